@@ -0,0 +1,739 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 * -*- */
+
+/* coap-bench -- load generator for measuring the throughput and latency of
+ *               CoAP servers
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <coap2/coap.h>
+
+#define BUFSIZE 1024
+#define MAX_KEY 64 /* Maximum length of a pre-shared key in bytes. */
+
+/* The token of each request: the slot index and the request generation */
+#define BENCH_TOKEN_LENGTH 8
+
+/* How often requests are checked for timing out, in microseconds */
+#define BENCH_SWEEP_US 100000
+
+typedef enum bench_method_t {
+  BENCH_GET,
+  BENCH_PUT,
+  BENCH_OBSERVE
+} bench_method_t;
+
+/*
+ * One request that may be outstanding.  Each session has the same number
+ * of slots, so the number of slots is the concurrency.
+ */
+typedef struct bench_slot_t {
+  coap_session_t *session;
+  uint64_t due;                    /* when the request was due, in us */
+  uint32_t gen;                    /* bumped for each request sent */
+  int busy;                        /* request outstanding */
+  int observing;                   /* observe relationship established */
+  struct bench_slot_t *next_free;  /* free list for the open loop */
+} bench_slot_t;
+
+static bench_slot_t *slots = NULL;
+static unsigned int slot_count = 0;
+static bench_slot_t *free_slots = NULL;
+
+/* Settings */
+static bench_method_t method = BENCH_GET;
+static uint8_t msgtype = COAP_MESSAGE_CON;
+static unsigned int session_count = 1;
+static unsigned int outstanding = 1;
+static unsigned int duration = 10;
+static double rate = 0;            /* requests/s for the open loop, or 0 */
+static unsigned int timeout_s = 5;
+static size_t payload_size = 32;
+static uint8_t *payload = NULL;
+static coap_optlist_t *optlist = NULL;
+static coap_uri_t uri;
+
+static char *cert_file = NULL;     /* Combined certificate and private key */
+static char *ca_file = NULL;       /* CA for cert_file */
+static uint8_t key[MAX_KEY];
+static ssize_t key_length = 0;
+static uint8_t user[MAX_KEY];
+static ssize_t user_length = -1;
+
+/* Results */
+static int running = 1;
+static uint64_t sent = 0;
+static uint64_t answered = 0;
+static uint64_t failed = 0;        /* 4.xx and 5.xx responses, RSTs, NACKs */
+static uint64_t timed_out = 0;
+static uint64_t not_sent = 0;      /* open loop, no slot free when due */
+static uint64_t notifications = 0;
+static coap_histogram_t latency;
+
+static int quit = 0;
+
+/* SIGINT handler: set quit to 1 for graceful termination */
+static void
+handle_sigint(int signum COAP_UNUSED) {
+  quit = 1;
+}
+
+static uint64_t
+bench_now(void) {
+  struct timespec tv;
+
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+static void
+slot_release(bench_slot_t *slot) {
+  slot->busy = 0;
+  if (rate > 0) {
+    slot->next_free = free_slots;
+    free_slots = slot;
+  }
+}
+
+static int
+slot_send(bench_slot_t *slot, uint64_t due) {
+  coap_pdu_t *pdu;
+  uint8_t token[BENCH_TOKEN_LENGTH];
+  uint8_t buf[4];
+  uint32_t index = (uint32_t)(slot - slots);
+
+  slot->gen++;
+  token[0] = (uint8_t)(index >> 24);
+  token[1] = (uint8_t)(index >> 16);
+  token[2] = (uint8_t)(index >> 8);
+  token[3] = (uint8_t)index;
+  token[4] = (uint8_t)(slot->gen >> 24);
+  token[5] = (uint8_t)(slot->gen >> 16);
+  token[6] = (uint8_t)(slot->gen >> 8);
+  token[7] = (uint8_t)slot->gen;
+
+  pdu = coap_pdu_init(msgtype,
+                      method == BENCH_PUT ? COAP_REQUEST_PUT :
+                                            COAP_REQUEST_GET,
+                      coap_new_message_id(slot->session),
+                      coap_session_max_pdu_size(slot->session));
+  if (!pdu)
+    goto fail;
+  if (!coap_add_token(pdu, sizeof(token), token))
+    goto error;
+  if (method == BENCH_OBSERVE &&
+      !coap_add_option(pdu, COAP_OPTION_OBSERVE,
+                          coap_encode_var_safe(buf, sizeof(buf),
+                                               COAP_OBSERVE_ESTABLISH), buf))
+    goto error;
+  /* Observe comes before any of the Uri options */
+  if (optlist && !coap_add_optlist_pdu(pdu, &optlist))
+    goto error;
+  if (method == BENCH_PUT && !coap_add_data(pdu, payload_size, payload))
+    goto error;
+
+  slot->due = due;
+  slot->busy = 1;
+  sent++;
+  if (coap_send(slot->session, pdu) == COAP_INVALID_MID)
+    goto fail;
+  return 1;
+
+error:
+  coap_delete_pdu(pdu);
+fail:
+  failed++;
+  slot_release(slot);
+  return 0;
+}
+
+/*
+ * Returns the slot that @p pdu is for, or NULL if it is for a request
+ * that is no longer outstanding.
+ */
+static bench_slot_t *
+slot_find(const coap_pdu_t *pdu) {
+  const uint8_t *t = pdu->token;
+  uint32_t index;
+  uint32_t gen;
+
+  if (pdu->token_length != BENCH_TOKEN_LENGTH)
+    return NULL;
+  index = (uint32_t)t[0] << 24 | (uint32_t)t[1] << 16 |
+          (uint32_t)t[2] << 8 | t[3];
+  gen = (uint32_t)t[4] << 24 | (uint32_t)t[5] << 16 |
+        (uint32_t)t[6] << 8 | t[7];
+  if (index >= slot_count || slots[index].gen != gen)
+    return NULL;
+  return &slots[index];
+}
+
+/* Ends the request of @p slot and, in the closed loop, sends the next one */
+static void
+slot_done(bench_slot_t *slot) {
+  slot_release(slot);
+  if (rate == 0 && running && method != BENCH_OBSERVE)
+    slot_send(slot, bench_now());
+}
+
+static coap_response_t
+message_handler(coap_context_t *ctx COAP_UNUSED,
+                coap_session_t *session COAP_UNUSED,
+                coap_pdu_t *sent_pdu COAP_UNUSED,
+                coap_pdu_t *received,
+                const coap_mid_t id COAP_UNUSED) {
+  bench_slot_t *slot = slot_find(received);
+
+  if (!slot)
+    return COAP_RESPONSE_OK;
+  if (slot->observing) {
+    notifications++;
+    return COAP_RESPONSE_OK;
+  }
+  if (!slot->busy)
+    return COAP_RESPONSE_OK;
+
+  coap_histogram_add(&latency, bench_now() - slot->due);
+  answered++;
+  if (received->type == COAP_MESSAGE_RST ||
+      COAP_RESPONSE_CLASS(received->code) > 2) {
+    failed++;
+  } else if (method == BENCH_OBSERVE) {
+    coap_opt_iterator_t opt_iter;
+
+    if (coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter))
+      slot->observing = 1;
+  }
+  slot_done(slot);
+  return COAP_RESPONSE_OK;
+}
+
+static void
+nack_handler(coap_context_t *context COAP_UNUSED,
+             coap_session_t *session COAP_UNUSED,
+             coap_pdu_t *sent_pdu,
+             coap_nack_reason_t reason COAP_UNUSED,
+             const coap_mid_t id COAP_UNUSED) {
+  bench_slot_t *slot = sent_pdu ? slot_find(sent_pdu) : NULL;
+
+  if (!slot || !slot->busy)
+    return;
+  failed++;
+  /*
+   * Not sent again until the next sweep, as a session that cannot connect
+   * fails each request straight away
+   */
+  slot_release(slot);
+}
+
+/*
+ * Gives up on the requests that have been outstanding for too long and, in
+ * the closed loop, sends again the requests that failed
+ */
+static void
+sweep_timeouts(uint64_t now) {
+  uint64_t limit = (uint64_t)timeout_s * 1000000;
+  unsigned int i;
+
+  for (i = 0; i < slot_count; i++) {
+    bench_slot_t *slot = &slots[i];
+
+    if (slot->busy && now - slot->due > limit) {
+      timed_out++;
+      /* Any late response no longer matches */
+      slot->gen++;
+      slot_done(slot);
+    } else if (!slot->busy && rate == 0 && method != BENCH_OBSERVE) {
+      slot_send(slot, now);
+    }
+  }
+}
+
+static int
+resolve_address(const coap_str_const_t *server, struct sockaddr *dst) {
+
+  struct addrinfo *res, *ainfo;
+  struct addrinfo hints;
+  static char addrstr[256];
+  int error, len=-1;
+
+  memset(addrstr, 0, sizeof(addrstr));
+  if (server->length)
+    memcpy(addrstr, server->s, server->length);
+  else
+    memcpy(addrstr, "localhost", 9);
+
+  memset ((char *)&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_UNSPEC;
+
+  error = getaddrinfo(addrstr, NULL, &hints, &res);
+
+  if (error != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+    return error;
+  }
+
+  for (ainfo = res; ainfo != NULL; ainfo = ainfo->ai_next) {
+    switch (ainfo->ai_family) {
+    case AF_INET6:
+    case AF_INET:
+      len = (int)ainfo->ai_addrlen;
+      memcpy(dst, ainfo->ai_addr, len);
+      goto finish;
+    default:
+      ;
+    }
+  }
+
+ finish:
+  freeaddrinfo(res);
+  return len;
+}
+
+static int
+cmdline_uri(char *arg) {
+  unsigned char portbuf[2];
+  unsigned char _buf[BUFSIZE];
+  unsigned char *buf = _buf;
+  size_t buflen;
+  int res;
+
+  if (coap_split_uri((unsigned char *)arg, strlen(arg), &uri) < 0) {
+    coap_log(LOG_ERR, "invalid CoAP URI\n");
+    return -1;
+  }
+  if (uri.scheme == COAP_URI_SCHEME_COAPS && !coap_dtls_is_supported()) {
+    coap_log(LOG_EMERG,
+             "coaps URI scheme not supported in this version of libcoap\n");
+    return -1;
+  }
+  if (uri.scheme == COAP_URI_SCHEME_COAPS_TCP && !coap_tls_is_supported()) {
+    coap_log(LOG_EMERG,
+             "coaps+tcp URI scheme not supported in this version of libcoap\n");
+    return -1;
+  }
+  if (uri.scheme == COAP_URI_SCHEME_COAP_TCP && !coap_tcp_is_supported()) {
+    coap_log(LOG_EMERG,
+             "coap+tcp URI scheme not supported in this version of libcoap\n");
+    return -1;
+  }
+
+  if (uri.port != (uri.scheme == COAP_URI_SCHEME_COAPS ||
+                   uri.scheme == COAP_URI_SCHEME_COAPS_TCP ?
+                   COAPS_DEFAULT_PORT : COAP_DEFAULT_PORT)) {
+    coap_insert_optlist(&optlist,
+                        coap_new_optlist(COAP_OPTION_URI_PORT,
+                                         coap_encode_var_safe(portbuf,
+                                                              sizeof(portbuf),
+                                                              uri.port),
+                                         portbuf));
+  }
+
+  if (uri.path.length) {
+    buflen = BUFSIZE;
+    res = coap_split_path(uri.path.s, uri.path.length, buf, &buflen);
+    while (res--) {
+      coap_insert_optlist(&optlist,
+                          coap_new_optlist(COAP_OPTION_URI_PATH,
+                                           coap_opt_length(buf),
+                                           coap_opt_value(buf)));
+      buf += coap_opt_size(buf);
+    }
+  }
+
+  if (uri.query.length) {
+    buflen = BUFSIZE;
+    buf = _buf;
+    res = coap_split_query(uri.query.s, uri.query.length, buf, &buflen);
+    while (res--) {
+      coap_insert_optlist(&optlist,
+                          coap_new_optlist(COAP_OPTION_URI_QUERY,
+                                           coap_opt_length(buf),
+                                           coap_opt_value(buf)));
+      buf += coap_opt_size(buf);
+    }
+  }
+  return 0;
+}
+
+static ssize_t
+cmdline_read_key(char *arg, unsigned char *buf, size_t maxlen) {
+  size_t len = strnlen(arg, maxlen);
+  if (len) {
+    memcpy(buf, arg, len);
+    return len;
+  }
+  return -1;
+}
+
+static coap_session_t *
+open_session(coap_context_t *ctx, coap_proto_t proto, coap_address_t *dst) {
+  if (proto == COAP_PROTO_DTLS || proto == COAP_PROTO_TLS) {
+    static char client_sni[256];
+
+    memset(client_sni, 0, sizeof(client_sni));
+    if (uri.host.length)
+      memcpy(client_sni, uri.host.s,
+             uri.host.length < sizeof(client_sni) ? uri.host.length :
+                                                    sizeof(client_sni) - 1);
+    else
+      memcpy(client_sni, "localhost", 9);
+
+    if (cert_file || !key_length) {
+      /* Setup PKI session */
+      coap_dtls_pki_t dtls_pki;
+
+      memset(&dtls_pki, 0, sizeof(dtls_pki));
+      dtls_pki.version = COAP_DTLS_PKI_SETUP_VERSION;
+      if (ca_file) {
+        dtls_pki.verify_peer_cert        = 1;
+        dtls_pki.check_common_ca         = 1;
+        dtls_pki.allow_self_signed       = 1;
+        dtls_pki.allow_expired_certs     = 1;
+        dtls_pki.cert_chain_validation   = 1;
+        dtls_pki.cert_chain_verify_depth = 2;
+        dtls_pki.check_cert_revocation   = 1;
+        dtls_pki.allow_no_crl            = 1;
+        dtls_pki.allow_expired_crl       = 1;
+      }
+      dtls_pki.client_sni = client_sni;
+      dtls_pki.pki_key.key_type = COAP_PKI_KEY_PEM;
+      dtls_pki.pki_key.key.pem.public_cert = cert_file;
+      dtls_pki.pki_key.key.pem.private_key = cert_file;
+      dtls_pki.pki_key.key.pem.ca_file = ca_file;
+      return coap_new_client_session_pki(ctx, NULL, dst, proto, &dtls_pki);
+    } else {
+      /* Setup PSK session */
+      coap_dtls_cpsk_t dtls_psk;
+
+      memset(&dtls_psk, 0, sizeof(dtls_psk));
+      dtls_psk.version = COAP_DTLS_CPSK_SETUP_VERSION;
+      dtls_psk.client_sni = client_sni;
+      dtls_psk.psk_info.identity.s = user_length >= 0 ? user : NULL;
+      dtls_psk.psk_info.identity.length =
+                                   user_length >= 0 ? (size_t)user_length : 0;
+      dtls_psk.psk_info.key.s = key;
+      dtls_psk.psk_info.key.length = (size_t)key_length;
+      return coap_new_client_session_psk2(ctx, NULL, dst, proto, &dtls_psk);
+    }
+  }
+  return coap_new_client_session(ctx, NULL, dst, proto);
+}
+
+static void
+report(coap_context_t *ctx, uint64_t elapsed) {
+  double seconds = elapsed / 1000000.0;
+  coap_counters_t counters;
+
+  coap_context_get_counters(ctx, &counters);
+  printf("%u sessions, %u outstanding requests, %s loop, %.2f s\n",
+         session_count, slot_count, rate > 0 ? "open" : "closed", seconds);
+  printf("requests:      %llu sent, %llu answered, %llu failed, "
+         "%llu timed out, %llu not sent\n",
+         (unsigned long long)sent, (unsigned long long)answered,
+         (unsigned long long)failed, (unsigned long long)timed_out,
+         (unsigned long long)not_sent);
+  printf("throughput:    %.1f req/s\n", answered / seconds);
+  if (method == BENCH_OBSERVE)
+    printf("notifications: %llu (%.1f/s)\n",
+           (unsigned long long)notifications, notifications / seconds);
+  if (latency.count)
+    printf("latency (us):  min %llu, p50 %llu, p99 %llu, p99.9 %llu, "
+           "max %llu\n",
+           (unsigned long long)latency.min,
+           (unsigned long long)coap_histogram_percentile(&latency, 50),
+           (unsigned long long)coap_histogram_percentile(&latency, 99),
+           (unsigned long long)coap_histogram_percentile(&latency, 99.9),
+           (unsigned long long)latency.max);
+  printf("traffic:       %llu PDUs sent, %llu received, "
+         "%llu retransmitted\n",
+         (unsigned long long)counters.tx_pdus,
+         (unsigned long long)counters.rx_pdus,
+         (unsigned long long)counters.retransmits);
+}
+
+static void
+usage(const char *program, const char *version) {
+  const char *p;
+  char buffer[72];
+  const char *lib_version = coap_package_version();
+
+  p = strrchr( program, '/' );
+  if ( p )
+    program = ++p;
+
+  fprintf( stderr, "%s v%s -- CoAP load generator\n"
+     "(c) 2021 The libcoap project\n\n"
+     "%s\n"
+     "%s\n"
+    , program, version, lib_version,
+    coap_string_tls_version(buffer, sizeof(buffer)));
+  fprintf(stderr, "\n"
+     "Usage: %s [-d seconds] [-m method] [-n sessions] [-o num] [-r rate]\n"
+     "\t\t[-s size] [-t seconds] [-v num] [-N]\n"
+     "\t\t[[-k key] [-u user]] [[-c certfile] [-C cafile]] URI\n"
+     "\tURI can be an absolute URI or a URI prefixed with scheme and host\n\n"
+     "General Options\n"
+     "\t-d seconds\tHow long to run for (default 10)\n"
+     "\t-m method\tget, put or observe (default get). With observe,\n"
+     "\t       \t\teach session registers once and the notifications\n"
+     "\t       \t\tare counted\n"
+     "\t-n sessions\tNumber of sessions to open (default 1)\n"
+     "\t-o num \t\tOutstanding requests per session (default 1)\n"
+     "\t-r rate\t\tSend rate requests per second in all (open loop),\n"
+     "\t       \t\tinstead of sending the next request of a session as\n"
+     "\t       \t\tsoon as one is answered (closed loop)\n"
+     "\t-s size\t\tSize of the payload of a PUT (default 32)\n"
+     "\t-t seconds\tTime after which a request that is not answered\n"
+     "\t       \t\tcounts as timed out (default 5)\n"
+     "\t-v num \t\tVerbosity level (default 3, maximum is 9)\n"
+     "\t-N     \t\tSend NON-confirmable requests\n"
+     "PSK Options (if supported by underlying (D)TLS library)\n"
+     "\t-k key \t\tPre-shared key for the specified user identity\n"
+     "\t-u user\t\tUser identity to send for pre-shared key mode\n"
+     "PKI Options (if supported by underlying (D)TLS library)\n"
+     "\t-c certfile\tPEM file with the certificate and private key\n"
+     "\t-C cafile\tPEM file with the CA that signed the server\n"
+     "\t       \t\tcertificate, which is then checked\n"
+     "Examples:\n"
+     "\tcoap-bench -n 8 -o 4 coap://[::1]/\n"
+     "\tcoap-bench -r 10000 -o 64 -N coap://[::1]/time\n"
+     "\tcoap-bench -m put -s 512 -k secret -u user coaps://[::1]/example\n"
+    , program);
+}
+
+int
+main(int argc, char **argv) {
+  coap_context_t *ctx = NULL;
+  coap_address_t dst;
+  coap_proto_t proto;
+  coap_log_t log_level = LOG_WARNING;
+  struct sigaction sa;
+  uint64_t start, now, end, next_due, interval = 0;
+  uint64_t next_sweep;
+  unsigned int i;
+  int opt, res;
+  int result = 1;
+
+  while ((opt = getopt(argc, argv, "c:d:k:m:n:o:r:s:t:u:v:C:N")) != -1) {
+    switch (opt) {
+    case 'c':
+      cert_file = optarg;
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'k':
+      key_length = cmdline_read_key(optarg, key, MAX_KEY);
+      break;
+    case 'm':
+      if (strcasecmp(optarg, "get") == 0)
+        method = BENCH_GET;
+      else if (strcasecmp(optarg, "put") == 0)
+        method = BENCH_PUT;
+      else if (strcasecmp(optarg, "observe") == 0)
+        method = BENCH_OBSERVE;
+      else {
+        usage(argv[0], LIBCOAP_PACKAGE_VERSION);
+        exit(1);
+      }
+      break;
+    case 'n':
+      session_count = atoi(optarg);
+      break;
+    case 'o':
+      outstanding = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 's':
+      payload_size = atoi(optarg);
+      break;
+    case 't':
+      timeout_s = atoi(optarg);
+      break;
+    case 'u':
+      user_length = cmdline_read_key(optarg, user, MAX_KEY);
+      break;
+    case 'v':
+      log_level = strtol(optarg, NULL, 10);
+      break;
+    case 'C':
+      ca_file = optarg;
+      break;
+    case 'N':
+      msgtype = COAP_MESSAGE_NON;
+      break;
+    default:
+      usage(argv[0], LIBCOAP_PACKAGE_VERSION);
+      exit(1);
+    }
+  }
+
+  if (optind >= argc || !session_count || !outstanding || !duration ||
+      rate < 0) {
+    usage(argv[0], LIBCOAP_PACKAGE_VERSION);
+    exit(1);
+  }
+
+  coap_startup();
+  coap_dtls_set_log_level(log_level);
+  coap_set_log_level(log_level);
+
+  if (cmdline_uri(argv[optind]) < 0)
+    goto finish;
+  if (key_length < 0) {
+    coap_log(LOG_CRIT, "Invalid pre-shared key specified\n");
+    goto finish;
+  }
+
+  coap_address_init(&dst);
+  res = resolve_address(&uri.host, &dst.addr.sa);
+  if (res < 0) {
+    fprintf(stderr, "failed to resolve address\n");
+    goto finish;
+  }
+  dst.size = res;
+  dst.addr.sin.sin_port = htons(uri.port);
+  proto = uri.scheme == COAP_URI_SCHEME_COAP_TCP ? COAP_PROTO_TCP :
+          uri.scheme == COAP_URI_SCHEME_COAPS_TCP ? COAP_PROTO_TLS :
+          uri.scheme == COAP_URI_SCHEME_COAPS ? COAP_PROTO_DTLS :
+                                                COAP_PROTO_UDP;
+
+  ctx = coap_new_context(NULL);
+  if (!ctx) {
+    coap_log(LOG_EMERG, "cannot create context\n");
+    goto finish;
+  }
+  /* The requests are timed by coap-bench itself */
+  coap_context_set_trace(ctx, 0, 0);
+  coap_register_response_handler(ctx, message_handler);
+  coap_register_nack_handler(ctx, nack_handler);
+
+  payload = coap_malloc(payload_size ? payload_size : 1);
+  slot_count = session_count * outstanding;
+  slots = coap_malloc(slot_count * sizeof(bench_slot_t));
+  if (!payload || !slots) {
+    coap_log(LOG_EMERG, "cannot allocate memory\n");
+    goto finish;
+  }
+  memset(payload, 'x', payload_size);
+  memset(slots, 0, slot_count * sizeof(bench_slot_t));
+  memset(&latency, 0, sizeof(latency));
+  latency.min = UINT64_MAX;
+
+  for (i = 0; i < session_count; i++) {
+    coap_session_t *session = open_session(ctx, proto, &dst);
+    unsigned int j;
+
+    if (!session) {
+      coap_log(LOG_EMERG, "cannot create client session\n");
+      goto finish;
+    }
+    for (j = 0; j < outstanding; j++)
+      slots[i * outstanding + j].session = session;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = handle_sigint;
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  /* So we do not exit on a SIGPIPE */
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  start = bench_now();
+  end = start + (uint64_t)duration * 1000000;
+  next_due = start;
+  next_sweep = start + BENCH_SWEEP_US;
+  if (rate > 0 && method != BENCH_OBSERVE) {
+    interval = (uint64_t)(1000000 / rate);
+    if (!interval)
+      interval = 1;
+    /* Interleave the sessions on the free list */
+    for (i = slot_count; i-- > 0; ) {
+      bench_slot_t *slot = &slots[(i % session_count) * outstanding +
+                                  i / session_count];
+      slot->next_free = free_slots;
+      free_slots = slot;
+    }
+  } else {
+    for (i = 0; i < slot_count; i++) {
+      /* A server keeps a single observation per session and resource */
+      if (method == BENCH_OBSERVE && i % outstanding)
+        continue;
+      slot_send(&slots[i], start);
+    }
+  }
+
+  while (!quit) {
+    uint32_t wait_ms;
+
+    now = bench_now();
+    if (now >= end)
+      break;
+    if (interval) {
+      /*
+       * Latency is measured from when a request was due, so that a server
+       * that stalls is not let off by requests not being sent meanwhile.
+       */
+      while (next_due <= now) {
+        bench_slot_t *slot = free_slots;
+
+        if (slot) {
+          free_slots = slot->next_free;
+          slot_send(slot, next_due);
+        } else {
+          not_sent++;
+        }
+        next_due += interval;
+      }
+    }
+    if (now >= next_sweep) {
+      sweep_timeouts(now);
+      next_sweep = now + BENCH_SWEEP_US;
+    }
+
+    wait_ms = (uint32_t)((next_sweep - now) / 1000);
+    if (interval && next_due - now < (uint64_t)wait_ms * 1000)
+      wait_ms = (uint32_t)((next_due - now) / 1000);
+    if ((end - now) / 1000 < wait_ms)
+      wait_ms = (uint32_t)((end - now) / 1000);
+    if (coap_io_process(ctx, wait_ms ? wait_ms : COAP_IO_NO_WAIT) < 0)
+      break;
+  }
+  running = 0;
+
+  report(ctx, bench_now() - start);
+  result = 0;
+
+ finish:
+  for (i = 0; slots && i < session_count; i++)
+    coap_session_release(slots[i * outstanding].session);
+  coap_free_context(ctx);
+  coap_free(slots);
+  coap_free(payload);
+  coap_delete_optlist(optlist);
+  coap_cleanup();
+
+  return result;
+}
@@ -0,0 +1,118 @@
+/* coap-coro -- C++20 coroutines with libcoap
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/*
+ * Serves /hello, and /relay which fetches /hello from the same server
+ * before it answers, on 127.0.0.1 and the port given (5683 by default),
+ * then fetches /relay itself and prints the response.
+ * It is built whenever the compiler supports C++20 coroutines, so that
+ * coap2/coap_coro.hpp is compiled as well as run.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <coap2/coap_coro.hpp>
+
+static coap::session *upstream;
+static bool done;
+static int status = 1;
+
+static coap::handler
+hnd_get_hello(coap::exchange ex) {
+  coap_pdu_t *response = ex.response();
+  static const char hello[] = "Hello World!";
+
+  response->code = COAP_RESPONSE_CODE(205);
+  coap_add_data(response, sizeof(hello) - 1,
+                reinterpret_cast<const uint8_t *>(hello));
+  co_return;
+}
+
+static coap::handler
+hnd_get_relay(coap::exchange ex) {
+  coap::response r = co_await upstream->get("hello");
+  coap_pdu_t *response = ex.response();
+
+  if (response) {
+    response->code = r.ok() ? r.code() : COAP_RESPONSE_CODE(504);
+    coap_add_data(response, r.body().size(),
+                  reinterpret_cast<const uint8_t *>(r.body().data()));
+  }
+}
+
+static coap::task
+fetch(coap::session s) {
+  coap::response r = co_await s.get("relay");
+
+  if (r.ok()) {
+    std::string_view body = r.body();
+
+    std::printf("%d.%02d %.*s\n", COAP_RESPONSE_CLASS(r.code()),
+                r.code() & 0x1f, static_cast<int>(body.size()), body.data());
+    if (r.code() == COAP_RESPONSE_CODE(205) && body == "Hello World!")
+      status = 0;
+  } else {
+    std::printf("no response\n");
+  }
+  done = true;
+}
+
+int
+main(int argc, char *argv[]) {
+  coap_context_t *ctx;
+  coap_endpoint_t *ep;
+  coap_resource_t *r;
+  coap_session_t *session;
+  coap_address_t addr;
+  int n;
+
+  coap_startup();
+  ctx = coap_new_context(nullptr);
+  if (!ctx)
+    return 1;
+  coap_context_set_block_mode(ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = htons(argc > 1 ? std::atoi(argv[1]) :
+                                            COAP_DEFAULT_PORT);
+  ep = coap_new_endpoint(ctx, &addr, COAP_PROTO_UDP);
+  if (!ep)
+    goto finish;
+
+  r = coap_resource_init(coap_make_str_const("hello"), 0);
+  coap::register_handler<hnd_get_hello>(r, COAP_REQUEST_GET);
+  coap_add_resource(ctx, r);
+  r = coap_resource_init(coap_make_str_const("relay"), 0);
+  coap::register_handler<hnd_get_relay>(r, COAP_REQUEST_GET);
+  coap_add_resource(ctx, r);
+
+  /* The server sends its requests to itself as well */
+  session = coap_new_client_session(ctx, nullptr, &addr, COAP_PROTO_UDP);
+  if (!session)
+    goto finish;
+  {
+    coap::session s(session, 5000);
+
+    upstream = &s;
+    fetch(s);
+    for (n = 0; n < 100 && !done; n++)
+      coap_io_process(ctx, 100);
+  }
+
+finish:
+  coap_free_context(ctx);
+  coap_cleanup();
+  return status;
+}
@@ -47,6 +47,9 @@
 
 #define RD_ROOT_STR   "rd"
 #define RD_ROOT_SIZE  2
+#define RD_LOOKUP_EP_STR "rd-lookup/ep"
+
+#define LOCSIZE 68
 
 static char *cert_file = NULL; /* Combined certificate and private key in PEM */
 static char *ca_file = NULL;   /* CA for cert_file - for cert checking in PEM */
@@ -62,17 +65,63 @@ static const char *hint = "CoAP";
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-typedef struct rd_t {
-  UT_hash_handle hh;      /**< hash handle (for internal use only) */
-  coap_string_t uri_path; /**< the actual key for this resource */
+/* Lifetime of a registration if the endpoint does not give one (RFC 9176) */
+#define RD_DEFAULT_LIFETIME 90000
+#define RD_MIN_LIFETIME     60
+
+/*
+ * The registrations expire from a wheel of one slot per second.  Those that
+ * expire further away than a turn of the wheel stay in their slot until the
+ * turn in which they do.
+ */
+#define RD_WHEEL_SLOTS 4096
+
+typedef struct rd_t rd_t;
+
+/* The attributes of a registration that lookups are indexed by */
+typedef enum rd_attr_t {
+  RD_ATTR_EP,             /* endpoint name */
+  RD_ATTR_D,              /* sector (domain) */
+  RD_ATTR_RT,             /* resource type */
+  RD_ATTR_COUNT
+} rd_attr_t;
+
+static const char *rd_attr_name[RD_ATTR_COUNT] = { "ep", "d", "rt" };
+
+/* The lists a registration is on: those of its attribute values and the
+ * slot of the wheel */
+#define RD_LINK_WHEEL RD_ATTR_COUNT
+#define RD_LINK_COUNT (RD_ATTR_COUNT + 1)
+
+/* The registrations that share a value of an indexed attribute */
+typedef struct rd_index_t {
+  UT_hash_handle hh;      /**< hash handle of the value */
+  rd_t *head;             /**< the registrations with the value */
+  size_t count;           /**< the number of registrations with the value */
+  coap_str_const_t value; /**< the value, kept after this structure */
+} rd_index_t;
+
+struct rd_t {
+  coap_resource_t *resource; /**< the registration resource */
+
+  struct {
+    rd_index_t *index;    /**< the value of the attribute or NULL */
+    rd_t *next;
+    rd_t *prev;
+  } link[RD_LINK_COUNT];  /**< the attribute indexes, then the wheel */
+
+  uint32_t lifetime;      /**< lifetime in seconds */
+  coap_tick_t expires;    /**< second at which the registration expires */
 
   size_t etag_len;        /**< actual length of @c etag */
   unsigned char etag[8];  /**< ETag for current description */
 
   coap_string_t data;     /**< points to the resource description  */
-} rd_t;
+};
 
-rd_t *resources = NULL;
+static rd_index_t *rd_index[RD_ATTR_COUNT];
+static rd_t *rd_wheel[RD_WHEEL_SLOTS];
+static coap_tick_t rd_wheel_now;      /* the last second that has expired */
 
 static ssize_t
 cmdline_read_key(char *arg, unsigned char *buf, size_t maxlen) {
@@ -84,6 +133,113 @@ cmdline_read_key(char *arg, unsigned char *buf, size_t maxlen) {
   return -1;
 }
 
+static coap_tick_t
+rd_seconds(void) {
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  return now / COAP_TICKS_PER_SECOND;
+}
+
+static void
+rd_list_add(rd_t **head, rd_t *rd, int list) {
+  rd->link[list].prev = NULL;
+  rd->link[list].next = *head;
+  if (*head)
+    (*head)->link[list].prev = rd;
+  *head = rd;
+}
+
+static void
+rd_list_remove(rd_t **head, rd_t *rd, int list) {
+  if (rd->link[list].prev)
+    rd->link[list].prev->link[list].next = rd->link[list].next;
+  else
+    *head = rd->link[list].next;
+  if (rd->link[list].next)
+    rd->link[list].next->link[list].prev = rd->link[list].prev;
+}
+
+static rd_index_t *
+rd_index_find(rd_attr_t attr, const uint8_t *s, size_t length) {
+  rd_index_t *index;
+
+  HASH_FIND(hh, rd_index[attr], s, length, index);
+  return index;
+}
+
+/* Files @p rd under @p value of @p attr, or under none if @p value is
+ * empty */
+static int
+rd_index_set(rd_t *rd, rd_attr_t attr, const uint8_t *s, size_t length) {
+  rd_index_t *index = rd->link[attr].index;
+
+  if (index) {
+    if (index->value.length == length && memcmp(index->value.s, s, length) == 0)
+      return 1;
+    rd_list_remove(&index->head, rd, attr);
+    rd->link[attr].index = NULL;
+    if (--index->count == 0) {
+      HASH_DELETE(hh, rd_index[attr], index);
+      coap_free(index);
+    }
+  }
+  if (!length)
+    return 1;
+
+  index = rd_index_find(attr, s, length);
+  if (!index) {
+    index = (rd_index_t *)coap_malloc(sizeof(rd_index_t) + length);
+    if (!index)
+      return 0;
+    memset(index, 0, sizeof(rd_index_t));
+    memcpy(index + 1, s, length);
+    index->value.s = (const uint8_t *)(index + 1);
+    index->value.length = length;
+    HASH_ADD_KEYPTR(hh, rd_index[attr], index->value.s, length, index);
+  }
+  rd_list_add(&index->head, rd, attr);
+  rd->link[attr].index = index;
+  index->count++;
+  return 1;
+}
+
+/* (Re-)starts the lifetime of @p rd */
+static void
+rd_wheel_set(rd_t *rd, uint32_t lifetime) {
+  if (rd->expires)
+    rd_list_remove(&rd_wheel[rd->expires % RD_WHEEL_SLOTS], rd,
+                   RD_LINK_WHEEL);
+  rd->lifetime = lifetime;
+  rd->expires = rd_seconds() + lifetime;
+  rd_list_add(&rd_wheel[rd->expires % RD_WHEEL_SLOTS], rd, RD_LINK_WHEEL);
+}
+
+/* Deletes the registrations whose lifetime has run out */
+static void
+rd_wheel_expire(coap_context_t *ctx) {
+  coap_tick_t now = rd_seconds();
+  coap_tick_t slots = now - rd_wheel_now;
+
+  if (slots > RD_WHEEL_SLOTS)
+    slots = RD_WHEEL_SLOTS;
+  while (slots--) {
+    rd_t *rd, *tmp;
+
+    for (rd = rd_wheel[++rd_wheel_now % RD_WHEEL_SLOTS]; rd; rd = tmp) {
+      tmp = rd->link[RD_LINK_WHEEL].next;
+      if (rd->expires <= now) {
+        if (rd->link[RD_ATTR_EP].index)
+          coap_log(LOG_INFO, "registration %.*s has expired\n",
+                   (int)coap_resource_get_uri_path(rd->resource)->length,
+                   coap_resource_get_uri_path(rd->resource)->s);
+        coap_delete_resource(ctx, rd->resource);
+      }
+    }
+  }
+  rd_wheel_now = now;
+}
+
 static inline rd_t *
 rd_new(void) {
   rd_t *rd;
@@ -97,11 +253,33 @@ rd_new(void) {
 static inline void
 rd_delete(rd_t *rd) {
   if (rd) {
+    int attr;
+
+    for (attr = 0; attr < RD_ATTR_COUNT; attr++)
+      rd_index_set(rd, attr, NULL, 0);
+    if (rd->expires)
+      rd_list_remove(&rd_wheel[rd->expires % RD_WHEEL_SLOTS], rd,
+                     RD_LINK_WHEEL);
     coap_free(rd->data.s);
     coap_free(rd);
   }
 }
 
+/* Returns the registration of @p resource, unless it has been deleted */
+static rd_t *
+rd_get(coap_resource_t *resource) {
+  rd_t *rd = (rd_t *)coap_resource_get_userdata(resource);
+
+  /* Only deleted registrations have no endpoint name */
+  return rd && rd->link[RD_ATTR_EP].index ? rd : NULL;
+}
+
+/* Called when a registration resource is deleted */
+static void
+rd_release(void *user_data) {
+  rd_delete((rd_t *)user_data);
+}
+
 static int quit = 0;
 
 /* SIGINT handler: set quit to 1 for graceful termination */
@@ -118,13 +296,13 @@ hnd_get_resource(coap_context_t  *ctx COAP_UNUSED,
                  coap_binary_t *token COAP_UNUSED,
                  coap_string_t *query COAP_UNUSED,
                  coap_pdu_t *response) {
-  rd_t *rd = NULL;
+  rd_t *rd = rd_get(resource);
   unsigned char buf[3];
-  coap_str_const_t* uri_path = coap_resource_get_uri_path(resource);
-
-  if (uri_path)
-    HASH_FIND(hh, resources, uri_path->s, uri_path->length, rd);
 
+  if (!rd) {
+    response->code = COAP_RESPONSE_CODE_NOT_FOUND;
+    return;
+  }
   response->code = COAP_RESPONSE_CODE_CONTENT;
 
   coap_add_option(response,
@@ -133,10 +311,10 @@ hnd_get_resource(coap_context_t  *ctx COAP_UNUSED,
                                        COAP_MEDIATYPE_APPLICATION_LINK_FORMAT),
                                        buf);
 
-  if (rd && rd->etag_len)
+  if (rd->etag_len)
     coap_add_option(response, COAP_OPTION_ETAG, rd->etag_len, rd->etag);
 
-  if (rd && rd->data.s)
+  if (rd->data.s)
     coap_add_data(response, rd->data.length, rd->data.s);
 }
 
@@ -220,25 +398,28 @@ hnd_put_resource(coap_context_t  *ctx COAP_UNUSED,
 }
 
 static void
-hnd_delete_resource(coap_context_t  *ctx,
+hnd_delete_resource(coap_context_t  *ctx COAP_UNUSED,
                     coap_resource_t *resource,
                     coap_session_t *session COAP_UNUSED,
                     coap_pdu_t *request COAP_UNUSED,
                     coap_binary_t *token COAP_UNUSED,
                     coap_string_t *query COAP_UNUSED,
                     coap_pdu_t *response) {
-  rd_t *rd = NULL;
-  coap_str_const_t* uri_path = coap_resource_get_uri_path(resource);
+  rd_t *rd = rd_get(resource);
+  int attr;
 
-  if (uri_path)
-    HASH_FIND(hh, resources, uri_path->s, uri_path->length, rd);
-  if (rd) {
-    HASH_DELETE(hh, resources, rd);
-    rd_delete(rd);
+  if (!rd) {
+    response->code = COAP_RESPONSE_CODE_NOT_FOUND;
+    return;
   }
-  /* FIXME: link attributes for resource have been created dynamically
-   * using coap_malloc() and must be released. */
-  coap_delete_resource(ctx, resource);
+  /*
+   * The resource cannot be deleted while its handler is running, so the
+   * registration is taken out of the indexes now and expires in a second.
+   * It is then released by rd_release().
+   */
+  for (attr = 0; attr < RD_ATTR_COUNT; attr++)
+    rd_index_set(rd, attr, NULL, 0);
+  rd_wheel_set(rd, 1);
 
   response->code = COAP_RESPONSE_CODE_DELETED;
 }
@@ -371,32 +552,53 @@ add_source_address(coap_resource_t *resource,
   coap_add_attr(resource,
                 coap_make_str_const("A"),
                 &attr_val,
-                COAP_ATTR_FLAGS_RELEASE_VALUE);
+                0);
+  coap_free(buf);
 #undef BUFSIZE
 }
 
-static rd_t *
-make_rd(coap_pdu_t *pdu) {
-  rd_t *rd;
+/* Parses the lifetime in @p lt, or gives the default if there is none */
+static int
+parse_lifetime(const coap_string_t *lt, uint32_t *lifetime) {
+  uint64_t value = 0;
+  size_t i;
+
+  if (!lt->length) {
+    *lifetime = RD_DEFAULT_LIFETIME;
+    return 1;
+  }
+  for (i = 0; i < lt->length; i++) {
+    if (!isdigit(lt->s[i]))
+      return 0;
+    value = value * 10 + (lt->s[i] - '0');
+    if (value > 0xffffffff)
+      return 0;
+  }
+  if (value < RD_MIN_LIFETIME)
+    return 0;
+  *lifetime = (uint32_t)value;
+  return 1;
+}
+
+/* Takes the links and the ETag of the registration from @p pdu */
+static int
+rd_set_links(rd_t *rd, coap_pdu_t *pdu) {
   unsigned char *data;
+  size_t length;
   coap_opt_iterator_t opt_iter;
   coap_opt_t *etag;
 
-  rd = rd_new();
+  if (coap_get_data(pdu, &length, &data)) {
+    unsigned char *s = (unsigned char *)coap_malloc(length);
 
-  if (!rd) {
-    coap_log(LOG_DEBUG, "hnd_get_rd: cannot allocate storage for rd\n");
-    return NULL;
-  }
-
-  if (coap_get_data(pdu, &rd->data.length, &data)) {
-    rd->data.s = (unsigned char *)coap_malloc(rd->data.length);
-    if (!rd->data.s) {
-      coap_log(LOG_DEBUG, "hnd_get_rd: cannot allocate storage for rd->data\n");
-      rd_delete(rd);
-      return NULL;
+    if (!s) {
+      coap_log(LOG_DEBUG, "hnd_post_rd: cannot allocate storage for rd->data\n");
+      return 0;
     }
-    memcpy(rd->data.s, data, rd->data.length);
+    memcpy(s, data, length);
+    coap_free(rd->data.s);
+    rd->data.s = s;
+    rd->data.length = length;
   }
 
   etag = coap_check_option(pdu, COAP_OPTION_ETAG, &opt_iter);
@@ -405,7 +607,76 @@ make_rd(coap_pdu_t *pdu) {
     memcpy(rd->etag, coap_opt_value(etag), rd->etag_len);
   }
 
-  return rd;
+  return 1;
+}
+
+/* Returns the registration of endpoint @p ep in sector @p d */
+static rd_t *
+rd_find(const coap_string_t *ep, const coap_string_t *d) {
+  rd_index_t *index = rd_index_find(RD_ATTR_EP, ep->s, ep->length);
+  rd_t *rd;
+
+  if (!index)
+    return NULL;
+  for (rd = index->head; rd; rd = rd->link[RD_ATTR_EP].next) {
+    rd_index_t *sector = rd->link[RD_ATTR_D].index;
+
+    if (sector ? sector->value.length == d->length &&
+                 memcmp(sector->value.s, d->s, d->length) == 0 :
+                 d->length == 0)
+      return rd;
+  }
+  return NULL;
+}
+
+static void
+add_location(coap_pdu_t *response, const uint8_t *loc, size_t loc_size) {
+  /* split path into segments and add Location-Path options */
+  unsigned char _b[LOCSIZE];
+  unsigned char *b = _b;
+  size_t buflen = sizeof(_b);
+  int nseg;
+
+  nseg = coap_split_path(loc, loc_size, b, &buflen);
+  while (nseg--) {
+    coap_add_option(response,
+                    COAP_OPTION_LOCATION_PATH,
+                    coap_opt_length(b),
+                    coap_opt_value(b));
+    b += coap_opt_size(b);
+  }
+}
+
+/* Registration update: restarts the lifetime of the registration */
+static void
+hnd_post_resource(coap_context_t  *ctx COAP_UNUSED,
+                  coap_resource_t *resource,
+                  coap_session_t *session COAP_UNUSED,
+                  coap_pdu_t *request,
+                  coap_binary_t *token COAP_UNUSED,
+                  coap_string_t *query,
+                  coap_pdu_t *response) {
+  rd_t *rd = rd_get(resource);
+  coap_string_t lt = {0, NULL};
+  uint32_t lifetime;
+
+  if (!rd) {
+    response->code = COAP_RESPONSE_CODE_NOT_FOUND;
+    return;
+  }
+  lifetime = rd->lifetime;
+  if (query &&
+      parse_param((const uint8_t *)"lt", 2, query->s, query->length, &lt) &&
+      !parse_lifetime(&lt, &lifetime)) {
+    response->code = COAP_RESPONSE_CODE_BAD_REQUEST;
+    return;
+  }
+  if (!rd_set_links(rd, request)) {
+    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return;
+  }
+  rd_wheel_set(rd, lifetime);
+  response->code = COAP_RESPONSE_CODE_CHANGED;
 }
 
 static void
@@ -414,38 +685,59 @@ hnd_post_rd(coap_context_t  *ctx,
             coap_session_t *session,
             coap_pdu_t *request,
             coap_binary_t *token COAP_UNUSED,
-            coap_string_t *query COAP_UNUSED,
+            coap_string_t *query,
             coap_pdu_t *response) {
   coap_resource_t *r;
-#define LOCSIZE 68
-  unsigned char *loc;
+  unsigned char loc[LOCSIZE];
   size_t loc_size;
-  coap_string_t h = {0, NULL}, ins = {0, NULL}, rt = {0, NULL}, lt = {0, NULL}; /* store query parameters */
+  coap_string_t ep = {0, NULL}, d = {0, NULL}, ins = {0, NULL}, rt = {0, NULL}, lt = {0, NULL}; /* store query parameters */
   unsigned char *buf;
   coap_str_const_t attr_val;
   coap_str_const_t resource_val;
-
-  loc = (unsigned char *)coap_malloc(LOCSIZE);
-  if (!loc) {
-    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
-    return;
-  }
-  memcpy(loc, RD_ROOT_STR, RD_ROOT_SIZE);
-
-  loc_size = RD_ROOT_SIZE;
-  loc[loc_size++] = '/';
+  uint32_t lifetime;
+  rd_t *rd;
 
   /* store query parameters for later use */
   if (query) {
-    parse_param((const uint8_t *)"h", 1, query->s, query->length, &h);
+    if (!parse_param((const uint8_t *)"ep", 2, query->s, query->length, &ep))
+      parse_param((const uint8_t *)"h", 1, query->s, query->length, &ep);
+    parse_param((const uint8_t *)"d", 1, query->s, query->length, &d);
     parse_param((const uint8_t *)"ins", 3, query->s, query->length, &ins);
     parse_param((const uint8_t *)"lt", 2, query->s, query->length, &lt);
     parse_param((const uint8_t *)"rt", 2, query->s, query->length, &rt);
   }
 
-  if (h.length) {   /* client has specified a node name */
-    memcpy(loc + loc_size, h.s, min(h.length, LOCSIZE - loc_size - 1));
-    loc_size += min(h.length, LOCSIZE - loc_size - 1);
+  if (!parse_lifetime(&lt, &lifetime)) {
+    response->code = COAP_RESPONSE_CODE_BAD_REQUEST;
+    return;
+  }
+
+  if (ep.length) {
+    rd = rd_find(&ep, &d);
+    if (rd) {
+      /* The endpoint registers again: update its registration */
+      coap_str_const_t *uri_path = coap_resource_get_uri_path(rd->resource);
+
+      if (!rd_set_links(rd, request) ||
+          !rd_index_set(rd, RD_ATTR_RT, rt.s, rt.length)) {
+        response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+        return;
+      }
+      rd_wheel_set(rd, lifetime);
+      response->code = COAP_RESPONSE_CODE_CREATED;
+      add_location(response, uri_path->s, uri_path->length);
+      return;
+    }
+  }
+
+  memcpy(loc, RD_ROOT_STR, RD_ROOT_SIZE);
+
+  loc_size = RD_ROOT_SIZE;
+  loc[loc_size++] = '/';
+
+  if (ep.length) {   /* client has specified a node name */
+    memcpy(loc + loc_size, ep.s, min(ep.length, LOCSIZE - loc_size - 1));
+    loc_size += min(ep.length, LOCSIZE - loc_size - 1);
 
     if (ins.length && loc_size > 1) {
       loc[loc_size++] = '-';
@@ -478,16 +770,38 @@ hnd_post_rd(coap_context_t  *ctx,
     }
   }
 
-  /* TODO:
-   *   - use lt to check expiration
-   */
-
   resource_val.s = loc;
   resource_val.length = loc_size;
-  r = coap_resource_init(&resource_val, COAP_RESOURCE_FLAGS_RELEASE_URI);
+  if (coap_get_resource_from_uri_path(ctx, &resource_val)) {
+    /* The same endpoint name in another sector */
+    static unsigned int instance = 0;
+
+    loc_size = min(loc_size, LOCSIZE - 10);
+    loc_size += snprintf((char *)(loc + loc_size), LOCSIZE - loc_size,
+                         "-%x", ++instance);
+    resource_val.length = loc_size;
+  }
+
+  rd = rd_new();
+  if (!rd || !rd_set_links(rd, request)) {
+    coap_log(LOG_DEBUG, "hnd_post_rd: cannot allocate storage for rd\n");
+    rd_delete(rd);
+    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return;
+  }
+
+  r = coap_resource_init(&resource_val, 0);
+  if (!r) {
+    rd_delete(rd);
+    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return;
+  }
   coap_register_handler(r, COAP_REQUEST_GET, hnd_get_resource);
+  coap_register_handler(r, COAP_REQUEST_POST, hnd_post_resource);
   coap_register_handler(r, COAP_REQUEST_PUT, hnd_put_resource);
   coap_register_handler(r, COAP_REQUEST_DELETE, hnd_delete_resource);
+  coap_resource_set_userdata(r, rd);
+  rd->resource = r;
 
   if (ins.s) {
     buf = (unsigned char *)coap_malloc(ins.length + 2);
@@ -501,7 +815,8 @@ hnd_post_rd(coap_context_t  *ctx,
       coap_add_attr(r,
                     coap_make_str_const("ins"),
                     &attr_val,
-                    COAP_ATTR_FLAGS_RELEASE_VALUE);
+                    0);
+      coap_free(buf);
     }
   }
 
@@ -517,46 +832,198 @@ hnd_post_rd(coap_context_t  *ctx,
       coap_add_attr(r,
                     coap_make_str_const("rt"),
                     &attr_val,
-                    COAP_ATTR_FLAGS_RELEASE_VALUE);
+                    0);
+      coap_free(buf);
     }
   }
 
   add_source_address(r, &session->addr_info.remote);
 
-  {
-    rd_t *rd;
-    rd = make_rd(request);
-    if (rd) {
-      rd->uri_path.s = loc;
-      rd->uri_path.length = loc_size;
-      HASH_ADD(hh, resources, uri_path.s[0], rd->uri_path.length, rd);
-    } else {
-      /* FIXME: send error response and delete r */
-    }
-  }
-
   coap_add_resource(ctx, r);
 
+  /* Endpoints that give no name are looked up by their location */
+  if (!ep.length) {
+    ep.s = loc + RD_ROOT_SIZE + 1;
+    ep.length = loc_size - RD_ROOT_SIZE - 1;
+  }
+  if (!rd_index_set(rd, RD_ATTR_EP, ep.s, ep.length) ||
+      !rd_index_set(rd, RD_ATTR_D, d.s, d.length) ||
+      !rd_index_set(rd, RD_ATTR_RT, rt.s, rt.length)) {
+    /* This releases rd as well */
+    coap_delete_resource(ctx, r);
+    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return;
+  }
+  rd_wheel_set(rd, lifetime);
 
   /* create response */
 
   response->code = COAP_RESPONSE_CODE_CREATED;
+  add_location(response, loc, loc_size);
+}
+
+typedef struct rd_buf_t {
+  uint8_t *s;
+  size_t length;
+  size_t size;
+} rd_buf_t;
+
+static int
+rd_buf_add(rd_buf_t *buf, const void *s, size_t length) {
+  if (buf->length + length > buf->size) {
+    size_t size = buf->size ? buf->size : 1024;
+    uint8_t *ns;
+
+    while (size < buf->length + length)
+      size *= 2;
+    ns = (uint8_t *)realloc(buf->s, size);
+    if (!ns)
+      return 0;
+    buf->s = ns;
+    buf->size = size;
+  }
+  memcpy(buf->s + buf->length, s, length);
+  buf->length += length;
+  return 1;
+}
+
+static int
+rd_buf_add_attr(rd_buf_t *buf, rd_t *rd, rd_attr_t attr) {
+  rd_index_t *index = rd->link[attr].index;
+
+  return !index ||
+         (rd_buf_add(buf, ";", 1) &&
+          rd_buf_add(buf, rd_attr_name[attr], strlen(rd_attr_name[attr])) &&
+          rd_buf_add(buf, "=\"", 2) &&
+          rd_buf_add(buf, index->value.s, index->value.length) &&
+          rd_buf_add(buf, "\"", 1));
+}
+
+static void
+rd_buf_release(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  free(app_ptr);
+}
+
+/*
+ * Adds the registrations of @p list that match @p filter to @p buf, after
+ * skipping @p skip of them and up to @p count of them.  Returns -1 if out
+ * of memory, 0 if @p count has been reached and 1 otherwise.
+ */
+static int
+rd_lookup_ep_list(rd_buf_t *buf, rd_t *list, rd_attr_t list_attr,
+                  rd_index_t *filter[RD_ATTR_COUNT],
+                  size_t *skip, size_t *count) {
+  rd_t *rd;
+
+  for (rd = list; rd; rd = rd->link[list_attr].next) {
+    coap_str_const_t *uri_path;
+    char lifetime[16];
+    int attr;
 
-  { /* split path into segments and add Location-Path options */
-    unsigned char _b[LOCSIZE];
-    unsigned char *b = _b;
-    size_t buflen = sizeof(_b);
-    int nseg;
-
-    nseg = coap_split_path(loc, loc_size, b, &buflen);
-    while (nseg--) {
-      coap_add_option(response,
-                      COAP_OPTION_LOCATION_PATH,
-                      coap_opt_length(b),
-                      coap_opt_value(b));
-      b += coap_opt_size(b);
+    for (attr = 0; attr < RD_ATTR_COUNT; attr++) {
+      if (filter[attr] && rd->link[attr].index != filter[attr])
+        break;
+    }
+    if (attr < RD_ATTR_COUNT)
+      continue;
+    if (*skip) {
+      (*skip)--;
+      continue;
     }
+    if (*count == 0)
+      return 0;
+    (*count)--;
+
+    uri_path = coap_resource_get_uri_path(rd->resource);
+    snprintf(lifetime, sizeof(lifetime), ";lt=%u", rd->lifetime);
+    if (!(buf->length == 0 || rd_buf_add(buf, ",", 1)) ||
+        !rd_buf_add(buf, "</", 2) ||
+        !rd_buf_add(buf, uri_path->s, uri_path->length) ||
+        !rd_buf_add(buf, ">", 1) ||
+        !rd_buf_add_attr(buf, rd, RD_ATTR_EP) ||
+        !rd_buf_add_attr(buf, rd, RD_ATTR_D) ||
+        !rd_buf_add_attr(buf, rd, RD_ATTR_RT) ||
+        !rd_buf_add(buf, lifetime, strlen(lifetime)))
+      return -1;
   }
+  return 1;
+}
+
+/*
+ * Endpoint lookup.  The registrations are taken from the index of the most
+ * selective of the ep, d and rt filters given, so that the time taken
+ * depends on the number of matches rather than of registrations.
+ */
+static void
+hnd_get_lookup_ep(coap_context_t  *ctx COAP_UNUSED,
+                  coap_resource_t *resource,
+                  coap_session_t *session,
+                  coap_pdu_t *request,
+                  coap_binary_t *token,
+                  coap_string_t *query,
+                  coap_pdu_t *response) {
+  rd_index_t *filter[RD_ATTR_COUNT];
+  rd_index_t *from = NULL;
+  rd_attr_t from_attr = RD_ATTR_EP;
+  coap_string_t value;
+  size_t skip = 0;
+  size_t count = SIZE_MAX;
+  rd_buf_t buf = { NULL, 0, 0 };
+  int res = 1;
+  int attr;
+
+  for (attr = 0; attr < RD_ATTR_COUNT; attr++) {
+    filter[attr] = NULL;
+    if (!query ||
+        !parse_param((const uint8_t *)rd_attr_name[attr],
+                     strlen(rd_attr_name[attr]),
+                     query->s, query->length, &value) ||
+        !value.length)
+      continue;
+    filter[attr] = rd_index_find(attr, value.s, value.length);
+    if (!filter[attr])
+      goto finish;
+    if (!from || filter[attr]->count < from->count) {
+      from = filter[attr];
+      from_attr = attr;
+    }
+  }
+  if (query) {
+    if (parse_param((const uint8_t *)"count", 5, query->s, query->length,
+                    &value) && value.length)
+      count = strtoul((const char *)value.s, NULL, 10);
+    if (parse_param((const uint8_t *)"page", 4, query->s, query->length,
+                    &value) && value.length && count != SIZE_MAX)
+      skip = strtoul((const char *)value.s, NULL, 10) * count;
+  }
+
+  if (from) {
+    res = rd_lookup_ep_list(&buf, from->head, from_attr, filter,
+                            &skip, &count);
+  } else {
+    rd_index_t *index, *tmp;
+
+    HASH_ITER(hh, rd_index[RD_ATTR_EP], index, tmp) {
+      res = rd_lookup_ep_list(&buf, index->head, RD_ATTR_EP, filter,
+                              &skip, &count);
+      if (res <= 0)
+        break;
+    }
+  }
+  if (res < 0) {
+    free(buf.s);
+    response->code = COAP_RESPONSE_CODE_INTERNAL_ERROR;
+    return;
+  }
+
+finish:
+  response->code = COAP_RESPONSE_CODE_CONTENT;
+  coap_add_data_large_response(resource, session, request, response,
+                               token, query,
+                               COAP_MEDIATYPE_APPLICATION_LINK_FORMAT, -1, 0,
+                               buf.length,
+                               buf.s ? buf.s : (const uint8_t *)"",
+                               rd_buf_release, buf.s);
 }
 
 static void
@@ -573,6 +1040,16 @@ init_resources(coap_context_t *ctx) {
 
   coap_add_resource(ctx, r);
 
+  r = coap_resource_init(coap_make_str_const(RD_LOOKUP_EP_STR), 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_lookup_ep);
+
+  coap_add_attr(r, coap_make_str_const("ct"), coap_make_str_const("40"), 0);
+  coap_add_attr(r, coap_make_str_const("rt"), coap_make_str_const("\"core.rd-lookup-ep\""), 0);
+
+  coap_add_resource(ctx, r);
+
+  coap_resource_release_userdata_handler(ctx, rd_release);
+  rd_wheel_now = rd_seconds();
 }
 
 static void
@@ -878,6 +1355,9 @@ main(int argc, char **argv) {
   if (group)
     coap_join_mcast_group_intf(ctx, group, group_if);
 
+  /* Lookups can return more than fits into a PDU */
+  coap_context_set_block_mode(ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
   init_resources(ctx);
 
 #ifdef _WIN32
@@ -897,7 +1377,7 @@ main(int argc, char **argv) {
   while ( !quit ) {
     result = coap_io_process( ctx, COAP_RESOURCE_CHECK_TIME * 1000 );
     if ( result >= 0 ) {
-      /* coap_check_resource_list( ctx ); */
+      rd_wheel_expire(ctx);
     }
   }
 
@@ -90,6 +90,10 @@ coap_address_set_port(coap_address_t *addr, uint16_t port) {
 
 #else /* WITH_LWIP || WITH_CONTIKI */
 
+#ifdef COAP_AF_UNIX_SUPPORT
+#include <sys/un.h>
+#endif /* COAP_AF_UNIX_SUPPORT */
+
  /** multi-purpose address abstraction */
 typedef struct coap_address_t {
   socklen_t size;           /**< size of addr */
@@ -97,6 +101,9 @@ typedef struct coap_address_t {
     struct sockaddr         sa;
     struct sockaddr_in      sin;
     struct sockaddr_in6     sin6;
+#ifdef COAP_AF_UNIX_SUPPORT
+    struct sockaddr_un      cun;
+#endif /* COAP_AF_UNIX_SUPPORT */
   } addr;
 } coap_address_t;
 
@@ -208,4 +215,34 @@ coap_is_mcast(const coap_address_t *a) {
 }
 #endif /* !WITH_LWIP && !WITH_CONTIKI */
 
+/**
+ * Sets @p addr to the Unix domain socket @p path of @p length bytes, for a
+ * UDP endpoint or client session that exchanges CoAP messages with a
+ * process on the same host.  A @p path that starts with a NUL byte is in
+ * the abstract namespace of Linux, else it is a filesystem path, which a
+ * UDP endpoint removes before it binds to it and when it is freed.
+ *
+ * @param addr   The address to set.
+ * @param path   The path of the socket, which need not be NUL terminated.
+ * @param length The length of @p path.
+ *
+ * @return @c 1 if @p addr has been set, or @c 0 if @p path is too long or
+ *         libcoap has been built without COAP_AF_UNIX_SUPPORT.
+ */
+int coap_address_set_unix_domain(coap_address_t *addr, const uint8_t *path,
+                                 size_t length);
+
+/**
+ * Returns @c 1 if @p addr is a Unix domain socket address, else @c 0.
+ */
+COAP_STATIC_INLINE int
+coap_address_is_unix(const coap_address_t *addr) {
+#ifdef COAP_AF_UNIX_SUPPORT
+  return addr->addr.sa.sa_family == AF_UNIX;
+#else /* ! COAP_AF_UNIX_SUPPORT */
+  (void)addr;
+  return 0;
+#endif /* ! COAP_AF_UNIX_SUPPORT */
+}
+
 #endif /* COAP_ADDRESS_H_ */
@@ -23,9 +23,9 @@
  * @defgroup coap_async Asynchronous Messaging
  * @{
  * Structure for managing asynchronous state of CoAP resources. A
- * coap_context_t object holds a list of coap_async_state_t objects that can be
- * used to generate a separate response in case a result of an operation cannot
- * be delivered in time.
+ * coap_context_t object holds a hash table of coap_async_state_t objects that
+ * can be used to generate a separate response in case a result of an
+ * operation cannot be delivered in time.
  */
 typedef struct coap_async_state_t {
   unsigned char flags;  /**< holds the flags to control behaviour */
@@ -42,9 +42,16 @@ typedef struct coap_async_state_t {
    * asynchronous state object.
    */
   void *appdata;
+  /* session and id must follow each other, as together they are the key
+     of the context's async_state */
   coap_session_t *session;         /**< transaction session */
   coap_mid_t id;                   /**< message id */
-  struct coap_async_state_t *next; /**< internally used for linking */
+  UT_hash_handle hh;               /**< context's async_state, by session
+                                        and id */
+  UT_hash_handle hh_token;         /**< session's async_token, by token */
+  coap_tick_t ack_due;             /**< when the held back empty ACK is
+                                        sent, or 0 if it has been */
+  coap_tick_t timeout_due;         /**< when the state times out, or 0 */
   size_t tokenlen;                 /**< length of the token */
   uint8_t token[8];                /**< the token to use in a response */
 } coap_async_state_t;
@@ -131,6 +138,19 @@ coap_free_async(coap_async_state_t *state);
  */
 coap_async_state_t *coap_find_async(coap_context_t *context, coap_session_t *session, coap_mid_t id);
 
+/**
+ * Retrieves the object of @p session that was registered for the request
+ * with the token @p token.  This function returns a pointer to that object
+ * or @c NULL if not found.
+ *
+ * @param session The session that is used for asynchronous transmissions.
+ * @param token   The token of the request.
+ *
+ * @return        A pointer to the object or @c NULL if not found.
+ */
+coap_async_state_t *coap_find_async_token(coap_session_t *session,
+                                          const coap_binary_t *token);
+
 /**
  * Updates the time stamp of @p s.
  *
@@ -139,6 +159,51 @@ coap_async_state_t *coap_find_async(coap_context_t *context, coap_session_t *ses
 COAP_STATIC_INLINE void
 coap_touch_async(coap_async_state_t *s) { coap_ticks(&s->created); }
 
+/**
+ * Sets how long the empty ACK to a Confirmable request that is registered
+ * with coap_register_async() by the request handler is held back.  If the
+ * response is sent with coap_send() within that time, it is piggybacked on
+ * the ACK (whatever its type and message id) instead of being sent as a
+ * separate response.  Otherwise the empty ACK is sent when the time is up,
+ * when the client sends the request again, or when the object is removed
+ * with coap_remove_async().
+ *
+ * @param context      The context.
+ * @param milliseconds How long the ACK is held back, or @c 0 for it to be
+ *                     sent straight away (the default).
+ */
+void coap_context_set_async_ack_delay(coap_context_t *context,
+                                      unsigned int milliseconds);
+
+/**
+ * Sets @p s to time out @p seconds from now, if it has not been removed by
+ * then.  When it times out, the handler registered with
+ * coap_register_async_timeout_handler() is called, or if there is none,
+ * a 5.03 (Service Unavailable) response is sent.  The object is then
+ * removed and released with coap_free_async(), so the application must not
+ * use it any more.
+ *
+ * @param s       The state object.
+ * @param seconds The number of seconds until @p s times out, or @c 0 for it
+ *                to never time out (the default).
+ */
+void coap_async_set_timeout(coap_async_state_t *s, unsigned int seconds);
+
+/**
+ * Registers a new handler that is called whenever an asynchronous state
+ * object times out (see coap_async_set_timeout()).  The handler is expected
+ * to send the response itself, if there is to be one.
+ *
+ * @param context The context to register the handler for.
+ * @param handler The timeout handler to register, or NULL for a 5.03
+ *                (Service Unavailable) response to be sent.
+ */
+COAP_STATIC_INLINE void
+coap_register_async_timeout_handler(coap_context_t *context,
+                                    coap_async_timeout_handler_t handler) {
+  context->async_timeout_handler = handler;
+}
+
 /** @} */
 
 /**
@@ -151,6 +216,58 @@ coap_touch_async(coap_async_state_t *s) { coap_ticks(&s->created); }
 void
 coap_delete_all_async(coap_context_t *context);
 
+/**
+ * Answers the Confirmable request @p pdu with an empty ACK if it is a
+ * duplicate of a request that is being handled asynchronously, as the
+ * client has not had the ACK.
+ *
+ * Internal function.
+ *
+ * @param session The session the request was received on.
+ * @param pdu     The Confirmable request.
+ *
+ * @return @c 1 if @p pdu is a duplicate, else @c 0.
+ */
+int coap_async_check_duplicate(coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Checks whether the empty ACK to the Confirmable request @p pdu is held
+ * back, as the request is handled asynchronously.
+ *
+ * Internal function.
+ *
+ * @param session The session the request was received on.
+ * @param pdu     The Confirmable request.
+ *
+ * @return @c 1 if the ACK is held back, else @c 0.
+ */
+int coap_async_ack_held(coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Turns the separate response @p pdu into a response piggybacked on the ACK
+ * to the request, if the ACK to that request is being held back.
+ *
+ * Internal function.
+ *
+ * @param session The session @p pdu is sent on.
+ * @param pdu     The response.
+ */
+void coap_async_piggyback(coap_session_t *session, coap_pdu_t *pdu);
+
+/**
+ * Sends the held back ACKs and times out the asynchronous states of
+ * @p session that are due.
+ *
+ * Internal function.
+ *
+ * @param session The session.
+ * @param now     The current time.
+ *
+ * @return When the next of them is due, or @c 0 if none is.
+ */
+coap_tick_t coap_async_check_timeouts(coap_session_t *session,
+                                      coap_tick_t now);
+
 #endif /*  WITHOUT_ASYNC */
 
 #endif /* COAP_ASYNC_H_ */
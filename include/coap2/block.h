@@ -38,6 +38,18 @@ typedef struct {
 
 #define COAP_BLOCK_USE_LIBCOAP  0x01 /* Use libcoap to do block requests */
 #define COAP_BLOCK_SINGLE_BODY  0x02 /* Deliver the data as a single body */
+#define COAP_BLOCK_STREAM_BODY  0x04 /* Deliver the data in order, a block or
+                                        contiguous range at a time */
+#define COAP_BLOCK_TRY_Q_BLOCK  0x08 /* Use Q-Block1/Q-Block2 (RFC9177) bursts
+                                        over unreliable transports */
+
+#ifndef COAP_DEFAULT_MAX_BODY_SIZE
+/**
+ * The largest body that libcoap puts together from blocks unless
+ * coap_context_set_max_body_size() says otherwise.
+ */
+#define COAP_DEFAULT_MAX_BODY_SIZE (8 * 1024 * 1024)
+#endif /* COAP_DEFAULT_MAX_BODY_SIZE */
 
 /**
  * Returns the value of the least significant byte of a Block option @p opt.
@@ -200,6 +212,29 @@ coap_add_data_blocked_response(coap_resource_t *resource,
 typedef void (*coap_release_large_data_t)(struct coap_session_t *session,
                                           void *app_ptr);
 
+/**
+ * Callback handler for reading a slice of a large body that is produced on
+ * demand by the application, given to coap_add_data_large_request_producer()
+ * or coap_add_data_large_response_producer().  The slices are asked for as
+ * the blocks are sent, usually in order, but a slice may be asked for again
+ * (for example when a client asks for a block again), so @p offset can be
+ * anywhere in the body.
+ *
+ * @param session The session that this data is associated with.
+ * @param offset  The offset of the slice in the body.
+ * @param length  The length of the slice, which is never beyond the end of
+ *                the body.
+ * @param buf     The buffer to fill with the @p length bytes of the slice.
+ * @param app_ptr The application provided pointer provided to the
+ *                coap_add_data_large_*_producer() functions.
+ *
+ * @return @c 1 if @p buf has been filled in, else @c 0 to abandon the
+ *         transfer.
+ */
+typedef int (*coap_large_data_producer_t)(struct coap_session_t *session,
+                                          size_t offset, size_t length,
+                                          uint8_t *buf, void *app_ptr);
+
 /**
  * Associates given data with the @p pdu that is passed as second parameter.
  *
@@ -247,6 +282,33 @@ int coap_add_data_large_request(struct coap_session_t *session,
                                 coap_release_large_data_t release_func,
                                 void *app_ptr);
 
+/**
+ * As coap_add_data_large_request(), but the body of @p length bytes is read
+ * a slice at a time by @p producer as the BLOCK1 blocks are sent, so it
+ * never has to be held in memory as a whole.  The slices that are read
+ * cover up to COAP_BLOCK_PRODUCER_READAHEAD blocks at a time.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for libcoap to work correctly when using this function.
+ *
+ * @param session  The session to associate the data with.
+ * @param pdu      The PDU to associate the data with.
+ * @param length   The length of the body to transmit.
+ * @param producer The function that reads the slices of the body.
+ * @param release_func The function to call once the body is no longer
+ *                 needed, or @c NULL if the function is not required.
+ * @param app_ptr  A Pointer that the application can provide for when
+ *                 producer() and release_func() are called.
+ *
+ * @return @c 1 if addition is successful, else @c 0.
+ */
+int coap_add_data_large_request_producer(struct coap_session_t *session,
+                                         coap_pdu_t *pdu,
+                                         size_t length,
+                                         coap_large_data_producer_t producer,
+                                         coap_release_large_data_t release_func,
+                                         void *app_ptr);
+
 /**
  * Associates given data with the @p response pdu that is passed as fourth
  * parameter.
@@ -311,6 +373,137 @@ coap_add_data_large_response(coap_resource_t *resource,
                              coap_release_large_data_t release_func,
                              void *app_ptr);
 
+/**
+ * As coap_add_data_large_response(), but the body of @p length bytes is read
+ * a slice at a time by @p producer as the BLOCK2 blocks are sent, so it
+ * never has to be held in memory as a whole.  The slices that are read
+ * cover up to COAP_BLOCK_PRODUCER_READAHEAD blocks at a time.  A body that
+ * is produced cannot be shared between the observers of @p resource, so
+ * the handler is called for each of them.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for libcoap to work correctly when using this function.
+ *
+ * @param resource   The resource the data is associated with.
+ * @param session    The coap session.
+ * @param request    The requesting pdu.
+ * @param response   The response pdu.
+ * @param token      The token taken from the (original) requesting pdu.
+ * @param query      The query taken from the (original) requesting pdu.
+ * @param media_type The format of the data.
+ * @param maxage     The maxmimum life of the data. If @c -1, then there
+ *                   is no maxage.
+ * @param etag       ETag to use if not 0.
+ * @param length     The length of the body to transmit.
+ * @param producer   The function that reads the slices of the body.
+ * @param release_func The function to call once the body is no longer
+ *                   needed, or @c NULL if the function is not required.
+ * @param app_ptr    A Pointer that the application can provide for when
+ *                   producer() and release_func() are called.
+ *
+ * @return @c 1 if addition is successful, else @c 0.
+ */
+int
+coap_add_data_large_response_producer(coap_resource_t *resource,
+                                      struct coap_session_t *session,
+                                      coap_pdu_t *request,
+                                      coap_pdu_t *response,
+                                      const coap_binary_t *token,
+                                      const coap_string_t *query,
+                                      uint16_t media_type,
+                                      int maxage,
+                                      uint64_t etag,
+                                      size_t length,
+                                      coap_large_data_producer_t producer,
+                                      coap_release_large_data_t release_func,
+                                      void *app_ptr);
+
+/**
+ * Registers @p data as a large body of @p resource, identified by @p etag,
+ * so that the same immutable body can be shared by all the transfers of
+ * that representation instead of being copied or reloaded per request.
+ * Any body already registered for @p etag is removed.
+ *
+ * The body is referenced by the resource until it is removed by
+ * coap_resource_remove_large_body() or the resource is deleted, and by each
+ * transfer started by coap_add_large_body_response() until that transfer
+ * has finished. @p release_func is called (with a @c NULL session) once the
+ * last reference has gone.
+ *
+ * @param resource     The resource the body belongs to.
+ * @param etag         The ETag of this representation (0 if none).
+ * @param length       The length of @p data.
+ * @param data         The body, which must not change while it is
+ *                     registered or in use.
+ * @param release_func The function to call to de-allocate @p data or NULL if
+ *                     the function is not required.
+ * @param app_ptr      A Pointer that the application can provide for when
+ *                     release_func() is called.
+ *
+ * @return The registered body, or @c NULL on error, in which case
+ *         release_func() has been called.
+ */
+coap_large_body_t *coap_resource_add_large_body(coap_resource_t *resource,
+                                     uint64_t etag,
+                                     size_t length,
+                                     const uint8_t *data,
+                                     coap_release_large_data_t release_func,
+                                     void *app_ptr);
+
+/**
+ * Finds the large body registered for @p resource with @p etag.
+ *
+ * @param resource The resource.
+ * @param etag     The ETag of the body.
+ *
+ * @return The body, or @c NULL if none is registered.
+ */
+coap_large_body_t *coap_resource_find_large_body(coap_resource_t *resource,
+                                                 uint64_t etag);
+
+/**
+ * Removes @p body from the large bodies of @p resource. Transfers of the
+ * body that are still in progress are completed before it is released.
+ *
+ * @param resource The resource.
+ * @param body     The registered body (may be @c NULL).
+ */
+void coap_resource_remove_large_body(coap_resource_t *resource,
+                                     coap_large_body_t *body);
+
+/**
+ * Associates the registered large @p body with the @p response PDU, in the
+ * same way as coap_add_data_large_response() does with application data,
+ * but referencing the body instead of taking it over.  The ETag option of
+ * the response is that of @p body.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for libcoap to work correctly when using this function.
+ *
+ * @param resource   The resource the data is associated with.
+ * @param session    The coap session.
+ * @param request    The requesting pdu.
+ * @param response   The response pdu.
+ * @param token      The token taken from the (original) requesting pdu.
+ * @param query      The query taken from the (original) requesting pdu.
+ * @param media_type The format of the data.
+ * @param maxage     The maxmimum life of the data. If @c -1, then there
+ *                   is no maxage.
+ * @param body       The body from coap_resource_add_large_body().
+ *
+ * @return @c 1 if addition is successful, else @c 0.
+ */
+int
+coap_add_large_body_response(coap_resource_t *resource,
+                             struct coap_session_t *session,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response,
+                             const coap_binary_t *token,
+                             const coap_string_t *query,
+                             uint16_t media_type,
+                             int maxage,
+                             coap_large_body_t *body);
+
 /**
  * Set the context level CoAP block handling bits for handling RFC7959.
  * These bits flow down to a session when a session is created and if the peer
@@ -332,6 +525,59 @@ coap_add_data_large_response(coap_resource_t *resource,
 void coap_context_set_block_mode(coap_context_t *context,
                                   uint8_t block_mode);
 
+/**
+ * Sets the largest body that the blocks received by @p context are put
+ * together into, which is COAP_DEFAULT_MAX_BODY_SIZE unless changed.  A
+ * transfer that says it is larger, or whose blocks go past it, is not
+ * kept, and a server answers 4.13 (Request Entity Too Large) with the
+ * limit in Size1.  Bodies passed on block by block or streamed are not
+ * held, so are not limited.
+ *
+ * @param context       The coap_context_t object.
+ * @param max_body_size The largest body in bytes, or @c 0 for no limit
+ *                      other than the largest block number.
+ */
+void coap_context_set_max_body_size(coap_context_t *context,
+                                    size_t max_body_size);
+
+/**
+ * Keeps the large transfers that are not complete in files in @p dir, so
+ * that they pick up at the first missing block rather than at block 0 when
+ * the session is lost and the request is made again on a new session.
+ *
+ * As a client, a Block2 response that has not all arrived when its
+ * session is freed or times out is saved, keyed on the server's address
+ * and on what the request asks for.  When the same GET or FETCH is next
+ * sent with coap_send_large(), it asks for the first missing block, and
+ * the body built from the blocks that were saved and the ones that follow
+ * is passed to the response handler.  Should the ETag of the body have
+ * changed, the transfer starts again at block 0.
+ *
+ * As a server, a Block1 request body that has not all arrived is saved,
+ * keyed on the Uri-Path, the Size1 and Content-Format of the body and the
+ * client (its PSK identity, or else its address).  When block 0 of the
+ * same body is next received, the 2.31 (Continue) response tells the client
+ * to go on from the first missing block.
+ *
+ * Only transfers put back together by COAP_BLOCK_SINGLE_BODY (see
+ * coap_context_set_block_mode()) that use Block1 or Block2 (not Q-Block1
+ * or Q-Block2) and are not Observe responses are saved.  The files hold
+ * the body received so far, so @p dir needs to be somewhere only the
+ * application can read.
+ *
+ * A saved transfer is dropped once it is COAP_BLOCK_RESUME_TTL seconds
+ * old, and no more than COAP_BLOCK_RESUME_MAX_FILES are kept, the oldest
+ * going first to make room.  One that is larger than the limit set by
+ * coap_context_set_max_body_size() is not picked up again.
+ *
+ * @param context The coap_context_t object.
+ * @param dir     The directory to keep the transfers in, or @c NULL to stop
+ *                saving them.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_block_resume(coap_context_t *context, const char *dir);
+
 /**
  * Cancel an observe that is being tracked by the client large receive logic
  * when using coap_send_large().
@@ -0,0 +1,117 @@
+/*
+ * coap_arena_internal.h -- Per-request memory arena
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_arena_internal.h
+ * @brief Per-request memory arena internal information
+ */
+
+#ifndef COAP_ARENA_INTERNAL_H_
+#define COAP_ARENA_INTERNAL_H_
+
+/**
+ * @defgroup arena_internal Request Arena (Internal)
+ * Bump allocator for the short-lived allocations made while a request is
+ * dispatched, which are all released together once it has been handled.
+ * Internal API functions
+ * @{
+ */
+
+/**
+ * Size of the arena storage that handle_request() keeps on the stack.
+ * Requests needing more get further blocks from the heap.
+ */
+#ifndef COAP_REQUEST_ARENA_SIZE
+#if defined(WITH_LWIP) || defined(WITH_CONTIKI) || defined(RIOT_VERSION)
+#define COAP_REQUEST_ARENA_SIZE 128
+#else /* ! WITH_LWIP && ! WITH_CONTIKI && ! RIOT_VERSION */
+#define COAP_REQUEST_ARENA_SIZE 512
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI && ! RIOT_VERSION */
+#endif /* COAP_REQUEST_ARENA_SIZE */
+
+/** Smallest block taken from the heap once the arena storage is used up. */
+#ifndef COAP_ARENA_BLOCK_SIZE
+#define COAP_ARENA_BLOCK_SIZE 512
+#endif /* COAP_ARENA_BLOCK_SIZE */
+
+typedef struct coap_arena_block_t coap_arena_block_t;
+
+struct coap_arena_t {
+  uint8_t *next;              /**< next free byte of the current block */
+  uint8_t *end;               /**< end of the current block */
+  coap_arena_block_t *blocks; /**< blocks taken from the heap, newest first */
+  size_t block_size;          /**< smallest block taken from the heap,
+                                   COAP_ARENA_BLOCK_SIZE unless changed */
+};
+
+/**
+ * Sets up @p arena to allocate from the @p size bytes at @p buf, typically
+ * on the stack of the caller.
+ *
+ * @param arena The arena to set up.
+ * @param buf   The initial storage.
+ * @param size  The size of @p buf.
+ */
+void coap_arena_init(coap_arena_t *arena, uint8_t *buf, size_t size);
+
+/**
+ * Allocates @p size bytes from @p arena, suitably aligned for any object.
+ * The memory stays valid until coap_arena_release() is called.
+ *
+ * @param arena The arena.
+ * @param size  The number of bytes needed.
+ *
+ * @return The allocated memory or @c NULL if out of memory.
+ */
+void *coap_arena_alloc(coap_arena_t *arena, size_t size);
+
+/**
+ * Releases all the memory allocated from @p arena at once.
+ *
+ * @param arena The arena.
+ */
+void coap_arena_release(coap_arena_t *arena);
+
+/**
+ * Creates a new string of @p size bytes in @p arena, or on the heap if
+ * @p arena is @c NULL.  Only a string from the heap is released with
+ * coap_delete_string().
+ *
+ * @param arena The arena, or @c NULL.
+ * @param size  The size of the string.
+ *
+ * @return The new string or @c NULL if out of memory.
+ */
+coap_string_t *coap_arena_new_string(coap_arena_t *arena, size_t size);
+
+/**
+ * Like coap_get_query(), but the string is created with
+ * coap_arena_new_string().
+ *
+ * @param request Request PDU.
+ * @param arena   The arena, or @c NULL.
+ *
+ * @return The escaped query or @c NULL if there is none.
+ */
+coap_string_t *coap_get_query_arena(const coap_pdu_t *request,
+                                    coap_arena_t *arena);
+
+/**
+ * Like coap_get_uri_path(), but the string is created with
+ * coap_arena_new_string().
+ *
+ * @param request Request PDU.
+ * @param arena   The arena, or @c NULL.
+ *
+ * @return The escaped uri path or @c NULL if out of memory.
+ */
+coap_string_t *coap_get_uri_path_arena(const coap_pdu_t *request,
+                                       coap_arena_t *arena);
+
+/** @} */
+
+#endif /* COAP_ARENA_INTERNAL_H_ */
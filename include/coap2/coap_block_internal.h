@@ -30,22 +30,103 @@ typedef enum {
   COAP_RECURSE_NO
 } coap_recurse_t;
 
-struct coap_lg_range {
-  uint32_t begin;
-  uint32_t end;
-};
+/**
+ * Checks whether Q-Block1 and Q-Block2 (RFC9177) are to be used on
+ * session @p s.
+ */
+#define COAP_SESSION_Q_BLOCK(s) \
+  (((s)->block_mode & COAP_BLOCK_TRY_Q_BLOCK) && \
+   COAP_PROTO_NOT_RELIABLE((s)->proto))
+
+/**
+ * The EXCHANGE_LIFETIME of session @p s in coap_tick_t, which is how long
+ * a completed large body transfer is kept around for.
+ */
+#define COAP_EXCHANGE_LIFETIME_TICKS(s) \
+  ((coap_tick_t)COAP_EXCHANGE_LIFETIME(s) * COAP_TICKS_PER_SECOND)
 
-#define COAP_RBLOCK_CNT 4
 /**
- * Structure to keep track of received blocks
+ * The most blocks that can be tracked for a body, as the block number of a
+ * Block or Q-Block option is at most 20 bits.
+ */
+#define COAP_RBLOCK_MAX_BLOCKS (1UL << 20)
+
+/**
+ * Structure to keep track of received blocks.  There is a bit per block in
+ * @p bitmap, which is sized from Size1 or Size2 when the body size is known
+ * and grown as needed otherwise, up to @p max_blocks.
  */
 typedef struct coap_rblock_t {
-  uint32_t used;
+  uint32_t *bitmap;       /**< bit set for each block received */
+  uint32_t words;         /**< number of 32 bit words in @p bitmap */
+  uint32_t max_blocks;    /**< most blocks allowed for, or 0 for
+                               COAP_RBLOCK_MAX_BLOCKS */
+  uint32_t first_missing; /**< all blocks before this have been received */
+  uint32_t end;           /**< highest block received + 1, 0 if none */
   uint32_t retry;
-  struct coap_lg_range range[COAP_RBLOCK_CNT];
   coap_tick_t last_seen;
 } coap_rblock_t;
 
+/**
+ * Makes sure that @p rec_blocks has a bit for each of the blocks below
+ * @p count.
+ *
+ * @param rec_blocks The received blocks.
+ * @param count      The number of blocks to make room for.
+ *
+ * @return @c 1 if successful, @c 0 if @p count is more than the
+ *         max_blocks of @p rec_blocks or out of memory.
+ */
+int coap_rblock_size(coap_rblock_t *rec_blocks, size_t count);
+
+/**
+ * Forgets all the blocks received, keeping the bitmap for re-use.
+ *
+ * @param rec_blocks The received blocks.
+ */
+void coap_rblock_reset(coap_rblock_t *rec_blocks);
+
+/**
+ * Releases the bitmap of @p rec_blocks.
+ *
+ * @param rec_blocks The received blocks.
+ */
+void coap_rblock_free(coap_rblock_t *rec_blocks);
+
+/**
+ * Marks block @p block_num as received, growing the bitmap if needed.
+ *
+ * @param rec_blocks The received blocks.
+ * @param block_num  The number of the block received.
+ *
+ * @return @c 1 if successful, @c 0 if @p block_num cannot be tracked.
+ */
+int coap_rblock_add(coap_rblock_t *rec_blocks, uint32_t block_num);
+
+/**
+ * Checks whether block @p block_num has been received.
+ *
+ * @param rec_blocks The received blocks.
+ * @param block_num  The number of the block.
+ *
+ * @return @c 1 if it has, else @c 0.
+ */
+int coap_rblock_check(const coap_rblock_t *rec_blocks, uint32_t block_num);
+
+/**
+ * Fills in @p out with up to @p max of the block numbers below @p count
+ * that are not in @p rec_blocks.
+ *
+ * @param rec_blocks The received blocks.
+ * @param count      The number of blocks in the body.
+ * @param out        Filled in with the missing block numbers.
+ * @param max        The size of @p out.
+ *
+ * @return The number of block numbers filled in.
+ */
+uint32_t coap_block_find_missing(const coap_rblock_t *rec_blocks,
+                                 uint32_t count, uint32_t *out, uint32_t max);
+
 /**
  * Structure to keep track of block1 specific information
  * (Requests)
@@ -55,6 +136,8 @@ typedef struct coap_l_block1_t {
   uint8_t token[8];      /**< last used token */
   size_t token_length;   /**< length of token */
   uint32_t count;        /**< the number of packets sent for payload */
+  uint32_t q_last;       /**< Q-Block1: highest block number sent */
+  unsigned int q_retry;  /**< Q-Block1: retransmits since last response */
 } coap_l_block1_t;
 
 /**
@@ -64,8 +147,15 @@ typedef struct coap_l_block1_t {
 typedef struct coap_l_block2_t {
   coap_resource_t *resource; /**< associated resource */
   coap_string_t *query;  /**< Associated query for the resource */
+  coap_string_t *uri_path; /**< Path of the request if the resource is a
+                                route, as a route serves many paths */
   uint64_t etag;         /**< ETag value */
+  uint32_t generation;   /**< generation of the resource the body is of */
   coap_time_t maxage_expire; /**< When this entry expires */
+  uint32_t q_next;       /**< Q-Block2: next block of the set to send */
+  uint32_t q_end;        /**< Q-Block2: end of the set to send */
+  uint8_t q_token[8];    /**< Q-Block2: token of the request for the set */
+  size_t q_token_length; /**< Q-Block2: length of q_token */
 } coap_l_block2_t;
 
 /**
@@ -84,12 +174,93 @@ struct coap_lg_xmit_t {
     coap_l_block2_t b2;
   } b;
   coap_pdu_t pdu;        /**< skeletal PDU */
-  coap_tick_t last_payload; /**< Last time MAX_PAYLOAD was sent or 0 */
+  coap_tick_t last_payload; /**< Last time MAX_PAYLOADS was sent or 0 */
   coap_tick_t last_used; /**< Last time all data sent or 0 */
   coap_release_large_data_t release_func; /**< large data de-alloc function */
   void *app_ptr;         /**< applicaton provided ptr for de-alloc function */
+  coap_large_data_producer_t producer; /**< reads the large data if data is
+                                            NULL */
+  uint8_t *window;       /**< large data read ahead by producer */
+  size_t window_offset;  /**< offset of window in the large data */
+  size_t window_length;  /**< length of the large data in window */
+  size_t window_size;    /**< allocated size of window */
+  UT_hash_handle hh;     /**< session->lg_xmit_token index on token (BLOCK1)
+                              or session->lg_xmit_resource index on
+                              resource (BLOCK2) */
+  struct coap_lg_xmit_t *next_query; /**< BLOCK2: next lg_xmit for the same
+                                          resource, but another query */
 };
 
+/**
+ * Reference counted holder of a BLOCK2 large body, used as the app_ptr of
+ * an lg_xmit once the body is shared with other lg_xmits or with PDUs that
+ * send their payload directly from it. If @p release_func is set, the
+ * body belongs to the application and is released when the last reference
+ * is dropped, otherwise the body data follows the structure.
+ *
+ * A body registered with coap_resource_add_large_body() is also on the
+ * resource's list of bodies, which holds a reference until the body is
+ * removed or the resource is deleted.
+ */
+typedef struct coap_lg_xmit_body_t {
+  struct coap_lg_xmit_body_t *next; /**< next body of the same resource */
+  unsigned int ref;      /**< number of lg_xmits and PDUs referencing this */
+  coap_session_t *session; /**< session passed to release_func */
+  coap_release_large_data_t release_func; /**< application de-alloc function */
+  void *app_ptr;         /**< applicaton provided ptr for de-alloc function */
+  coap_resource_t *resource; /**< resource the body is registered with, or
+                                  NULL once removed, or if not registered */
+  uint8_t registered;    /**< set if coap_resource_add_large_body() created
+                              this, so the data stays valid for all
+                              references */
+  uint64_t etag;         /**< ETag of a registered body */
+  const uint8_t *data;   /**< data of a registered body */
+  size_t length;         /**< length of a registered body */
+} coap_lg_xmit_body_t;
+
+/**
+ * The maximum number of blocks that are held back while waiting for a
+ * missing block when a body is streamed (COAP_BLOCK_STREAM_BODY).
+ */
+#ifndef COAP_BLOCK_STREAM_WINDOW
+#define COAP_BLOCK_STREAM_WINDOW 16
+#endif /* COAP_BLOCK_STREAM_WINDOW */
+
+/**
+ * The number of blocks of a produced large body (see
+ * coap_large_data_producer_t) that are read in one go, and kept until they
+ * have been sent.
+ */
+#ifndef COAP_BLOCK_PRODUCER_READAHEAD
+#define COAP_BLOCK_PRODUCER_READAHEAD 4
+#endif /* COAP_BLOCK_PRODUCER_READAHEAD */
+
+/**
+ * A block that has arrived ahead of the data delivered so far when a body
+ * is streamed.
+ */
+typedef struct coap_block_pending_t {
+  struct coap_block_pending_t *next;
+  size_t offset;         /**< Offset of the data in the body */
+  size_t length;         /**< Length of the data */
+  uint8_t data[1];       /**< The data */
+} coap_block_pending_t;
+
+/**
+ * State of a body that is being delivered to the application in order, a
+ * block or contiguous range at a time (COAP_BLOCK_STREAM_BODY).  Only the
+ * blocks that arrive out of order are buffered.
+ */
+typedef struct coap_block_stream_t {
+  size_t offset;         /**< All the data before this has been delivered */
+  size_t end;            /**< End of the body, if end_set */
+  uint8_t end_set;       /**< Set once the last block has been seen */
+  unsigned int count;    /**< Number of blocks in pending */
+  coap_block_pending_t *pending; /**< Blocks beyond offset, by offset */
+  coap_binary_t *range;  /**< Last range delivered, if it had to be joined
+                              up from several blocks */
+} coap_block_stream_t;
+
 /**
  * Structure to hold large body (many blocks) client receive information
  */
@@ -107,6 +278,7 @@ struct coap_lg_crcv_t {
   uint8_t szx;           /**< size of individual blocks */
   size_t total_len;      /**< Length as indicated by SIZE2 option */
   coap_binary_t *body_data; /**< Used for re-assembling entire body */
+  coap_block_stream_t stream; /**< Used for streaming the body */
   coap_binary_t *app_token; /**< app requesting PDU token */
   uint8_t base_token[8]; /**< established base PDU token */
   size_t base_token_length; /**< length of token */
@@ -116,6 +288,7 @@ struct coap_lg_crcv_t {
   coap_rblock_t rec_blocks; /** < list of received blocks */
   coap_tick_t last_used; /**< Last time all data sent or 0 */
   uint16_t block_option; /**< Block option in use */
+  UT_hash_handle hh;     /**< session->lg_crcv_token index on token */
 };
 
 /**
@@ -134,6 +307,7 @@ struct coap_lg_srcv_t {
   uint8_t szx;           /**< size of individual blocks */
   size_t total_len;      /**< Length as indicated by SIZE1 option */
   coap_binary_t *body_data; /**< Used for re-assembling entire body */
+  coap_block_stream_t stream; /**< Used for streaming the body */
   size_t amount_so_far;  /**< Amount of data seen so far */
   coap_resource_t *resource; /**< associated resource */
   coap_str_const_t *uri_path; /** set to uri_path if unknown resource */
@@ -141,8 +315,13 @@ struct coap_lg_srcv_t {
   uint8_t last_token[8]; /**< last used token */
   size_t last_token_length; /**< length of token */
   coap_mid_t last_mid;   /**< Last received mid for this set of packets */
+  uint32_t total_blocks; /**< Q-Block1: number of blocks once the last
+                              block has been seen, else 0 */
   coap_tick_t last_used; /**< Last time data sent or 0 */
   uint16_t block_option; /**< Block option in use */
+  uint64_t resume_key;   /**< Key the progress is saved under, or 0 */
+  UT_hash_handle hh;     /**< session->lg_srcv_resource index on resource,
+                              or session->lg_srcv_path index on uri_path */
 };
 
 coap_lg_crcv_t * coap_block_new_lg_crcv(coap_session_t *session,
@@ -151,12 +330,80 @@ coap_lg_crcv_t * coap_block_new_lg_crcv(coap_session_t *session,
 void coap_block_delete_lg_crcv(coap_session_t *session,
                                coap_lg_crcv_t *lg_crcv);
 
+/**
+ * Picks up the Block2 body saved under @p key in the newly set up
+ * @p lg_crcv, and changes the request @p pdu to ask for the first block
+ * that is missing.  Nothing is changed if there is nothing usable saved.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive set up for @p pdu.
+ * @param pdu     The request that is about to be sent.
+ * @param key     The key returned by coap_block_resume_crcv_key().
+ */
+void coap_block_resume_lg_crcv(coap_session_t *session,
+                               coap_lg_crcv_t *lg_crcv,
+                               coap_pdu_t *pdu, uint64_t key);
+
+/**
+ * Adds @p lg_crcv to the session's list of large receives and indexes it
+ * by its current token.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive to add.
+ */
+void coap_block_add_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv);
+
+/**
+ * Removes @p lg_crcv from the session's list of large receives and from the
+ * token index. The storage is not released.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive to remove.
+ */
+void coap_block_remove_lg_crcv(coap_session_t *session,
+                               coap_lg_crcv_t *lg_crcv);
+
+/**
+ * Updates the token of @p lg_crcv that is expected in the next response,
+ * keeping the session's token index in sync.
+ *
+ * @param session The session.
+ * @param lg_crcv The large receive to update.
+ * @param token   The new token.
+ * @param length  The length of @p token (at most 8).
+ */
+void coap_block_set_lg_crcv_token(coap_session_t *session,
+                                  coap_lg_crcv_t *lg_crcv,
+                                  const uint8_t *token, size_t length);
+
 coap_tick_t coap_block_check_lg_crcv_timeouts(coap_session_t *session,
                                               coap_tick_t now);
 
+/**
+ * Retransmits the last block of the Q-Block1 sets that have not been
+ * responded to within NON_TIMEOUT, giving up after NON_MAX_RETRANSMIT.
+ *
+ * @param session The session.
+ * @param now     The current time.
+ *
+ * @return The ticks until the next check is due, or -1 if none.
+ */
+coap_tick_t coap_block_check_lg_xmit_timeouts(coap_session_t *session,
+                                              coap_tick_t now);
+
 void coap_block_delete_lg_srcv(coap_session_t *session,
                                coap_lg_srcv_t *lg_srcv);
 
+/**
+ * Removes @p lg_srcv from the session's list of large receives and from its
+ * index. The storage is not released.
+ *
+ * @param session The session.
+ * @param lg_srcv The large receive to remove.
+ */
+void coap_block_remove_lg_srcv(coap_session_t *session,
+                               coap_lg_srcv_t *lg_srcv);
+
 coap_tick_t coap_block_check_lg_srcv_timeouts(coap_session_t *session,
                                               coap_tick_t now);
 
@@ -189,6 +436,113 @@ int coap_handle_response_get_block(coap_context_t *context,
 void coap_block_delete_lg_xmit(coap_session_t *session,
                                coap_lg_xmit_t *lg_xmit);
 
+/**
+ * Creates an unlinked copy of the BLOCK2 @p lg_xmit so that the same large
+ * body can be sent to another session without the application handler
+ * being called again. The first time @p lg_xmit is copied its body is
+ * taken over by libcoap and @p lg_xmit's reference on the application's
+ * body is dropped. The body is then shared by reference between @p lg_xmit
+ * and its copies.
+ *
+ * @param session The session that @p lg_xmit belongs to.
+ * @param lg_xmit The BLOCK2 large transmit to copy.
+ *
+ * @return The copy with its transmit state reset, or @c NULL on error.
+ */
+coap_lg_xmit_t *coap_block_copy_lg_xmit(coap_session_t *session,
+                                        coap_lg_xmit_t *lg_xmit);
+
+/**
+ * Adds @p len bytes of the body of @p lg_xmit starting at @p offset as the
+ * payload of @p pdu. Where the session can transmit it, the payload is not
+ * copied into @p pdu but sent directly from the body, which @p pdu then
+ * holds a reference on.
+ *
+ * @param session The session @p pdu is going to be sent on.
+ * @param pdu     The PDU to add the payload to.
+ * @param lg_xmit The large transmit holding the body.
+ * @param offset  The offset of the payload in the body.
+ * @param len     The length of the payload.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_block_add_xmit_data(coap_session_t *session, coap_pdu_t *pdu,
+                             coap_lg_xmit_t *lg_xmit, size_t offset,
+                             size_t len);
+
+/**
+ * Drops a reference on @p body, releasing it when it is no longer used.
+ *
+ * @param body The large body.
+ */
+void coap_block_release_xmit_body(coap_lg_xmit_body_t *body);
+
+/**
+ * Drops the references that @p resource holds on its registered large
+ * bodies. Called when @p resource is deleted.
+ *
+ * @param resource The resource.
+ */
+void coap_block_delete_large_bodies(coap_resource_t *resource);
+
+/**
+ * Sends the Q-Block2 blocks that are still due for the current sets of the
+ * session's large transmits. Called once the response to the request for a
+ * set has been sent, so that the response goes first.
+ *
+ * @param session The session.
+ */
+void coap_block_send_q_block2_sets(coap_session_t *session);
+
+/**
+ * Sends the Q-Block1 blocks of @p lg_xmit from block @p num to the end of
+ * the MAX_PAYLOADS set that @p num is in, as NON requests.
+ *
+ * @param session The session.
+ * @param lg_xmit The Q-Block1 large transmit.
+ * @param num     The block to start from.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_block_send_q_block1_set(coap_session_t *session,
+                                 coap_lg_xmit_t *lg_xmit, uint32_t num);
+
+/**
+ * Adds @p lg_xmit to the session's list of large transmits and indexes it,
+ * by token for BLOCK1 and by resource and query for BLOCK2. An existing
+ * BLOCK2 lg_xmit for the same resource and query is replaced.
+ *
+ * @param session The session.
+ * @param lg_xmit The large transmit to add.
+ */
+void coap_block_add_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit);
+
+/**
+ * Removes @p lg_xmit from the session's list of large transmits and from its
+ * index. The storage is not released.
+ *
+ * @param session The session.
+ * @param lg_xmit The large transmit to remove.
+ */
+void coap_block_remove_lg_xmit(coap_session_t *session,
+                               coap_lg_xmit_t *lg_xmit);
+
+/**
+ * Finds the BLOCK2 large transmit of the session for @p resource and
+ * @p query (and the path of @p request if @p resource is a route).
+ *
+ * @param session  The session.
+ * @param resource The resource.
+ * @param request  The request, or @c NULL to match any path of a route.
+ * @param query    The query, or @c NULL if none.
+ *
+ * @return The large transmit, or @c NULL if there is none.
+ */
+coap_lg_xmit_t *coap_block_find_lg_xmit_response(coap_session_t *session,
+                                                 coap_resource_t *resource,
+                                                 const coap_pdu_t *request,
+                                                 const coap_string_t *query);
+
 /**
  * The function that does all the work for the coap_add_data_large*()
  * functions.
@@ -196,27 +550,32 @@ void coap_block_delete_lg_xmit(coap_session_t *session,
  * @param session  The session to associate the data with.
  * @param pdu      The PDU to associate the data with.
  * @param resource The resource to associate the data with (BLOCK2).
+ * @param request  The request the data is for, or @c NULL (BLOCK2).
  * @param query    The query to associate the data with (BLOCK2).
  * @param maxage   The maxmimum life of the data. If @c -1, then there
  *                 is no maxage (BLOCK2).
  * @param etag     ETag to use if not 0 (BLOCK2).
  * @param length   The length of data to transmit.
- * @param data     The data to transmit.
+ * @param data     The data to transmit, or @c NULL if it is read by
+ *                 @p producer.
+ * @param producer The function that reads the data, or @c NULL.
  * @param release_func The function to call to de-allocate @p data or NULL if
  *                 the function is not required.
  * @param app_ptr  A Pointer that the application can provide for when
- *                 release_func() is called.
+ *                 producer() or release_func() is called.
  *
  * @return @c 1 if transmission initiation is successful, else @c 0.
  */
 int coap_add_data_large_internal(struct coap_session_t *session,
                         coap_pdu_t *pdu,
                         coap_resource_t *resource,
+                        const coap_pdu_t *request,
                         const coap_string_t *query,
                         int maxage,
                         uint64_t etag,
                         size_t length,
                         const uint8_t *data,
+                        coap_large_data_producer_t producer,
                         coap_release_large_data_t release_func,
                         void *app_ptr);
 
@@ -227,10 +586,126 @@ int coap_add_data_large_internal(struct coap_session_t *session,
  * @param session  The session
  * @param response The response PDU to to check
  * @param resource The requested resource
+ * @param request  The request
  * @param query    The requested query
  */
 void coap_check_code_lg_xmit(coap_session_t *session, coap_pdu_t *response,
-                             coap_resource_t *resource, coap_string_t *query);
+                             coap_resource_t *resource,
+                             const coap_pdu_t *request, coap_string_t *query);
+
+#ifndef COAP_BLOCK_RESUME_MAX_FILES
+/**
+ * The most transfers that coap_block_resume_save() keeps in the directory,
+ * the oldest being removed to make room for another.
+ */
+#define COAP_BLOCK_RESUME_MAX_FILES 64
+#endif /* COAP_BLOCK_RESUME_MAX_FILES */
+
+#ifndef COAP_BLOCK_RESUME_TTL
+/**
+ * How long in seconds a saved transfer is kept for after it was last
+ * saved.
+ */
+#define COAP_BLOCK_RESUME_TTL (24 * 60 * 60)
+#endif /* COAP_BLOCK_RESUME_TTL */
+
+/**
+ * What is saved by coap_block_resume_save() of a body that has not all
+ * been received, so that the transfer can pick up where it left off after
+ * the session is lost.
+ */
+typedef struct coap_block_resume_t {
+  uint64_t key;            /**< Which transfer this is */
+  size_t total_len;        /**< Expected length of the body */
+  uint32_t *bitmap;        /**< Bit set for each block received */
+  uint32_t words;          /**< Number of 32 bit words in @p bitmap */
+  uint32_t first_missing;  /**< All blocks before this have been received */
+  uint32_t end;            /**< Highest block received + 1 */
+  coap_binary_t *body_data; /**< The body so far, blocks in place */
+  uint16_t content_format; /**< Content format of the body */
+  uint8_t szx;             /**< Size of the blocks */
+  uint8_t etag_length;     /**< ETag length */
+  uint8_t etag[8];         /**< ETag of the body */
+} coap_block_resume_t;
+
+/**
+ * Returns the key that a Block2 transfer asked for by the request @p pdu
+ * on @p session is saved under, made up from the peer's address, the
+ * method, the options that say what is asked for and any body.
+ *
+ * @param session The client session.
+ * @param pdu     The request.
+ *
+ * @return The key, or @c 0 if transfers cannot be saved.
+ */
+uint64_t coap_block_resume_crcv_key(const coap_session_t *session,
+                                    const coap_pdu_t *pdu);
+
+/**
+ * Returns the key that a Block1 transfer of @p total_len bytes of
+ * @p content_format to @p uri_path from the peer of @p session is saved
+ * under.  The peer is known by its PSK identity if it has one, else by its
+ * address.
+ *
+ * @param session      The server session.
+ * @param uri_path     The path of the resource.
+ * @param uri_path_len The length of @p uri_path.
+ * @param total_len    The Size1 of the body.
+ * @param content_format The Content-Format of the body.
+ *
+ * @return The key, or @c 0 if transfers cannot be saved.
+ */
+uint64_t coap_block_resume_srcv_key(const coap_session_t *session,
+                                    const uint8_t *uri_path,
+                                    size_t uri_path_len, size_t total_len,
+                                    uint16_t content_format);
+
+/**
+ * Saves @p state under its key in the directory set by
+ * coap_context_set_block_resume(), replacing what was there.  Transfers
+ * older than COAP_BLOCK_RESUME_TTL are removed first, then the oldest
+ * ones while there are COAP_BLOCK_RESUME_MAX_FILES others.
+ *
+ * @param context The context.
+ * @param state   What has been received.
+ *
+ * @return @c 1 if saved, else @c 0.
+ */
+int coap_block_resume_save(coap_context_t *context,
+                           const coap_block_resume_t *state);
+
+/**
+ * Checks whether something is saved under @p key.
+ *
+ * @param context The context.
+ * @param key     The key of the transfer.
+ *
+ * @return @c 1 if there is, else @c 0.
+ */
+int coap_block_resume_exists(const coap_context_t *context, uint64_t key);
+
+/**
+ * Reads back what is saved under @p key.  The bitmap and body_data of
+ * @p state are allocated and become the caller's.  A saved transfer that
+ * cannot be used, is older than COAP_BLOCK_RESUME_TTL or is larger than
+ * the context's max_body_size is removed.
+ *
+ * @param context The context.
+ * @param key     The key of the transfer.
+ * @param state   Filled in with what was saved.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_block_resume_load(coap_context_t *context, uint64_t key,
+                           coap_block_resume_t *state);
+
+/**
+ * Removes what is saved under @p key, if anything.
+ *
+ * @param context The context.
+ * @param key     The key of the transfer.
+ */
+void coap_block_resume_forget(coap_context_t *context, uint64_t key);
 
 /** @} */
 
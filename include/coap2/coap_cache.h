@@ -40,6 +40,11 @@ typedef enum coap_cache_record_pdu_t {
   COAP_CACHE_RECORD_PDU
 } coap_cache_record_pdu_t;
 
+typedef enum coap_cache_key_hash_t {
+  COAP_CACHE_KEY_HASH_DIGEST,   /* SHA256 digest, if there is TLS support */
+  COAP_CACHE_KEY_HASH_FAST      /* 128-bit non-cryptographic hash */
+} coap_cache_key_hash_t;
+
 /**
  * Calculates a cache-key for the given CoAP PDU. See
  * https://tools.ietf.org/html/rfc7252#section-5.6
@@ -90,13 +95,45 @@ void coap_delete_cache_key(coap_cache_key_t *cache_key);
 int coap_cache_ignore_options(coap_context_t *context,
                               const uint16_t *options, size_t count);
 
+/**
+ * Select how cache-keys are calculated for @p context.  The default
+ * COAP_CACHE_KEY_HASH_DIGEST uses the TLS library digest, whereas
+ * COAP_CACHE_KEY_HASH_FAST uses a much cheaper 128-bit non-cryptographic
+ * hash.  The fast hash should only be used if the PDUs that are keyed
+ * cannot be crafted by an attacker to collide with others.
+ *
+ * This has to be done before any cache-entries are created.
+ *
+ * @param context   The context to use.
+ * @param key_hash  COAP_CACHE_KEY_HASH_DIGEST or COAP_CACHE_KEY_HASH_FAST.
+ *
+ * @return          @c 1 if successful, else @c 0 if there are already
+ *                  cache-entries.
+ */
+int coap_cache_set_key_hash(coap_context_t *context,
+                            coap_cache_key_hash_t key_hash);
+
+/**
+ * Limit the memory used by the cache-entries of @p context.  When a new
+ * cache-entry takes the cache over @p max_size bytes, the least recently
+ * used cache-entries are deleted (calling any app_data free callback)
+ * until it fits again.
+ *
+ * @param context   The context to use.
+ * @param max_size  The maximum size of the cache in bytes, or @c 0 for no
+ *                  limit (the default).
+ */
+void coap_cache_set_max_size(coap_context_t *context, size_t max_size);
+
 /**
  * Create a new cache-entry hash keyed by cache-key derived from the PDU.
  *
  * If @p session_based is set, then this cache-entry will get deleted when
  * the session is freed off.
  * If @p record_pdu is set, then the copied PDU will get freed off when
- * this cache-entry is deleted.
+ * this cache-entry is deleted.  A @p pdu that is already shared (see
+ * coap_pdu_reference()) is referenced instead of copied, which does not
+ * change its contents.
  *
  * The cache-entry is maintained on a context hash list.
  *
@@ -121,7 +158,8 @@ coap_cache_entry_t *coap_new_cache_entry(coap_session_t *session,
 
 /**
  * Remove a cache-entry from the hash list and free off all the appropriate
- * contents apart from app_data.
+ * contents apart from app_data.  It is removed from the backend set by
+ * coap_cache_set_backend() as well.
  *
  * @param context     The context to use.
  * @param cache_entry The cache-entry to remove.
@@ -193,6 +231,107 @@ void coap_cache_set_app_data(coap_cache_entry_t *cache_entry, void *data,
  */
 void *coap_cache_get_app_data(const coap_cache_entry_t *cache_entry);
 
+/**
+ * A second level store for the cache-entries of a context, such as a
+ * key-value store shared by the processes of a cluster.  The cache of the
+ * context stays in front of it, so the backend is only asked when an entry
+ * is not found there.
+ *
+ * Only the cache-entries that are not session based and that record the PDU
+ * are handed to the backend, as a version byte, the idle timeout (4 bytes,
+ * network order) and the PDU in the CoAP over UDP format.
+ */
+typedef struct coap_cache_backend_t {
+  /**
+   * Stores @p data of @p len bytes for @p key, replacing what is there.
+   * @p ttl is the idle timeout of the entry in seconds, or @c 0 if none.
+   * Returns @c 1 if stored, else @c 0.
+   */
+  int (*put)(void *arg, const uint8_t *key, size_t key_len,
+             const uint8_t *data, size_t len, unsigned int ttl);
+  /**
+   * Copies the data stored for @p key into @p data if it fits in
+   * @p max_len bytes.  Returns the length of the stored data (even if it
+   * did not fit, in which case it is asked again with a larger buffer), or
+   * @c 0 if there is none.
+   */
+  size_t (*get)(void *arg, const uint8_t *key, size_t key_len,
+                uint8_t *data, size_t max_len);
+  /** Removes the data stored for @p key, if any.  May be NULL. */
+  void (*remove)(void *arg, const uint8_t *key, size_t key_len);
+  void *arg;                    /**< Passed to the callbacks */
+} coap_cache_backend_t;
+
+/**
+ * Sets the second level store of the cache-entries of @p context.  New
+ * cache-entries are written through to it, coap_cache_get_by_key() and
+ * coap_cache_get_by_pdu() fall back to it, and coap_delete_cache_entry()
+ * removes the entry from it as well.  Entries that the cache of @p context
+ * drops on its own (idle timeout, size limit, session or context going
+ * away) are left in the backend.
+ *
+ * @param context The context.
+ * @param backend The callbacks (which are copied), or @c NULL to stop using
+ *                a backend.
+ */
+void coap_cache_set_backend(coap_context_t *context,
+                            const coap_cache_backend_t *backend);
+
+/**
+ * A cache backend kept in a memory-mapped file, so that it can be larger
+ * than memory allows and survives a restart.
+ */
+typedef struct coap_cache_store_t coap_cache_store_t;
+
+/**
+ * Opens the cache store in the file @p path of @p size bytes, creating it
+ * if it does not exist.  An existing store of the same size is used as it
+ * is, so the cache is warm straight after a restart.  The store is meant
+ * for a single process, but may be shared by the contexts (and threads) of
+ * that process.
+ *
+ * A new entry is kept for its idle timeout and, if it is a response, no
+ * longer than its Max-Age says.  The space of the entries that have been
+ * replaced, removed or have expired comes back when the store is compacted,
+ * which happens when it is full or coap_cache_store_compact() is called.
+ *
+ * @param path The file of the store.
+ * @param size The size of the file, which is fixed.
+ *
+ * @return The store, or @c NULL if the file cannot be mapped (or the store
+ *         is not supported on this platform).
+ */
+coap_cache_store_t *coap_cache_store_open(const char *path, size_t size);
+
+/**
+ * Writes out and closes @p store.  It must no longer be set for any
+ * context.
+ *
+ * @param store The store, or @c NULL.
+ */
+void coap_cache_store_close(coap_cache_store_t *store);
+
+/**
+ * Copies the live entries of @p store into a new file that then replaces
+ * the old one.  This may be called from a thread other than the ones
+ * running the contexts that use @p store, which are held up only while the
+ * copy is done.
+ *
+ * @param store The store.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_cache_store_compact(coap_cache_store_t *store);
+
+/**
+ * Uses @p store as the cache backend of @p context, as by
+ * coap_cache_set_backend().
+ *
+ * @param context The context.
+ * @param store   The store, or @c NULL to stop using a backend.
+ */
+void coap_cache_set_store(coap_context_t *context, coap_cache_store_t *store);
+
 /** @} */
 
 #endif  /* COAP_CACHE_H */
@@ -42,8 +42,41 @@ struct coap_cache_entry_t {
   coap_tick_t expire_ticks;
   unsigned int idle_timeout;
   coap_cache_app_data_free_callback_t callback;
+  size_t size;                     /**< bytes charged to the cache size */
+  struct coap_cache_entry_t *lru_prev; /**< context's cache_lru list, */
+  struct coap_cache_entry_t *lru_next; /**< least recently used first */
+  coap_tick_t timer_due;           /**< expire_ticks when put in the heap */
+  struct coap_cache_entry_t *timer_child;   /**< Links for context's */
+  struct coap_cache_entry_t *timer_sibling; /**< cache_timers heap */
+  struct coap_cache_entry_t *timer_prev;
+  uint8_t in_timers;               /**< set if in the cache_timers heap */
+  coap_resource_t *resource;       /**< resource of a cached response, or NULL */
+  struct coap_cache_entry_t *rnext; /**< next in resource's cached responses */
+  coap_tick_t fresh_ticks;         /**< cached response is fresh until then */
+  uint8_t request_code;            /**< method of the cached request */
+  uint8_t shared;                  /**< set if in the cache backend */
 };
 
+/*
+ * What is handed to the cache backend: a version byte, the idle timeout (4
+ * bytes, network order) and then the recorded PDU in the CoAP over UDP
+ * format.
+ */
+#define COAP_CACHE_BACKEND_VERSION 1
+#define COAP_CACHE_BACKEND_HDR 5
+
+/**
+ * Removes @p cache_entry from the cache of @p context and frees it off,
+ * leaving any copy in the cache backend alone.
+ *
+ * Internal function.
+ *
+ * @param context     The context.
+ * @param cache_entry The cache-entry to free off.
+ */
+void coap_cache_free_entry(coap_context_t *context,
+                           coap_cache_entry_t *cache_entry);
+
 /**
  * Expire coap_cache_entry_t entries
  *
@@ -53,6 +86,71 @@ struct coap_cache_entry_t {
  */
 void coap_expire_cache_entries(coap_context_t *context);
 
+/**
+ * Calculates the cache-key for @p pdu like coap_cache_derive_key(), but
+ * into the caller's @p cache_key rather than a newly allocated one.
+ *
+ * Internal function.
+ *
+ * @param session       The session to add into cache-key if @p session_based
+ *                      is set.
+ * @param pdu           The CoAP PDU for which a cache-key is to be calculated.
+ * @param session_based COAP_CACHE_IS_SESSION_BASED if session based
+ *                      cache-key, else COAP_CACHE_NOT_SESSION_BASED.
+ * @param cache_key     Where to put the cache-key.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_cache_derive_key_buf(const coap_session_t *session,
+                              const coap_pdu_t *pdu,
+                              coap_cache_session_based_t session_based,
+                              coap_cache_key_t *cache_key);
+
+/**
+ * Fills in @p response from the response cached for @p request, if there is
+ * one that is still fresh. Only used for resources created with
+ * COAP_RESOURCE_FLAGS_CACHE_RESPONSES.
+ *
+ * Internal function.
+ *
+ * @param session  The session the request came in on.
+ * @param resource The resource the request is for.
+ * @param request  The request.
+ * @param response The response, with the token already added.
+ *
+ * @return @c 1 if @p response has been filled in, else @c 0 and the
+ *         handler has to be called.
+ */
+int coap_cache_fill_response(coap_session_t *session,
+                             coap_resource_t *resource,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response);
+
+/**
+ * Keeps a copy of the @p response to @p request for as long as its Max-Age,
+ * if the response can be cached.
+ *
+ * Internal function.
+ *
+ * @param session  The session the request came in on.
+ * @param resource The resource the request is for.
+ * @param request  The request.
+ * @param response The response returned by the handler.
+ */
+void coap_cache_store_response(coap_session_t *session,
+                               coap_resource_t *resource,
+                               coap_pdu_t *request,
+                               coap_pdu_t *response);
+
+/**
+ * Deletes all the responses cached for @p resource.
+ *
+ * Internal function.
+ *
+ * @param resource The resource that has changed.
+ */
+void coap_cache_invalidate_resource(coap_resource_t *resource);
+
 typedef void coap_digest_ctx_t;
 
 /**
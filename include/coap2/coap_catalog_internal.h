@@ -0,0 +1,104 @@
+/*
+ * coap_catalog_internal.h -- Storage of the compact resources of a context
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_catalog_internal.h
+ * @brief Internal compact resource storage functions
+ */
+
+#ifndef COAP_CATALOG_INTERNAL_H_
+#define COAP_CATALOG_INTERNAL_H_
+
+/**
+ * @defgroup catalog_internal Compact Resource Storage (Internal)
+ * The storage that the resources added with coap_add_resources_compact()
+ * share: their URI paths and attributes are kept in an arena, the attribute
+ * names and values are interned, and the handler sets are shared by
+ * reference.  None of it is released before the context is freed.
+ * Internal API functions
+ * @{
+ */
+
+/**
+ * Smallest block that the arena of the compact resources takes from the
+ * heap.
+ */
+#ifndef COAP_CATALOG_BLOCK_SIZE
+#define COAP_CATALOG_BLOCK_SIZE (64 * 1024)
+#endif /* COAP_CATALOG_BLOCK_SIZE */
+
+typedef struct coap_catalog_t coap_catalog_t;
+
+/**
+ * Returns the compact resource storage of @p context, which is created if
+ * it has none yet.
+ *
+ * @param context The context.
+ *
+ * @return The storage or @c NULL if out of memory.
+ */
+coap_catalog_t *coap_catalog_get(coap_context_t *context);
+
+/**
+ * Releases the compact resource storage of @p context, once there are no
+ * more resources that use it.
+ *
+ * @param context The context.
+ */
+void coap_catalog_free(coap_context_t *context);
+
+/**
+ * Returns the copy of the string @p s of @p length bytes kept in
+ * @p catalog, which is made if there is none yet.
+ *
+ * @param catalog The storage.
+ * @param s       The string.
+ * @param length  The length of @p s.
+ *
+ * @return The interned string or @c NULL if out of memory.
+ */
+coap_str_const_t *coap_catalog_intern(coap_catalog_t *catalog,
+                                      const uint8_t *s, size_t length);
+
+/**
+ * Copies the string @p s of @p length bytes into the arena of @p catalog,
+ * without interning it.
+ *
+ * @param catalog The storage.
+ * @param s       The string.
+ * @param length  The length of @p s.
+ *
+ * @return The copy or @c NULL if out of memory.
+ */
+coap_str_const_t *coap_catalog_copy(coap_catalog_t *catalog,
+                                    const uint8_t *s, size_t length);
+
+/**
+ * Allocates @p size bytes from the arena of @p catalog.
+ *
+ * @param catalog The storage.
+ * @param size    The number of bytes needed.
+ *
+ * @return The memory or @c NULL if out of memory.
+ */
+void *coap_catalog_alloc(coap_catalog_t *catalog, size_t size);
+
+/**
+ * Returns the handler set of @p catalog with the COAP_RESOURCE_METHODS
+ * handlers of @p handlers, which is made if there is none yet.
+ *
+ * @param catalog  The storage.
+ * @param handlers The handlers, indexed by method - 1, or @c NULL for none.
+ *
+ * @return The shared handler set or @c NULL if out of memory.
+ */
+coap_method_handler_t *coap_catalog_handlers(coap_catalog_t *catalog,
+                                     const coap_method_handler_t *handlers);
+
+/** @} */
+
+#endif /* COAP_CATALOG_INTERNAL_H_ */
@@ -0,0 +1,649 @@
+/*
+ * coap_coro.hpp -- C++20 coroutines on top of the request handlers
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_coro.hpp
+ * @brief C++20 coroutines for clients and resource handlers
+ */
+
+#ifndef COAP_CORO_HPP_
+#define COAP_CORO_HPP_
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "coap2/coap_coro.hpp needs a C++20 compiler with coroutine support"
+#endif
+
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <string_view>
+
+#include "coap2/coap.h"
+
+/**
+ * @defgroup coro C++20 Coroutines
+ * A header-only layer that lets C++20 code await the responses to its
+ * requests, and write resource handlers that wait for something else
+ * before they answer, without chains of call-backs:
+ *
+ * @code
+ * coap::task fetch(coap::session s) {
+ *   coap::response r = co_await s.get("sensors/temp");
+ *   if (r.ok())
+ *     use(r.code(), r.body());
+ * }
+ *
+ * coap::handler hnd_get_proxied(coap::exchange ex) {
+ *   coap::response r = co_await upstream.get("data");
+ *   coap_pdu_t *response = ex.response();
+ *   if (response) {
+ *     response->code = r.ok() ? r.code() : COAP_RESPONSE_CODE(504);
+ *     coap_add_data(response, r.body().size(),
+ *                   (const uint8_t *)r.body().data());
+ *   }
+ * }
+ *
+ * coap::register_handler<hnd_get_proxied>(resource, COAP_REQUEST_GET);
+ * @endcode
+ *
+ * A request is sent with coap_send_request(), whose handler resumes the
+ * awaiting coroutine with the response, keyed by the token of the request.
+ * The awaiter lives in the frame of the coroutine, so awaiting a response
+ * allocates nothing beyond the request itself.  A coroutine is resumed
+ * from within coap_io_process() (or whatever drives the context), on the
+ * thread of the context, and the response it is given is only valid until
+ * it next suspends or returns.  If the frame of a coroutine is destroyed
+ * while it waits, the request is cancelled with coap_cancel_request().
+ *
+ * A resource handler that suspends before it has answered is carried on
+ * by coap_register_async(): the request is acknowledged as usual for a
+ * separate response, and the response is sent when the coroutine returns.
+ *
+ * Coroutines must have run to completion before the context is released.
+ * Block-wise responses are only passed on whole if the session has
+ * COAP_BLOCK_USE_LIBCOAP and COAP_BLOCK_SINGLE_BODY set (see
+ * coap_context_set_block_mode()).
+ * @{
+ */
+
+namespace coap {
+
+/**
+ * The response to a request, as given back by co_await.  Its status and
+ * code stay valid, but its PDU and body only until the coroutine next
+ * suspends or returns, and must be copied if they are needed after that.
+ */
+class response {
+public:
+  response() noexcept = default;
+  response(coap_request_status_t status, coap_pdu_t *pdu) noexcept
+    : status_(status), pdu_(pdu), code_(pdu ? pdu->code : 0) {}
+
+  /** The outcome of the request. */
+  coap_request_status_t status() const noexcept { return status_; }
+
+  /** Whether a response has been received, whatever its code. */
+  bool ok() const noexcept { return status_ == COAP_REQUEST_STATUS_OK; }
+
+  /** Whether the request timed out. */
+  bool timed_out() const noexcept {
+    return status_ == COAP_REQUEST_STATUS_TIMEOUT;
+  }
+
+  /**
+   * The response, or NULL unless ok().  It is only valid until the
+   * coroutine next suspends or returns.
+   */
+  coap_pdu_t *pdu() const noexcept { return pdu_; }
+
+  /** The code of the response, or 0 unless ok(). */
+  uint8_t code() const noexcept { return code_; }
+
+  /** The body of the response, valid as long as pdu(). */
+  std::string_view body() const noexcept {
+    size_t length, offset, total;
+    const uint8_t *data;
+
+    if (!pdu_ || !coap_get_data_large(pdu_, &length, &data, &offset, &total))
+      return std::string_view();
+    return std::string_view(reinterpret_cast<const char *>(data), length);
+  }
+
+private:
+  coap_request_status_t status_ = COAP_REQUEST_STATUS_FAILED;
+  coap_pdu_t *pdu_ = nullptr;
+  uint8_t code_ = 0;
+};
+
+/**
+ * Awaits the response to a request.  The request is sent when it is
+ * awaited, and the coroutine is resumed with its final response, or when
+ * it has timed out or failed.  An awaiter that is destroyed while the
+ * request is still waiting cancels it, and one that is never awaited
+ * releases the request unsent.
+ */
+class request_awaiter {
+public:
+  /**
+   * Awaits the response to @p pdu, which must carry a token that is not
+   * in use by another request of @p session.  The awaiter takes over
+   * @p pdu.
+   *
+   * @param session    The session to send the request on.
+   * @param pdu        The request, or NULL for the request to fail.
+   * @param timeout_ms The time within which the response must have been
+   *                   received, or @c 0 for no timeout.
+   */
+  request_awaiter(coap_session_t *session, coap_pdu_t *pdu,
+                  unsigned int timeout_ms) noexcept
+    : session_(session), pdu_(pdu), timeout_ms_(timeout_ms) {
+    if (pdu_) {
+      token_length_ = pdu_->token_length;
+      std::memcpy(token_, pdu_->token, token_length_);
+    }
+  }
+
+  /**
+   * Awaits the response to a request of @p method for @p uri, which is
+   * either a path with an optional query ("a/b?x=1&y") relative to the
+   * server of @p session, or a full URI whose host and port are ignored.
+   * The segments of the path and query are taken as they are, without
+   * percent-decoding.  A new token is given to the request.
+   *
+   * @param session        The session to send the request on.
+   * @param method         The method of the request.
+   * @param uri            The path and query of the request.
+   * @param payload        The payload of the request, if any.
+   * @param content_format The Content-Format of @p payload, or @c -1 for
+   *                       none.
+   * @param timeout_ms     The time within which the response must have
+   *                       been received, or @c 0 for no timeout.
+   */
+  request_awaiter(coap_session_t *session, coap_request_t method,
+                  std::string_view uri, std::string_view payload,
+                  int content_format, unsigned int timeout_ms) noexcept
+    : session_(session), timeout_ms_(timeout_ms) {
+    pdu_ = build(method, uri, payload, content_format);
+  }
+
+  request_awaiter(const request_awaiter &) = delete;
+  request_awaiter &operator=(const request_awaiter &) = delete;
+
+  ~request_awaiter() {
+    if (waiting_) {
+      coap_binary_t token = { token_length_, token_ };
+      coap_cancel_request(session_, &token);
+    }
+    if (pdu_)
+      coap_delete_pdu(pdu_);
+  }
+
+  bool await_ready() const noexcept { return !pdu_; }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    coap_pdu_t *pdu = pdu_;
+
+    awaiting_ = awaiting;
+    pdu_ = nullptr;
+    waiting_ = true;
+    sending_ = true;
+    if (coap_send_request(session_, pdu, handle_response, this,
+                          timeout_ms_) == COAP_INVALID_MID)
+      waiting_ = false;
+    sending_ = false;
+    /* Not suspended if it is over before it was sent */
+    return waiting_;
+  }
+
+  response await_resume() const noexcept { return result_; }
+
+private:
+  coap_pdu_t *build(coap_request_t method, std::string_view uri,
+                    std::string_view payload, int content_format) noexcept {
+    coap_pdu_t *pdu;
+    size_t length;
+
+    if (!session_)
+      return nullptr;
+    pdu = coap_pdu_init(COAP_MESSAGE_CON, method,
+                        coap_new_message_id(session_),
+                        coap_session_max_pdu_size(session_));
+    if (!pdu)
+      return nullptr;
+    coap_session_new_token(session_, &length, token_);
+    token_length_ = length;
+    if (!coap_add_token(pdu, token_length_, token_))
+      goto error;
+
+    {
+      std::string_view path = uri, query;
+      size_t pos = uri.find("://");
+
+      if (pos != std::string_view::npos) {
+        coap_uri_t parsed;
+
+        if (coap_split_uri(reinterpret_cast<const uint8_t *>(uri.data()),
+                           uri.size(), &parsed) < 0)
+          goto error;
+        path = std::string_view(reinterpret_cast<const char *>(parsed.path.s),
+                                parsed.path.length);
+        query = std::string_view(
+                  reinterpret_cast<const char *>(parsed.query.s),
+                  parsed.query.length);
+      } else if ((pos = uri.find('?')) != std::string_view::npos) {
+        path = uri.substr(0, pos);
+        query = uri.substr(pos + 1);
+      }
+      if (!add_segments(pdu, COAP_OPTION_URI_PATH, path, '/'))
+        goto error;
+      if (content_format >= 0) {
+        uint8_t buf[4];
+
+        if (!coap_add_option(pdu, COAP_OPTION_CONTENT_FORMAT,
+                             coap_encode_var_safe(buf, sizeof(buf),
+                                                  content_format),
+                             buf))
+          goto error;
+      }
+      if (!add_segments(pdu, COAP_OPTION_URI_QUERY, query, '&'))
+        goto error;
+    }
+    if (!payload.empty() &&
+        !coap_add_data(pdu, payload.size(),
+                       reinterpret_cast<const uint8_t *>(payload.data())))
+      goto error;
+    return pdu;
+
+  error:
+    coap_delete_pdu(pdu);
+    return nullptr;
+  }
+
+  static bool add_segments(coap_pdu_t *pdu, uint16_t number,
+                           std::string_view s, char separator) noexcept {
+    while (!s.empty()) {
+      size_t end = s.find(separator);
+      std::string_view segment = s.substr(0, end);
+
+      if (!segment.empty() &&
+          !coap_add_option(pdu, number, segment.size(),
+                           reinterpret_cast<const uint8_t *>(segment.data())))
+        return false;
+      if (end == std::string_view::npos)
+        break;
+      s.remove_prefix(end + 1);
+    }
+    return true;
+  }
+
+  static coap_response_t handle_response(coap_session_t *session,
+                                         coap_pdu_t *received,
+                                         coap_request_status_t status,
+                                         void *arg) noexcept {
+    request_awaiter *self = static_cast<request_awaiter *>(arg);
+    coap_opt_iterator_t opt_iter;
+    coap_block_t block;
+
+    (void)session;
+    /* Only the final response resumes the coroutine, as the handler is
+       called no more after it */
+    if (status == COAP_REQUEST_STATUS_OK) {
+      if (COAP_RESPONSE_CLASS(received->code) == 2 &&
+          coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter))
+        return COAP_RESPONSE_OK;
+      if ((coap_get_block(received, COAP_OPTION_BLOCK2, &block) ||
+           coap_get_block(received, COAP_OPTION_Q_BLOCK2, &block)) &&
+          block.m)
+        return COAP_RESPONSE_OK;
+    }
+    self->waiting_ = false;
+    self->result_ = response(status, received);
+    /* The awaiter may be gone once the coroutine has been resumed */
+    if (!self->sending_)
+      self->awaiting_.resume();
+    return COAP_RESPONSE_OK;
+  }
+
+  coap_session_t *session_;
+  coap_pdu_t *pdu_ = nullptr;
+  unsigned int timeout_ms_;
+  bool waiting_ = false;
+  bool sending_ = false;
+  size_t token_length_ = 0;
+  uint8_t token_[8];
+  std::coroutine_handle<> awaiting_;
+  response result_;
+};
+
+/**
+ * A non-owning handle on a client session that sends requests to be
+ * awaited.
+ */
+class session {
+public:
+  /**
+   * @param s          The session, which must outlive the requests.
+   * @param timeout_ms The time within which the response to each request
+   *                   must have been received, or @c 0 for no timeout.
+   */
+  explicit session(coap_session_t *s, unsigned int timeout_ms = 0) noexcept
+    : session_(s), timeout_ms_(timeout_ms) {}
+
+  coap_session_t *native() const noexcept { return session_; }
+
+  void set_timeout(unsigned int timeout_ms) noexcept {
+    timeout_ms_ = timeout_ms;
+  }
+
+  request_awaiter get(std::string_view uri) const noexcept {
+    return request(COAP_REQUEST_GET, uri);
+  }
+
+  request_awaiter del(std::string_view uri) const noexcept {
+    return request(COAP_REQUEST_DELETE, uri);
+  }
+
+  request_awaiter put(std::string_view uri, std::string_view payload,
+                      int content_format = -1) const noexcept {
+    return request(COAP_REQUEST_PUT, uri, payload, content_format);
+  }
+
+  request_awaiter post(std::string_view uri, std::string_view payload,
+                       int content_format = -1) const noexcept {
+    return request(COAP_REQUEST_POST, uri, payload, content_format);
+  }
+
+  request_awaiter request(coap_request_t method, std::string_view uri,
+                          std::string_view payload = std::string_view(),
+                          int content_format = -1) const noexcept {
+    return request_awaiter(session_, method, uri, payload, content_format,
+                           timeout_ms_);
+  }
+
+  /** Awaits the response to @p pdu, which must carry a token. */
+  request_awaiter send(coap_pdu_t *pdu) const noexcept {
+    return request_awaiter(session_, pdu, timeout_ms_);
+  }
+
+private:
+  coap_session_t *session_;
+  unsigned int timeout_ms_;
+};
+
+/**
+ * A coroutine that is started straight away and is not waited for, such
+ * as a client that awaits responses.  Its frame is released when it
+ * returns.
+ */
+class task {
+public:
+  struct promise_type {
+    task get_return_object() noexcept { return task(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+#ifndef COAP_WITHOUT_ASYNC
+
+class handler;
+
+/**
+ * A request that is being handled by a coroutine, as passed to it by
+ * register_handler().  Until the coroutine first suspends, it answers
+ * with the response of the method handler, as an ordinary handler does.
+ * After that, the request is carried on with coap_register_async(), and
+ * response() is a separate response that is sent when the coroutine
+ * returns, so it is best built after the last co_await.
+ */
+class exchange {
+public:
+  exchange(coap_context_t *context, coap_resource_t *resource,
+           coap_session_t *session, coap_pdu_t *request,
+           coap_binary_t *token, coap_string_t *query,
+           coap_pdu_t *response) noexcept
+    : context_(context), resource_(resource), session_(session),
+      request_(request), token_(token), query_(query), response_(response) {}
+
+  exchange(exchange &&) noexcept = default;
+  exchange(const exchange &) = delete;
+  exchange &operator=(const exchange &) = delete;
+
+  coap_context_t *context() const noexcept { return context_; }
+  coap_resource_t *resource() const noexcept { return resource_; }
+  coap_session_t *session() const noexcept { return session_; }
+
+  /** The request, or NULL once the coroutine has suspended. */
+  coap_pdu_t *request() const noexcept { return request_; }
+
+  /** The token of the request, or NULL once the coroutine has suspended. */
+  coap_binary_t *token() const noexcept { return token_; }
+
+  /** The query of the request, or NULL once the coroutine has suspended. */
+  coap_string_t *query() const noexcept { return query_; }
+
+  /** Whether the coroutine has suspended, and answers separately. */
+  bool separate() const noexcept { return async_; }
+
+  /**
+   * Whether the request has gone without an answer for too long (see
+   * coap_async_set_timeout()), so that a response would not be sent.
+   */
+  bool expired() const noexcept { return async_ && !find_async(); }
+
+  /**
+   * The response, or NULL if there is to be none.  Once the coroutine has
+   * suspended, it is allocated when first asked for, and may then be NULL
+   * for lack of memory.  A separate response is only sent if its code is
+   * set.
+   */
+  coap_pdu_t *response() noexcept {
+    if (!response_ && async_ && !abandoned_) {
+      response_ = coap_pdu_init(confirmable_ ? COAP_MESSAGE_CON
+                                             : COAP_MESSAGE_NON,
+                                0, coap_new_message_id(session_),
+                                coap_session_max_pdu_size(session_));
+      if (response_ && token_length_ &&
+          !coap_add_token(response_, token_length_, token_data_)) {
+        coap_delete_pdu(response_);
+        response_ = nullptr;
+      }
+    }
+    return response_;
+  }
+
+  /**
+   * Sets @p seconds for the request to be answered in, once the coroutine
+   * has suspended, after which a 5.03 (Service Unavailable) response is
+   * sent instead, unless the application has its own
+   * coap_register_async_timeout_handler().
+   */
+  void set_timeout(unsigned int seconds) noexcept {
+    if (coap_async_state_t *s = find_async())
+      coap_async_set_timeout(s, seconds);
+  }
+
+private:
+  friend class handler;
+
+  coap_async_state_t *find_async() const noexcept {
+    coap_binary_t token = {
+      token_length_, const_cast<uint8_t *>(token_data_)
+    };
+
+    return coap_find_async_token(session_, &token);
+  }
+
+  /* Carries on the request after the method handler has returned */
+  void suspend() noexcept {
+    unsigned char flags = COAP_ASYNC_SEPARATE;
+
+    confirmable_ = request_->type == COAP_MESSAGE_CON;
+    if (confirmable_)
+      flags |= COAP_ASYNC_CONFIRM;
+    token_length_ = request_->token_length;
+    std::memcpy(token_data_, request_->token, token_length_);
+    if (coap_register_async(context_, session_, request_, flags, nullptr)) {
+      coap_session_reference(session_);
+    } else {
+      response_->code = COAP_RESPONSE_CODE(503);
+      abandoned_ = true;
+    }
+    async_ = true;
+    request_ = nullptr;
+    token_ = nullptr;
+    query_ = nullptr;
+    response_ = nullptr;
+  }
+
+  /* Sends the separate response once the coroutine has returned */
+  void finish() noexcept {
+    coap_async_state_t *s;
+
+    if (abandoned_)
+      return;
+    s = find_async();
+    if (s && response_ && response_->code) {
+      coap_send(session_, response_);
+      response_ = nullptr;
+    }
+    if (response_)
+      coap_delete_pdu(response_);
+    response_ = nullptr;
+    if (s) {
+      coap_async_state_t *removed;
+
+      coap_remove_async(context_, session_, s->id, &removed);
+      coap_free_async(removed);
+    }
+    coap_session_release(session_);
+  }
+
+  void fail() noexcept {
+    coap_pdu_t *pdu = response();
+
+    if (pdu)
+      pdu->code = COAP_RESPONSE_CODE(500);
+  }
+
+  coap_context_t *context_;
+  coap_resource_t *resource_;
+  coap_session_t *session_;
+  coap_pdu_t *request_;
+  coap_binary_t *token_;
+  coap_string_t *query_;
+  coap_pdu_t *response_;
+  bool async_ = false;
+  bool abandoned_ = false;
+  bool confirmable_ = false;
+  size_t token_length_ = 0;
+  uint8_t token_data_[8];
+};
+
+/**
+ * The return type of a coroutine that handles a request, which takes its
+ * exchange by value.  An exception that escapes it answers with 5.00
+ * (Internal Server Error).
+ */
+class handler {
+public:
+  struct promise_type {
+    explicit promise_type(exchange &ex) noexcept : exchange_(&ex) {}
+
+    handler get_return_object() noexcept {
+      return handler(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+
+    /* Left for the method handler to release if it returns straight away,
+       else released here once the separate response is sent */
+    struct final_awaiter {
+      bool separate;
+      bool await_ready() const noexcept { return separate; }
+      void await_suspend(std::coroutine_handle<>) const noexcept {}
+      void await_resume() const noexcept {}
+    };
+
+    final_awaiter final_suspend() noexcept {
+      if (exchange_->async_)
+        exchange_->finish();
+      return final_awaiter{ exchange_->async_ };
+    }
+
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { exchange_->fail(); }
+
+    exchange *exchange_;
+  };
+
+  handler(handler &&other) noexcept : coroutine_(other.coroutine_) {
+    other.coroutine_ = nullptr;
+  }
+  handler(const handler &) = delete;
+  handler &operator=(const handler &) = delete;
+
+  /*
+   * Called by the method handler once the coroutine has returned or
+   * suspended for the first time.
+   */
+  void start() noexcept {
+    std::coroutine_handle<promise_type> coroutine = coroutine_;
+
+    coroutine_ = nullptr;
+    if (coroutine.done())
+      coroutine.destroy();
+    else
+      coroutine.promise().exchange_->suspend();
+  }
+
+  ~handler() {
+    if (coroutine_)
+      start();
+  }
+
+private:
+  explicit handler(std::coroutine_handle<promise_type> coroutine) noexcept
+    : coroutine_(coroutine) {}
+
+  std::coroutine_handle<promise_type> coroutine_;
+};
+
+namespace detail {
+
+template <handler (*Fn)(exchange)>
+void method_handler(coap_context_t *context, coap_resource_t *resource,
+                    coap_session_t *session, coap_pdu_t *request,
+                    coap_binary_t *token, coap_string_t *query,
+                    coap_pdu_t *response) {
+  Fn(exchange(context, resource, session, request, token, query,
+              response)).start();
+}
+
+} /* namespace detail */
+
+/**
+ * Registers the coroutine @p Fn as the handler of @p method for
+ * @p resource, as coap_register_handler() does.
+ *
+ * @param resource The resource.
+ * @param method   The method of the requests.
+ */
+template <handler (*Fn)(exchange)>
+void register_handler(coap_resource_t *resource, coap_request_t method) {
+  coap_register_handler(resource, method, detail::method_handler<Fn>);
+}
+
+#endif /* COAP_WITHOUT_ASYNC */
+
+} /* namespace coap */
+
+/** @} */
+
+#endif /* COAP_CORO_HPP_ */
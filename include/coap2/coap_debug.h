@@ -107,6 +107,26 @@ typedef void (*coap_log_handler_t) (coap_log_t level, const char *message);
  */
 void coap_set_log_handler(coap_log_handler_t handler);
 
+/**
+ * Hands the output of coap_log() over to a background thread, so that the
+ * calling thread only formats the message and queues it with its level
+ * and time, without taking a lock.  The thread adds the time stamp and
+ * writes the messages out, or passes them to the handler set with
+ * coap_set_log_handler(), which is then called on that thread.  Messages
+ * that do not fit into the queue are dropped and counted, and the count
+ * is logged once there is room again.  The queue is drained and the thread
+ * stopped by coap_cleanup().  This must not be called while other threads
+ * may be logging.
+ *
+ * @param queue_size The size of the queue in bytes, or @c 0 for the output
+ *                   to be written straight away again (the default), once
+ *                   the queue has been drained.
+ *
+ * @return @c 1 on success, else @c 0 if there are no threads or the queue
+ *         cannot be set up.
+ */
+int coap_set_log_async(size_t queue_size);
+
 /**
  * Get the library package name.
  *
@@ -138,17 +158,37 @@ void coap_log_impl(coap_log_t level,
 void coap_log_impl(coap_log_t level, const char *format, ...);
 #endif
 
+#ifndef COAP_MAX_LOG_LEVEL
+/**
+ * The most verbose level that coap_log() is compiled in for.  The calls for
+ * the levels above it are removed by the compiler, whatever the level set
+ * with coap_set_log_level().  Defaults to all the levels.
+ */
+#define COAP_MAX_LOG_LEVEL COAP_LOG_CIPHERS
+#endif
+
+/**
+ * Checks whether output at @p level is both compiled in and enabled, so
+ * that output that is costly to prepare can be skipped otherwise.
+ *
+ * @param level One of the LOG_* values.
+ */
+#define coap_log_enabled(level) \
+  ((int)(level) <= (int)COAP_MAX_LOG_LEVEL && \
+   (int)(level) <= (int)coap_get_log_level())
+
 #ifndef coap_log
 /**
  * Logging function.
  * Writes the given text to @c COAP_ERR_FD (for @p level <= @c LOG_CRIT) or @c
  * COAP_DEBUG_FD (for @p level >= @c LOG_ERR). The text is output only when
- * @p level is below or equal to the log level that set by coap_set_log_level().
+ * @p level is below or equal to the log level that set by coap_set_log_level()
+ * and to @c COAP_MAX_LOG_LEVEL.  The arguments are only evaluated then.
  *
  * @param level One of the LOG_* values.
  */
 #define coap_log(level, ...) do { \
-  if ((int)((level))<=(int)coap_get_log_level()) \
+  if (coap_log_enabled(level)) \
      coap_log_impl((level), __VA_ARGS__); \
 } while(0)
 #endif
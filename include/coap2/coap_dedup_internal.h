@@ -0,0 +1,63 @@
+/*
+ * coap_dedup_internal.h -- Responses to recently received CON requests
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_dedup_internal.h
+ * @brief Internal CON request deduplication functions
+ */
+
+#ifndef COAP_DEDUP_INTERNAL_H_
+#define COAP_DEDUP_INTERNAL_H_
+
+/**
+ * @defgroup dedup_internal Request Deduplication (Internal)
+ * Functions that keep the responses to the Confirmable requests that a
+ * session has received for EXCHANGE_LIFETIME, so that a duplicate of a
+ * request (sent again as the ACK was lost) is answered without being
+ * handled a second time (RFC 7252 4.5).
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_dedup_t coap_dedup_t;
+
+/**
+ * Checks whether the Confirmable request @p pdu that @p session has
+ * received is a duplicate of one received within EXCHANGE_LIFETIME.  If it
+ * is not, it is recorded as received.
+ *
+ * @param session  The session.
+ * @param pdu      The Confirmable request.
+ * @param response Set to the response that was sent to the original
+ *                 request if @p pdu is a duplicate, or to NULL if no
+ *                 response has been sent yet.
+ *
+ * @return @c 1 if @p pdu is a duplicate, else @c 0.
+ */
+int coap_dedup_check(coap_session_t *session, const coap_pdu_t *pdu,
+                     const coap_pdu_t **response);
+
+/**
+ * Keeps a copy of the ACK or RST @p pdu that @p session is sending, if it
+ * answers a Confirmable request that was recorded by coap_dedup_check().
+ * The header of @p pdu must have been encoded.
+ *
+ * @param session The session.
+ * @param pdu     The ACK or RST.
+ */
+void coap_dedup_store(coap_session_t *session, const coap_pdu_t *pdu);
+
+/**
+ * Releases all the requests recorded for @p session.
+ *
+ * @param session The session.
+ */
+void coap_dedup_free(coap_session_t *session);
+
+/** @} */
+
+#endif /* COAP_DEDUP_INTERNAL_H_ */
@@ -0,0 +1,82 @@
+/*
+ * coap_defer_internal.h -- Requests handled by worker threads
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_defer_internal.h
+ * @brief Internal deferred request functions
+ */
+
+#ifndef COAP_DEFER_INTERNAL_H_
+#define COAP_DEFER_INTERNAL_H_
+
+/**
+ * @defgroup defer_internal Deferred Requests (Internal)
+ * Functions that run the slow part of the handling of a request in a pool
+ * of worker threads, and pass the response back to the I/O thread.
+ * Internal API functions
+ * @{
+ */
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_LOCK) && \
+    defined(__GNUC__) && !defined(_WIN32) && !defined(WITH_CONTIKI) && \
+    !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#define COAP_DEFER_WORKERS 1
+#else
+#define COAP_DEFER_WORKERS 0
+#endif
+
+typedef struct coap_defer_pool_t coap_defer_pool_t;
+typedef struct coap_defer_job_t coap_defer_job_t;
+
+/**
+ * Allocates the posted event that the worker thread running @p job uses to
+ * pass it back to the I/O thread, so that doing so cannot fail.
+ *
+ * @param job The deferred request.
+ *
+ * @return The event, to be freed with coap_free_type(COAP_STRING) if it
+ *         is never posted, or NULL on failure.
+ */
+struct coap_post_t *coap_post_defer_new(coap_defer_job_t *job);
+
+/**
+ * Passes a finished deferred request back to the I/O thread of
+ * @p context, which then calls coap_defer_done().  This may be called from
+ * any thread.
+ *
+ * @param context The context.
+ * @param post    The event returned by coap_post_defer_new().
+ */
+void coap_post_defer(coap_context_t *context, struct coap_post_t *post);
+
+/**
+ * Sends the response of a deferred request that a worker thread has
+ * finished with, and then releases @p job.  Called from the I/O loop.
+ *
+ * @param job The deferred request.
+ */
+void coap_defer_done(coap_defer_job_t *job);
+
+/**
+ * Releases @p job without sending its response.
+ *
+ * @param job The deferred request.
+ */
+void coap_defer_job_free(coap_defer_job_t *job);
+
+/**
+ * Stops the worker threads of @p context, once they have finished with all
+ * the requests queued for them.  The requests are then passed back as
+ * posted events.
+ *
+ * @param context The context.
+ */
+void coap_defer_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_DEFER_INTERNAL_H_ */
@@ -24,6 +24,9 @@
 #define COAP_DTLS_HINT_LENGTH 128
 #endif
 
+/** The length of the key protecting (D)TLS session tickets */
+#define COAP_DTLS_TICKET_KEY_LEN 64
+
 /* https://tools.ietf.org/html/rfc6347#section-4.2.4.1 */
 #ifndef COAP_DTLS_RETRANSMIT_MS
 #define COAP_DTLS_RETRANSMIT_MS 1000
@@ -517,6 +520,41 @@ int
 coap_dtls_context_set_cpsk(struct coap_context_t *coap_context,
                           coap_dtls_cpsk_t *setup_data);
 
+/**
+ * Set the key with which the DTLS context protects the session tickets it
+ * issues to clients, or stop issuing them if @p key is NULL.
+ *
+ * Internal function.
+ *
+ * @param coap_context The CoAP context.
+ * @param key          The key, originally passed into
+ *                     coap_context_set_session_ticket_key(), or NULL.
+ * @param key_len      The length of @p key, which is
+ *                     #COAP_DTLS_TICKET_KEY_LEN.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int
+coap_dtls_context_set_ticket_key(struct coap_context_t *coap_context,
+                                 const uint8_t *key, size_t key_len);
+
+/**
+ * Make the DTLS context of @p coap_context use the (D)TLS configuration of
+ * the DTLS context of @p from: its PKI and PSK set up, root CAs and session
+ * ticket key.  Where the (D)TLS library can share the loaded configuration
+ * it is shared, otherwise it is copied.
+ *
+ * Internal function.
+ *
+ * @param coap_context The CoAP context, which has no sessions yet.
+ * @param from         The CoAP context with the configuration.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int
+coap_dtls_context_share(struct coap_context_t *coap_context,
+                        struct coap_context_t *from);
+
 /**
  * Set the DTLS context's default server PKI information.
  * This does the PKI specifics following coap_dtls_new_context().
@@ -722,6 +760,18 @@ int coap_dtls_hello(struct coap_session_t *coap_session,
                     const uint8_t *data,
                     size_t data_len);
 
+/**
+ * Checks whether coap_dtls_hello() takes a ClientHello whose cookie has
+ * already been checked by coap_dtls_cookie_check() as the start of a
+ * handshake, so that no session needs to be set up for the cookie exchange.
+ *
+ * Internal function.
+ *
+ * @return @c 1 if the cookies are checked by libcoap, @c 0 if they are
+ *         exchanged by the (D)TLS library.
+ */
+int coap_dtls_is_cookie_stateless(void);
+
 /**
  * Get DTLS overhead over cleartext PDUs.
  *
@@ -805,6 +855,19 @@ ssize_t coap_tls_read(struct coap_session_t *coap_session,
                       size_t data_len
                       );
 
+/**
+ * Checks whether the records of a TLS session are encrypted by the kernel
+ * (kTLS), so that its application data can be written to the socket
+ * directly.
+ *
+ * Internal function.
+ *
+ * @param coap_session The CoAP session.
+ *
+ * @return          @c 1 if the kernel encrypts the records sent, else @c 0.
+ */
+int coap_tls_is_ktls_send(struct coap_session_t *coap_session);
+
 /**
  * Initialize the underlying (D)TLS Library layer.
  *
@@ -0,0 +1,76 @@
+/*
+ * coap_dtls_cookie_internal.h -- Stateless DTLS cookie exchange
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_dtls_cookie_internal.h
+ * @brief Internal stateless DTLS cookie functions
+ */
+
+#ifndef COAP_DTLS_COOKIE_INTERNAL_H_
+#define COAP_DTLS_COOKIE_INTERNAL_H_
+
+/**
+ * @defgroup dtls_cookie_internal DTLS cookies (Internal)
+ * Functions that check the cookie of a DTLS ClientHello (RFC 6347 4.2.1)
+ * straight from the datagram, so that no session is set up for a peer
+ * until it has shown that it can receive at its address.
+ * Internal API functions
+ * @{
+ */
+
+/** The length of the cookies that are handed out */
+#define COAP_DTLS_COOKIE_LENGTH 16
+
+/** How often the secret that the cookies are made with is changed */
+#define COAP_DTLS_COOKIE_ROTATE_TICKS (60 * COAP_TICKS_PER_SECOND)
+
+typedef struct coap_dtls_cookie_t coap_dtls_cookie_t;
+
+/**
+ * Checks the cookie of the ClientHello in @p packet, received on
+ * @p endpoint from the peer given by @p addr_hash.  If there is no cookie,
+ * or it is not valid, a HelloVerifyRequest with a fresh cookie is sent
+ * back.  Nothing is kept about the peer.
+ *
+ * @param endpoint  The DTLS endpoint that @p packet was received on.
+ * @param packet    The datagram.
+ * @param addr_hash The address of the peer.
+ * @param now       The current time.
+ *
+ * @return @c 1 if the ClientHello has a valid cookie, @c 0 if a
+ *         HelloVerifyRequest has been sent (or could not be), @c -1 if
+ *         @p packet is not a ClientHello.
+ */
+int coap_dtls_cookie_check(coap_endpoint_t *endpoint,
+                           const coap_packet_t *packet,
+                           const coap_addr_hash_t *addr_hash,
+                           coap_tick_t now);
+
+/**
+ * Makes the cookie that the peer given by @p addr_hash is expected to send
+ * back with the current secret of @p context.
+ *
+ * @param context   The context.
+ * @param addr_hash The address of the peer.
+ * @param cookie    Set to the cookie, COAP_DTLS_COOKIE_LENGTH bytes.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_dtls_cookie_make(coap_context_t *context,
+                          const coap_addr_hash_t *addr_hash,
+                          uint8_t *cookie);
+
+/**
+ * Releases the cookie secrets of @p context.
+ *
+ * @param context The context.
+ */
+void coap_dtls_cookie_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_DTLS_COOKIE_INTERNAL_H_ */
@@ -0,0 +1,171 @@
+/*
+ * coap_dtls_offload_internal.h -- DTLS handshakes and records run by worker
+ * threads
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_dtls_offload_internal.h
+ * @brief Internal DTLS handshake and record offload functions
+ */
+
+#ifndef COAP_DTLS_OFFLOAD_INTERNAL_H_
+#define COAP_DTLS_OFFLOAD_INTERNAL_H_
+
+/**
+ * @defgroup dtls_offload_internal DTLS handshake offload (Internal)
+ * Functions that hand the DTLS handshakes of server sessions, and if asked
+ * for the records of the established ones, over to a pool of worker
+ * threads.
+ * Internal API functions
+ * @{
+ */
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_LOCK) && \
+    defined(__GNUC__) && !defined(_WIN32) && !defined(WITH_CONTIKI) && \
+    !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#define COAP_DTLS_OFFLOAD 1
+#else
+#define COAP_DTLS_OFFLOAD 0
+#endif
+
+typedef struct coap_dtls_offload_t coap_dtls_offload_t;
+typedef struct coap_dtls_job_t coap_dtls_job_t;
+
+/**
+ * The actions that a worker thread leaves for the I/O thread to carry out
+ * once it has finished with a session.
+ */
+typedef enum coap_dtls_job_action_t {
+  COAP_DTLS_JOB_EVENT = 1,     /**< call coap_handle_event() */
+  COAP_DTLS_JOB_CONNECTED,     /**< call coap_session_connected() */
+  COAP_DTLS_JOB_DISCONNECTED,  /**< call coap_session_disconnected() */
+  COAP_DTLS_JOB_HELLO,         /**< Client Hello accepted, set up the
+                                    server session */
+  COAP_DTLS_JOB_PDU            /**< call coap_handle_dgram() for a
+                                    decrypted PDU */
+} coap_dtls_job_action_t;
+
+/**
+ * Passes the DTLS record in @p data to the worker threads if @p session is
+ * doing a server side handshake and handshake offload has been enabled by
+ * coap_context_set_dtls_handshake_threads(), or is an established server
+ * session and coap_context_set_dtls_record_offload() has been enabled too.
+ * Records for a session that is in the hands of the workers are queued in
+ * order, even if the session has just become established.
+ *
+ * @param session  The session the record has been received on.
+ * @param data     The received record (is copied).
+ * @param data_len The length of @p data.
+ *
+ * @return @c 1 if the record has been taken over, else @c 0 if it is to be
+ *         handled by the caller.
+ */
+int coap_dtls_offload_packet(coap_session_t *session,
+                             const uint8_t *data, size_t data_len);
+
+/**
+ * Passes the PDU in @p data that is to be sent on @p session to the worker
+ * threads to be encrypted and sent, if the workers have @p session in hand
+ * or @p data is a notification of an established server session for which
+ * record offload is enabled.
+ *
+ * @param session  The session to send on.
+ * @param data     The PDU (is copied).
+ * @param data_len The length of @p data.
+ *
+ * @return @c 1 if the PDU has been taken over, else @c 0 if it is to be
+ *         sent by the caller.
+ */
+int coap_dtls_offload_send(coap_session_t *session,
+                           const uint8_t *data, size_t data_len);
+
+/**
+ * If called by a worker thread, records @p action for @p session to be
+ * carried out by the I/O thread once the worker has finished.
+ *
+ * @param session The session.
+ * @param action  The action to defer.
+ * @param value   The event for COAP_DTLS_JOB_EVENT or the reason for
+ *                COAP_DTLS_JOB_DISCONNECTED.
+ *
+ * @return @c 1 if deferred, else @c 0 if the caller is not a worker thread
+ *         and must carry out the action itself.
+ */
+int coap_dtls_offload_defer(coap_session_t *session,
+                            coap_dtls_job_action_t action, int value);
+
+/**
+ * If called by a worker thread, keeps the PDU in @p data that has been
+ * decrypted for @p session to be passed to coap_handle_dgram() by the I/O
+ * thread once the worker has finished.
+ *
+ * @param session  The session.
+ * @param data     The decrypted PDU (is copied).
+ * @param data_len The length of @p data.
+ *
+ * @return @c 1 if deferred, else @c 0 if the caller is not a worker thread
+ *         and must handle the PDU itself.
+ */
+int coap_dtls_offload_defer_pdu(coap_session_t *session,
+                                const uint8_t *data, size_t data_len);
+
+/**
+ * If called by a worker thread, records that @p session has sent a
+ * datagram, so that its last_rx_tx is updated by the I/O thread once the
+ * worker has finished.
+ *
+ * @param session The session.
+ *
+ * @return @c 1 if recorded, else @c 0 if the caller is not a worker thread
+ *         and must update last_rx_tx itself.
+ */
+int coap_dtls_offload_defer_sent(coap_session_t *session);
+
+/**
+ * Checks whether the caller is a DTLS handshake worker thread.
+ *
+ * @return @c 1 if called from a worker thread, else @c 0.
+ */
+int coap_dtls_offload_in_worker(void);
+
+/**
+ * Waits for the worker threads to finish with @p session, if they have it
+ * in hand, and has them leave the records still queued for it.  Called by
+ * the I/O thread before the (D)TLS state of the session is freed.
+ *
+ * @param session The session.
+ */
+void coap_dtls_offload_cancel(coap_session_t *session);
+
+/**
+ * Carries out the actions left by the worker threads for the sessions
+ * they have finished with.  Called from the I/O loop.
+ *
+ * @param context The context.
+ *
+ * @return The number of sessions still in the hands of the workers.
+ */
+unsigned int coap_dtls_offload_process(coap_context_t *context);
+
+/**
+ * Waits for the worker threads to finish with all the sessions of
+ * @p context, dropping any records and actions that are still pending.
+ * This must be done before any server sessions are freed.
+ *
+ * @param context The context.
+ */
+void coap_dtls_offload_drain(coap_context_t *context);
+
+/**
+ * Stops the worker threads of @p context.
+ *
+ * @param context The context.
+ */
+void coap_dtls_offload_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_DTLS_OFFLOAD_INTERNAL_H_ */
@@ -48,6 +48,13 @@ typedef struct coap_context_t coap_context_t;
  * typedef all the opaque structures that are defined in coap_*_internal.h
  */
 
+/* ************* coap_arena_internal.h ***************** */
+
+/**
+ * Memory of the request being dispatched
+ */
+typedef struct coap_arena_t coap_arena_t;
+
 /* ************* coap_cache_internal.h ***************** */
 
 /**
@@ -66,6 +73,12 @@ typedef struct coap_lg_crcv_t coap_lg_crcv_t;
 
 typedef struct coap_lg_srcv_t coap_lg_srcv_t;
 
+/**
+ * A large body that is shared by all the transfers of the same resource
+ * representation.
+ */
+typedef struct coap_lg_xmit_body_t coap_large_body_t;
+
 /* ************* coap_cache_internal.h ***************** */
 
 /**
@@ -19,6 +19,32 @@
 #include "coap2/uthash.h"
 #include "coap2/str.h"
 
+/**
+ * Calculates the hash that uthash uses for the hash tables of libcoap, in
+ * place of its default Jenkins hash. This is a seeded wyhash-style hash
+ * that reads the key 4 or 8 bytes at a time. The seed is picked at random
+ * by coap_startup(), which makes it hard to flood a table with colliding
+ * keys.
+ *
+ * @param key The key to hash.
+ * @param len The length of @p key.
+ *
+ * @return The hash value of @p key.
+ */
+unsigned int coap_uthash_hash(const void *key, size_t len);
+
+/**
+ * Picks the random seed of coap_uthash_hash(). Called by coap_startup()
+ * before any hash table is used.
+ */
+void coap_uthash_init(void);
+
+/* Applications that use RESOURCES_FIND() or SESSIONS_FIND() must hash the
+ * same way as the library. */
+#undef HASH_FUNCTION
+#define HASH_FUNCTION(keyptr,keylen,hashv) \
+  ((hashv) = coap_uthash_hash((keyptr), (keylen)))
+
 typedef unsigned char coap_key_t[4];
 
 #ifndef coap_hash
@@ -0,0 +1,129 @@
+/*
+ * coap_histogram.h -- Latency histograms
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_histogram.h
+ * @brief Latency histograms
+ */
+
+#ifndef COAP_HISTOGRAM_H_
+#define COAP_HISTOGRAM_H_
+
+/**
+ * @defgroup histogram Latency Histograms
+ * API functions for the histograms of the time taken by request handlers,
+ * by the round trips of confirmable requests and by notifying observers
+ * @{
+ */
+
+/**
+ * Number of bits of each value that are kept beyond its most significant
+ * bit, so that a value is recorded to within 1 / 2^COAP_HISTOGRAM_SUB_BITS.
+ */
+#define COAP_HISTOGRAM_SUB_BITS 3
+
+/**
+ * Number of buckets of a histogram.  Values from 2^(COAP_HISTOGRAM_BUCKETS /
+ * 2^COAP_HISTOGRAM_SUB_BITS + COAP_HISTOGRAM_SUB_BITS - 1) microseconds
+ * (some 4.7 hours) up go into the last bucket.
+ */
+#define COAP_HISTOGRAM_BUCKETS 256
+
+/**
+ * A log-linear histogram of durations in microseconds.  Each power of two
+ * is split into 2^COAP_HISTOGRAM_SUB_BITS buckets of the same width.
+ */
+typedef struct coap_histogram_t {
+  uint64_t count;    /**< Number of values recorded */
+  uint64_t sum;      /**< Sum of the values recorded */
+  uint64_t min;      /**< Smallest value recorded */
+  uint64_t max;      /**< Largest value recorded */
+  uint32_t buckets[COAP_HISTOGRAM_BUCKETS]; /**< Values in each bucket */
+} coap_histogram_t;
+
+/**
+ * Starts or stops keeping the latency histograms of @p context, its
+ * resources and its sessions.  They are not kept by default.  The
+ * histograms are set up on first use and stay, with their values, when
+ * they are no longer kept.
+ *
+ * @param context The context.
+ * @param enable  @c 1 to keep the histograms, @c 0 to stop.
+ */
+void coap_context_set_histograms(coap_context_t *context, int enable);
+
+/**
+ * Takes a snapshot of the histogram of the time taken by the request
+ * handlers of @p resource.
+ *
+ * @param resource  The resource.
+ * @param histogram Set to the histogram.
+ *
+ * @return @c 1 if successful, @c 0 if the histogram has not been set up.
+ */
+int coap_resource_get_handler_histogram(const coap_resource_t *resource,
+                                        coap_histogram_t *histogram);
+
+/**
+ * Takes a snapshot of the histogram of the round trip times of the
+ * confirmable messages sent on @p session, from when they were first sent
+ * until they were acknowledged.  Messages that were retransmitted are left
+ * out.
+ *
+ * @param session   The session.
+ * @param histogram Set to the histogram.
+ *
+ * @return @c 1 if successful, @c 0 if the histogram has not been set up.
+ */
+int coap_session_get_rtt_histogram(const coap_session_t *session,
+                                   coap_histogram_t *histogram);
+
+/**
+ * Takes a snapshot of the histogram of the time taken to notify the
+ * observers of a resource of @p context after it has changed.
+ *
+ * @param context   The context.
+ * @param histogram Set to the histogram.
+ *
+ * @return @c 1 if successful, @c 0 if the histogram has not been set up.
+ */
+int coap_context_get_notify_histogram(const coap_context_t *context,
+                                      coap_histogram_t *histogram);
+
+/**
+ * Adds @p value to @p histogram.  The histogram needs to have been set to
+ * all zeros first, with @p min set to UINT64_MAX.
+ *
+ * @param histogram The histogram.
+ * @param value     The value in microseconds.
+ */
+void coap_histogram_add(coap_histogram_t *histogram, uint64_t value);
+
+/**
+ * Returns the value below which @p percentile percent of the values in
+ * @p histogram lie, to within the width of its bucket.
+ *
+ * @param histogram  The histogram.
+ * @param percentile The percentile, from @c 0 to @c 100.
+ *
+ * @return The value in microseconds, or @c 0 if @p histogram is empty.
+ */
+uint64_t coap_histogram_percentile(const coap_histogram_t *histogram,
+                                   double percentile);
+
+/**
+ * Returns the smallest value that is recorded in @p bucket.
+ *
+ * @param bucket The bucket, less than COAP_HISTOGRAM_BUCKETS.
+ *
+ * @return The value in microseconds.
+ */
+uint64_t coap_histogram_bucket_value(unsigned int bucket);
+
+/** @} */
+
+#endif /* COAP_HISTOGRAM_H_ */
@@ -0,0 +1,51 @@
+/*
+ * coap_histogram_internal.h -- Latency histograms
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_histogram_internal.h
+ * @brief Internal latency histogram functions
+ */
+
+#ifndef COAP_HISTOGRAM_INTERNAL_H_
+#define COAP_HISTOGRAM_INTERNAL_H_
+
+/**
+ * @defgroup histogram_internal Latency Histograms (Internal)
+ * Functions that time the request handlers, the round trips of confirmable
+ * messages and the notifying of observers.
+ * Internal API functions
+ * @{
+ */
+
+/**
+ * Returns the time in microseconds from a monotonic clock, or from the
+ * clock of coap_ticks() where there is none.
+ *
+ * @return The time in microseconds.
+ */
+uint64_t coap_histogram_clock(void);
+
+/**
+ * Records the time taken since @p start in @p *histogram, setting it up on
+ * first use.
+ *
+ * @param histogram The histogram, or where to keep the one set up.
+ * @param start     The start time from coap_histogram_clock().
+ */
+void coap_histogram_record_since(coap_histogram_t **histogram,
+                                 uint64_t start);
+
+/**
+ * Releases @p histogram.
+ *
+ * @param histogram The histogram, or @c NULL.
+ */
+void coap_histogram_free(coap_histogram_t *histogram);
+
+/** @} */
+
+#endif /* COAP_HISTOGRAM_INTERNAL_H_ */
@@ -46,12 +46,32 @@
 #include "coap2/coap_mutex.h"
 
 /* Specifically defined internal .h files */
+#include "coap2/coap_arena_internal.h"
 #include "coap2/coap_asn1_internal.h"
 #include "coap2/coap_block_internal.h"
 #include "coap2/coap_cache_internal.h"
+#include "coap2/coap_catalog_internal.h"
+#include "coap2/coap_dtls_cookie_internal.h"
+#include "coap2/coap_dtls_offload_internal.h"
+#include "coap2/coap_io_internal.h"
+#include "coap2/coap_option_internal.h"
+#include "coap2/coap_oscore_internal.h"
+#include "coap2/coap_probe_internal.h"
+#include "coap2/coap_prng_internal.h"
+#include "coap2/coap_proxy_internal.h"
+#include "coap2/coap_psk_store_internal.h"
+#include "coap2/coap_pki_cache_internal.h"
+#include "coap2/coap_dedup_internal.h"
+#include "coap2/coap_overload_internal.h"
+#include "coap2/coap_ratelimit_internal.h"
+#include "coap2/coap_defer_internal.h"
+#include "coap2/coap_request_internal.h"
 #include "coap2/coap_session_internal.h"
+#include "coap2/coap_session_pool_internal.h"
 #include "coap2/coap_resource_internal.h"
 #include "coap2/coap_subscribe_internal.h"
 #include "coap2/coap_tcp_internal.h"
+#include "coap2/coap_trace_internal.h"
+#include "coap2/coap_histogram_internal.h"
 
 #endif /* COAP_INTERNAL_H_ */
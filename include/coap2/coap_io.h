@@ -31,6 +31,41 @@
 #define COAP_MAX_EPOLL_EVENTS 10
 #endif /* COAP_MAX_EPOLL_EVENTS */
 
+/*
+ * The epoll_wait() events array starts at COAP_MAX_EPOLL_EVENTS and is
+ * grown up to this limit while it keeps being filled.  Can be changed
+ * at run time with coap_context_set_max_epoll_events().
+ */
+#ifndef COAP_MAX_EPOLL_EVENTS_LIMIT
+#define COAP_MAX_EPOLL_EVENTS_LIMIT 256
+#endif /* COAP_MAX_EPOLL_EVENTS_LIMIT */
+
+/*
+ * The maximum number of datagrams that are read from a UDP endpoint each
+ * time it is readable, by a single recvmmsg() call if available, else by
+ * reading the socket until it would block. Busy servers may want to
+ * increase this by using -DCOAP_RECVMMSG_BATCH=nn at compile time. A value
+ * of 1 disables batched reads.
+ */
+#ifndef COAP_RECVMMSG_BATCH
+#define COAP_RECVMMSG_BATCH 8
+#endif /* COAP_RECVMMSG_BATCH */
+
+#if COAP_RECVMMSG_BATCH > 1 && !defined(WITH_CONTIKI) && \
+    !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#define COAP_NETWORK_READ_BATCH 1
+#endif
+
+/*
+ * The maximum number of datagrams that are queued for transmission when
+ * coap_context_set_tx_batching() is enabled before coap_io_flush() is
+ * done implicitly. Can be changed by using -DCOAP_TX_BATCH_SIZE=nn at
+ * compile time.
+ */
+#ifndef COAP_TX_BATCH_SIZE
+#define COAP_TX_BATCH_SIZE 32
+#endif /* COAP_TX_BATCH_SIZE */
+
 #ifdef _WIN32
 typedef SOCKET coap_fd_t;
 #define coap_closesocket closesocket
@@ -54,6 +89,11 @@ typedef struct coap_addr_hash_t {
   uint16_t lport;              /**< local port */
 } coap_addr_hash_t;
 
+typedef struct coap_peer_key_t {
+  coap_address_t remote;       /**< remote address and port */
+  int ifindex;                 /**< interface index */
+} coap_peer_key_t;
+
 typedef struct coap_addr_tuple_t {
   coap_address_t remote;       /**< remote address and port */
   coap_address_t local;        /**< local address and port */
@@ -98,6 +138,9 @@ typedef struct coap_socket_t {
 #define COAP_SOCKET_CAN_ACCEPT   0x0400  /**< non blocking server socket can now accept without blocking */
 #define COAP_SOCKET_CAN_CONNECT  0x0800  /**< non blocking client socket can now connect without blocking */
 #define COAP_SOCKET_MULTICAST    0x1000  /**< socket is used for multicast communication */
+#define COAP_SOCKET_REUSEPORT    0x2000  /**< bind socket with SO_REUSEPORT */
+#define COAP_SOCKET_EDGE         0x4000  /**< socket is registered edge-triggered with epoll */
+#define COAP_SOCKET_URING        0x8000  /**< socket is read by io_uring, not epoll */
 
 coap_endpoint_t *coap_malloc_endpoint( void );
 void coap_mfree_endpoint( coap_endpoint_t *ep );
@@ -110,6 +153,29 @@ coap_socket_connect_udp(coap_socket_t *sock,
                         coap_address_t *local_addr,
                         coap_address_t *remote_addr);
 
+/**
+ * Has the kernel discover the path MTU of the connected UDP socket
+ * @p sock, and set the Don't Fragment bit of the datagrams that fit it.
+ *
+ * @param sock   The socket.
+ * @param family The address family of the peer.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_socket_set_path_mtu_discovery(coap_socket_t *sock, int family);
+
+/**
+ * Returns the largest UDP payload that fits the path MTU of the connected
+ * socket @p sock as the kernel knows it.
+ *
+ * @param sock   The socket.
+ * @param family The address family of the peer.
+ *
+ * @return The path MTU less the IP and UDP headers, or @c 0 if it is not
+ *         known.
+ */
+size_t coap_socket_get_path_mtu(coap_socket_t *sock, int family);
+
 int
 coap_socket_bind_udp(coap_socket_t *sock,
                      const coap_address_t *listen_addr,
@@ -127,6 +193,44 @@ coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len);
 ssize_t
 coap_socket_read(coap_socket_t *sock, uint8_t *data, size_t data_len);
 
+#if defined(HAVE_STRUCT_CMSGHDR) && !defined(_WIN32) && \
+    !defined(WITH_CONTIKI) && !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#define COAP_SOCKET_SENDV 1
+#include <sys/uio.h>
+
+/**
+ * As coap_socket_send(), but gathering the datagram from the @p iovcnt
+ * buffers of @p iov.
+ *
+ * @param sock    Socket to send data with.
+ * @param session Addressing information for unconnected sockets.
+ * @param iov     The buffers to send.
+ * @param iovcnt  The number of entries in @p iov.
+ *
+ * @return        The number of bytes written on success, or a value less
+ *                than zero on error.
+ */
+ssize_t
+coap_socket_sendv(coap_socket_t *sock, struct coap_session_t *session,
+                  const struct iovec *iov, int iovcnt);
+
+/**
+ * As coap_socket_write(), but gathering the data from the @p iovcnt
+ * buffers of @p iov.
+ *
+ * @param sock    Connected socket to write data to.
+ * @param iov     The buffers to write.
+ * @param iovcnt  The number of entries in @p iov.
+ *
+ * @return        The number of bytes written, zero if the socket would
+ *                block, or a value less than zero on error.
+ */
+ssize_t
+coap_socket_writev(coap_socket_t *sock, const struct iovec *iov, int iovcnt);
+#else /* ! HAVE_STRUCT_CMSGHDR || ... */
+#define COAP_SOCKET_SENDV 0
+#endif /* ! HAVE_STRUCT_CMSGHDR || ... */
+
 void
 coap_epoll_ctl_mod(coap_socket_t *sock, uint32_t events, const char *func);
 
@@ -167,13 +271,41 @@ ssize_t coap_network_send( coap_socket_t *sock, const struct coap_session_t *ses
  * error, @p *packet is set to NULL.
  *
  * @param sock   Socket to read data from
- * @param packet Received packet metadata and payload. src and dst should be preset.
+ * @param packet Received packet metadata and payload. src and dst should be
+ *               preset, as should payload and size where the packet has them.
  *
  * @return       The number of bytes received on success, or a value less than
- *               zero on error.
+ *               zero on error.  This is @c -2 if the peer of a connected
+ *               socket is unreachable, and @c -3 if a datagram that was sent
+ *               on it turned out to be too big for the path.
  */
 ssize_t coap_network_read( coap_socket_t *sock, struct coap_packet_t *packet );
 
+#ifdef COAP_NETWORK_READ_BATCH
+/**
+ * Reads up to @p count datagrams from the unconnected socket @p sock with a
+ * single recvmmsg() call, or where that is not available (such as on
+ * Windows) with one coap_network_read() after another until the socket
+ * would block. Each entry of @p packets must have its addr_info,
+ * payload and size initialized as for coap_network_read() before this
+ * function is called.
+ * On return, the first n entries hold the received data, the remote address
+ * and the local address and interface index taken from the pktinfo
+ * ancillary data.
+ *
+ * @param sock    Socket to read data from.
+ * @param packets Array of received packets.
+ * @param count   The number of entries in @p packets. At most
+ *                #COAP_RECVMMSG_BATCH datagrams are read.
+ *
+ * @return        The number of packets received (which may be zero) on
+ *                success, or a value less than zero on error.
+ */
+int coap_network_read_batch(coap_socket_t *sock,
+                            struct coap_packet_t *packets,
+                            unsigned int count);
+#endif /* COAP_NETWORK_READ_BATCH */
+
 #ifndef coap_mcast_interface
 # define coap_mcast_interface(Local) 0
 #endif
@@ -194,6 +326,14 @@ void coap_packet_get_memmapped(struct coap_packet_t *packet,
 struct pbuf *coap_packet_extract_pbuf(struct coap_packet_t *packet);
 #endif
 
+#ifdef RIOT_VERSION
+/*
+ * Releases the GNRC packet that the payload of @p packet points into.  Must
+ * be called once the datagram read by coap_network_read() has been handled.
+ */
+void coap_packet_release(struct coap_packet_t *packet);
+#endif
+
 #if defined(WITH_LWIP)
 /*
  * This is only included in coap_io.h instead of .c in order to be available for
@@ -210,12 +350,31 @@ struct coap_packet_t {
   int ifindex;                /**< the interface index */
 //  uint16_t srcport;
 };
+#elif defined(RIOT_VERSION)
+/*
+ * The payload is not copied out of the GNRC packet buffer, but referenced
+ * until coap_packet_release() is called.
+ */
+struct coap_packet_t {
+  coap_addr_tuple_t addr_info; /**< local and remote addresses */
+  int ifindex;                /**< the interface index */
+  size_t length;              /**< length of payload */
+  unsigned char *payload;     /**< payload, within pkt */
+  gnrc_pktsnip_t *pkt;        /**< the packet that holds the payload */
+};
 #else
+/*
+ * A datagram is read into buf, unless the context has a receive buffer
+ * larger than that (see coap_context_set_max_rx_size()), in which case
+ * payload points to that buffer instead.
+ */
 struct coap_packet_t {
   coap_addr_tuple_t addr_info; /**< local and remote addresses */
   int ifindex;                /**< the interface index */
   size_t length;              /**< length of payload */
-  unsigned char payload[COAP_RXBUFFER_SIZE]; /**< payload */
+  unsigned char *payload;     /**< payload */
+  size_t size;                /**< the space at payload */
+  unsigned char buf[COAP_RXBUFFER_SIZE]; /**< space for the payload */
 };
 #endif
 typedef struct coap_packet_t coap_packet_t;
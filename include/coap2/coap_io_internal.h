@@ -0,0 +1,234 @@
+/*
+ * coap_io_internal.h -- Default network I/O functions for libcoap
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_io_internal.h
+ * @brief Internal network I/O functions
+ */
+
+#ifndef COAP_IO_INTERNAL_H_
+#define COAP_IO_INTERNAL_H_
+
+/**
+ * @defgroup io_internal Network I/O (Internal)
+ * Functions that move received datagrams between the sockets and the
+ * sessions.
+ * Internal API functions
+ * @{
+ */
+
+#if defined(COAP_EPOLL_SUPPORT) || defined(COAP_KQUEUE_SUPPORT)
+/*
+ * The sockets are registered with the epoll or kqueue of their context, and
+ * coap_io_process() waits on that rather than on select().
+ */
+#define COAP_EVENT_QUEUE_SUPPORT 1
+#endif /* COAP_EPOLL_SUPPORT || COAP_KQUEUE_SUPPORT */
+
+#ifndef _WIN32
+#include <errno.h>
+
+/*
+ * Non-zero if the errno value @p err says that a non-blocking socket call
+ * had nothing to do.  EAGAIN and EWOULDBLOCK are the same value on most
+ * systems, which only needs to be compared once.
+ */
+#if EAGAIN != EWOULDBLOCK
+#define COAP_SOCKET_WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#else /* EAGAIN == EWOULDBLOCK */
+#define COAP_SOCKET_WOULD_BLOCK(err) ((err) == EAGAIN)
+#endif /* EAGAIN == EWOULDBLOCK */
+#endif /* ! _WIN32 */
+
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+/**
+ * Passes the epoll @p events (EPOLLIN, EPOLLOUT) that @p sock is to be
+ * waited for on to the add or modify call-back that has been set by
+ * coap_context_set_io_callbacks() for @p ctx.
+ *
+ * @param ctx    The context of @p sock.
+ * @param sock   The socket.
+ * @param events The epoll events.
+ * @param add    @c 1 if @p sock is new, else @c 0.
+ */
+void coap_io_external_watch(coap_context_t *ctx, coap_socket_t *sock,
+                            uint32_t events, int add);
+
+/**
+ * Arms the timer that has been set by coap_context_set_io_callbacks() for
+ * @p ctx to fire in @p delay ticks, or disarms it if @p delay is @c 0.
+ * Nothing is done if the timer is already due then.
+ *
+ * @param ctx   The context.
+ * @param delay The number of ticks until the timer is to fire.
+ */
+void coap_io_external_set_timer(coap_context_t *ctx, coap_tick_t delay);
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+
+#ifdef COAP_KQUEUE_SUPPORT
+/*
+ * The kqueue backend takes and reports the socket events as the epoll
+ * events they correspond to, so that both share the socket dispatch and
+ * coap_epoll_ctl_mod().
+ */
+#define EPOLLIN    0x001
+#define EPOLLOUT   0x004
+#define EPOLLERR   0x008
+#define EPOLLHUP   0x010
+#define EPOLLRDHUP 0x2000
+
+/**
+ * Arms the EVFILT_TIMER of the kqueue of @p ctx to fire once in @p delay
+ * ticks, or disarms it if @p delay is @c 0.  Nothing is done if the timer
+ * is already due then.
+ *
+ * @param ctx   The context.
+ * @param delay The number of ticks until the timer is to fire.
+ * @param func  The caller, for the error message.
+ */
+void coap_kqueue_set_timer(coap_context_t *ctx, coap_tick_t delay,
+                           const char *func);
+#endif /* COAP_KQUEUE_SUPPORT */
+
+/**
+ * Looks up or creates the session for the datagram in @p packet that has
+ * been read from @p endpoint, and passes the datagram on to it.
+ *
+ * @param ctx      The context.
+ * @param endpoint The endpoint the datagram was read from.
+ * @param packet   The datagram.
+ * @param now      The current time.
+ *
+ * @return The result of handling the datagram, or @c -1 if there is no
+ *         session for it.
+ */
+int coap_handle_endpoint_packet(coap_context_t *ctx,
+                                coap_endpoint_t *endpoint,
+                                coap_packet_t *packet, coap_tick_t now);
+
+#if !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+/**
+ * Sets up @p packet to have a datagram for @p ctx read into it: into the
+ * receive buffer set by coap_context_set_max_rx_size() if @p ctx has one,
+ * else into the packet itself.
+ *
+ * @param packet The packet.
+ * @param ctx    The context the datagram is read for.
+ */
+COAP_STATIC_INLINE void
+coap_packet_set_rxbuf(coap_packet_t *packet, const coap_context_t *ctx) {
+  if (ctx->rxbuf) {
+    packet->payload = ctx->rxbuf;
+    packet->size = ctx->rx_size;
+  } else {
+    packet->payload = packet->buf;
+    packet->size = sizeof(packet->buf);
+  }
+}
+#endif /* ! WITH_LWIP && ! RIOT_VERSION */
+
+/**
+ * Installs the steering of the SO_REUSEPORT group of the bound endpoint
+ * socket @p sock that is set by coap_context_set_reuseport_steering() for
+ * @p context, if any.
+ *
+ * @param sock    The endpoint socket.
+ * @param context The context of the endpoint.
+ */
+void coap_socket_set_steering(coap_socket_t *sock, coap_context_t *context);
+
+/**
+ * The classes of traffic that coap_io_flush() sends the queued datagrams
+ * of, in this order.
+ */
+typedef enum coap_tx_class_t {
+  COAP_TX_CONTROL,    /**< Empty ACKs and RSTs, pings and signaling */
+  COAP_TX_RETRANSMIT, /**< Retransmitted Confirmable messages */
+  COAP_TX_NORMAL,     /**< Requests and responses */
+  COAP_TX_BULK,       /**< Notifications and all but the first Block2 */
+  COAP_TX_CLASSES
+} coap_tx_class_t;
+
+/**
+ * Writes out the PDUs that the TCP and TLS sessions of @p ctx have held
+ * back since coap_context_set_tcp_cork() was enabled.
+ *
+ * @param ctx The context.
+ */
+void coap_io_flush_corked(coap_context_t *ctx);
+
+/**
+ * Sets @p t to the time of the I/O processing iteration that @p ctx is in,
+ * so that all the timeouts handled in one iteration agree on the time, and
+ * the clock is read once.  Outside of an iteration, or in a DTLS handshake
+ * worker thread, the clock is read.
+ *
+ * @param ctx The context, or @c NULL.
+ * @param t   Set to the current time.
+ */
+COAP_STATIC_INLINE void
+coap_io_ticks(const coap_context_t *ctx, coap_tick_t *t) {
+  /* io_now belongs to the I/O thread */
+  if (ctx && !(ctx->dtls_offload && coap_dtls_offload_in_worker()) &&
+      ctx->io_now)
+    *t = ctx->io_now;
+  else
+    coap_ticks(t);
+}
+
+#ifdef COAP_IO_URING_SUPPORT
+/*
+ * The number of receive buffers provided to io_uring for each context.
+ * Must be a power of 2.
+ */
+#ifndef COAP_IO_URING_BUFFERS
+#define COAP_IO_URING_BUFFERS 256
+#endif /* COAP_IO_URING_BUFFERS */
+
+typedef struct coap_io_uring_t coap_io_uring_t;
+
+/**
+ * Starts a multishot receive on the UDP endpoint @p endpoint, creating the
+ * io_uring of the endpoint's context if needed.  On success the endpoint
+ * socket is flagged COAP_SOCKET_URING and is then only registered with
+ * epoll for output.
+ *
+ * @param endpoint The endpoint.
+ *
+ * @return @c 1 if the endpoint is read by io_uring, else @c 0 if it has to
+ *         be read using epoll.
+ */
+int coap_io_uring_add_endpoint(coap_endpoint_t *endpoint);
+
+/**
+ * Cancels the multishot receive of @p endpoint, if any.
+ *
+ * @param endpoint The endpoint that is about to be freed.
+ */
+void coap_io_uring_remove_endpoint(coap_endpoint_t *endpoint);
+
+/**
+ * Handles all the io_uring completions of @p ctx.  Called when epoll
+ * reports the io_uring file descriptor as readable.
+ *
+ * @param ctx The context.
+ * @param now The current time.
+ */
+void coap_io_uring_process(coap_context_t *ctx, coap_tick_t now);
+
+/**
+ * Frees the io_uring of @p ctx.  Must be called after all the endpoints
+ * have been freed.
+ *
+ * @param ctx The context.
+ */
+void coap_io_uring_free(coap_context_t *ctx);
+#endif /* COAP_IO_URING_SUPPORT */
+
+/** @} */
+
+#endif /* COAP_IO_INTERNAL_H_ */
@@ -54,4 +54,24 @@ typedef int coap_mutex_t;
 
 #endif /* COAP_CONSTRAINED_STACK */
 
+/*
+ * The small static buffers that are used for formatting log output are
+ * made thread local where possible, so that separate contexts can be run
+ * in separate threads.
+ */
+#ifndef COAP_THREAD_LOCAL
+#if defined(WITH_CONTIKI) || defined(WITH_LWIP) || defined(RIOT_VERSION)
+#define COAP_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define COAP_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+      !defined(__STDC_NO_THREADS__)
+#define COAP_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define COAP_THREAD_LOCAL __thread
+#else
+#define COAP_THREAD_LOCAL
+#endif
+#endif /* COAP_THREAD_LOCAL */
+
 #endif /* COAP_MUTEX_H_ */
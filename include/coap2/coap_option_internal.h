@@ -0,0 +1,85 @@
+/*
+ * coap_option_internal.h -- Properties of the CoAP option numbers
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_option_internal.h
+ * @brief Internal option property functions
+ */
+
+#ifndef COAP_OPTION_INTERNAL_H_
+#define COAP_OPTION_INTERNAL_H_
+
+/**
+ * @defgroup option_props_internal Option Properties (Internal)
+ * The options that libcoap defines are described once by a table indexed
+ * by the option number.  Each context keeps its own COAP_OPT_PROP_* flags of
+ * the option numbers below COAP_OPTION_PROPS_SIZE, which are worked out
+ * when the context is created and again when coap_cache_ignore_options()
+ * or coap_context_set_block_mode() change them, so that looking them up
+ * does not have to go through the option filters or the cache-key ignore
+ * list.
+ * Internal API functions
+ * @{
+ */
+
+/** Description of an option that libcoap defines. */
+typedef struct coap_option_desc_t {
+  const char *name;  /**< name of the option, or @c NULL if not defined */
+  uint16_t min_len;  /**< smallest valid length of the value */
+  uint16_t max_len;  /**< largest valid length of the value */
+  uint8_t flags;     /**< the COAP_OPT_PROP_* that are not derived from
+                          the option number */
+} coap_option_desc_t;
+
+/**
+ * Returns the description of the option @p type, or @c NULL if libcoap does
+ * not define it.
+ *
+ * @param type The option number.
+ *
+ * @return The description or @c NULL.
+ */
+const coap_option_desc_t *coap_option_desc(uint16_t type);
+
+/**
+ * Works out the COAP_OPT_PROP_* flags of all the option numbers below
+ * COAP_OPTION_PROPS_SIZE for @p context.
+ *
+ * @param context The context.
+ */
+void coap_option_props_init(coap_context_t *context);
+
+/**
+ * Returns the COAP_OPT_PROP_* flags of the option @p type as @p context
+ * sees it, for option numbers that are not kept in the table.
+ *
+ * @param context The context.
+ * @param type    The option number.
+ *
+ * @return The flags.
+ */
+uint8_t coap_option_props_uncached(const coap_context_t *context,
+                                   uint16_t type);
+
+/**
+ * Returns the COAP_OPT_PROP_* flags of the option @p type as @p context
+ * sees it.
+ *
+ * @param context The context.
+ * @param type    The option number.
+ *
+ * @return The flags.
+ */
+COAP_STATIC_INLINE uint8_t
+coap_option_props(const coap_context_t *context, uint16_t type) {
+  return type < COAP_OPTION_PROPS_SIZE ? context->option_props[type] :
+                                 coap_option_props_uncached(context, type);
+}
+
+/** @} */
+
+#endif /* COAP_OPTION_INTERNAL_H_ */
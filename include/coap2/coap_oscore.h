@@ -0,0 +1,120 @@
+/*
+ * coap_oscore.h -- Object Security for Constrained RESTful Environments
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_oscore.h
+ * @brief OSCORE (RFC 8613) support
+ */
+
+#ifndef COAP_OSCORE_H_
+#define COAP_OSCORE_H_
+
+/**
+ * @defgroup oscore OSCORE Support
+ * API functions for protecting requests and responses end to end with
+ * OSCORE (RFC 8613)
+ * @{
+ */
+
+/**
+ * The number of requests, by Partial IV, that a recipient remembers so
+ * that replays are rejected, unless set in coap_oscore_conf_t.
+ */
+#define COAP_OSCORE_DEFAULT_REPLAY_WINDOW 32
+
+/** The longest Sender ID or Recipient ID (for AES-CCM-16-64-128). */
+#define COAP_OSCORE_MAX_ID_LEN 7
+
+/**
+ * The parameters of an OSCORE security context.  The AEAD algorithm is
+ * always AES-CCM-16-64-128 and the HKDF algorithm HKDF SHA-256, as
+ * mandated by RFC 8613.  All the byte strings are copied.
+ */
+typedef struct coap_oscore_conf_t {
+  coap_bin_const_t master_secret; /**< Master Secret, at least 16 bytes */
+  coap_bin_const_t master_salt;   /**< Master Salt, or length 0 for none */
+  coap_bin_const_t sender_id;     /**< Sender ID (the kid of the messages
+                                       sent), may be length 0 */
+  coap_bin_const_t recipient_id;  /**< Recipient ID (the kid of the messages
+                                       received), may be length 0 */
+  coap_bin_const_t id_context;    /**< ID Context, or length 0 for none */
+  uint64_t sender_seq;            /**< First Sender Sequence Number */
+  unsigned int replay_window;     /**< Size of the replay window (at most
+                                       64), or 0 for
+                                       COAP_OSCORE_DEFAULT_REPLAY_WINDOW */
+} coap_oscore_conf_t;
+
+/**
+ * Checks whether OSCORE is available, which needs a (D)TLS library that
+ * provides AES-CCM (GnuTLS, OpenSSL or Mbed TLS).
+ *
+ * @return @c 1 if OSCORE is available, else @c 0.
+ */
+int coap_oscore_is_supported(void);
+
+/**
+ * Derives the security context described by @p conf and adds it to the
+ * store of @p context, where it is found by its Recipient ID and ID
+ * Context.  A server looks the security context of each request up in
+ * the store by the kid (and kid context) of the request; a client picks
+ * the security context for a session with coap_session_set_oscore().
+ *
+ * The Sender Sequence Number must never be used twice with the same
+ * keys, so an application that restarts must either persist how far it
+ * got and start from beyond that in @p conf->sender_seq, or use a new
+ * Master Salt or ID Context.
+ *
+ * @param context The context.
+ * @param conf    The parameters of the security context.
+ *
+ * @return @c 1 if successful, else @c 0 (also if a security context with
+ *         the same Recipient ID and ID Context has already been added).
+ */
+int coap_context_add_oscore(coap_context_t *context,
+                            const coap_oscore_conf_t *conf);
+
+/**
+ * Removes the security context with @p recipient_id and @p id_context
+ * from the store of @p context.  The sessions and exchanges that are
+ * using it carry on with it until they are done.
+ *
+ * @param context      The context.
+ * @param recipient_id The Recipient ID of the security context.
+ * @param id_context   The ID Context of the security context, or NULL.
+ *
+ * @return @c 1 if it was removed, else @c 0 if it was not found.
+ */
+int coap_context_remove_oscore(coap_context_t *context,
+                               const coap_bin_const_t *recipient_id,
+                               const coap_bin_const_t *id_context);
+
+/**
+ * Makes the client @p session protect all its requests with the
+ * security context with @p recipient_id and @p id_context from the store
+ * of its context.  The responses are then verified and decrypted before
+ * they are passed to the response handler.
+ *
+ * A Proxy-Uri option of a request is sent as Proxy-Scheme, Uri-Host and
+ * Uri-Port options that a forward proxy can see, with the path and query
+ * encrypted.  The OSCORE request and response must each fit in a single
+ * message between the proxy and the endpoints.
+ *
+ * @param session      The client session.
+ * @param recipient_id The Recipient ID of the security context, or NULL to
+ *                     stop protecting the requests.
+ * @param id_context   The ID Context of the security context, or NULL.
+ *
+ * @return @c 1 if successful, else @c 0 if the security context is not in
+ *         the store.
+ */
+int coap_session_set_oscore(coap_session_t *session,
+                            const coap_bin_const_t *recipient_id,
+                            const coap_bin_const_t *id_context);
+
+/** @} */
+
+#endif /* COAP_OSCORE_H_ */
@@ -0,0 +1,187 @@
+/*
+ * coap_oscore_internal.h -- Object Security for Constrained RESTful
+ *                           Environments
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_oscore_internal.h
+ * @brief Internal OSCORE (RFC 8613) functions
+ */
+
+#ifndef COAP_OSCORE_INTERNAL_H_
+#define COAP_OSCORE_INTERNAL_H_
+
+/**
+ * @defgroup oscore_internal OSCORE Support (Internal)
+ * Functions that protect the requests and responses of the sessions that
+ * use OSCORE as they are sent, and verify and decrypt them as they are
+ * received.
+ * Internal API functions
+ * @{
+ */
+
+/** Key length of AES-CCM-16-64-128. */
+#define COAP_OSCORE_KEY_LEN 16
+/** Nonce length of AES-CCM-16-64-128. */
+#define COAP_OSCORE_NONCE_LEN 13
+/** Tag length of AES-CCM-16-64-128. */
+#define COAP_OSCORE_TAG_LEN 8
+
+/**
+ * The number of requests of a session that can be waiting for (or, when
+ * observing, be getting) protected responses at the same time.
+ */
+#define COAP_OSCORE_MAX_EXCHANGES 64
+
+typedef struct coap_oscore_ctx_t coap_oscore_ctx_t;
+typedef struct coap_oscore_assoc_t coap_oscore_assoc_t;
+
+/**
+ * Encrypts @p in with AES-CCM-16-64-128, writing the ciphertext followed
+ * by the tag to @p out, which has room for @p in_len +
+ * COAP_OSCORE_TAG_LEN bytes.  Implemented by the (D)TLS library.
+ *
+ * @param key     The COAP_OSCORE_KEY_LEN byte key.
+ * @param nonce   The COAP_OSCORE_NONCE_LEN byte nonce.
+ * @param aad     The additional authenticated data.
+ * @param aad_len The length of @p aad.
+ * @param in      The plaintext.
+ * @param in_len  The length of @p in.
+ * @param out     Where the ciphertext and tag go.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_crypto_aead_encrypt(const uint8_t *key, const uint8_t *nonce,
+                             const uint8_t *aad, size_t aad_len,
+                             const uint8_t *in, size_t in_len, uint8_t *out);
+
+/**
+ * Verifies and decrypts @p in, a ciphertext followed by its tag, with
+ * AES-CCM-16-64-128, writing the @p in_len - COAP_OSCORE_TAG_LEN bytes of
+ * plaintext to @p out.  Implemented by the (D)TLS library.
+ *
+ * @param key     The COAP_OSCORE_KEY_LEN byte key.
+ * @param nonce   The COAP_OSCORE_NONCE_LEN byte nonce.
+ * @param aad     The additional authenticated data.
+ * @param aad_len The length of @p aad.
+ * @param in      The ciphertext and tag.
+ * @param in_len  The length of @p in.
+ * @param out     Where the plaintext goes.
+ *
+ * @return @c 1 if the tag verified, else @c 0.
+ */
+int coap_crypto_aead_decrypt(const uint8_t *key, const uint8_t *nonce,
+                             const uint8_t *aad, size_t aad_len,
+                             const uint8_t *in, size_t in_len, uint8_t *out);
+
+/**
+ * Protects @p pdu if it is a request of a session that has been set up by
+ * coap_session_set_oscore(), or the response to a request that was
+ * received protected.  Called by coap_send() for every PDU.
+ *
+ * @param session The session @p pdu is sent on.
+ * @param pdu     The PDU, which is taken over.
+ *
+ * @return @p pdu itself if it is not to be protected, the protected PDU
+ *         that replaces it, or @c NULL if it could not be protected.
+ */
+coap_pdu_t *coap_oscore_send_pdu(coap_session_t *session, coap_pdu_t *pdu);
+
+/**
+ * Verifies and decrypts the request @p pdu, which has an OSCORE option
+ * and is not for the proxy, turning it into the plain request in place.
+ *
+ * @param session The session the request came in on.
+ * @param pdu     The request.
+ *
+ * @return @c 0 if successful, else the code (as 401 for 4.01) of the
+ *         unprotected error response to send.  @p pdu is unchanged if
+ *         it could not be verified.
+ */
+int coap_oscore_unprotect_request(coap_session_t *session, coap_pdu_t *pdu);
+
+/**
+ * Verifies and decrypts the response @p pdu in place, if it is to a request
+ * that was protected.  The exchange the response belongs to is detached
+ * from @p session, and handed back with coap_oscore_assoc_done() once the
+ * response has been handled.
+ *
+ * @param session The session the response came in on.
+ * @param pdu     The response.
+ * @param sent    The request that the response matched in the send queue,
+ *                or NULL.  It is replaced by the plain request.
+ * @param assoc   Set to the exchange of the response, or NULL if it was not
+ *                protected.
+ *
+ * @return @c 1 if @p pdu is to be handled, else @c 0 if it is to be
+ *         dropped.
+ */
+int coap_oscore_unprotect_response(coap_session_t *session, coap_pdu_t *pdu,
+                                   coap_pdu_t **sent,
+                                   coap_oscore_assoc_t **assoc);
+
+/**
+ * Detaches from @p session the exchange of the request @p pdu that was
+ * protected, for the nack handler to be given the plain request.
+ *
+ * @param session The session.
+ * @param pdu     The protected request that was not delivered.
+ *
+ * @return The exchange, or NULL if @p pdu was not a protected request.
+ */
+coap_oscore_assoc_t *coap_oscore_assoc_take(coap_session_t *session,
+                                            coap_pdu_t *pdu);
+
+/**
+ * Returns the plain request of an exchange from coap_oscore_assoc_take().
+ *
+ * @param assoc The exchange.
+ *
+ * @return The plain request.
+ */
+coap_pdu_t *coap_oscore_assoc_request(coap_oscore_assoc_t *assoc);
+
+/**
+ * Hands back an exchange detached by coap_oscore_unprotect_response() or
+ * coap_oscore_assoc_take().
+ *
+ * @param session The session.
+ * @param assoc   The exchange, or NULL.
+ * @param keep    @c 1 if more responses are expected, else @c 0 to release
+ *                the exchange.
+ */
+void coap_oscore_assoc_done(coap_session_t *session,
+                            coap_oscore_assoc_t *assoc, int keep);
+
+/**
+ * Forgets the exchange that the response @p response, which is not sent
+ * (as asked by a No-Response option), belongs to.  The exchange is kept if
+ * @p response is empty, as a separate response may follow, or if it is an
+ * observe registration.
+ *
+ * @param session  The session the request came in on.
+ * @param response The response that is dropped, or NULL.
+ */
+void coap_oscore_response_dropped(coap_session_t *session,
+                                  const coap_pdu_t *response);
+
+/**
+ * Releases the OSCORE state of @p session.
+ *
+ * @param session The session.
+ */
+void coap_oscore_session_free(coap_session_t *session);
+
+/**
+ * Releases the security context store of @p context.
+ *
+ * @param context The context.
+ */
+void coap_oscore_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_OSCORE_INTERNAL_H_ */
@@ -0,0 +1,46 @@
+/*
+ * coap_overload_internal.h -- Admission control under overload
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_overload_internal.h
+ * @brief Internal overload admission control functions
+ */
+
+#ifndef COAP_OVERLOAD_INTERNAL_H_
+#define COAP_OVERLOAD_INTERNAL_H_
+
+/**
+ * @defgroup overload_internal Overload Control (Internal)
+ * Functions that check the watermarks set with coap_context_set_overload(),
+ * so that new requests are turned away with 5.03 and new sessions are not
+ * set up while they are crossed.
+ * Internal API functions
+ * @{
+ */
+
+/**
+ * Checks whether @p context is over any of its overload watermarks.
+ *
+ * @param context The context.
+ *
+ * @return @c 1 if overloaded, else @c 0.
+ */
+int coap_overload_check(coap_context_t *context);
+
+/**
+ * Answers the request @p pdu that @p session has received with 5.03
+ * (Service Unavailable), with the Max-Age of the overload settings as a
+ * hint of when to try again, without looking the resource up.
+ *
+ * @param session The session.
+ * @param pdu     The request.
+ */
+void coap_overload_reject(coap_session_t *session, const coap_pdu_t *pdu);
+
+/** @} */
+
+#endif /* COAP_OVERLOAD_INTERNAL_H_ */
@@ -0,0 +1,74 @@
+/*
+ * coap_pki_cache_internal.h -- Cache of verified peer certificates
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_pki_cache_internal.h
+ * @brief Internal PKI verification cache functions
+ */
+
+#ifndef COAP_PKI_CACHE_INTERNAL_H_
+#define COAP_PKI_CACHE_INTERNAL_H_
+
+/**
+ * @defgroup pki_cache_internal PKI Verification Cache (Internal)
+ * Functions that the (D)TLS libraries use to skip building and verifying
+ * the certificate chain of a client that has recently been verified.
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_pki_cache_t coap_pki_cache_t;
+
+/**
+ * Checks whether the certificate @p der that the client of @p session has
+ * sent was verified within the time to live of the cache of its context,
+ * and since the CRLs were last updated.  Only server sessions are looked
+ * up.  This may be called from the DTLS handshake worker threads.
+ *
+ * @param session The server session.
+ * @param der     The DER encoding of the client's certificate.
+ * @param der_len The length of @p der.
+ * @param sni     The server name the client has asked for, or NULL.
+ *
+ * @return @c 1 if the certificate need not be verified again, else @c 0.
+ */
+int coap_pki_cache_lookup(coap_session_t *session,
+                          const uint8_t *der, size_t der_len,
+                          const char *sni);
+
+/**
+ * Records that the certificate @p der that the client of @p session has
+ * sent verified with no allow_* overrides.
+ *
+ * @param session   The server session.
+ * @param der       The DER encoding of the client's certificate.
+ * @param der_len   The length of @p der.
+ * @param sni       The server name the client has asked for, or NULL.
+ * @param valid_for The number of seconds until the certificate expires.
+ */
+void coap_pki_cache_add(coap_session_t *session,
+                        const uint8_t *der, size_t der_len,
+                        const char *sni, unsigned long valid_for);
+
+/**
+ * Forgets all the certificates in the cache of @p context, as they were
+ * verified against a configuration that has changed.
+ *
+ * @param context The context.
+ */
+void coap_pki_cache_flush(coap_context_t *context);
+
+/**
+ * Releases the cache of @p context.
+ *
+ * @param context The context.
+ */
+void coap_pki_cache_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_PKI_CACHE_INTERNAL_H_ */
@@ -84,8 +84,9 @@ void coap_set_prng(coap_rand_func_t rng);
 
 /**
  * Seeds the default random number generation function with the given
- * @p seed. The default random number generation function will use
- * getrandom() if available, ignoring the seed.
+ * @p seed. The default function is a ChaCha20 generator per thread whose
+ * key is read from getrandom() if available, ignoring the seed, else from
+ * rand() seeded with @p seed.
  *
  * @param seed  The seed for the pseudo random number generator.
  */
@@ -0,0 +1,39 @@
+/*
+ * coap_prng_internal.h -- random number generation
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_prng_internal.h
+ * @brief Internal random number generation functions
+ */
+
+#ifndef COAP_PRNG_INTERNAL_H_
+#define COAP_PRNG_INTERNAL_H_
+
+/**
+ * @defgroup prng_internal Pseudo Random Numbers (Internal)
+ * The ChaCha20 generator behind the default coap_prng().
+ * Internal API functions
+ * @{
+ */
+
+#if !defined(WITH_CONTIKI) && !(defined(WITH_LWIP) && defined(LWIP_RAND))
+/**
+ * Writes the ChaCha20 (RFC 8439) block for @p key, block counter
+ * @p counter and an all zero nonce to @p out.  The key stream of the
+ * default coap_prng() is made of these blocks.
+ *
+ * @param key     The 32 byte key.
+ * @param counter The block counter.
+ * @param out     Where the 64 bytes of the block go.
+ */
+void coap_prng_chacha20_block(const uint8_t key[32], uint32_t counter,
+                              uint8_t out[64]);
+#endif /* ! WITH_CONTIKI && ! (WITH_LWIP && LWIP_RAND) */
+
+/** @} */
+
+#endif /* COAP_PRNG_INTERNAL_H_ */
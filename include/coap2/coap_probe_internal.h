@@ -0,0 +1,69 @@
+/*
+ * coap_probe_internal.h -- USDT probes on the protocol paths
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_probe_internal.h
+ * @brief Internal static tracepoint definitions
+ */
+
+#ifndef COAP_PROBE_INTERNAL_H_
+#define COAP_PROBE_INTERNAL_H_
+
+/**
+ * @defgroup probe_internal Static Tracepoints (Internal)
+ * USDT probes of the provider @c libcoap, for use with bpftrace, perf or
+ * SystemTap.  Each probe compiles to a single nop and costs nothing more
+ * until a tracer attaches to it.  With COAP_USDT_SUPPORT undefined they
+ * compile to nothing.
+ *
+ * The PDU probes take the session, the message id, a pointer to the token,
+ * the token length and the code as arguments:
+ *
+ * - @c send: coap_send() is called.
+ * - @c retransmit: a confirmable PDU is sent again.
+ * - @c receive: a PDU has been received and parsed.
+ * - @c request_start and @c request_done: the handling of a request by its
+ *   resource starts and ends.
+ * - @c notify: a notification is sent to an observer.
+ * - @c block_start and @c block_done: a large body transfer starts and ends
+ *   (complete or abandoned).  These take the total body length as a sixth
+ *   argument.
+ *
+ * The session probes take the session and one more value:
+ *
+ * - @c session_connected: the session is established (the protocol).
+ * - @c session_disconnected: the session is closed (the nack reason).
+ * - @c dtls_handshake_start: a (D)TLS handshake starts (the protocol).
+ * - @c dtls_handshake_done: it has ended (@c 1 if it succeeded, else @c 0).
+ *
+ * Internal API functions
+ * @{
+ */
+
+#ifdef COAP_USDT_SUPPORT
+#include <sys/sdt.h>
+
+#define COAP_PROBE_PDU(name, session, pdu) \
+  DTRACE_PROBE5(libcoap, name, (session), (pdu)->mid, (pdu)->token, \
+                (pdu)->token_length, (pdu)->code)
+
+#define COAP_PROBE_BLOCK(name, session, lg_xmit) \
+  DTRACE_PROBE6(libcoap, name, (session), (lg_xmit)->pdu.mid, \
+                (lg_xmit)->pdu.token, (lg_xmit)->pdu.token_length, \
+                (lg_xmit)->pdu.code, (lg_xmit)->length)
+
+#define COAP_PROBE_SESSION(name, session, value) \
+  DTRACE_PROBE2(libcoap, name, (session), (value))
+#else /* ! COAP_USDT_SUPPORT */
+#define COAP_PROBE_PDU(name, session, pdu) ((void)0)
+#define COAP_PROBE_BLOCK(name, session, lg_xmit) ((void)0)
+#define COAP_PROBE_SESSION(name, session, value) ((void)0)
+#endif /* ! COAP_USDT_SUPPORT */
+
+/** @} */
+
+#endif /* COAP_PROBE_INTERNAL_H_ */
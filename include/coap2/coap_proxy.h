@@ -0,0 +1,126 @@
+/*
+ * coap_proxy.h -- Forward proxy support for libcoap
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_proxy.h
+ * @brief CoAP forward proxy support
+ */
+
+#ifndef COAP_PROXY_H_
+#define COAP_PROXY_H_
+
+/**
+ * @defgroup proxy Forward Proxy Support
+ * API functions for forwarding Proxy-Uri / Proxy-Scheme requests
+ * @{
+ */
+
+/** Default number of requests that can be outstanding with an origin. */
+#define COAP_PROXY_DEFAULT_MAX_REQUESTS 16
+
+/** Default number of requests that can wait for an origin. */
+#define COAP_PROXY_DEFAULT_MAX_QUEUED 256
+
+/** Default number of origin responses that are kept for their Max-Age. */
+#define COAP_PROXY_DEFAULT_MAX_CACHED 64
+
+/**
+ * Seconds that an outstanding request waits for the origin's response
+ * before it is failed with 5.04 (Gateway Timeout).
+ */
+#define COAP_PROXY_REQUEST_TIMEOUT 247
+
+/**
+ * Callback that creates the session to an origin server, for example to
+ * set up the PSK or PKI information for a coaps or coaps+tcp origin.
+ *
+ * @param context  The context the session is to be created in.
+ * @param origin   The scheme, host and port of the origin.
+ * @param server   The resolved address of the origin.
+ * @param proto    The protocol to use.
+ * @param app_data The app_data of the proxy configuration.
+ *
+ * @return A new client session, or @c NULL if the origin cannot be reached.
+ */
+typedef coap_session_t *(*coap_proxy_session_handler_t)(
+                                            coap_context_t *context,
+                                            const coap_uri_t *origin,
+                                            const coap_address_t *server,
+                                            coap_proto_t proto,
+                                            void *app_data);
+
+/**
+ * The forward proxy configuration of a context.
+ */
+typedef struct coap_proxy_config_t {
+  unsigned int max_requests; /**< Requests outstanding per origin, or 0 for
+                                  COAP_PROXY_DEFAULT_MAX_REQUESTS */
+  unsigned int max_queued;   /**< Requests waiting per origin, or 0 for
+                                  COAP_PROXY_DEFAULT_MAX_QUEUED */
+  unsigned int max_cached;   /**< Responses kept for their Max-Age, or 0
+                                  for COAP_PROXY_DEFAULT_MAX_CACHED */
+  const coap_uri_t *next_hop; /**< Forward everything (with its proxy
+                                   options) to this proxy, or NULL */
+  coap_proxy_session_handler_t new_session; /**< Creates origin sessions, or
+                                                 NULL to only support coap
+                                                 and coap+tcp origins */
+  void *app_data;            /**< Passed to new_session */
+} coap_proxy_config_t;
+
+/**
+ * Sets up @p context to forward proxy requests with
+ * coap_proxy_forward_request().
+ *
+ * Requests for the same origin (scheme, host and port) share one session to
+ * the origin, on which each forwarded request gets a token of its own.  At
+ * most @p config->max_requests requests are outstanding with an origin;
+ * the ones that follow wait, up to @p config->max_queued of them, after
+ * which requests are answered with 5.03 (Service Unavailable).
+ *
+ * A GET or FETCH that has the same cache-key (see coap_cache_derive_key())
+ * as one that is still waiting for its origin is not forwarded again, but
+ * gets a copy of the same response.  2.05 (Content) responses to GET and
+ * FETCH are then kept for their Max-Age, up to @p config->max_cached of
+ * them, and used to answer the identical requests that follow.
+ *
+ * @param context The context to set up.
+ * @param config  The proxy configuration, which is copied.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_proxy_setup(coap_context_t *context,
+                     const coap_proxy_config_t *config);
+
+/**
+ * Forwards the Proxy-Uri or Proxy-Scheme @p request to its origin server (or
+ * to the configured next hop).  Called from the handler of the resource
+ * created by coap_resource_proxy_uri_init().
+ *
+ * The origin's response is sent back to @p session later as a separate
+ * response, so the handler must return with @p response untouched.  The
+ * Observe option is not passed on, so observers just get a single response.
+ * If the request body spans several blocks, the context needs
+ * COAP_BLOCK_USE_LIBCOAP and COAP_BLOCK_SINGLE_BODY, else 4.08 (Request
+ * Entity Incomplete) is returned.
+ *
+ * @param resource The proxy resource.
+ * @param session  The session the request came in on.
+ * @param request  The request.
+ * @param response The response.
+ *
+ * @return @c 1 if the request has been forwarded (or is waiting for the
+ *         origin), or @p response has been filled in from a cached response,
+ *         else @c 0 and the code of @p response is set.
+ */
+int coap_proxy_forward_request(coap_resource_t *resource,
+                               coap_session_t *session,
+                               coap_pdu_t *request,
+                               coap_pdu_t *response);
+
+/** @} */
+
+#endif /* COAP_PROXY_H_ */
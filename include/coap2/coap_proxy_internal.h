@@ -0,0 +1,70 @@
+/*
+ * coap_proxy_internal.h -- Forward proxy internal functions
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_proxy_internal.h
+ * @brief Internal forward proxy functions
+ */
+
+#ifndef COAP_PROXY_INTERNAL_H_
+#define COAP_PROXY_INTERNAL_H_
+
+/**
+ * @defgroup proxy_internal Forward Proxy Support (Internal)
+ * Functions that map the responses of origin servers back to the requests
+ * that were forwarded by coap_proxy_forward_request().
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_proxy_t coap_proxy_t;
+typedef struct coap_proxy_origin_t coap_proxy_origin_t;
+
+/**
+ * Passes a response that has been received on an origin session (one with
+ * proxy_origin set) back to the client of the matching forwarded request.
+ *
+ * @param session The origin session.
+ * @param rcvd    The response.
+ *
+ * @return @c 1 if the response belonged to a forwarded request, else @c 0.
+ */
+int coap_proxy_handle_response(coap_session_t *session, coap_pdu_t *rcvd);
+
+/**
+ * Fails the forwarded request that @p sent belongs to, if any, with 5.04
+ * (Gateway Timeout) when the origin did not answer, else with 5.02 (Bad
+ * Gateway).
+ *
+ * @param session The origin session.
+ * @param sent    The request that could not be delivered.
+ * @param reason  Why it could not be delivered.
+ *
+ * @return @c 1 if @p sent was a forwarded request, else @c 0.
+ */
+int coap_proxy_handle_nack(coap_session_t *session, coap_pdu_t *sent,
+                           coap_nack_reason_t reason);
+
+/**
+ * Fails all the requests outstanding with the origin of @p session with 5.02
+ * (Bad Gateway) as the session has gone.  The next request forwarded to the
+ * origin sets up a new session.
+ *
+ * @param session The origin session that has been disconnected.
+ */
+void coap_proxy_session_closed(coap_session_t *session);
+
+/**
+ * Releases the proxy state of @p context, including the origin sessions.
+ *
+ * @param context The context.
+ */
+void coap_proxy_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_PROXY_INTERNAL_H_ */
@@ -0,0 +1,111 @@
+/*
+ * coap_psk_store.h -- Pre-Shared Keys of the clients of a server
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_psk_store.h
+ * @brief Store of the Pre-Shared Keys of the clients of a server
+ */
+
+#ifndef COAP_PSK_STORE_H_
+#define COAP_PSK_STORE_H_
+
+/**
+ * @defgroup psk_store PSK Identity Store
+ * API functions for looking up the Pre-Shared Key of each client identity
+ * of a (D)TLS server
+ * @{
+ */
+
+typedef struct coap_psk_store_t coap_psk_store_t;
+
+/**
+ * Creates an empty store of identities and their Pre-Shared Keys.
+ *
+ * @return The store, or @c NULL on failure.
+ */
+coap_psk_store_t *coap_psk_store_new(void);
+
+/**
+ * Adds @p identity with @p key to @p store, or replaces the key if
+ * @p identity is already there.  Both are copied.  A store that has been
+ * loaded from a file, or handed to coap_context_set_psk_store(), cannot be
+ * added to.
+ *
+ * @param store    The store.
+ * @param identity The PSK identity of the client.
+ * @param key      The Pre-Shared Key of the client.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_psk_store_add(coap_psk_store_t *store,
+                       const coap_bin_const_t *identity,
+                       const coap_bin_const_t *key);
+
+/**
+ * Returns the number of identities in @p store.
+ *
+ * @param store The store.
+ *
+ * @return The number of identities.
+ */
+size_t coap_psk_store_count(const coap_psk_store_t *store);
+
+/**
+ * Writes @p store to @p filename, in a form that coap_psk_store_load() can
+ * map straight into memory.  The file is only meant to be read on hosts
+ * with the same byte order.
+ *
+ * @param store    The store.
+ * @param filename The file to write.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_psk_store_save(const coap_psk_store_t *store, const char *filename);
+
+/**
+ * Loads a store written by coap_psk_store_save().  The file is mapped
+ * rather than read where mmap() is available, so that even a large store
+ * is ready straight away, and must not be changed while the store is in
+ * use (write a new file and rename() it over the old one instead).
+ *
+ * @param filename The file to load.
+ *
+ * @return The store, or @c NULL if @p filename cannot be read or is not a
+ *         store.
+ */
+coap_psk_store_t *coap_psk_store_load(const char *filename);
+
+/**
+ * Releases @p store.  This must not be called for a store that has been
+ * handed to coap_context_set_psk_store().
+ *
+ * @param store The store.
+ */
+void coap_psk_store_free(coap_psk_store_t *store);
+
+/**
+ * Makes @p store the store that the server sessions of @p context look the
+ * PSK identities of their clients up in, replacing any previous store.
+ * @p context takes over @p store.  This may be called from any thread,
+ * also while coap_io_process() is running: the handshakes that are under
+ * way carry on with the store they started with, which is released once
+ * they no longer use it.
+ *
+ * The identities that are not in @p store are handled as before, by the
+ * @c validate_id_call_back or with the key set by coap_context_set_psk2().
+ *
+ * @param context The context.
+ * @param store   The store, or @c NULL to stop using a store.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_psk_store(coap_context_t *context,
+                               coap_psk_store_t *store);
+
+/** @} */
+
+#endif /* COAP_PSK_STORE_H_ */
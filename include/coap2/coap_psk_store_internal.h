@@ -0,0 +1,63 @@
+/*
+ * coap_psk_store_internal.h -- Pre-Shared Keys of the clients of a server
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_psk_store_internal.h
+ * @brief Internal PSK identity store functions
+ */
+
+#ifndef COAP_PSK_STORE_INTERNAL_H_
+#define COAP_PSK_STORE_INTERNAL_H_
+
+/**
+ * @defgroup psk_store_internal PSK Identity Store (Internal)
+ * Functions that the (D)TLS libraries use to look the PSK identities of
+ * clients up in the store of the context.
+ * Internal API functions
+ * @{
+ */
+
+/**
+ * Looks @p identity up in @p store.
+ *
+ * @param store        The store.
+ * @param identity     The PSK identity.
+ * @param identity_len The length of @p identity.
+ * @param key          Set to the key of @p identity, pointing into @p store.
+ *
+ * @return @c 1 if @p identity was found, else @c 0.
+ */
+int coap_psk_store_find(const coap_psk_store_t *store,
+                        const uint8_t *identity, size_t identity_len,
+                        coap_bin_const_t *key);
+
+/**
+ * Looks @p identity up in the store of the context of @p session and, if
+ * it is there, sets the @c psk_key of @p session to its key, for the
+ * context's @c get_server_psk to pick up.  This may be called from the
+ * DTLS handshake worker threads.
+ *
+ * @param session      The server session.
+ * @param identity     The PSK identity the client has sent.
+ * @param identity_len The length of @p identity.
+ *
+ * @return @c 1 if @p identity was found, else @c 0.
+ */
+int coap_psk_store_set_session_key(coap_session_t *session,
+                                   const uint8_t *identity,
+                                   size_t identity_len);
+
+/**
+ * Releases the store of @p context.
+ *
+ * @param context The context.
+ */
+void coap_psk_store_release_all(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_PSK_STORE_INTERNAL_H_ */
@@ -0,0 +1,49 @@
+/*
+ * coap_ratelimit_internal.h -- Rate limiting of the peers
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_ratelimit_internal.h
+ * @brief Internal per-peer rate limiting functions
+ */
+
+#ifndef COAP_RATELIMIT_INTERNAL_H_
+#define COAP_RATELIMIT_INTERNAL_H_
+
+/**
+ * @defgroup ratelimit_internal Rate Limiting (Internal)
+ * Functions that keep the token buckets set up with
+ * coap_context_set_ratelimit(), so that the datagrams of a peer that sends
+ * too fast are turned away straight from the receive buffer.
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_ratelimit_state_t coap_ratelimit_state_t;
+
+/**
+ * Takes a token from the bucket of the peer that @p packet was received
+ * from on @p endpoint.  If there is none left, the datagram is counted and,
+ * depending on the policy, a request is answered with 5.03.  Nothing of
+ * @p data is looked at unless a 5.03 is sent.
+ *
+ * @param endpoint The endpoint that @p packet was received on.
+ * @param packet   The datagram.
+ * @param data     The contents of the datagram.
+ * @param length   The length of @p data.
+ * @param now      The current time.
+ *
+ * @return @c 1 if the datagram is to be handled, @c 0 if it is to be
+ *         dropped.
+ */
+int coap_ratelimit_check(coap_endpoint_t *endpoint,
+                         const coap_packet_t *packet,
+                         const uint8_t *data, size_t length,
+                         coap_tick_t now);
+
+/** @} */
+
+#endif /* COAP_RATELIMIT_INTERNAL_H_ */
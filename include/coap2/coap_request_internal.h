@@ -0,0 +1,76 @@
+/*
+ * coap_request_internal.h -- Handlers of the requests sent by a session
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_request_internal.h
+ * @brief Internal per-request response handler functions
+ */
+
+#ifndef COAP_REQUEST_INTERNAL_H_
+#define COAP_REQUEST_INTERNAL_H_
+
+/**
+ * @defgroup request_internal Request Handlers (Internal)
+ * Functions that pass the responses to the requests sent with
+ * coap_send_request() to the handlers of those requests, by token.
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_request_cb_t coap_request_cb_t;
+
+/**
+ * Passes the response @p rcvd to the handler of the request of @p session
+ * with the same token, if there is one.  The handler is released once the
+ * response is final, that is neither a notification nor a block with more
+ * to follow.
+ *
+ * @param session The session.
+ * @param rcvd    The response, with the token of the request.
+ * @param result  Set to what the handler returned, unless NULL.
+ *
+ * @return @c 1 if passed to the handler of the request, else @c 0 if the
+ *         response is for the response handler of the context.
+ */
+int coap_request_response(coap_session_t *session, coap_pdu_t *rcvd,
+                          coap_response_t *result);
+
+/**
+ * Tells the handler of the request @p sent of @p session, if there is one,
+ * that the request could not be delivered, and then releases it.
+ *
+ * @param session The session.
+ * @param sent    The request.
+ *
+ * @return @c 1 if passed to the handler of the request, else @c 0 if it is
+ *         for the nack handler of the context.
+ */
+int coap_request_nack(coap_session_t *session, const coap_pdu_t *sent);
+
+/**
+ * Times out the requests of @p session that have not been answered in
+ * time.
+ *
+ * @param session The session.
+ * @param now     The current time.
+ *
+ * @return The time the next request is due to time out, or @c 0 if none.
+ */
+coap_tick_t coap_request_check_timeouts(coap_session_t *session,
+                                        coap_tick_t now);
+
+/**
+ * Tells the handlers of all the requests of @p session that are still
+ * waiting that the session is going away, and releases them.
+ *
+ * @param session The session.
+ */
+void coap_request_free(coap_session_t *session);
+
+/** @} */
+
+#endif /* COAP_REQUEST_INTERNAL_H_ */
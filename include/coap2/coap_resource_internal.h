@@ -31,6 +31,32 @@ struct coap_attr_t {
   int flags;
 };
 
+/**
+ * Number of request methods that a resource has handlers for: @c GET,
+ * @c POST, @c PUT, @c DELETE, @c FETCH, @c PATCH and @c IPATCH.
+ */
+#define COAP_RESOURCE_METHODS 7
+
+/**
+ * State of a resource created by coap_resource_file_init().
+ */
+typedef struct coap_file_resource_t coap_file_resource_t;
+
+/**
+ * Representation set by coap_resource_set_representation().  The response
+ * is built once, with its options and payload, and the payload is also
+ * registered as a large body of the resource, so that Block2 transfers are
+ * served from the same buffer.  Both go when the last transfer of the body
+ * has finished after the representation has been replaced.
+ */
+typedef struct coap_representation_t {
+  coap_pdu_t *pdu;          /**< 2.05 response without a token */
+  coap_large_body_t *body;  /**< the payload of @p pdu */
+  uint64_t etag;            /**< the ETag of @p pdu */
+  uint16_t media_type;      /**< the Content-Format of @p pdu */
+  int maxage;               /**< the Max-Age of @p pdu, or -1 */
+} coap_representation_t;
+
 /**
 * Abstraction of resource that can be attached to coap_context_t.
 * The key is uri_path.
@@ -43,6 +69,14 @@ struct coap_resource_t {
   unsigned int cacheable:1;      /**< can be cached */
   unsigned int is_unknown:1;     /**< resource created for unknown handler */
   unsigned int is_proxy_uri:1;   /**< resource created for proxy URI handler */
+  unsigned int dirty_queued:1;   /**< on the context's list of dirty
+                                  *   resources */
+  unsigned int is_route:1;       /**< in the context's route index */
+  unsigned int notifying:1;      /**< the subscribers are being notified */
+  unsigned int has_value:1;      /**< value is set */
+  unsigned int compact:1;        /**< added by coap_add_resources_compact(),
+                                  *   its uri_path, attributes and handlers
+                                  *   are kept by context->catalog */
 
   /**
    * Used to store handlers for the seven coap methods @c GET, @c POST, @c PUT,
@@ -50,13 +84,27 @@ struct coap_resource_t {
    * coap_dispatch() will pass incoming requests to handle_request() and then
    * to the handler that corresponds to its request method or generate a 4.05
    * response if no handler is available.
+   * Points to own_handler, or to a handler set shared by compact resources.
    */
-  coap_method_handler_t handler[7];
+  coap_method_handler_t *handler;
 
   UT_hash_handle hh;
 
   coap_attr_t *link_attr; /**< attributes to be included with the link format */
   coap_subscription_t *subscribers;  /**< list of observers for this resource */
+  coap_subscription_t *subscriber_index; /**< subscribers hashed by
+                                          *   (session, token) */
+  struct coap_subscription_slab_t *subscription_slabs; /**< storage of the
+                                                        *   subscribers */
+  struct coap_subscription_slab_t *subscription_partial; /**< those of
+                                                          *   subscription_slabs
+                                                          *   with free slots */
+  double value; /**< numeric state for the conditional attributes of the
+                 *   observers, set by coap_resource_notify_observers_value() */
+  coap_subscription_t *dirty_subscribers; /**< observers that still have to
+                                           *   be notified (dirty set) */
+  struct coap_resource_t *dirty_next; /**< next in context's dirty list */
+  struct coap_resource_t *dirty_prev; /**< previous in context's dirty list */
 
   /**
    * Request URI Path for this resource. This field will point into static
@@ -67,12 +115,30 @@ struct coap_resource_t {
                                     resource */
   int flags; /**< zero or more COAP_RESOURCE_FLAGS_* or'd together */
 
+  /**
+   * Bytes taken by the link of the resource in the rendered
+   * /.well-known/core of its context
+   */
+  size_t wellknown_length;
+
+  /**
+   * Order in which the resource was added to its context, so that filtered
+   * discovery lists resources in the same order as the whole catalog
+   */
+  unsigned int seq;
+
   /**
   * The next value for the Observe option. This field must be increased each
   * time the resource changes. Only the lower 24 bits are sent.
   */
   unsigned int observe;
 
+  /**
+   * Bumped by each request that may change the resource, so that a BLOCK2
+   * body that is still being sent from before then is not used again.
+   */
+  uint32_t generation;
+
   /**
    * Pointer back to the context that 'owns' this resource.
    */
@@ -88,14 +154,110 @@ struct coap_resource_t {
    */
   coap_str_const_t ** proxy_name_list;
 
+  /**
+   * Large bodies registered by coap_resource_add_large_body()
+   */
+  coap_large_body_t *large_bodies;
+
+  /**
+   * The file served by a resource from coap_resource_file_init(), or NULL
+   */
+  coap_file_resource_t *file;
+
+  /**
+   * The representation set by coap_resource_set_representation(), or NULL
+   */
+  coap_representation_t *rep;
+
+  /**
+   * Responses cached for a resource with COAP_RESOURCE_FLAGS_CACHE_RESPONSES
+   */
+  coap_cache_entry_t *cached_responses;
+
+  /**
+   * Current ETag of a resource with COAP_RESOURCE_FLAGS_AUTO_ETAG, or 0 if
+   * a new one is to be picked
+   */
+  uint64_t etag;
+
+  /**
+   * Time taken by the request handlers, or NULL until the first request is
+   * handled with histograms kept
+   */
+  coap_histogram_t *handler_histogram;
+
   /**
    * This pointer is under user control. It can be used to store context for
    * the coap handler.
    */
   void *user_data;
 
+  /**
+   * Storage of the handlers of a resource that is not compact.  This must
+   * stay the last field, as it is not allocated for compact resources.
+   */
+  coap_method_handler_t own_handler[COAP_RESOURCE_METHODS];
 };
 
+/**
+ * Frees the file state of a resource created by coap_resource_file_init().
+ * Does nothing for other resources.
+ *
+ * @param resource The resource being deleted.
+ */
+void coap_delete_file_resource(coap_resource_t *resource);
+
+/**
+ * Returns the current ETag of @p resource, picking a new one from the
+ * context if it has changed since the last call.
+ *
+ * @param resource The resource.
+ *
+ * @return The ETag, which is never @c 0.
+ */
+uint64_t coap_resource_etag(coap_resource_t *resource);
+
+/**
+ * Checks the ETag, If-Match and If-None-Match options of @p request
+ * against the current ETag of a resource with COAP_RESOURCE_FLAGS_AUTO_ETAG.
+ *
+ * @param resource The resource the request is for.
+ * @param request  The request.
+ * @param response The response, with the token already added.
+ *
+ * @return @c 1 if @p response has been filled in with 2.03 or 4.12, else
+ *         @c 0 and the handler has to be called.
+ */
+int coap_resource_check_etag(coap_resource_t *resource, coap_pdu_t *request,
+                             coap_pdu_t *response);
+
+/**
+ * Adds the current ETag of a resource with COAP_RESOURCE_FLAGS_AUTO_ETAG to
+ * the handler's @p response if it is a 2.05 without an ETag.
+ *
+ * @param resource The resource the response is for.
+ * @param response The response.
+ */
+void coap_resource_add_etag(coap_resource_t *resource, coap_pdu_t *response);
+
+/**
+ * Answers a GET @p request for a resource with a representation set by
+ * coap_resource_set_representation() by copying in the pre-built response,
+ * or with 2.03 if the request carries its ETag.  Requests with an Observe,
+ * Block2, Q-Block2, If-Match or If-None-Match option, and responses that do
+ * not fit into @p response, are left to the handler.
+ *
+ * @param resource The resource the request is for.
+ * @param request  The request.
+ * @param response The response, with the token already added.
+ *
+ * @return @c 1 if @p response has been filled in, else @c 0 and the handler
+ *         has to be called.
+ */
+int coap_resource_fill_representation(coap_resource_t *resource,
+                                      coap_pdu_t *request,
+                                      coap_pdu_t *response);
+
 /**
  * Deletes all resources from given @p context and frees their storage.
  *
@@ -103,8 +265,85 @@ struct coap_resource_t {
  */
 void coap_delete_all_resources(coap_context_t *context);
 
+/**
+ * One value of an attribute in the attribute index of a context.  The value
+ * points into the attribute (or the uri_path for @c href) of the resource.
+ */
+typedef struct coap_attr_entry_t {
+  const uint8_t *s;             /**< the value, without quotes */
+  size_t length;                /**< length of the value */
+  coap_resource_t *resource;    /**< the resource the value belongs to */
+} coap_attr_entry_t;
+
+/**
+ * The values of one attribute name over all the resources of a context,
+ * sorted on value and then on the seq of the resource, so that exact and
+ * prefix queries are a binary search.  The @c rt, @c if and @c rel values
+ * are split into their space separated tokens.
+ */
+typedef struct coap_attr_index_t {
+  UT_hash_handle hh;            /**< in the context's attr_index */
+  coap_str_const_t *name;       /**< attribute name (or @c href) */
+  coap_attr_entry_t *entries;   /**< the sorted values */
+  size_t count;                 /**< number of entries in use */
+  size_t size;                  /**< number of entries allocated */
+} coap_attr_index_t;
+
+/**
+ * A node of the route index of a context, one per distinct route segment.
+ */
+typedef struct coap_route_node_t {
+  UT_hash_handle hh;                   /**< in the parent's children */
+  coap_string_t *segment;              /**< literal segment, decoded */
+  struct coap_route_node_t *children;  /**< literal segments that follow */
+  struct coap_route_node_t *param;     /**< the {name} segment that
+                                            follows, if any */
+  coap_resource_t *resource;           /**< route that ends here */
+  coap_resource_t *wildcard;           /**< route that ends with * here */
+} coap_route_node_t;
+
+/**
+ * Returns the resource that matches the Uri-Path options of @p request,
+ * without building the path.  The options are hashed as they are encoded by
+ * coap_get_uri_path() and compared against the hash each resource was added
+ * with.  If no resource has been added for the path, the route index is
+ * searched.
+ *
+ * @param context The context with the resources.
+ * @param request The request.
+ *
+ * @return The resource, or @c NULL if none matches.
+ */
+coap_resource_t *coap_get_resource_from_request(coap_context_t *context,
+                                                const coap_pdu_t *request);
+
+/**
+ * Returns the length of the path that coap_get_uri_path() would build for
+ * @p request, and sets @p hashv to its coap_resource_hash().
+ *
+ * @param request The request.
+ * @param hashv   Set to the hash of the path.
+ *
+ * @return The length of the percent-encoded path.
+ */
+size_t coap_uri_path_hash(const coap_pdu_t *request, unsigned *hashv);
+
+/**
+ * Compares the path that coap_get_uri_path() would build for @p request
+ * with @p uri_path.
+ *
+ * @param request  The request.
+ * @param uri_path The path to compare with.
+ *
+ * @return @c 1 if they are the same, else @c 0.
+ */
+int coap_uri_path_equal(const coap_pdu_t *request,
+                        const coap_str_const_t *uri_path);
+
 #define RESOURCES_ADD(r, obj) \
-  HASH_ADD(hh, (r), uri_path->s[0], (obj)->uri_path->length, (obj))
+  HASH_ADD_KEYPTR_BYHASHVALUE(hh, (r), (obj)->uri_path->s, \
+                              (obj)->uri_path->length, \
+                              coap_resource_hash((obj)->uri_path), (obj))
 
 #define RESOURCES_DELETE(r, obj) \
   HASH_DELETE(hh, (r), (obj))
@@ -114,7 +353,8 @@ void coap_delete_all_resources(coap_context_t *context);
   HASH_ITER(hh, (r), tmp, rtmp)
 
 #define RESOURCES_FIND(r, k, res) {                     \
-    HASH_FIND(hh, (r), (k)->s, (k)->length, (res)); \
+    HASH_FIND_BYHASHVALUE(hh, (r), (k)->s, (k)->length, \
+                          coap_resource_hash(k), (res)); \
   }
 
 /**
@@ -19,7 +19,7 @@
 #include "coap2/coap_io.h"
 #include "coap2/coap_time.h"
 #include "coap2/pdu.h"
-#include "coap2/uthash.h"
+#include "coap2/coap_hashkey.h"
 #include "coap2/coap_dtls.h"
 
 /**
@@ -36,9 +36,65 @@ typedef struct coap_fixed_point_t {
 #define COAP_PARTIAL_SESSION_TIMEOUT_TICKS (30 * COAP_TICKS_PER_SECOND)
 #define COAP_DEFAULT_MAX_HANDSHAKE_SESSIONS 100
 
+/**
+ * The length of the DTLS Connection ID (RFC 9146) that a server session asks
+ * its peer to put in the records it sends, so that the session can still be
+ * found if the address of the peer changes (e.g. NAT rebinding).
+ */
+#ifndef COAP_DTLS_CID_LENGTH
+#define COAP_DTLS_CID_LENGTH 6
+#endif /* COAP_DTLS_CID_LENGTH */
+
 #define COAP_PROTO_NOT_RELIABLE(p) ((p)==COAP_PROTO_UDP || (p)==COAP_PROTO_DTLS)
 #define COAP_PROTO_RELIABLE(p) ((p)==COAP_PROTO_TCP || (p)==COAP_PROTO_TLS)
 
+/**
+ * Traffic counters of a session, an endpoint or a context.  Those of an
+ * endpoint include its sessions, and those of a context include all of its
+ * endpoints and sessions.
+ */
+typedef struct coap_counters_t {
+  uint64_t rx_pdus;       /**< PDUs received */
+  uint64_t rx_bytes;      /**< Size of the PDUs received */
+  uint64_t tx_pdus;       /**< PDUs sent, retransmissions included */
+  uint64_t tx_bytes;      /**< Size of the PDUs sent */
+  uint64_t retransmits;   /**< Confirmable PDUs sent again */
+  uint64_t duplicates;    /**< ACKs, blocks and CON requests received
+                               again */
+  uint64_t rx_rsts;       /**< RSTs received */
+  uint64_t tx_rsts;       /**< RSTs sent */
+  uint64_t dropped;       /**< Datagrams that could not be parsed or
+                               that no session was found for */
+  uint64_t dtls_failures; /**< (D)TLS errors, failed handshakes included */
+  uint64_t lg_timeouts;   /**< Large transfers given up as the peer
+                               stopped responding */
+  uint64_t overloaded;    /**< Requests answered with 5.03 and new
+                               sessions refused while overloaded */
+  uint64_t ratelimited;   /**< Datagrams turned away as their peer sent
+                               them too fast */
+} coap_counters_t;
+
+/**
+ * The round trip time estimators of a session that uses CoCoA (see
+ * coap_session_set_cocoa()), all in microseconds.  The strong estimator is
+ * fed by the CON messages that were acknowledged without being
+ * retransmitted, the weak one by those that were retransmitted once or
+ * twice (timed from the first transmission).
+ */
+typedef struct coap_rtt_stats_t {
+  uint32_t rto_us;           /**< Overall RTO that the next CON message
+                                  starts from */
+  uint32_t strong_srtt_us;   /**< Smoothed RTT of the strong estimator */
+  uint32_t strong_rttvar_us; /**< RTT variation of the strong estimator */
+  uint32_t strong_rto_us;    /**< RTO of the strong estimator */
+  uint32_t weak_srtt_us;     /**< Smoothed RTT of the weak estimator */
+  uint32_t weak_rttvar_us;   /**< RTT variation of the weak estimator */
+  uint32_t weak_rto_us;      /**< RTO of the weak estimator */
+  uint32_t last_rtt_us;      /**< The last RTT sample */
+  uint32_t strong_samples;   /**< Number of strong RTT samples */
+  uint32_t weak_samples;     /**< Number of weak RTT samples */
+} coap_rtt_stats_t;
+
 typedef uint8_t coap_session_type_t;
 /**
  * coap_session_type_t values
@@ -58,74 +114,122 @@ typedef uint8_t coap_session_state_t;
 #define COAP_SESSION_STATE_ESTABLISHED         4
 
 typedef struct coap_session_t {
+  /* Used for every PDU sent or received, kept in the first cache lines */
   coap_proto_t proto;               /**< protocol used */
   coap_session_type_t type;         /**< client or server side socket */
   coap_session_state_t state;       /**< current state of relationaship with peer */
+  uint8_t block_mode;             /**< Zero or more COAP_BLOCK_ or'd options */
+  uint16_t tx_mid;                  /**< the last message id that was used in this session */
+  uint16_t max_payloads;          /**< maximum Q-Block payloads in a burst
+                                       (default 10) */
   unsigned ref;                     /**< reference count from queues */
-  size_t tls_overhead;              /**< overhead of TLS layer */
-  size_t mtu;                       /**< path or CSM mtu */
-  coap_addr_hash_t addr_hash;  /**< Address hash for server incoming packets */
-  UT_hash_handle hh;
-  coap_addr_tuple_t addr_info;      /**< key: remote/local address info */
+  unsigned int con_active;          /**< Active CON request sent */
+  unsigned int nstart;              /**< maximum number of active CON
+                                         requests (default 1) */
   int ifindex;                      /**< interface index */
-  coap_socket_t sock;               /**< socket object for the session, if any */
-  coap_endpoint_t *endpoint;        /**< session's endpoint */
   struct coap_context_t *context;   /**< session's context */
+  coap_endpoint_t *endpoint;        /**< session's endpoint */
   void *tls;                        /**< security parameters */
-  uint16_t tx_mid;                  /**< the last message id that was used in this session */
-  uint8_t con_active;               /**< Active CON request sent */
-  uint8_t csm_block_supported;      /**< CSM TCP blocks supported */
-  coap_mid_t last_ping_mid;         /**< the last keepalive message id that was used in this session */
+  coap_tick_t last_rx_tx;
+  size_t mtu;                       /**< path or CSM mtu */
+  size_t tls_overhead;              /**< overhead of TLS layer */
+  size_t path_mtu;                  /**< UDP payload that the path MTU of
+                                         the socket was last seen to allow,
+                                         or 0 */
+  uint8_t path_mtu_lost;            /**< 1 if datagrams larger than
+                                         COAP_DEFAULT_MTU are being lost */
   struct coap_queue_t *delayqueue;  /**< list of delayed messages waiting to be sent */
+  struct coap_queue_t *sendqueue;   /**< this session's entries in the context's retransmission queue */
+  uint64_t tx_token;              /**< Next token number to use */
+  void *app;                        /**< application-specific data */
+  struct coap_session_ext_t *ext;   /**< State that only stream, secured or
+                                         keepalive sessions need, or NULL */
+  struct coap_dedup_t *dedup;     /**< CON requests received in the last
+                                       EXCHANGE_LIFETIME, oldest first */
+  struct coap_subscription_t *subscriptions; /**< Observations of the
+                                                  resources by this session */
+  coap_addr_hash_t addr_hash;  /**< Address hash for server incoming packets */
+  coap_addr_tuple_t addr_info;      /**< key: remote/local address info */
+  coap_counters_t counters;       /**< Traffic of this session */
+
+  /* The rest */
+  UT_hash_handle hh;
+  coap_socket_t sock;               /**< socket object for the session, if any */
+  struct coap_queue_t *delayqueue_tail; /**< last entry of delayqueue */
+  struct coap_queue_t *delayqueue_index; /**< delayqueue entries hashed by
+                                              message id, if the protocol
+                                              is not reliable */
   coap_lg_xmit_t *lg_xmit;          /**< list of large transmissions */
+  coap_lg_xmit_t *lg_xmit_token; /**< BLOCK1 lg_xmit entries hashed by token */
+  coap_lg_xmit_t *lg_xmit_resource; /**< BLOCK2 lg_xmit entries hashed by
+                                         resource */
   coap_lg_crcv_t *lg_crcv;       /**< Client list of expected large receives */
+  coap_lg_crcv_t *lg_crcv_token; /**< lg_crcv entries hashed by token */
   coap_lg_srcv_t *lg_srcv;       /**< Server list of expected large receives */
-  size_t partial_write;             /**< if > 0 indicates number of bytes already written from the pdu at the head of sendqueue */
-  uint8_t read_header[8];           /**< storage space for header of incoming message header */
-  size_t partial_read;              /**< if > 0 indicates number of bytes already read for an incoming message */
-  coap_pdu_t *partial_pdu;          /**< incomplete incoming pdu */
-  coap_tick_t last_rx_tx;
+  coap_lg_srcv_t *lg_srcv_resource; /**< lg_srcv entries hashed by resource */
+  coap_lg_srcv_t *lg_srcv_path;  /**< lg_srcv entries for the unknown and
+                                      proxy resources hashed by uri_path */
+  size_t corked_bytes;              /**< bytes held back in delayqueue for
+                                         coap_io_flush(), or 0 */
+  struct coap_session_t *cork_next; /**< next session in the context's list
+                                         of corked sessions */
   coap_tick_t last_tx_rst;
-  coap_tick_t last_ping;
-  coap_tick_t last_pong;
-  coap_tick_t csm_tx;
-  coap_dtls_cpsk_t cpsk_setup_data; /**< client provided PSK initial setup
-                                         data */
-  coap_bin_const_t *psk_identity;   /**< If client, this field contains the
-                                      current identity for server; When this
-                                      field is NULL, the current identity is
-                                      contained in cpsk_setup_data
-
-                                      If server, this field contains the client
-                                      provided identity.
-
-                                      Value maintained internally */
-  coap_bin_const_t *psk_key;        /**< If client, this field contains the
-                                      current pre-shared key for server;
-                                      When this field is NULL, the current
-                                      key is contained in cpsk_setup_data
-
-                                      If server, this field contains the
-                                      client's current key.
-
-                                      Value maintained internally */
-  coap_bin_const_t *psk_hint;       /**< If client, this field contains the
-                                      server provided identity hint.
-
-                                      If server, this field contains the
-                                      current hint for the client; When this
-                                      field is NULL, the current hint is
-                                      contained in context->spsk_setup_data
-
-                                      Value maintained internally */
-  void *app;                        /**< application-specific data */
   unsigned int max_retransmit;      /**< maximum re-transmit count (default 4) */
   coap_fixed_point_t ack_timeout;   /**< timeout waiting for ack (default 2 secs) */
   coap_fixed_point_t ack_random_factor; /**< ack random factor backoff (default 1.5) */
   unsigned int dtls_timeout_count;      /**< dtls setup retry counter */
   int dtls_event;                       /**< Tracking any (D)TLS events on this sesison */
-  uint8_t block_mode;             /**< Zero or more COAP_BLOCK_ or'd options */
-  uint64_t tx_token;              /**< Next token number to use */
+  struct coap_dtls_job_t *dtls_job; /**< DTLS handshake or records being
+                                         run by a worker thread or NULL */
+  UT_hash_handle hh_cid;          /**< Server sessions hashed by dtls_cid */
+  uint8_t dtls_cid[COAP_DTLS_CID_LENGTH]; /**< Server DTLS Connection ID */
+  uint8_t dtls_cid_set;           /**< 1 if dtls_cid is in use */
+  uint8_t in_idle_lru;            /**< 1 if in endpoint's idle_lru */
+  uint8_t in_hs_lru;              /**< 1 if in endpoint's hs_lru */
+  uint8_t in_timers;              /**< 1 if in context's session_timers */
+  uint8_t in_peers;               /**< 1 if in one of context's peer
+                                       indexes */
+  uint8_t cocoa;                  /**< 1 if the retransmission timeouts are
+                                       estimated with CoCoA */
+  struct coap_session_t *idle_prev; /**< Links for endpoint's idle_lru */
+  struct coap_session_t *idle_next;
+  struct coap_session_t *hs_prev;   /**< Links for endpoint's hs_lru */
+  struct coap_session_t *hs_next;
+  coap_tick_t timer_due;          /**< When the timeouts of the session next
+                                       need to be checked */
+  struct coap_session_t *timer_child;   /**< Links for context's */
+  struct coap_session_t *timer_sibling; /**< session_timers heap */
+  struct coap_session_t *timer_prev;
+  UT_hash_handle hh_peer;         /**< Sessions hashed by peer_key */
+  coap_peer_key_t peer_key;       /**< key: remote address and ifindex */
+  struct coap_proxy_origin_t *proxy_origin; /**< Forward proxy origin that
+                                                 this session goes to, or
+                                                 NULL */
+  struct coap_oscore_ctx_t *oscore; /**< OSCORE security context that the
+                                         requests are protected with, or
+                                         NULL */
+  struct coap_oscore_assoc_t *oscore_assoc; /**< Exchanges protected with
+                                                 OSCORE */
+  uint32_t trace_id;              /**< Identifies the session in the trace,
+                                       0 until its first PDU is traced */
+  unsigned int dedup_count;       /**< Number of entries in dedup */
+  struct coap_histogram_t *rtt_histogram; /**< Round trip times of the CON
+                                               messages sent, or NULL */
+  coap_rtt_stats_t rtt;           /**< CoCoA round trip time estimators */
+  uint64_t rto_updated_us;        /**< When rtt.rto_us was last updated,
+                                       from coap_histogram_clock() */
+  struct coap_async_state_t *async_token; /**< Asynchronous states of the
+                                               requests received, hashed
+                                               by token */
+  struct coap_request_cb_t *request_cbs; /**< Handlers of the requests sent
+                                              with coap_send_request(), by
+                                              token */
+  struct coap_request_cb_t *request_due; /**< Those of request_cbs with a
+                                              timeout, earliest first */
+  struct coap_pool_entry_t *pool_entry; /**< Entry in the client session
+                                             pool of the context, or NULL */
+  unsigned int obs_cond_count;    /**< Number of subscriptions with
+                                       conditional attributes */
 } coap_session_t;
 
 /**
@@ -284,6 +388,41 @@ int coap_session_refresh_psk_hint(coap_session_t *session,
 int coap_session_refresh_psk_key(coap_session_t *session,
                                  const struct coap_bin_const_t *psk_key);
 
+/**
+ * Returns the session's current Identity Hint (PSK).  If client, this is the
+ * hint provided by the server, if server, the hint being given to the client.
+ *
+ * @param session  The current coap_session_t object.
+ *
+ * @return The Identity Hint, or NULL if there is none (a server then uses
+ *         the hint in its context).
+ */
+const struct coap_bin_const_t *coap_session_get_psk_hint(
+                                            const coap_session_t *session);
+
+/**
+ * Returns the session's current pre-shared key (PSK).
+ *
+ * @param session  The current coap_session_t object.
+ *
+ * @return The pre-shared key, or NULL if none has been set for the session
+ *         (the initial key set up for the session or context is then used).
+ */
+const struct coap_bin_const_t *coap_session_get_psk_key(
+                                            const coap_session_t *session);
+
+/**
+ * Returns the session's current Identity (PSK).  If client, this is the
+ * identity being given to the server, if server, the identity provided by
+ * the client.
+ *
+ * @param session  The current coap_session_t object.
+ *
+ * @return The Identity, or NULL if there is none.
+ */
+const struct coap_bin_const_t *coap_session_get_psk_identity(
+                                            const coap_session_t *session);
+
 /**
 * Creates a new client session to the designated server with PKI credentials
 * @param ctx The CoAP context.
@@ -307,6 +446,96 @@ coap_session_t *coap_new_client_session_pki(
   struct coap_dtls_pki_t *setup_data
 );
 
+/**
+ * Sets up the client session pool of @p context, which keeps the sessions
+ * handed out by coap_get_client_session(), coap_get_client_session_psk2()
+ * and coap_get_client_session_pki(), so that those to the same server with
+ * the same security parameters are reused instead of paying for a new
+ * socket and (D)TLS handshake each time.  The sessions that the
+ * application no longer holds are evicted once they have not been handed
+ * out for @p idle_timeout seconds, or, least recently used first, to make
+ * room for a new session.  The pooled sessions are kept alive as any other
+ * by coap_context_set_keepalive().
+ *
+ * @param context      The context.
+ * @param max_sessions The number of sessions the pool keeps, or @c 0 to
+ *                     release them all and no longer pool sessions (the
+ *                     default).
+ * @param idle_timeout The number of seconds an unused session is kept, or
+ *                     @c 0 to keep it until it fails or room is needed.
+ */
+void coap_context_set_session_pool(struct coap_context_t *context,
+                                   unsigned int max_sessions,
+                                   unsigned int idle_timeout);
+
+/**
+ * Returns a session to @p server as coap_new_client_session() does, reusing
+ * the one in the client session pool of @p ctx that was set up with the same
+ * parameters if there is one that has not failed.  A new session is added to
+ * the pool (see coap_context_set_session_pool()).
+ *
+ * @param ctx      The CoAP context.
+ * @param local_if Address of local interface, or NULL.
+ * @param server   The server's address.
+ * @param proto    Protocol.
+ *
+ * @return The CoAP session or NULL if failed. Call coap_session_release()
+ *         once done with it.
+ */
+coap_session_t *coap_get_client_session(
+  struct coap_context_t *ctx,
+  const coap_address_t *local_if,
+  const coap_address_t *server,
+  coap_proto_t proto
+);
+
+/**
+ * Returns a session to @p server as coap_new_client_session_psk2() does,
+ * reusing the one in the client session pool of @p ctx that was set up with
+ * the same parameters, including the PSK credentials, if there is one that
+ * has not failed.
+ *
+ * @param ctx        The CoAP context.
+ * @param local_if   Address of local interface, or NULL.
+ * @param server     The server's address.
+ * @param proto      CoAP Protocol.
+ * @param setup_data PSK parameters.
+ *
+ * @return The CoAP session or NULL if failed. Call coap_session_release()
+ *         once done with it.
+ */
+coap_session_t *coap_get_client_session_psk2(
+  struct coap_context_t *ctx,
+  const coap_address_t *local_if,
+  const coap_address_t *server,
+  coap_proto_t proto,
+  struct coap_dtls_cpsk_t *setup_data
+);
+
+/**
+ * Returns a session to @p server as coap_new_client_session_pki() does,
+ * reusing the one in the client session pool of @p ctx that was set up with
+ * the same parameters, including the PKI definitions (the names of PEM
+ * files and PKCS11 URIs, or the contents of the buffers) and call-backs, if
+ * there is one that has not failed.
+ *
+ * @param ctx        The CoAP context.
+ * @param local_if   Address of local interface, or NULL.
+ * @param server     The server's address.
+ * @param proto      CoAP Protocol.
+ * @param setup_data PKI parameters.
+ *
+ * @return The CoAP session or NULL if failed. Call coap_session_release()
+ *         once done with it.
+ */
+coap_session_t *coap_get_client_session_pki(
+  struct coap_context_t *ctx,
+  const coap_address_t *local_if,
+  const coap_address_t *server,
+  coap_proto_t proto,
+  struct coap_dtls_pki_t *setup_data
+);
+
 /**
 * Creates a new server session for the specified endpoint.
 * @param ctx The CoAP context.
@@ -350,6 +579,44 @@ ssize_t coap_session_send(coap_session_t *session,
 ssize_t coap_session_write(coap_session_t *session,
   const uint8_t *data, size_t datalen);
 
+/**
+* Checks whether PDUs on @p session can be sent with the payload gathered
+* from outside of the PDU buffer without first copying it.
+*
+* @param session          The session.
+*
+* @return                 @c 1 if supported, else @c 0.
+*/
+int coap_session_can_sendv(const coap_session_t *session);
+
+#if COAP_SOCKET_SENDV
+/**
+* As coap_session_send(), but gathering the datagram from @p iov.
+*
+* @param session          Session to send data on.
+* @param iov              The buffers to send.
+* @param iovcnt           The number of entries in @p iov.
+*
+* @return                 The number of bytes written on success, or a value
+*                         less than zero on error.
+*/
+ssize_t coap_session_sendv(coap_session_t *session,
+  const struct iovec *iov, int iovcnt);
+
+/**
+* As coap_session_write(), but gathering the data from @p iov.
+*
+* @param session          Session to send data on.
+* @param iov              The buffers to send.
+* @param iovcnt           The number of entries in @p iov.
+*
+* @return                 The number of bytes written on success, or a value
+*                         less than zero on error.
+*/
+ssize_t coap_session_writev(coap_session_t *session,
+  const struct iovec *iov, int iovcnt);
+#endif /* COAP_SOCKET_SENDV */
+
 /**
 * Send a pdu according to the session's protocol. This function returns
 * the number of bytes that have been transmitted, or a value less than zero
@@ -429,6 +696,25 @@ void coap_free_endpoint(coap_endpoint_t *ep);
 */
 const char *coap_endpoint_str(const coap_endpoint_t *endpoint);
 
+/**
+ * Takes a snapshot of the traffic counters of @p session.
+ *
+ * @param session  The session.
+ * @param counters Set to the counters.
+ */
+void coap_session_get_counters(const coap_session_t *session,
+                               coap_counters_t *counters);
+
+/**
+ * Takes a snapshot of the traffic counters of @p endpoint, which include
+ * those of its sessions.
+ *
+ * @param endpoint The endpoint.
+ * @param counters Set to the counters.
+ */
+void coap_endpoint_get_counters(const coap_endpoint_t *endpoint,
+                                coap_counters_t *counters);
+
 /**
 * Lookup the server session for the packet received on an endpoint, or create
 * a new one.
@@ -461,6 +747,31 @@ coap_session_t *coap_session_get_by_peer(struct coap_context_t *ctx,
 void coap_session_free(coap_session_t *session);
 void coap_session_mfree(coap_session_t *session);
 
+/** The largest CoCoA RTO, and timeout of a retransmission, in microseconds. */
+#define COAP_COCOA_MAX_RTO_US 60000000
+
+/**
+ * Feeds the CoCoA estimators of @p session with the round trip time of a CON
+ * message that has been acknowledged.
+ *
+ * @param session     The session.
+ * @param sent_us     When the CON message was first sent, from
+ *                    coap_histogram_clock().
+ * @param retransmits The number of times it was retransmitted.
+ */
+void coap_session_rtt_sample(coap_session_t *session, uint64_t sent_us,
+                             unsigned int retransmits);
+
+/**
+ * Works out the CoCoA RTO that the next CON message of @p session starts
+ * from, after aging the estimate if there have been no samples for a while.
+ *
+ * @param session The session, which uses CoCoA.
+ *
+ * @return The RTO in microseconds.
+ */
+uint32_t coap_session_rto(coap_session_t *session);
+
  /**
   * @defgroup cc Rate Control
   * The transmission parameters for CoAP rate control ("Congestion
@@ -499,6 +810,8 @@ void coap_session_mfree(coap_session_t *session);
    * The number of simultaneous outstanding interactions that a client
    * maintains to a given server.
    * RFC 7252, Section 4.8 Default value of NSTART is 1
+   *
+   * Configurable using coap_session_set_nstart()
    */
 #define COAP_DEFAULT_NSTART 1
 
@@ -571,6 +884,43 @@ void coap_session_mfree(coap_session_t *session);
 #define COAP_NON_LIFETIME(s) \
  (COAP_MAX_TRANSMIT_SPAN(s) + COAP_MAX_LATENCY)
 
+  /**
+   * The number of payloads that are sent in one burst before waiting for
+   * the peer when using Q-Block1 or Q-Block2.
+   * RFC 9177, Section 7.2 Default value of MAX_PAYLOADS is 10
+   *
+   * Configurable using coap_session_set_max_payloads()
+   */
+#define COAP_DEFAULT_MAX_PAYLOADS 10
+
+  /**
+   * The largest MAX_PAYLOADS that can be configured.
+   */
+#define COAP_MAX_PAYLOADS_LIMIT 64
+
+  /**
+   * The NON_TIMEOUT definition for the session (s) in ticks.
+   *
+   * RFC 9177, Section 7.2 NON_TIMEOUT set to ACK_TIMEOUT
+   */
+#define COAP_NON_TIMEOUT_TICKS(s) \
+ ((coap_tick_t)(s->ack_timeout.integer_part * 1000 + \
+                s->ack_timeout.fractional_part) * COAP_TICKS_PER_SECOND / 1000)
+
+  /**
+   * The NON_RECEIVE_TIMEOUT definition for the session (s) in ticks.
+   *
+   * RFC 9177, Section 7.2 NON_RECEIVE_TIMEOUT set to 2 * NON_TIMEOUT
+   */
+#define COAP_NON_RECEIVE_TIMEOUT_TICKS(s) (2 * COAP_NON_TIMEOUT_TICKS(s))
+
+  /**
+   * The NON_MAX_RETRANSMIT definition for the session (s).
+   *
+   * RFC 9177, Section 7.2 NON_MAX_RETRANSMIT set to MAX_RETRANSMIT
+   */
+#define COAP_NON_MAX_RETRANSMIT(s) (s->max_retransmit)
+
       /** @} */
 
 /**
@@ -611,6 +961,32 @@ void coap_session_set_ack_timeout(coap_session_t *session,
 void coap_session_set_ack_random_factor(coap_session_t *session,
                                         coap_fixed_point_t value);
 
+/**
+* Set the maximum number of payloads sent in one burst when using Q-Block1
+* or Q-Block2 (RFC 9177 MAX_PAYLOADS)
+*
+* @param session The CoAP session.
+* @param value The value to set to. The default is 10 and the value is
+*              limited to COAP_MAX_PAYLOADS_LIMIT.
+*/
+void coap_session_set_max_payloads(coap_session_t *session,
+                                   uint16_t value);
+
+/**
+* Set the CoAP NSTART, the number of CON messages that can be waiting for
+* an ACK at the same time
+*
+* The CON messages beyond this are held back until earlier ones have been
+* acknowledged (or given up on), and are then sent in order.  RFC 7252
+* allows more than 1 only if the path to the peer is known to cope with the
+* additional load, such as a trusted backhaul.
+*
+* @param session The CoAP session.
+* @param value The value to set to. The default is 1 and should not normally
+*              get changed.
+*/
+void coap_session_set_nstart(coap_session_t *session, unsigned int value);
+
 /**
 * Get the CoAP maximum retransmit before failure
 *
@@ -622,6 +998,17 @@ void coap_session_set_ack_random_factor(coap_session_t *session,
 */
 unsigned int coap_session_get_max_transmit(coap_session_t *session);
 
+/**
+* Get the CoAP NSTART
+*
+* The number of CON messages that can be waiting for an ACK at the same time
+*
+* @param session The CoAP session.
+*
+* @return Current NSTART value
+*/
+unsigned int coap_session_get_nstart(coap_session_t *session);
+
 /**
 * Get the CoAP initial ack response timeout before the next re-transmit
 *
@@ -646,6 +1033,58 @@ coap_fixed_point_t coap_session_get_ack_timeout(coap_session_t *session);
 */
 coap_fixed_point_t coap_session_get_ack_random_factor(coap_session_t *session);
 
+/**
+* Get the maximum number of payloads sent in one burst when using Q-Block1
+* or Q-Block2 (RFC 9177 MAX_PAYLOADS)
+*
+* @param session The CoAP session.
+*
+* @return Current maximum payloads value
+*/
+uint16_t coap_session_get_max_payloads(coap_session_t *session);
+
+/**
+* Sets whether the retransmission timeouts of the CON messages of
+* @p session are estimated with CoCoA (draft-ietf-core-cocoa) rather than
+* starting from the fixed ack_timeout.
+*
+* CoCoA keeps a strong and a weak round trip time estimator, fed by the
+* acknowledgements of the CON messages, and combines them into an overall
+* RTO that the next CON message starts from (randomized by
+* ack_random_factor).  The timeout of a retransmission is multiplied by a
+* variable backoff factor of 3, 2 or 1.5 (for an initial RTO below 1
+* second, between 1 and 3 seconds, or above 3 seconds) instead of being
+* doubled.  The estimate starts from ack_timeout whenever CoCoA is enabled,
+* and ages towards it while no samples come in.
+*
+* @param session The CoAP session.
+* @param enable  @c 1 to use CoCoA, @c 0 for the fixed ack_timeout and
+*                binary exponential backoff of RFC 7252 (the default,
+*                unless set by coap_context_set_cocoa()).
+*/
+void coap_session_set_cocoa(coap_session_t *session, int enable);
+
+/**
+* Get whether the retransmission timeouts of @p session are estimated with
+* CoCoA.
+*
+* @param session The CoAP session.
+*
+* @return @c 1 if CoCoA is used, else @c 0.
+*/
+int coap_session_get_cocoa(coap_session_t *session);
+
+/**
+* Get the CoCoA round trip time estimators of @p session.
+*
+* @param session The CoAP session.
+* @param stats   Where the estimators are copied to.
+*
+* @return @c 1 if successful, else @c 0 if @p session does not use CoCoA.
+*/
+int coap_session_get_rtt_stats(coap_session_t *session,
+                               coap_rtt_stats_t *stats);
+
 /**
  * Send a ping message for the session.
  * @param session The CoAP session.
@@ -23,6 +23,23 @@
  * @{
  */
 
+/**
+ * Index of the server sessions of an endpoint by their coap_addr_hash_t.
+ * The sessions are kept in a dense array for iteration, and are found
+ * through an open-addressing table whose slots hold their position in that
+ * array.  A control byte per slot holds 7 bits of the hash, so that a
+ * lookup mostly touches a single cache line before comparing a key.
+ */
+typedef struct coap_session_index_t {
+  struct coap_session_t **sessions; /**< the sessions, in no particular
+                                         order */
+  uint32_t *pos;          /**< per slot: position in @p sessions */
+  uint8_t *ctrl;          /**< per slot: 0 if empty, else 0x80 and the top
+                               7 bits of the hash */
+  unsigned int count;     /**< number of sessions */
+  unsigned int mask;      /**< number of slots - 1, or 0 if none yet */
+} coap_session_index_t;
+
 /**
 * Abstraction of virtual endpoint that can be attached to coap_context_t. The
 * keys (port, bind_addr) must uniquely identify this endpoint.
@@ -34,9 +51,399 @@ struct coap_endpoint_t {
   uint16_t default_mtu;           /**< default mtu for this interface */
   coap_socket_t sock;             /**< socket object for the interface, if any */
   coap_address_t bind_addr;       /**< local interface address */
-  struct coap_session_t *sessions; /**< hash table or list of active sessions */
+  coap_session_index_t sessions;  /**< active sessions */
+  struct coap_session_t *sessions_cid; /**< server sessions hashed by DTLS
+                                            Connection ID */
+  struct coap_session_t *idle_lru; /**< unreferenced server sessions, least
+                                        recently used first */
+  struct coap_session_t *hs_lru;   /**< unreferenced sessions in (D)TLS
+                                        handshake, least recently used
+                                        first */
+  unsigned int num_idle;           /**< number of sessions in idle_lru */
+  unsigned int num_hs;             /**< number of sessions in hs_lru */
+  coap_counters_t counters;        /**< Traffic of this endpoint */
+#ifdef COAP_IO_URING_SUPPORT
+  uint64_t uring_id;               /**< io_uring user_data of the multishot
+                                        receive, or 0 if not read by
+                                        io_uring */
+#endif /* COAP_IO_URING_SUPPORT */
 };
 
+/**
+ * Finds the session for @p key in @p index.
+ *
+ * @param index The session index.
+ * @param key   The address hash of the session.
+ *
+ * @return The session or @c NULL if not found.
+ */
+coap_session_t *coap_session_index_find(const coap_session_index_t *index,
+                                        const coap_addr_hash_t *key);
+
+/**
+ * Adds @p session to @p index under its current @c addr_hash.
+ *
+ * @param index   The session index.
+ * @param session The session, which must not be in @p index yet.
+ *
+ * @return @c 1 on success, or @c 0 if out of memory.
+ */
+int coap_session_index_add(coap_session_index_t *index,
+                           coap_session_t *session);
+
+/**
+ * Removes @p session from @p index, if it is there.  The last session of
+ * the dense array takes its place.
+ *
+ * @param index   The session index.
+ * @param session The session.
+ */
+void coap_session_index_remove(coap_session_index_t *index,
+                               coap_session_t *session);
+
+/**
+ * Releases the storage of @p index, leaving it empty.
+ *
+ * @param index The session index.
+ */
+void coap_session_index_free(coap_session_index_t *index);
+
+/* Steps @p pos back to the previous session of @p index, if any. */
+COAP_STATIC_INLINE coap_session_t *
+coap_session_index_prev(const coap_session_index_t *index, unsigned int *pos) {
+  if (*pos > index->count)
+    *pos = index->count;
+  return *pos ? index->sessions[--*pos] : NULL;
+}
+
+/**
+ * Iterates over the sessions in @p index, with @p pos an unsigned int
+ * holding the position.  The loop body may remove the current session
+ * @p el.
+ */
+#define SESSIONS_INDEX_ITER(index, el, pos) \
+  for ((pos) = (index)->count; \
+       ((el) = coap_session_index_prev((index), &(pos))) != NULL; )
+
+/**
+ * Takes the first entry off the delayqueue of @p session.
+ *
+ * @param session The session.
+ *
+ * @return The entry, or NULL if the delayqueue is empty.
+ */
+struct coap_queue_t *coap_session_delayqueue_pop(coap_session_t *session);
+
+/**
+ * Puts @p node back at the front of the delayqueue of @p session, as it
+ * could not be sent (in full) after all.
+ *
+ * @param session The session.
+ * @param node    The entry taken off by coap_session_delayqueue_pop().
+ */
+void coap_session_delayqueue_push(coap_session_t *session,
+                                  struct coap_queue_t *node);
+
+/**
+ * The state of a session that plain UDP sessions mostly do without, kept
+ * out of coap_session_t to make that smaller.  Sessions that are not plain
+ * UDP get it when they are created, a plain UDP session only once it needs
+ * it (keepalive pings, or PSK credentials set up for it).
+ */
+typedef struct coap_session_ext_t {
+  size_t partial_write;             /**< if > 0 indicates number of bytes already written from the pdu at the head of sendqueue */
+  uint8_t read_header[8];           /**< storage space for header of incoming message header */
+  size_t partial_read;              /**< if > 0 indicates number of bytes already read for an incoming message */
+  coap_pdu_t *partial_pdu;          /**< incomplete incoming pdu */
+  uint8_t *read_buf;                /**< receive ring buffer of a TCP or TLS
+                                         session, frames are parsed in place */
+  size_t read_head;                 /**< start of the unparsed bytes in
+                                         read_buf */
+  size_t read_tail;                 /**< end of the bytes read into read_buf */
+  uint8_t *write_buf;               /**< the PDUs gathered into a single TLS
+                                         record */
+  size_t write_pending;             /**< length of write_buf that the TLS
+                                         library has to be given again */
+  uint8_t csm_block_supported;      /**< CSM TCP blocks supported */
+  coap_mid_t last_ping_mid;         /**< the last keepalive message id that was used in this session */
+  coap_tick_t last_ping;
+  coap_tick_t last_pong;
+  coap_tick_t csm_tx;
+  coap_dtls_cpsk_t cpsk_setup_data; /**< client provided PSK initial setup
+                                         data */
+  coap_bin_const_t *psk_identity;   /**< If client, this field contains the
+                                      current identity for server; When this
+                                      field is NULL, the current identity is
+                                      contained in cpsk_setup_data
+
+                                      If server, this field contains the client
+                                      provided identity.
+
+                                      Value maintained internally */
+  coap_bin_const_t *psk_key;        /**< If client, this field contains the
+                                      current pre-shared key for server;
+                                      When this field is NULL, the current
+                                      key is contained in cpsk_setup_data
+
+                                      If server, this field contains the
+                                      client's current key.
+
+                                      Value maintained internally */
+  coap_bin_const_t *psk_hint;       /**< If client, this field contains the
+                                      server provided identity hint.
+
+                                      If server, this field contains the
+                                      current hint for the client; When this
+                                      field is NULL, the current hint is
+                                      contained in context->spsk_setup_data
+
+                                      Value maintained internally */
+  coap_address_t cid_remote;      /**< New peer address of a record with
+                                       dtls_cid that is yet to be
+                                       authenticated */
+  uint8_t cid_remote_set;         /**< 1 if cid_remote is valid */
+} coap_session_ext_t;
+
+/**
+ * Returns the coap_session_ext_t of @p session, which is allocated if it
+ * has none yet.
+ *
+ * @param session The session.
+ *
+ * @return The extension, or NULL if it could not be allocated.
+ */
+coap_session_ext_t *coap_session_ext(coap_session_t *session);
+
+/**
+ * Fills @p key with the parts of @p remote that coap_address_equals()
+ * compares, and @p ifindex, so that it can be hashed.
+ *
+ * @param key     The key to fill in.
+ * @param remote  The address.
+ * @param ifindex The interface index.
+ */
+void coap_session_peer_key(coap_peer_key_t *key, const coap_address_t *remote,
+                           int ifindex);
+
+/**
+ * Adds @p session to the peer index of its context that
+ * coap_session_get_by_peer() uses, or re-keys it there after its remote
+ * address or ifindex has changed.
+ *
+ * @param session The session.
+ */
+void coap_session_peer_update(coap_session_t *session);
+
+/**
+ * Removes @p session from the peer index of its context, if it is there.
+ *
+ * @param session The session.
+ */
+void coap_session_peer_remove(coap_session_t *session);
+
+/**
+ * The maximum number of servers for which a context keeps the (D)TLS state
+ * needed to resume a client session.
+ */
+#ifndef COAP_TLS_RESUME_MAX
+#define COAP_TLS_RESUME_MAX 8
+#endif /* COAP_TLS_RESUME_MAX */
+
+/**
+ * The size of the receive buffer of a TCP or TLS session.  Frames that lie
+ * wholly in the buffer are parsed in place, so it is best kept well above
+ * the size of the PDUs usually received.
+ */
+#ifndef COAP_TCP_READ_BUF_SIZE
+#define COAP_TCP_READ_BUF_SIZE 8192
+#endif /* COAP_TCP_READ_BUF_SIZE */
+
+/**
+ * The most buffers that the queued PDUs of a TCP session are gathered from
+ * for a single writev().
+ */
+#ifndef COAP_TCP_WRITE_IOV_MAX
+#define COAP_TCP_WRITE_IOV_MAX 64
+#endif /* COAP_TCP_WRITE_IOV_MAX */
+
+/**
+ * The most bytes of the queued PDUs of a TLS session that are gathered into
+ * a single write, the largest TLS record.
+ */
+#ifndef COAP_TLS_WRITE_BUF_SIZE
+#define COAP_TLS_WRITE_BUF_SIZE 16384
+#endif /* COAP_TLS_WRITE_BUF_SIZE */
+
+/**
+ * Adds @p n to the traffic counter @p counter of @p session, of its endpoint
+ * if it has one, and of its context.  The counters are only updated by the
+ * I/O thread, so plain increments are used.
+ */
+#define COAP_COUNT(session, counter, n) do { \
+    coap_session_t *count_s_ = (session); \
+    uint64_t count_n_ = (n); \
+    count_s_->counters.counter += count_n_; \
+    if (count_s_->endpoint) \
+      count_s_->endpoint->counters.counter += count_n_; \
+    count_s_->context->counters.counter += count_n_; \
+  } while (0)
+
+/**
+ * Adds @p n to the traffic counter @p counter of @p endpoint and of its
+ * context, for traffic that has no session.
+ */
+#define COAP_COUNT_ENDPOINT(endpoint, counter, n) do { \
+    coap_endpoint_t *count_e_ = (endpoint); \
+    uint64_t count_n_ = (n); \
+    count_e_->counters.counter += count_n_; \
+    count_e_->context->counters.counter += count_n_; \
+  } while (0)
+
+/**
+ * The (D)TLS state saved by a client session, so that the next session to
+ * the same server can resume it instead of doing a full handshake.  The
+ * contents of @p data are only known to the (D)TLS library.
+ */
+typedef struct coap_tls_resume_t {
+  struct coap_tls_resume_t *next;
+  coap_proto_t proto;           /**< COAP_PROTO_DTLS or COAP_PROTO_TLS */
+  coap_address_t remote;        /**< the server */
+  coap_bin_const_t *identity;   /**< PSK identity used, or NULL */
+  size_t length;                /**< length of @p data */
+  uint8_t data[1];              /**< the (D)TLS library's session state */
+} coap_tls_resume_t;
+
+/**
+ * Saves the (D)TLS state of client @p session so that it can be resumed by
+ * a later session to the same server, replacing any state saved before.
+ * Called by the (D)TLS library code when a session is freed.
+ *
+ * @param session The client session.
+ * @param data    The session state.
+ * @param length  The length of @p data.
+ */
+void coap_tls_resume_save(coap_session_t *session,
+                          const uint8_t *data, size_t length);
+
+/**
+ * Finds the (D)TLS state saved by coap_tls_resume_save() for a new client
+ * session to the same server.
+ *
+ * @param session The client session.
+ *
+ * @return The saved state or @c NULL if none.  This is only valid until the
+ *         next call to coap_tls_resume_save().
+ */
+const coap_tls_resume_t *coap_tls_resume_find(const coap_session_t *session);
+
+/**
+ * Discards the (D)TLS state saved for @p session, so that the next session
+ * does a full handshake.
+ *
+ * @param session The client session.
+ */
+void coap_tls_resume_forget(const coap_session_t *session);
+
+/**
+ * Discards all the (D)TLS state saved in @p context.
+ *
+ * @param context The context.
+ */
+void coap_tls_resume_free_all(coap_context_t *context);
+
+/**
+ * Moves @p session to the end of the idle and handshake lists of its
+ * endpoint that it now belongs in, based on its reference count, type and
+ * state.  Must be called whenever one of these changes for a session that
+ * has an endpoint and when the session is active.
+ *
+ * @param session The session.
+ */
+void coap_session_lru_update(coap_session_t *session);
+
+/**
+ * Makes sure that the timeouts of @p session (idle session, keepalive ping,
+ * CSM, (D)TLS handshake and large body transfers) are checked no later than
+ * @p due.  Must be called whenever a timeout is started or is brought
+ * forward.  Timeouts that are pushed back need not be, as @p session is
+ * then just checked early.
+ *
+ * @param session The session.
+ * @param due     When the session must be checked.
+ */
+void coap_session_timer_arm(coap_session_t *session, coap_tick_t due);
+
+/**
+ * Checks the timeouts of all the sessions of @p context that are due.
+ *
+ * @param context The context.
+ * @param now     The current time.
+ *
+ * @return The number of ticks until the next session is due, or @c 0 if
+ *         none are.
+ */
+coap_tick_t coap_session_timers_run(coap_context_t *context, coap_tick_t now);
+
+/*
+ * A DTLS record that carries a Connection ID (RFC 9146) has the Connection
+ * ID after the sequence number.
+ *
+ * typedef struct __attribute__((__packed__)) {
+ *   uint8_t content_type;           COAP_DTLS_CT_TLS12_CID
+ *   uint16_t version;               Protocol version
+ *   uint16_t epoch;                 counter for cipher state changes
+ *   uint8_t sequence_number[6];     sequence number
+ *   uint8_t cid[COAP_DTLS_CID_LENGTH]; Connection ID
+ *   uint16_t length;                length of the following fragment
+ * } dtls_record_cid_t;
+ */
+#define COAP_DTLS_CT_TLS12_CID 25 /* Content Type tls12_cid */
+#define COAP_DTLS_CID_OFFSET   11 /* offset of cid in dtls_record_cid_t */
+
+/**
+ * Allocates a new random DTLS Connection ID for server @p session and adds
+ * @p session to the Connection ID index of its endpoint.  Called by the
+ * (D)TLS library code before the handshake, which then passes
+ * @c session->dtls_cid (of length COAP_DTLS_CID_LENGTH) to the peer.  The
+ * first byte of the Connection ID of a shard (see
+ * coap_context_set_reuseport_steering()) is its shard modulo the shards.
+ *
+ * @param session The server session.
+ *
+ * @return @c 1 on success, else @c 0.
+ */
+int coap_session_new_dtls_cid(coap_session_t *session);
+
+/**
+ * Called by the (D)TLS library code once a record has been authenticated.
+ * If the record was found by its DTLS Connection ID and came from a new
+ * peer address, @p session is moved over to the new address.
+ *
+ * @param session The server session.
+ */
+void coap_session_dtls_cid_verified(coap_session_t *session);
+
+/**
+ * Takes @p session off the list of corked sessions of its context, if it
+ * is on it.  The PDUs it held back stay in its delayqueue.
+ *
+ * @param session The session.
+ */
+void coap_session_uncork(coap_session_t *session);
+
+/**
+ * Sets the MTU of the UDP or DTLS client @p session from the path MTU that
+ * the kernel knows for its socket, if coap_context_set_path_mtu_discovery()
+ * is enabled for its context.  If a datagram of more than COAP_DEFAULT_MTU
+ * bytes has had to be retransmitted while the path MTU has not changed,
+ * the MTU falls back to COAP_DEFAULT_MTU for good.
+ *
+ * @param session The session.
+ * @param lost    The size of the datagram that has had to be retransmitted,
+ *                or @c 0.
+ */
+void coap_session_update_path_mtu(coap_session_t *session, size_t lost);
+
 /** @} */
 
 #endif /* COAP_SESSION_INTERNAL_H_ */
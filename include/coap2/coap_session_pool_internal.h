@@ -0,0 +1,50 @@
+/*
+ * coap_session_pool_internal.h -- Client sessions kept for reuse
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_session_pool_internal.h
+ * @brief Internal client session pool functions
+ */
+
+#ifndef COAP_SESSION_POOL_INTERNAL_H_
+#define COAP_SESSION_POOL_INTERNAL_H_
+
+/**
+ * @defgroup session_pool_internal Client Session Pool (Internal)
+ * Functions that keep the client sessions handed out by
+ * coap_get_client_session() and friends, so that later calls for the same
+ * server and security parameters reuse them.
+ * Internal API functions
+ * @{
+ */
+
+typedef struct coap_pool_entry_t coap_pool_entry_t;
+
+/**
+ * Evicts @p session from the pool of its context if it has not been handed
+ * out for the idle timeout of the pool (or has failed) and the application
+ * no longer holds it.  Called by the session timers.
+ *
+ * @param session The pooled session.
+ * @param now     The current time.
+ * @param due     Set to when the session is to be checked again.
+ *
+ * @return @c 0 if @p session has been freed, else @c 1.
+ */
+int coap_session_pool_check(coap_session_t *session, coap_tick_t now,
+                            coap_tick_t *due);
+
+/**
+ * Releases the sessions held by the pool of @p context.
+ *
+ * @param context The context.
+ */
+void coap_session_pool_free(coap_context_t *context);
+
+/** @} */
+
+#endif /* COAP_SESSION_POOL_INTERNAL_H_ */
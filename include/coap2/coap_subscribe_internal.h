@@ -41,10 +41,34 @@
 #define COAP_OBS_MAX_FAIL  3
 #endif /* COAP_OBS_MAX_FAIL */
 
+/**
+ * The conditional attributes (draft-ietf-core-conditional-attributes) an
+ * observer registered with, and what it was last notified of.
+ */
+typedef struct coap_observe_cond_t {
+  coap_tick_t pmin;        /**< minimum period between notifications, or 0 */
+  coap_tick_t pmax;        /**< maximum period between notifications, or 0 */
+  coap_tick_t last_sent;   /**< when last notified */
+  double gt;               /**< notify when the value crosses above this */
+  double lt;               /**< notify when the value crosses below this */
+  double st;               /**< notify when the value changes by this much */
+  double last_value;       /**< the value last notified */
+  unsigned int has_gt:1;   /**< gt is set */
+  unsigned int has_lt:1;   /**< lt is set */
+  unsigned int has_st:1;   /**< st is set */
+  unsigned int has_value:1; /**< last_value is known */
+  unsigned int pending:1;  /**< a change is held back by pmin */
+} coap_observe_cond_t;
+
 /** Subscriber information */
 struct coap_subscription_t {
   struct coap_subscription_t *next; /**< next element in linked list */
+  UT_hash_handle hh;       /**< in the resource's (session, token) index */
+  /* session, token_length and token are the key of the index, so must
+   * follow each other */
   struct coap_session_t *session;   /**< subscriber session */
+  size_t token_length;     /**< actual length of token */
+  unsigned char token[8];  /**< token used for subscription */
 
   unsigned int non_cnt:4;  /**< up to 15 non-confirmable notifies allowed */
   unsigned int fail_cnt:2; /**< up to 3 confirmable notifies can fail */
@@ -55,13 +79,123 @@ struct coap_subscription_t {
   uint8_t code;            /** request type code (GET/FETCH)*/
   uint16_t mid;             /**< message id, if any, in regular host byte order */
   coap_block_t block;      /**< GET/FETCH request Block definition */
-  size_t token_length;     /**< actual length of token */
-  unsigned char token[8];  /**< token used for subscription */
   struct coap_string_t *query; /**< query string used for subscription, if any */
+  struct coap_subscription_t *dirty_next; /**< next in the resource's list of
+                                           *   dirty subscribers */
+  struct coap_subscription_t *dirty_prev; /**< previous in the resource's
+                                           *   list of dirty subscribers */
+  struct coap_resource_t *resource;  /**< the observed resource */
+  struct coap_subscription_t *session_next; /**< next in the session's list
+                                             *   of subscriptions */
+  struct coap_subscription_t *session_prev; /**< previous in the session's
+                                             *   list of subscriptions */
+  struct coap_subscription_slab_t *slab; /**< the slab holding it, if any */
+  coap_observe_cond_t *cond; /**< conditional attributes, if any */
 };
 
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+/**
+ * Subscriptions are carved out of per-resource slabs rather than allocated
+ * one by one, so that those of a resource sit next to each other and a full
+ * notification of the resource is a sequential scan of its slabs.
+ */
+#define COAP_SUBSCRIPTION_SLABS 1
+#endif /* !WITH_LWIP && !WITH_CONTIKI */
+
+#ifndef COAP_SUBSCRIPTION_SLAB_MAX
+/**
+ * The number of subscriptions in the largest slab.  The first slab of a
+ * resource holds four, and each new one twice as many as the last up to
+ * this many, so that resources with few observers stay small.
+ */
+#define COAP_SUBSCRIPTION_SLAB_MAX 256
+#endif /* COAP_SUBSCRIPTION_SLAB_MAX */
+
+/** A block of subscriptions of a resource */
+typedef struct coap_subscription_slab_t {
+  struct coap_subscription_slab_t *next; /**< next in the resource's slabs */
+  struct coap_subscription_slab_t *prev; /**< previous in the resource's
+                                          *   slabs */
+  struct coap_subscription_slab_t *partial_next; /**< next of the resource's
+                                                  *   slabs with free slots */
+  struct coap_subscription_slab_t *partial_prev; /**< previous of the
+                                                  *   resource's slabs with
+                                                  *   free slots */
+  coap_subscription_t *free; /**< free slots, linked by next */
+  unsigned int size;         /**< number of slots */
+  unsigned int used;         /**< number of slots in use */
+  coap_subscription_t slot[1]; /**< the slots, in use if session is set */
+} coap_subscription_slab_t;
+
+/** The length of the (session, token) key of a subscription */
+#define COAP_SUBSCRIPTION_KEY_LEN \
+  (offsetof(coap_subscription_t, token) + 8 - \
+   offsetof(coap_subscription_t, session))
+
 void coap_subscription_init(coap_subscription_t *);
 
+#if COAP_SUBSCRIPTION_SLABS
+/**
+ * Takes a free slot for a subscription out of the slabs of @p resource,
+ * adding a slab if they are full.
+ *
+ * @param resource The resource to be observed.
+ *
+ * @return The zeroed subscription, or @c NULL if out of memory.
+ */
+coap_subscription_t *coap_subscription_alloc(coap_resource_t *resource);
+
+/**
+ * Returns the slot of @p s to the slabs of @p resource.  A slab that
+ * becomes empty is released, unless the resource is being notified, when
+ * that is left to coap_subscription_slabs_trim().
+ *
+ * @param resource The resource @p s has been taken off.
+ * @param s        The subscription.
+ */
+void coap_subscription_free(coap_resource_t *resource, coap_subscription_t *s);
+
+/**
+ * Releases the empty slabs of @p resource.
+ *
+ * @param resource The resource.
+ */
+void coap_subscription_slabs_trim(coap_resource_t *resource);
+#endif /* COAP_SUBSCRIPTION_SLABS */
+
+/**
+ * Tells the observe registry of the context of @p resource, if any, that
+ * the observer @p s has been added.
+ *
+ * @param resource The resource.
+ * @param s        The new observer.
+ */
+void coap_observe_registry_added(coap_resource_t *resource,
+                                 coap_subscription_t *s);
+
+/**
+ * Tells the observe registry of the context of @p resource, if any, that
+ * the observer @p s is going away.
+ *
+ * @param resource The resource.
+ * @param s        The observer.
+ */
+void coap_observe_registry_removed(coap_resource_t *resource,
+                                   coap_subscription_t *s);
+
+/**
+ * Passes the change of the observable @p resource to the @c publish hook
+ * of the observe registry of its context, if any, unless the change came
+ * from another node.
+ *
+ * @param resource The resource.
+ * @param query    The query that the change is for, or NULL.
+ * @param value    The new value of the resource, or NULL.
+ */
+void coap_observe_registry_publish(coap_resource_t *resource,
+                                   const coap_string_t *query,
+                                   const double *value);
+
 /**
  * Handles a failed observe notify.
  *
@@ -75,13 +209,27 @@ coap_handle_failed_notify(coap_context_t *context,
                           const coap_binary_t *token);
 
 /**
- * Checks all known resources to see if they are dirty and then notifies
- * subscribed observers.
+ * Notifies the subscribed observers of all the resources that have been
+ * marked as dirty since the last call.  Only the resources on the
+ * context's list of dirty resources are looked at.
  *
  * @param context The context to check for dirty resources.
  */
 void coap_check_notify(coap_context_t *context);
 
+/**
+ * Sends the notifications held back by the @c pmin conditional attribute,
+ * and the refreshes due by the @c pmax attribute, to the observers of
+ * @p session.  Called by the session timers.
+ *
+ * @param session The observers' session.
+ * @param now     The current time.
+ *
+ * @return The time the next notification is due, or @c 0 if none.
+ */
+coap_tick_t coap_observe_cond_check_timeouts(coap_session_t *session,
+                                             coap_tick_t now);
+
 /**
  * Adds the specified peer as observer for @p resource. The subscription is
  * identified by the given @p token. This function returns the registered
@@ -0,0 +1,71 @@
+/*
+ * coap_trace.h -- Binary trace of the PDUs sent and received
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_trace.h
+ * @brief Binary trace of the PDUs sent and received
+ */
+
+#ifndef COAP_TRACE_H_
+#define COAP_TRACE_H_
+
+/**
+ * @defgroup trace PDU Trace
+ * API functions for capturing the PDUs of a context into a ring buffer
+ * and writing them out as a pcapng file
+ * @{
+ */
+
+/** Default size of the trace ring buffer of a context. */
+#ifndef COAP_TRACE_DEFAULT_SIZE
+#define COAP_TRACE_DEFAULT_SIZE (64 * 1024)
+#endif /* COAP_TRACE_DEFAULT_SIZE */
+
+/** Default number of payload bytes that are kept for each PDU. */
+#ifndef COAP_TRACE_DEFAULT_MAX_PAYLOAD
+#define COAP_TRACE_DEFAULT_MAX_PAYLOAD 32
+#endif /* COAP_TRACE_DEFAULT_MAX_PAYLOAD */
+
+/**
+ * Sets up the trace of the PDUs that @p context sends and receives.  Each
+ * PDU is recorded with its header, token and options, the first
+ * @p max_payload bytes of its payload, the time, the direction and the
+ * session.  The oldest records are overwritten once @p size bytes are used.
+ *
+ * The trace is set up with COAP_TRACE_DEFAULT_SIZE and
+ * COAP_TRACE_DEFAULT_MAX_PAYLOAD when the context is created.  Any records
+ * already held are dropped.
+ *
+ * @param context     The context.
+ * @param size        The size of the ring buffer, or @c 0 to stop tracing.
+ * @param max_payload The number of payload bytes to keep for each PDU.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_trace(coap_context_t *context, size_t size,
+                           size_t max_payload);
+
+/**
+ * Writes the PDUs held in the trace of @p context, oldest first, to
+ * @p filename in pcapng format.  The packets use Wireshark's exported PDU
+ * link type, so that they are shown by its CoAP dissector, including the
+ * ones of DTLS sessions.  The trace is left as it is.
+ *
+ * This may be called from a thread other than the one that does the I/O
+ * of @p context, but not while coap_context_set_trace() is called.
+ *
+ * @param context  The context.
+ * @param filename The file to write.
+ *
+ * @return The number of PDUs written, or @c -1 if there is no trace or the
+ *         file cannot be written.
+ */
+int coap_trace_write_pcapng(coap_context_t *context, const char *filename);
+
+/** @} */
+
+#endif /* COAP_TRACE_H_ */
@@ -0,0 +1,60 @@
+/*
+ * coap_trace_internal.h -- Binary trace of the PDUs sent and received
+ *
+ * This file is part of the CoAP library libcoap. Please see README for terms
+ * of use.
+ */
+
+/**
+ * @file coap_trace_internal.h
+ * @brief Internal PDU trace functions
+ */
+
+#ifndef COAP_TRACE_INTERNAL_H_
+#define COAP_TRACE_INTERNAL_H_
+
+/**
+ * @defgroup trace_internal PDU Trace (Internal)
+ * Functions that record the PDUs sent and received in the trace of the
+ * context.
+ * Internal API functions
+ * @{
+ */
+
+/*
+ * The trace is written by the I/O thread only, and read by
+ * coap_trace_write_pcapng() without locking, using atomic positions.
+ */
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(WITH_LWIP) && \
+    !defined(RIOT_VERSION)
+#define COAP_TRACE_SUPPORT 1
+#endif /* __GNUC__ && !WITH_CONTIKI && !WITH_LWIP && !RIOT_VERSION */
+
+typedef struct coap_trace_t coap_trace_t;
+
+#ifdef COAP_TRACE_SUPPORT
+/**
+ * Records @p pdu in the trace of the context of @p session, if it has one.
+ *
+ * @param session The session the PDU is sent or received on.
+ * @param pdu     The PDU, with its header encoded.
+ * @param sent    @c 1 if the PDU has been sent, @c 0 if it has been
+ *                received.
+ */
+void coap_trace_pdu(coap_session_t *session, const coap_pdu_t *pdu,
+                    int sent);
+
+/**
+ * Releases the trace of @p context.
+ *
+ * @param context The context.
+ */
+void coap_trace_free(coap_context_t *context);
+#else /* ! COAP_TRACE_SUPPORT */
+#define coap_trace_pdu(session, pdu, sent) ((void)0)
+#define coap_trace_free(context) ((void)0)
+#endif /* ! COAP_TRACE_SUPPORT */
+
+/** @} */
+
+#endif /* COAP_TRACE_INTERNAL_H_ */
@@ -54,6 +54,55 @@ typedef USHORT in_port_t;
 #  endif /* __GNUC__ */
 #endif /* COAP_UNUSED */
 
+/*
+ * Subsystems that can be left out of constrained builds.  Each is in unless
+ * its COAP_WITHOUT_* switch is defined, by coap.h as configured (see the
+ * ENABLE_* CMake options or --disable-* configure options), by coap_config.h
+ * or on the compiler command line.  The older WITHOUT_ASYNC, WITHOUT_QUERY_FILTER and
+ * COAP_DISABLE_TCP switches are kept in step with their new names.
+ *
+ * COAP_WITHOUT_ASYNC          coap_register_async() and friends.
+ * COAP_WITHOUT_BLOCK2_LARGE   the response bodies kept by the library
+ *                             (coap_add_data_large_response(),
+ *                             coap_add_large_body_response()), which then
+ *                             fall back to coap_add_data_blocked_response().
+ * COAP_WITHOUT_CACHE          the cache-entries and the response cache of
+ *                             src/coap_cache.c.  Cache-keys remain.
+ * COAP_WITHOUT_PROXY          the forward proxy and the Proxy-Uri and
+ *                             Proxy-Scheme handling of incoming requests,
+ *                             which are then answered with 5.05.
+ * COAP_WITHOUT_QUERY_FILTER   the query filtering of .well-known/core.
+ * COAP_WITHOUT_TCP            TCP, TLS and the signaling messages.
+ */
+#if defined(WITHOUT_ASYNC) && !defined(COAP_WITHOUT_ASYNC)
+#define COAP_WITHOUT_ASYNC 1
+#elif defined(COAP_WITHOUT_ASYNC) && !defined(WITHOUT_ASYNC)
+#define WITHOUT_ASYNC 1
+#endif
+#if defined(WITHOUT_QUERY_FILTER) && !defined(COAP_WITHOUT_QUERY_FILTER)
+#define COAP_WITHOUT_QUERY_FILTER 1
+#elif defined(COAP_WITHOUT_QUERY_FILTER) && !defined(WITHOUT_QUERY_FILTER)
+#define WITHOUT_QUERY_FILTER 1
+#endif
+#ifdef COAP_WITHOUT_TCP
+#undef COAP_DISABLE_TCP
+#define COAP_DISABLE_TCP 1
+#elif defined(COAP_DISABLE_TCP) && COAP_DISABLE_TCP
+#define COAP_WITHOUT_TCP 1
+#endif
+
+/*
+ * COAP_AF_UNIX_SUPPORT (the ENABLE_AF_UNIX CMake option or --enable-af-unix
+ * configure option) lets UDP endpoints and sessions run over Unix domain
+ * datagram sockets, see coap_address_set_unix_domain().  It makes
+ * coap_address_t large enough to hold a struct sockaddr_un.
+ */
+#if defined(COAP_AF_UNIX_SUPPORT) && \
+    (defined(_WIN32) || defined(WITH_LWIP) || defined(WITH_CONTIKI) || \
+     defined(RIOT_VERSION))
+#undef COAP_AF_UNIX_SUPPORT
+#endif
+
 void coap_startup(void);
 
 void coap_cleanup(void);
@@ -52,6 +52,39 @@ typedef enum {
 
 #ifndef WITH_LWIP
 
+/**
+ * Memory usage of one coap_memory_tag_t type as tracked by coap_malloc_type()
+ * and coap_free_type() when libcoap is built with COAP_MEM_STATS. @c bytes
+ * is the requested size of the objects, or the fixed block size where the
+ * objects are held in fixed size blocks.
+ */
+typedef struct coap_memory_stats_t {
+  size_t count;       /**< number of live objects */
+  size_t bytes;       /**< number of live bytes */
+  size_t peak_count;  /**< highest number of live objects */
+  size_t peak_bytes;  /**< highest number of live bytes */
+  size_t failed;      /**< number of failed allocations */
+} coap_memory_stats_t;
+
+/**
+ * Retrieves the memory usage of @p type.
+ *
+ * @param type  The type of object.
+ * @param stats Where to store the memory usage.
+ *
+ * @return @c 1 if @p stats has been updated, or @c 0 if libcoap has not been
+ *         built with COAP_MEM_STATS or @p type is not valid.
+ */
+int coap_memory_stats(coap_memory_tag_t type, coap_memory_stats_t *stats);
+
+/**
+ * Resets the high-water marks of @p type to the current usage, so that the
+ * peak over a new measurement interval can be taken.
+ *
+ * @param type The type of object.
+ */
+void coap_memory_stats_reset_peak(coap_memory_tag_t type);
+
 /**
  * Allocates a chunk of @p size bytes and returns a pointer to the newly
  * allocated memory. The @p type is used to select the appropriate storage
@@ -68,7 +101,7 @@ void *coap_malloc_type(coap_memory_tag_t type, size_t size);
  * Reallocates a chunk @p p of bytes created by coap_malloc_type() or
  * coap_realloc_type() and returns a pointer to the newly allocated memory of
  * @p size.
- * Only COAP_STRING type is supported.
+ * Only the COAP_STRING and COAP_PDU_BUF types are supported.
  *
  * Note: If there is an error, @p p will separately need to be released by
  * coap_free_type().
@@ -90,6 +123,35 @@ void *coap_realloc_type(coap_memory_tag_t type, void *p, size_t size);
  */
 void coap_free_type(coap_memory_tag_t type, void *p);
 
+/**
+ * Statistics for one of the per-type slabs that back coap_malloc_type() when
+ * libcoap is built with COAP_MEM_SLAB. The slabs are used for the fixed size
+ * types COAP_PDU, COAP_NODE, COAP_SESSION, COAP_LG_XMIT, COAP_LG_CRCV,
+ * COAP_LG_SRCV and COAP_CACHE_KEY.  COAP_PDU_BUF is served from slabs of a
+ * few size classes, which coap_memory_slab_stats() does not report.
+ */
+typedef struct coap_memory_slab_stats_t {
+  size_t object_size; /**< size of each object in the slab */
+  size_t chunks;      /**< number of chunks obtained from malloc() */
+  size_t objects;     /**< number of objects carved out of the chunks */
+  size_t depot;       /**< free objects held in the shared depot */
+  size_t cached;      /**< free objects cached by the calling thread */
+  size_t refills;     /**< thread cache refills from the depot or a chunk */
+  size_t flushes;     /**< thread cache flushes back to the depot */
+} coap_memory_slab_stats_t;
+
+/**
+ * Retrieves the statistics of the slab used for @p type.
+ *
+ * @param type  The type of object.
+ * @param stats Where to store the statistics.
+ *
+ * @return @c 1 if @p type is slab backed and @p stats has been updated,
+ *         else @c 0.
+ */
+int coap_memory_slab_stats(coap_memory_tag_t type,
+                           coap_memory_slab_stats_t *stats);
+
 /**
  * Wrapper function to coap_malloc_type() for backwards compatibility.
  */
@@ -29,26 +29,61 @@
 #include "pdu.h"
 #include "coap_prng.h"
 #include "coap_session.h"
+#include "coap_cache.h"
 #include "resource.h"
 
 /**
  * Queue entry
  */
 typedef struct coap_queue_t {
-  struct coap_queue_t *next;
-  coap_tick_t t;                /**< when to send PDU for the next time */
+  struct coap_queue_t *next;    /**< next entry in a session's delayqueue */
+  coap_tick_t t;                /**< when to send PDU for the next time,
+                                 *   relative to sendqueue_basetime */
   unsigned char retransmit_cnt; /**< retransmission counter, will be removed
                                  *    when zero */
-  unsigned int timeout;         /**< the randomized timeout value */
+  unsigned char vbf;            /**< CoCoA variable backoff factor, in
+                                 *   halves, that timeout is multiplied by
+                                 *   on each retransmission, or 0 if the
+                                 *   timeout doubles */
+  unsigned char is_mcast;       /**< response to a multicast request that
+                                 *   is held back for its leisure, and is
+                                 *   sent once when due */
+  unsigned int timeout;         /**< the randomized timeout value (of the
+                                 *   current transmission if vbf is set) */
   coap_session_t *session;      /**< the CoAP session */
   coap_mid_t id;                /**< CoAP message id */
   coap_pdu_t *pdu;              /**< the CoAP PDU to send */
+  struct coap_queue_t *heap_child;   /**< first child in the sendqueue heap */
+  struct coap_queue_t *heap_sibling; /**< next sibling in the sendqueue heap */
+  struct coap_queue_t *heap_prev;    /**< previous sibling, or parent if
+                                      *   first child, in the sendqueue heap */
+  struct coap_queue_t *session_next; /**< next sendqueue entry of session */
+  struct coap_queue_t *session_prev; /**< previous sendqueue entry of
+                                      *   session */
+  UT_hash_handle hh;                 /**< (session, id) index of the
+                                      *   context's sendqueue */
+  uint64_t sent_us;                  /**< when first sent, from
+                                      *   coap_histogram_clock(), if the
+                                      *   round trip is to be timed, else 0 */
 } coap_queue_t;
 
 /**
- * Adds @p node to given @p queue, ordered by variable t in @p node.
- *
- * @param queue Queue to add to.
+ * The length of the (session, id) key used for the sendqueue index.
+ * The session and id fields of coap_queue_t must stay adjacent.
+ */
+#define COAP_QUEUE_KEY_LEN \
+  (offsetof(coap_queue_t, id) + sizeof(coap_mid_t) - \
+   offsetof(coap_queue_t, session))
+
+/**
+ * Adds @p node to the retransmission @p queue, ordered by variable t in
+ * @p node.  The queue is a pairing heap, so that new entries are added in
+ * constant time and the next entry to transmit is removed in O(log n)
+ * amortized time. If @p node has a session, @p node is also added to the
+ * session's list of queued entries and to the context's (session, id)
+ * index so that it can be found by message id in constant time.
+ *
+ * @param queue Queue to add to (normally &context->sendqueue).
  * @param node Node entry to add to Queue.
  *
  * @return @c 1 added to queue, @c 0 failure.
@@ -103,6 +138,33 @@ typedef coap_response_t (*coap_response_handler_t)(struct coap_context_t *contex
                                                    coap_pdu_t *received,
                                                    const coap_mid_t id);
 
+/**
+ * The outcome of a request sent with coap_send_request().
+ */
+typedef enum coap_request_status_t {
+  COAP_REQUEST_STATUS_OK,      /**< a response has been received */
+  COAP_REQUEST_STATUS_TIMEOUT, /**< no final response in time */
+  COAP_REQUEST_STATUS_FAILED   /**< the request could not be delivered, or
+                                    the session is being released */
+} coap_request_status_t;
+
+/**
+ * Handler of the responses to a request sent with coap_send_request().
+ *
+ * @param session  CoAP session.
+ * @param received The response that was received, or NULL unless
+ *                 @p status is COAP_REQUEST_STATUS_OK.
+ * @param status   The outcome of the request.
+ * @param arg      The argument passed to coap_send_request().
+ *
+ * @return @c COAP_RESPONSE_OK if successful, else @c COAP_RESPONSE_FAIL which
+ *         triggers sending a RST packet for @p received.
+ */
+typedef coap_response_t (*coap_request_handler_t)(coap_session_t *session,
+                                                  coap_pdu_t *received,
+                                                  coap_request_status_t status,
+                                                  void *arg);
+
 /**
  * Negative Acknowedge handler that is used as callback in coap_context_t.
  *
@@ -144,34 +206,160 @@ typedef void (*coap_pong_handler_t)(struct coap_context_t *context,
                                     coap_pdu_t *received,
                                     const coap_mid_t id);
 
+#ifndef WITHOUT_ASYNC
+/**
+ * Asynchronous request timeout handler that is used as callback in
+ * coap_context_t.
+ *
+ * @param context CoAP context.
+ * @param async   The asynchronous state that has timed out.  It is
+ *                released when the handler returns.
+ */
+typedef void (*coap_async_timeout_handler_t)(struct coap_context_t *context,
+                                     struct coap_async_state_t *async);
+#endif /* WITHOUT_ASYNC */
+
+/**
+ * The watermarks above which a context is overloaded (see
+ * coap_context_set_overload()).  A watermark of @c 0 is not checked.
+ */
+typedef struct coap_overload_t {
+  unsigned int max_sendqueue;  /**< Confirmable messages waiting to be
+                                    acknowledged */
+  unsigned int max_async;      /**< Asynchronous requests not yet answered */
+  unsigned int handler_budget_ms; /**< Time spent in the request handlers
+                                       in one I/O processing iteration */
+  size_t max_memory;           /**< Bytes in use by libcoap, as tracked
+                                    when built with COAP_MEM_STATS */
+  unsigned int max_age;        /**< Max-Age of the 5.03 responses in
+                                    seconds, or 0 to leave it out */
+} coap_overload_t;
+
+/**
+ * coap_ratelimit_t policy values
+ */
+#define COAP_RATELIMIT_DROP 0 /**< Drop the datagrams over the rate */
+#define COAP_RATELIMIT_503  1 /**< Answer requests over the rate with 5.03 */
+
+/** The number of peers tracked if coap_ratelimit_t does not say */
+#define COAP_RATELIMIT_DEFAULT_PEERS 1024
+
+/**
+ * The rate that each peer of a context may send datagrams at (see
+ * coap_context_set_ratelimit()).
+ */
+typedef struct coap_ratelimit_t {
+  unsigned int rate;     /**< Datagrams per second that a peer may send */
+  unsigned int burst;    /**< Datagrams that a peer may send in one go,
+                              or 0 for @c rate */
+  unsigned int peers;    /**< Peers tracked, or 0 for
+                              COAP_RATELIMIT_DEFAULT_PEERS */
+  int policy;            /**< COAP_RATELIMIT_DROP or COAP_RATELIMIT_503 */
+  unsigned int max_age;  /**< Max-Age of the 5.03 responses in seconds, or
+                              0 to leave it out */
+} coap_ratelimit_t;
+
+/**
+ * The socket events of coap_io_callbacks_t and coap_io_do_socket().
+ */
+#define COAP_IO_EVENT_READ  0x01 /**< readable, or to be watched for it */
+#define COAP_IO_EVENT_WRITE 0x02 /**< writable, or to be watched for it */
+#define COAP_IO_EVENT_ERROR 0x04 /**< error or hang-up on the socket */
+
+/**
+ * The call-backs through which the sockets and the timer of a context are
+ * handed to an event loop of the application (see
+ * coap_context_set_io_callbacks()).  Each is passed the @p arg given to
+ * coap_context_set_io_callbacks().
+ */
+typedef struct coap_io_callbacks_t {
+  /** Starts watching @p fd for @p events (COAP_IO_EVENT_*), reporting them
+   * with coap_io_do_socket() for @p sock */
+  void (*add)(struct coap_context_t *context, coap_socket_t *sock,
+              coap_fd_t fd, unsigned int events, void *arg);
+  /** Changes the @p events that @p fd is watched for */
+  void (*modify)(struct coap_context_t *context, coap_socket_t *sock,
+                 coap_fd_t fd, unsigned int events, void *arg);
+  /** Stops watching @p fd, which is about to be closed */
+  void (*remove)(struct coap_context_t *context, coap_socket_t *sock,
+                 coap_fd_t fd, void *arg);
+  /** Arms the timer to call coap_io_do_timers() in @p timeout_ms, replacing
+   * any earlier setting, or disarms it if @p timeout_ms is @c 0 */
+  void (*set_timer)(struct coap_context_t *context, unsigned int timeout_ms,
+                    void *arg);
+  /** Has coap_io_do_timers() called soon.  This may be called from any
+   * thread, and may be @c NULL if no other threads post to the context */
+  void (*wake)(struct coap_context_t *context, void *arg);
+} coap_io_callbacks_t;
+
+/**
+ * @defgroup option_props Option Properties
+ * The properties of an option number as a context sees them, as kept in the
+ * option_props table of coap_context_t for the option numbers below
+ * COAP_OPTION_PROPS_SIZE.
+ * @{
+ */
+#define COAP_OPTION_PROPS_SIZE  (COAP_OPTION_NORESPONSE + 1)
+
+#define COAP_OPT_PROP_CRITICAL   0x01 /**< Critical (RFC 7252 5.4.1) */
+#define COAP_OPT_PROP_UNSAFE     0x02 /**< Unsafe to forward (RFC 7252 5.4.2) */
+#define COAP_OPT_PROP_NOCACHEKEY 0x04 /**< Not part of the cache-key */
+#define COAP_OPT_PROP_REPEATABLE 0x08 /**< May occur more than once */
+#define COAP_OPT_PROP_KNOWN      0x10 /**< Understood by the context */
+#define COAP_OPT_PROP_HOP_BY_HOP 0x20 /**< Not passed on by the proxy */
+/** @} */
+
 /**
  * The CoAP stack's global state is stored in a coap_context_t object.
  */
 struct coap_context_t {
   coap_opt_filter_t known_options;
+  uint8_t option_props[COAP_OPTION_PROPS_SIZE]; /**< COAP_OPT_PROP_* of
+                                                     the option numbers */
   coap_resource_t *resources; /**< hash table or list of known
                                    resources */
   coap_resource_t *unknown_resource; /**< can be used for handling
                                           unknown resources */
   coap_resource_t *proxy_uri_resource; /**< can be used for handling
                                             proxy URI resources */
+  struct coap_route_node_t *routes; /**< index of the resources added
+                                         with COAP_RESOURCE_FLAGS_ROUTE */
+  uint8_t *wellknown;              /**< rendered /.well-known/core, each
+                                        link led by a ',', or NULL */
+  size_t wellknown_length;         /**< bytes used in wellknown */
+  size_t wellknown_size;           /**< bytes allocated for wellknown */
+  struct coap_attr_index_t *attr_index; /**< resources by attribute value,
+                                             for filtered discovery */
+  unsigned int resource_seq;       /**< seq of the next resource added */
+  struct coap_catalog_t *catalog;  /**< storage of the resources added with
+                                        coap_add_resources_compact(), or
+                                        NULL */
   coap_resource_release_userdata_handler_t release_userdata;
                                         /**< function to  release user_data
                                              when resource is deleted */
 
 #ifndef WITHOUT_ASYNC
   /**
-   * list of asynchronous message ids */
+   * asynchronous states hashed by session and message id */
   struct coap_async_state_t *async_state;
+  coap_tick_t async_ack_delay;     /**< How long the ACK to a Confirmable
+                                        request that is handled
+                                        asynchronously is held back */
+  coap_async_timeout_handler_t async_timeout_handler; /**< Called for the
+                                        asynchronous states that time out */
 #endif /* WITHOUT_ASYNC */
 
   /**
-   * The time stamp in the first element of the sendqeue is relative
+   * The time stamps of all the elements in the sendqueue are relative
    * to sendqueue_basetime. */
   coap_tick_t sendqueue_basetime;
-  coap_queue_t *sendqueue;
+  coap_queue_t *sendqueue;         /**< root of the retransmission heap */
+  coap_queue_t *sendqueue_index;   /**< sendqueue entries hashed by
+                                    *   (session, id) */
   coap_endpoint_t *endpoint;      /**< the endpoints used for listening  */
   coap_session_t *sessions;       /**< client sessions */
+  coap_session_t *peers_client;   /**< client sessions hashed by peer_key */
+  coap_session_t *peers_server;   /**< server sessions hashed by peer_key */
 
 #ifdef WITH_CONTIKI
   struct uip_udp_conn *conn;      /**< uIP connection object */
@@ -214,18 +402,157 @@ struct coap_context_t {
   unsigned int ping_timeout;           /**< Minimum inactivity time before sending a ping message. 0 means disabled. */
   unsigned int csm_timeout;           /**< Timeout for waiting for a CSM from the remote side. 0 means disabled. */
   uint8_t observe_pending;         /**< Observe response pending */
+  coap_resource_t *dirty_resources; /**< Resources with pending
+                                         notifications */
   uint8_t block_mode;              /**< Zero or more COAP_BLOCK_ or'd options */
+  size_t max_body_size;            /**< Largest body put together from
+                                        blocks, or 0 for no limit */
+  char *block_resume_dir;          /**< Directory the large transfers that
+                                        are not complete are saved in, or
+                                        NULL */
+  uint8_t reuseport;               /**< Set SO_REUSEPORT on new endpoints */
+  uint16_t reuseport_shard;        /**< Shard of this context */
+  uint16_t reuseport_shards;       /**< Shards the endpoints are steered
+                                        across, or 0 */
+  int reuseport_cpu;               /**< SO_INCOMING_CPU of the endpoints, or
+                                        -1 */
+  uint8_t path_mtu_discovery;      /**< New client sessions take their MTU
+                                        from the path MTU */
+  uint8_t cocoa;                   /**< New sessions use CoCoA */
   uint64_t etag;                   /**< Next ETag to use */
 
   coap_cache_entry_t *cache;       /**< CoAP cache-entry cache */
   uint16_t *cache_ignore_options;  /**< CoAP options to ignore when creating a cache-key */
   size_t cache_ignore_count;       /**< The number of CoAP options to ignore when creating a cache-key */
+  coap_cache_entry_t *cache_lru;   /**< Cache-entries, least recently used
+                                        first */
+  coap_cache_entry_t *cache_timers; /**< Pairing heap of the cache-entries
+                                         that have an idle timeout */
+  size_t cache_size;               /**< Bytes used by the cache-entries */
+  size_t cache_max_size;           /**< Limit for cache_size, or 0 */
+  uint8_t cache_key_hash;          /**< coap_cache_key_hash_t in use */
+  coap_cache_backend_t cache_backend; /**< Second level of the cache, if
+                                           put is set */
   void *app;                       /**< application-specific data */
+  struct coap_tx_batch_t *tx_batch; /**< Datagrams queued for coap_io_flush()
+                                         or NULL if not batching */
+  size_t tcp_cork;                 /**< Bytes that the TCP and TLS sessions
+                                        hold back at most, or 0 */
+  uint8_t tx_class;                /**< coap_tx_class_t of what is being
+                                        sent */
+  int tx_deferred;                 /**< Set if the budget held anything back
+                                        in this I/O processing iteration */
+  unsigned int tx_budget_retransmit; /**< Retransmissions per iteration, or
+                                          0 */
+  unsigned int tx_budget_bulk;     /**< Notifications and blocks per
+                                        iteration, or 0 */
+  unsigned int tx_bulk_sent;       /**< Notifications and blocks sent in
+                                        this iteration */
+  coap_session_t *corked;          /**< Sessions holding PDUs back for
+                                        coap_io_flush() */
+  struct coap_post_t *posted;      /**< Events posted by other threads, most
+                                        recent first */
+  struct coap_dtls_offload_t *dtls_offload; /**< DTLS handshake worker
+                                                 threads or NULL */
+  uint8_t dtls_offload_records;    /**< Set if the worker threads also
+                                        handle the records of established
+                                        sessions */
+  struct coap_defer_pool_t *defer; /**< Worker threads of the deferred
+                                        requests or NULL */
+  struct coap_dtls_cookie_t *dtls_cookie; /**< Secrets of the DTLS cookies
+                                               or NULL */
+  struct coap_psk_store_t *psk_store; /**< PSK identities of the clients,
+                                           or NULL */
+  unsigned char psk_store_lock;    /**< Held while psk_store is swapped or
+                                        referenced */
+  struct coap_pki_cache_t *pki_cache; /**< Recently verified client
+                                           certificates, or NULL */
+  unsigned char pki_cache_lock;    /**< Held while pki_cache is used */
+  unsigned int dedup_max;          /**< CON requests that a session
+                                        remembers the response to, or 0 */
+  unsigned int mcast_leisure_ms;   /**< Longest delay of the responses to
+                                        multicast requests, or 0 */
+  uint8_t *rxbuf;                  /**< rx_size bytes that the datagrams are
+                                        read into, or NULL to read them into
+                                        the coap_packet_t */
+  size_t rx_size;                  /**< Size of rxbuf, or 0 */
+#ifdef COAP_AF_UNIX_SUPPORT
+  uint8_t *unix_rxbuf;             /**< COAP_AF_UNIX_MTU bytes that the
+                                        Unix domain datagrams are read into,
+                                        or NULL until one is read */
+#endif /* COAP_AF_UNIX_SUPPORT */
+  struct coap_pool_entry_t *session_pool; /**< Client sessions kept for
+                                               reuse, least recently used
+                                               first */
+  unsigned int session_pool_max;   /**< Sessions the pool keeps, or 0 */
+  unsigned int session_pool_idle;  /**< Seconds a pooled session is kept
+                                        unused, or 0 */
+  coap_overload_t overload;        /**< Watermarks of the admission
+                                        control */
+  uint64_t handler_us;             /**< Time spent in the request handlers
+                                        in this I/O processing iteration */
+  int overloaded;                  /**< Set while over a watermark */
+  struct coap_ratelimit_state_t *ratelimit; /**< Token buckets of the
+                                                 peers, or NULL */
+  struct coap_observe_registry_t *observe_registry; /**< Hooks sharing the
+                                                         observers with a
+                                                         cluster, or NULL */
+  uint8_t observe_remote;          /**< Set while the change event of
+                                        another node is applied */
+  struct coap_tls_resume_t *tls_resume; /**< (D)TLS state saved for resuming
+                                             client sessions, most recent
+                                             first */
+  struct coap_proxy_t *proxy;      /**< Forward proxy state or NULL */
+  struct coap_oscore_ctx_t *oscore; /**< OSCORE security contexts, by
+                                         Recipient ID and ID Context */
+  struct coap_trace_t *trace;      /**< Ring buffer of the PDUs sent and
+                                        received, or NULL */
+  coap_counters_t counters;        /**< Traffic of all the endpoints and
+                                        sessions */
+  int histograms;                  /**< 1 if the latency histograms are
+                                        kept */
+  struct coap_histogram_t *notify_histogram; /**< Time taken to notify the
+                                                  observers of a resource,
+                                                  or NULL */
+  coap_arena_t *request_arena;     /**< Memory released once the request
+                                        being handled has been answered,
+                                        else NULL */
+  coap_session_t *session_timers;  /**< Pairing heap of the sessions that
+                                        have timeouts, by timer_due */
+  coap_tick_t session_timers_now;  /**< Time of the current run of the
+                                        session timers, else 0 */
+  coap_tick_t io_now;              /**< Time of the current I/O processing
+                                        iteration, else 0 */
+  unsigned int timers_session_timeout; /**< session_timeout, ping_timeout and */
+  unsigned int timers_ping_timeout;    /**< csm_timeout that the session */
+  unsigned int timers_csm_timeout;     /**< timers were set up with */
+#if defined(COAP_EPOLL_SUPPORT) || defined(COAP_KQUEUE_SUPPORT)
+  int epfd;                        /**< External FD for epoll or kqueue */
 #ifdef COAP_EPOLL_SUPPORT
-  int epfd;                        /**< External FD for epoll */
   int eptimerfd;                   /**< Internal FD for timeout */
+  int eppostfd;                    /**< Internal eventfd to wake up epoll
+                                        when an event is posted */
+  struct epoll_event *epoll_events; /**< Events array for epoll_wait() */
+  struct coap_io_uring_t *io_uring; /**< io_uring used for reading UDP
+                                        endpoints, or NULL */
+#else /* COAP_KQUEUE_SUPPORT */
+  coap_tick_t kq_timer_due;        /**< When the EVFILT_TIMER fires, or 0 if
+                                        it is not armed */
+  struct kevent *epoll_events;     /**< Events array for kevent() */
+#endif /* COAP_KQUEUE_SUPPORT */
   coap_tick_t next_timeout;        /**< When the next timeout is to occur */
-#endif /* COAP_EPOLL_SUPPORT */
+  unsigned int epoll_events_size;  /**< Number of entries in epoll_events */
+  unsigned int epoll_events_max;   /**< Limit that epoll_events can grow to,
+                                        or 0 for COAP_MAX_EPOLL_EVENTS_LIMIT */
+  uint8_t epoll_edge;              /**< Register endpoints edge-triggered */
+  uint8_t io_external;             /**< The sockets and the timer are watched
+                                        through io_callbacks */
+  coap_io_callbacks_t io_callbacks; /**< Set by
+                                         coap_context_set_io_callbacks() */
+  void *io_callbacks_arg;          /**< Passed to the io_callbacks */
+  coap_tick_t io_timer_due;        /**< When the io_callbacks timer fires,
+                                        or 0 if it is not armed */
+#endif /* COAP_EPOLL_SUPPORT || COAP_KQUEUE_SUPPORT */
 };
 
 /**
@@ -291,6 +618,8 @@ coap_register_pong_handler(coap_context_t *context,
 COAP_STATIC_INLINE void
 coap_register_option(coap_context_t *ctx, uint16_t type) {
   coap_option_filter_set(&ctx->known_options, type);
+  if (type < COAP_OPTION_PROPS_SIZE)
+    ctx->option_props[type] |= COAP_OPT_PROP_KNOWN;
 }
 
 /**
@@ -371,6 +700,86 @@ coap_context_set_pki_root_cas(coap_context_t *context,
                               const char *ca_file,
                               const char *ca_dir);
 
+/**
+ * Set the key with which the context's server sessions protect the (D)TLS
+ * session tickets they issue, so that a returning client can resume its
+ * session without a full handshake.  Contexts (in the same or other
+ * processes) that share the same key accept each other's tickets, so a
+ * client can resume on any of them.  By default, all the contexts of a
+ * process share a random key that is generated by coap_startup().
+ *
+ * Calling this again replaces the key, after which the tickets issued with
+ * the old key are no longer accepted.
+ *
+ * @param context The current coap_context_t object.
+ * @param key     The #COAP_DTLS_TICKET_KEY_LEN bytes of the key, which must
+ *                be kept secret, or NULL to stop issuing tickets.
+ * @param key_len The length of @p key.
+ *
+ * @return @c 1 if successful, else @c 0 if not supported by the (D)TLS
+ *         library.
+ */
+int
+coap_context_set_session_ticket_key(coap_context_t *context,
+                                    const uint8_t *key, size_t key_len);
+
+/**
+ * Set up a cache of the client certificates that the context's server
+ * sessions have verified, so that a client that connects again within
+ * @p ttl seconds does not have its certificate chain built and verified
+ * again.  The validate_cn_call_back is still called for the client's
+ * certificate (at depth 0), but not for the rest of the chain.
+ *
+ * Only certificates that verified without any of the allow_* overrides of
+ * coap_dtls_pki_t are cached, and for no longer than they are valid.
+ * Calling this again replaces (and empties) the cache.  This may be called
+ * from any thread.  This is not supported by Mbed TLS or TinyDTLS.
+ *
+ * @param context     The current coap_context_t object.
+ * @param max_entries The number of certificates the cache holds at most,
+ *                    or @c 0 to stop caching.
+ * @param ttl         The number of seconds a certificate is cached for,
+ *                    or @c 0 to stop caching.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_pki_cache(coap_context_t *context, size_t max_entries,
+                               unsigned int ttl);
+
+/**
+ * Tell the context that its CRLs have been updated, so that the
+ * certificates in its cache (see coap_context_set_pki_cache()) are
+ * verified again, against the new CRLs, the next time they are used.
+ * This is done by coap_context_set_pki() and
+ * coap_context_set_pki_root_cas() as well.  This may be called from any
+ * thread.
+ *
+ * @param context The current coap_context_t object.
+ */
+void coap_context_pki_crl_updated(coap_context_t *context);
+
+/**
+ * Make @p context use the (D)TLS configuration of @p from, as set up by
+ * coap_context_set_psk2(), coap_context_set_pki(),
+ * coap_context_set_pki_root_cas() and coap_context_set_session_ticket_key(),
+ * so that the contexts of a sharded server (see coap_context_set_reuseport())
+ * load their certificates and keys once and issue session tickets that
+ * each other accept.  With OpenSSL the loaded configuration is shared,
+ * with GnuTLS and Mbed TLS (which load the certificates for each session)
+ * it is copied.  This is not supported by TinyDTLS.
+ *
+ * This must be called once @p from has been set up, and before any
+ * endpoints or sessions are created in @p context.  @p from may be released
+ * before @p context.  The PSK identity store and the PKI cache are not
+ * shared.
+ *
+ * @param context The coap_context_t object to set up.
+ * @param from    The coap_context_t object with the (D)TLS configuration.
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_share_dtls(coap_context_t *context, coap_context_t *from);
+
 /**
  * Set the context keepalive timer for sessions.
  * A keepalive message will be sent after if a session has been inactive,
@@ -389,16 +798,116 @@ coap_context_set_pki_root_cas(coap_context_t *context,
  */
 void coap_context_set_keepalive(coap_context_t *context, unsigned int seconds);
 
+/**
+ * Sets whether the sessions subsequently created for @p context estimate
+ * the retransmission timeouts of their CON messages with CoCoA.  See
+ * coap_session_set_cocoa().
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 for new sessions to use CoCoA, @c 0 to not (the
+ *                default).
+ */
+void coap_context_set_cocoa(coap_context_t *context, int enable);
+
+/**
+ * Sets the number of Confirmable requests whose responses each session of
+ * @p context keeps for EXCHANGE_LIFETIME.  A duplicate of one of these
+ * requests, sent again by the peer as the ACK was lost, is answered with
+ * the response that was sent the first time, and is not passed to the
+ * request handler again (RFC 7252 4.5).  A duplicate that comes in before
+ * the response has been sent is dropped.  The oldest requests are
+ * forgotten once a session has @p max_entries of them.  This only applies
+ * to UDP and DTLS sessions.
+ *
+ * @param context     The coap_context_t object.
+ * @param max_entries The number of requests to keep per session, or @c 0
+ *                    to not deduplicate requests (the default).
+ */
+void coap_context_set_dedup_cache(coap_context_t *context,
+                                  unsigned int max_entries);
+
+/**
+ * Sets the leisure of @p context, the longest time that the response to a
+ * request received via IP multicast is held back for (RFC 7252 8.2).  Each
+ * such response is sent after a random delay of up to @p milliseconds, so
+ * that the responses of all the servers of the group do not arrive at the
+ * client at the same time.  Error responses to multicast requests are not
+ * sent at all (RFC 7252 8.1).
+ *
+ * @param context      The coap_context_t object.
+ * @param milliseconds The leisure, or @c 0 to send the responses straight
+ *                     away.  The default is @c 5000 (DEFAULT_LEISURE).
+ */
+void coap_context_set_mcast_leisure(coap_context_t *context,
+                                    unsigned int milliseconds);
+
+/**
+ * Sets the watermarks above which @p context is overloaded.  While it is,
+ * new requests are answered with 5.03 (Service Unavailable), with
+ * @c max_age of @p limits as Max-Age to say when to try again, before
+ * their resource is looked up, and packets that would set up a new server
+ * session are dropped.  Retransmissions, ACKs and responses are still
+ * handled, so that the load can drain.
+ *
+ * @param context The coap_context_t object.
+ * @param limits  The watermarks, or NULL for no admission control (the
+ *                default).
+ */
+void coap_context_set_overload(coap_context_t *context,
+                               const coap_overload_t *limits);
+
+/**
+ * Checks whether @p context is over any of the watermarks set with
+ * coap_context_set_overload().
+ *
+ * @param context The coap_context_t object.
+ *
+ * @return @c 1 if overloaded, else @c 0.
+ */
+int coap_context_is_overloaded(coap_context_t *context);
+
+/**
+ * Limits the rate at which each peer may send datagrams to the UDP and DTLS
+ * endpoints of @p context.  Each peer, told apart by its address without
+ * the port, has a token bucket of @c burst datagrams that is refilled at
+ * @c rate datagrams per second, and only the last @c peers peers that have
+ * sent something are tracked.  A datagram that finds the bucket of its peer
+ * empty is turned away before a session is looked up or the datagram is
+ * parsed: it is dropped, or with the COAP_RATELIMIT_503 policy a request
+ * received on a UDP endpoint is answered with 5.03 (Service Unavailable),
+ * at most once a second for each peer.
+ *
+ * @param context The coap_context_t object.
+ * @param limits  The rate, or NULL for no rate limiting (the default).
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_ratelimit(coap_context_t *context,
+                               const coap_ratelimit_t *limits);
+
 /**
  * Get the libcoap internal file descriptor for using in an application's
  * select() or returned as an event in an application's epoll_wait() call.
+ * With kqueue, this is the kqueue descriptor, which polls as readable when
+ * there are events pending.
  *
  * @param context        The coap_context_t object.
  *
- * @return The libcoap file descriptor or @c -1 if epoll is not available.
+ * @return The libcoap file descriptor or @c -1 if neither epoll nor kqueue
+ *         is available.
  */
 int coap_context_get_coap_fd(coap_context_t *context);
 
+/**
+ * Takes a snapshot of the traffic counters of @p context, which include
+ * those of all its endpoints and sessions.
+ *
+ * @param context  The coap_context_t object.
+ * @param counters Set to the counters.
+ */
+void coap_context_get_counters(const coap_context_t *context,
+                               coap_counters_t *counters);
+
 /**
  * Returns a new message id and updates @p session->tx_mid accordingly. The
  * message id is returned in network byte order to make it easier to read in
@@ -542,6 +1051,99 @@ coap_send_rst(coap_session_t *session, coap_pdu_t *request) {
 */
 coap_mid_t coap_send( coap_session_t *session, coap_pdu_t *pdu );
 
+/**
+ * Sends the request @p pdu as coap_send() does, with @p handler to be
+ * called for its responses instead of the response handler of the context.
+ * The responses are matched to the request by token, which must not be in
+ * use by another request of @p session that is sent this way.  Once
+ * @p handler has been given the final response (one that is neither a
+ * notification nor a block with more to follow), or has been told that
+ * the request timed out or failed, it is not called again.  A notification
+ * stops the timeout, as the observation then goes on until it is
+ * cancelled.
+ *
+ * @param session    The CoAP session.
+ * @param pdu        The request to send, which is released.
+ * @param handler    The handler of the responses to the request.
+ * @param arg        Passed on to @p handler.
+ * @param timeout_ms The time in milliseconds within which the final
+ *                   response must have been received, or @c 0 for no
+ *                   timeout.
+ *
+ * @return The message id of the sent message or @c COAP_INVALID_MID on
+ *         error, in which case @p handler is not called.
+ */
+coap_mid_t coap_send_request(coap_session_t *session, coap_pdu_t *pdu,
+                             coap_request_handler_t handler, void *arg,
+                             unsigned int timeout_ms);
+
+/**
+ * Sends the request @p pdu to each of the @p count @p sessions, as
+ * coap_send_request() does, with @p handler to be called for the responses
+ * of each.  The options and payload of @p pdu are copied as they are
+ * encoded, and each session gives its request a token and message id of
+ * its own.  The token of @p pdu is not used.  If the datagrams of a session
+ * go out from an endpoint, they are sent together by as few system calls
+ * as possible before this returns, unless the context is already batching
+ * them (see coap_context_set_tx_batching()).
+ *
+ * Unlike coap_send_request(), @p handler is called with
+ * #COAP_REQUEST_STATUS_FAILED straight away for a session that the
+ * request could not be sent to, so that it hears about every session.
+ *
+ * @param sessions   The CoAP sessions.
+ * @param count      The number of @p sessions.
+ * @param pdu        The request to send, which is not released.
+ * @param handler    The handler of the responses to the requests.
+ * @param arg        Passed on to @p handler.
+ * @param timeout_ms The time in milliseconds within which the final
+ *                   response of each session must have been received, or
+ *                   @c 0 for no timeout.
+ *
+ * @return The number of sessions the request was sent to.
+ */
+size_t coap_send_request_scatter(coap_session_t **sessions, size_t count,
+                                 const coap_pdu_t *pdu,
+                                 coap_request_handler_t handler, void *arg,
+                                 unsigned int timeout_ms);
+
+/**
+ * Stops waiting for the responses to the request of @p session with
+ * @p token that was sent with coap_send_request(), without calling its
+ * handler, and stops any retransmissions of the request.  Any later
+ * responses go to the response handler of the context.
+ *
+ * @param session The CoAP session.
+ * @param token   The token of the request.
+ *
+ * @return @c 1 if the request was waiting for responses, else @c 0.
+ */
+int coap_cancel_request(coap_session_t *session, const coap_binary_t *token);
+
+/**
+ * Sends the request @p pdu to the multicast group that @p session was
+ * created for, as coap_send_request() does, and collects the responses of
+ * the members of the group until @p timeout_ms has passed.  @p handler is
+ * called for each response, during which @c addr_info.remote of @p session
+ * is the address of the server that sent it, and then once with
+ * #COAP_REQUEST_STATUS_TIMEOUT when the collection is over.  The request
+ * must be Non-confirmable (RFC 7252 8.1).
+ *
+ * @param session    The CoAP session of the multicast group.
+ * @param pdu        The request to send, which is released.
+ * @param handler    The handler of the responses to the request.
+ * @param arg        Passed on to @p handler.
+ * @param timeout_ms The time in milliseconds for which responses are
+ *                   collected, which must not be @c 0.  It should be
+ *                   longer than the leisure of the servers.
+ *
+ * @return The message id of the sent message or @c COAP_INVALID_MID on
+ *         error, in which case @p handler is not called.
+ */
+coap_mid_t coap_send_group_request(coap_session_t *session, coap_pdu_t *pdu,
+                                   coap_request_handler_t handler, void *arg,
+                                   unsigned int timeout_ms);
+
 /**
  * Sends a CoAP message to given peer. The memory that is
  * allocated for the pdu will be released by coap_send_large().
@@ -649,6 +1251,20 @@ coap_cancel_session_messages(coap_context_t *context,
                              coap_session_t *session,
                              coap_nack_reason_t reason);
 
+/**
+ * Reports that the CON @p pdu could not be delivered, to the forward proxy
+ * if @p pdu is a request that it passed on, else to the nack handler.
+ *
+ * @param context The context in use.
+ * @param session The session @p pdu was sent on.
+ * @param pdu     The PDU.
+ * @param reason  Why @p pdu could not be delivered.
+ * @param mid     The message id of @p pdu.
+ */
+void coap_handle_nack(coap_context_t *context, coap_session_t *session,
+                      coap_pdu_t *pdu, coap_nack_reason_t reason,
+                      coap_mid_t mid);
+
 /**
  * Dispatches the PDUs from the receive queue in given context.
  */
@@ -727,7 +1343,8 @@ coap_pdu_t *coap_wellknown_response(coap_context_t *context,
  * @param r  random value as fractional part of a Q0.MAX_BITS fixed point
  *           value
  * @return   COAP_TICKS_PER_SECOND * 'ack_timeout' *
- *           (1 + ('ack_random_factor' - 1) * r)
+ *           (1 + ('ack_random_factor' - 1) * r), with the CoCoA RTO in
+ *           place of 'ack_timeout' if the session uses CoCoA
  */
 unsigned int coap_calc_timeout(coap_session_t *session, unsigned char r);
 
@@ -788,6 +1405,384 @@ coap_join_mcast_group_intf(coap_context_t *ctx, const char *groupname,
  */
 int coap_io_process(coap_context_t *ctx, uint32_t timeout_ms);
 
+/**
+ * Enables or disables transmit batching for @p context.  When enabled,
+ * datagrams sent on UDP endpoints (typically responses and observe
+ * notifications) are queued and only handed to the kernel by the next
+ * coap_io_flush(), using as few sendmmsg() (or UDP GSO) calls as possible.
+ *
+ * coap_io_process() flushes the queue before it waits for new input and
+ * just before it returns.  Applications that call coap_io_prepare_epoll()
+ * and coap_io_do_epoll() (or coap_io_prepare_io() and coap_io_do_io())
+ * directly must call coap_io_flush() before waiting for new input.
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 to enable transmit batching, @c 0 to disable it (any
+ *                queued datagrams are sent first).
+ *
+ * @return @c 1 if successful, else @c 0 if batching is not supported.
+ */
+int coap_context_set_tx_batching(coap_context_t *context, int enable);
+
+/**
+ * Sends all the datagrams that have been queued for @p context since the
+ * last flush, and writes out the PDUs held back on its TCP and TLS
+ * sessions.  Does nothing unless coap_context_set_tx_batching() or
+ * coap_context_set_tcp_cork() has been enabled.
+ *
+ * @param context The coap_context_t object.
+ */
+void coap_io_flush(coap_context_t *context);
+
+/**
+ * Sets the cork limit of the TCP and TLS sessions of @p context.  When
+ * @p limit is not 0, the PDUs sent on such a session (typically a burst of
+ * observe notifications) are held back until @p limit bytes are waiting,
+ * or until the next coap_io_flush(), and are then written together with a
+ * single writev() or in a single TLS record where possible.
+ *
+ * @param context The coap_context_t object.
+ * @param limit   The number of bytes to hold back at most, or @c 0 to write
+ *                each PDU as soon as it is sent (the default).
+ */
+void coap_context_set_tcp_cork(coap_context_t *context, size_t limit);
+
+/**
+ * Sets how much of the traffic that can wait @p context sends in one I/O
+ * processing iteration, so that the ACKs, RSTs, pings and signaling of a
+ * burst are not held up behind it.  What is over budget is sent in the
+ * following iterations, which then do not wait for new input.
+ *
+ * Within an iteration, the datagrams queued by
+ * coap_context_set_tx_batching() are sent with the control traffic first,
+ * then the retransmissions, the requests and responses, and the
+ * notifications and the blocks after the first of a Block2 transfer last.
+ *
+ * @param context     The coap_context_t object.
+ * @param retransmits The retransmissions sent per iteration at most, or
+ *                    @c 0 for all that are due (the default).
+ * @param bulk        The notifications and blocks sent per iteration at
+ *                    most, or @c 0 for no limit (the default).
+ */
+void coap_context_set_tx_budget(coap_context_t *context,
+                                unsigned int retransmits, unsigned int bulk);
+
+/**
+ * Enables or disables SO_REUSEPORT on the endpoints subsequently created by
+ * coap_new_endpoint() for @p context.
+ *
+ * This allows a server to be sharded across several threads, each running
+ * its own coap_context_t with its own endpoint bound to the same address
+ * and port.  The kernel then spreads the incoming traffic over the
+ * endpoints by hashing the remote address, so all the traffic of a client
+ * (including its observe registrations) stays with the same context.
+ * Each context has to register its own resources.
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 to set SO_REUSEPORT on new endpoints, @c 0 to not.
+ *
+ * @return @c 1 if successful, else @c 0 if SO_REUSEPORT is not supported.
+ */
+int coap_context_set_reuseport(coap_context_t *context, int enable);
+
+/**
+ * Makes @p context shard @p shard of @p shards of a server that is sharded
+ * with coap_context_set_reuseport(), so that a client keeps landing on the
+ * shard that holds its session when the kernel hashing would move it.
+ *
+ * The UDP and DTLS endpoints subsequently created by coap_new_endpoint()
+ * install a classic BPF program on their SO_REUSEPORT group.  It steers a
+ * DTLS record with a Connection ID to the shard given by the first byte of
+ * the Connection ID, which the shards hand out accordingly, so that the
+ * client is still found after a NAT rebinding.  Anything else goes to the
+ * shard of the CPU that received it, which does not change as shards come
+ * and go.  The shards must create their endpoints in shard order, as the
+ * kernel numbers the sockets of the group in the order they are bound.
+ *
+ * @param context The coap_context_t object.
+ * @param shard   The shard of @p context, less than @p shards.
+ * @param shards  The number of shards (up to 256), or @c 0 to leave the
+ *                steering to the kernel hashing (the default).
+ * @param cpu     The CPU that the thread of @p context runs on, which is
+ *                set as SO_INCOMING_CPU of the endpoints, or @c -1.
+ *
+ * @return @c 1 if successful, else @c 0 if the parameters are not valid or
+ *         the steering is not supported.
+ */
+int coap_context_set_reuseport_steering(coap_context_t *context,
+                                        unsigned int shard,
+                                        unsigned int shards, int cpu);
+
+/**
+ * Sets the maximum number of events that coap_io_process() asks for in a
+ * single epoll_wait() (or kevent()) call for @p context.
+ *
+ * The events array starts with COAP_MAX_EPOLL_EVENTS entries and is doubled
+ * each time epoll_wait() fills it, up to @p max_events, so that a busy
+ * server needs fewer epoll_wait() calls per loop.
+ *
+ * @param context    The coap_context_t object.
+ * @param max_events The maximum size of the events array, or @c 0 for the
+ *                   default of COAP_MAX_EPOLL_EVENTS_LIMIT.
+ */
+void coap_context_set_max_epoll_events(coap_context_t *context,
+                                       unsigned int max_events);
+
+/**
+ * Enables or disables edge-triggered epoll registration for the endpoints
+ * of @p context.
+ *
+ * When enabled, each readable endpoint is read until there is nothing left
+ * (and each TCP / TLS listening endpoint accepts until there are no more
+ * pending connections) whenever epoll reports it, rather than once per
+ * epoll_wait() call.  This saves epoll_wait() calls under heavy load.
+ * Sessions are not affected.  With kqueue, the endpoints are registered
+ * with EV_CLEAR.
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 to use edge-triggered endpoints, @c 0 for level-triggered.
+ *
+ * @return @c 1 if successful, else @c 0 if neither epoll nor kqueue is
+ *         supported.
+ */
+int coap_context_set_epoll_edge_triggered(coap_context_t *context, int enable);
+
+/**
+ * Sets the largest UDP or DTLS datagram that @p context can receive to
+ * @p size bytes, rather than COAP_RXBUFFER_SIZE, so that peers on links
+ * with a larger MTU (such as jumbo frames) can send bigger PDUs and fewer
+ * blocks.  The datagrams are then read one at a time into a buffer of the
+ * context, and the endpoints are not read with recvmmsg() or io_uring.
+ * This is also the largest MTU that coap_context_set_path_mtu_discovery()
+ * gives a UDP session, as the peer is expected to be set up alike.
+ *
+ * This must be called before any endpoints or sessions are created.  DTLS
+ * PDUs are still limited to COAP_RXBUFFER_SIZE.
+ *
+ * @param context The coap_context_t object.
+ * @param size    The largest datagram, at most 65535 bytes.  A size of
+ *                COAP_RXBUFFER_SIZE or less restores the default.
+ *
+ * @return @c 1 if successful, else @c 0 if @p size is too big, the buffer
+ *         could not be allocated or @p context already has endpoints or
+ *         sessions.
+ */
+int coap_context_set_max_rx_size(coap_context_t *context, size_t size);
+
+/**
+ * Enables or disables Path MTU discovery for the UDP and DTLS client
+ * sessions subsequently created for @p context.
+ *
+ * The socket of each such session is set to not fragment its datagrams
+ * (IP_MTU_DISCOVER or IPV6_MTU_DISCOVER), and the MTU of the session is
+ * set with coap_session_set_mtu() from the path MTU that the kernel
+ * reports for the peer (IP_MTU or IPV6_MTU), less the IP and UDP headers.
+ * The path MTU is checked again when the kernel reports that a datagram
+ * was too big and whenever a Confirmable message is retransmitted.  As the
+ * blocks of a transfer are sized to fit the MTU of the session, up to the
+ * largest block size of 1024 bytes, a body that fits the path MTU is sent
+ * in a single datagram.
+ *
+ * If a message that is larger than COAP_DEFAULT_MTU has to be
+ * retransmitted while the path MTU has not changed, the path is taken to
+ * be dropping the larger datagrams silently, and the MTU of the session
+ * falls back to COAP_DEFAULT_MTU.
+ *
+ * The MTU is capped by the size set by coap_context_set_max_rx_size() for
+ * UDP sessions, and by COAP_RXBUFFER_SIZE for DTLS sessions.
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 to discover the path MTU of new sessions, @c 0 to
+ *                use COAP_DEFAULT_MTU (the default).
+ *
+ * @return @c 1 if successful, else @c 0 if Path MTU discovery is not
+ *         supported.
+ */
+int coap_context_set_path_mtu_discovery(coap_context_t *context, int enable);
+
+/**
+ * Hands the sockets and the timer of @p context to the event loop of the
+ * application (such as libuv, Boost.Asio or libevent), so that it can
+ * drive libcoap without coap_io_process() and without polling the epoll
+ * or kqueue descriptor of the context in turn.
+ *
+ * From then on, @p callbacks are called whenever libcoap starts, changes
+ * or stops waiting for a socket, and whenever the next retransmission or
+ * session timer moves, instead of updating the epoll or kqueue of
+ * @p context.  The event loop then calls coap_io_do_socket() with the
+ * events of a socket that has become ready, and coap_io_do_timers() when
+ * the timer has fired or the wake call-back has been called.
+ * coap_io_process() must no longer be called for @p context.
+ *
+ * This must be called before any endpoints or sessions are created.  The
+ * endpoints are not read with io_uring.
+ *
+ * @param context   The coap_context_t object.
+ * @param callbacks The call-backs, which are copied.  All but @c wake
+ *                  must be set.
+ * @param arg       Passed to each of the call-backs.
+ *
+ * @return @c 1 if successful, else @c 0 if neither epoll nor kqueue is
+ *         supported or @p context already has endpoints or sessions.
+ */
+int coap_context_set_io_callbacks(coap_context_t *context,
+                                  const coap_io_callbacks_t *callbacks,
+                                  void *arg);
+
+/**
+ * Handles the @p events (COAP_IO_EVENT_*) that the event loop of the
+ * application has seen on the socket that was passed to the add or modify
+ * call-back of coap_context_set_io_callbacks() as @p sock.  The timer is
+ * updated afterwards.
+ *
+ * @param context The coap_context_t object.
+ * @param sock    The socket, as passed to the call-back.
+ * @param events  The events that have occurred.
+ */
+void coap_io_do_socket(coap_context_t *context, coap_socket_t *sock,
+                       unsigned int events);
+
+/**
+ * Does the retransmissions and session timeouts that are due for
+ * @p context, the notifications of observers and the work posted by other
+ * threads, and sets the timer of coap_context_set_io_callbacks() for the
+ * next.
+ *
+ * @param context The coap_context_t object.
+ *
+ * @return The number of milliseconds until this is next to be called, or
+ *         @c 0 if there is nothing to wait for.
+ */
+unsigned int coap_io_do_timers(coap_context_t *context);
+
+/**
+ * Posts a request to notify the observers of @p resource to the thread
+ * that runs coap_io_process() for @p context.  This is the thread safe
+ * version of coap_resource_notify_observers() and may be called from any
+ * thread.  The request is queued without locking and
+ * coap_resource_notify_observers() is called from within the I/O loop.
+ *
+ * @p resource must not be deleted while a request for it is pending.
+ *
+ * @param context  The coap_context_t object that @p resource belongs to.
+ * @param resource The resource that has changed.
+ * @param query    The optional query to restrict the notification to (is
+ *                 copied), or @c NULL.
+ *
+ * @return @c 1 if the request was queued, else @c 0.
+ */
+int coap_context_post_notify(coap_context_t *context,
+                             coap_resource_t *resource,
+                             const coap_string_t *query);
+
+/**
+ * Posts @p pdu to be sent over @p session by the thread that runs
+ * coap_io_process() for @p context, which then calls coap_send().  This
+ * may be called from any thread.
+ *
+ * The caller must have taken a reference to @p session for this
+ * (coap_session_reference() in the I/O thread), which is released once the
+ * PDU has been handed to coap_send().  If this function fails, the caller
+ * still owns that reference.  The ownership of @p pdu is passed on as for
+ * coap_send(), also if this function fails.
+ *
+ * @param context The coap_context_t object that @p session belongs to.
+ * @param session The session to send @p pdu over.
+ * @param pdu     The PDU to send.
+ *
+ * @return @c 1 if the PDU was queued, else @c 0.
+ */
+int coap_context_post_send(coap_context_t *context,
+                           coap_session_t *session,
+                           coap_pdu_t *pdu);
+
+/**
+ * Processes all the events that have been posted to @p context by
+ * coap_context_post_notify() and coap_context_post_send().  This is called
+ * by the I/O loop and must only be called from the thread running it.
+ *
+ * @param context The coap_context_t object.
+ */
+void coap_process_posted(coap_context_t *context);
+
+/**
+ * Wakes up the thread that runs coap_io_process() for @p context if it is
+ * waiting in epoll_wait(), so that it picks up work done for it by other
+ * threads.  With coap_context_set_io_callbacks(), the wake call-back is
+ * called instead.  This may be called from any thread.
+ *
+ * @param context The coap_context_t object.
+ */
+void coap_context_wake_io(coap_context_t *context);
+
+/**
+ * Hands the DTLS handshakes of the server sessions of @p context over to
+ * @p threads worker threads, so that the key exchange and certificate
+ * checks of many clients connecting at the same time do not hold up the
+ * traffic of the sessions that are already established.  Once the
+ * handshake of a session has completed, the session is passed back to the
+ * thread running coap_io_process() for @p context, which raises the
+ * events and sends any queued PDUs as usual.
+ *
+ * The (D)TLS library callbacks that are made during the handshake (such
+ * as the PSK, SNI and CN validation call-backs) are then called from the
+ * worker threads and must be thread safe.  Handshakes of client sessions
+ * are not offloaded.  This is not supported by TinyDTLS, which keeps all
+ * its peers in one shared context.
+ *
+ * This function must be called from the thread running coap_io_process().
+ *
+ * @param context The coap_context_t object.
+ * @param threads The number of worker threads, or @c 0 to stop offloading
+ *                (the default).
+ *
+ * @return @c 1 if successful, else @c 0 if not supported or the threads
+ *         could not be started.
+ */
+int coap_context_set_dtls_handshake_threads(coap_context_t *context,
+                                            unsigned int threads);
+
+/**
+ * Has the worker threads started by coap_context_set_dtls_handshake_threads()
+ * also decrypt the records received on the established server sessions of
+ * @p context, and encrypt and send their notifications, so that the
+ * cryptography of many sessions is spread over the workers.  The decrypted
+ * PDUs of a session are handled by the thread running coap_io_process() in
+ * the order they were received, and while the workers have a session in
+ * hand everything it sends goes through them in order, so that the (D)TLS
+ * library is only used by one thread at a time for each session.
+ *
+ * This only has an effect while there are worker threads.  This function
+ * must be called from the thread running coap_io_process().
+ *
+ * @param context The coap_context_t object.
+ * @param enable  @c 1 to hand over the records, @c 0 to handle them in the
+ *                thread running coap_io_process() (the default).
+ *
+ * @return @c 1 if successful, else @c 0 if not supported.
+ */
+int coap_context_set_dtls_record_offload(coap_context_t *context,
+                                         int enable);
+
+/**
+ * Starts @p threads worker threads to run the handlers that the method
+ * handlers of the resources of @p context pass slow requests on to with
+ * coap_defer_request(), so that the other requests are not held up.  Any
+ * previous threads are first stopped, once they have finished with the
+ * requests already deferred.
+ *
+ * This function must be called from the thread running coap_io_process().
+ *
+ * @param context The coap_context_t object.
+ * @param threads The number of worker threads, or @c 0 to stop them (the
+ *                default).
+ *
+ * @return @c 1 if successful, else @c 0 if not supported or the threads
+ *         could not be started.
+ */
+int coap_context_set_defer_threads(coap_context_t *context,
+                                   unsigned int threads);
+
 #ifndef RIOT_VERSION
 /**
  * The main message processing loop with additional fds for internal select.
@@ -893,7 +1888,8 @@ void coap_io_do_io(coap_context_t *ctx, coap_tick_t now);
  * (e.g. a packet retransmit).
  *
  * Note: If epoll support is compiled into libcoap, coap_io_prepare_epoll() must
- * be used instead of coap_io_prepare_io().
+ * be used instead of coap_io_prepare_io().  The same goes for kqueue support,
+ * with the timer of the kqueue being armed instead.
  *
  * Internal function.
  *
@@ -925,6 +1921,25 @@ struct epoll_event;
 void coap_io_do_epoll(coap_context_t *ctx, struct epoll_event* events,
                       size_t nevents);
 
+struct kevent;
+
+/**
+ * Process all the kqueue events
+ *
+ * Note: If kqueue support is compiled into libcoap, coap_io_do_kqueue() must
+ * be used instead of coap_io_do_io().
+ *
+ * Internal function
+ *
+ * @param ctx    The current CoAP context.
+ * @param events The list of events returned from a kevent() call on the
+ *               descriptor returned by coap_context_get_coap_fd().
+ * @param nevents The number of events.
+ *
+ */
+void coap_io_do_kqueue(coap_context_t *ctx, struct kevent *events,
+                       size_t nevents);
+
 /**@}*/
 
 /**
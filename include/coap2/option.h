@@ -148,7 +148,17 @@ int coap_option_filter_unset(coap_opt_filter_t *filter, uint16_t type);
  *
  * @return       @c 1 if @p type was found, @c 0 otherwise, or @c -1 on error.
  */
-int coap_option_filter_get(coap_opt_filter_t *filter, uint16_t type);
+int coap_option_filter_get(const coap_opt_filter_t *filter, uint16_t type);
+
+/**
+ * Where an option of a parsed PDU is, so that the options do not have to be
+ * decoded again each time they are looked up.
+ */
+typedef struct coap_pdu_opt_index_t {
+  uint16_t number;          /**< option number */
+  uint16_t offset;          /**< offset of the option from token + token_length */
+  uint16_t size;            /**< size of the option, header and value */
+} coap_pdu_opt_index_t;
 
 /**
  * Iterator to run through PDU options. This object must be
@@ -173,6 +183,10 @@ typedef struct {
   unsigned int filtered:1;      /**< denotes whether or not filter is used */
   coap_opt_t *next_option;      /**< pointer to the unparsed next option */
   coap_opt_filter_t filter;     /**< option filter */
+  const coap_pdu_opt_index_t *index; /**< option index of the PDU, or NULL */
+  coap_opt_t *options;          /**< first option, when index is set */
+  uint8_t index_count;          /**< number of entries in index */
+  uint8_t next_index;           /**< entry of index to look at next */
 } coap_opt_iterator_t;
 
 /**
@@ -376,6 +390,111 @@ int coap_insert_optlist(coap_optlist_t **optlist_chain,
  */
 void coap_delete_optlist(coap_optlist_t *optlist_chain);
 
+/** Number of options that a coap_opt_stage_t can hold. */
+#define COAP_OPT_STAGE_SIZE 8
+
+#define COAP_OPT_STAGE_ADD    0 /**< added after any with the same number */
+#define COAP_OPT_STAGE_UPDATE 1 /**< replaces any with the same number */
+#define COAP_OPT_STAGE_REMOVE 2 /**< removes any with the same number */
+
+/**
+ * An option that has been staged in a coap_opt_stage_t.
+ */
+typedef struct coap_opt_stage_entry_t {
+  uint16_t number;              /**< the option number (no delta coding) */
+  uint8_t mode;                 /**< COAP_OPT_STAGE_ADD, _UPDATE or _REMOVE */
+  size_t length;                /**< the option value length */
+  const uint8_t *data;          /**< the option data, or NULL if in value */
+  uint8_t value[8];             /**< copy of an option data of up to 8 bytes */
+} coap_opt_stage_entry_t;
+
+/**
+ * Options that are staged in any order, to then be merged with the options
+ * of a PDU by coap_add_opt_stage_pdu().  All of the options are encoded in a
+ * single pass, instead of moving the rest of the PDU for each option as
+ * coap_insert_option(), coap_update_option() and coap_remove_option() do.
+ *
+ * @code
+ * coap_opt_stage_t stage;
+ * uint8_t buf[4];
+ *
+ * coap_opt_stage_init(&stage);
+ * coap_opt_stage_update(&stage, COAP_OPTION_SIZE2,
+ *                       coap_encode_var_safe(buf, sizeof(buf), length), buf);
+ * coap_opt_stage_update(&stage, COAP_OPTION_ETAG,
+ *                       coap_encode_var_safe(buf, sizeof(buf), etag), buf);
+ * coap_opt_stage_remove(&stage, COAP_OPTION_OBSERVE);
+ * coap_add_opt_stage_pdu(pdu, &stage);
+ * @endcode
+ */
+typedef struct coap_opt_stage_t {
+  size_t count;                 /**< number of options staged */
+  coap_opt_stage_entry_t opt[COAP_OPT_STAGE_SIZE]; /**< the staged options */
+} coap_opt_stage_t;
+
+/**
+ * Initializes @p stage to be empty.
+ *
+ * @param stage The stage to initialize.
+ */
+void coap_opt_stage_init(coap_opt_stage_t *stage);
+
+/**
+ * Stages the option @p number to be added to a PDU after any options with
+ * the same number, as coap_add_option() does.  Option data of up to 8 bytes
+ * is copied, longer data must stay valid until coap_add_opt_stage_pdu() is
+ * called.
+ *
+ * @param stage  The stage to add the option to.
+ * @param number The option number (COAP_OPTION_*)
+ * @param length The option length
+ * @param data   The option value data
+ *
+ * @return       @c 1 if successful, @c 0 if @p stage is full.
+ */
+int coap_opt_stage_add(coap_opt_stage_t *stage, uint16_t number,
+                       size_t length, const uint8_t *data);
+
+/**
+ * Stages the option @p number to replace the options with the same number
+ * in a PDU, as coap_update_option() does.  Anything that is staged for
+ * @p number already is dropped.
+ *
+ * @param stage  The stage to add the option to.
+ * @param number The option number (COAP_OPTION_*)
+ * @param length The option length
+ * @param data   The option value data
+ *
+ * @return       @c 1 if successful, @c 0 if @p stage is full.
+ */
+int coap_opt_stage_update(coap_opt_stage_t *stage, uint16_t number,
+                          size_t length, const uint8_t *data);
+
+/**
+ * Stages the removal of all the options @p number from a PDU.  Anything that
+ * is staged for @p number already is dropped.
+ *
+ * @param stage  The stage to add the removal to.
+ * @param number The option number (COAP_OPTION_*)
+ *
+ * @return       @c 1 if successful, @c 0 if @p stage is full.
+ */
+int coap_opt_stage_remove(coap_opt_stage_t *stage, uint16_t number);
+
+/**
+ * Merges the options of @p stage with the options that are in @p pdu and
+ * encodes them, resizing @p pdu and moving any payload data at most once.
+ * As with coap_add_option(), a Hop-Limit option is added to requests that
+ * get a Proxy-Uri or Proxy-Scheme option without one.
+ *
+ * @param pdu   The PDU to update.
+ * @param stage The staged options.
+ *
+ * @return      @c 1 if successful, @c 0 if @p pdu could not be updated, in
+ *              which case it is left as it was.
+ */
+int coap_add_opt_stage_pdu(coap_pdu_t *pdu, const coap_opt_stage_t *stage);
+
 /** @} */
 
 /**
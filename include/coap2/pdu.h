@@ -31,10 +31,19 @@
 #define COAP_DEFAULT_MTU       1152
 #endif /* COAP_DEFAULT_MTU */
 
+#ifndef COAP_AF_UNIX_MTU
+/* default MTU of a Unix domain socket, which has no IP stack to fit in */
+#define COAP_AF_UNIX_MTU      65535
+#endif /* COAP_AF_UNIX_MTU */
+
 #ifndef COAP_DEFAULT_HOP_LIMIT
 #define COAP_DEFAULT_HOP_LIMIT       16
 #endif /* COAP_DEFAULT_HOP_LIMIT */
 
+#ifndef COAP_DEFAULT_LEISURE_MS
+#define COAP_DEFAULT_LEISURE_MS    5000 /* RFC 7252 8.2 DEFAULT_LEISURE */
+#endif /* COAP_DEFAULT_LEISURE_MS */
+
 /* TCP Message format constants, do not modify */
 #define COAP_MESSAGE_SIZE_OFFSET_TCP8 13
 #define COAP_MESSAGE_SIZE_OFFSET_TCP16 269 /* 13 + 256 */
@@ -136,10 +145,12 @@ typedef enum coap_request_t {
 #define COAP_OPTION_URI_QUERY      15 /* CU-RE__, String,  1-255 B, RFC7252 */
 #define COAP_OPTION_HOP_LIMIT      16 /* ______U, uint,        1 B, RFC8768 */
 #define COAP_OPTION_ACCEPT         17 /* C___E__, uint,      0-2 B, RFC7252 */
+#define COAP_OPTION_Q_BLOCK1       19 /* CU__E_U, uint,      0-3 B, RFC9177 */
 #define COAP_OPTION_LOCATION_QUERY 20 /* ___RE__, String,  0-255 B, RFC7252 */
 #define COAP_OPTION_BLOCK2         23 /* CU-_E_U, uint,      0-3 B, RFC7959 */
 #define COAP_OPTION_BLOCK1         27 /* CU-_E_U, uint,      0-3 B, RFC7959 */
 #define COAP_OPTION_SIZE2          28 /* __N_E_U, uint,      0-4 B, RFC7959 */
+#define COAP_OPTION_Q_BLOCK2       31 /* CU__E_U, uint,      0-3 B, RFC9177 */
 #define COAP_OPTION_PROXY_URI      35 /* CU-___U, String, 1-1034 B, RFC7252 */
 #define COAP_OPTION_PROXY_SCHEME   39 /* CU-___U, String,  1-255 B, RFC7252 */
 #define COAP_OPTION_SIZE1          60 /* __N_E_U, uint,      0-4 B, RFC7252 */
@@ -233,6 +244,9 @@ const char *coap_response_phrase(unsigned char code);
 /* Content formats from RFC 8782 */
 #define COAP_MEDIATYPE_APPLICATION_DOTS_CBOR    271 /* application/dots+cbor */
 
+/* Content formats from RFC 9177 */
+#define COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ  272 /* application/missing-blocks+cbor-seq */
+
 /* Note that identifiers for registered media types are in the range 0-65535. We
  * use an unallocated type here and hope for the best. */
 #define COAP_MEDIATYPE_ANY                         0xff /* any media type */
@@ -272,6 +286,9 @@ COAP_DEPRECATED typedef struct {
 #define COAP_OPTION_LENGTH(option) (option).length
 #define COAP_OPTION_DATA(option) ((unsigned char *)&(option) + sizeof(coap_option))
 
+/** Number of options of a parsed PDU that are recorded in its option index. */
+#define COAP_PDU_OPT_INDEX_SIZE 16
+
 /**
  * structure for CoAP PDUs
  * token, if any, follows the fixed size header, then options until
@@ -282,6 +299,8 @@ COAP_DEPRECATED typedef struct {
  * max_hdr_size.
  * options starts at token + token_length
  * payload starts at data, its length is used_size - (data - token)
+ * When xmit_data is set, the buffer ends with the 0xff marker and the
+ * payload of xmit_length bytes is sent directly from xmit_data.
  */
 
 struct coap_pdu_t {
@@ -290,8 +309,16 @@ struct coap_pdu_t {
   uint8_t max_hdr_size;     /**< space reserved for protocol-specific header */
   uint8_t hdr_size;         /**< actual size used for protocol-specific header */
   uint8_t token_length;     /**< length of Token */
+  uint8_t borrowed;         /**< set if the header, token, options and payload
+                                 are held in a buffer not owned by the PDU,
+                                 or in the one allocated along with it */
   uint16_t mid;             /**< message id, if any, in regular host byte order */
   uint16_t max_opt;         /**< highest option number in PDU */
+  uint8_t opt_indexed;      /**< set if opt_index holds all the options */
+  uint8_t opt_count;        /**< number of entries in opt_index */
+  coap_pdu_opt_index_t opt_index[COAP_PDU_OPT_INDEX_SIZE]; /**< options found
+                                 by coap_pdu_parse(), in order, valid only
+                                 while opt_indexed is set */
   size_t alloc_size;        /**< allocated storage for token, options and payload */
   size_t used_size;         /**< used bytes of storage for token, options and payload */
   size_t max_size;          /**< maximum size for token, options and payload, or zero for variable size pdu */
@@ -311,8 +338,16 @@ struct coap_pdu_t {
   size_t body_length;       /**< Holds body data length */
   size_t body_offset;       /**< Holds body data offset */
   size_t body_total;        /**< Holds body data total size */
+  const uint8_t *xmit_data; /**< payload sent from outside of the PDU
+                                 buffer after the 0xff marker, or NULL */
+  size_t xmit_length;       /**< length of xmit_data */
+  struct coap_lg_xmit_body_t *xmit_body; /**< reference held on the body
+                                              containing xmit_data */
   coap_lg_xmit_t *lg_xmit;  /**< Holds ptr to lg_xmit if sending a set of
                                  blocks */
+  unsigned int ref;         /**< references held by coap_pdu_reference() in
+                                 addition to the creator's, the PDU must not
+                                 be changed while there are any */
 };
 
 #define COAP_PDU_IS_EMPTY(pdu)     ((pdu)->code == 0)
@@ -320,9 +355,36 @@ struct coap_pdu_t {
 #define COAP_PDU_IS_RESPONSE(pdu)  ((pdu)->code >= 64 && (pdu)->code < 224)
 #define COAP_PDU_IS_SIGNALING(pdu) ((pdu)->code >= 224)
 
+/** Number of bytes that @p pdu occupies on the wire (header included) */
+#define COAP_PDU_WIRE_SIZE(pdu) \
+  ((pdu)->hdr_size + (pdu)->used_size + (pdu)->xmit_length)
+
 #define COAP_PDU_MAX_UDP_HEADER_SIZE 4
 #define COAP_PDU_MAX_TCP_HEADER_SIZE 6
 
+/**
+ * Size of the buffer for the token, options and payload that coap_pdu_init()
+ * allocates along with the PDU, so that a small PDU takes a single
+ * allocation.  A PDU that grows beyond it moves to a buffer of its own.  If
+ * 0, the buffer is always allocated separately.
+ */
+#ifndef COAP_PDU_INLINE_SIZE
+#if defined(WITH_LWIP) || defined(WITH_CONTIKI) || \
+    (defined(RIOT_VERSION) && defined(MODULE_MEMARRAY))
+#define COAP_PDU_INLINE_SIZE 0
+#else /* ! WITH_LWIP && ! WITH_CONTIKI && ! MODULE_MEMARRAY */
+#define COAP_PDU_INLINE_SIZE 128
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI && ! MODULE_MEMARRAY */
+#endif /* COAP_PDU_INLINE_SIZE */
+
+/** Size of the COAP_PDU allocation made by coap_pdu_init() */
+#if COAP_PDU_INLINE_SIZE
+#define COAP_PDU_ALLOC_SIZE \
+  (sizeof(coap_pdu_t) + COAP_PDU_MAX_TCP_HEADER_SIZE + COAP_PDU_INLINE_SIZE)
+#else /* ! COAP_PDU_INLINE_SIZE */
+#define COAP_PDU_ALLOC_SIZE sizeof(coap_pdu_t)
+#endif /* ! COAP_PDU_INLINE_SIZE */
+
 #ifdef WITH_LWIP
 /**
  * Creates a CoAP PDU from an lwIP @p pbuf, whose reference is passed on to this
@@ -478,6 +540,55 @@ coap_pdu_duplicate(const coap_pdu_t *old_pdu,
                    uint8_t *token,
                    coap_opt_filter_t *drop_options);
 
+/**
+ * Shares @p pdu once it has been built, for example between the
+ * retransmission queue and a cache.  From then on the PDU must not be
+ * changed by any of its holders, each of which releases it with
+ * coap_delete_pdu().  A holder that needs a different token or message id
+ * takes a copy with coap_pdu_copy() instead.
+ *
+ * Internal use only.
+ *
+ * @param pdu The PDU to share.
+ *
+ * @return @p pdu.
+ */
+coap_pdu_t *coap_pdu_reference(coap_pdu_t *pdu);
+
+/**
+ * Copies the options and payload of @p src into a new PDU carrying the given
+ * token and message id.  Any payload sent from outside of the buffer of
+ * @p src is copied in.
+ *
+ * Internal use only.
+ *
+ * @param src          The PDU to copy, which may be shared.
+ * @param mid          The message id of the copy.
+ * @param max_size     The maximum size of the copy, or 0 for no limit.
+ * @param token_length The length of @p token.
+ * @param token        The token of the copy.
+ *
+ * @return The copy or @c NULL if failure.
+ */
+coap_pdu_t *coap_pdu_copy(const coap_pdu_t *src, coap_mid_t mid,
+                          size_t max_size, size_t token_length,
+                          const uint8_t *token);
+
+/**
+ * Appends the options and payload of @p src to @p dst, which only holds
+ * a token, so that a response built once can answer many requests.  The
+ * payload of @p src must be in its own buffer.
+ *
+ * Internal use only.
+ *
+ * @param dst The PDU to fill in.
+ * @param src The PDU to copy, which may be shared.
+ *
+ * @return @c 1 on success, or @c 0 if the copy does not fit into the
+ *         maximum size of @p dst or memory cannot be allocated.
+ */
+int coap_pdu_copy_body(coap_pdu_t *dst, const coap_pdu_t *src);
+
 /**
 * Interprets @p data to determine the number of bytes in the header.
 * This function returns @c 0 on error or a number greater than zero on success.
@@ -545,6 +656,33 @@ int coap_pdu_parse(coap_proto_t proto,
                    const uint8_t *data,
                    size_t length,
                    coap_pdu_t *pdu);
+
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+/**
+ * Creates a PDU that uses the received @p data in place instead of copying
+ * it. Only the header size is checked, the header and options still need to
+ * be parsed with coap_pdu_parse_header() and coap_pdu_parse_opt().
+ *
+ * @p data must stay valid and must not be reused until the PDU has been
+ * released with coap_delete_pdu(). A private copy of @p data is taken the
+ * first time the PDU needs to grow, so the PDU can be updated as usual.
+ *
+ * For TCP and TLS, @p data holds exactly one frame.
+ *
+ * Internal use only.
+ *
+ * @param proto    Session's protocol.
+ * @param data     The raw data of the received PDU.
+ * @param length   The actual size of @p data.
+ * @param max_size The maximum size of the PDU.
+ *
+ * @return The PDU or @c NULL on error.
+ */
+coap_pdu_t *coap_pdu_borrow(coap_proto_t proto,
+                            uint8_t *data,
+                            size_t length,
+                            size_t max_size);
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
 /**
  * Adds token of length @p len to @p pdu.
  * Adding the token destroys any following contents of the pdu. Hence options
@@ -20,7 +20,7 @@
 #define COAP_RESOURCE_CHECK_TIME 2
 #endif /* COAP_RESOURCE_CHECK_TIME */
 
-#include "coap2/uthash.h"
+#include "coap2/coap_hashkey.h"
 #include "coap2/async.h"
 #include "coap2/block.h"
 #include "coap2/str.h"
@@ -46,6 +46,17 @@ typedef void (*coap_method_handler_t)
    coap_string_t * /* query string */,
    coap_pdu_t * /* response */);
 
+/**
+ * Definition of the handler that a request is deferred to with
+ * coap_defer_request().  It is called from a worker thread, and so may
+ * only read @p session and @p request and fill in @p response.
+ */
+typedef void (*coap_defer_handler_t)
+  (coap_session_t * /* session */,
+   const coap_pdu_t * /* request */,
+   coap_pdu_t * /* response */,
+   void * /* arg */);
+
 #define COAP_ATTR_FLAGS_RELEASE_NAME  0x1
 #define COAP_ATTR_FLAGS_RELEASE_VALUE 0x2
 
@@ -75,6 +86,46 @@ typedef void (*coap_method_handler_t)
  */
 #define COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS  0x4
 
+/**
+ * Notifications for observers that did not register with a query are only
+ * built once per change. The GET handler is called for the first such
+ * observer and the resulting response (including any large body set up by
+ * coap_add_data_large_response()) is copied for the others, with only the
+ * token, message id and message type updated. Only set this flag if the
+ * handler output does not depend on the observer's session.
+ */
+#define COAP_RESOURCE_FLAGS_NOTIFY_FANOUT  0x8
+
+/**
+ * 2.05 responses to GET and FETCH requests are kept for their Max-Age and
+ * later identical requests are answered from the copy without calling the
+ * handler. Requests with an Observe or block option always go to the handler.
+ * The copies are dropped by coap_resource_notify_observers() and by any PUT,
+ * POST, DELETE, PATCH or iPATCH request for the resource. Only set this flag
+ * if the handler output does not depend on the client's session.
+ */
+#define COAP_RESOURCE_FLAGS_CACHE_RESPONSES  0x10
+
+/**
+ * The library keeps a current ETag for the resource and adds it to 2.05
+ * responses that do not have one. A GET or FETCH request that lists the
+ * current ETag is answered with 2.03 (Valid), and a request whose If-Match
+ * or If-None-Match condition fails with 4.12 (Precondition Failed), without
+ * calling the handler. The ETag changes on coap_resource_notify_observers()
+ * and on any PUT, POST, DELETE, PATCH or iPATCH request for the resource.
+ */
+#define COAP_RESOURCE_FLAGS_AUTO_ETAG  0x20
+
+/**
+ * The uri_path of the resource is a route that matches many paths.  A
+ * segment @c {name} matches any one segment, which the handler can get with
+ * coap_resource_get_route_param(), and a last segment of @c * matches the
+ * rest of the path (which may be empty).  Literal segments take precedence
+ * over @c {name} segments, which take precedence over @c *.  Paths that have
+ * been added as resources of their own take precedence over any route.
+ */
+#define COAP_RESOURCE_FLAGS_ROUTE  0x40
+
 /**
  * Creates a new resource object and initializes the link field to the string
  * @p uri_path. This function returns the new coap_resource_t object.
@@ -101,6 +152,18 @@ typedef void (*coap_method_handler_t)
  *                  If this flag is set, coap-observe notifications
  *                  will be sent non-confirmable by default.@n
  *
+ *                 COAP_RESOURCE_FLAGS_NOTIFY_FANOUT
+ *                  If this flag is set, the handler is only called once
+ *                  per change for observers without a query.@n
+ *
+ *                 COAP_RESOURCE_FLAGS_CACHE_RESPONSES
+ *                  If this flag is set, repeated GET and FETCH requests are
+ *                  answered from a cached response while it is fresh.@n
+ *
+ *                 COAP_RESOURCE_FLAGS_AUTO_ETAG
+ *                  If this flag is set, ETags and the validation of
+ *                  them are handled by the library.@n
+ *
  *                  If flags is set to 0 then the
  *                  COAP_RESOURCE_FLAGS_NOTIFY_NON is considered.
  *
@@ -156,6 +219,70 @@ coap_resource_t *coap_resource_unknown_init(coap_method_handler_t put_handler);
 coap_resource_t *coap_resource_proxy_uri_init(coap_method_handler_t handler,
                       size_t host_name_count, const char *host_name_list[]);
 
+/**
+ * Creates a new resource object that answers GET requests with the contents
+ * of the file @p filename, using Block2 if it does not fit into a single
+ * response. Files of COAP_FILE_MMAP_MIN (64 KiB) or more are memory mapped
+ * where possible, smaller ones are read in, and all transfers of the file
+ * share the one copy. The ETag is derived from the file's metadata and the
+ * file is loaded again when it has changed, the old copy being kept until
+ * the transfers using it have finished. Files must be replaced (e.g. by
+ * rename()) rather than truncated or rewritten in place while they are
+ * served, as truncating a file that is mapped raises SIGBUS.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for this resource to work correctly.
+ *
+ * @param uri_path   The URI path of the new resource.
+ * @param filename   The file to serve (is copied).
+ * @param media_type The format of the file's contents.
+ * @param maxage     The Max-Age of the responses. If @c -1, then there is
+ *                   no Max-Age option.
+ * @param flags      Flags for memory management, as for
+ *                   coap_resource_init().
+ *
+ * @return       A pointer to the new object or @c NULL on error.
+ */
+coap_resource_t *coap_resource_file_init(coap_str_const_t *uri_path,
+                                         const char *filename,
+                                         uint16_t media_type, int maxage,
+                                         int flags);
+
+/**
+ * Sets the representation that @p resource answers GET requests with, so
+ * that the response is built once here instead of by a handler for each
+ * request.  A GET request is answered by copying in the pre-built response,
+ * without calling any handler, or with 2.03 if it carries the ETag.  The
+ * requests with an Observe or Block2 option, and responses that do not fit
+ * into a single PDU, are answered from the same buffer by the GET handler
+ * that this function registers for @p resource.
+ *
+ * Calling this again replaces the representation in one go; transfers of the
+ * old one that are still in progress are completed before it is released.
+ * The observers of @p resource are notified.
+ *
+ * Note: COAP_BLOCK_USE_LIBCOAP must be set by coap_context_set_block_mode()
+ * for representations that need Block2.
+ *
+ * @param resource   The resource.
+ * @param media_type The Content-Format of the representation.
+ * @param maxage     The Max-Age of the responses. If @c -1, then there is
+ *                   no Max-Age option.
+ * @param etag       The ETag of the representation, or @c 0 to have one
+ *                   derived from @p media_type and @p data.
+ * @param options    Any other options of the responses (may be @c NULL). The
+ *                   chain is sorted, but remains the caller's to delete.
+ * @param length     The length of @p data.
+ * @param data       The payload, which is copied.
+ *
+ * @return @c 1 on success, else @c 0, in which case the representation of
+ *         @p resource is unchanged.
+ */
+int coap_resource_set_representation(coap_resource_t *resource,
+                                     uint16_t media_type, int maxage,
+                                     uint64_t etag, coap_optlist_t **options,
+                                     size_t length, const uint8_t *data);
+
 /**
  * Returns the resource identified by the unique string @p uri_path. If no
  * resource was found, this function returns @c NULL.
@@ -177,6 +304,39 @@ coap_resource_t *coap_get_resource_from_uri_path(coap_context_t *context,
  */
 coap_str_const_t* coap_resource_get_uri_path(coap_resource_t *resource);
 
+/**
+ * Gets the Uri-Path segment of @p request that matched the @c {name} segment
+ * of the route of @p resource (see COAP_RESOURCE_FLAGS_ROUTE).  The value is
+ * not percent-encoded and points into @p request, so is only valid for as
+ * long as the request is.
+ *
+ * @param resource The route resource the request was passed to.
+ * @param request  The request.
+ * @param name     The name of the segment, without the braces.
+ * @param value    Updated with the segment.
+ *
+ * @return @c 1 if the segment was found, else @c 0.
+ */
+int coap_resource_get_route_param(const coap_resource_t *resource,
+                                  const coap_pdu_t *request,
+                                  const char *name,
+                                  coap_str_const_t *value);
+
+/**
+ * Allocates @p size bytes for a request handler, for example to build a
+ * response body in.  The memory is released by libcoap once the handler has
+ * returned, so must not be freed, nor be used after then.  Data added with
+ * coap_add_data() is copied, so may be in this memory, unlike the data
+ * passed to coap_add_data_large_response().
+ *
+ * @param context The context the handler was called for.
+ * @param size    The number of bytes needed.
+ *
+ * @return The allocated memory, or @c NULL if out of memory or no handler is
+ *         being called.
+ */
+void *coap_request_alloc(coap_context_t *context, size_t size);
+
 /**
  * Sets the notification message type of resource @p resource to given
  * @p mode
@@ -233,6 +393,48 @@ void coap_resource_release_userdata_handler(coap_context_t *context,
  */
 void coap_add_resource(coap_context_t *context, coap_resource_t *resource);
 
+/**
+ * Definition of a resource for coap_add_resources_compact().
+ */
+typedef struct coap_resource_def_t {
+  coap_str_const_t uri_path;   /**< Path of the resource, which is copied */
+  int flags;                   /**< Zero or more COAP_RESOURCE_FLAGS_* or'd
+                                    together */
+  /** The handlers of @c GET, @c POST, @c PUT, @c DELETE, @c FETCH,
+   *  @c PATCH and @c IPATCH, in that order, or NULL for none */
+  const coap_method_handler_t *handlers;
+  /** @p attr_count pairs of attribute name and value, which are copied;
+   *  a value with @c s NULL is no value */
+  const coap_str_const_t *attrs;
+  size_t attr_count;           /**< Number of attributes in @p attrs */
+  void *user_data;             /**< Initial user data of the resource */
+} coap_resource_def_t;
+
+/**
+ * Creates the resources defined by @p defs and registers them for
+ * @p context, in a compact form meant for very large catalogs.  Resources
+ * with the same handlers share a single handler set, the attribute names
+ * and values are interned, and the URI paths and attributes are kept in an
+ * arena of the context instead of being allocated one by one.  The
+ * rendered /.well-known/core and the attribute index are only built again
+ * when next asked for.
+ *
+ * The resources are used like any other, and coap_register_handler() and
+ * coap_add_attr() can be used on them.  The memory of the URI paths and
+ * attributes of a compact resource is only released with @p context, even
+ * if the resource is deleted before.
+ *
+ * @param context The context to use.
+ * @param defs    The definitions of the resources.
+ * @param count   The number of resources in @p defs.
+ *
+ * @return The number of resources registered, which is less than @p count
+ *         only if out of memory.
+ */
+size_t coap_add_resources_compact(coap_context_t *context,
+                                  const coap_resource_def_t *defs,
+                                  size_t count);
+
 /**
  * Deletes a resource identified by @p resource. The storage allocated for that
  * resource is freed, and removed from the context.
@@ -257,6 +459,28 @@ void coap_register_handler(coap_resource_t *resource,
                            coap_request_t method,
                            coap_method_handler_t handler);
 
+/**
+ * Passes the slow part of the handling of @p request on to the worker
+ * threads started by coap_context_set_defer_threads(), so that the other
+ * requests are handled in the meantime.  This is called by a method
+ * handler, which then leaves its own response empty, so that the request
+ * is acknowledged (see coap_context_set_async_ack_delay() for holding the
+ * ACK back).  @p handler is called from a worker thread with a copy of
+ * @p request and a separate response, which is sent once the handler has
+ * returned.  A response whose code has not been set is sent as a 5.00.
+ *
+ * @param session The session the request was received on.
+ * @param request The request, which is copied.
+ * @param handler The handler to run in a worker thread.
+ * @param arg     Passed on to @p handler.
+ *
+ * @return @c 1 if the request has been deferred, else @c 0 if there are no
+ *         worker threads (or no memory), in which case the method handler
+ *         must fill in its response itself.
+ */
+int coap_defer_request(coap_session_t *session, const coap_pdu_t *request,
+                       coap_defer_handler_t handler, void *arg);
+
 /**
  * Registers a new attribute with the given @p resource. As the
  * attribute's coap_str_const_ fields will point to @p name and @p value the
@@ -381,8 +605,36 @@ void coap_register_handler(coap_resource_t *resource,
 coap_resource_t *coap_get_resource_from_uri_path(coap_context_t *context,
                                                 coap_str_const_t *uri_path);
 
+/**
+ * The resources of a context are hashed on their uri_path with FNV-1a, so
+ * that a request can be matched without building its path first.  The hash
+ * starts at COAP_RESOURCE_HASH_INIT and each byte of the (percent-encoded)
+ * path is added with COAP_RESOURCE_HASH_ADD().
+ */
+#define COAP_RESOURCE_HASH_INIT 2166136261U
+#define COAP_RESOURCE_HASH_ADD(h, c) (((h) ^ (uint8_t)(c)) * 16777619U)
+
+/**
+ * Returns the hash that a resource with @p uri_path is stored under.
+ *
+ * @param uri_path The Uri-Path of the resource.
+ *
+ * @return The hash value.
+ */
+COAP_STATIC_INLINE unsigned
+coap_resource_hash(const coap_str_const_t *uri_path) {
+  unsigned hashv = COAP_RESOURCE_HASH_INIT;
+  size_t i;
+
+  for (i = 0; i < uri_path->length; i++)
+    hashv = COAP_RESOURCE_HASH_ADD(hashv, uri_path->s[i]);
+  return hashv;
+}
+
 #define RESOURCES_ADD(r, obj) \
-  HASH_ADD(hh, (r), uri_path->s[0], (obj)->uri_path->length, (obj))
+  HASH_ADD_KEYPTR_BYHASHVALUE(hh, (r), (obj)->uri_path->s, \
+                              (obj)->uri_path->length, \
+                              coap_resource_hash((obj)->uri_path), (obj))
 
 #define RESOURCES_DELETE(r, obj) \
   HASH_DELETE(hh, (r), (obj))
@@ -392,7 +644,8 @@ coap_resource_t *coap_get_resource_from_uri_path(coap_context_t *context,
   HASH_ITER(hh, (r), tmp, rtmp)
 
 #define RESOURCES_FIND(r, k, res) {                     \
-    HASH_FIND(hh, (r), (k)->s, (k)->length, (res)); \
+    HASH_FIND_BYHASHVALUE(hh, (r), (k)->s, (k)->length, \
+                          coap_resource_hash(k), (res)); \
   }
 
 /**
@@ -61,6 +61,125 @@ int
 coap_resource_notify_observers(coap_resource_t *resource,
                                const coap_string_t *query);
 
+/**
+ * Records @p value as the current numeric state of @p resource and then
+ * initiates the sending of an Observe packet to its observers as
+ * coap_resource_notify_observers() does for a NULL query.
+ *
+ * Observers that registered with the conditional attributes @c st (step),
+ * @c gt (greater than) or @c lt (less than) in their query are only notified
+ * when @p value has moved by at least the step since they were last
+ * notified, or has crossed one of the thresholds.  The @c pmin and @c pmax
+ * attributes are honoured whether or not a value is given.
+ *
+ * @param resource The CoAP resource to use.
+ * @param value    The current value of the resource.
+ *
+ * @return         @c 1 if the Observe has been triggered, @c 0 otherwise.
+ */
+int
+coap_resource_notify_observers_value(coap_resource_t *resource, double value);
+
+/**
+ * The hooks by which the observe state of a server is shared with the
+ * other nodes of a cluster, so that a change to a resource on any node
+ * notifies the observers on all of them, each node sending the
+ * notifications of its own observers (see
+ * coap_context_set_observe_registry()).  Any hook may be NULL.
+ */
+typedef struct coap_observe_registry_t {
+  /**
+   * Called when an observer of @p resource registers with @p session of
+   * this node, for the registry to record that this node owns it.
+   */
+  void (*add)(void *arg, coap_resource_t *resource, coap_session_t *session,
+              const coap_bin_const_t *token);
+  /**
+   * Called when the observer added with the same parameters goes away.
+   */
+  void (*remove)(void *arg, coap_resource_t *resource,
+                 coap_session_t *session, const coap_bin_const_t *token);
+  /**
+   * Called with the serialized change event of an observable resource
+   * that has changed on this node, which the application passes to
+   * coap_observe_registry_event() on the other nodes (or those that own
+   * observers of the resource).
+   */
+  void (*publish)(void *arg, const uint8_t *event, size_t length);
+  void *arg;                       /**< Passed to the hooks */
+} coap_observe_registry_t;
+
+/**
+ * Sets the hooks by which the observe state of @p context is shared with
+ * the other nodes of a cluster.
+ *
+ * @param context  The context.
+ * @param registry The hooks, which are copied, or NULL for none (the
+ *                 default).
+ *
+ * @return @c 1 if successful, else @c 0.
+ */
+int coap_context_set_observe_registry(coap_context_t *context,
+                                      const coap_observe_registry_t *registry);
+
+/**
+ * Applies the change @p event published by another node of the cluster:
+ * the observers of the resource on this node are notified as by
+ * coap_resource_notify_observers() or
+ * coap_resource_notify_observers_value(), without the event being
+ * published again.
+ *
+ * @param context The context.
+ * @param event   The change event, as passed to the @c publish hook.
+ * @param length  The length of @p event.
+ *
+ * @return @c 1 if the Observe has been triggered, @c 0 if @p event is not
+ *         valid, its resource is not known or it has no observers here.
+ */
+int coap_observe_registry_event(coap_context_t *context,
+                                const uint8_t *event, size_t length);
+
+/**
+ * Saves the observers of @p context to @p filename, so that a new process
+ * can take them over with coap_observe_restore() and carry on notifying
+ * them without them having to register again.  The token, query and block
+ * settings of each observer are saved, together with the addresses and
+ * message id and token counters of its session, the Observe sequence and
+ * ETag of its resource and the ETag counter of @p context.
+ *
+ * Only the observers of plain UDP sessions are saved, as the state of a
+ * (D)TLS, TCP or OSCORE session cannot be carried across.  The snapshot is
+ * written to @p filename with ".tmp" appended and then renamed, so an
+ * existing snapshot is only replaced by a complete one.
+ *
+ * @param context  The context.
+ * @param filename The file to save the snapshot to.
+ * @param detach   If set, the saved observers are then dropped from
+ *                 @p context without being told, so that freeing @p context
+ *                 on the way out does not end their observations.
+ *
+ * @return The number of observers saved, or @c -1 if the snapshot could not
+ *         be written.
+ */
+int coap_observe_snapshot(coap_context_t *context, const char *filename,
+                          int detach);
+
+/**
+ * Restores the observers saved by coap_observe_snapshot() to @p context,
+ * which must already have its resources and UDP endpoints (on the same
+ * ports) set up.  The sessions of the observers are created as if they had
+ * just sent a request, and the observers of resources that no longer exist
+ * are dropped.
+ *
+ * @param context  The context.
+ * @param filename The snapshot file.
+ *
+ * @return The number of observers restored, or @c -1 if @p filename cannot
+ *         be read or is not a valid snapshot (observers restored before the
+ *         invalid part of the file are kept).
+ */
+int coap_observe_restore(coap_context_t *context, const char *filename);
+
 /** @} */
 
 #endif /* COAP_SUBSCRIBE_H_ */
@@ -72,6 +72,11 @@ coap_address_equals(const coap_address_t *a, const coap_address_t *b) {
    return a->addr.sin6.sin6_port == b->addr.sin6.sin6_port &&
      memcmp(&a->addr.sin6.sin6_addr, &b->addr.sin6.sin6_addr,
             sizeof(struct in6_addr)) == 0;
+#ifdef COAP_AF_UNIX_SUPPORT
+ case AF_UNIX:
+   return memcmp(a->addr.cun.sun_path, b->addr.cun.sun_path,
+                 a->size - offsetof(struct sockaddr_un, sun_path)) == 0;
+#endif /* COAP_AF_UNIX_SUPPORT */
  default: /* fall through and signal error */
    ;
  }
@@ -97,6 +102,29 @@ int coap_is_mcast(const coap_address_t *a) {
 
 #endif /* !defined(WITH_CONTIKI) && !defined(WITH_LWIP) */
 
+int
+coap_address_set_unix_domain(coap_address_t *addr, const uint8_t *path,
+                             size_t length) {
+#ifdef COAP_AF_UNIX_SUPPORT
+  /* A filesystem path keeps its NUL terminator */
+  size_t used = length + (length && path[0] ? 1 : 0);
+
+  assert(addr);
+  if (!length || used > sizeof(addr->addr.cun.sun_path))
+    return 0;
+  coap_address_init(addr);
+  addr->addr.cun.sun_family = AF_UNIX;
+  memcpy(addr->addr.cun.sun_path, path, length);
+  addr->size = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + used);
+  return 1;
+#else /* ! COAP_AF_UNIX_SUPPORT */
+  (void)addr;
+  (void)path;
+  (void)length;
+  return 0;
+#endif /* ! COAP_AF_UNIX_SUPPORT */
+}
+
 void coap_address_init(coap_address_t *addr) {
   assert(addr);
   memset(addr, 0, sizeof(coap_address_t));
@@ -15,16 +15,50 @@
 
 #ifndef WITHOUT_ASYNC
 
-/* utlist-style macros for searching pairs in linked lists */
-#define SEARCH_PAIR(head,out,field1,val1,field2,val2)   \
-  SEARCH_PAIR2(head,out,field1,val1,field2,val2,next)
+/*
+ * The states are hashed by session and message id in the context's
+ * async_state, to match duplicates of the requests, and by token in the
+ * session's async_token, to match the responses the application sends.
+ * The held back ACKs and the timeouts are carried out by the timers of the
+ * session, so the application does not have to poll for them.
+ */
+#define COAP_ASYNC_KEYLEN                                               \
+  (offsetof(coap_async_state_t, id) + sizeof(coap_mid_t) -              \
+   offsetof(coap_async_state_t, session))
+
+static coap_async_state_t *
+coap_async_lookup(coap_context_t *context, coap_session_t *session,
+                  coap_mid_t id) {
+  coap_async_state_t key;
+  coap_async_state_t *s;
+
+  key.session = session;
+  key.id = id;
+  HASH_FIND(hh, context->async_state, &key.session, COAP_ASYNC_KEYLEN, s);
+  return s;
+}
+
+/* Sends the empty ACK that is held back for @p s */
+static void
+coap_async_send_ack(coap_async_state_t *s) {
+  coap_pdu_t *ack;
 
-#define SEARCH_PAIR2(head,out,field1,val1,field2,val2,next)             \
-  do {                                                                  \
-    LL_FOREACH2(head,out,next) {                                        \
-      if ((out)->field1 == (val1) && (out)->field2 == (val2)) break;    \
-    }                                                                   \
-} while(0)
+  s->ack_due = 0;
+  ack = coap_pdu_init(COAP_MESSAGE_ACK, 0, s->id, 0);
+  if (ack && coap_send(s->session, ack) == COAP_INVALID_MID)
+    coap_log(LOG_DEBUG, "cannot send ACK for mid=0x%x\n", s->id);
+}
+
+/* Makes sure the session timers look at @p s when it is next due */
+static void
+coap_async_timer_arm(coap_async_state_t *s) {
+  coap_tick_t due = s->ack_due;
+
+  if (s->timeout_due && (!due || s->timeout_due < due))
+    due = s->timeout_due;
+  if (due)
+    coap_session_timer_arm(s->session, due);
+}
 
 coap_async_state_t *
 coap_register_async(coap_context_t *context, coap_session_t *session,
@@ -32,7 +66,7 @@ coap_register_async(coap_context_t *context, coap_session_t *session,
   coap_async_state_t *s;
   coap_mid_t id = request->mid;
 
-  SEARCH_PAIR(context->async_state,s,session,session,id,id);
+  s = coap_async_lookup(context, session, id);
 
   if (s != NULL) {
     /* We must return NULL here as the caller must know that he is
@@ -68,25 +102,49 @@ coap_register_async(coap_context_t *context, coap_session_t *session,
 
   coap_touch_async(s);
 
-  LL_PREPEND(context->async_state, s);
+  if (request->type == COAP_MESSAGE_CON && context->async_ack_delay &&
+      COAP_PROTO_NOT_RELIABLE(session->proto)) {
+    s->ack_due = s->created + context->async_ack_delay;
+    coap_async_timer_arm(s);
+  }
+
+  HASH_ADD(hh, context->async_state, session, COAP_ASYNC_KEYLEN, s);
+  HASH_ADD(hh_token, session->async_token, token, s->tokenlen, s);
 
   return s;
 }
 
 coap_async_state_t *
 coap_find_async(coap_context_t *context, coap_session_t *session, coap_mid_t id) {
-  coap_async_state_t *tmp;
-  SEARCH_PAIR(context->async_state,tmp,session,session,id,id);
-  return tmp;
+  return coap_async_lookup(context, session, id);
+}
+
+coap_async_state_t *
+coap_find_async_token(coap_session_t *session, const coap_binary_t *token) {
+  coap_async_state_t *s;
+
+  HASH_FIND(hh_token, session->async_token, token->s, token->length, s);
+  return s;
+}
+
+/* Takes @p s out of the hash tables */
+static void
+coap_async_unlink(coap_context_t *context, coap_async_state_t *s) {
+  HASH_DELETE(hh, context->async_state, s);
+  HASH_DELETE(hh_token, s->session->async_token, s);
 }
 
 int
 coap_remove_async(coap_context_t *context, coap_session_t *session,
                   coap_mid_t id, coap_async_state_t **s) {
-  coap_async_state_t *tmp = coap_find_async(context, session, id);
+  coap_async_state_t *tmp = coap_async_lookup(context, session, id);
 
-  if (tmp)
-    LL_DELETE(context->async_state,tmp);
+  if (tmp) {
+    coap_async_unlink(context, tmp);
+    if (tmp->ack_due)
+      /* The client must not go on sending the request */
+      coap_async_send_ack(tmp);
+  }
 
   *s = tmp;
   return tmp != NULL;
@@ -109,12 +167,122 @@ void
 coap_delete_all_async(coap_context_t *context) {
   coap_async_state_t *astate, *tmp;
 
-  LL_FOREACH_SAFE(context->async_state, astate, tmp) {
+  HASH_ITER(hh, context->async_state, astate, tmp) {
+    coap_async_unlink(context, astate);
     coap_free_async(astate);
   }
   context->async_state = NULL;
 }
 
+void
+coap_context_set_async_ack_delay(coap_context_t *context,
+                                 unsigned int milliseconds) {
+  context->async_ack_delay =
+    (coap_tick_t)milliseconds * COAP_TICKS_PER_SECOND / 1000;
+}
+
+void
+coap_async_set_timeout(coap_async_state_t *s, unsigned int seconds) {
+  coap_tick_t now;
+
+  if (seconds) {
+    coap_ticks(&now);
+    s->timeout_due = now + (coap_tick_t)seconds * COAP_TICKS_PER_SECOND;
+    coap_async_timer_arm(s);
+  } else {
+    s->timeout_due = 0;
+  }
+}
+
+int
+coap_async_check_duplicate(coap_session_t *session, const coap_pdu_t *pdu) {
+  coap_async_state_t *s;
+
+  if (!session->async_token)
+    return 0;
+  s = coap_async_lookup(session->context, session, pdu->mid);
+  if (!s)
+    return 0;
+  coap_log(LOG_DEBUG, "mid=0x%x is handled asynchronously, sending ACK\n",
+           pdu->mid);
+  coap_async_send_ack(s);
+  return 1;
+}
+
+int
+coap_async_ack_held(coap_session_t *session, const coap_pdu_t *pdu) {
+  coap_async_state_t *s;
+
+  if (!session->async_token)
+    return 0;
+  s = coap_async_lookup(session->context, session, pdu->mid);
+  return s && s->ack_due;
+}
+
+void
+coap_async_piggyback(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_async_state_t *s;
+
+  HASH_FIND(hh_token, session->async_token, pdu->token, pdu->token_length, s);
+  if (s && s->ack_due) {
+    s->ack_due = 0;
+    pdu->type = COAP_MESSAGE_ACK;
+    pdu->mid = s->id;
+  }
+}
+
+/* Times out @p s, which is then released */
+static void
+coap_async_timeout(coap_context_t *context, coap_async_state_t *s) {
+  coap_log(LOG_DEBUG, "asynchronous state for mid=0x%x timed out\n", s->id);
+  /* Left in async_token until the end so that the response can still be
+     piggybacked on the ACK */
+  HASH_DELETE(hh, context->async_state, s);
+  if (context->async_timeout_handler) {
+    context->async_timeout_handler(context, s);
+  } else {
+    coap_pdu_t *response;
+
+    response = coap_pdu_init((s->flags & COAP_ASYNC_CONFIRM) ?
+                             COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+                             COAP_RESPONSE_CODE(503),
+                             coap_new_message_id(s->session),
+                             coap_session_max_pdu_size(s->session));
+    if (response && !coap_add_token(response, s->tokenlen, s->token)) {
+      coap_delete_pdu(response);
+      response = NULL;
+    }
+    if (!response || coap_send(s->session, response) == COAP_INVALID_MID)
+      coap_log(LOG_DEBUG, "cannot send timeout response for mid=0x%x\n",
+               s->id);
+  }
+  HASH_DELETE(hh_token, s->session->async_token, s);
+  if (s->ack_due)
+    coap_async_send_ack(s);
+  coap_free_async(s);
+}
+
+coap_tick_t
+coap_async_check_timeouts(coap_session_t *session, coap_tick_t now) {
+  coap_context_t *context = session->context;
+  coap_async_state_t *s, *tmp;
+  coap_tick_t due = 0;
+
+  HASH_ITER(hh_token, session->async_token, s, tmp) {
+    if (s->timeout_due && s->timeout_due <= now) {
+      coap_async_timeout(context, s);
+      continue;
+    }
+    if (s->ack_due && s->ack_due <= now)
+      coap_async_send_ack(s);
+    if (s->ack_due && (!due || s->ack_due < due))
+      due = s->ack_due;
+    if (s->timeout_due && (!due || s->timeout_due < due))
+      due = s->timeout_due;
+  }
+  return due;
+}
+
 #else
 void does_not_exist(void);        /* make some compilers happy */
 #endif /* WITHOUT_ASYNC */
@@ -134,6 +134,52 @@ coap_add_block(coap_pdu_t *pdu, size_t len, const uint8_t *data,
                        data + start);
 }
 
+/*
+ * As coap_add_block(), but taking the data from the body of @p lg_xmit
+ */
+static int
+coap_block_add_xmit_block(coap_session_t *session, coap_pdu_t *pdu,
+                          coap_lg_xmit_t *lg_xmit, unsigned int block_num,
+                          unsigned char block_szx) {
+  size_t start = (size_t)block_num << (block_szx + 4);
+
+  if (lg_xmit->length <= start)
+    return 0;
+
+  return coap_block_add_xmit_data(session, pdu, lg_xmit, start,
+                         min(lg_xmit->length - start,
+                             ((size_t)1 << (block_szx + 4))));
+}
+
+/*
+ * Adds the @p len bytes at @p offset of a body that is either @p data or
+ * read by @p producer to @p pdu.
+ */
+static int
+coap_block_add_body_data(coap_session_t *session, coap_pdu_t *pdu,
+                         const uint8_t *data,
+                         coap_large_data_producer_t producer, void *app_ptr,
+                         size_t offset, size_t len) {
+  uint8_t *payload;
+
+  if (!producer)
+    return coap_add_data(pdu, len, data + offset);
+  if (len == 0)
+    return 1;
+  payload = coap_add_data_after(pdu, len);
+  if (!payload)
+    return 0;
+  if (!producer(session, offset, len, payload, app_ptr)) {
+    coap_log(LOG_DEBUG, "** %s: producer failed at offset %zu\n",
+             coap_session_str(session), offset);
+    /* Take the payload out again */
+    pdu->used_size = pdu->data - pdu->token - 1;
+    pdu->data = NULL;
+    return 0;
+  }
+  return 1;
+}
+
 /*
  * Note that the COAP_OPTION_ have to be added in the correct order
  */
@@ -263,9 +309,18 @@ void
 coap_context_set_block_mode(coap_context_t *context,
                                   uint8_t block_mode) {
   context->block_mode = block_mode &= (COAP_BLOCK_USE_LIBCOAP |
-                                       COAP_BLOCK_SINGLE_BODY);
+                                       COAP_BLOCK_SINGLE_BODY |
+                                       COAP_BLOCK_STREAM_BODY |
+                                       COAP_BLOCK_TRY_Q_BLOCK);
   if (!(block_mode & COAP_BLOCK_USE_LIBCOAP))
     context->block_mode = 0;
+  coap_option_props_init(context);
+}
+
+void
+coap_context_set_max_body_size(coap_context_t *context,
+                               size_t max_body_size) {
+  context->max_body_size = max_body_size;
 }
 
 /*
@@ -273,16 +328,6 @@ coap_context_set_block_mode(coap_context_t *context,
  * [The upper 32 bits are incremented as different payloads are sent]
  *
  */
-COAP_STATIC_INLINE int
-block_token_match(const uint8_t *a, size_t alen,
-  const uint8_t *b, size_t blen) {
-  size_t bias;
-  if (blen < 4)
-    return alen == blen && memcmp(a, b, blen) == 0;
-  bias = blen - 4;
-  return alen == blen && memcmp(a+bias, b+bias, 4) == 0;
-}
-
 COAP_STATIC_INLINE int
 full_match(const uint8_t *a, size_t alen,
   const uint8_t *b, size_t blen) {
@@ -335,11 +380,13 @@ int
 coap_add_data_large_internal(coap_session_t *session,
                              coap_pdu_t *pdu,
                              coap_resource_t *resource,
+                             const coap_pdu_t *request,
                              const coap_string_t *query,
                              int maxage,
                              uint64_t etag,
                              size_t length,
                              const uint8_t *data,
+                             coap_large_data_producer_t producer,
                              coap_release_large_data_t release_func,
                              void *app_ptr) {
 
@@ -372,16 +419,22 @@ coap_add_data_large_internal(coap_session_t *session,
   /* Determine the block size to use, adding in sensible options if needed */
   if (COAP_PDU_IS_REQUEST(pdu)) {
     coap_lg_xmit_t *q;
+    coap_opt_iterator_t opt_iter;
 
     option = COAP_OPTION_BLOCK1;
+    if (coap_check_option(pdu, COAP_OPTION_Q_BLOCK1, &opt_iter) ||
+        (COAP_SESSION_Q_BLOCK(session) &&
+         !coap_check_option(pdu, COAP_OPTION_BLOCK1, &opt_iter)))
+      option = COAP_OPTION_Q_BLOCK1;
 
     /* See if this token is already in use for large bodies (unlikely) */
     LL_FOREACH_SAFE(session->lg_xmit, lg_xmit, q) {
-      if (full_match(pdu->token, pdu->token_length,
+      if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
+          full_match(pdu->token, pdu->token_length,
                      lg_xmit->b.b1.app_token->s,
                      lg_xmit->b.b1.app_token->length)) {
         /* Unfortunately need to free this off as potential size change */
-        LL_DELETE(session->lg_xmit, lg_xmit);
+        coap_block_remove_lg_xmit(session, lg_xmit);
         coap_block_delete_lg_xmit(session, lg_xmit);
         lg_xmit = NULL;
         break;
@@ -390,30 +443,33 @@ coap_add_data_large_internal(coap_session_t *session,
   }
   else {
     /* Have to assume that it is a response even if code is 0.00 */
-    coap_lg_xmit_t *q;
-    coap_string_t empty = { 0, NULL};
+    coap_opt_iterator_t opt_iter;
 
     assert(resource);
-    option = COAP_OPTION_BLOCK2;
+    /* Set up by coap_add_data_large_response() if Q-Block2 was asked for */
+    if (coap_check_option(pdu, COAP_OPTION_Q_BLOCK2, &opt_iter))
+      option = COAP_OPTION_Q_BLOCK2;
+    else
+      option = COAP_OPTION_BLOCK2;
 
     /* Check if resource+query is already in use for large bodies (unlikely) */
-    LL_FOREACH_SAFE(session->lg_xmit, lg_xmit, q) {
-      if (resource == lg_xmit->b.b2.resource &&
-          coap_string_equal(query ? query : &empty,
-                         lg_xmit->b.b2.query ? lg_xmit->b.b2.query : &empty)) {
-        /* Unfortunately need to free this off as potential size change */
-        LL_DELETE(session->lg_xmit, lg_xmit);
-        coap_block_delete_lg_xmit(session, lg_xmit);
-        lg_xmit = NULL;
-        break;
-      }
+    lg_xmit = coap_block_find_lg_xmit_response(session, resource, request,
+                                               query);
+    if (lg_xmit) {
+      /* Unfortunately need to free this off as potential size change */
+      coap_block_remove_lg_xmit(session, lg_xmit);
+      coap_block_delete_lg_xmit(session, lg_xmit);
+      lg_xmit = NULL;
     }
   }
 
   avail = pdu->max_size - pdu->used_size - pdu->hdr_size;
   /* May need token of length 8, so account for this */
   avail -= (pdu->token_length <= 8) ? pdu->token_length <= 8 : 0;
+  /* The largest block that fits the MTU of the session */
   blk_size = coap_flsll((long long)avail) - 4 - 1;
+  if (avail >= 16 && blk_size > COAP_MAX_BLOCK_SZX)
+    blk_size = COAP_MAX_BLOCK_SZX;
 
   /* see if BLOCKx defined - if so update blk_size as given by app */
   if (coap_get_block(pdu, option, &block)) {
@@ -434,6 +490,28 @@ coap_add_data_large_internal(coap_session_t *session,
     /* App is defining a single block to send */
     size_t rem;
 
+    if (option == COAP_OPTION_BLOCK2) {
+      coap_opt_stage_t stage;
+
+      /*
+       * Lets a client that already has the other blocks (such as one that
+       * is resuming the body) check that this one is of the same body
+       */
+      coap_opt_stage_init(&stage);
+      coap_opt_stage_update(&stage,
+                            COAP_OPTION_SIZE2,
+                            coap_encode_var_safe(buf, sizeof(buf),
+                                                 (unsigned int)length),
+                            buf);
+      if (etag == 0 && (resource->flags & COAP_RESOURCE_FLAGS_AUTO_ETAG))
+        etag = coap_resource_etag(resource);
+      if (etag)
+        coap_opt_stage_update(&stage,
+                              COAP_OPTION_ETAG,
+                              coap_encode_var_safe8(buf, sizeof(buf), etag),
+                              buf);
+      coap_add_opt_stage_pdu(pdu, &stage);
+    }
     pdu->body_data = data;
     pdu->body_length = length;
     coap_log(LOG_DEBUG, "PDU presented by app\n");
@@ -444,7 +522,8 @@ coap_add_data_large_internal(coap_session_t *session,
       rem = chunk;
       if (chunk > length - block.num * chunk)
         rem = length - block.num * chunk;
-      if (!coap_add_data(pdu, rem, &data[block.num * chunk]))
+      if (!coap_block_add_body_data(session, pdu, data, producer, app_ptr,
+                                    block.num * chunk, rem))
         goto fail;
     }
     if (release_func)
@@ -454,6 +533,7 @@ coap_add_data_large_internal(coap_session_t *session,
     /* Only add in lg_xmit if more than one block needs to be handled */
     uint64_t token;
     size_t rem;
+    coap_opt_stage_t stage;
 
     lg_xmit = coap_malloc_type(COAP_LG_XMIT, sizeof(coap_lg_xmit_t));
     if (!lg_xmit)
@@ -478,6 +558,13 @@ coap_add_data_large_internal(coap_session_t *session,
     lg_xmit->last_payload = 0;
     lg_xmit->last_used = 0;
     lg_xmit->app_ptr = app_ptr;
+    lg_xmit->producer = producer;
+    lg_xmit->window = NULL;
+    lg_xmit->window_offset = 0;
+    lg_xmit->window_length = 0;
+    lg_xmit->window_size = 0;
+    /* The options are all encoded in one go once the block is known */
+    coap_opt_stage_init(&stage);
     if (COAP_PDU_IS_REQUEST(pdu)) {
       /* Need to keep original token for updating response PDUs */
       lg_xmit->b.b1.app_token = coap_new_binary(pdu->token_length);
@@ -488,6 +575,8 @@ coap_add_data_large_internal(coap_session_t *session,
        * Need to set up new token for use during transmits
        */
       lg_xmit->b.b1.count = 1;
+      lg_xmit->b.b1.q_last = block.num;
+      lg_xmit->b.b1.q_retry = 0;
       token = ((++session->tx_token) & 0xffffffff) +
               ((uint64_t)lg_xmit->b.b1.count << 32);
       memset(lg_xmit->b.b1.token, 0, sizeof(lg_xmit->b.b1.token));
@@ -497,11 +586,11 @@ coap_add_data_large_internal(coap_session_t *session,
        * Token will be updated in pdu later as original pdu may be needed in
        * coap_send_large()
        */
-      coap_update_option(pdu,
-                         COAP_OPTION_SIZE1,
-                         coap_encode_var_safe(buf, sizeof(buf),
-                                              (unsigned int)length),
-                         buf);
+      coap_opt_stage_update(&stage,
+                            COAP_OPTION_SIZE1,
+                            coap_encode_var_safe(buf, sizeof(buf),
+                                                 (unsigned int)length),
+                            buf);
     }
     else {
       /*
@@ -509,6 +598,7 @@ coap_add_data_large_internal(coap_session_t *session,
        * token match is used for BLOCK1 large body transmissions
        */
       lg_xmit->b.b2.resource = resource;
+      lg_xmit->b.b2.generation = resource->generation;
       if (query) {
         lg_xmit->b.b2.query = coap_new_string(query->length);
         if (lg_xmit->b.b2.query) {
@@ -518,39 +608,50 @@ coap_add_data_large_internal(coap_session_t *session,
       else {
         lg_xmit->b.b2.query = NULL;
       }
+      /* A route serves many paths, so these have to be told apart too */
+      lg_xmit->b.b2.uri_path = resource->is_route && request ?
+                               coap_get_uri_path(request) : NULL;
       lg_xmit->b.b2.etag = etag;
+      lg_xmit->b.b2.q_next = lg_xmit->b.b2.q_end = 0;
       if (maxage >= 0) {
         coap_tick_t now;
 
-        coap_ticks(&now);
+        coap_io_ticks(session->context, &now);
         lg_xmit->b.b2.maxage_expire = coap_ticks_to_rt(now) + maxage;
       }
       else {
         lg_xmit->b.b2.maxage_expire = 0;
       }
-      coap_update_option(pdu,
-                         COAP_OPTION_SIZE2,
-                         coap_encode_var_safe(buf, sizeof(buf),
-                                              (unsigned int)length),
-                         buf);
+      coap_opt_stage_update(&stage,
+                            COAP_OPTION_SIZE2,
+                            coap_encode_var_safe(buf, sizeof(buf),
+                                                 (unsigned int)length),
+                            buf);
+      if (etag == 0 && resource &&
+          (resource->flags & COAP_RESOURCE_FLAGS_AUTO_ETAG)) {
+        /* Lets the client revalidate the whole body with this ETag */
+        etag = coap_resource_etag(resource);
+      }
       if (etag == 0) {
         if (++session->context->etag == 0)
           ++session->context->etag;
         etag = session->context->etag;
       }
-      coap_update_option(pdu,
-                         COAP_OPTION_ETAG,
-                         coap_encode_var_safe8(buf, sizeof(buf), etag),
-                         buf);
+      coap_opt_stage_update(&stage,
+                            COAP_OPTION_ETAG,
+                            coap_encode_var_safe8(buf, sizeof(buf), etag),
+                            buf);
     }
 
     /* Add in with requested block num, more bit and block size */
     block.m = ((block.num + 1) * chunk) < lg_xmit->length;
-    coap_update_option(pdu,
-                       lg_xmit->option,
-                       coap_encode_var_safe(buf, sizeof(buf),
-                        (block.num << 4) | (block.m << 3) | lg_xmit->blk_size),
-                       buf);
+    coap_opt_stage_update(&stage,
+                          lg_xmit->option,
+                          coap_encode_var_safe(buf, sizeof(buf),
+                           (block.num << 4) | (block.m << 3) |
+                           lg_xmit->blk_size),
+                          buf);
+    coap_add_opt_stage_pdu(pdu, &stage);
 
     /* Set up skeletal PDU to use as a basis for all the subsequent blocks */
     memcpy(&lg_xmit->pdu, pdu, sizeof(lg_xmit->pdu));
@@ -591,13 +692,23 @@ coap_add_data_large_internal(coap_session_t *session,
     rem = chunk;
     if (chunk > lg_xmit->length - block.num * chunk)
       rem = lg_xmit->length - block.num * chunk;
-    if (!coap_add_data(pdu, rem, &data[block.num * chunk]))
+    if (!coap_block_add_xmit_data(session, pdu, lg_xmit, block.num * chunk,
+                                  rem))
       goto fail;
 
     lg_xmit->last_block = -1;
 
+    if (option == COAP_OPTION_Q_BLOCK2) {
+      /* The rest of the first set follows once the response has gone */
+      lg_xmit->b.b2.q_next = block.num + 1;
+      lg_xmit->b.b2.q_end = (block.num / session->max_payloads + 1) *
+                            session->max_payloads;
+      lg_xmit->b.b2.q_token_length = pdu->token_length;
+      memcpy(lg_xmit->b.b2.q_token, pdu->token, pdu->token_length);
+    }
+
     /* Link the new lg_xmit in */
-    LL_PREPEND(session->lg_xmit,lg_xmit);
+    coap_block_add_lg_xmit(session, lg_xmit);
   }
   else {
     /* No need to use blocks */
@@ -608,7 +719,8 @@ coap_add_data_large_internal(coap_session_t *session,
                      (0 << 4) | (0 << 3) | blk_size), buf);
     }
 add_data:
-    if (!coap_add_data(pdu, length, data))
+    if (!coap_block_add_body_data(session, pdu, data, producer, app_ptr, 0,
+                                  length))
       goto fail;
 
     if (release_func)
@@ -618,6 +730,8 @@ add_data:
 
 fail:
   if (lg_xmit) {
+    /* release_func is called just below */
+    lg_xmit->release_func = NULL;
     coap_block_delete_lg_xmit(session, lg_xmit);
   }
   if (release_func)
@@ -632,25 +746,43 @@ coap_add_data_large_request(coap_session_t *session,
                             const uint8_t *data,
                             coap_release_large_data_t release_func,
                             void *app_ptr) {
-  return coap_add_data_large_internal(session, pdu, NULL, NULL, -1,
-                                 0, length, data, release_func, app_ptr);
+  return coap_add_data_large_internal(session, pdu, NULL, NULL, NULL, -1,
+                                 0, length, data, NULL, release_func, app_ptr);
 }
 
 int
-coap_add_data_large_response(coap_resource_t *resource,
-                             coap_session_t *session,
-                             coap_pdu_t *request,
-                             coap_pdu_t *response,
-                             const coap_binary_t *token,
-                             const coap_string_t *query,
-                             uint16_t media_type,
-                             int maxage,
-                             uint64_t etag,
-                             size_t length,
-                             const uint8_t *data,
-                             coap_release_large_data_t release_func,
-                             void *app_ptr
-) {
+coap_add_data_large_request_producer(coap_session_t *session,
+                                     coap_pdu_t *pdu,
+                                     size_t length,
+                                     coap_large_data_producer_t producer,
+                                     coap_release_large_data_t release_func,
+                                     void *app_ptr) {
+  assert(producer);
+  return coap_add_data_large_internal(session, pdu, NULL, NULL, NULL, -1,
+                                 0, length, NULL, producer, release_func,
+                                 app_ptr);
+}
+
+#ifndef COAP_WITHOUT_BLOCK2_LARGE
+/*
+ * The work of coap_add_data_large_response(), for a body that is either
+ * @p data or read by @p producer.
+ */
+static int
+coap_add_data_large_response_body(coap_resource_t *resource,
+                                  coap_session_t *session,
+                                  coap_pdu_t *request,
+                                  coap_pdu_t *response,
+                                  const coap_binary_t *token,
+                                  const coap_string_t *query,
+                                  uint16_t media_type,
+                                  int maxage,
+                                  uint64_t etag,
+                                  size_t length,
+                                  const uint8_t *data,
+                                  coap_large_data_producer_t producer,
+                                  coap_release_large_data_t release_func,
+                                  void *app_ptr) {
   unsigned char buf[4];
   coap_block_t block = { 0, 0, 0 };
   int block_requested = 0;
@@ -663,7 +795,12 @@ coap_add_data_large_response(coap_resource_t *resource,
    * correct options are put into the PDU.
    */
   if (request) {
-    if (coap_get_block(request, COAP_OPTION_BLOCK2, &block)) {
+    if (COAP_SESSION_Q_BLOCK(session) &&
+        coap_get_block(request, COAP_OPTION_Q_BLOCK2, &block)) {
+      block_opt = COAP_OPTION_Q_BLOCK2;
+    }
+    if (block_opt == COAP_OPTION_Q_BLOCK2 ||
+        coap_get_block(request, COAP_OPTION_BLOCK2, &block)) {
       block_requested = 1;
       if (block.num != 0 && length <= (block.num << (block.szx + 4))) {
         coap_log(LOG_DEBUG, "Illegal block requested (%d > last = %zu)\n",
@@ -719,9 +856,9 @@ coap_add_data_large_response(coap_resource_t *resource,
         ;
     }
 
-    if (!coap_add_data_large_internal(session, response, resource, query,
-                                      maxage, etag, length, data,
-                                      release_func, app_ptr)) {
+    if (!coap_add_data_large_internal(session, response, resource, request,
+                                      query, maxage, etag, length, data,
+                                      producer, release_func, app_ptr)) {
       response->code = COAP_RESPONSE_CODE(500);
       goto error;
     }
@@ -732,9 +869,9 @@ coap_add_data_large_response(coap_resource_t *resource,
   /*
    * BLOCK2 not requested
    */
-  if (!coap_add_data_large_internal(session, response, resource, query, maxage,
-                                    etag, length, data, release_func,
-                                    app_ptr)) {
+  if (!coap_add_data_large_internal(session, response, resource, request,
+                                    query, maxage, etag, length, data, producer,
+                                    release_func, app_ptr)) {
     response->code = COAP_RESPONSE_CODE(400);
     goto error;
   }
@@ -748,18 +885,442 @@ error:
   return 0;
 }
 
+int
+coap_add_data_large_response(coap_resource_t *resource,
+                             coap_session_t *session,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response,
+                             const coap_binary_t *token,
+                             const coap_string_t *query,
+                             uint16_t media_type,
+                             int maxage,
+                             uint64_t etag,
+                             size_t length,
+                             const uint8_t *data,
+                             coap_release_large_data_t release_func,
+                             void *app_ptr
+) {
+  return coap_add_data_large_response_body(resource, session, request,
+                                           response, token, query, media_type,
+                                           maxage, etag, length, data, NULL,
+                                           release_func, app_ptr);
+}
+
+int
+coap_add_data_large_response_producer(coap_resource_t *resource,
+                                      coap_session_t *session,
+                                      coap_pdu_t *request,
+                                      coap_pdu_t *response,
+                                      const coap_binary_t *token,
+                                      const coap_string_t *query,
+                                      uint16_t media_type,
+                                      int maxage,
+                                      uint64_t etag,
+                                      size_t length,
+                                      coap_large_data_producer_t producer,
+                                      coap_release_large_data_t release_func,
+                                      void *app_ptr) {
+  assert(producer);
+  return coap_add_data_large_response_body(resource, session, request,
+                                           response, token, query, media_type,
+                                           maxage, etag, length, NULL,
+                                           producer, release_func, app_ptr);
+}
+#else /* COAP_WITHOUT_BLOCK2_LARGE */
+/*
+ * The body is not kept, so the handler is called again for each block that
+ * is asked for and only that block is added.
+ */
+int
+coap_add_data_large_response(coap_resource_t *resource,
+                             coap_session_t *session,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response,
+                             const coap_binary_t *token,
+                             const coap_string_t *query,
+                             uint16_t media_type,
+                             int maxage,
+                             uint64_t etag,
+                             size_t length,
+                             const uint8_t *data,
+                             coap_release_large_data_t release_func,
+                             void *app_ptr
+) {
+  (void)query;
+  (void)etag;
+  coap_add_data_blocked_response(resource, session, request, response,
+                                 token, media_type, maxage, length, data);
+  if (release_func)
+    release_func(session, app_ptr);
+  return COAP_RESPONSE_CLASS(response->code) == 2;
+}
+
+int
+coap_add_data_large_response_producer(coap_resource_t *resource,
+                                      coap_session_t *session,
+                                      coap_pdu_t *request,
+                                      coap_pdu_t *response,
+                                      const coap_binary_t *token,
+                                      const coap_string_t *query,
+                                      uint16_t media_type,
+                                      int maxage,
+                                      uint64_t etag,
+                                      size_t length,
+                                      coap_large_data_producer_t producer,
+                                      coap_release_large_data_t release_func,
+                                      void *app_ptr) {
+  (void)resource;
+  (void)request;
+  (void)token;
+  (void)query;
+  (void)media_type;
+  (void)maxage;
+  (void)etag;
+  (void)length;
+  (void)producer;
+  coap_log(LOG_WARNING, "coap_add_data_large_response_producer: not "
+           "supported with COAP_WITHOUT_BLOCK2_LARGE\n");
+  response->code = COAP_RESPONSE_CODE(500);
+  if (release_func)
+    release_func(session, app_ptr);
+  return 0;
+}
+#endif /* COAP_WITHOUT_BLOCK2_LARGE */
+
+int
+coap_rblock_size(coap_rblock_t *rec_blocks, size_t count) {
+  uint32_t max_blocks = rec_blocks->max_blocks ? rec_blocks->max_blocks :
+                                                 COAP_RBLOCK_MAX_BLOCKS;
+  uint32_t words;
+  uint32_t *bitmap;
+
+  if (count > max_blocks)
+    return 0;
+  words = (uint32_t)((count + 31) / 32);
+  if (words <= rec_blocks->words)
+    return 1;
+  /* Double up so that a body of unknown size is not reallocated per block */
+  if (words < rec_blocks->words * 2)
+    words = rec_blocks->words * 2;
+  if (words > (max_blocks + 31) / 32)
+    words = (max_blocks + 31) / 32;
+  bitmap = coap_realloc_type(COAP_STRING, rec_blocks->bitmap,
+                             words * sizeof(uint32_t));
+  if (!bitmap)
+    return 0;
+  memset(&bitmap[rec_blocks->words], 0,
+         (words - rec_blocks->words) * sizeof(uint32_t));
+  rec_blocks->bitmap = bitmap;
+  rec_blocks->words = words;
+  return 1;
+}
+
+void
+coap_rblock_reset(coap_rblock_t *rec_blocks) {
+  if (rec_blocks->bitmap)
+    memset(rec_blocks->bitmap, 0, rec_blocks->words * sizeof(uint32_t));
+  rec_blocks->first_missing = 0;
+  rec_blocks->end = 0;
+}
+
+void
+coap_rblock_free(coap_rblock_t *rec_blocks) {
+  coap_free_type(COAP_STRING, rec_blocks->bitmap);
+  rec_blocks->bitmap = NULL;
+  rec_blocks->words = 0;
+}
+
+/*
+ * Returns the largest body that @p session puts together from blocks of
+ * @p block_option, or 0 if there is no limit.  Bodies that are passed on
+ * block by block or streamed are not held, so are not limited.
+ */
+static size_t
+coap_block_max_body(const coap_session_t *session, uint16_t block_option) {
+  if (block_option != COAP_OPTION_Q_BLOCK1 &&
+      (!(session->block_mode & COAP_BLOCK_SINGLE_BODY) ||
+       (session->block_mode & COAP_BLOCK_STREAM_BODY)))
+    return 0;
+  return session->context->max_body_size;
+}
+
+/*
+ * Returns the most blocks of 2^(@p szx + 4) bytes that a body of up to
+ * @p max_body bytes can have, or 0 if @p max_body is 0 for no limit.
+ */
+static uint32_t
+coap_block_max_blocks(size_t max_body, uint8_t szx) {
+  size_t blocks = (max_body >> (szx + 4)) +
+                  ((max_body & (((size_t)1 << (szx + 4)) - 1)) != 0);
+
+  return blocks < COAP_RBLOCK_MAX_BLOCKS ? (uint32_t)blocks :
+                                           COAP_RBLOCK_MAX_BLOCKS;
+}
+
+/*
+ * Returns the number of the lowest clear bit at or above @p num in
+ * @p rec_blocks, skipping over whole words of received blocks.
+ */
+static uint32_t
+coap_rblock_next_missing(const coap_rblock_t *rec_blocks, uint32_t num) {
+  uint32_t word = num / 32;
+  uint32_t bits;
+
+  if (word >= rec_blocks->words)
+    return num;
+  /* Treat the blocks below num in this word as received */
+  bits = rec_blocks->bitmap[word] | ((1U << (num & 31)) - 1);
+  while (bits == 0xffffffff) {
+    if (++word == rec_blocks->words)
+      return word * 32;
+    bits = rec_blocks->bitmap[word];
+  }
+#if defined(__GNUC__)
+  return word * 32 + (uint32_t)__builtin_ctz(~bits);
+#else /* ! __GNUC__ */
+  num = word * 32;
+  while (bits & 1) {
+    bits >>= 1;
+    num++;
+  }
+  return num;
+#endif /* ! __GNUC__ */
+}
+
+int
+coap_rblock_check(const coap_rblock_t *rec_blocks, uint32_t block_num) {
+  if (block_num < rec_blocks->first_missing)
+    return 1;
+  if (block_num >= rec_blocks->end)
+    return 0;
+  return (rec_blocks->bitmap[block_num / 32] >> (block_num & 31)) & 1;
+}
+
+static int
+check_all_blocks_in(coap_rblock_t *rec_blocks, size_t total_blocks) {
+  /* total_blocks counts from 1 */
+  return rec_blocks->first_missing >= total_blocks;
+}
+
+int
+coap_rblock_add(coap_rblock_t *rec_blocks, uint32_t block_num) {
+  if (!coap_rblock_size(rec_blocks, (size_t)block_num + 1))
+    /* Too many blocks */
+    return 0;
+  rec_blocks->bitmap[block_num / 32] |= 1U << (block_num & 31);
+  if (block_num >= rec_blocks->end)
+    rec_blocks->end = block_num + 1;
+  if (block_num == rec_blocks->first_missing)
+    rec_blocks->first_missing = coap_rblock_next_missing(rec_blocks,
+                                                         block_num);
+  return 1;
+}
+
+static int
+update_received_blocks(coap_session_t *session, coap_rblock_t *rec_blocks,
+                       uint32_t block_num) {
+  /* Reset as there is activity */
+  rec_blocks->retry = 0;
+
+  if (!coap_rblock_add(rec_blocks, block_num))
+    return 0;
+  coap_io_ticks(session->context, &rec_blocks->last_seen);
+  return 1;
+}
+
+uint32_t
+coap_block_find_missing(const coap_rblock_t *rec_blocks, uint32_t count,
+                        uint32_t *out, uint32_t max) {
+  uint32_t num = rec_blocks->first_missing;
+  uint32_t n = 0;
+
+  while (num < count && n < max) {
+    if (num < rec_blocks->end) {
+      num = coap_rblock_next_missing(rec_blocks, num);
+      if (num >= count)
+        break;
+    }
+    out[n++] = num++;
+  }
+  return n;
+}
+
+/*
+ * Encodes the block numbers in @p nums as the CBOR Sequence of unsigned
+ * integers of an application/missing-blocks+cbor-seq payload (RFC9177).
+ *
+ * Returns the length of the payload in @p buf.
+ */
+static size_t
+coap_block_encode_missing(const uint32_t *nums, uint32_t count, uint8_t *buf) {
+  uint8_t *p = buf;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (nums[i] < 24) {
+      *p++ = (uint8_t)nums[i];
+    }
+    else if (nums[i] < 0x100) {
+      *p++ = 0x18;
+      *p++ = (uint8_t)nums[i];
+    }
+    else if (nums[i] < 0x10000) {
+      *p++ = 0x19;
+      *p++ = (uint8_t)(nums[i] >> 8);
+      *p++ = (uint8_t)nums[i];
+    }
+    else {
+      *p++ = 0x1a;
+      *p++ = (uint8_t)(nums[i] >> 24);
+      *p++ = (uint8_t)(nums[i] >> 16);
+      *p++ = (uint8_t)(nums[i] >> 8);
+      *p++ = (uint8_t)nums[i];
+    }
+  }
+  return p - buf;
+}
+
+/*
+ * Decodes up to @p max block numbers from an
+ * application/missing-blocks+cbor-seq payload into @p nums, stopping at
+ * anything that is not an unsigned integer.
+ *
+ * Returns the number of block numbers decoded.
+ */
+static uint32_t
+coap_block_decode_missing(const uint8_t *data, size_t length, uint32_t *nums,
+                          uint32_t max) {
+  uint32_t count = 0;
+  size_t i = 0;
+
+  while (i < length && count < max) {
+    uint8_t info = data[i] & 0x1f;
+    size_t len;
+    uint32_t num;
+
+    if (data[i] >> 5 != 0 || info > 0x1a)
+      break;
+    len = info < 24 ? 0 : (size_t)1 << (info - 24);
+    if (i + 1 + len > length)
+      break;
+    if (len == 0) {
+      num = info;
+    }
+    else {
+      size_t j;
+
+      num = 0;
+      for (j = 1; j <= len; j++)
+        num = (num << 8) | data[i + j];
+    }
+    i += 1 + len;
+    nums[count++] = num;
+  }
+  return count;
+}
+
+/*
+ * Asks for blocks of the Q-Block2 body that @p lg_crcv is receiving.  The
+ * @p count blocks in @p missing are asked for one by one, followed by the
+ * set that starts at @p next if @p more.
+ *
+ * The token stays the same for the whole body as responses to the earlier
+ * requests may still be on their way.
+ *
+ * Returns 1 if the request has been sent, else 0.
+ */
+static int
+coap_block_request_q_block2(coap_session_t *session, coap_lg_crcv_t *lg_crcv,
+                            const uint32_t *missing, uint32_t count,
+                            int more, uint32_t next) {
+  coap_pdu_t *pdu;
+  uint8_t buf[4];
+  uint32_t i;
+
+  pdu = coap_pdu_duplicate(&lg_crcv->pdu, session, lg_crcv->token_length,
+                           lg_crcv->token, NULL);
+  if (!pdu)
+    return 0;
+  while (coap_remove_option(pdu, COAP_OPTION_Q_BLOCK2))
+    ;
+  /* Only sent with the first block */
+  coap_remove_option(pdu, COAP_OPTION_OBSERVE);
+
+  for (i = 0; i < count; i++) {
+    if (!coap_add_option(pdu, COAP_OPTION_Q_BLOCK2,
+                         coap_encode_var_safe(buf, sizeof(buf),
+                                          (missing[i] << 4) | lg_crcv->szx),
+                         buf))
+      /* The rest will be asked for later */
+      break;
+  }
+  if (more) {
+    coap_add_option(pdu, COAP_OPTION_Q_BLOCK2,
+                    coap_encode_var_safe(buf, sizeof(buf),
+                                     (next << 4) | (1 << 3) | lg_crcv->szx),
+                    buf);
+  }
+  return coap_send(session, pdu) != COAP_INVALID_MID;
+}
+
+/*
+ * Asks for the blocks of the Q-Block2 body that @p lg_crcv is receiving
+ * that are missing up to the highest block received so far, and for the
+ * next set if @p more.
+ */
+static int
+coap_block_request_q_block2_missing(coap_session_t *session,
+                                    coap_lg_crcv_t *lg_crcv, int more) {
+  uint32_t missing[COAP_MAX_PAYLOADS_LIMIT];
+  uint32_t count;
+  uint32_t next;
+
+  next = lg_crcv->rec_blocks.end;
+  count = coap_block_find_missing(&lg_crcv->rec_blocks, next, missing,
+                                  session->max_payloads);
+  if (count == session->max_payloads ||
+      ((size_t)next << (lg_crcv->szx + 4)) >= lg_crcv->total_len)
+    more = 0;
+  if (count == 0 && !more)
+    return 1;
+  return coap_block_request_q_block2(session, lg_crcv, missing, count,
+                                     more, next);
+}
+
 coap_tick_t
 coap_block_check_lg_crcv_timeouts(coap_session_t *session, coap_tick_t now) {
   coap_lg_crcv_t *p;
   coap_lg_crcv_t *q;
-  coap_tick_t partial_timeout = COAP_EXCHANGE_LIFETIME(session);
+  coap_tick_t partial_timeout = COAP_EXCHANGE_LIFETIME_TICKS(session);
+  coap_tick_t receive_timeout = COAP_NON_RECEIVE_TIMEOUT_TICKS(session);
   coap_tick_t tim_rem = -1;
 
   LL_FOREACH_SAFE(session->lg_crcv, p, q) {
+    if (p->block_option == COAP_OPTION_Q_BLOCK2 && !p->initial) {
+      /* Q-Block2 body still being received */
+      if (p->rec_blocks.last_seen + receive_timeout <= now) {
+        if (p->rec_blocks.retry >= COAP_NON_MAX_RETRANSMIT(session)) {
+          coap_log(LOG_DEBUG, "** %s: lg_crcv %p Q-Block2 blocks missing\n",
+                   coap_session_str(session), (void*)p);
+          COAP_COUNT(session, lg_timeouts, 1);
+          coap_handle_event(session->context, COAP_EVENT_PARTIAL_BLOCK,
+                            session);
+          coap_block_remove_lg_crcv(session, p);
+          coap_block_delete_lg_crcv(session, p);
+          continue;
+        }
+        p->rec_blocks.retry++;
+        p->rec_blocks.last_seen = now;
+        coap_block_request_q_block2_missing(session, p, 1);
+      }
+      if (tim_rem > p->rec_blocks.last_seen + receive_timeout - now)
+        tim_rem = p->rec_blocks.last_seen + receive_timeout - now;
+      continue;
+    }
     if (!p->observe_set && p->last_used &&
         p->last_used + partial_timeout <= now) {
       /* Expire this entry */
-      LL_DELETE(session->lg_crcv, p);
+      coap_block_remove_lg_crcv(session, p);
       coap_block_delete_lg_crcv(session, p);
     }
     else if (!p->observe_set && p->last_used) {
@@ -771,48 +1332,17 @@ coap_block_check_lg_crcv_timeouts(coap_session_t *session, coap_tick_t now) {
   return tim_rem;
 }
 
-static int
-check_if_received_block(coap_rblock_t *rec_blocks, uint32_t block_num) {
-  uint32_t i;
-
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block_num < rec_blocks->range[i].begin)
-      return 0;
-    if (block_num <= rec_blocks->range[i].end)
-      return 1;
-  }
-  return 0;
-}
-
-static int
-check_all_blocks_in(coap_rblock_t *rec_blocks, size_t total_blocks) {
-  uint32_t i;
-  uint32_t block = 0;
-
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block < rec_blocks->range[i].begin)
-      return 0;
-    if (block < rec_blocks->range[i].end)
-      block = rec_blocks->range[i].end;
-  }
-  /* total_blocks counts from 1 */
-  if (block + 1 < total_blocks)
-    return 0;
-
-  return 1;
-}
-
 coap_tick_t
 coap_block_check_lg_srcv_timeouts(coap_session_t *session, coap_tick_t now) {
   coap_lg_srcv_t *p;
   coap_lg_srcv_t *q;
-  coap_tick_t partial_timeout = COAP_EXCHANGE_LIFETIME(session);
+  coap_tick_t partial_timeout = COAP_EXCHANGE_LIFETIME_TICKS(session);
   coap_tick_t tim_rem = -1;
 
   LL_FOREACH_SAFE(session->lg_srcv, p, q) {
     if (p->last_used && p->last_used + partial_timeout <= now) {
       /* Expire this entry */
-      LL_DELETE(session->lg_srcv, p);
+      coap_block_remove_lg_srcv(session, p);
       coap_block_delete_lg_srcv(session, p);
     }
     else if (p->last_used) {
@@ -877,55 +1407,942 @@ coap_block_new_lg_crcv(coap_session_t *session, coap_pdu_t *pdu) {
 }
 
 void
-coap_block_delete_lg_crcv(coap_session_t *session,
-                               coap_lg_crcv_t *lg_crcv) {
-  if (lg_crcv == NULL)
-    return;
+coap_block_add_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  LL_PREPEND(session->lg_crcv, lg_crcv);
+  HASH_ADD_KEYPTR(hh, session->lg_crcv_token, lg_crcv->token,
+                  lg_crcv->token_length, lg_crcv);
+}
 
-  if (lg_crcv->pdu.token)
-    coap_free_type(COAP_PDU_BUF, lg_crcv->pdu.token - lg_crcv->pdu.hdr_size);
-  coap_free_type(COAP_STRING, lg_crcv->body_data);
-  coap_log(LOG_DEBUG, "** %s: lg_crcv %p released\n",
-           coap_session_str(session), (void*)lg_crcv);
-  coap_delete_binary(lg_crcv->app_token);
+void
+coap_block_remove_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  LL_DELETE(session->lg_crcv, lg_crcv);
+  HASH_DELETE(hh, session->lg_crcv_token, lg_crcv);
+}
+
+void
+coap_block_set_lg_crcv_token(coap_session_t *session, coap_lg_crcv_t *lg_crcv,
+                             const uint8_t *token, size_t length) {
+  /* the key is the token itself, so it has to be re-indexed */
+  HASH_DELETE(hh, session->lg_crcv_token, lg_crcv);
+  lg_crcv->token_length = min(length, sizeof(lg_crcv->token));
+  memcpy(lg_crcv->token, token, lg_crcv->token_length);
+  HASH_ADD_KEYPTR(hh, session->lg_crcv_token, lg_crcv->token,
+                  lg_crcv->token_length, lg_crcv);
+}
+
+/*
+ * Drops everything held for a streamed body and starts again at offset 0
+ */
+static void
+coap_block_stream_reset(coap_block_stream_t *stream) {
+  coap_block_pending_t *q, *tmp;
+
+  LL_FOREACH_SAFE(stream->pending, q, tmp) {
+    coap_free_type(COAP_STRING, q);
+  }
+  coap_delete_binary(stream->range);
+  memset(stream, 0, sizeof(*stream));
+}
+
+/*
+ * Adds the block of @p length bytes of @p data at @p offset to a streamed
+ * body.  On return of 1, @p data, @p length and @p offset are updated to
+ * the range of data that is now in order and is to be passed to the
+ * application.
+ *
+ * Return: 1 There is data to deliver
+ *         0 Nothing to deliver yet (or a duplicate)
+ *        -1 Too many blocks held back, or out of memory
+ */
+static int
+coap_block_stream_add(coap_block_stream_t *stream, const uint8_t **data,
+                      size_t *length, size_t *offset, int last) {
+  size_t end = *offset + *length;
+  size_t range_end;
+  size_t at;
+  coap_block_pending_t *q, **pp;
+
+  coap_delete_binary(stream->range);
+  stream->range = NULL;
+
+  if (end < stream->offset || (end == stream->offset && *length))
+    /* Already delivered */
+    return 0;
+  if (last) {
+    stream->end = end;
+    stream->end_set = 1;
+  }
+  if (*offset > stream->offset) {
+    /* Out of order - hold on to it until the gap has been filled */
+    for (pp = &stream->pending; *pp && (*pp)->offset < *offset;
+         pp = &(*pp)->next)
+      ;
+    if (*pp && (*pp)->offset == *offset)
+      return 0;
+    if (stream->count >= COAP_BLOCK_STREAM_WINDOW)
+      return -1;
+    q = coap_malloc_type(COAP_STRING, sizeof(coap_block_pending_t) + *length);
+    if (!q)
+      return -1;
+    q->offset = *offset;
+    q->length = *length;
+    memcpy(q->data, *data, *length);
+    q->next = *pp;
+    *pp = q;
+    stream->count++;
+    return 0;
+  }
+
+  /* Skip anything that has already been delivered */
+  *data += stream->offset - *offset;
+  *length = end - stream->offset;
+  *offset = stream->offset;
+
+  if (stream->pending && stream->pending->offset <= end) {
+    /* Join up with the blocks that were waiting for this one */
+    range_end = end;
+    for (q = stream->pending; q && q->offset <= range_end; q = q->next) {
+      if (q->offset + q->length > range_end)
+        range_end = q->offset + q->length;
+    }
+    stream->range = coap_new_binary(range_end - *offset);
+    if (!stream->range)
+      return -1;
+    memcpy(stream->range->s, *data, *length);
+    at = end;
+    while ((q = stream->pending) && q->offset <= range_end) {
+      if (q->offset + q->length > at) {
+        memcpy(&stream->range->s[at - *offset], &q->data[at - q->offset],
+               q->offset + q->length - at);
+        at = q->offset + q->length;
+      }
+      stream->pending = q->next;
+      stream->count--;
+      coap_free_type(COAP_STRING, q);
+    }
+    *data = stream->range->s;
+    *length = range_end - *offset;
+  }
+  stream->offset = *offset + *length;
+  return 1;
+}
+
+/*
+ * Set once all of a streamed body has been delivered
+ */
+#define COAP_BLOCK_STREAM_DONE(stream) \
+  ((stream)->end_set && (stream)->offset >= (stream)->end)
+
+/*
+ * Saves what has arrived of a Block2 body that has got part of the way, so
+ * that a new session can carry on from the first missing block.
+ */
+static void
+coap_block_save_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  coap_block_resume_t state;
+  coap_binary_t body;
+
+  if (!session->context->block_resume_dir || lg_crcv->initial ||
+      !lg_crcv->etag_set || !lg_crcv->body_data || lg_crcv->observe_set ||
+      lg_crcv->block_option != COAP_OPTION_BLOCK2 ||
+      (session->block_mode & COAP_BLOCK_STREAM_BODY) ||
+      lg_crcv->rec_blocks.first_missing == 0)
+    return;
+  memset(&state, 0, sizeof(state));
+  state.key = coap_block_resume_crcv_key(session, &lg_crcv->pdu);
+  if (!state.key)
+    return;
+  /* Nothing after the highest block received is worth keeping */
+  body.s = lg_crcv->body_data->s;
+  body.length = min(lg_crcv->body_data->length,
+                    (size_t)lg_crcv->rec_blocks.end << (lg_crcv->szx + 4));
+  state.total_len = lg_crcv->total_len;
+  state.bitmap = lg_crcv->rec_blocks.bitmap;
+  state.words = lg_crcv->rec_blocks.words;
+  state.first_missing = lg_crcv->rec_blocks.first_missing;
+  state.end = lg_crcv->rec_blocks.end;
+  state.body_data = &body;
+  state.content_format = lg_crcv->content_format;
+  state.szx = lg_crcv->szx;
+  state.etag_length = lg_crcv->etag_length;
+  memcpy(state.etag, lg_crcv->etag, lg_crcv->etag_length);
+  coap_block_resume_save(session->context, &state);
+}
+
+/*
+ * Removes anything saved of the body of @p lg_crcv, as it has all arrived
+ * or is no longer the same.
+ */
+static void
+coap_block_forget_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv) {
+  if (session->context->block_resume_dir &&
+      lg_crcv->block_option == COAP_OPTION_BLOCK2)
+    coap_block_resume_forget(session->context,
+                             coap_block_resume_crcv_key(session,
+                                                        &lg_crcv->pdu));
+}
+
+void
+coap_block_resume_lg_crcv(coap_session_t *session, coap_lg_crcv_t *lg_crcv,
+                          coap_pdu_t *pdu, uint64_t key) {
+  coap_block_resume_t state;
+  uint8_t buf[4];
+
+  if (!coap_block_resume_load(session->context, key, &state))
+    return;
+  coap_rblock_free(&lg_crcv->rec_blocks);
+  lg_crcv->rec_blocks.max_blocks =
+    coap_block_max_blocks(coap_block_max_body(session, COAP_OPTION_BLOCK2),
+                          state.szx);
+  lg_crcv->rec_blocks.bitmap = state.bitmap;
+  lg_crcv->rec_blocks.words = state.words;
+  lg_crcv->rec_blocks.first_missing = state.first_missing;
+  lg_crcv->rec_blocks.end = state.end;
+  coap_io_ticks(session->context, &lg_crcv->rec_blocks.last_seen);
+  lg_crcv->body_data = state.body_data;
+  lg_crcv->total_len = state.total_len;
+  lg_crcv->content_format = state.content_format;
+  lg_crcv->szx = state.szx;
+  lg_crcv->etag_length = state.etag_length;
+  memcpy(lg_crcv->etag, state.etag, state.etag_length);
+  lg_crcv->etag_set = 1;
+  lg_crcv->block_option = COAP_OPTION_BLOCK2;
+  lg_crcv->last_type = pdu->type;
+  lg_crcv->initial = 0;
+  coap_log(LOG_INFO, "** %s: large body resumed at block %u\n",
+           coap_session_str(session), state.first_missing);
+  coap_update_option(pdu, COAP_OPTION_BLOCK2,
+                     coap_encode_var_safe(buf, sizeof(buf),
+                                          (state.first_missing << 4) |
+                                          state.szx),
+                     buf);
+}
+
+void
+coap_block_delete_lg_crcv(coap_session_t *session,
+                               coap_lg_crcv_t *lg_crcv) {
+  if (lg_crcv == NULL)
+    return;
+
+  coap_block_save_lg_crcv(session, lg_crcv);
+  if (lg_crcv->pdu.token)
+    coap_free_type(COAP_PDU_BUF, lg_crcv->pdu.token - lg_crcv->pdu.hdr_size);
+  coap_free_type(COAP_STRING, lg_crcv->body_data);
+  coap_rblock_free(&lg_crcv->rec_blocks);
+  coap_block_stream_reset(&lg_crcv->stream);
+  coap_log(LOG_DEBUG, "** %s: lg_crcv %p released\n",
+           coap_session_str(session), (void*)lg_crcv);
+  coap_delete_binary(lg_crcv->app_token);
   coap_free_type(COAP_LG_CRCV, lg_crcv);
 }
 
+/*
+ * Finds the lg_srcv that is receiving a body for @p resource, or for
+ * @p uri_path if the request is for the unknown or proxy resource.
+ */
+static coap_lg_srcv_t *
+coap_block_find_lg_srcv(coap_context_t *context, coap_session_t *session,
+                        coap_resource_t *resource, coap_string_t *uri_path) {
+  coap_lg_srcv_t *lg_srcv;
+
+  if (resource == context->unknown_resource ||
+      resource == context->proxy_uri_resource || resource->is_route) {
+    if (!uri_path)
+      return NULL;
+    HASH_FIND(hh, session->lg_srcv_path, uri_path->s, uri_path->length,
+              lg_srcv);
+  }
+  else {
+    HASH_FIND(hh, session->lg_srcv_resource, &resource, sizeof(resource),
+              lg_srcv);
+  }
+  return lg_srcv;
+}
+
+static void
+coap_block_add_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  LL_PREPEND(session->lg_srcv, lg_srcv);
+  if (lg_srcv->uri_path)
+    HASH_ADD_KEYPTR(hh, session->lg_srcv_path, lg_srcv->uri_path->s,
+                    lg_srcv->uri_path->length, lg_srcv);
+  else
+    HASH_ADD_KEYPTR(hh, session->lg_srcv_resource, &lg_srcv->resource,
+                    sizeof(lg_srcv->resource), lg_srcv);
+}
+
+void
+coap_block_remove_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  LL_DELETE(session->lg_srcv, lg_srcv);
+  if (lg_srcv->uri_path)
+    HASH_DELETE(hh, session->lg_srcv_path, lg_srcv);
+  else
+    HASH_DELETE(hh, session->lg_srcv_resource, lg_srcv);
+}
+
+/*
+ * Saves what has arrived of a Block1 body that has got part of the way, so
+ * that the client can carry on from the first missing block on a new
+ * session.
+ */
+static void
+coap_block_save_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv) {
+  coap_block_resume_t state;
+  coap_binary_t body;
+  size_t chunk = (size_t)1 << (lg_srcv->szx + 4);
+
+  if (!lg_srcv->resume_key || !session->context->block_resume_dir ||
+      !lg_srcv->body_data || lg_srcv->rec_blocks.first_missing == 0 ||
+      check_all_blocks_in(&lg_srcv->rec_blocks,
+                          (lg_srcv->total_len + chunk - 1) / chunk))
+    return;
+  memset(&state, 0, sizeof(state));
+  body.s = lg_srcv->body_data->s;
+  body.length = min(lg_srcv->body_data->length,
+                    lg_srcv->rec_blocks.end * chunk);
+  state.key = lg_srcv->resume_key;
+  state.total_len = lg_srcv->total_len;
+  state.bitmap = lg_srcv->rec_blocks.bitmap;
+  state.words = lg_srcv->rec_blocks.words;
+  state.first_missing = lg_srcv->rec_blocks.first_missing;
+  state.end = lg_srcv->rec_blocks.end;
+  state.body_data = &body;
+  state.content_format = lg_srcv->content_format;
+  state.szx = lg_srcv->szx;
+  coap_block_resume_save(session->context, &state);
+}
+
+/*
+ * Picks up what was saved of the Block1 body that @p lg_srcv has just been
+ * set up for, provided that the first block of @p length bytes at @p data
+ * is the same as what was saved.
+ */
+static void
+coap_block_resume_lg_srcv(coap_session_t *session, coap_lg_srcv_t *lg_srcv,
+                          size_t length, const uint8_t *data) {
+  coap_block_resume_t state;
+
+  if (!coap_block_resume_load(session->context, lg_srcv->resume_key, &state))
+    return;
+  if (state.total_len != lg_srcv->total_len || state.szx != lg_srcv->szx ||
+      state.content_format != lg_srcv->content_format ||
+      length > state.body_data->length ||
+      memcmp(state.body_data->s, data, length) != 0) {
+    /* A different body, so start again */
+    coap_log(LOG_DEBUG, "** %s: saved large body does not match\n",
+             coap_session_str(session));
+    coap_free_type(COAP_STRING, state.bitmap);
+    coap_delete_binary(state.body_data);
+    coap_block_resume_forget(session->context, lg_srcv->resume_key);
+    return;
+  }
+  coap_rblock_free(&lg_srcv->rec_blocks);
+  lg_srcv->rec_blocks.bitmap = state.bitmap;
+  lg_srcv->rec_blocks.words = state.words;
+  lg_srcv->rec_blocks.first_missing = state.first_missing;
+  lg_srcv->rec_blocks.end = state.end;
+  coap_io_ticks(session->context, &lg_srcv->rec_blocks.last_seen);
+  lg_srcv->body_data = state.body_data;
+  coap_log(LOG_INFO, "** %s: large body resumed at block %u\n",
+           coap_session_str(session), state.first_missing);
+}
+
+void
+coap_block_delete_lg_srcv(coap_session_t *session,
+                               coap_lg_srcv_t *lg_srcv) {
+  if (lg_srcv == NULL)
+    return;
+
+  coap_block_save_lg_srcv(session, lg_srcv);
+  coap_delete_str_const(lg_srcv->uri_path);
+  coap_free_type(COAP_STRING, lg_srcv->body_data);
+  coap_rblock_free(&lg_srcv->rec_blocks);
+  coap_block_stream_reset(&lg_srcv->stream);
+  coap_log(LOG_DEBUG, "** %s: lg_srcv %p released\n",
+         coap_session_str(session), (void*)lg_srcv);
+  coap_free_type(COAP_LG_SRCV, lg_srcv);
+}
+
+void
+coap_block_delete_lg_xmit(coap_session_t *session,
+                               coap_lg_xmit_t *lg_xmit) {
+  if (lg_xmit == NULL)
+    return;
+
+  COAP_PROBE_BLOCK(block_done, session, lg_xmit);
+  if (lg_xmit->release_func) {
+    lg_xmit->release_func(session, lg_xmit->app_ptr);
+  }
+  coap_free_type(COAP_STRING, lg_xmit->window);
+  if (lg_xmit->pdu.token) {
+    coap_free_type(COAP_PDU_BUF, lg_xmit->pdu.token - lg_xmit->pdu.hdr_size);
+  }
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu))
+    coap_delete_binary(lg_xmit->b.b1.app_token);
+  else {
+    coap_delete_string(lg_xmit->b.b2.query);
+    coap_delete_string(lg_xmit->b.b2.uri_path);
+  }
+
+  coap_log(LOG_DEBUG, "** %s: lg_xmit %p released\n",
+           coap_session_str(session), (void*)lg_xmit);
+  coap_free_type(COAP_LG_XMIT, lg_xmit);
+}
+
+static void
+coap_block_release_shared_body(coap_session_t *session, void *app_ptr) {
+  (void)session;
+  coap_block_release_xmit_body((coap_lg_xmit_body_t *)app_ptr);
+}
+
+void
+coap_block_release_xmit_body(coap_lg_xmit_body_t *body) {
+  if (--body->ref == 0) {
+    if (body->release_func)
+      body->release_func(body->session, body->app_ptr);
+    coap_free_type(COAP_STRING, body);
+  }
+}
+
+coap_large_body_t *
+coap_resource_add_large_body(coap_resource_t *resource, uint64_t etag,
+                             size_t length, const uint8_t *data,
+                             coap_release_large_data_t release_func,
+                             void *app_ptr) {
+  coap_lg_xmit_body_t *body;
+
+  assert(resource);
+  body = coap_malloc_type(COAP_STRING, sizeof(coap_lg_xmit_body_t));
+  if (!body) {
+    if (release_func)
+      release_func(NULL, app_ptr);
+    return NULL;
+  }
+  memset(body, 0, sizeof(coap_lg_xmit_body_t));
+  /* This reference belongs to the resource */
+  body->ref = 1;
+  body->release_func = release_func;
+  body->app_ptr = app_ptr;
+  body->resource = resource;
+  body->registered = 1;
+  body->etag = etag;
+  body->data = data;
+  body->length = length;
+
+  /* Any body already registered with this ETag is superseded */
+  coap_resource_remove_large_body(resource,
+                               coap_resource_find_large_body(resource, etag));
+  LL_PREPEND(resource->large_bodies, body);
+  return body;
+}
+
+coap_large_body_t *
+coap_resource_find_large_body(coap_resource_t *resource, uint64_t etag) {
+  coap_lg_xmit_body_t *body;
+
+  LL_FOREACH(resource->large_bodies, body) {
+    if (body->etag == etag)
+      break;
+  }
+  return body;
+}
+
+void
+coap_resource_remove_large_body(coap_resource_t *resource,
+                                coap_large_body_t *body) {
+  if (!body || body->resource != resource)
+    return;
+  LL_DELETE(resource->large_bodies, body);
+  body->resource = NULL;
+  coap_block_release_xmit_body(body);
+}
+
+void
+coap_block_delete_large_bodies(coap_resource_t *resource) {
+  coap_lg_xmit_body_t *body, *tmp;
+
+  LL_FOREACH_SAFE(resource->large_bodies, body, tmp) {
+    coap_resource_remove_large_body(resource, body);
+  }
+}
+
+int
+coap_add_large_body_response(coap_resource_t *resource,
+                             coap_session_t *session,
+                             coap_pdu_t *request,
+                             coap_pdu_t *response,
+                             const coap_binary_t *token,
+                             const coap_string_t *query,
+                             uint16_t media_type,
+                             int maxage,
+                             coap_large_body_t *body) {
+  assert(body);
+  /* Dropped by coap_block_release_shared_body() */
+  body->ref++;
+  return coap_add_data_large_response(resource, session, request, response,
+                                      token, query, media_type, maxage,
+                                      body->etag, body->length, body->data,
+                                      coap_block_release_shared_body, body);
+}
+
+/*
+ * Puts the application's body of @p lg_xmit behind a reference counted
+ * coap_lg_xmit_body_t so that PDUs can hold on to it.
+ */
+static coap_lg_xmit_body_t *
+coap_block_share_body(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  coap_lg_xmit_body_t *body;
+
+  if (lg_xmit->release_func == coap_block_release_shared_body)
+    return (coap_lg_xmit_body_t *)lg_xmit->app_ptr;
+
+  body = coap_malloc_type(COAP_STRING, sizeof(coap_lg_xmit_body_t));
+  if (!body)
+    return NULL;
+  memset(body, 0, sizeof(coap_lg_xmit_body_t));
+  body->ref = 1;
+  body->session = session;
+  body->release_func = lg_xmit->release_func;
+  body->app_ptr = lg_xmit->app_ptr;
+  lg_xmit->release_func = coap_block_release_shared_body;
+  lg_xmit->app_ptr = body;
+  return body;
+}
+
+/*
+ * Returns the @p len bytes at @p offset of the body that the producer of
+ * @p lg_xmit reads, reading them (and the blocks that follow them) into
+ * the window if they are not there already.
+ *
+ * Returns NULL if the producer fails or memory cannot be allocated.
+ */
+static const uint8_t *
+coap_block_produce(coap_session_t *session, coap_lg_xmit_t *lg_xmit,
+                   size_t offset, size_t len) {
+  size_t want = len * COAP_BLOCK_PRODUCER_READAHEAD;
+
+  if (offset >= lg_xmit->window_offset &&
+      offset + len <= lg_xmit->window_offset + lg_xmit->window_length)
+    return lg_xmit->window + (offset - lg_xmit->window_offset);
+
+  if (want < len)
+    want = len;
+  if (want > lg_xmit->length - offset)
+    want = lg_xmit->length - offset;
+  if (want > lg_xmit->window_size) {
+    uint8_t *window = coap_realloc_type(COAP_STRING, lg_xmit->window, want);
+
+    if (!window)
+      return NULL;
+    lg_xmit->window = window;
+    lg_xmit->window_size = want;
+  }
+  lg_xmit->window_length = 0;
+  if (!lg_xmit->producer(session, offset, want, lg_xmit->window,
+                         lg_xmit->app_ptr)) {
+    coap_log(LOG_DEBUG, "** %s: producer failed at offset %zu\n",
+             coap_session_str(session), offset);
+    return NULL;
+  }
+  lg_xmit->window_offset = offset;
+  lg_xmit->window_length = want;
+  return lg_xmit->window;
+}
+
+int
+coap_block_add_xmit_data(coap_session_t *session, coap_pdu_t *pdu,
+                         coap_lg_xmit_t *lg_xmit, size_t offset, size_t len) {
+  coap_lg_xmit_body_t *body;
+
+  assert(offset + len <= lg_xmit->length);
+  if (len == 0)
+    return 1;
+  if (lg_xmit->producer) {
+    /* The window is reused, so cannot be sent from directly */
+    const uint8_t *data = coap_block_produce(session, lg_xmit, offset, len);
+
+    return data && coap_add_data(pdu, len, data);
+  }
+  if (!coap_session_can_sendv(session) || pdu->data ||
+      !coap_pdu_resize(pdu, pdu->used_size + 1) ||
+      (body = coap_block_share_body(session, lg_xmit)) == NULL)
+    return coap_add_data(pdu, len, lg_xmit->data + offset);
+
+  pdu->token[pdu->used_size++] = COAP_PAYLOAD_START;
+  pdu->data = pdu->token + pdu->used_size;
+  pdu->xmit_data = lg_xmit->data + offset;
+  pdu->xmit_length = len;
+  pdu->xmit_body = body;
+  body->ref++;
+  return 1;
+}
+
+coap_lg_xmit_t *
+coap_block_copy_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  coap_lg_xmit_body_t *body;
+  coap_lg_xmit_t *copy;
+  uint8_t *buf;
+
+  assert(!COAP_PDU_IS_REQUEST(&lg_xmit->pdu));
+
+  /* A body that is produced is not held in memory to be shared */
+  if (lg_xmit->producer)
+    return NULL;
+
+  body = lg_xmit->release_func == coap_block_release_shared_body ?
+         (coap_lg_xmit_body_t *)lg_xmit->app_ptr : NULL;
+  if (!body || (body->release_func && !body->registered)) {
+    /* Take over the body so that it no longer depends on the application */
+    body = coap_malloc_type(COAP_STRING,
+                            sizeof(coap_lg_xmit_body_t) + lg_xmit->length);
+    if (!body)
+      return NULL;
+    memset(body, 0, sizeof(coap_lg_xmit_body_t));
+    body->ref = 1;
+    memcpy(body + 1, lg_xmit->data, lg_xmit->length);
+    if (lg_xmit->release_func)
+      lg_xmit->release_func(session, lg_xmit->app_ptr);
+    lg_xmit->data = (const uint8_t *)(body + 1);
+    lg_xmit->release_func = coap_block_release_shared_body;
+    lg_xmit->app_ptr = body;
+  }
+  body = (coap_lg_xmit_body_t *)lg_xmit->app_ptr;
+
+  copy = coap_malloc_type(COAP_LG_XMIT, sizeof(coap_lg_xmit_t));
+  if (!copy)
+    return NULL;
+  memcpy(copy, lg_xmit, sizeof(coap_lg_xmit_t));
+  copy->next = NULL;
+  copy->offset = 0;
+  copy->last_block = -1;
+  copy->last_payload = 0;
+  copy->last_used = 0;
+  copy->next_query = NULL;
+  copy->b.b2.query = NULL;
+  copy->b.b2.uri_path = NULL;
+
+  buf = coap_malloc_type(COAP_PDU_BUF, lg_xmit->pdu.alloc_size);
+  if (!buf) {
+    coap_free_type(COAP_LG_XMIT, copy);
+    return NULL;
+  }
+  copy->pdu.token = buf + lg_xmit->pdu.hdr_size;
+  memcpy(copy->pdu.token, lg_xmit->pdu.token, lg_xmit->pdu.used_size);
+  if (lg_xmit->pdu.data)
+    copy->pdu.data = copy->pdu.token + (lg_xmit->pdu.data - lg_xmit->pdu.token);
+  body->ref++;
+
+  if (lg_xmit->b.b2.query) {
+    copy->b.b2.query = coap_new_string(lg_xmit->b.b2.query->length);
+    if (!copy->b.b2.query) {
+      coap_block_delete_lg_xmit(session, copy);
+      return NULL;
+    }
+    memcpy(copy->b.b2.query->s, lg_xmit->b.b2.query->s,
+           lg_xmit->b.b2.query->length);
+  }
+  if (lg_xmit->b.b2.uri_path) {
+    copy->b.b2.uri_path = coap_new_string(lg_xmit->b.b2.uri_path->length);
+    if (!copy->b.b2.uri_path) {
+      coap_block_delete_lg_xmit(session, copy);
+      return NULL;
+    }
+    memcpy(copy->b.b2.uri_path->s, lg_xmit->b.b2.uri_path->s,
+           lg_xmit->b.b2.uri_path->length);
+  }
+  return copy;
+}
+
+/*
+ * The key a BLOCK1 lg_xmit is indexed on is the lower 32 bits of its token,
+ * as the upper 32 bits change with every block sent.
+ */
+#define LG_XMIT_TOKEN_KEY_LEN 4
+
+coap_lg_xmit_t *
+coap_block_find_lg_xmit_response(coap_session_t *session,
+                                 coap_resource_t *resource,
+                                 const coap_pdu_t *request,
+                                 const coap_string_t *query) {
+  coap_lg_xmit_t *lg_xmit;
+  coap_string_t empty = { 0, NULL};
+
+  /* These are indexed on resource, then chained by query (and path) */
+  HASH_FIND(hh, session->lg_xmit_resource, &resource, sizeof(resource),
+            lg_xmit);
+  for (; lg_xmit; lg_xmit = lg_xmit->next_query) {
+    if (coap_string_equal(query ? query : &empty,
+                   lg_xmit->b.b2.query ? lg_xmit->b.b2.query : &empty)) {
+      coap_string_t *uri_path = lg_xmit->b.b2.uri_path;
+      coap_str_const_t path;
+
+      if (!uri_path || !request)
+        break;
+      path.length = uri_path->length;
+      path.s = uri_path->s;
+      if (coap_uri_path_equal(request, &path))
+        break;
+    }
+  }
+  return lg_xmit;
+}
+
+static coap_lg_xmit_t *
+coap_block_find_lg_xmit_request(coap_session_t *session,
+                                const uint8_t *token, size_t length) {
+  coap_lg_xmit_t *lg_xmit;
+
+  /* BLOCK1 tokens are always at least 5 bytes long */
+  if (length < LG_XMIT_TOKEN_KEY_LEN)
+    return NULL;
+  HASH_FIND(hh, session->lg_xmit_token,
+            token + length - LG_XMIT_TOKEN_KEY_LEN, LG_XMIT_TOKEN_KEY_LEN,
+            lg_xmit);
+  return lg_xmit;
+}
+
+void
+coap_block_add_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  coap_lg_xmit_t *head;
+
+  lg_xmit->next_query = NULL;
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu)) {
+    assert(lg_xmit->b.b1.token_length >= LG_XMIT_TOKEN_KEY_LEN);
+    HASH_ADD_KEYPTR(hh, session->lg_xmit_token,
+                    lg_xmit->b.b1.token + lg_xmit->b.b1.token_length -
+                    LG_XMIT_TOKEN_KEY_LEN, LG_XMIT_TOKEN_KEY_LEN, lg_xmit);
+  }
+  else {
+    coap_string_t empty = { 0, NULL };
+    coap_string_t *query = lg_xmit->b.b2.query ? lg_xmit->b.b2.query : &empty;
+    coap_string_t *path = lg_xmit->b.b2.uri_path ? lg_xmit->b.b2.uri_path :
+                                                   &empty;
+
+    /* Any previous large body for this resource+query(+path) is superseded */
+    HASH_FIND(hh, session->lg_xmit_resource, &lg_xmit->b.b2.resource,
+              sizeof(lg_xmit->b.b2.resource), head);
+    for (; head; head = head->next_query) {
+      if (coap_string_equal(query, head->b.b2.query ? head->b.b2.query :
+                                                      &empty) &&
+          coap_string_equal(path, head->b.b2.uri_path ? head->b.b2.uri_path :
+                                                        &empty))
+        break;
+    }
+    if (head) {
+      coap_block_remove_lg_xmit(session, head);
+      coap_block_delete_lg_xmit(session, head);
+    }
+    HASH_FIND(hh, session->lg_xmit_resource, &lg_xmit->b.b2.resource,
+              sizeof(lg_xmit->b.b2.resource), head);
+    if (head) {
+      /* Other queries of the same resource hang off the indexed one */
+      lg_xmit->next_query = head->next_query;
+      head->next_query = lg_xmit;
+    }
+    else {
+      HASH_ADD_KEYPTR(hh, session->lg_xmit_resource, &lg_xmit->b.b2.resource,
+                      sizeof(lg_xmit->b.b2.resource), lg_xmit);
+    }
+  }
+  LL_PREPEND(session->lg_xmit, lg_xmit);
+  COAP_PROBE_BLOCK(block_start, session, lg_xmit);
+}
+
+void
+coap_block_remove_lg_xmit(coap_session_t *session, coap_lg_xmit_t *lg_xmit) {
+  coap_lg_xmit_t *head;
+
+  LL_DELETE(session->lg_xmit, lg_xmit);
+  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu)) {
+    HASH_DELETE(hh, session->lg_xmit_token, lg_xmit);
+    return;
+  }
+  HASH_FIND(hh, session->lg_xmit_resource, &lg_xmit->b.b2.resource,
+            sizeof(lg_xmit->b.b2.resource), head);
+  if (head == lg_xmit) {
+    HASH_DELETE(hh, session->lg_xmit_resource, lg_xmit);
+    if (lg_xmit->next_query)
+      HASH_ADD_KEYPTR(hh, session->lg_xmit_resource,
+                      &lg_xmit->next_query->b.b2.resource,
+                      sizeof(lg_xmit->next_query->b.b2.resource),
+                      lg_xmit->next_query);
+  }
+  else if (head) {
+    while (head->next_query && head->next_query != lg_xmit)
+      head = head->next_query;
+    if (head->next_query)
+      head->next_query = lg_xmit->next_query;
+  }
+  lg_xmit->next_query = NULL;
+}
+
+/*
+ * Sends block @p num of the Q-Block1 @p lg_xmit as a request of @p type
+ *
+ * Returns 1 if sent, else 0.
+ */
+static int
+coap_block_send_q_block1(coap_session_t *session, coap_lg_xmit_t *lg_xmit,
+                         uint32_t num, uint8_t type) {
+  size_t chunk = (size_t)1 << (lg_xmit->blk_size + 4);
+  uint64_t token = coap_decode_var_bytes8(lg_xmit->b.b1.token,
+                                          lg_xmit->b.b1.token_length);
+  uint8_t ltoken[8];
+  size_t ltoken_length;
+  uint8_t buf[8];
+  coap_pdu_t *pdu;
+
+  token = (token & 0xffffffff) + ((uint64_t)(++lg_xmit->b.b1.count) << 32);
+  ltoken_length = coap_encode_var_safe8(ltoken, sizeof(token), token);
+  pdu = coap_pdu_duplicate(&lg_xmit->pdu, session, ltoken_length, ltoken,
+                           NULL);
+  if (!pdu)
+    return 0;
+  pdu->type = type;
+  coap_update_option(pdu, lg_xmit->option,
+                     coap_encode_var_safe(buf, sizeof(buf),
+                       (num << 4) |
+                       (((num + 1) * chunk < lg_xmit->length) << 3) |
+                       lg_xmit->blk_size),
+                     buf);
+  if (!coap_block_add_xmit_block(session, pdu, lg_xmit, num,
+                                 lg_xmit->blk_size)) {
+    coap_delete_pdu(pdu);
+    return 0;
+  }
+  if (num > lg_xmit->b.b1.q_last)
+    lg_xmit->b.b1.q_last = num;
+  return coap_send(session, pdu) != COAP_INVALID_MID;
+}
+
+int
+coap_block_send_q_block1_set(coap_session_t *session, coap_lg_xmit_t *lg_xmit,
+                             uint32_t num) {
+  size_t chunk = (size_t)1 << (lg_xmit->blk_size + 4);
+  uint32_t end = (num / session->max_payloads + 1) * session->max_payloads;
+
+  for (; num < end && num * chunk < lg_xmit->length; num++) {
+    if (!coap_block_send_q_block1(session, lg_xmit, num, COAP_MESSAGE_NON))
+      return 0;
+  }
+  /* The server should respond to the last block of the set */
+  coap_io_ticks(session->context, &lg_xmit->last_payload);
+  coap_session_timer_arm(session, lg_xmit->last_payload +
+                                  COAP_NON_TIMEOUT_TICKS(session));
+  return 1;
+}
+
+coap_tick_t
+coap_block_check_lg_xmit_timeouts(coap_session_t *session, coap_tick_t now) {
+  coap_lg_xmit_t *p;
+  coap_lg_xmit_t *q;
+  coap_tick_t non_timeout = COAP_NON_TIMEOUT_TICKS(session);
+  coap_tick_t tim_rem = -1;
+
+  LL_FOREACH_SAFE(session->lg_xmit, p, q) {
+    if (p->option != COAP_OPTION_Q_BLOCK1 || !p->last_payload)
+      continue;
+    if (p->last_payload + non_timeout <= now) {
+      if (p->b.b1.q_retry >= COAP_NON_MAX_RETRANSMIT(session)) {
+        coap_context_t *context = session->context;
+
+        coap_log(LOG_DEBUG, "** %s: lg_xmit %p Q-Block1 not responded to\n",
+                 coap_session_str(session), (void*)p);
+        COAP_COUNT(session, lg_timeouts, 1);
+        coap_block_remove_lg_xmit(session, p);
+        /* The skeletal PDU still has the application's token */
+        coap_handle_nack(context, session, &p->pdu,
+                         COAP_NACK_TOO_MANY_RETRIES, p->pdu.mid);
+        coap_block_delete_lg_xmit(session, p);
+        continue;
+      }
+      /* Resending the last block sent prompts the server to respond */
+      p->b.b1.q_retry++;
+      coap_block_send_q_block1(session, p, p->b.b1.q_last, COAP_MESSAGE_NON);
+      p->last_payload = now;
+    }
+    if (tim_rem > p->last_payload + non_timeout - now)
+      tim_rem = p->last_payload + non_timeout - now;
+  }
+  return tim_rem;
+}
+
+/*
+ * Stages the Max-Age option updated to what is left of the Max-Age of the
+ * BLOCK2 @p lg_xmit.
+ *
+ * Returns 1 if successful, else 0.
+ */
+static int
+coap_block_stage_maxage(coap_lg_xmit_t *lg_xmit, coap_opt_stage_t *stage) {
+  coap_tick_t now;
+  coap_time_t rem;
+  uint8_t buf[8];
+
+  if (!lg_xmit->b.b2.maxage_expire)
+    return 1;
+
+  coap_ticks(&now);
+  rem = coap_ticks_to_rt(now);
+  if (lg_xmit->b.b2.maxage_expire > rem) {
+    rem = lg_xmit->b.b2.maxage_expire - rem;
+  }
+  else {
+    rem = 0;
+    /* Entry needs to be expired */
+    coap_ticks(&lg_xmit->last_used);
+  }
+  return coap_opt_stage_update(stage, COAP_OPTION_MAXAGE,
+                               coap_encode_var_safe8(buf, sizeof(buf), rem),
+                               buf);
+}
+
 void
-coap_block_delete_lg_srcv(coap_session_t *session,
-                               coap_lg_srcv_t *lg_srcv) {
-  if (lg_srcv == NULL)
-    return;
+coap_block_send_q_block2_sets(coap_session_t *session) {
+  coap_lg_xmit_t *p;
 
-  coap_delete_str_const(lg_srcv->uri_path);
-  coap_free_type(COAP_STRING, lg_srcv->body_data);
-  coap_log(LOG_DEBUG, "** %s: lg_srcv %p released\n",
-         coap_session_str(session), (void*)lg_srcv);
-  coap_free_type(COAP_LG_SRCV, lg_srcv);
-}
+  LL_FOREACH(session->lg_xmit, p) {
+    size_t chunk;
 
-void
-coap_block_delete_lg_xmit(coap_session_t *session,
-                               coap_lg_xmit_t *lg_xmit) {
-  if (lg_xmit == NULL)
-    return;
+    if (p->option != COAP_OPTION_Q_BLOCK2)
+      continue;
+    chunk = (size_t)1 << (p->blk_size + 4);
+    while (p->b.b2.q_next < p->b.b2.q_end &&
+           p->b.b2.q_next * chunk < p->length) {
+      uint32_t num = p->b.b2.q_next++;
+      coap_opt_filter_t drop_options;
+      coap_opt_stage_t stage;
+      coap_pdu_t *pdu;
+      uint8_t buf[8];
 
-  if (lg_xmit->release_func) {
-    lg_xmit->release_func(session, lg_xmit->app_ptr);
-  }
-  if (lg_xmit->pdu.token) {
-    coap_free_type(COAP_PDU_BUF, lg_xmit->pdu.token - lg_xmit->pdu.hdr_size);
+      /* Observe is only in the first block */
+      memset(&drop_options, 0, sizeof(coap_opt_filter_t));
+      coap_option_filter_set(&drop_options, COAP_OPTION_OBSERVE);
+      pdu = coap_pdu_duplicate(&p->pdu, session, p->b.b2.q_token_length,
+                               p->b.b2.q_token, &drop_options);
+      if (!pdu)
+        break;
+      pdu->type = COAP_MESSAGE_NON;
+      coap_opt_stage_init(&stage);
+      if (!coap_opt_stage_update(&stage, p->option,
+                                 coap_encode_var_safe(buf, sizeof(buf),
+                                   (num << 4) |
+                                   (((num + 1) * chunk < p->length) << 3) |
+                                   p->blk_size),
+                                 buf) ||
+          !coap_block_stage_maxage(p, &stage) ||
+          !coap_add_opt_stage_pdu(pdu, &stage) ||
+          !coap_block_add_xmit_block(session, pdu, p, num, p->blk_size)) {
+        coap_delete_pdu(pdu);
+        break;
+      }
+      if (coap_send(session, pdu) == COAP_INVALID_MID)
+        break;
+    }
+    p->b.b2.q_next = p->b.b2.q_end = 0;
   }
-  if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu))
-    coap_delete_binary(lg_xmit->b.b1.app_token);
-  else
-    coap_delete_string(lg_xmit->b.b2.query);
-
-  coap_log(LOG_DEBUG, "** %s: lg_xmit %p released\n",
-           coap_session_str(session), (void*)lg_xmit);
-  coap_free_type(COAP_LG_XMIT, lg_xmit);
 }
 
+#ifndef COAP_WITHOUT_BLOCK2_LARGE
 static int
 add_block_send(uint32_t num, uint32_t *out_blocks,
                           uint32_t *count, uint32_t max_count) {
@@ -935,8 +2352,8 @@ add_block_send(uint32_t num, uint32_t *out_blocks,
     if (num == out_blocks[i])
       return 0;
     else if (num < out_blocks[i]) {
-      if (*count - i > 1)
-        memmove(&out_blocks[i], &out_blocks[i+1], *count - i -1);
+      memmove(&out_blocks[i+1], &out_blocks[i],
+              (*count - i) * sizeof(out_blocks[0]));
       out_blocks[i] = num;
       (*count)++;
       return 1;
@@ -974,13 +2391,24 @@ coap_handle_request_send_block(coap_session_t *session,
   coap_lg_xmit_t *p;
   coap_block_t block;
   uint16_t block_opt = 0;
-  uint32_t out_blocks[1];
+  uint32_t out_blocks[COAP_MAX_PAYLOADS_LIMIT];
   const char *error_phrase;
 
   if (coap_get_block(pdu, COAP_OPTION_BLOCK2, &block)) {
     block_opt = COAP_OPTION_BLOCK2;
   }
-  LL_FOREACH(session->lg_xmit, p) {
+  else if ((session->block_mode & COAP_BLOCK_TRY_Q_BLOCK) &&
+           coap_get_block(pdu, COAP_OPTION_Q_BLOCK2, &block)) {
+    block_opt = COAP_OPTION_Q_BLOCK2;
+  }
+  p = coap_block_find_lg_xmit_response(session, resource, pdu, query);
+  if (p && p->b.b2.generation != resource->generation) {
+    /* The resource has been changed since, so start again */
+    coap_block_remove_lg_xmit(session, p);
+    coap_block_delete_lg_xmit(session, p);
+    p = NULL;
+  }
+  if (p) {
     size_t chunk;
     coap_opt_iterator_t opt_iter;
     coap_opt_iterator_t opt_b_iter;
@@ -988,21 +2416,30 @@ coap_handle_request_send_block(coap_session_t *session,
     uint32_t request_cnt, i;
     coap_opt_t *etag_opt = NULL;
     coap_pdu_t *out_pdu = response;
-    static coap_string_t empty = { 0, NULL};
+    int q_more = 0;
+    uint32_t q_from = 0;
 
-    if (COAP_PDU_IS_REQUEST(&p->pdu) || resource != p->b.b2.resource ||
-        !coap_string_equal(query ? query : &empty,
-                           p->b.b2.query ? p->b.b2.query : &empty)) {
-      /* try out the next one */
-      continue;
+    if ((block_opt == COAP_OPTION_Q_BLOCK2) !=
+        (p->option == COAP_OPTION_Q_BLOCK2)) {
+      /* Asked for the other way, so let the application start again */
+      return 0;
+    }
+    if (p->release_func == coap_block_release_shared_body &&
+        ((coap_lg_xmit_body_t *)p->app_ptr)->registered &&
+        (!block_opt || (block_opt == COAP_OPTION_BLOCK2 && block.num == 0))) {
+      /*
+       * A new transfer of a registered body, so let the application pick
+       * the current representation (the body itself is not copied)
+       */
+      return 0;
     }
     etag_opt = coap_check_option(pdu, COAP_OPTION_ETAG, &opt_iter);
     if (etag_opt) {
       uint64_t etag = coap_decode_var_bytes8(coap_opt_value(etag_opt),
                                             coap_opt_length(etag_opt));
       if (etag != p->b.b2.etag) {
-        /* try out the next one */
-        continue;
+        /* Not this body, so let the application handle it */
+        return 0;
       }
       out_pdu->code = COAP_RESPONSE_CODE(203);
       return 1;
@@ -1059,8 +2496,18 @@ coap_handle_request_send_block(coap_session_t *session,
         response->code = COAP_RESPONSE_CODE(400);
         return 1;
       }
-      add_block_send(num, out_blocks, &request_cnt, 1);
-      break;
+      if (p->option != COAP_OPTION_Q_BLOCK2) {
+        add_block_send(num, out_blocks, &request_cnt, 1);
+        break;
+      }
+      /* Q-Block2 may ask for several blocks, and M asks for the set */
+      if ((size_t)num * chunk >= p->length)
+        continue;
+      if (COAP_OPT_BLOCK_MORE(option) && !q_more) {
+        q_more = 1;
+        q_from = num;
+      }
+      add_block_send(num, out_blocks, &request_cnt, session->max_payloads);
     }
     if (request_cnt == 0) {
       /* Block2 not found - give them the first block */
@@ -1068,10 +2515,20 @@ coap_handle_request_send_block(coap_session_t *session,
       p->offset = 0;
       out_blocks[0] = 0;
       request_cnt = 1;
+      q_more = p->option == COAP_OPTION_Q_BLOCK2;
+    }
+    if (q_more) {
+      /* The rest of the set follows once the response has gone */
+      p->b.b2.q_next = q_from + 1;
+      p->b.b2.q_end = (q_from / session->max_payloads + 1) *
+                      session->max_payloads;
+      p->b.b2.q_token_length = pdu->token_length;
+      memcpy(p->b.b2.q_token, pdu->token, pdu->token_length);
     }
 
     for (i = 0; i < request_cnt; i++) {
       uint8_t buf[8];
+      coap_opt_stage_t stage;
 
       block.num = out_blocks[i];
       p->offset = block.num * chunk;
@@ -1089,6 +2546,8 @@ coap_handle_request_send_block(coap_session_t *session,
           response->code = COAP_RESPONSE_CODE(500);
           goto fail;
         }
+        /* Only the response can be piggybacked */
+        out_pdu->type = COAP_MESSAGE_NON;
       }
       else {
         /*
@@ -1110,43 +2569,21 @@ coap_handle_request_send_block(coap_session_t *session,
       }
       if (pdu->type == COAP_MESSAGE_NON)
         out_pdu->type = COAP_MESSAGE_NON;
-      if (!coap_update_option(out_pdu, p->option,
+      coap_opt_stage_init(&stage);
+      if (!coap_opt_stage_update(&stage, p->option,
           coap_encode_var_safe(buf,
                           sizeof(buf),
                           (block.num << 4) |
                            ((p->offset + chunk < p->length) << 3) |
                            block.szx),
-                          buf)) {
+                          buf) ||
+          !coap_block_stage_maxage(p, &stage) ||
+          !coap_add_opt_stage_pdu(out_pdu, &stage)) {
         goto internal_issue;
       }
-      if (p->b.b2.maxage_expire) {
-        coap_tick_t now;
-        coap_time_t rem;
-
-        coap_ticks(&now);
-        rem = coap_ticks_to_rt(now);
-        if (p->b.b2.maxage_expire > rem) {
-          rem = p->b.b2.maxage_expire - rem;
-        }
-        else {
-          rem = 0;
-          /* Entry needs to be expired */
-          coap_ticks(&p->last_used);
-        }
-        if (!coap_update_option(out_pdu, COAP_OPTION_MAXAGE,
-                                coap_encode_var_safe8(buf,
-                                                      sizeof(buf),
-                                                      rem),
-                                buf)) {
-          goto internal_issue;
-        }
-      }
 
-      if (!etag_opt && !coap_add_block(out_pdu,
-                                       p->length,
-                                       p->data,
-                                       block.num,
-                                       block.szx)) {
+      if (!etag_opt && !coap_block_add_xmit_block(session, out_pdu, p,
+                                                  block.num, block.szx)) {
         goto internal_issue;
       }
       if (i + 1 < request_cnt) {
@@ -1157,9 +2594,9 @@ coap_handle_request_send_block(coap_session_t *session,
 
 fail:
     /* Keep in cache for 4 * ACK_TIMOUT */
-    coap_ticks(&p->last_used);
+    coap_io_ticks(session->context, &p->last_used);
     goto skip_app_handler;
-  } /* end of LL_FOREACH() */
+  }
   return 0;
 
 skip_app_handler:
@@ -1172,61 +2609,22 @@ internal_issue:
                 (const uint8_t *)error_phrase);
   goto fail;
 }
-
-static int
-update_received_blocks(coap_rblock_t *rec_blocks, uint32_t block_num) {
-  uint32_t i;
-
-  /* Reset as there is activity */
-  rec_blocks->retry = 0;
-
-  for (i = 0; i < rec_blocks->used; i++) {
-    if (block_num >= rec_blocks->range[i].begin &&
-        block_num <= rec_blocks->range[i].end)
-      break;
-
-    if (block_num < rec_blocks->range[i].begin) {
-      if (block_num + 1 == rec_blocks->range[i].begin) {
-        rec_blocks->range[i].begin = block_num;
-      }
-      else {
-        /* Need to insert a new range */
-        if (rec_blocks->used == COAP_RBLOCK_CNT -1)
-          /* Too many losses */
-          return 0;
-        memmove(&rec_blocks->range[i+1], &rec_blocks->range[i],
-                (rec_blocks->used - i) * sizeof (rec_blocks->range[0]));
-        rec_blocks->range[i].begin = rec_blocks->range[i].end = block_num;
-        rec_blocks->used++;
-      }
-      break;
-    }
-    if (block_num == rec_blocks->range[i].end + 1) {
-      rec_blocks->range[i].end = block_num;
-      if (i + 1 < rec_blocks->used) {
-        if (rec_blocks->range[i+1].begin == block_num + 1) {
-          /* Merge the 2 ranges */
-          rec_blocks->range[i].end = rec_blocks->range[i+1].end;
-          if (i+2 < rec_blocks->used) {
-            memmove (&rec_blocks->range[i+1], &rec_blocks->range[i+2],
-                   (rec_blocks->used - (i+2)) * sizeof (rec_blocks->range[0]));
-          }
-          rec_blocks->used--;
-        }
-      }
-      break;
-    }
-  }
-  if (i == rec_blocks->used) {
-    if (rec_blocks->used == COAP_RBLOCK_CNT -1)
-      /* Too many losses */
-      return 0;
-    rec_blocks->range[i].begin = rec_blocks->range[i].end = block_num;
-    rec_blocks->used++;
-  }
-  coap_ticks(&rec_blocks->last_seen);
-  return 1;
+#else /* COAP_WITHOUT_BLOCK2_LARGE */
+int
+coap_handle_request_send_block(coap_session_t *session,
+                               coap_pdu_t *pdu,
+                               coap_pdu_t *response,
+                               coap_resource_t *resource,
+                               coap_string_t *query) {
+  (void)session;
+  (void)pdu;
+  (void)response;
+  (void)resource;
+  (void)query;
+  /* Every block of a response is built by the handler */
+  return 0;
 }
+#endif /* COAP_WITHOUT_BLOCK2_LARGE */
 
 /*
  * Need to check if this is a large PUT / POST using multiple blocks
@@ -1254,6 +2652,7 @@ coap_handle_request_put_block(coap_context_t *context,
   size_t total = 0;
   coap_block_t block;
   coap_opt_iterator_t opt_iter;
+  coap_opt_stage_t stage;
   uint16_t block_option = 0;
 
   coap_get_data_large(pdu, &length, &data, &offset, &total);
@@ -1263,6 +2662,10 @@ coap_handle_request_put_block(coap_context_t *context,
   if (coap_get_block(pdu, COAP_OPTION_BLOCK1, &block)) {
     block_option = COAP_OPTION_BLOCK1;
   }
+  else if ((session->block_mode & COAP_BLOCK_TRY_Q_BLOCK) &&
+           coap_get_block(pdu, COAP_OPTION_Q_BLOCK1, &block)) {
+    block_option = COAP_OPTION_Q_BLOCK1;
+  }
   if (block_option) {
     coap_lg_srcv_t *p;
     coap_opt_t *size_opt = coap_check_option(pdu,
@@ -1279,16 +2682,8 @@ coap_handle_request_put_block(coap_context_t *context,
                                         coap_opt_length(size_opt)) : 0;
     offset = block.num << (block.szx + 4);
 
-    LL_FOREACH(session->lg_srcv, p) {
-      if (resource == p->resource) {
-        break;
-      }
-      if ((p->resource == context->unknown_resource ||
-           resource == context->proxy_uri_resource) &&
-          coap_string_equal(uri_path, p->uri_path))
-        break;
-    }
-    if (!p && block.num != 0) {
+    p = coap_block_find_lg_srcv(context, session, resource, uri_path);
+    if (!p && block.num != 0 && block_option != COAP_OPTION_Q_BLOCK1) {
       /* random access - no need to track */
       pdu->body_data = data;
       pdu->body_length = length;
@@ -1297,6 +2692,18 @@ coap_handle_request_put_block(coap_context_t *context,
     }
     /* Do not do this if this is a single block */
     else if (!p && !(offset == 0 && block.m == 0)) {
+      size_t max_body = coap_block_max_body(session, block_option);
+
+      if (max_body && total > max_body) {
+        uint8_t buf[8];
+
+        /* Tell the client how large a body can be (RFC7959 2.9.3) */
+        coap_add_option(response, COAP_OPTION_SIZE1,
+                        coap_encode_var_safe8(buf, sizeof(buf), max_body),
+                        buf);
+        response->code = COAP_RESPONSE_CODE(413);
+        goto skip_app_handler;
+      }
       p = coap_malloc_type(COAP_LG_SRCV, sizeof(coap_lg_srcv_t));
       if (p == NULL) {
         coap_add_data(response, sizeof("Memory issue")-1,
@@ -1309,20 +2716,50 @@ coap_handle_request_put_block(coap_context_t *context,
       memset(p, 0, sizeof(coap_lg_srcv_t));
       p->resource = resource;
       if (resource == context->unknown_resource ||
-          resource == context->proxy_uri_resource)
-        p->uri_path = coap_new_str_const(uri_path->s, uri_path->length);
+          resource == context->proxy_uri_resource || resource->is_route) {
+        /* These are indexed on uri_path */
+        p->uri_path = uri_path ? coap_new_str_const(uri_path->s,
+                                                    uri_path->length) : NULL;
+        if (!p->uri_path) {
+          coap_free_type(COAP_LG_SRCV, p);
+          coap_add_data(response, sizeof("Memory issue")-1,
+                        (const uint8_t *)"Memory issue");
+          response->code = COAP_RESPONSE_CODE(500);
+          goto skip_app_handler;
+        }
+      }
       p->content_format = fmt;
       p->total_len = total;
       p->amount_so_far = length;
       p->szx = block.szx;
       p->block_option = block_option;
+      p->rec_blocks.max_blocks = coap_block_max_blocks(max_body, block.szx);
+      if (total) {
+        size_t chunk = (size_t)1 << (block.szx + 4);
+
+        /* Size1 gives the number of blocks to expect */
+        (void)coap_rblock_size(&p->rec_blocks, (total + chunk - 1) / chunk);
+      }
       if (observe) {
         p->observe_length = min(coap_opt_length(observe), 3);
         memcpy(p->observe, coap_opt_value(observe), p->observe_length);
         p->observe_set = 1;
       }
       p->body_data = NULL;
-      LL_PREPEND(session->lg_srcv, p);
+      if (context->block_resume_dir && total &&
+          (uri_path || resource->uri_path) &&
+          block_option == COAP_OPTION_BLOCK1 &&
+          (session->block_mode & COAP_BLOCK_SINGLE_BODY) &&
+          !(session->block_mode & COAP_BLOCK_STREAM_BODY)) {
+        p->resume_key = uri_path ?
+          coap_block_resume_srcv_key(session, uri_path->s, uri_path->length,
+                                     total, fmt) :
+          coap_block_resume_srcv_key(session, resource->uri_path->s,
+                                     resource->uri_path->length, total, fmt);
+        if (p->resume_key)
+          coap_block_resume_lg_srcv(session, p, length, data);
+      }
+      coap_block_add_lg_srcv(session, p);
     }
     if (p) {
       if (fmt != p->content_format) {
@@ -1335,11 +2772,180 @@ coap_handle_request_put_block(coap_context_t *context,
       p->last_type = pdu->type;
       memcpy(p->last_token, pdu->token, pdu->token_length);
       p->last_token_length = pdu->token_length;
+      if (block_option == COAP_OPTION_Q_BLOCK1) {
+        /*
+         * Q-Block1 blocks can arrive in any order and are always put back
+         * together into a single body.  The client is only told how things
+         * are going at the end of each set, or when it looks to be stuck.
+         */
+        uint32_t missing[COAP_MAX_PAYLOADS_LIMIT];
+        uint32_t missing_cnt;
+        uint32_t last;
+        int newest;
+        int duplicate;
+        int respond;
+
+        newest = block.num >= p->rec_blocks.end;
+        duplicate = coap_rblock_check(&p->rec_blocks, block.num);
+        if (duplicate)
+          COAP_COUNT(session, duplicates, 1);
+        else {
+          if (!update_received_blocks(session, &p->rec_blocks, block.num)) {
+            coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
+            coap_add_data(response, sizeof("Too many missing blocks")-1,
+                          (const uint8_t *)"Too many missing blocks");
+            response->code = COAP_RESPONSE_CODE(408);
+            goto free_lg_recv;
+          }
+          if (!block.m) {
+            p->total_blocks = block.num + 1;
+            /* Size1 is only an estimate */
+            p->total_len = offset + length;
+          }
+          p->body_data = coap_block_build_body(p->body_data, length, data,
+                                               offset,
+                                               p->total_len > offset + length ?
+                                               p->total_len : offset + length);
+          if (!p->body_data) {
+            coap_add_data(response, sizeof("Memory issue")-1,
+                          (const uint8_t *)"Memory issue");
+            response->code = COAP_RESPONSE_CODE(500);
+            goto free_lg_recv;
+          }
+        }
+        if (p->total_blocks &&
+            check_all_blocks_in(&p->rec_blocks, p->total_blocks)) {
+          /* Pass the whole body up as for COAP_BLOCK_SINGLE_BODY */
+          coap_opt_stage_init(&stage);
+          if (p->observe_set) {
+            coap_opt_stage_update(&stage, COAP_OPTION_OBSERVE,
+                                  p->observe_length, p->observe);
+          }
+          coap_opt_stage_remove(&stage, block_option);
+          coap_add_opt_stage_pdu(pdu, &stage);
+          pdu->body_data = p->body_data->s;
+          pdu->body_length = p->total_len;
+          pdu->body_offset = 0;
+          pdu->body_total = p->total_len;
+          h(context, resource, session, pdu, token, query, response);
+          /* Check if lg_xmit generated and update PDU code if so */
+          coap_check_code_lg_xmit(session, response, resource, pdu, query);
+          /* Last chunk - free off shortly */
+          coap_io_ticks(session->context, &p->last_used);
+          coap_session_timer_arm(session, p->last_used +
+                                 COAP_EXCHANGE_LIFETIME_TICKS(session));
+          goto skip_app_handler;
+        }
+        last = p->rec_blocks.end - 1;
+        missing_cnt = coap_block_find_missing(&p->rec_blocks,
+                                              p->total_blocks ?
+                                              p->total_blocks : last + 1,
+                                              missing, session->max_payloads);
+        respond = pdu->type == COAP_MESSAGE_CON || !block.m || duplicate ||
+                  (block.num + 1) % session->max_payloads == 0 ||
+                  (missing_cnt == 0 && !newest);
+        if (!respond) {
+          /* Wait for more of the set */
+          goto skip_app_handler;
+        }
+        if (missing_cnt) {
+          uint8_t mbuf[COAP_MAX_PAYLOADS_LIMIT * 5];
+          uint8_t buf[2];
+
+          /* Ask for the blocks that have not arrived */
+          coap_insert_option(response, COAP_OPTION_CONTENT_FORMAT,
+                             coap_encode_var_safe(buf, sizeof(buf),
+                               COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ),
+                             buf);
+          coap_add_data(response,
+                        coap_block_encode_missing(missing, missing_cnt, mbuf),
+                        mbuf);
+          response->code = COAP_RESPONSE_CODE(408);
+        }
+        else {
+          uint8_t buf[4];
+
+          /* Ask for the next set */
+          coap_insert_option(response, block_option,
+                           coap_encode_var_safe(buf, sizeof(buf),
+                             (last << 4) | (1 << 3) | block.szx),
+                           buf);
+          response->code = COAP_RESPONSE_CODE(231);
+        }
+        goto skip_app_handler;
+      }
+      if (session->block_mode & (COAP_BLOCK_STREAM_BODY)) {
+        const uint8_t *sdata = data;
+        size_t slength = length;
+        size_t soffset = offset;
+        int ret = 0;
+
+        if (!coap_rblock_check(&p->rec_blocks, block.num)) {
+          ret = coap_block_stream_add(&p->stream, &sdata, &slength, &soffset,
+                                      !block.m);
+          if (ret < 0 ||
+              !update_received_blocks(session, &p->rec_blocks, block.num)) {
+            coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
+            coap_add_data(response, sizeof("Too many missing blocks")-1,
+                          (const uint8_t *)"Too many missing blocks");
+            response->code = COAP_RESPONSE_CODE(408);
+            goto free_lg_recv;
+          }
+        }
+        if (ret == 1) {
+          /* Pass on the data that is now in order */
+          pdu->body_data = sdata;
+          pdu->body_length = slength;
+          pdu->body_offset = soffset;
+          if (COAP_BLOCK_STREAM_DONE(&p->stream)) {
+            pdu->body_total = p->stream.end;
+            if (p->observe_set) {
+              coap_update_option(pdu, COAP_OPTION_OBSERVE,
+                                 p->observe_length, p->observe);
+            }
+            /* Last chunk - free off shortly */
+            coap_io_ticks(session->context, &p->last_used);
+            coap_session_timer_arm(session, p->last_used +
+                                   COAP_EXCHANGE_LIFETIME_TICKS(session));
+            goto call_app_handler;
+          }
+          if (p->total_len > soffset + slength)
+            pdu->body_total = p->total_len;
+          else
+            pdu->body_total = soffset + slength + 1;
+        }
+        if (block.m) {
+          uint8_t buf[4];
+
+          coap_insert_option(response, block_option,
+                           coap_encode_var_safe(buf, sizeof(buf),
+                             (block.num << 4) |
+                             (block.m << 3) |
+                             block.szx),
+                           buf);
+          if (ret == 1) {
+            h(context, resource, session, pdu, token, query, response);
+            /* Check if lg_xmit generated and update PDU code if so */
+            coap_check_code_lg_xmit(session, response, resource, pdu, query);
+            if (COAP_RESPONSE_CLASS(response->code) == 2) {
+              /* Just in case, as there are more to go */
+              response->code = COAP_RESPONSE_CODE(231);
+            }
+            *added_block = 1;
+          }
+          else {
+            /* Ask for the next block */
+            response->code = COAP_RESPONSE_CODE(231);
+          }
+        }
+        /* Otherwise the last block, but earlier blocks are still missing */
+        goto skip_app_handler;
+      }
       if (session->block_mode & (COAP_BLOCK_SINGLE_BODY)) {
         size_t chunk = (size_t)1 << (block.szx + 4);
-        if (!check_if_received_block(&p->rec_blocks, block.num)) {
+        if (!coap_rblock_check(&p->rec_blocks, block.num)) {
           /* Update list of blocks received */
-          if (!update_received_blocks(&p->rec_blocks, block.num)) {
+          if (!update_received_blocks(session, &p->rec_blocks, block.num)) {
             coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
             coap_add_data(response, sizeof("Too many missing blocks")-1,
                           (const uint8_t *)"Too many missing blocks");
@@ -1358,11 +2964,17 @@ coap_handle_request_put_block(coap_context_t *context,
           /* Not all the payloads of the body have arrived */
           if (block.m) {
             uint8_t buf[4];
-
-            /* Ask for the next block */
+            uint32_t num = block.num;
+
+            /*
+             * Ask for the next block, which is after the ones already
+             * there if the body has been picked up from where it was saved
+             */
+            if (p->rec_blocks.first_missing > num + 1)
+              num = p->rec_blocks.first_missing - 1;
             coap_insert_option(response, block_option,
                              coap_encode_var_safe(buf, sizeof(buf),
-                               (block.num << 4) |
+                               (num << 4) |
                                (block.m << 3) |
                                block.szx),
                              buf);
@@ -1377,23 +2989,31 @@ coap_handle_request_put_block(coap_context_t *context,
          * application layer. Add back in observe option if appropriate.
          * Adjust all other information.
          */
+        coap_opt_stage_init(&stage);
         if (p->observe_set) {
-          coap_update_option(pdu, COAP_OPTION_OBSERVE,
-                             p->observe_length, p->observe);
+          coap_opt_stage_update(&stage, COAP_OPTION_OBSERVE,
+                                p->observe_length, p->observe);
         }
-        coap_remove_option(pdu, block_option);
+        coap_opt_stage_remove(&stage, block_option);
+        coap_add_opt_stage_pdu(pdu, &stage);
         pdu->body_data = p->body_data->s;
         pdu->body_length = p->total_len;
         pdu->body_offset = 0;
         pdu->body_total = p->total_len;
+        if (p->resume_key) {
+          coap_block_resume_forget(context, p->resume_key);
+          p->resume_key = 0;
+        }
         coap_log(LOG_DEBUG, "Server app vesion of updated PDU\n");
         coap_show_pdu(LOG_DEBUG, pdu);
         /* Need to do this here as we need to free off p */
         h(context, resource, session, pdu, token, query, response);
         /* Check if lg_xmit generated and update PDU code if so */
-        coap_check_code_lg_xmit(session, response, resource, query);
+        coap_check_code_lg_xmit(session, response, resource, pdu, query);
         /* Last chunk - free off shortly */
-        coap_ticks(&p->last_used);
+        coap_io_ticks(session->context, &p->last_used);
+        coap_session_timer_arm(session, p->last_used +
+                               COAP_EXCHANGE_LIFETIME_TICKS(session));
         goto skip_app_handler;
       }
       else {
@@ -1416,7 +3036,7 @@ coap_handle_request_put_block(coap_context_t *context,
                            buf);
           h(context, resource, session, pdu, token, query, response);
           /* Check if lg_xmit generated and update PDU code if so */
-          coap_check_code_lg_xmit(session, response, resource, query);
+          coap_check_code_lg_xmit(session, response, resource, pdu, query);
           if (COAP_RESPONSE_CLASS(response->code) == 2) {
             /* Just in case, as there are more to go */
             response->code = COAP_RESPONSE_CODE(231);
@@ -1431,12 +3051,14 @@ coap_handle_request_put_block(coap_context_t *context,
 
       if (block.m == 0) {
         /* Last chunk - free off all */
-        coap_ticks(&p->last_used);
+        coap_io_ticks(session->context, &p->last_used);
+        coap_session_timer_arm(session, p->last_used +
+                               COAP_EXCHANGE_LIFETIME_TICKS(session));
       }
       goto call_app_handler;
 
 free_lg_recv:
-      LL_DELETE(session->lg_srcv, p);
+      coap_block_remove_lg_srcv(session, p);
       coap_block_delete_lg_srcv(session, p);
       goto skip_app_handler;
     }
@@ -1448,6 +3070,72 @@ skip_app_handler:
   return 1;
 }
 
+/*
+ * Handles a response to a Q-Block1 request body that is being sent.
+ *
+ * Returns 1 if the response has been dealt with, else 0 if the response is
+ * for the application.
+ */
+static int
+coap_block_q_block1_response(coap_session_t *session, coap_lg_xmit_t *p,
+                             coap_pdu_t *rcvd) {
+  size_t chunk = (size_t)1 << (p->blk_size + 4);
+  uint32_t total = (uint32_t)((p->length + chunk - 1) / chunk);
+  coap_block_t block;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *fmt_opt;
+
+  if (rcvd->code == COAP_RESPONSE_CODE(231) &&
+      coap_get_block(rcvd, COAP_OPTION_Q_BLOCK1, &block)) {
+    /* All is in up to block.num, so send the next set */
+    if ((int)block.num <= p->last_block)
+      return 1;
+    p->last_block = block.num;
+    p->b.b1.q_retry = 0;
+    if (block.num + 1 < total)
+      coap_block_send_q_block1_set(session, p, block.num + 1);
+    return 1;
+  }
+  fmt_opt = coap_check_option(rcvd, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+  if (rcvd->code == COAP_RESPONSE_CODE(408) && fmt_opt &&
+      coap_decode_var_bytes(coap_opt_value(fmt_opt),
+                            coap_opt_length(fmt_opt)) ==
+                                       COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ) {
+    /* Send the blocks that the server says are missing */
+    uint32_t missing[COAP_MAX_PAYLOADS_LIMIT];
+    uint32_t count = 0;
+    uint32_t i;
+    size_t length;
+    uint8_t *data;
+
+    if (coap_get_data(rcvd, &length, &data))
+      count = coap_block_decode_missing(data, length, missing,
+                                        session->max_payloads);
+    for (i = 0; i < count; i++) {
+      if (missing[i] < total)
+        coap_block_send_q_block1(session, p, missing[i], COAP_MESSAGE_NON);
+    }
+    /* The server is still there, so start counting again */
+    p->b.b1.q_retry = 0;
+    coap_io_ticks(session->context, &p->last_payload);
+    coap_session_timer_arm(session, p->last_payload +
+                                    COAP_NON_TIMEOUT_TICKS(session));
+    return 1;
+  }
+  if (rcvd->code == COAP_RESPONSE_CODE(402) && p->last_block == -1 &&
+      p->pdu.type == COAP_MESSAGE_CON) {
+    /* Q-Block1 is not understood by the server, so fall back to Block1 */
+    coap_log(LOG_DEBUG, "** %s: Q-Block1 not supported, using Block1\n",
+             coap_session_str(session));
+    session->block_mode &= ~COAP_BLOCK_TRY_Q_BLOCK;
+    coap_remove_option(&p->pdu, COAP_OPTION_Q_BLOCK1);
+    p->option = COAP_OPTION_BLOCK1;
+    p->last_payload = 0;
+    return coap_block_send_q_block1(session, p, 0, p->pdu.type);
+  }
+  return 0;
+}
+
 /*
  * Need to see if this is a response to a large body request transfer. If so,
  * need to initiate the request containing the next block and not trouble the
@@ -1465,17 +3153,21 @@ skip_app_handler:
 int
 coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *rcvd) {
   coap_lg_xmit_t *p;
-  coap_lg_xmit_t *q;
 
-  LL_FOREACH_SAFE(session->lg_xmit, p, q) {
-    if (COAP_PDU_IS_REQUEST(&p->pdu) &&
-        !block_token_match(rcvd->token, rcvd->token_length,
-                    p->b.b1.token, p->b.b1.token_length)) {
-    }
-    /* lg_xmit found */
-    size_t chunk = (size_t)1 << (p->blk_size + 4);
+  p = coap_block_find_lg_xmit_request(session, rcvd->token,
+                                      rcvd->token_length);
+  if (p) {
+    size_t chunk;
     coap_block_t block;
 
+    /* lg_xmit found */
+    chunk = (size_t)1 << (p->blk_size + 4);
+
+    if (p->option == COAP_OPTION_Q_BLOCK1) {
+      if (coap_block_q_block1_response(session, p, rcvd))
+        return 1;
+      goto fail_body;
+    }
     if (COAP_RESPONSE_CLASS(rcvd->code) == 2 &&
         coap_get_block(rcvd, p->option, &block)) {
       coap_log(LOG_DEBUG,
@@ -1514,6 +3206,7 @@ coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *rcvd) {
          *
          * Once a block has been ACKd, there is no need to retransmit it.
          */
+        COAP_COUNT(session, duplicates, 1);
         return 1;
       }
       p->last_block = block.num;
@@ -1522,8 +3215,8 @@ coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *rcvd) {
         /* Build the next PDU request based off the skeletal PDU */
         uint8_t buf[8];
         coap_pdu_t *pdu;
-        uint64_t token = coap_decode_var_bytes8(p->pdu.token,
-                                                p->pdu.token_length);
+        uint64_t token = coap_decode_var_bytes8(p->b.b1.token,
+                                                p->b.b1.token_length);
         uint8_t ltoken[8];
         size_t ltoken_length;
 
@@ -1541,11 +3234,7 @@ coap_handle_response_send_block(coap_session_t *session, coap_pdu_t *rcvd) {
                              block.szx),
                            buf);
 
-        if (!coap_add_block(pdu,
-                            p->length,
-                            p->data,
-                            block.num,
-                            block.szx))
+        if (!coap_block_add_xmit_block(session, pdu, p, block.num, block.szx))
           goto fail_body;
         if (coap_send(session, pdu) == COAP_INVALID_MID)
           goto fail_body;
@@ -1560,14 +3249,13 @@ fail_body:
     coap_log(LOG_DEBUG, "PDU given to app\n");
     coap_show_pdu(LOG_DEBUG, rcvd);
 
-    LL_DELETE(session->lg_xmit, p);
+    coap_block_remove_lg_xmit(session, p);
     coap_block_delete_lg_xmit(session, p);
     /*
      * There may be a block response after doing the large request
      * https://tools.ietf.org/html/rfc7959#section-3.3
      */
-    break;
-  } /* end of LL_FOREACH_SAFE */
+  }
   return 0;
 }
 
@@ -1639,19 +3327,35 @@ coap_handle_response_get_block(coap_context_t *context,
   uint16_t block_opt = 0;
   size_t offset;
 
-  LL_FOREACH(session->lg_crcv, p) {
+  HASH_FIND(hh, session->lg_crcv_token, rcvd->token, rcvd->token_length, p);
+  if (p) {
     size_t chunk = 0;
     uint8_t buf[8];
     coap_opt_iterator_t opt_iter;
 
-    if (!full_match(rcvd->token, rcvd->token_length,
-                     p->token, p->token_length)) {
-      /* try out the next one */
-      continue;
-    }
-
     /* lg_crcv found */
 
+    if (rcvd->code == COAP_RESPONSE_CODE(402) && p->initial &&
+        COAP_SESSION_Q_BLOCK(session) &&
+        coap_check_option(&p->pdu, COAP_OPTION_Q_BLOCK2, &opt_iter)) {
+      /* Q-Block2 is not understood by the server, so fall back to Block2 */
+      size_t len;
+      coap_pdu_t *pdu;
+
+      coap_log(LOG_DEBUG, "** %s: Q-Block2 not supported, using Block2\n",
+               coap_session_str(session));
+      session->block_mode &= ~COAP_BLOCK_TRY_Q_BLOCK;
+      while (coap_remove_option(&p->pdu, COAP_OPTION_Q_BLOCK2))
+        ;
+      coap_session_new_token(session, &len, buf);
+      pdu = coap_pdu_duplicate(&p->pdu, session, len, buf, NULL);
+      if (pdu) {
+        coap_block_set_lg_crcv_token(session, p, pdu->token,
+                                     pdu->token_length);
+        if (coap_send(session, pdu) != COAP_INVALID_MID)
+          goto skip_app_handler;
+      }
+    }
     if (COAP_RESPONSE_CLASS(rcvd->code) == 2) {
       size_t length;
       uint8_t *data;
@@ -1668,6 +3372,10 @@ coap_handle_response_get_block(coap_context_t *context,
         have_block = 1;
         block_opt = COAP_OPTION_BLOCK2;
       }
+      else if (coap_get_block(rcvd, COAP_OPTION_Q_BLOCK2, &block)) {
+        have_block = 1;
+        block_opt = COAP_OPTION_Q_BLOCK2;
+      }
       if (have_block) {
         coap_opt_t *fmt_opt = coap_check_option(rcvd,
                                             COAP_OPTION_CONTENT_FORMAT,
@@ -1690,6 +3398,8 @@ coap_handle_response_get_block(coap_context_t *context,
         }
 
         if (p->initial) {
+          size_t max_body;
+
           p->initial = 0;
           if (etag_opt) {
             p->etag_length = coap_opt_length(etag_opt);
@@ -1699,12 +3409,24 @@ coap_handle_response_get_block(coap_context_t *context,
           else {
             p->etag_set = 0;
           }
+          max_body = coap_block_max_body(session, block_opt);
+          if (max_body && size2 > max_body) {
+            coap_log(LOG_WARNING,
+                     "** %s: body of %zu bytes is too large\n",
+                     coap_session_str(session), size2);
+            coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
+            goto fail_resp;
+          }
           p->total_len = size2;
           p->content_format = fmt;
           p->szx = block.szx;
           p->block_option = block_opt;
           p->last_type = rcvd->type;
-          p->rec_blocks.used = 0;
+          coap_rblock_reset(&p->rec_blocks);
+          p->rec_blocks.max_blocks = coap_block_max_blocks(max_body,
+                                                           block.szx);
+          /* Size2 gives the number of blocks to expect */
+          (void)coap_rblock_size(&p->rec_blocks, (size2 + chunk - 1) / chunk);
         }
         if (p->total_len < size2)
           p->total_len = size2;
@@ -1722,21 +3444,26 @@ coap_handle_response_get_block(coap_context_t *context,
             if (!(session->block_mode & COAP_BLOCK_SINGLE_BODY))
               coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
 
+            coap_block_forget_lg_crcv(session, p);
             p->initial = 1;
             coap_free_type(COAP_STRING, p->body_data);
             p->body_data = NULL;
+            coap_block_stream_reset(&p->stream);
 
             coap_session_new_token(session, &len, buf);
             pdu = coap_pdu_duplicate(&p->pdu, session, len, buf, NULL);
             if (!pdu)
               goto fail_resp;
 
-            memcpy(p->token, pdu->token, pdu->token_length);
-            p->token_length = pdu->token_length;
+            coap_block_set_lg_crcv_token(session, p, pdu->token,
+                                         pdu->token_length);
 
+            /* Q-Block2 asks for the whole of the first set */
             coap_update_option(pdu, block_opt,
                                coap_encode_var_safe(buf, sizeof(buf),
-                                      (0 << 4) | (0 << 3) | block.szx),
+                                      (0 << 4) |
+                                      ((block_opt == COAP_OPTION_Q_BLOCK2) << 3) |
+                                      block.szx),
                                buf);
 
             if (coap_send(session, pdu) == COAP_INVALID_MID)
@@ -1748,13 +3475,15 @@ coap_handle_response_get_block(coap_context_t *context,
         else if (p->etag_set) {
           /* Cannot handle this change in ETag to not being there */
           coap_log(LOG_WARNING, "Not all blocks have ETag option\n");
-          session->block_mode &= ~(COAP_BLOCK_SINGLE_BODY);
+          session->block_mode &= ~(COAP_BLOCK_SINGLE_BODY |
+                                  COAP_BLOCK_STREAM_BODY);
           goto block_mode;
         }
 
         if (fmt != p->content_format) {
           coap_log(LOG_WARNING, "Content-Format option mismatch\n");
-          session->block_mode &= ~(COAP_BLOCK_SINGLE_BODY);
+          session->block_mode &= ~(COAP_BLOCK_SINGLE_BODY |
+                                  COAP_BLOCK_STREAM_BODY);
           goto block_mode;
         }
         coap_log(LOG_DEBUG,
@@ -1773,13 +3502,27 @@ coap_handle_response_get_block(coap_context_t *context,
             p->observe_set = 0;
           }
         }
-        if (!check_if_received_block(&p->rec_blocks, block.num)) {
+        if (!coap_rblock_check(&p->rec_blocks, block.num)) {
+          const uint8_t *sdata = data;
+          size_t slength = length;
+          size_t soffset = offset;
+          int sret = 0;
+
           /* Update list of blocks received */
-          if (!update_received_blocks(&p->rec_blocks, block.num)) {
+          if (!update_received_blocks(session, &p->rec_blocks, block.num)) {
             coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
             goto fail_resp;
           }
 
+          if (session->block_mode & (COAP_BLOCK_STREAM_BODY)) {
+            sret = coap_block_stream_add(&p->stream, &sdata, &slength,
+                                         &soffset, !block.m);
+            if (sret < 0) {
+              coap_handle_event(context, COAP_EVENT_PARTIAL_BLOCK, session);
+              goto fail_resp;
+            }
+          }
+
           if (session->block_mode & (COAP_BLOCK_SINGLE_BODY)) {
             p->body_data = coap_block_build_body(p->body_data, length, data,
                                                  offset, size2);
@@ -1795,7 +3538,20 @@ coap_handle_response_get_block(coap_context_t *context,
             size_t len;
             coap_pdu_t *pdu;
 
-            if (block.m) {
+            if (block_opt == COAP_OPTION_Q_BLOCK2) {
+              /*
+               * The rest of the set is on its way using the same token.
+               * Ask for what is missing at the end of each set, or when
+               * the last block is in.
+               */
+              if (!block.m)
+                coap_block_request_q_block2_missing(session, p, 0);
+              else if ((block.num + 1) % session->max_payloads == 0)
+                coap_block_request_q_block2_missing(session, p, 1);
+              coap_session_timer_arm(session, p->rec_blocks.last_seen +
+                                     COAP_NON_RECEIVE_TIMEOUT_TICKS(session));
+            }
+            else if (block.m) {
               block.m = 0;
 
               /* Ask for the next block */
@@ -1804,8 +3560,8 @@ coap_handle_response_get_block(coap_context_t *context,
               if (!pdu)
                 goto fail_resp;
 
-              memcpy(p->token, pdu->token, pdu->token_length);
-              p->token_length = pdu->token_length;
+              coap_block_set_lg_crcv_token(session, p, pdu->token,
+                                           pdu->token_length);
 
               /* Only sent with the first block */
               coap_remove_option(pdu, COAP_OPTION_OBSERVE);
@@ -1821,10 +3577,20 @@ coap_handle_response_get_block(coap_context_t *context,
             }
             if (session->block_mode & (COAP_BLOCK_SINGLE_BODY))
               goto skip_app_handler;
+            if ((session->block_mode & (COAP_BLOCK_STREAM_BODY)) && sret != 1)
+              /* Held back until the missing blocks arrive */
+              goto skip_app_handler;
 
             /* need to put back original token into rcvd */
             coap_update_token(rcvd, p->app_token->length, p->app_token->s);
-            rcvd->body_offset = block.num*chunk;
+            if (session->block_mode & (COAP_BLOCK_STREAM_BODY)) {
+              rcvd->body_data = sdata;
+              rcvd->body_length = slength;
+              rcvd->body_offset = soffset;
+            }
+            else {
+              rcvd->body_offset = block.num*chunk;
+            }
             rcvd->body_total = size2;
             goto call_app_handler;
           }
@@ -1838,15 +3604,33 @@ coap_handle_response_get_block(coap_context_t *context,
                                  p->observe_length, p->observe);
             }
             rcvd->body_data = p->body_data->s;
-            rcvd->body_length = block.num*chunk + length;
+            if (block_opt == COAP_OPTION_Q_BLOCK2)
+              /* The last block to arrive may not be the last of the body */
+              rcvd->body_length = p->total_len;
+            else
+              rcvd->body_length = block.num*chunk + length;
             rcvd->body_offset = 0;
             rcvd->body_total = rcvd->body_length;
           }
+          else if (session->block_mode & (COAP_BLOCK_STREAM_BODY)) {
+            /* The rest of the body, now that all of it is in */
+            rcvd->body_data = sdata;
+            rcvd->body_length = slength;
+            rcvd->body_offset = soffset;
+            rcvd->body_total = soffset + slength;
+          }
           else {
             rcvd->body_offset = block.num*chunk;
             rcvd->body_total = size2;
           }
-          if (context->response_handler) {
+          if (session->proxy_origin &&
+              coap_proxy_handle_response(session, rcvd)) {
+            /* Passed back to the client by the forward proxy */
+          }
+          else if (coap_request_response(session, rcvd, NULL)) {
+            /* Passed to the handler of the request */
+          }
+          else if (context->response_handler) {
             if (session->block_mode &
                   (COAP_BLOCK_SINGLE_BODY)) {
               coap_log(LOG_DEBUG, "Client app vesion of updated PDU\n");
@@ -1856,10 +3640,13 @@ coap_handle_response_get_block(coap_context_t *context,
                                       rcvd->mid);
           }
           app_has_response = 1;
+          if (p->body_data)
+            coap_block_forget_lg_crcv(session, p);
           /* Set up for the next data body if observing */
           p->initial = 1;
-          memcpy(p->token, p->base_token, p->base_token_length);
-          p->token_length = p->base_token_length;
+          coap_block_stream_reset(&p->stream);
+          coap_block_set_lg_crcv_token(session, p, p->base_token,
+                                       p->base_token_length);
           if (p->body_data) {
             coap_free_type(COAP_STRING, p->body_data);
             p->body_data = NULL;
@@ -1868,6 +3655,10 @@ coap_handle_response_get_block(coap_context_t *context,
             goto skip_app_handler;
           }
         }
+        else if (session->block_mode & (COAP_BLOCK_STREAM_BODY)) {
+          /* Already passed on */
+          goto skip_app_handler;
+        }
         else {
 block_mode:
           /* need to put back original token into rcvd */
@@ -1884,10 +3675,17 @@ block_mode:
             rcvd->body_total = block.num*chunk + length;
             /* Set up for the next data body if observing */
             p->initial = 1;
-            memcpy(p->token, p->base_token, p->base_token_length);
-            p->token_length = p->base_token_length;
+            coap_block_set_lg_crcv_token(session, p, p->base_token,
+                                         p->base_token_length);
           }
-          if (context->response_handler) {
+          if (session->proxy_origin &&
+              coap_proxy_handle_response(session, rcvd)) {
+            /* Passed back to the client by the forward proxy */
+          }
+          else if (coap_request_response(session, rcvd, NULL)) {
+            /* Passed to the handler of the request */
+          }
+          else if (context->response_handler) {
             coap_log(LOG_DEBUG, "Client app vesion of updated PDU\n");
             coap_show_pdu(LOG_DEBUG, rcvd);
             context->response_handler(context, session, sent, rcvd,
@@ -1910,15 +3708,24 @@ block_mode:
         }
       }
     }
+    if (!have_block && !p->initial && p->body_data &&
+        COAP_RESPONSE_CLASS(rcvd->code) != 5) {
+      /* The body that was being resumed is no longer there as it was */
+      coap_block_forget_lg_crcv(session, p);
+      p->initial = 1;
+      coap_free_type(COAP_STRING, p->body_data);
+      p->body_data = NULL;
+    }
     if (!block.m && !p->observe_set) {
 fail_resp:
       /* lg_crcv no longer required - cache it */
-      coap_ticks(&p->last_used);
+      coap_io_ticks(session->context, &p->last_used);
+      coap_session_timer_arm(session, p->last_used +
+                             COAP_EXCHANGE_LIFETIME_TICKS(session));
     }
     /* need to put back original token into rcvd */
     coap_update_token(rcvd, p->app_token->length, p->app_token->s);
-    break;
-  } /* LL_FOREACH() */
+  }
 
   /* Check if receiving a block response and if blocks can be set up */
   if (recursive == COAP_RECURSE_OK && !p) {
@@ -1930,9 +3737,9 @@ fail_resp:
       }
     }
     else if (COAP_RESPONSE_CLASS(rcvd->code) == 2) {
-      if (coap_get_block(rcvd, COAP_OPTION_BLOCK2, &block)) {
+      if (coap_get_block(rcvd, COAP_OPTION_BLOCK2, &block) ||
+          coap_get_block(rcvd, COAP_OPTION_Q_BLOCK2, &block)) {
         have_block = 1;
-        block_opt = COAP_OPTION_BLOCK2;
         if (block.num != 0) {
           /* Assume random access and just give the single response to app */
           size_t length;
@@ -1949,7 +3756,7 @@ fail_resp:
         coap_lg_crcv_t *lg_crcv = coap_block_new_lg_crcv(session, sent);
 
         if (lg_crcv) {
-          LL_PREPEND(session->lg_crcv, lg_crcv);
+          coap_block_add_lg_crcv(session, lg_crcv);
           return coap_handle_response_get_block(context, session, sent, rcvd,
                                                 COAP_RECURSE_NO);
         }
@@ -1968,22 +3775,14 @@ skip_app_handler:
 /* Check if lg_xmit generated and update PDU code if so */
 void
 coap_check_code_lg_xmit(coap_session_t *session, coap_pdu_t *response,
-                        coap_resource_t *resource, coap_string_t *query) {
+                        coap_resource_t *resource, const coap_pdu_t *request,
+                        coap_string_t *query) {
   coap_lg_xmit_t *lg_xmit;
-  coap_string_t empty = { 0, NULL};
 
   if (response->code == 0)
     return;
-  LL_FOREACH(session->lg_xmit, lg_xmit) {
-    if (!COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
-        lg_xmit->b.b2.resource == resource &&
-        coap_string_equal(query ? query : &empty,
-                   lg_xmit->b.b2.query ? lg_xmit->b.b2.query : &empty)) {
-      /* lg_xmit found */
-      if (lg_xmit->pdu.code == 0) {
-        lg_xmit->pdu.code = response->code;
-        return;
-      }
-    }
-  }
+  lg_xmit = coap_block_find_lg_xmit_response(session, resource, request,
+                                             query);
+  if (lg_xmit && lg_xmit->pdu.code == 0)
+    lg_xmit->pdu.code = response->code;
 }
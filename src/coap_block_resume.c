@@ -0,0 +1,461 @@
+/* coap_block_resume.c -- Progress of large body transfers kept on disk
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#if defined(HAVE_UNISTD_H) && !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+#include <unistd.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Each transfer that is not complete is kept in a file of its own in the
+ * directory given to coap_context_set_block_resume(), named after the key
+ * of the transfer: a header, the bitmap of the blocks received and then the
+ * body as far as it has got.  The file is written under another name and
+ * then renamed, so a transfer that is being saved as the process dies is
+ * either complete or not there.  The numbers are in host byte order, as
+ * the files are not meant to be moved to another machine.
+ */
+#define COAP_BLOCK_RESUME_MAGIC "coaprsm1"
+
+typedef struct coap_block_resume_header_t {
+  char magic[8];
+  uint64_t key;
+  uint64_t total_len;
+  uint64_t body_len;
+  uint32_t words;
+  uint32_t first_missing;
+  uint32_t end;
+  uint16_t content_format;
+  uint8_t szx;
+  uint8_t etag_length;
+  uint8_t etag[8];
+} coap_block_resume_header_t;
+
+int
+coap_context_set_block_resume(coap_context_t *context, const char *dir) {
+  char *copy = NULL;
+
+  if (dir) {
+    size_t len = strlen(dir);
+
+    copy = coap_malloc_type(COAP_STRING, len + 1);
+    if (!copy)
+      return 0;
+    memcpy(copy, dir, len + 1);
+  }
+  coap_free_type(COAP_STRING, context->block_resume_dir);
+  context->block_resume_dir = copy;
+  return 1;
+}
+
+static uint64_t
+resume_hash(uint64_t h, const uint8_t *data, size_t length) {
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+ * Hashes the address of the peer without the port, which changes when the
+ * client sets up a new session.
+ */
+static uint64_t
+resume_hash_peer(uint64_t h, const coap_session_t *session) {
+  const coap_address_t *addr = &session->addr_info.remote;
+
+  switch (addr->addr.sa.sa_family) {
+  case AF_INET:
+    return resume_hash(h, (const uint8_t *)&addr->addr.sin.sin_addr,
+                       sizeof(addr->addr.sin.sin_addr));
+  case AF_INET6:
+    return resume_hash(h, (const uint8_t *)&addr->addr.sin6.sin6_addr,
+                       sizeof(addr->addr.sin6.sin6_addr));
+#ifdef COAP_AF_UNIX_SUPPORT
+  case AF_UNIX:
+    return resume_hash(h, (const uint8_t *)addr->addr.cun.sun_path,
+                       strlen(addr->addr.cun.sun_path));
+#endif /* COAP_AF_UNIX_SUPPORT */
+  default:
+    return h;
+  }
+}
+
+/* Keys of 0 are taken to mean that there is nothing to save */
+#define RESUME_KEY(h) ((h) ? (h) : 1)
+
+uint64_t
+coap_block_resume_crcv_key(const coap_session_t *session,
+                           const coap_pdu_t *pdu) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  uint8_t code = pdu->code;
+  size_t length;
+  uint8_t *data;
+
+  h = resume_hash(h, (const uint8_t *)"c", 1);
+  h = resume_hash(h, &code, 1);
+  h = resume_hash_peer(h, session);
+  coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    switch (opt_iter.type) {
+    case COAP_OPTION_URI_HOST:
+    case COAP_OPTION_URI_PORT:
+    case COAP_OPTION_URI_PATH:
+    case COAP_OPTION_URI_QUERY:
+    case COAP_OPTION_PROXY_URI:
+    case COAP_OPTION_PROXY_SCHEME:
+    case COAP_OPTION_ACCEPT:
+      {
+        uint8_t num[2];
+
+        num[0] = (uint8_t)(opt_iter.type >> 8);
+        num[1] = (uint8_t)opt_iter.type;
+        h = resume_hash(h, num, sizeof(num));
+        num[0] = (uint8_t)(coap_opt_length(option) >> 8);
+        num[1] = (uint8_t)coap_opt_length(option);
+        h = resume_hash(h, num, sizeof(num));
+        h = resume_hash(h, coap_opt_value(option), coap_opt_length(option));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  /* The body of a FETCH is part of what is asked for */
+  if (coap_get_data(pdu, &length, &data))
+    h = resume_hash(h, data, length);
+  return RESUME_KEY(h);
+}
+
+uint64_t
+coap_block_resume_srcv_key(const coap_session_t *session,
+                           const uint8_t *uri_path, size_t uri_path_len,
+                           size_t total_len, uint16_t content_format) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint64_t total = total_len;
+  const coap_bin_const_t *identity = coap_session_get_psk_identity(session);
+
+  h = resume_hash(h, (const uint8_t *)"s", 1);
+  h = resume_hash(h, uri_path, uri_path_len);
+  h = resume_hash(h, (const uint8_t *)&total, sizeof(total));
+  h = resume_hash(h, (const uint8_t *)&content_format,
+                  sizeof(content_format));
+  /* The client is known by its PSK identity where there is one */
+  if (identity)
+    h = resume_hash(h, identity->s, identity->length);
+  else
+    h = resume_hash_peer(h, session);
+  return RESUME_KEY(h);
+}
+
+static char *
+resume_path(const coap_context_t *context, uint64_t key, const char *suffix) {
+  size_t len = strlen(context->block_resume_dir) + 1 + 16 +
+               strlen(suffix) + 1;
+  char *path = coap_malloc_type(COAP_STRING, len);
+
+  if (path)
+    snprintf(path, len, "%s/%08x%08x%s", context->block_resume_dir,
+             (unsigned int)(key >> 32), (unsigned int)(key & 0xffffffff),
+             suffix);
+  return path;
+}
+
+/* Whether @p name is that of a saved transfer, or one being written */
+static int
+resume_name(const char *name) {
+  size_t i;
+
+  for (i = 0; i < 16; i++) {
+    if (!isxdigit((unsigned char)name[i]))
+      return 0;
+  }
+  return name[16] == '\0' || strcmp(&name[16], ".tmp") == 0;
+}
+
+/*
+ * Removes the transfers that have not been saved for COAP_BLOCK_RESUME_TTL,
+ * then the oldest while there are COAP_BLOCK_RESUME_MAX_FILES others than
+ * the one for @p key, so that clients that go away and never come back do
+ * not fill up the directory.
+ */
+static void
+resume_prune(coap_context_t *context, uint64_t key) {
+  char *keep = resume_path(context, key, "");
+  size_t dir_len = strlen(context->block_resume_dir);
+  time_t now = time(NULL);
+
+  if (!keep)
+    return;
+  for (;;) {
+    DIR *dir = opendir(context->block_resume_dir);
+    struct dirent *entry;
+    char path[1024];
+    char oldest[1024];
+    time_t oldest_time = 0;
+    unsigned int count = 0;
+
+    if (!dir)
+      break;
+    oldest[0] = '\0';
+    while ((entry = readdir(dir)) != NULL) {
+      struct stat st;
+
+      if (!resume_name(entry->d_name) ||
+          dir_len + 1 + strlen(entry->d_name) + 1 > sizeof(path))
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", context->block_resume_dir,
+               entry->d_name);
+      if (strcmp(path, keep) == 0 || stat(path, &st) == -1)
+        continue;
+      if (now - st.st_mtime >= COAP_BLOCK_RESUME_TTL) {
+        if (unlink(path) == 0)
+          coap_log(LOG_DEBUG, "** block transfer %s expired\n", path);
+        continue;
+      }
+      count++;
+      if (oldest[0] == '\0' || st.st_mtime < oldest_time) {
+        memcpy(oldest, path, strlen(path) + 1);
+        oldest_time = st.st_mtime;
+      }
+    }
+    closedir(dir);
+    if (count < COAP_BLOCK_RESUME_MAX_FILES || unlink(oldest) == -1)
+      break;
+    coap_log(LOG_DEBUG, "** block transfer %s dropped to make room\n",
+             oldest);
+  }
+  coap_free_type(COAP_STRING, keep);
+}
+
+int
+coap_block_resume_save(coap_context_t *context,
+                       const coap_block_resume_t *state) {
+  coap_block_resume_header_t header;
+  char *path;
+  char *tmp_path;
+  FILE *fp;
+  int ok;
+
+  path = resume_path(context, state->key, "");
+  tmp_path = resume_path(context, state->key, ".tmp");
+  if (!path || !tmp_path) {
+    coap_free_type(COAP_STRING, path);
+    coap_free_type(COAP_STRING, tmp_path);
+    return 0;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COAP_BLOCK_RESUME_MAGIC, sizeof(header.magic));
+  header.key = state->key;
+  header.total_len = state->total_len;
+  header.body_len = state->body_data->length;
+  header.words = state->words;
+  header.first_missing = state->first_missing;
+  header.end = state->end;
+  header.content_format = state->content_format;
+  header.szx = state->szx;
+  header.etag_length = state->etag_length;
+  memcpy(header.etag, state->etag, state->etag_length);
+
+  resume_prune(context, state->key);
+  fp = fopen(tmp_path, "wb");
+  ok = fp &&
+       fwrite(&header, sizeof(header), 1, fp) == 1 &&
+       fwrite(state->bitmap, sizeof(uint32_t), state->words, fp) ==
+         state->words &&
+       fwrite(state->body_data->s, 1, state->body_data->length, fp) ==
+         state->body_data->length;
+  if (fp && fclose(fp) != 0)
+    ok = 0;
+  if (ok && rename(tmp_path, path) == -1)
+    ok = 0;
+  if (!ok) {
+    coap_log(LOG_WARNING, "coap_block_resume_save: %s: %s\n", path,
+             coap_socket_strerror());
+    if (fp)
+      unlink(tmp_path);
+  }
+  else {
+    coap_log(LOG_DEBUG, "** block transfer %s saved at block %u\n", path,
+             state->first_missing);
+  }
+  coap_free_type(COAP_STRING, path);
+  coap_free_type(COAP_STRING, tmp_path);
+  return ok;
+}
+
+int
+coap_block_resume_exists(const coap_context_t *context, uint64_t key) {
+  char *path = resume_path(context, key, "");
+  int ret;
+
+  if (!path)
+    return 0;
+  ret = access(path, R_OK) == 0;
+  coap_free_type(COAP_STRING, path);
+  return ret;
+}
+
+int
+coap_block_resume_load(coap_context_t *context, uint64_t key,
+                       coap_block_resume_t *state) {
+  coap_block_resume_header_t header;
+  char *path = resume_path(context, key, "");
+  FILE *fp;
+  struct stat st;
+  int ok = 0;
+
+  memset(state, 0, sizeof(*state));
+  if (!path)
+    return 0;
+  fp = fopen(path, "rb");
+  if (!fp)
+    goto finish;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, COAP_BLOCK_RESUME_MAGIC,
+             sizeof(header.magic)) != 0 ||
+      header.key != key || header.szx > 6 ||
+      header.etag_length > sizeof(header.etag) ||
+      header.words == 0 || header.words > COAP_RBLOCK_MAX_BLOCKS / 32 ||
+      header.first_missing == 0 || header.first_missing > header.end ||
+      header.end > header.words * 32 ||
+      header.body_len > ((uint64_t)header.words * 32) << (header.szx + 4) ||
+      header.body_len > header.total_len ||
+      (size_t)header.total_len != header.total_len)
+    goto bad;
+  /* Checked before the body is allocated, as the file may not be ours */
+  if (context->max_body_size && header.total_len > context->max_body_size) {
+    coap_log(LOG_WARNING,
+             "coap_block_resume_load: %s: body of %llu bytes is too large\n",
+             path, (unsigned long long)header.total_len);
+    goto bad;
+  }
+  if (fstat(fileno(fp), &st) == -1 ||
+      time(NULL) - st.st_mtime >= COAP_BLOCK_RESUME_TTL)
+    goto bad;
+
+  state->bitmap = coap_malloc_type(COAP_STRING,
+                                   header.words * sizeof(uint32_t));
+  state->body_data = coap_new_binary((size_t)header.total_len);
+  if (!state->bitmap || !state->body_data)
+    goto bad;
+  if (fread(state->bitmap, sizeof(uint32_t), header.words, fp) !=
+        header.words ||
+      fread(state->body_data->s, 1, (size_t)header.body_len, fp) !=
+        header.body_len)
+    goto bad;
+
+  state->key = key;
+  state->total_len = (size_t)header.total_len;
+  state->words = header.words;
+  state->first_missing = header.first_missing;
+  state->end = header.end;
+  state->content_format = header.content_format;
+  state->szx = header.szx;
+  state->etag_length = header.etag_length;
+  memcpy(state->etag, header.etag, header.etag_length);
+  coap_log(LOG_DEBUG, "** block transfer %s resumed at block %u\n", path,
+           state->first_missing);
+  ok = 1;
+  goto finish;
+
+bad:
+  coap_log(LOG_WARNING, "coap_block_resume_load: %s: not usable\n", path);
+  coap_free_type(COAP_STRING, state->bitmap);
+  coap_delete_binary(state->body_data);
+  memset(state, 0, sizeof(*state));
+  unlink(path);
+finish:
+  if (fp)
+    fclose(fp);
+  coap_free_type(COAP_STRING, path);
+  return ok;
+}
+
+void
+coap_block_resume_forget(coap_context_t *context, uint64_t key) {
+  char *path = resume_path(context, key, "");
+
+  if (path) {
+    if (unlink(path) == 0)
+      coap_log(LOG_DEBUG, "** block transfer %s forgotten\n", path);
+    coap_free_type(COAP_STRING, path);
+  }
+}
+
+#else /* ! HAVE_UNISTD_H || WITH_LWIP || WITH_CONTIKI */
+
+int
+coap_context_set_block_resume(coap_context_t *context, const char *dir) {
+  (void)context;
+  if (dir) {
+    coap_log(LOG_WARNING, "coap_context_set_block_resume: not supported\n");
+    return 0;
+  }
+  return 1;
+}
+
+uint64_t
+coap_block_resume_crcv_key(const coap_session_t *session,
+                           const coap_pdu_t *pdu) {
+  (void)session;
+  (void)pdu;
+  return 0;
+}
+
+uint64_t
+coap_block_resume_srcv_key(const coap_session_t *session,
+                           const uint8_t *uri_path, size_t uri_path_len,
+                           size_t total_len, uint16_t content_format) {
+  (void)session;
+  (void)uri_path;
+  (void)uri_path_len;
+  (void)total_len;
+  (void)content_format;
+  return 0;
+}
+
+int
+coap_block_resume_save(coap_context_t *context,
+                       const coap_block_resume_t *state) {
+  (void)context;
+  (void)state;
+  return 0;
+}
+
+int
+coap_block_resume_exists(const coap_context_t *context, uint64_t key) {
+  (void)context;
+  (void)key;
+  return 0;
+}
+
+int
+coap_block_resume_load(coap_context_t *context, uint64_t key,
+                       coap_block_resume_t *state) {
+  (void)context;
+  (void)key;
+  memset(state, 0, sizeof(*state));
+  return 0;
+}
+
+void
+coap_block_resume_forget(coap_context_t *context, uint64_t key) {
+  (void)context;
+  (void)key;
+}
+
+#endif /* ! HAVE_UNISTD_H || WITH_LWIP || WITH_CONTIKI */
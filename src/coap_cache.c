@@ -11,28 +11,9 @@
 /* Determines if the given option_type denotes an option type that can
  * be used as CacheKey. Options that can be cache keys are not Unsafe
  * and not marked explicitly as NoCacheKey. */
-static int
+COAP_STATIC_INLINE int
 is_cache_key(const coap_context_t *ctx, uint16_t option_type) {
-  int nocachekey = (option_type & 0x1e) == 0x1c;
-  size_t i;
-
-  /*
-   * https://tools.ietf.org/html/rfc7641#section-2 Observe is not a
-   * part of the cache-key.
-   */
-  if (option_type == COAP_OPTION_OBSERVE) {
-    nocachekey = 1;
-  }
-
-  /* Check for option user has defined as not part of cache-key */
-  for (i = 0; i < ctx->cache_ignore_count; i++) {
-    if (ctx->cache_ignore_options[i] == option_type) {
-      nocachekey = 1;
-      break;
-    }
-  }
-
-  return nocachekey == 0;
+  return !(coap_option_props(ctx, option_type) & COAP_OPT_PROP_NOCACHEKEY);
 }
 
 int
@@ -51,6 +32,8 @@ coap_cache_ignore_options(coap_context_t *ctx,
     }
     else {
       coap_log(LOG_WARNING, "Unable to create cache_ignore_options\n");
+      ctx->cache_ignore_count = 0;
+      coap_option_props_init(ctx);
       return 0;
     }
   }
@@ -58,39 +41,113 @@ coap_cache_ignore_options(coap_context_t *ctx,
     ctx->cache_ignore_options = NULL;
     ctx->cache_ignore_count = count;
   }
+  coap_option_props_init(ctx);
   return 1;
 }
 
-coap_cache_key_t *
-coap_cache_derive_key(const coap_session_t *session,
-                      const coap_pdu_t *pdu,
-                      coap_cache_session_based_t session_based) {
+/*
+ * A cache-key is built either with the TLS library digest, or with a fast
+ * non-cryptographic 128-bit hash (two 64-bit FNV-1a lanes with different
+ * primes, finished off with a 64-bit mixer) that needs no set up.
+ */
+typedef struct coap_cache_hash_t {
+  coap_digest_ctx_t *dctx;  /**< digest context, or NULL for the fast hash */
+  uint64_t h1;              /**< fast hash lanes */
+  uint64_t h2;
+  uint64_t length;          /**< bytes hashed by the fast hash */
+} coap_cache_hash_t;
+
+static int
+coap_cache_hash_setup(coap_cache_hash_t *hash, const coap_context_t *ctx) {
+  memset(hash, 0, sizeof(*hash));
+  if (ctx->cache_key_hash == COAP_CACHE_KEY_HASH_FAST) {
+    hash->h1 = 0xcbf29ce484222325ULL;
+    hash->h2 = 0x84222325cbf29ce4ULL;
+    return 1;
+  }
+  hash->dctx = coap_digest_setup();
+  return hash->dctx != NULL;
+}
+
+static int
+coap_cache_hash_update(coap_cache_hash_t *hash, const uint8_t *data,
+                       size_t len) {
+  size_t i;
+
+  if (hash->dctx) {
+    if (!coap_digest_update(hash->dctx, data, len)) {
+      coap_digest_free(hash->dctx);
+      return 0;
+    }
+    return 1;
+  }
+  for (i = 0; i < len; i++) {
+    hash->h1 = (hash->h1 ^ data[i]) * 0x100000001b3ULL;
+    hash->h2 = (hash->h2 ^ data[i]) * 0x9e3779b97f4a7c15ULL;
+  }
+  hash->length += len;
+  return 1;
+}
+
+static uint64_t
+coap_cache_hash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int
+coap_cache_hash_final(coap_cache_hash_t *hash, coap_cache_key_t *cache_key) {
+  uint64_t h1, h2;
+
+  if (hash->dctx) {
+    coap_digest_t digest;
+
+    /* coap_digest_final() is guaranteed to free off dctx no matter what */
+    if (!coap_digest_final(hash->dctx, &digest))
+      return 0;
+    memcpy(cache_key->key, digest.key, sizeof(cache_key->key));
+    return 1;
+  }
+  h1 = coap_cache_hash_mix(hash->h1 ^ hash->length);
+  h2 = coap_cache_hash_mix(hash->h2 + h1);
+  h1 += h2;
+  memset(cache_key->key, 0, sizeof(cache_key->key));
+  memcpy(cache_key->key, &h1, sizeof(h1));
+  memcpy(cache_key->key + sizeof(h1), &h2, sizeof(h2));
+  return 1;
+}
+
+int
+coap_cache_derive_key_buf(const coap_session_t *session,
+                          const coap_pdu_t *pdu,
+                          coap_cache_session_based_t session_based,
+                          coap_cache_key_t *cache_key) {
   coap_opt_t *option;
   coap_opt_iterator_t opt_iter;
-  coap_digest_ctx_t *dctx;
-  coap_digest_t digest;
-  coap_cache_key_t *cache_key;
+  coap_cache_hash_t hash;
 
   if (!coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL)) {
-    return NULL;
+    return 0;
   }
 
-  dctx = coap_digest_setup();
-  if (!dctx)
-    return NULL;
+  if (!coap_cache_hash_setup(&hash, session->context))
+    return 0;
 
   if (session_based == COAP_CACHE_IS_SESSION_BASED) {
     /* Include the session ptr */
-    if (!coap_digest_update(dctx, (const uint8_t*)session, sizeof(session))) {
-      coap_digest_free(dctx);
-      return NULL;
+    if (!coap_cache_hash_update(&hash, (const uint8_t*)&session,
+                                sizeof(session))) {
+      return 0;
     }
   }
   while ((option = coap_option_next(&opt_iter))) {
     if (is_cache_key(session->context, opt_iter.type)) {
-      if (!coap_digest_update(dctx, option, coap_opt_size(option))) {
-        coap_digest_free(dctx);
-        return NULL;
+      if (!coap_cache_hash_update(&hash, option, coap_opt_size(option))) {
+        return 0;
       }
     }
   }
@@ -101,34 +158,301 @@ coap_cache_derive_key(const coap_session_t *session,
     size_t len;
     uint8_t *data;
     if (coap_get_data(pdu, &len, &data)) {
-      if (!coap_digest_update(dctx, data, len)) {
-        coap_digest_free(dctx);
-        return NULL;
+      if (!coap_cache_hash_update(&hash, data, len)) {
+        return 0;
       }
     }
   }
 
-  if (!coap_digest_final(dctx, &digest)) {
-    /* coap_digest_final() is guaranteed to free off dctx no matter what */
+  return coap_cache_hash_final(&hash, cache_key);
+}
+
+coap_cache_key_t *
+coap_cache_derive_key(const coap_session_t *session,
+                      const coap_pdu_t *pdu,
+                      coap_cache_session_based_t session_based) {
+  coap_cache_key_t key;
+  coap_cache_key_t *cache_key;
+
+  if (!coap_cache_derive_key_buf(session, pdu, session_based, &key))
     return NULL;
-  }
   cache_key = coap_malloc_type(COAP_CACHE_KEY, sizeof(coap_cache_key_t));
   if (cache_key) {
-    memcpy(cache_key->key, digest.key, sizeof(cache_key->key));
+    memcpy(cache_key, &key, sizeof(key));
   }
   return cache_key;
 }
 
+int
+coap_cache_set_key_hash(coap_context_t *ctx, coap_cache_key_hash_t key_hash) {
+  if (ctx->cache) {
+    coap_log(LOG_WARNING,
+             "coap_cache_set_key_hash: cache entries already exist\n");
+    return 0;
+  }
+  ctx->cache_key_hash = key_hash;
+  return 1;
+}
+
 void
 coap_delete_cache_key(coap_cache_key_t *cache_key) {
   coap_free_type(COAP_CACHE_KEY, cache_key);
 }
 
+#ifndef COAP_WITHOUT_CACHE
+
+
+/*
+ * The cache-entries that have an idle timeout are kept in a pairing heap
+ * (context->cache_timers) ordered by timer_due, the same way as the
+ * session timers.  A lookup moves expire_ticks later without touching the
+ * heap, so an entry that is due is put back if it has been used since.
+ */
+
+/* Melds the two heaps @p a and @p b and returns the new root. */
+static coap_cache_entry_t *
+coap_cache_timer_meld(coap_cache_entry_t *a, coap_cache_entry_t *b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (b->timer_due < a->timer_due) {
+    coap_cache_entry_t *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  /* make b the first child of a */
+  b->timer_prev = a;
+  b->timer_sibling = a->timer_child;
+  if (a->timer_child)
+    a->timer_child->timer_prev = b;
+  a->timer_child = b;
+  return a;
+}
+
+/*
+ * Melds the list of siblings starting at @p first into a single heap using
+ * the standard two pass method and returns the new root.
+ */
+static coap_cache_entry_t *
+coap_cache_timer_merge_pairs(coap_cache_entry_t *first) {
+  coap_cache_entry_t *pairs = NULL;
+  coap_cache_entry_t *root = NULL;
+
+  /* first pass: meld pairs left to right, collect them in reverse order */
+  while (first) {
+    coap_cache_entry_t *a = first;
+    coap_cache_entry_t *b = first->timer_sibling;
+
+    first = b ? b->timer_sibling : NULL;
+    a->timer_prev = a->timer_sibling = NULL;
+    if (b)
+      b->timer_prev = b->timer_sibling = NULL;
+    a = coap_cache_timer_meld(a, b);
+    a->timer_sibling = pairs;
+    pairs = a;
+  }
+
+  /* second pass: meld the pairs right to left */
+  while (pairs) {
+    coap_cache_entry_t *next = pairs->timer_sibling;
+
+    pairs->timer_sibling = NULL;
+    root = coap_cache_timer_meld(root, pairs);
+    pairs = next;
+  }
+  return root;
+}
+
+static void
+coap_cache_timer_cancel(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  if (!entry->in_timers)
+    return;
+  if (entry == ctx->cache_timers) {
+    ctx->cache_timers = coap_cache_timer_merge_pairs(entry->timer_child);
+  } else {
+    if (entry->timer_prev->timer_child == entry)
+      entry->timer_prev->timer_child = entry->timer_sibling;
+    else
+      entry->timer_prev->timer_sibling = entry->timer_sibling;
+    if (entry->timer_sibling)
+      entry->timer_sibling->timer_prev = entry->timer_prev;
+    ctx->cache_timers = coap_cache_timer_meld(ctx->cache_timers,
+                           coap_cache_timer_merge_pairs(entry->timer_child));
+  }
+  entry->timer_child = entry->timer_sibling = entry->timer_prev = NULL;
+  entry->in_timers = 0;
+}
+
+static void
+coap_cache_timer_arm(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  entry->timer_due = entry->expire_ticks;
+  entry->in_timers = 1;
+  ctx->cache_timers = coap_cache_timer_meld(ctx->cache_timers, entry);
+}
+
+/* Marks @p entry as the most recently used */
+static void
+coap_cache_touch(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  if (entry->idle_timeout > 0) {
+    coap_io_ticks(ctx, &entry->expire_ticks);
+    entry->expire_ticks += entry->idle_timeout * COAP_TICKS_PER_SECOND;
+  }
+  if (ctx->cache_lru != entry || entry->lru_next) {
+    DL_DELETE2(ctx->cache_lru, entry, lru_prev, lru_next);
+    DL_APPEND2(ctx->cache_lru, entry, lru_prev, lru_next);
+  }
+}
+
+/*
+ * Deletes the least recently used cache-entries, other than @p keep, until
+ * the cache fits in its configured size.
+ */
+static void
+coap_cache_shrink(coap_context_t *ctx, const coap_cache_entry_t *keep) {
+  while (ctx->cache_max_size && ctx->cache_size > ctx->cache_max_size &&
+         ctx->cache_lru && ctx->cache_lru != keep) {
+    coap_log(LOG_DEBUG, "cache full, deleting least recently used entry\n");
+    coap_cache_free_entry(ctx, ctx->cache_lru);
+  }
+}
+
+/*
+ * Puts @p entry into the hash, the LRU list and (if it has an idle timeout)
+ * the timer heap of @p ctx, making room for it.
+ */
+static void
+coap_cache_add_entry(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  if (entry->idle_timeout > 0) {
+    coap_io_ticks(ctx, &entry->expire_ticks);
+    entry->expire_ticks += entry->idle_timeout * COAP_TICKS_PER_SECOND;
+    coap_cache_timer_arm(ctx, entry);
+  }
+  HASH_ADD(hh, ctx->cache, cache_key[0], sizeof(coap_cache_key_t), entry);
+  DL_APPEND2(ctx->cache_lru, entry, lru_prev, lru_next);
+  ctx->cache_size += entry->size;
+  coap_cache_shrink(ctx, entry);
+}
+
+void
+coap_cache_set_backend(coap_context_t *ctx,
+                       const coap_cache_backend_t *backend) {
+  if (backend && backend->put && backend->get) {
+    ctx->cache_backend = *backend;
+  }
+  else {
+    memset(&ctx->cache_backend, 0, sizeof(ctx->cache_backend));
+  }
+}
+
+/* Copies @p entry to the backend, if there is one */
+static void
+coap_cache_backend_put(coap_context_t *ctx, coap_cache_entry_t *entry) {
+  const coap_pdu_t *pdu = entry->pdu;
+  uint8_t *data;
+  size_t len;
+
+  if (!ctx->cache_backend.put || !pdu)
+    return;
+  len = COAP_CACHE_BACKEND_HDR + 4 + pdu->used_size;
+  data = coap_malloc(len);
+  if (!data)
+    return;
+  data[0] = COAP_CACHE_BACKEND_VERSION;
+  data[1] = (uint8_t)(entry->idle_timeout >> 24);
+  data[2] = (uint8_t)(entry->idle_timeout >> 16);
+  data[3] = (uint8_t)(entry->idle_timeout >> 8);
+  data[4] = (uint8_t)entry->idle_timeout;
+  /* Built here, as the header of a shared PDU must be left alone */
+  data[5] = (uint8_t)(COAP_DEFAULT_VERSION << 6 | (pdu->type & 0x03) << 4 |
+                      (pdu->token_length & 0x0f));
+  data[6] = pdu->code;
+  data[7] = (uint8_t)(pdu->mid >> 8);
+  data[8] = (uint8_t)pdu->mid;
+  if (pdu->used_size)
+    memcpy(data + 9, pdu->token, pdu->used_size);
+  if (ctx->cache_backend.put(ctx->cache_backend.arg, entry->cache_key->key,
+                             sizeof(coap_cache_key_t), data, len,
+                             entry->idle_timeout))
+    entry->shared = 1;
+  else
+    coap_log(LOG_DEBUG, "cache backend did not take the entry\n");
+  coap_free(data);
+}
+
+/*
+ * Fetches the entry for @p cache_key from the backend, if there is one, and
+ * puts it into the cache of @p ctx.
+ */
+static coap_cache_entry_t *
+coap_cache_backend_get(coap_context_t *ctx, const coap_cache_key_t *cache_key) {
+  uint8_t buf[1152];
+  uint8_t *data = buf;
+  size_t len;
+  coap_cache_entry_t *entry = NULL;
+  coap_pdu_t *pdu = NULL;
+
+  if (!ctx->cache_backend.get)
+    return NULL;
+  len = ctx->cache_backend.get(ctx->cache_backend.arg, cache_key->key,
+                               sizeof(coap_cache_key_t), buf, sizeof(buf));
+  if (len > sizeof(buf)) {
+    size_t got;
+
+    data = coap_malloc(len);
+    if (!data)
+      return NULL;
+    got = ctx->cache_backend.get(ctx->cache_backend.arg, cache_key->key,
+                                 sizeof(coap_cache_key_t), data, len);
+    if (got != len)
+      goto fail;
+  }
+  if (len < COAP_CACHE_BACKEND_HDR + 4 ||
+      data[0] != COAP_CACHE_BACKEND_VERSION)
+    goto fail;
+
+  pdu = coap_pdu_init(0, 0, 0, len - COAP_CACHE_BACKEND_HDR);
+  if (!pdu || !coap_pdu_parse(COAP_PROTO_UDP, data + COAP_CACHE_BACKEND_HDR,
+                              len - COAP_CACHE_BACKEND_HDR, pdu)) {
+    coap_log(LOG_DEBUG, "cache backend returned an invalid entry\n");
+    goto fail;
+  }
+  entry = coap_malloc_type(COAP_CACHE_ENTRY, sizeof(coap_cache_entry_t));
+  if (!entry)
+    goto fail;
+  memset(entry, 0, sizeof(coap_cache_entry_t));
+  entry->cache_key = coap_malloc_type(COAP_CACHE_KEY, sizeof(coap_cache_key_t));
+  if (!entry->cache_key) {
+    coap_free_type(COAP_CACHE_ENTRY, entry);
+    entry = NULL;
+    goto fail;
+  }
+  memcpy(entry->cache_key, cache_key, sizeof(coap_cache_key_t));
+  entry->pdu = pdu;
+  entry->shared = 1;
+  entry->idle_timeout = (unsigned int)data[1] << 24 |
+                        (unsigned int)data[2] << 16 |
+                        (unsigned int)data[3] << 8 | data[4];
+  entry->size = sizeof(coap_cache_entry_t) + sizeof(coap_cache_key_t) +
+                sizeof(coap_pdu_t) + pdu->max_hdr_size + pdu->alloc_size;
+  if (data != buf)
+    coap_free(data);
+  coap_cache_add_entry(ctx, entry);
+  return entry;
+
+fail:
+  coap_delete_pdu(pdu);
+  if (data != buf)
+    coap_free(data);
+  return NULL;
+}
+
 coap_cache_entry_t *
 coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
                coap_cache_record_pdu_t record_pdu,
                coap_cache_session_based_t session_based,
                unsigned int idle_timeout) {
+  coap_context_t *ctx = session->context;
   coap_cache_entry_t *entry = coap_malloc_type(COAP_CACHE_ENTRY,
                                                sizeof(coap_cache_entry_t));
   if (!entry) {
@@ -137,33 +461,57 @@ coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
 
   memset(entry, 0, sizeof(coap_cache_entry_t));
   entry->session = session;
-  if (record_pdu == COAP_CACHE_RECORD_PDU) {
+  entry->size = sizeof(coap_cache_entry_t) + sizeof(coap_cache_key_t);
+  if (record_pdu == COAP_CACHE_RECORD_PDU && pdu->ref) {
+    /*
+     * Already shared, so it can no longer change.  Taking a reference only
+     * updates the count, so the PDU is still const to the caller (the cast
+     * is by way of uintptr_t so that -Wcast-qual is not set off).
+     */
+    entry->pdu = coap_pdu_reference((coap_pdu_t *)(uintptr_t)pdu);
+    entry->size += sizeof(coap_pdu_t) + pdu->max_hdr_size + pdu->alloc_size;
+  }
+  else if (record_pdu == COAP_CACHE_RECORD_PDU) {
     entry->pdu = coap_pdu_init(pdu->type, pdu->code, pdu->mid, pdu->alloc_size);
     if (entry->pdu) {
+      uint8_t borrowed;
+      size_t alloc_size;
+
       if (!coap_pdu_resize(entry->pdu, pdu->alloc_size)) {
         coap_delete_pdu(entry->pdu);
         coap_free_type(COAP_CACHE_ENTRY, entry);
         return NULL;
       }
-      /* Need to get the appropriate data across */
+      /* Need to get the appropriate data across, but keep the buffer */
+      borrowed = entry->pdu->borrowed;
+      alloc_size = entry->pdu->alloc_size;
       memcpy(entry->pdu, pdu, offsetof(coap_pdu_t, token));
+      entry->pdu->borrowed = borrowed;
+      entry->pdu->alloc_size = alloc_size;
       memcpy(entry->pdu->token, pdu->token, pdu->used_size);
       /* And adjust all the pointers etc. */
       entry->pdu->data = entry->pdu->token + (pdu->data - pdu->token);
+      entry->size += sizeof(coap_pdu_t) + entry->pdu->max_hdr_size +
+                     entry->pdu->alloc_size;
     }
   }
+  if (ctx->cache_max_size && entry->size > ctx->cache_max_size) {
+    coap_log(LOG_DEBUG, "cache entry larger than the cache\n");
+    coap_delete_pdu(entry->pdu);
+    coap_free_type(COAP_CACHE_ENTRY, entry);
+    return NULL;
+  }
   entry->cache_key = coap_cache_derive_key(session, pdu, session_based);
   if (!entry->cache_key) {
+    coap_delete_pdu(entry->pdu);
     coap_free_type(COAP_CACHE_ENTRY, entry);
     return NULL;
   }
   entry->idle_timeout = idle_timeout;
-  if (idle_timeout > 0) {
-    coap_ticks(&entry->expire_ticks);
-    entry->expire_ticks += idle_timeout * COAP_TICKS_PER_SECOND;
-  }
-
-  HASH_ADD(hh, session->context->cache, cache_key[0], sizeof(coap_cache_key_t), entry);
+  /* A session based cache-key means nothing to another process */
+  if (session_based == COAP_CACHE_NOT_SESSION_BASED)
+    coap_cache_backend_put(ctx, entry);
+  coap_cache_add_entry(ctx, entry);
   return entry;
 }
 
@@ -175,9 +523,11 @@ coap_cache_get_by_key(coap_context_t *ctx, const coap_cache_key_t *cache_key) {
   if (cache_key) {
     HASH_FIND(hh, ctx->cache, cache_key, sizeof(coap_cache_key_t), cache_entry);
   }
-  if (cache_entry && cache_entry->idle_timeout > 0) {
-    coap_ticks(&cache_entry->expire_ticks);
-    cache_entry->expire_ticks += cache_entry->idle_timeout * COAP_TICKS_PER_SECOND;
+  if (cache_entry) {
+    coap_cache_touch(ctx, cache_entry);
+  }
+  else if (cache_key) {
+    cache_entry = coap_cache_backend_get(ctx, cache_key);
   }
   return cache_entry;
 }
@@ -186,19 +536,12 @@ coap_cache_entry_t *
 coap_cache_get_by_pdu(coap_session_t *session,
                       const coap_pdu_t *request,
                       coap_cache_session_based_t session_based) {
-  coap_cache_key_t *cache_key = coap_cache_derive_key(session, request, session_based);
-  coap_cache_entry_t *cache_entry;
+  coap_cache_key_t cache_key;
 
-  if (!cache_key)
+  if (!coap_cache_derive_key_buf(session, request, session_based, &cache_key))
     return NULL;
 
-  cache_entry = coap_cache_get_by_key(session->context, cache_key);
-  coap_delete_cache_key(cache_key);
-  if (cache_entry && cache_entry->idle_timeout > 0) {
-    coap_ticks(&cache_entry->expire_ticks);
-    cache_entry->expire_ticks += cache_entry->idle_timeout * COAP_TICKS_PER_SECOND;
-  }
-  return cache_entry;
+  return coap_cache_get_by_key(session->context, &cache_key);
 }
 
 void
@@ -206,9 +549,25 @@ coap_delete_cache_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
 
   assert(cache_entry);
 
+  if (cache_entry && cache_entry->shared && ctx->cache_backend.remove) {
+    ctx->cache_backend.remove(ctx->cache_backend.arg,
+                              cache_entry->cache_key->key,
+                              sizeof(coap_cache_key_t));
+  }
+  coap_cache_free_entry(ctx, cache_entry);
+}
+
+void
+coap_cache_free_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
+
+  assert(cache_entry);
+
   if (cache_entry) {
     HASH_DELETE(hh, ctx->cache, cache_entry);
   }
+  DL_DELETE2(ctx->cache_lru, cache_entry, lru_prev, lru_next);
+  coap_cache_timer_cancel(ctx, cache_entry);
+  ctx->cache_size -= cache_entry->size;
   if (cache_entry->pdu) {
     coap_delete_pdu(cache_entry->pdu);
   }
@@ -219,6 +578,12 @@ coap_delete_cache_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
   coap_free_type(COAP_CACHE_ENTRY, cache_entry);
 }
 
+void
+coap_cache_set_max_size(coap_context_t *ctx, size_t max_size) {
+  ctx->cache_max_size = max_size;
+  coap_cache_shrink(ctx, NULL);
+}
+
 const coap_pdu_t *
 coap_cache_get_pdu(const coap_cache_entry_t *cache_entry) {
         return cache_entry->pdu;
@@ -240,15 +605,333 @@ coap_cache_get_app_data(const coap_cache_entry_t *cache_entry) {
 void
 coap_expire_cache_entries(coap_context_t *ctx) {
   coap_tick_t now;
-  coap_cache_entry_t *cp, *ctmp;
+  coap_cache_entry_t *cp;
+
+  if (!ctx->cache_timers)
+    return;
+  coap_io_ticks(ctx, &now);
+  while ((cp = ctx->cache_timers) != NULL && cp->timer_due <= now) {
+    coap_cache_timer_cancel(ctx, cp);
+    if (cp->expire_ticks <= now) {
+      coap_cache_free_entry(ctx, cp);
+    }
+    else {
+      /* Used since it was armed */
+      coap_cache_timer_arm(ctx, cp);
+    }
+  }
+}
+
+/* Upper limit of responses kept for a single resource */
+#define COAP_CACHE_MAX_RESOURCE_RESPONSES 16
+
+/*
+ * Requests that are part of an observation or a block-wise transfer have
+ * to be seen by the handler, so they are never answered from the cache.
+ */
+static int
+coap_cache_request_cacheable(const coap_resource_t *resource,
+                             coap_pdu_t *request) {
+  coap_opt_iterator_t opt_iter;
 
-  coap_ticks(&now);
-  HASH_ITER(hh, ctx->cache, cp, ctmp) {
-    if (cp->idle_timeout > 0) {
-      if (cp->expire_ticks <= now) {
-        coap_delete_cache_entry(ctx, cp);
+  if (!(resource->flags & COAP_RESOURCE_FLAGS_CACHE_RESPONSES))
+    return 0;
+  if (request->code != COAP_REQUEST_GET && request->code != COAP_REQUEST_FETCH)
+    return 0;
+  if (coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_BLOCK1, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_BLOCK2, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_Q_BLOCK1, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter))
+    return 0;
+  return 1;
+}
+
+static void
+coap_cache_free_response(coap_cache_entry_t *entry) {
+  coap_delete_pdu(entry->pdu);
+  coap_delete_cache_key(entry->cache_key);
+  coap_free_type(COAP_CACHE_ENTRY, entry);
+}
+
+/*
+ * Removes the stale responses of @p resource and returns the fresh one
+ * cached for @p cache_key and @p code, if any.
+ */
+static coap_cache_entry_t *
+coap_cache_find_response(coap_resource_t *resource,
+                         const coap_cache_key_t *cache_key, uint8_t code,
+                         coap_tick_t now) {
+  coap_cache_entry_t **pp = &resource->cached_responses;
+  coap_cache_entry_t *found = NULL;
+
+  while (*pp) {
+    coap_cache_entry_t *entry = *pp;
+
+    if (entry->fresh_ticks <= now) {
+      *pp = entry->rnext;
+      coap_cache_free_response(entry);
+      continue;
+    }
+    if (!found && entry->request_code == code &&
+        memcmp(entry->cache_key->key, cache_key->key,
+               sizeof(cache_key->key)) == 0)
+      found = entry;
+    pp = &entry->rnext;
+  }
+  return found;
+}
+
+int
+coap_cache_fill_response(coap_session_t *session,
+                         coap_resource_t *resource,
+                         coap_pdu_t *request,
+                         coap_pdu_t *response) {
+  coap_cache_key_t cache_key;
+  coap_cache_entry_t *entry;
+  coap_tick_t now;
+  uint8_t buf[4];
+
+  if (!resource->cached_responses ||
+      !coap_cache_request_cacheable(resource, request))
+    return 0;
+
+  if (!coap_cache_derive_key_buf(session, request,
+                                 COAP_CACHE_NOT_SESSION_BASED, &cache_key))
+    return 0;
+  coap_io_ticks(session->context, &now);
+  entry = coap_cache_find_response(resource, &cache_key, request->code, now);
+  if (!entry)
+    return 0;
+
+  /* The response may have been cached for a session with larger PDUs */
+  if (!coap_pdu_copy_body(response, entry->pdu))
+    goto fail;
+  response->code = entry->pdu->code;
+  /* The client may only keep the response for as long as is left */
+  if (!coap_update_option(response, COAP_OPTION_MAXAGE,
+                          coap_encode_var_safe(buf, sizeof(buf),
+                            (unsigned int)((entry->fresh_ticks - now) /
+                                           COAP_TICKS_PER_SECOND)),
+                          buf))
+    goto fail;
+  coap_log(LOG_DEBUG, "answered request for resource '%*.*s' from cache\n",
+           (int)resource->uri_path->length, (int)resource->uri_path->length,
+           resource->uri_path->s);
+  return 1;
+
+fail:
+  /* Leave the response as the handler expects to find it */
+  response->code = 0;
+  response->used_size = response->token_length;
+  response->max_opt = 0;
+  response->data = NULL;
+  return 0;
+}
+
+void
+coap_cache_store_response(coap_session_t *session,
+                          coap_resource_t *resource,
+                          coap_pdu_t *request,
+                          coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_cache_key_t cache_key;
+  coap_cache_entry_t *entry;
+  coap_tick_t now;
+  unsigned int max_age = COAP_DEFAULT_MAX_AGE;
+  unsigned int count;
+
+  if (response->code != COAP_RESPONSE_CODE(205) || response->xmit_length ||
+      !coap_cache_request_cacheable(resource, request) ||
+      coap_check_option(response, COAP_OPTION_BLOCK2, &opt_iter) ||
+      coap_check_option(response, COAP_OPTION_Q_BLOCK2, &opt_iter))
+    return;
+
+  opt = coap_check_option(response, COAP_OPTION_MAXAGE, &opt_iter);
+  if (opt)
+    max_age = coap_decode_var_bytes(coap_opt_value(opt), coap_opt_length(opt));
+  if (max_age == 0)
+    return;
+
+  if (!coap_cache_derive_key_buf(session, request,
+                                 COAP_CACHE_NOT_SESSION_BASED, &cache_key))
+    return;
+  coap_io_ticks(session->context, &now);
+  if (coap_cache_find_response(resource, &cache_key, request->code, now)) {
+    /* Already cached by an earlier identical request */
+    return;
+  }
+
+  entry = coap_malloc_type(COAP_CACHE_ENTRY, sizeof(coap_cache_entry_t));
+  if (!entry)
+    return;
+  memset(entry, 0, sizeof(coap_cache_entry_t));
+  entry->cache_key = coap_malloc_type(COAP_CACHE_KEY,
+                                      sizeof(coap_cache_key_t));
+  if (entry->cache_key)
+    memcpy(entry->cache_key, &cache_key, sizeof(cache_key));
+  if (!entry->cache_key) {
+    coap_cache_free_response(entry);
+    return;
+  }
+  /*
+   * The response is not changed once it has been built, so is shared with
+   * the retransmission queue rather than copied.  Only its options and
+   * payload are used.
+   */
+  entry->pdu = coap_pdu_reference(response);
+  entry->resource = resource;
+  entry->request_code = request->code;
+  entry->fresh_ticks = now + (coap_tick_t)max_age * COAP_TICKS_PER_SECOND;
+
+  /* Newest first, dropping the oldest once the resource has too many */
+  entry->rnext = resource->cached_responses;
+  resource->cached_responses = entry;
+  for (count = 1; entry->rnext; count++) {
+    if (count == COAP_CACHE_MAX_RESOURCE_RESPONSES) {
+      coap_cache_entry_t *rest = entry->rnext;
+
+      entry->rnext = NULL;
+      while (rest) {
+        coap_cache_entry_t *next = rest->rnext;
+
+        coap_cache_free_response(rest);
+        rest = next;
       }
+      break;
     }
+    entry = entry->rnext;
+  }
+}
+
+void
+coap_cache_invalidate_resource(coap_resource_t *resource) {
+  coap_cache_entry_t *entry = resource->cached_responses;
+
+  resource->cached_responses = NULL;
+  while (entry) {
+    coap_cache_entry_t *next = entry->rnext;
+
+    coap_cache_free_response(entry);
+    entry = next;
   }
 }
 
+#else /* COAP_WITHOUT_CACHE */
+
+/*
+ * Only the cache-keys are left, so that the forward proxy and applications
+ * can still match requests.  Nothing is ever cached.
+ */
+
+void
+coap_cache_set_backend(coap_context_t *ctx,
+                       const coap_cache_backend_t *backend) {
+  (void)ctx;
+  (void)backend;
+}
+
+coap_cache_entry_t *
+coap_new_cache_entry(coap_session_t *session, const coap_pdu_t *pdu,
+               coap_cache_record_pdu_t record_pdu,
+               coap_cache_session_based_t session_based,
+               unsigned int idle_timeout) {
+  (void)session;
+  (void)pdu;
+  (void)record_pdu;
+  (void)session_based;
+  (void)idle_timeout;
+  coap_log(LOG_DEBUG, "coap_new_cache_entry: not supported\n");
+  return NULL;
+}
+
+coap_cache_entry_t *
+coap_cache_get_by_key(coap_context_t *ctx, const coap_cache_key_t *cache_key) {
+  (void)ctx;
+  (void)cache_key;
+  return NULL;
+}
+
+coap_cache_entry_t *
+coap_cache_get_by_pdu(coap_session_t *session,
+                      const coap_pdu_t *request,
+                      coap_cache_session_based_t session_based) {
+  (void)session;
+  (void)request;
+  (void)session_based;
+  return NULL;
+}
+
+void
+coap_delete_cache_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
+  (void)ctx;
+  (void)cache_entry;
+}
+
+void
+coap_cache_free_entry(coap_context_t *ctx, coap_cache_entry_t *cache_entry) {
+  (void)ctx;
+  (void)cache_entry;
+}
+
+void
+coap_cache_set_max_size(coap_context_t *ctx, size_t max_size) {
+  ctx->cache_max_size = max_size;
+}
+
+const coap_pdu_t *
+coap_cache_get_pdu(const coap_cache_entry_t *cache_entry) {
+  (void)cache_entry;
+  return NULL;
+}
+
+void
+coap_cache_set_app_data(coap_cache_entry_t *cache_entry,
+                        void *data,
+                        coap_cache_app_data_free_callback_t callback) {
+  (void)cache_entry;
+  (void)data;
+  (void)callback;
+}
+
+void *
+coap_cache_get_app_data(const coap_cache_entry_t *cache_entry) {
+  (void)cache_entry;
+  return NULL;
+}
+
+void
+coap_expire_cache_entries(coap_context_t *ctx) {
+  (void)ctx;
+}
+
+int
+coap_cache_fill_response(coap_session_t *session,
+                         coap_resource_t *resource,
+                         coap_pdu_t *request,
+                         coap_pdu_t *response) {
+  (void)session;
+  (void)resource;
+  (void)request;
+  (void)response;
+  return 0;
+}
+
+void
+coap_cache_store_response(coap_session_t *session,
+                          coap_resource_t *resource,
+                          coap_pdu_t *request,
+                          coap_pdu_t *response) {
+  (void)session;
+  (void)resource;
+  (void)request;
+  (void)response;
+}
+
+void
+coap_cache_invalidate_resource(coap_resource_t *resource) {
+  (void)resource;
+}
+
+#endif /* COAP_WITHOUT_CACHE */
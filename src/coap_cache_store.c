@@ -0,0 +1,513 @@
+/* coap_cache_store.c -- Persistent store for cache-entries
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#if !defined(COAP_WITHOUT_CACHE) && \
+    defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_LOCK)
+#include <pthread.h>
+#define COAP_CACHE_STORE_LOCKED 1
+#else
+#define COAP_CACHE_STORE_LOCKED 0
+#endif
+
+/*
+ * The store is a single file of a fixed size that is mapped in: a header,
+ * then a hash index of record offsets (open addressing, linear probing)
+ * and then an append-only log of records.  A replaced or removed record is
+ * only marked dead, and its space comes back when the live records are
+ * copied into a new file by coap_cache_store_compact(), which also happens
+ * when the log is full.  The numbers are in host byte order, as the file
+ * is not meant to be moved to another machine.
+ */
+#define COAP_CACHE_STORE_MAGIC "coapcst1"
+#define COAP_CACHE_STORE_EMPTY 0    /* index slot never used */
+#define COAP_CACHE_STORE_DELETED 1  /* index slot of a removed record */
+#define COAP_CACHE_STORE_MIN_LOG 4096
+
+typedef struct coap_cache_store_header_t {
+  char magic[8];
+  uint64_t size;           /* of the file */
+  uint64_t buckets;        /* slots in the index, a power of 2 */
+  uint64_t used;           /* slots that are not empty */
+  uint64_t log_start;      /* offset of the first record */
+  uint64_t log_end;        /* offset the next record goes to */
+} coap_cache_store_header_t;
+
+typedef struct coap_cache_store_record_t {
+  uint32_t length;         /* of the whole record, a multiple of 8 */
+  uint32_t data_len;
+  int64_t expires;         /* time_t it expires at, or 0 if never */
+  uint8_t key_len;
+  uint8_t dead;
+  uint8_t pad[6];
+  /* followed by the key and then the data */
+} coap_cache_store_record_t;
+
+struct coap_cache_store_t {
+#if COAP_CACHE_STORE_LOCKED
+  pthread_mutex_t mutex;   /* the store may be compacted by another thread */
+#endif /* COAP_CACHE_STORE_LOCKED */
+  char *path;
+  int fd;
+  uint8_t *map;
+  size_t size;
+};
+
+#define STORE_HEADER(store) ((coap_cache_store_header_t *)(store)->map)
+#define STORE_INDEX(store) \
+  ((uint64_t *)((store)->map + sizeof(coap_cache_store_header_t)))
+#define STORE_RECORD(store, offset) \
+  ((coap_cache_store_record_t *)((store)->map + (offset)))
+#define STORE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+#if COAP_CACHE_STORE_LOCKED
+#define STORE_LOCK(store) pthread_mutex_lock(&(store)->mutex)
+#define STORE_UNLOCK(store) pthread_mutex_unlock(&(store)->mutex)
+#else /* ! COAP_CACHE_STORE_LOCKED */
+#define STORE_LOCK(store)
+#define STORE_UNLOCK(store)
+#endif /* ! COAP_CACHE_STORE_LOCKED */
+
+static uint64_t
+store_hash(const uint8_t *key, size_t key_len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < key_len; i++) {
+    h ^= key[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/*
+ * Returns the index slot of the record for @p key, or the slot it would go
+ * into (the first deleted one on the way, if any) with *found cleared.
+ */
+static uint64_t *
+store_find(coap_cache_store_t *store, const uint8_t *key, size_t key_len,
+           int *found) {
+  coap_cache_store_header_t *header = STORE_HEADER(store);
+  uint64_t *index = STORE_INDEX(store);
+  uint64_t mask = header->buckets - 1;
+  uint64_t i = store_hash(key, key_len) & mask;
+  uint64_t *free_slot = NULL;
+  uint64_t n;
+
+  *found = 0;
+  for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    coap_cache_store_record_t *record;
+
+    if (index[i] == COAP_CACHE_STORE_EMPTY)
+      return free_slot ? free_slot : &index[i];
+    if (index[i] == COAP_CACHE_STORE_DELETED) {
+      if (!free_slot)
+        free_slot = &index[i];
+      continue;
+    }
+    record = STORE_RECORD(store, index[i]);
+    if (record->key_len == key_len &&
+        memcmp(record + 1, key, key_len) == 0) {
+      *found = 1;
+      return &index[i];
+    }
+  }
+  return free_slot;
+}
+
+static void
+store_kill(coap_cache_store_t *store, uint64_t *slot) {
+  STORE_RECORD(store, *slot)->dead = 1;
+  *slot = COAP_CACHE_STORE_DELETED;
+}
+
+/* Lays out an empty store in @p map of @p size bytes */
+static int
+store_format(uint8_t *map, size_t size) {
+  coap_cache_store_header_t *header = (coap_cache_store_header_t *)map;
+  uint64_t buckets = 64;
+
+  /* Room for an entry of about 512 bytes per slot, at half load */
+  while (buckets * 256 < size)
+    buckets <<= 1;
+  if (sizeof(*header) + buckets * 8 + COAP_CACHE_STORE_MIN_LOG > size)
+    return 0;
+  memset(map, 0, sizeof(*header) + buckets * 8);
+  memcpy(header->magic, COAP_CACHE_STORE_MAGIC, sizeof(header->magic));
+  header->size = size;
+  header->buckets = buckets;
+  header->log_start = header->log_end = sizeof(*header) + buckets * 8;
+  return 1;
+}
+
+static int
+store_valid(const uint8_t *map, size_t size) {
+  const coap_cache_store_header_t *header =
+                                     (const coap_cache_store_header_t *)map;
+
+  return memcmp(header->magic, COAP_CACHE_STORE_MAGIC,
+                sizeof(header->magic)) == 0 &&
+         header->size == size && header->buckets >= 64 &&
+         (header->buckets & (header->buckets - 1)) == 0 &&
+         header->log_start == sizeof(*header) + header->buckets * 8 &&
+         header->log_end >= header->log_start && header->log_end <= size;
+}
+
+/* Creates and maps a file of @p size bytes, returning the map or NULL */
+static uint8_t *
+store_map(const char *path, size_t size, int *fd, int *existing) {
+  struct stat st;
+  uint8_t *map;
+
+  *fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (*fd == -1)
+    return NULL;
+  if (fstat(*fd, &st) == -1)
+    goto fail;
+  *existing = (size_t)st.st_size == size;
+  if (!*existing && ftruncate(*fd, (off_t)size) == -1)
+    goto fail;
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  return map;
+
+fail:
+  close(*fd);
+  *fd = -1;
+  return NULL;
+}
+
+coap_cache_store_t *
+coap_cache_store_open(const char *path, size_t size) {
+  coap_cache_store_t *store;
+  size_t length = strlen(path);
+  int existing;
+
+  store = coap_malloc(sizeof(coap_cache_store_t));
+  if (!store)
+    return NULL;
+  memset(store, 0, sizeof(coap_cache_store_t));
+#if COAP_CACHE_STORE_LOCKED
+  pthread_mutex_init(&store->mutex, NULL);
+#endif /* COAP_CACHE_STORE_LOCKED */
+  store->fd = -1;
+  store->size = size;
+  store->path = coap_malloc(length + 1);
+  if (!store->path)
+    goto fail;
+  memcpy(store->path, path, length + 1);
+  store->map = store_map(path, size, &store->fd, &existing);
+  if (!store->map) {
+    coap_log(LOG_WARNING, "coap_cache_store_open: cannot map %s\n", path);
+    goto fail;
+  }
+  if (!existing || !store_valid(store->map, size)) {
+    if (!store_format(store->map, size)) {
+      coap_log(LOG_WARNING, "coap_cache_store_open: %zu bytes is too small\n",
+               size);
+      if (!existing)
+        unlink(path);
+      goto fail;
+    }
+  }
+  else {
+    coap_log(LOG_DEBUG, "coap_cache_store_open: reusing %s\n", path);
+  }
+  return store;
+
+fail:
+  coap_cache_store_close(store);
+  return NULL;
+}
+
+void
+coap_cache_store_close(coap_cache_store_t *store) {
+  if (!store)
+    return;
+  if (store->map) {
+    msync(store->map, store->size, MS_SYNC);
+    munmap(store->map, store->size);
+  }
+  if (store->fd != -1)
+    close(store->fd);
+  coap_free(store->path);
+#if COAP_CACHE_STORE_LOCKED
+  pthread_mutex_destroy(&store->mutex);
+#endif /* COAP_CACHE_STORE_LOCKED */
+  coap_free(store);
+}
+
+/* Appends a record to the log, returning its offset or 0 if it is full */
+static uint64_t
+store_append(coap_cache_store_t *store, const uint8_t *key, size_t key_len,
+             const uint8_t *data, size_t len, int64_t expires) {
+  coap_cache_store_header_t *header = STORE_HEADER(store);
+  coap_cache_store_record_t *record;
+  size_t length = STORE_ALIGN(sizeof(*record) + key_len + len);
+  uint64_t offset = header->log_end;
+
+  if (length > header->size - offset)
+    return 0;
+  record = STORE_RECORD(store, offset);
+  memset(record, 0, sizeof(*record));
+  record->length = (uint32_t)length;
+  record->data_len = (uint32_t)len;
+  record->expires = expires;
+  record->key_len = (uint8_t)key_len;
+  memcpy(record + 1, key, key_len);
+  memcpy((uint8_t *)(record + 1) + key_len, data, len);
+  header->log_end += length;
+  return offset;
+}
+
+/*
+ * Copies the live records into a new file, which then replaces the old
+ * one.  Called with the lock held.
+ */
+static int
+store_compact(coap_cache_store_t *store) {
+  coap_cache_store_t new_store;
+  coap_cache_store_header_t *header = STORE_HEADER(store);
+  char *tmpname;
+  size_t length = strlen(store->path);
+  int64_t now = (int64_t)time(NULL);
+  uint64_t offset;
+  int existing;
+  size_t kept = 0;
+
+  tmpname = coap_malloc(length + sizeof(".tmp"));
+  if (!tmpname)
+    return 0;
+  memcpy(tmpname, store->path, length);
+  memcpy(tmpname + length, ".tmp", sizeof(".tmp"));
+  unlink(tmpname);
+  new_store = *store;
+  new_store.map = store_map(tmpname, store->size, &new_store.fd, &existing);
+  if (!new_store.map)
+    goto fail;
+  store_format(new_store.map, store->size);
+
+  for (offset = header->log_start; offset < header->log_end;
+       offset += STORE_RECORD(store, offset)->length) {
+    coap_cache_store_record_t *record = STORE_RECORD(store, offset);
+    const uint8_t *key = (const uint8_t *)(record + 1);
+    uint64_t *slot;
+    uint64_t new_offset;
+    int found;
+
+    if (record->length == 0)
+      break;
+    if (record->dead || (record->expires && record->expires <= now))
+      continue;
+    slot = store_find(&new_store, key, record->key_len, &found);
+    new_offset = store_append(&new_store, key, record->key_len,
+                              key + record->key_len, record->data_len,
+                              record->expires);
+    if (!slot || !new_offset)
+      break;
+    if (*slot == COAP_CACHE_STORE_EMPTY)
+      STORE_HEADER(&new_store)->used++;
+    *slot = new_offset;
+    kept++;
+  }
+
+  if (msync(new_store.map, store->size, MS_SYNC) == -1 ||
+      rename(tmpname, store->path) == -1) {
+    munmap(new_store.map, store->size);
+    close(new_store.fd);
+    unlink(tmpname);
+    goto fail;
+  }
+  munmap(store->map, store->size);
+  close(store->fd);
+  store->map = new_store.map;
+  store->fd = new_store.fd;
+  coap_free(tmpname);
+  coap_log(LOG_DEBUG, "coap_cache_store_compact: %zu records kept\n", kept);
+  return 1;
+
+fail:
+  coap_log(LOG_WARNING, "coap_cache_store_compact: cannot write %s\n",
+           tmpname);
+  coap_free(tmpname);
+  return 0;
+}
+
+int
+coap_cache_store_compact(coap_cache_store_t *store) {
+  int ret;
+
+  STORE_LOCK(store);
+  ret = store_compact(store);
+  STORE_UNLOCK(store);
+  return ret;
+}
+
+/*
+ * When the entry expires: after @p ttl seconds, and for a response no later
+ * than its Max-Age says.
+ */
+static int64_t
+store_expires(const uint8_t *data, size_t len, unsigned int ttl) {
+  int64_t now = (int64_t)time(NULL);
+  int64_t expires = ttl ? now + ttl : 0;
+  coap_pdu_t *pdu;
+
+  if (len <= COAP_CACHE_BACKEND_HDR ||
+      data[0] != COAP_CACHE_BACKEND_VERSION)
+    return expires;
+  pdu = coap_pdu_init(0, 0, 0, len - COAP_CACHE_BACKEND_HDR);
+  if (pdu && coap_pdu_parse(COAP_PROTO_UDP, data + COAP_CACHE_BACKEND_HDR,
+                            len - COAP_CACHE_BACKEND_HDR, pdu) &&
+      COAP_PDU_IS_RESPONSE(pdu)) {
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *opt = coap_check_option(pdu, COAP_OPTION_MAXAGE, &opt_iter);
+    unsigned int max_age = opt ? coap_decode_var_bytes(coap_opt_value(opt),
+                                                       coap_opt_length(opt))
+                               : COAP_DEFAULT_MAX_AGE;
+
+    /* 0 would be never, so a Max-Age of 0 is kept for a second */
+    if (!expires || now + max_age < expires)
+      expires = now + (max_age ? max_age : 1);
+  }
+  coap_delete_pdu(pdu);
+  return expires;
+}
+
+static int
+store_put(void *arg, const uint8_t *key, size_t key_len,
+          const uint8_t *data, size_t len, unsigned int ttl) {
+  coap_cache_store_t *store = (coap_cache_store_t *)arg;
+  coap_cache_store_header_t *header;
+  int64_t expires = store_expires(data, len, ttl);
+  uint64_t *slot;
+  uint64_t offset;
+  int found;
+  int ret = 0;
+
+  if (key_len > 255 || len > UINT32_MAX / 2)
+    return 0;
+  STORE_LOCK(store);
+  header = STORE_HEADER(store);
+  slot = store_find(store, key, key_len, &found);
+  if (found)
+    store_kill(store, slot);
+  /* Keep the index at most three quarters full, counting deleted slots */
+  if (header->used >= header->buckets / 4 * 3 ||
+      STORE_ALIGN(sizeof(coap_cache_store_record_t) + key_len + len) >
+      header->size - header->log_end) {
+    if (!store_compact(store))
+      goto done;
+    header = STORE_HEADER(store);
+    if (header->used >= header->buckets / 4 * 3)
+      goto done;
+    slot = store_find(store, key, key_len, &found);
+  }
+  offset = store_append(store, key, key_len, data, len, expires);
+  if (!slot || !offset)
+    goto done;
+  if (*slot == COAP_CACHE_STORE_EMPTY)
+    header->used++;
+  *slot = offset;
+  ret = 1;
+
+done:
+  STORE_UNLOCK(store);
+  return ret;
+}
+
+static size_t
+store_get(void *arg, const uint8_t *key, size_t key_len,
+          uint8_t *data, size_t max_len) {
+  coap_cache_store_t *store = (coap_cache_store_t *)arg;
+  coap_cache_store_record_t *record;
+  uint64_t *slot;
+  size_t len = 0;
+  int found;
+
+  STORE_LOCK(store);
+  slot = store_find(store, key, key_len, &found);
+  if (found) {
+    record = STORE_RECORD(store, *slot);
+    if (record->expires && record->expires <= (int64_t)time(NULL)) {
+      store_kill(store, slot);
+    }
+    else {
+      len = record->data_len;
+      if (len <= max_len)
+        memcpy(data, (const uint8_t *)(record + 1) + key_len, len);
+    }
+  }
+  STORE_UNLOCK(store);
+  return len;
+}
+
+static void
+store_remove(void *arg, const uint8_t *key, size_t key_len) {
+  coap_cache_store_t *store = (coap_cache_store_t *)arg;
+  uint64_t *slot;
+  int found;
+
+  STORE_LOCK(store);
+  slot = store_find(store, key, key_len, &found);
+  if (found)
+    store_kill(store, slot);
+  STORE_UNLOCK(store);
+}
+
+void
+coap_cache_set_store(coap_context_t *context, coap_cache_store_t *store) {
+  coap_cache_backend_t backend;
+
+  if (!store) {
+    coap_cache_set_backend(context, NULL);
+    return;
+  }
+  backend.put = store_put;
+  backend.get = store_get;
+  backend.remove = store_remove;
+  backend.arg = store;
+  coap_cache_set_backend(context, &backend);
+}
+
+#else /* COAP_WITHOUT_CACHE || ! (HAVE_MMAP && ...) */
+
+coap_cache_store_t *
+coap_cache_store_open(const char *path, size_t size) {
+  (void)path;
+  (void)size;
+  coap_log(LOG_WARNING, "coap_cache_store_open: not supported\n");
+  return NULL;
+}
+
+void
+coap_cache_store_close(coap_cache_store_t *store) {
+  (void)store;
+}
+
+int
+coap_cache_store_compact(coap_cache_store_t *store) {
+  (void)store;
+  return 0;
+}
+
+void
+coap_cache_set_store(coap_context_t *context, coap_cache_store_t *store) {
+  (void)store;
+  coap_cache_set_backend(context, NULL);
+}
+
+#endif /* COAP_WITHOUT_CACHE || ! (HAVE_MMAP && ...) */
@@ -0,0 +1,172 @@
+/* coap_catalog.c -- Storage of the compact resources of a context
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The compact resources of a context take their URI paths, attributes and
+ * handler sets from here rather than from separate heap allocations.  All
+ * of it lives in an arena that is only released with the context.  The
+ * attribute names and values are interned through an open-addressing table
+ * of string pointers, so that a catalog of millions of resources keeps only
+ * one copy of each "rt" or "ct" value.  The handler sets are hashed by the
+ * handlers they hold, so that resources registered with the same handlers
+ * point to the same set.
+ */
+typedef struct coap_catalog_handlers_t {
+  UT_hash_handle hh;
+  coap_method_handler_t handler[COAP_RESOURCE_METHODS]; /* key */
+} coap_catalog_handlers_t;
+
+struct coap_catalog_t {
+  coap_arena_t arena;
+  coap_str_const_t **strings;        /* interned strings, NULL if empty */
+  size_t string_count;
+  size_t string_mask;                /* number of slots - 1, or 0 if none */
+  coap_catalog_handlers_t *handler_sets;
+  coap_catalog_handlers_t *last_set; /* most recently asked for */
+};
+
+#define COAP_CATALOG_MIN_SLOTS 256
+
+coap_catalog_t *
+coap_catalog_get(coap_context_t *context) {
+  coap_catalog_t *catalog = context->catalog;
+
+  if (catalog)
+    return catalog;
+  catalog = coap_malloc_type(COAP_STRING, sizeof(coap_catalog_t));
+  if (!catalog)
+    return NULL;
+  memset(catalog, 0, sizeof(coap_catalog_t));
+  coap_arena_init(&catalog->arena, NULL, 0);
+  catalog->arena.block_size = COAP_CATALOG_BLOCK_SIZE;
+  context->catalog = catalog;
+  return catalog;
+}
+
+void
+coap_catalog_free(coap_context_t *context) {
+  coap_catalog_t *catalog = context->catalog;
+
+  if (!catalog)
+    return;
+  HASH_CLEAR(hh, catalog->handler_sets);
+  coap_free_type(COAP_STRING, catalog->strings);
+  coap_arena_release(&catalog->arena);
+  coap_free_type(COAP_STRING, catalog);
+  context->catalog = NULL;
+}
+
+void *
+coap_catalog_alloc(coap_catalog_t *catalog, size_t size) {
+  return coap_arena_alloc(&catalog->arena, size);
+}
+
+coap_str_const_t *
+coap_catalog_copy(coap_catalog_t *catalog, const uint8_t *s, size_t length) {
+  coap_str_const_t *str;
+  uint8_t *p;
+
+  str = coap_arena_alloc(&catalog->arena, sizeof(coap_str_const_t) +
+                                          length + 1);
+  if (!str)
+    return NULL;
+  p = (uint8_t *)str + sizeof(coap_str_const_t);
+  if (length)
+    memcpy(p, s, length);
+  p[length] = '\000';
+  str->s = p;
+  str->length = length;
+  return str;
+}
+
+/* Returns the slot of the string @p s, or the empty slot it is to go in */
+static size_t
+coap_catalog_slot(const coap_catalog_t *catalog, const uint8_t *s,
+                  size_t length) {
+  size_t i = coap_uthash_hash(s, length) & catalog->string_mask;
+
+  while (catalog->strings[i] &&
+         (catalog->strings[i]->length != length ||
+          memcmp(catalog->strings[i]->s, s, length) != 0))
+    i = (i + 1) & catalog->string_mask;
+  return i;
+}
+
+static int
+coap_catalog_grow(coap_catalog_t *catalog) {
+  size_t slots = catalog->string_mask ? (catalog->string_mask + 1) * 2 :
+                                        COAP_CATALOG_MIN_SLOTS;
+  coap_catalog_t grown = *catalog;
+  size_t i;
+
+  if (slots > SIZE_MAX / sizeof(coap_str_const_t *))
+    return 0;
+  grown.strings = coap_malloc_type(COAP_STRING,
+                                   slots * sizeof(coap_str_const_t *));
+  if (!grown.strings)
+    return 0;
+  memset(grown.strings, 0, slots * sizeof(coap_str_const_t *));
+  grown.string_mask = slots - 1;
+  for (i = 0; catalog->string_mask && i <= catalog->string_mask; i++) {
+    coap_str_const_t *str = catalog->strings[i];
+
+    if (str)
+      grown.strings[coap_catalog_slot(&grown, str->s, str->length)] = str;
+  }
+  coap_free_type(COAP_STRING, catalog->strings);
+  catalog->strings = grown.strings;
+  catalog->string_mask = grown.string_mask;
+  return 1;
+}
+
+coap_str_const_t *
+coap_catalog_intern(coap_catalog_t *catalog, const uint8_t *s,
+                    size_t length) {
+  coap_str_const_t *str;
+  size_t i;
+
+  if ((!catalog->string_mask ||
+       catalog->string_count == (catalog->string_mask + 1) / 4 * 3) &&
+      !coap_catalog_grow(catalog))
+    return NULL;
+  i = coap_catalog_slot(catalog, s, length);
+  if (catalog->strings[i])
+    return catalog->strings[i];
+  str = coap_catalog_copy(catalog, s, length);
+  if (!str)
+    return NULL;
+  catalog->strings[i] = str;
+  catalog->string_count++;
+  return str;
+}
+
+coap_method_handler_t *
+coap_catalog_handlers(coap_catalog_t *catalog,
+                      const coap_method_handler_t *handlers) {
+  coap_method_handler_t key[COAP_RESOURCE_METHODS];
+  coap_catalog_handlers_t *set = catalog->last_set;
+
+  if (handlers)
+    memcpy(key, handlers, sizeof(key));
+  else
+    memset(key, 0, sizeof(key));
+  /* Resources added together mostly have the same handlers */
+  if (!set || memcmp(set->handler, key, sizeof(key)) != 0) {
+    HASH_FIND(hh, catalog->handler_sets, key, sizeof(key), set);
+    if (!set) {
+      set = coap_arena_alloc(&catalog->arena, sizeof(coap_catalog_handlers_t));
+      if (!set)
+        return NULL;
+      memset(set, 0, sizeof(coap_catalog_handlers_t));
+      memcpy(set->handler, key, sizeof(key));
+      HASH_ADD(hh, catalog->handler_sets, handler, sizeof(set->handler), set);
+    }
+    catalog->last_set = set;
+  }
+  return set->handler;
+}
@@ -198,6 +198,25 @@ coap_print_addr(const struct coap_address_t *addr, unsigned char *buf, size_t le
     need_buf = INET6_ADDRSTRLEN;
 
     break;
+#ifdef COAP_AF_UNIX_SUPPORT
+  case AF_UNIX:
+  {
+    /* The path, with an abstract one shown as starting with '@' */
+    size_t plen = addr->size > offsetof(struct sockaddr_un, sun_path) ?
+                  addr->size - offsetof(struct sockaddr_un, sun_path) : 0;
+    size_t i;
+
+    for (i = 0; i < plen && (size_t)(p - buf) + 1 < len; i++) {
+      uint8_t c = (uint8_t)addr->addr.cun.sun_path[i];
+
+      if (c == '\000' && i)
+        break;
+      *p++ = c == '\000' ? '@' : isprint(c) ? c : '.';
+    }
+    *p = '\000';
+    return p - buf;
+  }
+#endif /* COAP_AF_UNIX_SUPPORT */
   default:
     /* Include trailing NULL if possible */
     memcpy(buf, "(unknown address type)", min(22+1, len));
@@ -308,7 +327,7 @@ msg_code_string(uint16_t c) {
                                    "FETCH", "PATCH", "iPATCH" };
   static const char *signals[] = { "7.00", "CSM", "Ping", "Pong", "Release",
                                    "Abort" };
-  static char buf[5];
+  static COAP_THREAD_LOCAL char buf[5];
 
   if (c < sizeof(methods)/sizeof(const char *)) {
     return methods[c];
@@ -328,30 +347,6 @@ msg_option_string(uint8_t code, uint16_t option_type) {
     const char *name;
   };
 
-  static struct option_desc_t options[] = {
-    { COAP_OPTION_IF_MATCH, "If-Match" },
-    { COAP_OPTION_URI_HOST, "Uri-Host" },
-    { COAP_OPTION_ETAG, "ETag" },
-    { COAP_OPTION_IF_NONE_MATCH, "If-None-Match" },
-    { COAP_OPTION_OBSERVE, "Observe" },
-    { COAP_OPTION_URI_PORT, "Uri-Port" },
-    { COAP_OPTION_LOCATION_PATH, "Location-Path" },
-    { COAP_OPTION_URI_PATH, "Uri-Path" },
-    { COAP_OPTION_CONTENT_FORMAT, "Content-Format" },
-    { COAP_OPTION_MAXAGE, "Max-Age" },
-    { COAP_OPTION_URI_QUERY, "Uri-Query" },
-    { COAP_OPTION_HOP_LIMIT, "Hop-Limit" },
-    { COAP_OPTION_ACCEPT, "Accept" },
-    { COAP_OPTION_LOCATION_QUERY, "Location-Query" },
-    { COAP_OPTION_BLOCK2, "Block2" },
-    { COAP_OPTION_BLOCK1, "Block1" },
-    { COAP_OPTION_SIZE2, "Size2" },
-    { COAP_OPTION_PROXY_URI, "Proxy-Uri" },
-    { COAP_OPTION_PROXY_SCHEME, "Proxy-Scheme" },
-    { COAP_OPTION_SIZE1, "Size1" },
-    { COAP_OPTION_NORESPONSE, "No-Response" }
-  };
-
   static struct option_desc_t options_csm[] = {
     { COAP_SIGNALING_OPTION_MAX_MESSAGE_SIZE, "Max-Message-Size" },
     { COAP_SIGNALING_OPTION_BLOCK_WISE_TRANSFER, "Block-wise-Transfer" }
@@ -370,7 +365,7 @@ msg_option_string(uint8_t code, uint16_t option_type) {
     { COAP_SIGNALING_OPTION_BAD_CSM_OPTION, "Bad-CSM-Option" }
   };
 
-  static char buf[6];
+  static COAP_THREAD_LOCAL char buf[6];
   size_t i;
 
   if (code == COAP_SIGNALING_CSM) {
@@ -398,12 +393,10 @@ msg_option_string(uint8_t code, uint16_t option_type) {
       }
     }
   } else {
-    /* search option_type in list of known options */
-    for (i = 0; i < sizeof(options)/sizeof(struct option_desc_t); i++) {
-      if (option_type == options[i].type) {
-        return options[i].name;
-      }
-    }
+    const coap_option_desc_t *desc = coap_option_desc(option_type);
+
+    if (desc)
+      return desc->name;
   }
   /* unknown option type, just print to buf */
   snprintf(buf, sizeof(buf), "%u", option_type);
@@ -445,6 +438,8 @@ print_content_format(unsigned int format_type,
     { COAP_MEDIATYPE_APPLICATION_SENML_XML, "application/senml+xml" },
     { COAP_MEDIATYPE_APPLICATION_SENSML_XML, "application/sensml+xml" },
     { COAP_MEDIATYPE_APPLICATION_DOTS_CBOR, "application/dots+cbor" },
+    { COAP_MEDIATYPE_APPLICATION_MB_CBOR_SEQ,
+      "application/missing-blocks+cbor-seq" },
     { 75, "application/dcaf+cbor" }
   };
 
@@ -525,7 +520,7 @@ coap_show_pdu(coap_log_t level, const coap_pdu_t *pdu) {
   size_t outbuflen = 0;
 
   /* Save time if not needed */
-  if (level > coap_get_log_level())
+  if (!coap_log_enabled(level))
     return;
 
 #if COAP_CONSTRAINED_STACK
@@ -604,6 +599,8 @@ coap_show_pdu(coap_log_t level, const coap_pdu_t *pdu) {
 
     case COAP_OPTION_BLOCK1:
     case COAP_OPTION_BLOCK2:
+    case COAP_OPTION_Q_BLOCK1:
+    case COAP_OPTION_Q_BLOCK2:
       /* split block option into number/more/size where more is the
        * letter M if set, the _ otherwise */
       buf_len = snprintf((char *)buf, sizeof(buf), "%u/%c/%u",
@@ -846,12 +843,312 @@ void coap_set_log_handler(coap_log_handler_t handler) {
   log_handler = handler;
 }
 
+/* Writes out @p message as logged at @p level at the time @p now */
+static void
+coap_log_write(coap_log_t level, coap_tick_t now, const char *message) {
+  if (log_handler) {
+    log_handler(level, message);
+  } else {
+    char timebuf[32];
+    FILE *log_fd;
+    size_t len;
+
+    log_fd = level <= LOG_CRIT ? COAP_ERR_FD : COAP_DEBUG_FD;
+    len = print_timestamp(timebuf,sizeof(timebuf), now);
+    if (len)
+      fprintf(log_fd, "%.*s ", (int)len, timebuf);
+    if (level <= COAP_LOG_CIPHERS)
+      fprintf(log_fd, "%s ", loglevels[level]);
+    fputs(message, log_fd);
+  }
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_LOCK) && \
+    defined(__GNUC__) && !defined(_WIN32) && !defined(WITH_CONTIKI) && \
+    !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#define COAP_LOG_ASYNC 1
+#include <pthread.h>
+#else
+#define COAP_LOG_ASYNC 0
+#endif
+
+#if COAP_LOG_ASYNC
+/*
+ * The asynchronous log is a ring buffer of records, each a coap_log_rec_t
+ * followed by the message, padded to a multiple of 8 bytes.  head counts
+ * the bytes ever reserved and tail the bytes ever written out.  A logging
+ * thread reserves its record by moving head on with a compare-and-swap,
+ * fills it in and then sets its length, which is zero until the record is
+ * complete.  The writer thread takes the records in order from tail while
+ * their length is set, and zeroes them before it moves tail on, so that
+ * the length of the next record to be reserved there reads zero.
+ *
+ * The writer only sleeps on the condition variable, with sleeping set,
+ * once the buffer has stayed empty for a while, and it is only signalled
+ * then, or when the buffer is getting full, so that a busy log does not
+ * cost a system call for each message.
+ */
+typedef struct coap_log_rec_t {
+  uint32_t length;        /* of the record, or 0 until it is complete */
+  uint16_t message_length;
+  uint8_t level;
+  uint8_t reserved;
+  uint64_t ticks;
+} coap_log_rec_t;
+
+#define COAP_LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define COAP_LOG_MIN_SIZE 4096
+#define COAP_LOG_PAUSE_MS 10
+
+typedef struct coap_log_async_t {
+  uint8_t *buf;
+  size_t size;            /* a power of two */
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  int sleeping;
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_t thread;
+} coap_log_async_t;
+
+static coap_log_async_t *log_async = NULL;
+
+static void
+coap_log_async_copy(coap_log_async_t *q, uint64_t pos, void *out,
+                    const void *in, size_t len) {
+  size_t offset = (size_t)pos & (q->size - 1);
+  size_t first = q->size - offset;
+
+  if (first > len)
+    first = len;
+  if (out) {
+    memcpy(out, q->buf + offset, first);
+    memcpy((uint8_t *)out + first, q->buf, len - first);
+  } else if (in) {
+    memcpy(q->buf + offset, in, first);
+    memcpy(q->buf, (const uint8_t *)in + first, len - first);
+  } else {
+    memset(q->buf + offset, 0, first);
+    memset(q->buf, 0, len - first);
+  }
+}
+
+static void
+coap_log_async_wake(coap_log_async_t *q) {
+  pthread_mutex_lock(&q->mutex);
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+/* Queues @p message, returning 0 if there is no room for it */
+static int
+coap_log_async_put(coap_log_async_t *q, coap_log_t level,
+                   const char *message, size_t message_length) {
+  coap_log_rec_t rec;
+  coap_tick_t now;
+  uint64_t pos, tail;
+  size_t length;
+
+  if (message_length > UINT16_MAX)
+    message_length = UINT16_MAX;
+  length = COAP_LOG_ALIGN(sizeof(rec) + message_length);
+  pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  do {
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (pos + length - tail > q->size) {
+      __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&q->head, &pos, pos + length, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  memset(&rec, 0, sizeof(rec));
+  rec.message_length = (uint16_t)message_length;
+  rec.level = (uint8_t)level;
+  coap_ticks(&now);
+  rec.ticks = now;
+  /* All but length, which does not wrap as the records are aligned */
+  coap_log_async_copy(q, pos + sizeof(rec.length), NULL,
+                      (const uint8_t *)&rec + sizeof(rec.length),
+                      sizeof(rec) - sizeof(rec.length));
+  coap_log_async_copy(q, pos + sizeof(rec), NULL, message, message_length);
+  __atomic_store_n((uint32_t *)(q->buf + ((size_t)pos & (q->size - 1))),
+                   (uint32_t)length, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST) ||
+      pos + length - tail > q->size / 2)
+    coap_log_async_wake(q);
+  return 1;
+}
+
+/* Writes out the complete records, returning how many there were */
+static unsigned int
+coap_log_async_drain(coap_log_async_t *q) {
+  char message[COAP_DEBUG_BUF_SIZE];
+  unsigned int count = 0;
+  uint64_t dropped;
+
+  for (;;) {
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    uint32_t *length = (uint32_t *)(q->buf + ((size_t)tail & (q->size - 1)));
+    coap_log_rec_t rec;
+    size_t message_length;
+
+    rec.length = __atomic_load_n(length, __ATOMIC_ACQUIRE);
+    if (!rec.length)
+      break;
+    coap_log_async_copy(q, tail, &rec, NULL, sizeof(rec));
+    message_length = rec.message_length;
+    if (message_length > sizeof(message) - 1)
+      message_length = sizeof(message) - 1;
+    coap_log_async_copy(q, tail + sizeof(rec), message, NULL,
+                        message_length);
+    message[message_length] = '\000';
+    coap_log_async_copy(q, tail, NULL, NULL, rec.length);
+    __atomic_store_n(&q->tail, tail + rec.length, __ATOMIC_RELEASE);
+    coap_log_write((coap_log_t)rec.level, (coap_tick_t)rec.ticks, message);
+    count++;
+  }
+
+  dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    coap_tick_t now;
+
+    snprintf(message, sizeof(message),
+             "%llu log messages dropped, as the queue was full\n",
+             (unsigned long long)dropped);
+    coap_ticks(&now);
+    coap_log_write(LOG_WARNING, now, message);
+  }
+  if (count && !log_handler) {
+    fflush(COAP_DEBUG_FD);
+    fflush(COAP_ERR_FD);
+  }
+  return count;
+}
+
+static void *
+coap_log_async_writer(void *arg) {
+  coap_log_async_t *q = (coap_log_async_t *)arg;
+  int idle = 0;
+
+  pthread_mutex_lock(&q->mutex);
+  while (!q->stop) {
+    struct timespec until;
+
+    pthread_mutex_unlock(&q->mutex);
+    idle = coap_log_async_drain(q) ? 0 : idle + 1;
+    pthread_mutex_lock(&q->mutex);
+    if (q->stop)
+      break;
+    if (idle < 2) {
+      /* Lets a busy log gather, without being signalled */
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += COAP_LOG_PAUSE_MS * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&q->wake, &q->mutex, &until);
+    } else {
+      __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+      /* Rechecked, as a record may have been completed in the meantime */
+      if (!__atomic_load_n((uint32_t *)(q->buf +
+                                        ((size_t)q->tail & (q->size - 1))),
+                           __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&q->wake, &q->mutex);
+      __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+      idle = 0;
+    }
+  }
+  pthread_mutex_unlock(&q->mutex);
+  coap_log_async_drain(q);
+  return NULL;
+}
+
+static void
+coap_log_async_stop(coap_log_async_t *q) {
+  pthread_mutex_lock(&q->mutex);
+  q->stop = 1;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->mutex);
+  pthread_join(q->thread, NULL);
+  pthread_cond_destroy(&q->wake);
+  pthread_mutex_destroy(&q->mutex);
+  coap_free_type(COAP_STRING, q->buf);
+  coap_free_type(COAP_STRING, q);
+}
+#endif /* COAP_LOG_ASYNC */
+
+int
+coap_set_log_async(size_t queue_size) {
+#if COAP_LOG_ASYNC
+  coap_log_async_t *q = NULL;
+  size_t size = COAP_LOG_MIN_SIZE;
+
+  if (queue_size) {
+    while (size < queue_size && size < ((size_t)1 << 30))
+      size <<= 1;
+    q = coap_malloc_type(COAP_STRING, sizeof(coap_log_async_t));
+    if (!q)
+      return 0;
+    memset(q, 0, sizeof(coap_log_async_t));
+    q->buf = coap_malloc_type(COAP_STRING, size);
+    if (!q->buf) {
+      coap_free_type(COAP_STRING, q);
+      return 0;
+    }
+    memset(q->buf, 0, size);
+    q->size = size;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    if (pthread_create(&q->thread, NULL, coap_log_async_writer, q) != 0) {
+      pthread_cond_destroy(&q->wake);
+      pthread_mutex_destroy(&q->mutex);
+      coap_free_type(COAP_STRING, q->buf);
+      coap_free_type(COAP_STRING, q);
+      return 0;
+    }
+  }
+  /* Whatever was queued before is written out before it is stopped */
+  q = __atomic_exchange_n(&log_async, q, __ATOMIC_ACQ_REL);
+  if (q)
+    coap_log_async_stop(q);
+  return 1;
+#else /* ! COAP_LOG_ASYNC */
+  return queue_size == 0;
+#endif /* ! COAP_LOG_ASYNC */
+}
+
 void
 coap_log_impl(coap_log_t level, const char *format, ...) {
 
   if (maxlog < level)
     return;
 
+#if COAP_LOG_ASYNC
+  {
+    coap_log_async_t *q = __atomic_load_n(&log_async, __ATOMIC_ACQUIRE);
+
+    if (q) {
+      char message[COAP_DEBUG_BUF_SIZE];
+      va_list ap;
+      int len;
+
+      va_start(ap, format);
+      len = vsnprintf(message, sizeof(message), format, ap);
+      va_end(ap);
+      if (len >= 0)
+        coap_log_async_put(q, level, message,
+                           (size_t)len < sizeof(message) ?
+                             (size_t)len : sizeof(message) - 1);
+      return;
+    }
+  }
+#endif /* COAP_LOG_ASYNC */
+
   if (log_handler) {
 #if COAP_CONSTRAINED_STACK
     static coap_mutex_t static_log_mutex = COAP_MUTEX_INITIALIZER;
@@ -903,6 +1200,14 @@ static int num_packet_loss_intervals = 0;
 static int packet_loss_level = 0;
 static int send_packet_count = 0;
 
+/* DTLS handshake worker threads send packets too */
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#define COAP_SEND_PACKET_COUNT() \
+  __atomic_add_fetch(&send_packet_count, 1, __ATOMIC_RELAXED)
+#else /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+#define COAP_SEND_PACKET_COUNT() (++send_packet_count)
+#endif /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+
 int coap_debug_set_packet_loss(const char *loss_level) {
   const char *p = loss_level;
   char *end = NULL;
@@ -944,13 +1249,14 @@ int coap_debug_set_packet_loss(const char *loss_level) {
 }
 
 int coap_debug_send_packet(void) {
-  ++send_packet_count;
+  int count = COAP_SEND_PACKET_COUNT();
+
   if (num_packet_loss_intervals > 0) {
     int i;
     for (i = 0; i < num_packet_loss_intervals; i++) {
-      if (send_packet_count >= packet_loss_intervals[i].start
-        && send_packet_count <= packet_loss_intervals[i].end) {
-        coap_log(LOG_DEBUG, "Packet %u dropped\n", send_packet_count);
+      if (count >= packet_loss_intervals[i].start
+        && count <= packet_loss_intervals[i].end) {
+        coap_log(LOG_DEBUG, "Packet %u dropped\n", count);
         return 0;
       }
     }
@@ -959,7 +1265,7 @@ int coap_debug_send_packet(void) {
     uint16_t r = 0;
     coap_prng( (uint8_t*)&r, 2 );
     if ( r < packet_loss_level ) {
-      coap_log(LOG_DEBUG, "Packet %u dropped\n", send_packet_count);
+      coap_log(LOG_DEBUG, "Packet %u dropped\n", count);
       return 0;
     }
   }
@@ -0,0 +1,97 @@
+/* coap_dedup.c -- Responses to recently received CON requests
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * Each session hashes the message ids of the Confirmable requests it has
+ * received in the last EXCHANGE_LIFETIME, along with a copy of the ACK (or
+ * RST) that was sent in return.  As a uthash table iterates in the order
+ * of insertion, its head is always the oldest entry, so that the entries
+ * that have expired, or that are over the limit of the context, are
+ * dropped from the head as new requests come in.
+ */
+struct coap_dedup_t {
+  UT_hash_handle hh;
+  uint16_t mid;                /* key */
+  coap_tick_t expires;
+  coap_pdu_t *response;        /* or NULL if none has been sent yet */
+};
+
+void
+coap_context_set_dedup_cache(coap_context_t *context,
+                             unsigned int max_entries) {
+  context->dedup_max = max_entries;
+}
+
+static void
+coap_dedup_delete(coap_session_t *session, coap_dedup_t *entry) {
+  HASH_DELETE(hh, session->dedup, entry);
+  session->dedup_count--;
+  coap_delete_pdu(entry->response);
+  coap_free_type(COAP_STRING, entry);
+}
+
+int
+coap_dedup_check(coap_session_t *session, const coap_pdu_t *pdu,
+                 const coap_pdu_t **response) {
+  unsigned int max_entries = session->context->dedup_max;
+  coap_dedup_t *entry;
+  coap_tick_t now;
+
+  *response = NULL;
+  if (!max_entries || COAP_PROTO_RELIABLE(session->proto))
+    return 0;
+
+  coap_ticks(&now);
+  HASH_FIND(hh, session->dedup, &pdu->mid, sizeof(pdu->mid), entry);
+  if (entry && entry->expires > now) {
+    *response = entry->response;
+    return 1;
+  }
+  if (entry)
+    /* The message id has been used again after EXCHANGE_LIFETIME */
+    coap_dedup_delete(session, entry);
+
+  /* Make room for the new request */
+  while (session->dedup &&
+         (session->dedup->expires <= now ||
+          session->dedup_count >= max_entries)) {
+    coap_dedup_delete(session, session->dedup);
+  }
+
+  entry = coap_malloc_type(COAP_STRING, sizeof(coap_dedup_t));
+  if (!entry)
+    return 0;
+  memset(entry, 0, sizeof(coap_dedup_t));
+  entry->mid = pdu->mid;
+  entry->expires = now + COAP_EXCHANGE_LIFETIME_TICKS(session);
+  HASH_ADD(hh, session->dedup, mid, sizeof(entry->mid), entry);
+  session->dedup_count++;
+  return 0;
+}
+
+void
+coap_dedup_store(coap_session_t *session, const coap_pdu_t *pdu) {
+  coap_dedup_t *entry;
+
+  HASH_FIND(hh, session->dedup, &pdu->mid, sizeof(pdu->mid), entry);
+  if (!entry || entry->response)
+    return;
+  entry->response = coap_pdu_copy(pdu, pdu->mid, pdu->max_size,
+                                  pdu->token_length, pdu->token);
+  if (!entry->response)
+    coap_log(LOG_DEBUG, "coap_dedup_store: insufficient memory\n");
+}
+
+void
+coap_dedup_free(coap_session_t *session) {
+  coap_dedup_t *entry, *tmp;
+
+  HASH_ITER(hh, session->dedup, entry, tmp) {
+    coap_dedup_delete(session, entry);
+  }
+}
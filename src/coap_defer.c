@@ -0,0 +1,253 @@
+/* coap_defer.c -- Requests handled by worker threads
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * A method handler that calls coap_defer_request() leaves its response
+ * empty, so that the request is acknowledged as usual (or the ACK is held
+ * back by the async state registered for it).  The job, holding copies of
+ * the request and a separate response, is queued for the worker threads,
+ * which call the deferred handler.  The finished job is then pushed onto
+ * the lock-free stack of posted events of the context, which wakes up the
+ * I/O thread, and the response is sent from there.  The event is allocated
+ * up front, so that a job always finds its way back.
+ */
+struct coap_defer_job_t {
+  struct coap_defer_job_t *next;
+  coap_session_t *session;
+  coap_pdu_t *request;          /* copy of the request */
+  coap_pdu_t *response;         /* separate response, filled in by
+                                   the handler */
+  coap_defer_handler_t handler;
+  void *arg;
+  struct coap_post_t *post;     /* passes the job back when done */
+};
+
+static void
+coap_defer_send(coap_defer_job_t *job) {
+  coap_session_t *session = job->session;
+  coap_pdu_t *response = job->response;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *nores;
+
+  job->response = NULL;
+  if (response->code == 0) {
+    coap_log(LOG_WARNING, "deferred handler gave no response for "
+                          "mid=0x%x\n", job->request->mid);
+    response->code = COAP_RESPONSE_CODE(500);
+  }
+  nores = coap_check_option(job->request, COAP_OPTION_NORESPONSE, &opt_iter);
+  if (nores &&
+      ((1 << (COAP_RESPONSE_CLASS(response->code) - 1)) &
+       coap_decode_var_bytes(coap_opt_value(nores),
+                             coap_opt_length(nores))) != 0) {
+    /* RFC 7967 */
+    coap_delete_pdu(response);
+  } else if (coap_send(session, response) == COAP_INVALID_MID) {
+    coap_log(LOG_DEBUG, "cannot send deferred response for mid=0x%x\n",
+             job->request->mid);
+  }
+}
+
+void
+coap_defer_job_free(coap_defer_job_t *job) {
+#ifndef WITHOUT_ASYNC
+  coap_async_state_t *s;
+
+  /* Sends the ACK if it is still held back */
+  if (coap_remove_async(job->session->context, job->session,
+                        job->request->mid, &s))
+    coap_free_async(s);
+#endif /* WITHOUT_ASYNC */
+  coap_delete_pdu(job->request);
+  coap_delete_pdu(job->response);
+  coap_session_release(job->session);
+  coap_free_type(COAP_STRING, job);
+}
+
+void
+coap_defer_done(coap_defer_job_t *job) {
+  coap_defer_send(job);
+  coap_defer_job_free(job);
+}
+
+#if COAP_DEFER_WORKERS
+#include <pthread.h>
+
+struct coap_defer_pool_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;          /* signalled when a job is queued */
+  coap_context_t *context;
+  coap_defer_job_t *queue;      /* jobs waiting for a worker */
+  coap_defer_job_t *queue_tail;
+  int stop;
+  unsigned int thread_count;
+  pthread_t threads[1];
+};
+
+static void *
+coap_defer_worker(void *arg) {
+  coap_defer_pool_t *pool = (coap_defer_pool_t *)arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    coap_defer_job_t *job;
+
+    /* The queue is emptied before the workers stop */
+    while (!pool->queue && !pool->stop)
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    if (!pool->queue)
+      break;
+    job = pool->queue;
+    pool->queue = job->next;
+    if (!pool->queue)
+      pool->queue_tail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job->handler(job->session, job->request, job->response, job->arg);
+    coap_post_defer(pool->context, job->post);
+
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+int
+coap_defer_request(coap_session_t *session, const coap_pdu_t *request,
+                   coap_defer_handler_t handler, void *arg) {
+  coap_defer_pool_t *pool;
+  coap_defer_job_t *job;
+
+  if (!session || !request || !handler || !session->context->defer)
+    return 0;
+  pool = session->context->defer;
+
+  job = coap_malloc_type(COAP_STRING, sizeof(coap_defer_job_t));
+  if (!job)
+    return 0;
+  memset(job, 0, sizeof(coap_defer_job_t));
+  job->request = coap_pdu_copy(request, request->mid, request->max_size,
+                               request->token_length, request->token);
+  job->response = coap_pdu_init(request->type == COAP_MESSAGE_CON ?
+                                COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+                                0, coap_new_message_id(session),
+                                coap_session_max_pdu_size(session));
+  job->post = coap_post_defer_new(job);
+  if (!job->request || !job->response || !job->post ||
+      !coap_add_token(job->response, request->token_length, request->token)) {
+    coap_log(LOG_WARNING, "coap_defer_request: insufficient memory\n");
+    coap_delete_pdu(job->request);
+    coap_delete_pdu(job->response);
+    coap_free_type(COAP_STRING, job->post);
+    coap_free_type(COAP_STRING, job);
+    return 0;
+  }
+  job->session = coap_session_reference(session);
+  job->handler = handler;
+  job->arg = arg;
+
+#ifndef WITHOUT_ASYNC
+  /* Duplicates of the request are then only acknowledged, and the ACK
+     may be held back for the response to be piggybacked on */
+  coap_register_async(session->context, session, job->request,
+                      COAP_ASYNC_SEPARATE, NULL);
+#endif /* WITHOUT_ASYNC */
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->queue_tail)
+    pool->queue_tail->next = job;
+  else
+    pool->queue = job;
+  pool->queue_tail = job;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  return 1;
+}
+
+void
+coap_defer_free(coap_context_t *context) {
+  coap_defer_pool_t *pool = context->defer;
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  for (i = 0; i < pool->thread_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->mutex);
+  coap_free_type(COAP_STRING, pool);
+  context->defer = NULL;
+}
+
+int
+coap_context_set_defer_threads(coap_context_t *context,
+                               unsigned int threads) {
+  coap_defer_pool_t *pool;
+
+  if (!context)
+    return 0;
+  coap_defer_free(context);
+  if (threads == 0)
+    return 1;
+
+  pool = coap_malloc_type(COAP_STRING, sizeof(coap_defer_pool_t) +
+                                       (threads - 1) * sizeof(pthread_t));
+  if (!pool)
+    return 0;
+  memset(pool, 0, sizeof(coap_defer_pool_t));
+  pool->context = context;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  context->defer = pool;
+
+  for (pool->thread_count = 0; pool->thread_count < threads;
+       pool->thread_count++) {
+    if (pthread_create(&pool->threads[pool->thread_count], NULL,
+                       coap_defer_worker, pool) != 0) {
+      coap_log(LOG_WARNING, "coap_context_set_defer_threads: "
+                            "pthread_create: %s\n", coap_socket_strerror());
+      coap_defer_free(context);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#else /* ! COAP_DEFER_WORKERS */
+
+int
+coap_defer_request(coap_session_t *session, const coap_pdu_t *request,
+                   coap_defer_handler_t handler, void *arg) {
+  (void)session;
+  (void)request;
+  (void)handler;
+  (void)arg;
+  return 0;
+}
+
+void
+coap_defer_free(coap_context_t *context) {
+  (void)context;
+}
+
+int
+coap_context_set_defer_threads(coap_context_t *context,
+                               unsigned int threads) {
+  (void)context;
+  (void)threads;
+  coap_log(LOG_WARNING, "coap_context_set_defer_threads: not supported\n");
+  return 0;
+}
+
+#endif /* ! COAP_DEFER_WORKERS */
@@ -0,0 +1,264 @@
+/* coap_dtls_cookie.c -- Stateless DTLS cookie exchange
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * A cookie is the HMAC-SHA256 of the peer's address, keyed with a secret
+ * that is changed every COAP_DTLS_COOKIE_ROTATE_TICKS.  Cookies made with
+ * the previous secret are still accepted, so that a peer whose exchange
+ * straddles a change is not turned away.
+ */
+struct coap_dtls_cookie_t {
+  uint8_t secret[2][32];          /* current and previous secret */
+  unsigned int current;           /* index of the current secret */
+  coap_tick_t rotated;            /* when the current secret was made */
+};
+
+/*
+ * The start of a ClientHello, with the offsets from the start of the
+ * datagram.
+ *
+ * Record layer                 Handshake
+ *  0 content_type              13 msg_type
+ *  1 version[2]                14 length[3]
+ *  3 epoch[2]                  17 message_seq[2]
+ *  5 sequence_number[6]        19 fragment_offset[3]
+ * 11 length[2]                 22 fragment_length[3]
+ *
+ * ClientHello
+ * 25 client_version[2]
+ * 27 random[32]
+ * 59 session_id length, then session_id and cookie length and cookie
+ */
+#define OFF_CONTENT_TYPE      0
+#define OFF_EPOCH             3
+#define OFF_RECORD_SEQ        5
+#define OFF_HANDSHAKE_TYPE   13
+#define OFF_FRAGMENT_OFFSET  19
+#define OFF_SESSION_ID_LEN   59
+#define DTLS_RECORD_HEADER   13
+#define DTLS_HANDSHAKE_HEADER 12
+#define DTLS_CT_ALERT        21  /* Content Type Alert */
+#define DTLS_CT_HANDSHAKE    22  /* Content Type Handshake */
+#define DTLS_HT_CLIENT_HELLO  1  /* Client Hello handshake type */
+#define DTLS_HT_HELLO_VERIFY  3  /* Hello Verify Request handshake type */
+
+static coap_dtls_cookie_t *
+coap_dtls_cookie_get(coap_context_t *context, coap_tick_t now) {
+  coap_dtls_cookie_t *cookie = context->dtls_cookie;
+
+  if (!cookie) {
+    cookie = coap_malloc_type(COAP_STRING, sizeof(coap_dtls_cookie_t));
+    if (!cookie)
+      return NULL;
+    coap_prng(cookie->secret, sizeof(cookie->secret));
+    cookie->current = 0;
+    cookie->rotated = now;
+    context->dtls_cookie = cookie;
+  }
+  return cookie;
+}
+
+static int
+coap_dtls_cookie_hmac(const uint8_t *secret,
+                      const coap_addr_hash_t *addr_hash, uint8_t *cookie) {
+  uint8_t pad[64];
+  coap_digest_t digest;
+  coap_digest_ctx_t *dctx;
+  size_t i;
+
+  /* RFC 2104, with a key shorter than the block */
+  memset(pad, 0x36, sizeof(pad));
+  for (i = 0; i < sizeof(digest); i++)
+    pad[i] ^= secret[i];
+  dctx = coap_digest_setup();
+  if (!dctx)
+    return 0;
+  if (!coap_digest_update(dctx, pad, sizeof(pad)) ||
+      !coap_digest_update(dctx, (const uint8_t *)addr_hash,
+                          sizeof(*addr_hash))) {
+    coap_digest_free(dctx);
+    return 0;
+  }
+  if (!coap_digest_final(dctx, &digest))
+    return 0;
+
+  memset(pad, 0x5c, sizeof(pad));
+  for (i = 0; i < sizeof(digest); i++)
+    pad[i] ^= secret[i];
+  dctx = coap_digest_setup();
+  if (!dctx)
+    return 0;
+  if (!coap_digest_update(dctx, pad, sizeof(pad)) ||
+      !coap_digest_update(dctx, digest.key, sizeof(digest))) {
+    coap_digest_free(dctx);
+    return 0;
+  }
+  if (!coap_digest_final(dctx, &digest))
+    return 0;
+  memcpy(cookie, digest.key, COAP_DTLS_COOKIE_LENGTH);
+  return 1;
+}
+
+int
+coap_dtls_cookie_make(coap_context_t *context,
+                      const coap_addr_hash_t *addr_hash, uint8_t *cookie) {
+  coap_dtls_cookie_t *state = context->dtls_cookie;
+
+  if (!state) {
+    coap_tick_t now;
+
+    coap_ticks(&now);
+    state = coap_dtls_cookie_get(context, now);
+    if (!state)
+      return 0;
+  }
+  return coap_dtls_cookie_hmac(state->secret[state->current], addr_hash,
+                               cookie);
+}
+
+/* Compares in constant time, not to give away how much of a guess is right */
+static int
+coap_dtls_cookie_equal(const uint8_t *a, const uint8_t *b) {
+  uint8_t diff = 0;
+  size_t i;
+
+  for (i = 0; i < COAP_DTLS_COOKIE_LENGTH; i++)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+static void
+coap_dtls_cookie_send_verify(coap_endpoint_t *endpoint,
+                             const coap_packet_t *packet,
+                             const uint8_t *hello, const uint8_t *cookie) {
+  uint8_t verify[DTLS_RECORD_HEADER + DTLS_HANDSHAKE_HEADER + 3 +
+                 COAP_DTLS_COOKIE_LENGTH];
+  uint8_t *p = verify;
+  size_t body = 3 + COAP_DTLS_COOKIE_LENGTH;
+  coap_session_t session;
+
+  /* Record, sent with the sequence number of the ClientHello */
+  *p++ = DTLS_CT_HANDSHAKE;
+  *p++ = 254;                           /* DTLS 1.0, as RFC 6347 asks */
+  *p++ = 255;
+  *p++ = 0;                             /* epoch */
+  *p++ = 0;
+  memcpy(p, &hello[OFF_RECORD_SEQ], 6);
+  p += 6;
+  *p++ = (uint8_t)((DTLS_HANDSHAKE_HEADER + body) >> 8);
+  *p++ = (uint8_t)(DTLS_HANDSHAKE_HEADER + body);
+  /* Handshake, unfragmented */
+  *p++ = DTLS_HT_HELLO_VERIFY;
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = (uint8_t)body;
+  *p++ = 0;                             /* message_seq */
+  *p++ = 0;
+  *p++ = 0;                             /* fragment_offset */
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;                             /* fragment_length */
+  *p++ = 0;
+  *p++ = (uint8_t)body;
+  /* HelloVerifyRequest */
+  *p++ = 254;
+  *p++ = 255;
+  *p++ = COAP_DTLS_COOKIE_LENGTH;
+  memcpy(p, cookie, COAP_DTLS_COOKIE_LENGTH);
+
+  /* Just enough of a session to send from the endpoint */
+  memset(&session, 0, sizeof(session));
+  session.proto = COAP_PROTO_DTLS;
+  session.type = COAP_SESSION_TYPE_HELLO;
+  session.context = endpoint->context;
+  session.endpoint = endpoint;
+  session.ifindex = packet->ifindex;
+  coap_address_copy(&session.addr_info.remote, &packet->addr_info.remote);
+  coap_address_copy(&session.addr_info.local, &packet->addr_info.local);
+  coap_session_send(&session, verify, sizeof(verify));
+}
+
+int
+coap_dtls_cookie_check(coap_endpoint_t *endpoint,
+                       const coap_packet_t *packet,
+                       const coap_addr_hash_t *addr_hash, coap_tick_t now) {
+#ifdef WITH_LWIP
+  const uint8_t *payload = (const uint8_t*)packet->pbuf->payload;
+  size_t length = packet->pbuf->len;
+#else /* ! WITH_LWIP */
+  const uint8_t *payload = (const uint8_t*)packet->payload;
+  size_t length = packet->length;
+#endif /* ! WITH_LWIP */
+  coap_dtls_cookie_t *state;
+  uint8_t expected[COAP_DTLS_COOKIE_LENGTH];
+  size_t offset;
+
+  if (length < (OFF_HANDSHAKE_TYPE + 1)) {
+    coap_log(LOG_DEBUG,
+       "coap_dtls_hello: ContentType %d Short Packet (%zu < %d) dropped\n",
+       payload[OFF_CONTENT_TYPE], length,
+       OFF_HANDSHAKE_TYPE + 1);
+    return -1;
+  }
+  if (payload[OFF_CONTENT_TYPE] != DTLS_CT_HANDSHAKE ||
+      payload[OFF_HANDSHAKE_TYPE] != DTLS_HT_CLIENT_HELLO) {
+    /* only log if not a late alert */
+    if (payload[OFF_CONTENT_TYPE] != DTLS_CT_ALERT)
+      coap_log(LOG_DEBUG,
+       "coap_dtls_hello: ContentType %d Handshake %d dropped\n",
+       payload[OFF_CONTENT_TYPE], payload[OFF_HANDSHAKE_TYPE]);
+    return -1;
+  }
+  /* Only the start of a ClientHello sent in the clear carries the cookie */
+  if (length < OFF_SESSION_ID_LEN + 1 ||
+      payload[OFF_EPOCH] || payload[OFF_EPOCH + 1] ||
+      payload[OFF_FRAGMENT_OFFSET] || payload[OFF_FRAGMENT_OFFSET + 1] ||
+      payload[OFF_FRAGMENT_OFFSET + 2])
+    return -1;
+  offset = OFF_SESSION_ID_LEN + 1 + payload[OFF_SESSION_ID_LEN];
+  if (offset >= length)
+    return -1;
+
+  state = coap_dtls_cookie_get(endpoint->context, now);
+  if (!state)
+    return 0;
+  if (now - state->rotated >= COAP_DTLS_COOKIE_ROTATE_TICKS) {
+    state->current ^= 1;
+    coap_prng(state->secret[state->current], sizeof(state->secret[0]));
+    state->rotated = now;
+  }
+
+  if (payload[offset] == COAP_DTLS_COOKIE_LENGTH &&
+      offset + 1 + COAP_DTLS_COOKIE_LENGTH <= length) {
+    const uint8_t *cookie = &payload[offset + 1];
+
+    if (coap_dtls_cookie_hmac(state->secret[state->current], addr_hash,
+                              expected) &&
+        coap_dtls_cookie_equal(cookie, expected))
+      return 1;
+    if (coap_dtls_cookie_hmac(state->secret[state->current ^ 1], addr_hash,
+                              expected) &&
+        coap_dtls_cookie_equal(cookie, expected))
+      return 1;
+  }
+
+  if (!coap_dtls_cookie_hmac(state->secret[state->current], addr_hash,
+                             expected))
+    return 0;
+  coap_log(LOG_DEBUG, "Invalid Cookie - sending Hello Verify\n");
+  coap_dtls_cookie_send_verify(endpoint, packet, payload, expected);
+  return 0;
+}
+
+void
+coap_dtls_cookie_free(coap_context_t *context) {
+  if (context->dtls_cookie) {
+    coap_free_type(COAP_STRING, context->dtls_cookie);
+    context->dtls_cookie = NULL;
+  }
+}
@@ -0,0 +1,711 @@
+/* coap_dtls_offload.c -- DTLS handshakes and records run by worker threads
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#if COAP_DTLS_OFFLOAD
+#include <pthread.h>
+
+/*
+ * A session whose handshake is in the hands of the worker threads has a
+ * coap_dtls_job_t attached.  The I/O thread appends the received records
+ * to the job and queues it for the workers, which feed the records to the
+ * (D)TLS library for as long as the handshake goes on.  Everything that
+ * has to be done in the I/O thread (events, connecting or disconnecting
+ * the session) is recorded as an action instead.  Once the handshake has
+ * finished, or there are no more records, the job is passed back to the
+ * I/O thread, which carries out the actions and then either detaches the
+ * job or queues it again.
+ *
+ * If record offload is enabled, established server sessions are handled in
+ * the same way: the workers decrypt the received records and keep the
+ * plaintext PDUs as actions, so that they are dispatched by the I/O thread
+ * in the order they were received.  The notifications are encrypted and
+ * sent by the workers too, and once a session has a job, everything it
+ * sends goes through the job until the job is detached.  That keeps the
+ * records of a session in order and means that the (D)TLS library is never
+ * used by two threads at once for the same session.
+ *
+ * A session is only ever worked on by one thread at a time and the job
+ * holds a reference on the session, so it cannot go away underneath.
+ */
+
+/* The maximum number of actions a job records before it is handed back */
+#define COAP_DTLS_JOB_ACTIONS 16
+
+typedef struct coap_dtls_record_t {
+  struct coap_dtls_record_t *next;
+  int outgoing;                 /* plaintext to be sent, rather than a
+                                   received record */
+  size_t length;
+  uint8_t data[1];
+} coap_dtls_record_t;
+
+typedef enum coap_dtls_job_state_t {
+  COAP_DTLS_JOB_IDLE = 0,       /* owned by the I/O thread */
+  COAP_DTLS_JOB_QUEUED,         /* waiting for a worker */
+  COAP_DTLS_JOB_RUNNING,        /* being worked on */
+  COAP_DTLS_JOB_DONE,           /* waiting for the I/O thread */
+  COAP_DTLS_JOB_REPLAYING       /* actions being carried out by the I/O
+                                   thread */
+} coap_dtls_job_state_t;
+
+struct coap_dtls_job_t {
+  struct coap_dtls_job_t *next;
+  coap_session_t *session;
+  coap_dtls_record_t *records;  /* received records, oldest first */
+  coap_dtls_record_t *records_tail;
+  coap_dtls_job_state_t state;
+  int halted;                   /* no more records until the actions
+                                   have been carried out */
+  int cancelled;                /* no more records as the session is being
+                                   disconnected (set with the mutex held) */
+  int sent;                     /* a datagram has been sent, so last_rx_tx
+                                   is to be updated */
+  unsigned int action_count;
+  struct {
+    coap_dtls_job_action_t action;
+    int value;
+    coap_dtls_record_t *pdu;    /* the plaintext for COAP_DTLS_JOB_PDU */
+  } actions[COAP_DTLS_JOB_ACTIONS];
+};
+
+struct coap_dtls_offload_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t work;          /* signalled when a job is queued */
+  pthread_cond_t idle;          /* signalled when a job is done */
+  coap_context_t *context;
+  coap_dtls_job_t *queue;       /* jobs waiting for a worker */
+  coap_dtls_job_t *queue_tail;
+  coap_dtls_job_t *done;        /* jobs waiting for the I/O thread */
+  unsigned int busy;            /* jobs queued or running */
+  unsigned int jobs;            /* jobs attached to sessions (only used by
+                                   the I/O thread) */
+  int stop;
+  unsigned int thread_count;
+  pthread_t threads[1];
+};
+
+/* The job a worker thread is currently running */
+static COAP_THREAD_LOCAL coap_dtls_job_t *coap_dtls_current_job;
+
+/*
+ * Only sessions that are private to the worker can be handed over. The
+ * Client Hello cookie exchange is only safe to offload where the library
+ * keeps that state per session.
+ */
+static int
+coap_dtls_offload_wanted(const coap_session_t *session) {
+  if (session->proto != COAP_PROTO_DTLS ||
+      session->type == COAP_SESSION_TYPE_CLIENT)
+    return 0;
+  if (session->type == COAP_SESSION_TYPE_HELLO)
+    return coap_get_tls_library_version()->type == COAP_TLS_LIBRARY_GNUTLS;
+  if (session->state == COAP_SESSION_STATE_ESTABLISHED)
+    return session->context->dtls_offload_records && session->tls;
+  return session->state == COAP_SESSION_STATE_HANDSHAKE && session->tls;
+}
+
+static void
+coap_dtls_job_add_record(coap_dtls_job_t *job, coap_dtls_record_t *record) {
+  record->next = NULL;
+  if (job->records_tail)
+    job->records_tail->next = record;
+  else
+    job->records = record;
+  job->records_tail = record;
+}
+
+static coap_dtls_record_t *
+coap_dtls_job_take_record(coap_dtls_job_t *job) {
+  coap_dtls_record_t *record = job->records;
+
+  if (record) {
+    job->records = record->next;
+    if (!job->records)
+      job->records_tail = NULL;
+  }
+  return record;
+}
+
+/* Called with the offload mutex held */
+static void
+coap_dtls_job_queue(coap_dtls_offload_t *offload, coap_dtls_job_t *job) {
+  job->state = COAP_DTLS_JOB_QUEUED;
+  job->next = NULL;
+  if (offload->queue_tail)
+    offload->queue_tail->next = job;
+  else
+    offload->queue = job;
+  offload->queue_tail = job;
+  offload->busy++;
+  pthread_cond_signal(&offload->work);
+}
+
+/* Feeds one record to the (D)TLS library on behalf of the I/O thread */
+static void
+coap_dtls_job_run_record(coap_dtls_job_t *job, coap_dtls_record_t *record) {
+  coap_session_t *session = job->session;
+
+  if (record->outgoing) {
+    if (session->tls)
+      coap_dtls_send(session, record->data, record->length);
+  } else if (session->type == COAP_SESSION_TYPE_HELLO) {
+    if (coap_dtls_hello(session, record->data, record->length) == 1)
+      coap_dtls_offload_defer(session, COAP_DTLS_JOB_HELLO, 0);
+  } else if (session->tls) {
+    coap_dtls_receive(session, record->data, record->length);
+  }
+}
+
+static void *
+coap_dtls_offload_worker(void *arg) {
+  coap_dtls_offload_t *offload = (coap_dtls_offload_t *)arg;
+
+  pthread_mutex_lock(&offload->mutex);
+  for (;;) {
+    coap_dtls_job_t *job;
+
+    while (!offload->queue && !offload->stop)
+      pthread_cond_wait(&offload->work, &offload->mutex);
+    if (!offload->queue)
+      break;
+    job = offload->queue;
+    offload->queue = job->next;
+    if (!offload->queue)
+      offload->queue_tail = NULL;
+    job->state = COAP_DTLS_JOB_RUNNING;
+
+    while (!job->halted && !job->cancelled && job->records) {
+      coap_dtls_record_t *record = coap_dtls_job_take_record(job);
+
+      pthread_mutex_unlock(&offload->mutex);
+      coap_dtls_current_job = job;
+      coap_dtls_job_run_record(job, record);
+      coap_dtls_current_job = NULL;
+      coap_free_type(COAP_STRING, record);
+      pthread_mutex_lock(&offload->mutex);
+    }
+
+    job->state = COAP_DTLS_JOB_DONE;
+    job->next = offload->done;
+    offload->done = job;
+    offload->busy--;
+    pthread_cond_broadcast(&offload->idle);
+    coap_context_wake_io(offload->context);
+  }
+  pthread_mutex_unlock(&offload->mutex);
+  return NULL;
+}
+
+static coap_dtls_record_t *
+coap_dtls_record_new(const uint8_t *data, size_t data_len, int outgoing) {
+  coap_dtls_record_t *record;
+
+  record = coap_malloc_type(COAP_STRING,
+                            sizeof(coap_dtls_record_t) + data_len);
+  if (!record)
+    return NULL;
+  record->next = NULL;
+  record->outgoing = outgoing;
+  record->length = data_len;
+  memcpy(record->data, data, data_len);
+  return record;
+}
+
+/* Appends a record to the job of @p session, setting the job up if need be */
+static void
+coap_dtls_offload_record(coap_session_t *session,
+                         const uint8_t *data, size_t data_len, int outgoing) {
+  coap_dtls_offload_t *offload = session->context->dtls_offload;
+  coap_dtls_job_t *job = session->dtls_job;
+  coap_dtls_record_t *record;
+
+  record = coap_dtls_record_new(data, data_len, outgoing);
+  if (!record)
+    return;
+
+  if (!job) {
+    job = coap_malloc_type(COAP_STRING, sizeof(coap_dtls_job_t));
+    if (!job) {
+      coap_free_type(COAP_STRING, record);
+      return;
+    }
+    memset(job, 0, sizeof(coap_dtls_job_t));
+    job->session = coap_session_reference(session);
+    session->dtls_job = job;
+    offload->jobs++;
+  }
+
+  pthread_mutex_lock(&offload->mutex);
+  coap_dtls_job_add_record(job, record);
+  if (job->state == COAP_DTLS_JOB_IDLE)
+    coap_dtls_job_queue(offload, job);
+  pthread_mutex_unlock(&offload->mutex);
+}
+
+int
+coap_dtls_offload_packet(coap_session_t *session,
+                         const uint8_t *data, size_t data_len) {
+  if (!session->context->dtls_offload ||
+      (!session->dtls_job && !coap_dtls_offload_wanted(session)))
+    return 0;
+  coap_dtls_offload_record(session, data, data_len, 0);
+  return 1;
+}
+
+int
+coap_dtls_offload_send(coap_session_t *session,
+                       const uint8_t *data, size_t data_len) {
+  coap_dtls_job_t *job = session->dtls_job;
+
+  if (!session->context->dtls_offload || coap_dtls_offload_in_worker())
+    return 0;
+  if (!job) {
+    /* Only the notifications are worth a job of their own */
+    if (session->context->tx_class != COAP_TX_BULK ||
+        session->state != COAP_SESSION_STATE_ESTABLISHED ||
+        !coap_dtls_offload_wanted(session))
+      return 0;
+  } else if (job->state == COAP_DTLS_JOB_REPLAYING && !job->records) {
+    /* Nothing to keep in order with, and the session is not in use */
+    return 0;
+  }
+  coap_dtls_offload_record(session, data, data_len, 1);
+  return 1;
+}
+
+int
+coap_dtls_offload_defer_pdu(coap_session_t *session,
+                            const uint8_t *data, size_t data_len) {
+  coap_dtls_job_t *job = coap_dtls_current_job;
+  coap_dtls_record_t *pdu;
+
+  if (!job || job->session != session)
+    return 0;
+  if (job->action_count == COAP_DTLS_JOB_ACTIONS) {
+    /* Cannot happen, as the job halts when the last one is taken */
+    coap_log(LOG_WARNING, "***%s: too many DTLS PDUs\n",
+             coap_session_str(session));
+    return 1;
+  }
+  pdu = coap_dtls_record_new(data, data_len, 0);
+  if (!pdu)
+    return 1;
+  job->actions[job->action_count].action = COAP_DTLS_JOB_PDU;
+  job->actions[job->action_count].value = 0;
+  job->actions[job->action_count].pdu = pdu;
+  job->action_count++;
+  if (job->action_count == COAP_DTLS_JOB_ACTIONS)
+    job->halted = 1;
+  return 1;
+}
+
+int
+coap_dtls_offload_defer(coap_session_t *session,
+                        coap_dtls_job_action_t action, int value) {
+  coap_dtls_job_t *job = coap_dtls_current_job;
+
+  if (!job || job->session != session)
+    return 0;
+  if (job->action_count < COAP_DTLS_JOB_ACTIONS) {
+    job->actions[job->action_count].action = action;
+    job->actions[job->action_count].value = value;
+    job->actions[job->action_count].pdu = NULL;
+    job->action_count++;
+  } else {
+    coap_log(LOG_WARNING, "***%s: too many DTLS handshake actions\n",
+             coap_session_str(session));
+  }
+  if (action != COAP_DTLS_JOB_EVENT ||
+      job->action_count == COAP_DTLS_JOB_ACTIONS)
+    job->halted = 1;
+  return 1;
+}
+
+int
+coap_dtls_offload_defer_sent(coap_session_t *session) {
+  coap_dtls_job_t *job = coap_dtls_current_job;
+
+  if (!job || job->session != session)
+    return 0;
+  job->sent = 1;
+  return 1;
+}
+
+int
+coap_dtls_offload_in_worker(void) {
+  return coap_dtls_current_job != NULL;
+}
+
+void
+coap_dtls_offload_cancel(coap_session_t *session) {
+  coap_dtls_offload_t *offload = session->context->dtls_offload;
+  coap_dtls_job_t *job = session->dtls_job;
+
+  if (!offload || !job || coap_dtls_offload_in_worker())
+    return;
+
+  pthread_mutex_lock(&offload->mutex);
+  job->cancelled = 1;
+  if (job->state == COAP_DTLS_JOB_QUEUED) {
+    /* Take it off the queue as if a worker had finished with it */
+    coap_dtls_job_t **jp;
+
+    for (jp = &offload->queue; *jp != job; jp = &(*jp)->next);
+    *jp = job->next;
+    if (offload->queue_tail == job) {
+      coap_dtls_job_t *tail;
+
+      for (tail = offload->queue; tail && tail->next; tail = tail->next);
+      offload->queue_tail = tail;
+    }
+    job->state = COAP_DTLS_JOB_DONE;
+    job->next = offload->done;
+    offload->done = job;
+    offload->busy--;
+  }
+  while (job->state == COAP_DTLS_JOB_RUNNING)
+    pthread_cond_wait(&offload->idle, &offload->mutex);
+  pthread_mutex_unlock(&offload->mutex);
+}
+
+/* Drops the plaintext PDUs of actions that have not been carried out */
+static void
+coap_dtls_job_drop_actions(coap_dtls_job_t *job) {
+  unsigned int i;
+
+  for (i = 0; i < job->action_count; i++)
+    coap_free_type(COAP_STRING, job->actions[i].pdu);
+  job->action_count = 0;
+}
+
+/* Detaches the job from its session, dropping anything still pending */
+static void
+coap_dtls_job_free(coap_dtls_offload_t *offload, coap_dtls_job_t *job) {
+  coap_session_t *session = job->session;
+  coap_dtls_record_t *record;
+
+  while ((record = coap_dtls_job_take_record(job)) != NULL)
+    coap_free_type(COAP_STRING, record);
+  coap_dtls_job_drop_actions(job);
+  session->dtls_job = NULL;
+  offload->jobs--;
+  coap_free_type(COAP_STRING, job);
+  /* Any handshake retransmit timeouts are now looked after here */
+  coap_session_timer_arm(session, 0);
+  coap_session_release(session);
+}
+
+/*
+ * Carries out the actions of a job handed back by a worker.
+ *
+ * Returns 0 if the session has failed to set up and is to be freed.
+ */
+static int
+coap_dtls_job_replay(coap_dtls_job_t *job) {
+  coap_session_t *session = job->session;
+  unsigned int i;
+  int ok = 1;
+
+  if (job->sent) {
+    coap_io_ticks(session->context, &session->last_rx_tx);
+    job->sent = 0;
+  }
+  for (i = 0; i < job->action_count; i++) {
+    switch (job->actions[i].action) {
+    case COAP_DTLS_JOB_EVENT:
+      coap_handle_event(session->context,
+                        (coap_event_t)job->actions[i].value, session);
+      break;
+    case COAP_DTLS_JOB_CONNECTED:
+      coap_session_connected(session);
+      break;
+    case COAP_DTLS_JOB_DISCONNECTED:
+      coap_session_disconnected(session,
+                                (coap_nack_reason_t)job->actions[i].value);
+      break;
+    case COAP_DTLS_JOB_PDU:
+      /* Dropped if the session has failed in the meantime */
+      if (session->tls)
+        coap_handle_dgram(session->context, session,
+                          job->actions[i].pdu->data,
+                          job->actions[i].pdu->length);
+      coap_free_type(COAP_STRING, job->actions[i].pdu);
+      job->actions[i].pdu = NULL;
+      break;
+    case COAP_DTLS_JOB_HELLO:
+      /* As coap_session_new_dtls_session(), which would free the session */
+      coap_io_ticks(session->context, &session->last_rx_tx);
+      session->type = COAP_SESSION_TYPE_SERVER;
+      COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
+      session->tls = coap_dtls_new_server_session(session);
+      if (session->tls) {
+        session->state = COAP_SESSION_STATE_HANDSHAKE;
+        coap_session_lru_update(session);
+      } else {
+        ok = 0;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  job->action_count = 0;
+  job->halted = 0;
+  job->cancelled = 0;
+  return ok;
+}
+
+unsigned int
+coap_dtls_offload_process(coap_context_t *context) {
+  coap_dtls_offload_t *offload = context->dtls_offload;
+  coap_dtls_job_t *done;
+
+  if (!offload)
+    return 0;
+
+  pthread_mutex_lock(&offload->mutex);
+  done = offload->done;
+  offload->done = NULL;
+  pthread_mutex_unlock(&offload->mutex);
+
+  while (done) {
+    coap_dtls_job_t *job = done;
+    coap_session_t *session = job->session;
+
+    done = job->next;
+    job->state = COAP_DTLS_JOB_REPLAYING;
+    if (!coap_dtls_job_replay(job)) {
+      coap_dtls_job_free(offload, job);
+      if (session->ref == 0)
+        coap_session_free(session);
+      continue;
+    }
+    if (job->records && coap_dtls_offload_wanted(session)) {
+      /* The handshake is still going on, or more records have come in */
+      pthread_mutex_lock(&offload->mutex);
+      coap_dtls_job_queue(offload, job);
+      pthread_mutex_unlock(&offload->mutex);
+      continue;
+    }
+
+    /* Anything left over is not for the workers, so handle it here */
+    coap_session_reference(session);
+    while (job->records && session->dtls_job) {
+      coap_dtls_record_t *record = coap_dtls_job_take_record(job);
+
+      if (session->tls && session->type == COAP_SESSION_TYPE_SERVER) {
+        if (record->outgoing)
+          coap_dtls_send(session, record->data, record->length);
+        else
+          coap_dtls_receive(session, record->data, record->length);
+      }
+      coap_free_type(COAP_STRING, record);
+    }
+    if (session->dtls_job)
+      coap_dtls_job_free(offload, job);
+    coap_session_release(session);
+  }
+
+  return offload->jobs;
+}
+
+void
+coap_dtls_offload_drain(coap_context_t *context) {
+  coap_dtls_offload_t *offload = context->dtls_offload;
+  coap_dtls_job_t *done;
+
+  if (!offload)
+    return;
+
+  pthread_mutex_lock(&offload->mutex);
+  while (offload->busy)
+    pthread_cond_wait(&offload->idle, &offload->mutex);
+  done = offload->done;
+  offload->done = NULL;
+  pthread_mutex_unlock(&offload->mutex);
+
+  while (done) {
+    coap_dtls_job_t *job = done;
+
+    done = job->next;
+    job->state = COAP_DTLS_JOB_REPLAYING;
+    coap_dtls_job_free(offload, job);
+  }
+}
+
+void
+coap_dtls_offload_free(coap_context_t *context) {
+  coap_dtls_offload_t *offload = context->dtls_offload;
+  unsigned int i;
+
+  if (!offload)
+    return;
+
+  coap_dtls_offload_drain(context);
+  pthread_mutex_lock(&offload->mutex);
+  offload->stop = 1;
+  pthread_cond_broadcast(&offload->work);
+  pthread_mutex_unlock(&offload->mutex);
+  for (i = 0; i < offload->thread_count; i++)
+    pthread_join(offload->threads[i], NULL);
+
+  pthread_cond_destroy(&offload->work);
+  pthread_cond_destroy(&offload->idle);
+  pthread_mutex_destroy(&offload->mutex);
+  coap_free_type(COAP_STRING, offload);
+  context->dtls_offload = NULL;
+}
+
+int
+coap_context_set_dtls_handshake_threads(coap_context_t *context,
+                                        unsigned int threads) {
+  coap_dtls_offload_t *offload;
+
+  if (!context)
+    return 0;
+  coap_dtls_offload_free(context);
+  if (threads == 0)
+    return 1;
+
+  if (coap_get_tls_library_version()->type == COAP_TLS_LIBRARY_TINYDTLS ||
+      coap_get_tls_library_version()->type == COAP_TLS_LIBRARY_NOTLS) {
+    /* TinyDTLS keeps all the peers in one shared context */
+    coap_log(LOG_WARNING, "coap_context_set_dtls_handshake_threads: "
+                          "not supported by the (D)TLS library\n");
+    return 0;
+  }
+
+  offload = coap_malloc_type(COAP_STRING, sizeof(coap_dtls_offload_t) +
+                                          (threads - 1) * sizeof(pthread_t));
+  if (!offload)
+    return 0;
+  memset(offload, 0, sizeof(coap_dtls_offload_t));
+  offload->context = context;
+  pthread_mutex_init(&offload->mutex, NULL);
+  pthread_cond_init(&offload->work, NULL);
+  pthread_cond_init(&offload->idle, NULL);
+  context->dtls_offload = offload;
+
+  for (offload->thread_count = 0; offload->thread_count < threads;
+       offload->thread_count++) {
+    if (pthread_create(&offload->threads[offload->thread_count], NULL,
+                       coap_dtls_offload_worker, offload) != 0) {
+      coap_log(LOG_WARNING, "coap_context_set_dtls_handshake_threads: "
+                            "pthread_create: %s\n", coap_socket_strerror());
+      coap_dtls_offload_free(context);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int
+coap_context_set_dtls_record_offload(coap_context_t *context, int enable) {
+  if (!context)
+    return 0;
+  if (enable &&
+      (coap_get_tls_library_version()->type == COAP_TLS_LIBRARY_TINYDTLS ||
+       coap_get_tls_library_version()->type == COAP_TLS_LIBRARY_NOTLS)) {
+    coap_log(LOG_WARNING, "coap_context_set_dtls_record_offload: "
+                          "not supported by the (D)TLS library\n");
+    return 0;
+  }
+  context->dtls_offload_records = enable ? 1 : 0;
+  return 1;
+}
+
+#else /* ! COAP_DTLS_OFFLOAD */
+
+int
+coap_dtls_offload_packet(coap_session_t *session,
+                         const uint8_t *data, size_t data_len) {
+  (void)session;
+  (void)data;
+  (void)data_len;
+  return 0;
+}
+
+int
+coap_dtls_offload_send(coap_session_t *session,
+                       const uint8_t *data, size_t data_len) {
+  (void)session;
+  (void)data;
+  (void)data_len;
+  return 0;
+}
+
+int
+coap_dtls_offload_defer(coap_session_t *session,
+                        coap_dtls_job_action_t action, int value) {
+  (void)session;
+  (void)action;
+  (void)value;
+  return 0;
+}
+
+int
+coap_dtls_offload_defer_pdu(coap_session_t *session,
+                            const uint8_t *data, size_t data_len) {
+  (void)session;
+  (void)data;
+  (void)data_len;
+  return 0;
+}
+
+int
+coap_dtls_offload_defer_sent(coap_session_t *session) {
+  (void)session;
+  return 0;
+}
+
+int
+coap_dtls_offload_in_worker(void) {
+  return 0;
+}
+
+void
+coap_dtls_offload_cancel(coap_session_t *session) {
+  (void)session;
+}
+
+unsigned int
+coap_dtls_offload_process(coap_context_t *context) {
+  (void)context;
+  return 0;
+}
+
+void
+coap_dtls_offload_drain(coap_context_t *context) {
+  (void)context;
+}
+
+void
+coap_dtls_offload_free(coap_context_t *context) {
+  (void)context;
+}
+
+int
+coap_context_set_dtls_handshake_threads(coap_context_t *context,
+                                        unsigned int threads) {
+  (void)context;
+  (void)threads;
+  coap_log(LOG_WARNING,
+           "coap_context_set_dtls_handshake_threads: not supported\n");
+  return 0;
+}
+
+int
+coap_context_set_dtls_record_offload(coap_context_t *context, int enable) {
+  (void)context;
+  (void)enable;
+  coap_log(LOG_WARNING,
+           "coap_context_set_dtls_record_offload: not supported\n");
+  return 0;
+}
+
+#endif /* ! COAP_DTLS_OFFLOAD */
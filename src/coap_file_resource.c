@@ -0,0 +1,280 @@
+/* coap_file_resource.c -- Resources that serve the contents of a file
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define COAP_FILE_MMAP 1
+#endif /* HAVE_MMAP && HAVE_SYS_MMAN_H */
+
+#ifndef COAP_FILE_MMAP_MIN
+/*
+ * Files smaller than this are read in rather than mapped, so that one that
+ * is truncated while it is being sent cannot raise SIGBUS.
+ */
+#define COAP_FILE_MMAP_MIN (64 * 1024)
+#endif /* COAP_FILE_MMAP_MIN */
+
+/*
+ * The file is mapped (or read in) as a large body registered with the
+ * resource, so all the transfers of the file share the one mapping.  When
+ * the file changes, a new mapping is registered and the old one goes once
+ * the transfers that are still using it have finished.
+ */
+struct coap_file_resource_t {
+  char *filename;
+  uint16_t media_type;
+  int maxage;
+  coap_large_body_t *body; /* current contents, or NULL */
+  dev_t dev;               /* identity of the file mapped for body */
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+};
+
+typedef struct coap_file_map_t {
+  void *addr;
+  size_t length;
+  int mapped;              /* set if addr is mmap()ed, else allocated */
+} coap_file_map_t;
+
+static long
+coap_file_mtime_nsec(const struct stat *st) {
+#if defined(__linux__)
+  return st->st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  return st->st_mtimespec.tv_nsec;
+#else
+  (void)st;
+  return 0;
+#endif
+}
+
+/*
+ * The ETag is a hash of the file's identity, size and modification time,
+ * so it changes whenever the file is replaced or written to.
+ */
+static uint64_t
+coap_file_etag(const struct stat *st) {
+  uint64_t v[5];
+  const uint8_t *p = (const uint8_t *)v;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  v[0] = (uint64_t)st->st_dev;
+  v[1] = (uint64_t)st->st_ino;
+  v[2] = (uint64_t)st->st_size;
+  v[3] = (uint64_t)st->st_mtime;
+  v[4] = (uint64_t)coap_file_mtime_nsec(st);
+  for (i = 0; i < sizeof(v); i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  /* 0 asks coap_add_data_large_response() to make one up */
+  return h ? h : 1;
+}
+
+static void
+coap_file_release(coap_session_t *session, void *app_ptr) {
+  coap_file_map_t *map = (coap_file_map_t *)app_ptr;
+
+  (void)session;
+#if COAP_FILE_MMAP
+  if (map->mapped)
+    munmap(map->addr, map->length);
+  else
+#endif /* COAP_FILE_MMAP */
+    coap_free_type(COAP_STRING, map->addr);
+  coap_free_type(COAP_STRING, map);
+}
+
+/*
+ * Maps or reads in the @p length bytes of the file open as @p fp, returning
+ * 1 on success, else 0.
+ */
+static int
+coap_file_map(FILE *fp, size_t length, coap_file_map_t *map) {
+  size_t got;
+
+  map->addr = NULL;
+  map->length = length;
+  map->mapped = 0;
+  if (length == 0)
+    return 1;
+#if COAP_FILE_MMAP
+  /*
+   * A mapped file that is truncated raises SIGBUS when the pages past the
+   * new end are sent, which is why the file is to be replaced rather than
+   * rewritten in place.  Small files are copied, as they cost little to.
+   */
+  if (length >= COAP_FILE_MMAP_MIN) {
+    map->addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map->addr != MAP_FAILED) {
+      map->mapped = 1;
+      return 1;
+    }
+    map->addr = NULL;
+  }
+#endif /* COAP_FILE_MMAP */
+  map->addr = coap_malloc_type(COAP_STRING, length);
+  got = map->addr ? fread(map->addr, 1, length, fp) : 0;
+  if (got != length) {
+    coap_free_type(COAP_STRING, map->addr);
+    map->addr = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Makes sure that the body registered for @p resource is for the file as
+ * it currently is.
+ *
+ * Returns the body, or NULL if the file cannot be read.
+ */
+static coap_large_body_t *
+coap_file_update(coap_resource_t *resource) {
+  coap_file_resource_t *file = resource->file;
+  coap_file_map_t *map;
+  struct stat st;
+  FILE *fp;
+
+  if (stat(file->filename, &st) == -1 || !S_ISREG(st.st_mode)) {
+    coap_log(LOG_DEBUG, "coap_file_update: %s: %s\n", file->filename,
+             coap_socket_strerror());
+    return NULL;
+  }
+  if (file->body && file->dev == st.st_dev && file->ino == st.st_ino &&
+      file->size == st.st_size && file->mtime == st.st_mtime &&
+      file->mtime_nsec == coap_file_mtime_nsec(&st))
+    return file->body;
+
+  /* (Re-)load the file, leaving any old body to the transfers using it */
+  coap_resource_remove_large_body(resource, file->body);
+  file->body = NULL;
+  map = coap_malloc_type(COAP_STRING, sizeof(coap_file_map_t));
+  if (!map)
+    return NULL;
+  /*
+   * The size and identity are taken again from the file that is opened,
+   * as it may have been replaced since stat().
+   */
+  fp = fopen(file->filename, "rb");
+  if (!fp || fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+      !coap_file_map(fp, (size_t)st.st_size, map)) {
+    coap_log(LOG_WARNING, "coap_file_update: %s: cannot map: %s\n",
+             file->filename, coap_socket_strerror());
+    if (fp)
+      fclose(fp);
+    coap_free_type(COAP_STRING, map);
+    return NULL;
+  }
+  fclose(fp);
+  file->body = coap_resource_add_large_body(resource, coap_file_etag(&st),
+                                            map->length, map->addr,
+                                            coap_file_release, map);
+  if (file->body) {
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    file->mtime_nsec = coap_file_mtime_nsec(&st);
+  }
+  return file->body;
+}
+
+static void
+coap_file_get(coap_context_t *context, coap_resource_t *resource,
+              coap_session_t *session, coap_pdu_t *request,
+              coap_binary_t *token, coap_string_t *query,
+              coap_pdu_t *response) {
+  coap_file_resource_t *file = resource->file;
+  coap_large_body_t *body;
+
+  (void)context;
+  body = coap_file_update(resource);
+  if (!body) {
+    response->code = COAP_RESPONSE_CODE(404);
+    return;
+  }
+  response->code = COAP_RESPONSE_CODE(205);
+  if (!coap_add_large_body_response(resource, session, request, response,
+                                    token, query, file->media_type,
+                                    file->maxage, body))
+    response->code = COAP_RESPONSE_CODE(500);
+}
+
+coap_resource_t *
+coap_resource_file_init(coap_str_const_t *uri_path, const char *filename,
+                        uint16_t media_type, int maxage, int flags) {
+  coap_resource_t *r;
+  coap_file_resource_t *file;
+  size_t len;
+
+  assert(filename);
+  file = coap_malloc_type(COAP_STRING, sizeof(coap_file_resource_t));
+  if (!file)
+    return NULL;
+  memset(file, 0, sizeof(coap_file_resource_t));
+  len = strlen(filename);
+  file->filename = coap_malloc_type(COAP_STRING, len + 1);
+  if (!file->filename) {
+    coap_free_type(COAP_STRING, file);
+    return NULL;
+  }
+  memcpy(file->filename, filename, len + 1);
+  file->media_type = media_type;
+  file->maxage = maxage;
+
+  r = coap_resource_init(uri_path, flags);
+  if (!r) {
+    coap_free_type(COAP_STRING, file->filename);
+    coap_free_type(COAP_STRING, file);
+    return NULL;
+  }
+  r->file = file;
+  coap_register_handler(r, COAP_REQUEST_GET, coap_file_get);
+  return r;
+}
+
+void
+coap_delete_file_resource(coap_resource_t *resource) {
+  coap_file_resource_t *file = resource->file;
+
+  if (!file)
+    return;
+  /* The body itself goes with the resource's other large bodies */
+  coap_free_type(COAP_STRING, file->filename);
+  coap_free_type(COAP_STRING, file);
+  resource->file = NULL;
+}
+
+#else /* ! HAVE_SYS_STAT_H */
+
+coap_resource_t *
+coap_resource_file_init(coap_str_const_t *uri_path, const char *filename,
+                        uint16_t media_type, int maxage, int flags) {
+  (void)uri_path;
+  (void)filename;
+  (void)media_type;
+  (void)maxage;
+  (void)flags;
+  coap_log(LOG_WARNING, "coap_resource_file_init: not supported\n");
+  return NULL;
+}
+
+void
+coap_delete_file_resource(coap_resource_t *resource) {
+  (void)resource;
+}
+
+#endif /* ! HAVE_SYS_STAT_H */
@@ -73,7 +73,6 @@ typedef struct coap_ssl_t {
   const uint8_t *pdu;
   unsigned pdu_len;
   unsigned peekmode;
-  gnutls_datum_t cookie_key;
 } coap_ssl_t;
 
 /*
@@ -122,6 +121,8 @@ typedef struct coap_gnutls_context_t {
   char *root_ca_file;
   char *root_ca_path;
   gnutls_priority_t priority_cache;
+  gnutls_datum_t ticket_key;    /* Size 0 if no session tickets issued */
+  uint8_t ticket_key_data[COAP_DTLS_TICKET_KEY_LEN];
 } coap_gnutls_context_t;
 
 typedef enum coap_free_bye_t {
@@ -155,6 +156,9 @@ typedef enum coap_free_bye_t {
 
 static int dtls_log_level = 0;
 
+/* The session ticket key shared by all the contexts by default */
+static uint8_t default_ticket_key[COAP_DTLS_TICKET_KEY_LEN];
+
 static int post_client_hello_gnutls_pki(gnutls_session_t g_session);
 static int post_client_hello_gnutls_psk(gnutls_session_t g_session);
 static int psk_server_callback(gnutls_session_t g_session,
@@ -237,7 +241,7 @@ coap_gnutls_log_func(int level, const char* text)
 int
 coap_dtls_context_set_pki(coap_context_t *c_context,
                           const coap_dtls_pki_t* setup_data,
-                          const coap_dtls_role_t role COAP_UNUSED)
+                          const coap_dtls_role_t role)
 {
   coap_gnutls_context_t *g_context =
                          ((coap_gnutls_context_t *)c_context->dtls_context);
@@ -275,6 +279,8 @@ coap_dtls_context_set_pki(coap_context_t *c_context,
     }
   }
   g_context->psk_pki_enabled |= IS_PKI;
+  if (role == COAP_DTLS_ROLE_SERVER)
+    g_context->psk_pki_enabled |= IS_SERVER;
   return 1;
 }
 
@@ -337,7 +343,7 @@ coap_dtls_context_set_spsk(coap_context_t *c_context,
   if (!g_context || !setup_data)
     return 0;
 
-  g_context->psk_pki_enabled |= IS_PSK;
+  g_context->psk_pki_enabled |= IS_PSK | IS_SERVER;
   return 1;
 }
 
@@ -359,6 +365,56 @@ coap_dtls_context_set_cpsk(coap_context_t *c_context,
   return 1;
 }
 
+/*
+ * return 0 failed
+ *        1 passed
+ */
+int
+coap_dtls_context_set_ticket_key(coap_context_t *c_context,
+                                 const uint8_t *key, size_t key_len) {
+  coap_gnutls_context_t *g_context =
+                         ((coap_gnutls_context_t *)c_context->dtls_context);
+
+  if (!g_context)
+    return 0;
+  if (key) {
+    memcpy(g_context->ticket_key_data, key, key_len);
+    g_context->ticket_key.size = sizeof(g_context->ticket_key_data);
+  } else {
+    g_context->ticket_key.size = 0;
+  }
+  return 1;
+}
+
+/*
+ * GnuTLS loads the certificates, keys and root CAs for each session, so
+ * the configuration is just copied.
+ *
+ * return 0 failed
+ *        1 passed
+ */
+int
+coap_dtls_context_share(coap_context_t *c_context, coap_context_t *from) {
+  coap_gnutls_context_t *g_context =
+                         ((coap_gnutls_context_t *)c_context->dtls_context);
+  coap_gnutls_context_t *f_context =
+                         ((coap_gnutls_context_t *)from->dtls_context);
+
+  if (!g_context || !f_context)
+    return 0;
+  if ((f_context->root_ca_file || f_context->root_ca_path) &&
+      !coap_dtls_context_set_pki_root_cas(c_context, f_context->root_ca_file,
+                                          f_context->root_ca_path))
+    return 0;
+  g_context->setup_data = f_context->setup_data;
+  g_context->psk_pki_enabled |= f_context->psk_pki_enabled &
+                                (IS_PSK | IS_PKI | IS_SERVER);
+  memcpy(g_context->ticket_key_data, f_context->ticket_key_data,
+         sizeof(g_context->ticket_key_data));
+  g_context->ticket_key.size = f_context->ticket_key.size;
+  return 1;
+}
+
 /*
  * return 0 failed
  *        1 passed
@@ -374,6 +430,12 @@ coap_dtls_context_check_keys_enabled(coap_context_t *c_context)
 void coap_dtls_startup(void) {
   gnutls_global_set_audit_log_function(coap_gnutls_audit_log_func);
   gnutls_global_set_log_function(coap_gnutls_log_func);
+  if (gnutls_rnd(GNUTLS_RND_KEY, default_ticket_key,
+                 sizeof(default_ticket_key)) < 0) {
+    coap_log(LOG_WARNING,
+             "Insufficient entropy for session ticket key generation\n");
+    coap_prng(default_ticket_key, sizeof(default_ticket_key));
+  }
 }
 
 void coap_dtls_shutdown(void) {
@@ -417,6 +479,10 @@ coap_dtls_new_context(struct coap_context_t *c_context COAP_UNUSED) {
 
     G_CHECK(gnutls_global_init(), "gnutls_global_init");
     memset(g_context, 0, sizeof(struct coap_gnutls_context_t));
+    memcpy(g_context->ticket_key_data, default_ticket_key,
+           sizeof(g_context->ticket_key_data));
+    g_context->ticket_key.data = g_context->ticket_key_data;
+    g_context->ticket_key.size = sizeof(g_context->ticket_key_data);
     g_context->alpn_proto.data = gnutls_malloc(4);
     if (g_context->alpn_proto.data) {
       memcpy(g_context->alpn_proto.data, "coap", 4);
@@ -477,6 +543,10 @@ coap_dtls_free_context(void *handle) {
     gnutls_free(g_context->psk_sni_entry_list);
 
   gnutls_priority_deinit(g_context->priority_cache);
+#if (GNUTLS_VERSION_NUMBER >= 0x030400)
+  gnutls_memset(g_context->ticket_key_data, 0,
+                sizeof(g_context->ticket_key_data));
+#endif /* GNUTLS_VERSION_NUMBER >= 0x030400 */
 
   gnutls_global_deinit();
   gnutls_free(g_context);
@@ -520,7 +590,7 @@ psk_client_callback(gnutls_session_t g_session,
   if (g_context == NULL)
     return -1;
 
-  setup_data = &c_session->cpsk_setup_data;
+  setup_data = &c_session->ext->cpsk_setup_data;
 
   if (hint)
     hint_len = strlen(hint);
@@ -594,6 +664,7 @@ typedef struct {
   const gnutls_datum_t *cert_list;
   unsigned int cert_list_size;
   int self_signed; /* 1 if cert self-signed, 0 otherwise */
+  time_t expires; /* expiration time of the first cert in chain */
 } coap_gnutls_certificate_info_t;
 
 /*
@@ -634,6 +705,7 @@ static gnutls_certificate_type_t get_san_or_cn(gnutls_session_t g_session,
           GNUTLS_X509_FMT_DER), "gnutls_x509_crt_import");
 
   cert_info->self_signed = gnutls_x509_crt_check_issuer(cert, cert);
+  cert_info->expires = gnutls_x509_crt_get_expiration_time(cert);
 
   size = sizeof(dn) -1;
   /* See if there is a Subject Alt Name first */
@@ -687,6 +759,20 @@ fail:
                           cert_info.san_or_cn : "?")
 #endif /* GNUTLS_VERSION_NUMBER < 0x030606 */
 
+/*
+ * return The server name requested by the client, or NULL if none
+ */
+static const char *get_server_name(gnutls_session_t g_session,
+                                   char *name, size_t size)
+{
+  unsigned int type;
+
+  if (gnutls_server_name_get(g_session, name, &size, &type, 0) !=
+      GNUTLS_E_SUCCESS || type != GNUTLS_NAME_DNS)
+    return NULL;
+  return name;
+}
+
 /*
  * return 0 failed
  *        1 passed
@@ -704,6 +790,8 @@ static int cert_verify_gnutls(gnutls_session_t g_session)
   int ret;
   coap_gnutls_certificate_info_t cert_info;
   gnutls_certificate_type_t cert_type;
+  char sni_buf[256];
+  const char *sni = NULL;
 
   memset(&cert_info, 0, sizeof(cert_info));
   cert_type = get_san_or_cn(g_session, &cert_info);
@@ -712,9 +800,24 @@ static int cert_verify_gnutls(gnutls_session_t g_session)
     goto finish;
 #endif /* >= 3.6.6 */
 
+  if (cert_type == GNUTLS_CRT_X509) {
+    /* Skip the chain if this client's cert has been verified recently */
+    sni = get_server_name(g_session, sni_buf, sizeof(sni_buf));
+    if (coap_pki_cache_lookup(c_session, cert_info.cert_list[0].data,
+                              cert_info.cert_list[0].size, sni))
+      goto verified;
+  }
+
   G_CHECK(gnutls_certificate_verify_peers(g_session, NULL, 0, &status),
           "gnutls_certificate_verify_peers");
 
+  if (status == 0 && cert_type == GNUTLS_CRT_X509 &&
+      cert_info.expires > time(NULL)) {
+    coap_pki_cache_add(c_session, cert_info.cert_list[0].data,
+                       cert_info.cert_list[0].size, sni,
+                       (unsigned long)(cert_info.expires - time(NULL)));
+  }
+
   if (status) {
     status &= ~(GNUTLS_CERT_INVALID);
     if (status & (GNUTLS_CERT_NOT_ACTIVATED|GNUTLS_CERT_EXPIRED)) {
@@ -808,6 +911,7 @@ static int cert_verify_gnutls(gnutls_session_t g_session)
   if (fail)
     goto fail;
 
+verified:
   if (g_context->setup_data.validate_cn_call_back) {
     gnutls_x509_crt_t cert;
     uint8_t der[2048];
@@ -1635,11 +1739,12 @@ setup_client_ssl_session(coap_session_t *c_session, coap_gnutls_env_t *g_env)
 {
   coap_gnutls_context_t *g_context =
              (coap_gnutls_context_t *)c_session->context->dtls_context;
+  const coap_tls_resume_t *resume;
   int ret;
 
   g_context->psk_pki_enabled |= IS_CLIENT;
   if (g_context->psk_pki_enabled & IS_PSK) {
-    coap_dtls_cpsk_t *setup_data = &c_session->cpsk_setup_data;
+    coap_dtls_cpsk_t *setup_data = &c_session->ext->cpsk_setup_data;
     G_CHECK(gnutls_psk_allocate_client_credentials(&g_env->psk_cl_credentials),
             "gnutls_psk_allocate_client_credentials");
     gnutls_psk_set_client_credentials_function(g_env->psk_cl_credentials,
@@ -1712,6 +1817,13 @@ setup_client_ssl_session(coap_session_t *c_session, coap_gnutls_env_t *g_env)
               "gnutls_server_name_set");
     }
   }
+
+  /* Try to resume the last session with this server */
+  resume = coap_tls_resume_find(c_session);
+  if (resume &&
+      gnutls_session_set_data(g_env->g_session, resume->data,
+                              resume->length) != GNUTLS_E_SUCCESS)
+    coap_tls_resume_forget(c_session);
   return GNUTLS_E_SUCCESS;
 
 fail:
@@ -1753,15 +1865,18 @@ psk_server_callback(gnutls_session_t g_session,
     identity = "";
 
   /* Track the Identity being used */
-  if (c_session->psk_identity)
-    coap_delete_bin_const(c_session->psk_identity);
-  c_session->psk_identity = coap_new_bin_const((const uint8_t *)identity,
+  if (c_session->ext->psk_identity)
+    coap_delete_bin_const(c_session->ext->psk_identity);
+  c_session->ext->psk_identity = coap_new_bin_const((const uint8_t *)identity,
                                                identity_len);
 
   coap_log(LOG_DEBUG, "got psk_identity: '%.*s'\n",
                       (int)identity_len, identity);
 
-  if (setup_data->validate_id_call_back) {
+  /* A key found in the store is returned by get_server_psk() */
+  if (!coap_psk_store_set_session_key(c_session, (const uint8_t*)identity,
+                                      identity_len) &&
+      setup_data->validate_id_call_back) {
     coap_bin_const_t lidentity;
     lidentity.length = identity_len;
     lidentity.s = (const uint8_t*)identity;
@@ -1802,7 +1917,10 @@ setup_server_ssl_session(coap_session_t *c_session, coap_gnutls_env_t *g_env)
              (coap_gnutls_context_t *)c_session->context->dtls_context;
   int ret = GNUTLS_E_SUCCESS;
 
-  g_context->psk_pki_enabled |= IS_SERVER;
+  /*
+   * IS_SERVER is set when the server keys are set up, as this may be run
+   * by a DTLS handshake worker thread.
+   */
   if (g_context->psk_pki_enabled & IS_PSK) {
     G_CHECK(setup_psk_credentials(
                              &g_env->psk_sv_credentials,
@@ -1840,6 +1958,12 @@ setup_server_ssl_session(coap_session_t *c_session, coap_gnutls_env_t *g_env)
                                    g_env->pki_credentials),
             "gnutls_credentials_set\n");
   }
+
+  if (g_context->ticket_key.size) {
+    G_CHECK(gnutls_session_ticket_enable_server(g_env->g_session,
+                                                &g_context->ticket_key),
+            "gnutls_session_ticket_enable_server");
+  }
   return GNUTLS_E_SUCCESS;
 
 fail:
@@ -2041,7 +2165,6 @@ coap_dtls_free_gnutls_env(coap_gnutls_context_t *g_context,
       gnutls_certificate_free_credentials(g_env->pki_credentials);
       g_env->pki_credentials = NULL;
     }
-    gnutls_free(g_env->coap_ssl_data.cookie_key.data);
     gnutls_free(g_env);
   }
 }
@@ -2082,8 +2205,9 @@ do_gnutls_handshake(coap_session_t *c_session, coap_gnutls_env_t *g_env) {
   switch (ret) {
   case GNUTLS_E_SUCCESS:
     g_env->established = 1;
-    coap_log(LOG_DEBUG, "*  %s: GnuTLS established\n",
-                                            coap_session_str(c_session));
+    coap_log(LOG_DEBUG, "*  %s: GnuTLS established%s\n",
+             coap_session_str(c_session),
+             gnutls_session_is_resumed(g_env->g_session) ? " (resumed)" : "");
     ret = 1;
     break;
   case GNUTLS_E_INTERRUPTED:
@@ -2194,8 +2318,23 @@ void *coap_dtls_new_client_session(coap_session_t *c_session) {
   return g_env;
 }
 
+/* Saves the state of an established client session for resumption */
+static void
+coap_gnutls_save_resume(coap_session_t *c_session, coap_gnutls_env_t *g_env) {
+  gnutls_datum_t data;
+
+  if (c_session->type != COAP_SESSION_TYPE_CLIENT || !g_env->established ||
+      g_env->sent_alert)
+    return;
+  if (gnutls_session_get_data2(g_env->g_session, &data) != GNUTLS_E_SUCCESS)
+    return;
+  coap_tls_resume_save(c_session, data.data, data.size);
+  gnutls_free(data.data);
+}
+
 void coap_dtls_free_session(coap_session_t *c_session) {
   if (c_session && c_session->context && c_session->tls) {
+    coap_gnutls_save_resume(c_session, c_session->tls);
     coap_dtls_free_gnutls_env(c_session->context->dtls_context,
                 c_session->tls,
                 COAP_PROTO_NOT_RELIABLE(c_session->proto) ?
@@ -2341,8 +2480,11 @@ coap_dtls_receive(coap_session_t *c_session,
   coap_gnutls_env_t *g_env = (coap_gnutls_env_t *)c_session->tls;
   int ret = 0;
   coap_ssl_t *ssl_data = &g_env->coap_ssl_data;
-
+#if (GNUTLS_VERSION_NUMBER >= 0x030305)
+  gnutls_packet_t packet;
+#else /* GNUTLS_VERSION_NUMBER < 0x030305 */
   uint8_t pdu[COAP_RXBUFFER_SIZE];
+#endif /* GNUTLS_VERSION_NUMBER < 0x030305 */
 
   assert(g_env != NULL);
 
@@ -2360,10 +2502,24 @@ coap_dtls_receive(coap_session_t *c_session,
       gnutls_transport_set_ptr(g_env->g_session, c_session);
       coap_session_connected(c_session);
     }
+#if (GNUTLS_VERSION_NUMBER >= 0x030305)
+    /* Handle the PDU where GnuTLS has decrypted it, rather than a copy */
+    ret = gnutls_record_recv_packet(g_env->g_session, &packet);
+    if (ret > 0) {
+      gnutls_datum_t plain;
+
+      gnutls_packet_get(packet, &plain, NULL);
+      ret = coap_handle_dgram(c_session->context, c_session, plain.data,
+                              plain.size);
+      gnutls_packet_deinit(packet);
+      return ret;
+    }
+#else /* GNUTLS_VERSION_NUMBER < 0x030305 */
     ret = gnutls_record_recv(g_env->g_session, pdu, (int)sizeof(pdu));
     if (ret > 0) {
       return coap_handle_dgram(c_session->context, c_session, pdu, (size_t)ret);
     }
+#endif /* GNUTLS_VERSION_NUMBER < 0x030305 */
     else if (ret == 0) {
       c_session->dtls_event = COAP_EVENT_DTLS_CLOSED;
     }
@@ -2445,36 +2601,24 @@ coap_dtls_hello(coap_session_t *c_session,
     g_env = coap_dtls_new_gnutls_env(c_session, GNUTLS_SERVER);
     if (g_env) {
       c_session->tls = g_env;
-      gnutls_key_generate(&g_env->coap_ssl_data.cookie_key,
-                          GNUTLS_COOKIE_KEY_SIZE);
     }
     else {
       /* error should have already been reported */
       return -1;
     }
   }
-  if (data_len > 0) {
+  if (data_len > 18) {
     gnutls_dtls_prestate_st prestate;
-    uint8_t *data_rw;
 
+    /*
+     * The cookie has already been checked by coap_dtls_cookie_check(), so
+     * carry on from the HelloVerifyRequest that it sent, as
+     * gnutls_dtls_cookie_verify() would have done.
+     */
     memset(&prestate, 0, sizeof(prestate));
-    /* Need to do this to not get a compiler warning about const parameters */
-    memcpy (&data_rw, &data, sizeof(data_rw));
-    ret = gnutls_dtls_cookie_verify(&g_env->coap_ssl_data.cookie_key,
-                                     &c_session->addr_info,
-                                     sizeof(c_session->addr_info),
-                                     data_rw, data_len,
-                                     &prestate);
-    if (ret < 0) {  /* cookie not valid */
-      coap_log(LOG_DEBUG, "Invalid Cookie - sending Hello Verify\n");
-      gnutls_dtls_cookie_send(&g_env->coap_ssl_data.cookie_key,
-                              &c_session->addr_info,
-                              sizeof(c_session->addr_info),
-                              &prestate,
-                              c_session,
-                              coap_dgram_write);
-      return 0;
-    }
+    prestate.record_seq = data[10];     /* Record sequence number */
+    prestate.hsk_read_seq = data[18];   /* Handshake message_seq */
+    prestate.hsk_write_seq = 0;         /* That of the HelloVerifyRequest */
     gnutls_dtls_prestate_set(g_env->g_session, &prestate);
   }
 
@@ -2509,6 +2653,11 @@ coap_dtls_hello(coap_session_t *c_session,
   return ret;
 }
 
+int
+coap_dtls_is_cookie_stateless(void) {
+  return 1;
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *c_session COAP_UNUSED) {
   return 37;
 }
@@ -2833,6 +2982,11 @@ ssize_t coap_tls_read(coap_session_t *c_session,
   }
   return ret;
 }
+
+int coap_tls_is_ktls_send(coap_session_t *c_session COAP_UNUSED) {
+  /* Records are always encrypted through the push function */
+  return 0;
+}
 #endif /* !COAP_DISABLE_TCP */
 
 coap_digest_ctx_t *
@@ -2868,6 +3022,75 @@ coap_digest_final(coap_digest_ctx_t *digest_ctx,
   return 1;
 }
 
+#if (GNUTLS_VERSION_NUMBER >= 0x030400)
+/* The key of a gnutls_datum_t is not const, so it is given a copy */
+static int
+coap_crypto_aead_init(gnutls_aead_cipher_hd_t *handle, const uint8_t *key) {
+  uint8_t key_copy[COAP_OSCORE_KEY_LEN];
+  gnutls_datum_t k = { key_copy, COAP_OSCORE_KEY_LEN };
+
+  memcpy(key_copy, key, COAP_OSCORE_KEY_LEN);
+  return gnutls_aead_cipher_init(handle, GNUTLS_CIPHER_AES_128_CCM_8, &k);
+}
+
+int
+coap_crypto_aead_encrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  gnutls_aead_cipher_hd_t handle;
+  size_t out_len = in_len + COAP_OSCORE_TAG_LEN;
+  int ret;
+
+  if (coap_crypto_aead_init(&handle, key) < 0)
+    return 0;
+  ret = gnutls_aead_cipher_encrypt(handle, nonce, COAP_OSCORE_NONCE_LEN,
+                                   aad, aad_len, COAP_OSCORE_TAG_LEN,
+                                   in, in_len, out, &out_len);
+  gnutls_aead_cipher_deinit(handle);
+  return ret == 0 && out_len == in_len + COAP_OSCORE_TAG_LEN;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  gnutls_aead_cipher_hd_t handle;
+  size_t out_len = in_len - COAP_OSCORE_TAG_LEN;
+  int ret;
+
+  if (in_len < COAP_OSCORE_TAG_LEN ||
+      coap_crypto_aead_init(&handle, key) < 0)
+    return 0;
+  ret = gnutls_aead_cipher_decrypt(handle, nonce, COAP_OSCORE_NONCE_LEN,
+                                   aad, aad_len, COAP_OSCORE_TAG_LEN,
+                                   in, in_len, out, &out_len);
+  gnutls_aead_cipher_deinit(handle);
+  return ret == 0;
+}
+#else /* GNUTLS_VERSION_NUMBER < 0x030400 */
+int
+coap_crypto_aead_encrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+#endif /* GNUTLS_VERSION_NUMBER < 0x030400 */
+
 #else /* !HAVE_LIBGNUTLS */
 
 #ifdef __clang__
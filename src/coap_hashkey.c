@@ -24,3 +24,100 @@ coap_hash_impl(const unsigned char *s, size_t len, coap_key_t h) {
   }
 }
 
+
+/* The secret of wyhash (see https://github.com/wangyi-fudan/wyhash) */
+#define COAP_UTHASH_P0 UINT64_C(0xa0761d6478bd642f)
+#define COAP_UTHASH_P1 UINT64_C(0xe7037ed1a0b428db)
+
+/* The mixed-in random seed of coap_uthash_hash() */
+static uint64_t coap_uthash_seed;
+
+/* Sets *a and *b to the low and high half of *a times *b */
+COAP_STATIC_INLINE void
+coap_uthash_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else /* ! __SIZEOF_INT128__ */
+  uint64_t ha = *a >> 32, hb = *b >> 32;
+  uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t lo = t + (rm1 << 32);
+
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+  *a = lo;
+#endif /* ! __SIZEOF_INT128__ */
+}
+
+COAP_STATIC_INLINE uint64_t
+coap_uthash_mix(uint64_t a, uint64_t b) {
+  coap_uthash_mum(&a, &b);
+  return a ^ b;
+}
+
+COAP_STATIC_INLINE uint64_t
+coap_uthash_r8(const uint8_t *p) {
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+COAP_STATIC_INLINE uint64_t
+coap_uthash_r4(const uint8_t *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void
+coap_uthash_init(void) {
+  uint64_t seed = 0;
+
+  coap_prng(&seed, sizeof(seed));
+  coap_uthash_seed = seed ^ coap_uthash_mix(seed ^ COAP_UTHASH_P0,
+                                            COAP_UTHASH_P1);
+}
+
+unsigned int
+coap_uthash_hash(const void *key, size_t len) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t seed = coap_uthash_seed;
+  uint64_t a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      size_t mid = (len >> 3) << 2;
+
+      a = (coap_uthash_r4(p) << 32) | coap_uthash_r4(p + mid);
+      b = (coap_uthash_r4(p + len - 4) << 32) |
+          coap_uthash_r4(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+
+    while (i > 16) {
+      seed = coap_uthash_mix(coap_uthash_r8(p) ^ COAP_UTHASH_P1,
+                             coap_uthash_r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = coap_uthash_r8(p + i - 16);
+    b = coap_uthash_r8(p + i - 8);
+  }
+
+  a ^= COAP_UTHASH_P1;
+  b ^= seed;
+  coap_uthash_mum(&a, &b);
+  return (unsigned int)coap_uthash_mix(a ^ COAP_UTHASH_P0 ^ len,
+                                       b ^ COAP_UTHASH_P1);
+}
@@ -0,0 +1,161 @@
+/* coap_histogram.c -- Latency histograms
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif /* HAVE_TIME_H */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>  /* _POSIX_TIMERS */
+#endif /* HAVE_UNISTD_H */
+
+#define SUB_BUCKETS (1U << COAP_HISTOGRAM_SUB_BITS)
+
+/*
+ * Values below SUB_BUCKETS each have a bucket of their own.  Above that,
+ * a value with its most significant bit at position e goes into the
+ * bucket for e, picked out by the COAP_HISTOGRAM_SUB_BITS bits below it.
+ */
+static unsigned int
+coap_histogram_bucket(uint64_t value) {
+  unsigned int msb;
+  unsigned int bucket;
+
+  if (value < SUB_BUCKETS)
+    return (unsigned int)value;
+  msb = coap_flsll((long long)value) - 1;
+  bucket = (msb - COAP_HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS +
+           (unsigned int)((value >> (msb - COAP_HISTOGRAM_SUB_BITS)) &
+                          (SUB_BUCKETS - 1));
+  return bucket < COAP_HISTOGRAM_BUCKETS ? bucket :
+                                           COAP_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t
+coap_histogram_bucket_value(unsigned int bucket) {
+  unsigned int msb;
+
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+  if (bucket >= COAP_HISTOGRAM_BUCKETS)
+    bucket = COAP_HISTOGRAM_BUCKETS - 1;
+  msb = bucket / SUB_BUCKETS + COAP_HISTOGRAM_SUB_BITS - 1;
+  return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) <<
+         (msb - COAP_HISTOGRAM_SUB_BITS);
+}
+
+uint64_t
+coap_histogram_clock(void) {
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+  struct timespec tv;
+
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+#else /* ! _POSIX_TIMERS || ! CLOCK_MONOTONIC */
+  coap_tick_t now;
+
+  coap_ticks(&now);
+  return (uint64_t)now * 1000000 / COAP_TICKS_PER_SECOND;
+#endif /* ! _POSIX_TIMERS || ! CLOCK_MONOTONIC */
+}
+
+void
+coap_histogram_add(coap_histogram_t *histogram, uint64_t value) {
+  histogram->count++;
+  histogram->sum += value;
+  if (value < histogram->min)
+    histogram->min = value;
+  if (value > histogram->max)
+    histogram->max = value;
+  histogram->buckets[coap_histogram_bucket(value)]++;
+}
+
+void
+coap_histogram_record_since(coap_histogram_t **histogram, uint64_t start) {
+  coap_histogram_t *h = *histogram;
+  uint64_t now = coap_histogram_clock();
+
+  if (!h) {
+    h = coap_malloc_type(COAP_STRING, sizeof(coap_histogram_t));
+    if (!h)
+      return;
+    memset(h, 0, sizeof(coap_histogram_t));
+    h->min = UINT64_MAX;
+    *histogram = h;
+  }
+  coap_histogram_add(h, now > start ? now - start : 0);
+}
+
+void
+coap_histogram_free(coap_histogram_t *histogram) {
+  coap_free_type(COAP_STRING, histogram);
+}
+
+static int
+coap_histogram_get(const coap_histogram_t *from, coap_histogram_t *to) {
+  if (!from)
+    return 0;
+  *to = *from;
+  return 1;
+}
+
+void
+coap_context_set_histograms(coap_context_t *context, int enable) {
+  context->histograms = enable ? 1 : 0;
+}
+
+int
+coap_resource_get_handler_histogram(const coap_resource_t *resource,
+                                    coap_histogram_t *histogram) {
+  return coap_histogram_get(resource->handler_histogram, histogram);
+}
+
+int
+coap_session_get_rtt_histogram(const coap_session_t *session,
+                               coap_histogram_t *histogram) {
+  return coap_histogram_get(session->rtt_histogram, histogram);
+}
+
+int
+coap_context_get_notify_histogram(const coap_context_t *context,
+                                  coap_histogram_t *histogram) {
+  return coap_histogram_get(context->notify_histogram, histogram);
+}
+
+uint64_t
+coap_histogram_percentile(const coap_histogram_t *histogram,
+                          double percentile) {
+  uint64_t wanted;
+  uint64_t seen = 0;
+  unsigned int i;
+
+  if (!histogram->count)
+    return 0;
+  if (percentile <= 0)
+    return histogram->min;
+  if (percentile >= 100)
+    return histogram->max;
+  wanted = (uint64_t)(percentile * histogram->count / 100.0 + 0.5);
+  if (wanted == 0)
+    wanted = 1;
+  for (i = 0; i < COAP_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= wanted) {
+      /* The largest value the bucket holds, kept within what was seen */
+      uint64_t value = i + 1 < COAP_HISTOGRAM_BUCKETS ?
+                       coap_histogram_bucket_value(i + 1) - 1 :
+                       histogram->max;
+
+      if (value > histogram->max)
+        value = histogram->max;
+      if (value < histogram->min)
+        value = histogram->min;
+      return value;
+    }
+  }
+  return histogram->max;
+}
@@ -6,6 +6,11 @@
  * README for terms of use.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* needed for recvmmsg() and struct mmsghdr */
+#define _GNU_SOURCE 1
+#endif
+
 #include "coap2/coap_internal.h"
 
 #ifdef HAVE_STDIO_H
@@ -39,6 +44,12 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_SENDMMSG
+# include <netinet/udp.h>
+#endif
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
 #include <errno.h>
 #ifdef COAP_EPOLL_SUPPORT
 #include <sys/epoll.h>
@@ -47,6 +58,17 @@
 #include <limits.h>
 #endif
 #endif /* COAP_EPOLL_SUPPORT */
+#ifdef COAP_KQUEUE_SUPPORT
+#include <sys/event.h>
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#endif /* COAP_KQUEUE_SUPPORT */
+#ifdef COAP_IO_URING_SUPPORT
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* COAP_IO_URING_SUPPORT */
 
 #ifdef WITH_CONTIKI
 # include "uip.h"
@@ -120,6 +142,16 @@ coap_socket_connect_udp(coap_socket_t *sock,
   return 0;
 }
 
+int
+coap_socket_set_path_mtu_discovery(coap_socket_t *sock, int family) {
+  return 0;
+}
+
+size_t
+coap_socket_get_path_mtu(coap_socket_t *sock, int family) {
+  return 0;
+}
+
 ssize_t
 coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len) {
   return -1;
@@ -181,6 +213,13 @@ coap_socket_bind_udp(coap_socket_t *sock,
     coap_log(LOG_WARNING,
              "coap_socket_bind_udp: setsockopt SO_REUSEADDR: %s\n",
               coap_socket_strerror());
+#ifdef SO_REUSEPORT
+  if ((sock->flags & COAP_SOCKET_REUSEPORT) &&
+      setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, OPTVAL_T(&on), sizeof(on)) == COAP_SOCKET_ERROR)
+    coap_log(LOG_WARNING,
+             "coap_socket_bind_udp: setsockopt SO_REUSEPORT: %s\n",
+              coap_socket_strerror());
+#endif /* SO_REUSEPORT */
 #endif /* RIOT_VERSION */
 
   switch (listen_addr->addr.sa.sa_family) {
@@ -202,6 +241,13 @@ coap_socket_bind_udp(coap_socket_t *sock,
                 coap_socket_strerror());
     setsockopt(sock->fd, IPPROTO_IP, GEN_IP_PKTINFO, OPTVAL_T(&on), sizeof(on)); /* ignore error, because the likely cause is that IPv4 is disabled at the os level */
     break;
+#ifdef COAP_AF_UNIX_SUPPORT
+  case AF_UNIX:
+    /* Take over the path from an earlier server that did not clean up */
+    if (listen_addr->addr.cun.sun_path[0])
+      unlink(listen_addr->addr.cun.sun_path);
+    break;
+#endif /* COAP_AF_UNIX_SUPPORT */
   default:
     coap_log(LOG_ALERT, "coap_socket_bind_udp: unsupported sa_family\n");
     break;
@@ -286,6 +332,10 @@ coap_socket_connect_udp(coap_socket_t *sock,
                coap_socket_strerror());
 #endif /* RIOT_VERSION */
     break;
+#ifdef COAP_AF_UNIX_SUPPORT
+  case AF_UNIX:
+    break;
+#endif /* COAP_AF_UNIX_SUPPORT */
   default:
     coap_log(LOG_ALERT, "coap_socket_connect_udp: unsupported sa_family\n");
     break;
@@ -306,6 +356,21 @@ coap_socket_connect_udp(coap_socket_t *sock,
                coap_socket_strerror());
       goto error;
     }
+#ifdef COAP_AF_UNIX_SUPPORT
+  } else if (connect_addr.addr.sa.sa_family == AF_UNIX) {
+    /*
+     * The server can only answer a socket that has an address, so have
+     * Linux give it an unused one in the abstract namespace.
+     */
+    sa_family_t family = AF_UNIX;
+
+    if (bind(sock->fd, (const struct sockaddr *)&family,
+             (socklen_t)sizeof(family)) == COAP_SOCKET_ERROR) {
+      coap_log(LOG_WARNING, "coap_socket_connect_udp: bind: %s\n",
+               coap_socket_strerror());
+      goto error;
+    }
+#endif /* COAP_AF_UNIX_SUPPORT */
   }
 
   /* special treatment for sockets that are used for multicast communication */
@@ -359,12 +424,82 @@ error:
   return 0;
 }
 
+#if defined(IP_MTU_DISCOVER) && defined(IP_MTU) && \
+    defined(IPV6_MTU_DISCOVER) && defined(IPV6_MTU)
+#define COAP_PATH_MTU_SUPPORT 1
+#endif /* IP_MTU_DISCOVER && IP_MTU && IPV6_MTU_DISCOVER && IPV6_MTU */
+
+int
+coap_socket_set_path_mtu_discovery(coap_socket_t *sock, int family) {
+#ifdef COAP_PATH_MTU_SUPPORT
+  int want;
+
+  switch (family) {
+  case AF_INET:
+    want = IP_PMTUDISC_WANT;
+    if (setsockopt(sock->fd, IPPROTO_IP, IP_MTU_DISCOVER, OPTVAL_T(&want),
+                   sizeof(want)) == COAP_SOCKET_ERROR)
+      break;
+    return 1;
+  case AF_INET6:
+    want = IPV6_PMTUDISC_WANT;
+    if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, OPTVAL_T(&want),
+                   sizeof(want)) == COAP_SOCKET_ERROR)
+      break;
+    return 1;
+  default:
+    return 0;
+  }
+  coap_log(LOG_WARNING,
+           "coap_socket_set_path_mtu_discovery: setsockopt: %s\n",
+           coap_socket_strerror());
+  return 0;
+#else /* ! COAP_PATH_MTU_SUPPORT */
+  (void)sock;
+  (void)family;
+  return 0;
+#endif /* ! COAP_PATH_MTU_SUPPORT */
+}
+
+size_t
+coap_socket_get_path_mtu(coap_socket_t *sock, int family) {
+#ifdef COAP_PATH_MTU_SUPPORT
+  int mtu = 0;
+  socklen_t len = (socklen_t)sizeof(mtu);
+
+  /* Take off the IP and UDP headers */
+  switch (family) {
+  case AF_INET:
+    if (getsockopt(sock->fd, IPPROTO_IP, IP_MTU, OPTVAL_GT(&mtu),
+                   &len) == COAP_SOCKET_ERROR || mtu <= 20 + 8)
+      return 0;
+    return (size_t)mtu - 20 - 8;
+  case AF_INET6:
+    if (getsockopt(sock->fd, IPPROTO_IPV6, IPV6_MTU, OPTVAL_GT(&mtu),
+                   &len) == COAP_SOCKET_ERROR || mtu <= 40 + 8)
+      return 0;
+    return (size_t)mtu - 40 - 8;
+  default:
+    return 0;
+  }
+#else /* ! COAP_PATH_MTU_SUPPORT */
+  (void)sock;
+  (void)family;
+  return 0;
+#endif /* ! COAP_PATH_MTU_SUPPORT */
+}
+
 void coap_socket_close(coap_socket_t *sock) {
   if (sock->fd != COAP_INVALID_SOCKET) {
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
     coap_context_t *context = sock->session ? sock->session->context :
                               sock->endpoint ? sock->endpoint->context : NULL;
-    if (context != NULL) {
+    if (context != NULL && context->io_external) {
+      context->io_callbacks.remove(context, sock, sock->fd,
+                                   context->io_callbacks_arg);
+    }
+#ifdef COAP_EPOLL_SUPPORT
+    else if (context != NULL) {
       int ret;
       struct epoll_event event;
 
@@ -378,6 +513,7 @@ void coap_socket_close(coap_socket_t *sock) {
       }
     }
 #endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
     sock->endpoint = NULL;
     sock->session = NULL;
     coap_closesocket(sock->fd);
@@ -403,8 +539,16 @@ coap_epoll_ctl_mod(coap_socket_t *sock,
                             sock->endpoint ? sock->endpoint->context : NULL;
   if (context == NULL)
     return;
+  if (context->io_external) {
+    coap_io_external_watch(context, sock, events, 0);
+    return;
+  }
 
   event.events = events;
+  if (sock->flags & COAP_SOCKET_EDGE)
+    event.events |= EPOLLET;
+  if (sock->flags & COAP_SOCKET_URING)
+    event.events &= ~EPOLLIN;
   event.data.ptr = sock;
 
   ret = epoll_ctl(context->epfd, EPOLL_CTL_MOD, sock->fd, &event);
@@ -417,16 +561,145 @@ coap_epoll_ctl_mod(coap_socket_t *sock,
 }
 #endif /* COAP_EPOLL_SUPPORT */
 
-ssize_t
-coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len) {
-  ssize_t r;
+#ifdef COAP_KQUEUE_SUPPORT
+/*
+ * Applies the (up to two) @p changes to the kqueue of @p context.  With
+ * EV_RECEIPT each change reports its own result, so a failing one does not
+ * stop the others and no pending events get picked up.  A filter that is
+ * not there to be deleted is not an error.
+ */
+static int
+coap_kqueue_change(coap_context_t *context, struct kevent *changes,
+                   int nchanges, const char *func) {
+  struct kevent results[2];
+  int i, n;
+  int ok = 1;
+
+  assert(nchanges <= 2);
+  for (i = 0; i < nchanges; i++)
+    changes[i].flags |= EV_RECEIPT;
+  n = kevent(context->epfd, changes, nchanges, results, nchanges, NULL);
+  if (n == -1) {
+    coap_log(LOG_ERR, "%s: kevent failed: %s (%d)\n",
+             func, coap_socket_strerror(), errno);
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if ((results[i].flags & EV_ERROR) && results[i].data != 0 &&
+        results[i].data != ENOENT) {
+      coap_log(LOG_ERR, "%s: kevent failed: %s (%d)\n",
+               func, coap_socket_format_errno((int)results[i].data),
+               (int)results[i].data);
+      ok = 0;
+    }
+  }
+  return ok;
+}
 
-  sock->flags &= ~(COAP_SOCKET_WANT_WRITE | COAP_SOCKET_CAN_WRITE);
-#ifdef _WIN32
-  r = send(sock->fd, (const char *)data, (int)data_len, 0);
-#else
-  r = send(sock->fd, data, data_len, 0);
-#endif
+void
+coap_epoll_ctl_mod(coap_socket_t *sock,
+                   uint32_t events,
+                   const char *func
+) {
+  struct kevent changes[2];
+  coap_context_t *context;
+  unsigned short clear;
+
+  if (sock == NULL)
+    return;
+
+  context = sock->session ? sock->session->context :
+                            sock->endpoint ? sock->endpoint->context : NULL;
+  if (context == NULL)
+    return;
+  if (context->io_external) {
+    coap_io_external_watch(context, sock, events, 0);
+    return;
+  }
+
+  /* EV_ADD also updates a filter that is already there */
+  clear = (sock->flags & COAP_SOCKET_EDGE) ? EV_CLEAR : 0;
+  EV_SET(&changes[0], sock->fd, EVFILT_READ,
+         EV_ADD | clear | ((events & EPOLLIN) ? EV_ENABLE : EV_DISABLE),
+         0, 0, sock);
+  EV_SET(&changes[1], sock->fd, EVFILT_WRITE,
+         EV_ADD | ((events & EPOLLOUT) ? EV_ENABLE : EV_DISABLE),
+         0, 0, sock);
+  coap_kqueue_change(context, changes, 2, func);
+}
+
+void
+coap_kqueue_set_timer(coap_context_t *ctx, coap_tick_t delay,
+                      const char *func) {
+  struct kevent change;
+  coap_tick_t due = 0;
+
+  if (delay) {
+    coap_io_ticks(ctx, &due);
+    due += delay;
+  }
+  if (due == ctx->kq_timer_due)
+    return;
+  if (due) {
+    /* Adding the timer again replaces when it fires */
+    EV_SET(&change, 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+           (intptr_t)((delay * 1000 + COAP_TICKS_PER_SECOND - 1) /
+                      COAP_TICKS_PER_SECOND), NULL);
+  } else {
+    EV_SET(&change, 0, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+  }
+#ifdef COAP_DEBUG_WAKEUP_TIMES
+  coap_log(LOG_INFO, "****** Next wakeup in %" PRIu64 " ticks\n",
+           (uint64_t)delay);
+#endif /* COAP_DEBUG_WAKEUP_TIMES */
+  if (coap_kqueue_change(ctx, &change, 1, func))
+    ctx->kq_timer_due = due;
+}
+#endif /* COAP_KQUEUE_SUPPORT */
+
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+void
+coap_io_external_watch(coap_context_t *ctx, coap_socket_t *sock,
+                       uint32_t events, int add) {
+  unsigned int io_events = 0;
+
+  if (events & EPOLLIN)
+    io_events |= COAP_IO_EVENT_READ;
+  if (events & EPOLLOUT)
+    io_events |= COAP_IO_EVENT_WRITE;
+  if (add)
+    ctx->io_callbacks.add(ctx, sock, sock->fd, io_events,
+                          ctx->io_callbacks_arg);
+  else
+    ctx->io_callbacks.modify(ctx, sock, sock->fd, io_events,
+                             ctx->io_callbacks_arg);
+}
+
+void
+coap_io_external_set_timer(coap_context_t *ctx, coap_tick_t delay) {
+  coap_tick_t due = 0;
+
+  if (delay) {
+    coap_io_ticks(ctx, &due);
+    due += delay;
+  }
+  if (due == ctx->io_timer_due)
+    return;
+  ctx->io_timer_due = due;
+  ctx->io_callbacks.set_timer(ctx,
+                              (unsigned int)((delay * 1000 +
+                                              COAP_TICKS_PER_SECOND - 1) /
+                                             COAP_TICKS_PER_SECOND),
+                              ctx->io_callbacks_arg);
+}
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+
+/*
+ * Updates the socket flags for the result @p r of writing @p data_len bytes
+ * to @p sock, returning the number of bytes written or -1 on error.
+ */
+static ssize_t
+coap_socket_write_result(coap_socket_t *sock, ssize_t r, size_t data_len) {
   if (r == COAP_SOCKET_ERROR) {
 #ifdef _WIN32
     if (WSAGetLastError() == WSAEWOULDBLOCK) {
@@ -436,13 +709,13 @@ coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len) {
     if (errno==EAGAIN || errno == EINTR) {
 #endif
       sock->flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
       coap_epoll_ctl_mod(sock,
                          EPOLLOUT |
                           ((sock->flags & COAP_SOCKET_WANT_READ) ?
                            EPOLLIN : 0),
                          __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
       return 0;
     }
     if (errno == EPIPE || errno == ECONNRESET) {
@@ -457,17 +730,45 @@ coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len) {
   }
   if (r < (ssize_t)data_len) {
     sock->flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
       coap_epoll_ctl_mod(sock,
                          EPOLLOUT |
                           ((sock->flags & COAP_SOCKET_WANT_READ) ?
                            EPOLLIN : 0),
                          __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
   }
   return r;
 }
 
+ssize_t
+coap_socket_write(coap_socket_t *sock, const uint8_t *data, size_t data_len) {
+  ssize_t r;
+
+  sock->flags &= ~(COAP_SOCKET_WANT_WRITE | COAP_SOCKET_CAN_WRITE);
+#ifdef _WIN32
+  r = send(sock->fd, (const char *)data, (int)data_len, 0);
+#else
+  r = send(sock->fd, data, data_len, 0);
+#endif
+  return coap_socket_write_result(sock, r, data_len);
+}
+
+#if COAP_SOCKET_SENDV
+ssize_t
+coap_socket_writev(coap_socket_t *sock, const struct iovec *iov, int iovcnt) {
+  ssize_t r;
+  size_t data_len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    data_len += iov[i].iov_len;
+  sock->flags &= ~(COAP_SOCKET_WANT_WRITE | COAP_SOCKET_CAN_WRITE);
+  r = writev(sock->fd, iov, iovcnt);
+  return coap_socket_write_result(sock, r, data_len);
+}
+#endif /* COAP_SOCKET_SENDV */
+
 ssize_t
 coap_socket_read(coap_socket_t *sock, uint8_t *data, size_t data_len) {
   ssize_t r;
@@ -560,7 +861,139 @@ static __declspec(thread) LPFN_WSARECVMSG lpWSARecvMsg = NULL;
 #define ipi_spec_dst ipi_addr
 #endif
 
+#if !defined(RIOT_VERSION) && defined(HAVE_STRUCT_CMSGHDR)
+/**
+ * Adds the ancillary data to @p mhdr that selects @p local and @p ifindex as
+ * the source of an outgoing datagram. @p buf must be large enough to hold
+ * the largest packet info type (struct in6_pktinfo).
+ *
+ * @param mhdr    The message header to update.
+ * @param buf     The control buffer to use.
+ * @param local   The local address to send from.
+ * @param ifindex The interface index to send from.
+ *
+ * @return @c 1 on success, or @c 0 if the address family is not supported.
+ */
+static int
+coap_network_set_pktinfo(struct msghdr *mhdr, char *buf,
+                         const coap_address_t *local, int ifindex) {
+  if (coap_address_isany(local) || coap_is_mcast(local) ||
+      coap_address_is_unix(local))
+    return 1;
+
+  switch (local->addr.sa.sa_family) {
+  case AF_INET6:
+  {
+    struct cmsghdr *cmsg;
+
+    if (IN6_IS_ADDR_V4MAPPED(&local->addr.sin6.sin6_addr)) {
+#if defined(IP_PKTINFO)
+      struct in_pktinfo *pktinfo;
+      mhdr->msg_control = buf;
+      mhdr->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+
+      cmsg = CMSG_FIRSTHDR(mhdr);
+      cmsg->cmsg_level = SOL_IP;
+      cmsg->cmsg_type = IP_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+      pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+      pktinfo->ipi_ifindex = ifindex;
+      memcpy(&pktinfo->ipi_spec_dst,
+             local->addr.sin6.sin6_addr.s6_addr + 12,
+             sizeof(pktinfo->ipi_spec_dst));
+#elif defined(IP_SENDSRCADDR)
+      mhdr->msg_control = buf;
+      mhdr->msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
+
+      cmsg = CMSG_FIRSTHDR(mhdr);
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type = IP_SENDSRCADDR;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
+
+      memcpy(CMSG_DATA(cmsg),
+             local->addr.sin6.sin6_addr.s6_addr + 12,
+             sizeof(struct in_addr));
+#endif /* IP_PKTINFO */
+    } else {
+      struct in6_pktinfo *pktinfo;
+      mhdr->msg_control = buf;
+      mhdr->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+
+      cmsg = CMSG_FIRSTHDR(mhdr);
+      cmsg->cmsg_level = IPPROTO_IPV6;
+      cmsg->cmsg_type = IPV6_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+      pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+
+      pktinfo->ipi6_ifindex = ifindex;
+      memcpy(&pktinfo->ipi6_addr,
+             &local->addr.sin6.sin6_addr,
+             sizeof(pktinfo->ipi6_addr));
+    }
+    break;
+  }
+  case AF_INET:
+  {
+#if defined(IP_PKTINFO)
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *pktinfo;
+
+    mhdr->msg_control = buf;
+    mhdr->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+
+    cmsg = CMSG_FIRSTHDR(mhdr);
+    cmsg->cmsg_level = SOL_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+    pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+    pktinfo->ipi_ifindex = ifindex;
+    memcpy(&pktinfo->ipi_spec_dst,
+           &local->addr.sin.sin_addr,
+           sizeof(pktinfo->ipi_spec_dst));
+#elif defined(IP_SENDSRCADDR)
+    struct cmsghdr *cmsg;
+    mhdr->msg_control = buf;
+    mhdr->msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
+
+    cmsg = CMSG_FIRSTHDR(mhdr);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_SENDSRCADDR;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
+
+    memcpy(CMSG_DATA(cmsg),
+           &local->addr.sin.sin_addr,
+           sizeof(struct in_addr));
+#endif /* IP_PKTINFO */
+    break;
+  }
+  default:
+    /* error */
+    coap_log(LOG_WARNING, "protocol not supported\n");
+    return 0;
+  }
+  return 1;
+}
+#endif /* ! RIOT_VERSION && HAVE_STRUCT_CMSGHDR */
+
 #ifndef RIOT_VERSION
+/*
+ * Endpoint sockets are never connected.  Their flags are not looked at, as
+ * the DTLS handshake workers send on them while the I/O thread updates the
+ * flags.
+ */
+static int
+coap_socket_is_connected(const coap_socket_t *sock,
+                         const coap_session_t *session) {
+  if (session->endpoint && sock == &session->endpoint->sock)
+    return 0;
+  return (sock->flags & COAP_SOCKET_CONNECTED) != 0;
+}
+
 ssize_t
 coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint8_t *data, size_t datalen) {
   ssize_t bytes_written = 0;
@@ -568,7 +1001,7 @@ coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint
   if (!coap_debug_send_packet()) {
     bytes_written = (ssize_t)datalen;
 #ifndef WITH_CONTIKI
-  } else if (sock->flags & COAP_SOCKET_CONNECTED) {
+  } else if (coap_socket_is_connected(sock, session)) {
 #ifdef _WIN32
     bytes_written = send(sock->fd, (const char *)data, (int)datalen, 0);
 #else
@@ -601,103 +1034,9 @@ coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint
     mhdr.msg_iov = iov;
     mhdr.msg_iovlen = 1;
 
-    if (!coap_address_isany(&session->addr_info.local) &&
-        !coap_is_mcast(&session->addr_info.local))
-    switch (session->addr_info.local.addr.sa.sa_family) {
-    case AF_INET6:
-    {
-      struct cmsghdr *cmsg;
-
-      if (IN6_IS_ADDR_V4MAPPED(&session->addr_info.local.addr.sin6.sin6_addr)) {
-#if defined(IP_PKTINFO)
-        struct in_pktinfo *pktinfo;
-        mhdr.msg_control = buf;
-        mhdr.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
-
-        cmsg = CMSG_FIRSTHDR(&mhdr);
-        cmsg->cmsg_level = SOL_IP;
-        cmsg->cmsg_type = IP_PKTINFO;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-
-        pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-
-        pktinfo->ipi_ifindex = session->ifindex;
-        memcpy(&pktinfo->ipi_spec_dst,
-               session->addr_info.local.addr.sin6.sin6_addr.s6_addr + 12,
-               sizeof(pktinfo->ipi_spec_dst));
-#elif defined(IP_SENDSRCADDR)
-        mhdr.msg_control = buf;
-        mhdr.msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
-
-        cmsg = CMSG_FIRSTHDR(&mhdr);
-        cmsg->cmsg_level = IPPROTO_IP;
-        cmsg->cmsg_type = IP_SENDSRCADDR;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
-
-        memcpy(CMSG_DATA(cmsg),
-               session->addr_info.local.addr.sin6.sin6_addr.s6_addr + 12,
-               sizeof(struct in_addr));
-#endif /* IP_PKTINFO */
-      } else {
-        struct in6_pktinfo *pktinfo;
-        mhdr.msg_control = buf;
-        mhdr.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
-
-        cmsg = CMSG_FIRSTHDR(&mhdr);
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_PKTINFO;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-
-        pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-
-        pktinfo->ipi6_ifindex = session->ifindex;
-        memcpy(&pktinfo->ipi6_addr,
-               &session->addr_info.local.addr.sin6.sin6_addr,
-               sizeof(pktinfo->ipi6_addr));
-      }
-      break;
-    }
-    case AF_INET:
-    {
-#if defined(IP_PKTINFO)
-      struct cmsghdr *cmsg;
-      struct in_pktinfo *pktinfo;
-
-      mhdr.msg_control = buf;
-      mhdr.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
-
-      cmsg = CMSG_FIRSTHDR(&mhdr);
-      cmsg->cmsg_level = SOL_IP;
-      cmsg->cmsg_type = IP_PKTINFO;
-      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-
-      pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-
-      pktinfo->ipi_ifindex = session->ifindex;
-      memcpy(&pktinfo->ipi_spec_dst,
-             &session->addr_info.local.addr.sin.sin_addr,
-             sizeof(pktinfo->ipi_spec_dst));
-#elif defined(IP_SENDSRCADDR)
-      struct cmsghdr *cmsg;
-      mhdr.msg_control = buf;
-      mhdr.msg_controllen = CMSG_SPACE(sizeof(struct in_addr));
-
-      cmsg = CMSG_FIRSTHDR(&mhdr);
-      cmsg->cmsg_level = IPPROTO_IP;
-      cmsg->cmsg_type = IP_SENDSRCADDR;
-      cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
-
-      memcpy(CMSG_DATA(cmsg),
-             &session->addr_info.local.addr.sin.sin_addr,
-             sizeof(struct in_addr));
-#endif /* IP_PKTINFO */
-      break;
-    }
-    default:
-      /* error */
-      coap_log(LOG_WARNING, "protocol not supported\n");
+    if (!coap_network_set_pktinfo(&mhdr, buf, &session->addr_info.local,
+                                  session->ifindex))
       bytes_written = -1;
-    }
 #endif /* HAVE_STRUCT_CMSGHDR */
 
 #ifdef _WIN32
@@ -733,24 +1072,641 @@ coap_network_send(coap_socket_t *sock, const coap_session_t *session, const uint
 }
 #endif /* RIOT_VERSION */
 
-#define SIN6(A) ((struct sockaddr_in6 *)(A))
-
-void
-coap_packet_get_memmapped(coap_packet_t *packet, unsigned char **address, size_t *length) {
-  *address = packet->payload;
-  *length = packet->length;
-}
+#if defined(HAVE_SENDMMSG) && defined(HAVE_STRUCT_CMSGHDR) && \
+    !defined(WITH_CONTIKI) && !defined(RIOT_VERSION)
+#define COAP_TX_BATCHING 1
+#else
+#define COAP_TX_BATCHING 0
+#endif
 
-#ifndef RIOT_VERSION
-ssize_t
-coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
-  ssize_t len = -1;
+#if COAP_TX_BATCHING
+/* Linux limits a GSO super-datagram to UDP_MAX_SEGMENTS (64) segments */
+#define COAP_TX_GSO_SEGMENTS 64
 
-  assert(sock);
-  assert(packet);
+/**
+ * A datagram that has been queued by coap_socket_send() for transmission
+ * with the next coap_io_flush().
+ */
+typedef struct coap_tx_entry_t {
+  coap_fd_t fd;                    /**< endpoint socket to send on */
+  int ifindex;                     /**< interface to send from */
+  coap_address_t remote;           /**< destination address */
+  coap_address_t local;            /**< source address */
+  size_t length;                   /**< length of data */
+  uint8_t tx_class;                /**< coap_tx_class_t of the datagram */
+  uint8_t data[COAP_RXBUFFER_SIZE]; /**< the datagram */
+} coap_tx_entry_t;
+
+struct coap_tx_batch_t {
+  unsigned int count;              /**< number of queued entries */
+  int gso;                         /**< 1 if UDP_SEGMENT can be used */
+  coap_tx_entry_t entries[COAP_TX_BATCH_SIZE];
+  coap_tx_entry_t *sorted[COAP_TX_BATCH_SIZE]; /**< entries in the order
+                                                    they are sent */
+};
 
-  if ((sock->flags & COAP_SOCKET_CAN_READ) == 0) {
-    return -1;
+int
+coap_context_set_tx_batching(coap_context_t *context, int enable) {
+  if (!enable) {
+    if (context->tx_batch) {
+      coap_io_flush(context);
+      coap_free_type(COAP_STRING, context->tx_batch);
+      context->tx_batch = NULL;
+    }
+    return 1;
+  }
+  if (context->tx_batch)
+    return 1;
+  context->tx_batch = coap_malloc_type(COAP_STRING,
+                                       sizeof(struct coap_tx_batch_t));
+  if (!context->tx_batch) {
+    coap_log(LOG_WARNING, "coap_context_set_tx_batching: malloc failed\n");
+    return 0;
+  }
+  context->tx_batch->count = 0;
+#ifdef UDP_SEGMENT
+  context->tx_batch->gso = 1;
+#else /* ! UDP_SEGMENT */
+  context->tx_batch->gso = 0;
+#endif /* ! UDP_SEGMENT */
+  return 1;
+}
+
+/*
+ * Queue the datagram for the next coap_io_flush(). Only datagrams sent on
+ * an endpoint socket are queued, anything else returns 0 and is sent
+ * immediately by the caller.
+ */
+static ssize_t
+coap_tx_batch_add(coap_socket_t *sock, const coap_session_t *session,
+                  const struct iovec *iov, int iovcnt) {
+  struct coap_tx_batch_t *batch = session->context->tx_batch;
+  coap_tx_entry_t *entry;
+  size_t datalen = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    datalen += iov[i].iov_len;
+
+  if (!batch || coap_dtls_offload_in_worker() ||
+      session->context->network_send != coap_network_send ||
+      session->endpoint == NULL || sock != &session->endpoint->sock ||
+      datalen > sizeof(batch->entries[0].data) ||
+      coap_address_is_unix(&session->addr_info.remote))
+    return 0;
+
+  if (!coap_debug_send_packet()) {
+    /* simulated packet loss */
+    return (ssize_t)datalen;
+  }
+
+  if (batch->count == COAP_TX_BATCH_SIZE)
+    coap_io_flush(session->context);
+
+  entry = &batch->entries[batch->count++];
+  entry->fd = sock->fd;
+  entry->ifindex = session->ifindex;
+  entry->tx_class = session->context->tx_class;
+  coap_address_copy(&entry->remote, &session->addr_info.remote);
+  coap_address_copy(&entry->local, &session->addr_info.local);
+  entry->length = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(entry->data + entry->length, iov[i].iov_base, iov[i].iov_len);
+    entry->length += iov[i].iov_len;
+  }
+  return (ssize_t)datalen;
+}
+
+#ifdef UDP_SEGMENT
+/*
+ * Returns the number of entries starting at @p first that can be sent as
+ * a single GSO super-datagram.  All must have the same source and
+ * destination and, apart from the last one, the same length.
+ */
+static unsigned int
+coap_tx_gso_run(struct coap_tx_batch_t *batch, unsigned int first) {
+  coap_tx_entry_t *head = batch->sorted[first];
+  size_t total = head->length;
+  unsigned int i;
+
+  for (i = first + 1; i < batch->count && i - first < COAP_TX_GSO_SEGMENTS;
+       i++) {
+    coap_tx_entry_t *entry = batch->sorted[i];
+
+    if (batch->sorted[i - 1]->length != head->length ||
+        entry->length > head->length ||
+        total + entry->length > 65507 ||
+        entry->fd != head->fd || entry->ifindex != head->ifindex ||
+        !coap_address_equals(&entry->remote, &head->remote) ||
+        !coap_address_equals(&entry->local, &head->local))
+      break;
+    total += entry->length;
+  }
+  return i - first;
+}
+
+/*
+ * Sends @p count entries starting at @p first with a single sendmsg() and
+ * a UDP_SEGMENT control message.
+ *
+ * Returns 1 if sent, 0 if GSO is not supported or -1 on other errors.
+ */
+static int
+coap_tx_send_gso(struct coap_tx_batch_t *batch, unsigned int first,
+                 unsigned int count) {
+  coap_tx_entry_t *head = batch->sorted[first];
+  struct iovec iov[COAP_TX_GSO_SEGMENTS];
+  union {
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo)) +
+             CMSG_SPACE(sizeof(uint16_t))];
+    size_t align; /* CMSG_ALIGN() alignment */
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr mhdr;
+  uint16_t segment = (uint16_t)head->length;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = batch->sorted[first + i]->data;
+    iov[i].iov_len = (iov_len_t)batch->sorted[first + i]->length;
+  }
+  memset(&control, 0, sizeof(control));
+  memset(&mhdr, 0, sizeof(mhdr));
+  mhdr.msg_name = &head->remote.addr;
+  mhdr.msg_namelen = head->remote.size;
+  mhdr.msg_iov = iov;
+  mhdr.msg_iovlen = count;
+  coap_network_set_pktinfo(&mhdr, control.buf, &head->local, head->ifindex);
+
+  /* append the segment size after any packet info */
+  cmsg = (struct cmsghdr *)(control.buf + mhdr.msg_controllen);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+  mhdr.msg_control = control.buf;
+  mhdr.msg_controllen += CMSG_SPACE(sizeof(uint16_t));
+
+  if (sendmsg(head->fd, &mhdr, 0) < 0) {
+    if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+        errno == EOPNOTSUPP) {
+      coap_log(LOG_DEBUG, "coap_io_flush: UDP GSO not available: %s\n",
+               coap_socket_strerror());
+      return 0;
+    }
+    coap_log(LOG_CRIT, "coap_io_flush: %s\n", coap_socket_strerror());
+    return -1;
+  }
+  return 1;
+}
+#endif /* UDP_SEGMENT */
+
+/*
+ * Sends @p count entries starting at @p first with as few sendmmsg() calls
+ * as possible.  Consecutive entries on the same socket are grouped together.
+ */
+static void
+coap_tx_send_mmsg(struct coap_tx_batch_t *batch, unsigned int first,
+                  unsigned int count) {
+  struct mmsghdr mmsg[COAP_TX_BATCH_SIZE];
+  struct iovec iov[COAP_TX_BATCH_SIZE];
+  union {
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    size_t align; /* CMSG_ALIGN() alignment */
+  } control[COAP_TX_BATCH_SIZE];
+  unsigned int i;
+
+  memset(mmsg, 0, count * sizeof(mmsg[0]));
+  for (i = 0; i < count; i++) {
+    coap_tx_entry_t *entry = batch->sorted[first + i];
+
+    iov[i].iov_base = entry->data;
+    iov[i].iov_len = (iov_len_t)entry->length;
+    memset(control[i].buf, 0, sizeof(control[i].buf));
+    mmsg[i].msg_hdr.msg_name = &entry->remote.addr;
+    mmsg[i].msg_hdr.msg_namelen = entry->remote.size;
+    mmsg[i].msg_hdr.msg_iov = &iov[i];
+    mmsg[i].msg_hdr.msg_iovlen = 1;
+    coap_network_set_pktinfo(&mmsg[i].msg_hdr, control[i].buf,
+                             &entry->local, entry->ifindex);
+  }
+
+  i = 0;
+  while (i < count) {
+    coap_fd_t fd = batch->sorted[first + i]->fd;
+    unsigned int n = 1;
+    int sent;
+
+    while (i + n < count && batch->sorted[first + i + n]->fd == fd)
+      n++;
+    sent = sendmmsg(fd, &mmsg[i], n, 0);
+    if (sent <= 0) {
+      /* skip the datagram that could not be sent */
+      coap_log(LOG_CRIT, "coap_io_flush: %s\n", coap_socket_strerror());
+      sent = 1;
+    }
+    i += (unsigned int)sent;
+  }
+}
+
+void
+coap_io_flush(coap_context_t *context) {
+  struct coap_tx_batch_t *batch = context->tx_batch;
+  unsigned int first = 0;
+  unsigned int i = 0;
+  unsigned int c, j;
+
+  coap_io_flush_corked(context);
+  if (!batch || batch->count == 0)
+    return;
+
+  /*
+   * The control traffic goes out first, so that the peers do not
+   * retransmit for want of an ACK, then the retransmissions, and the
+   * notifications and blocks last.  The order within a class is kept.
+   */
+  for (c = 0; c < COAP_TX_CLASSES; c++) {
+    for (j = 0; j < batch->count; j++) {
+      if (batch->entries[j].tx_class == c)
+        batch->sorted[i++] = &batch->entries[j];
+    }
+  }
+  i = 0;
+
+  while (i < batch->count) {
+#ifdef UDP_SEGMENT
+    unsigned int run = batch->gso ? coap_tx_gso_run(batch, i) : 1;
+
+    if (run > 1) {
+      int ret;
+
+      /* keep the datagram order on the wire */
+      if (i > first)
+        coap_tx_send_mmsg(batch, first, i - first);
+      first = i;
+      ret = coap_tx_send_gso(batch, i, run);
+      if (ret == 0) {
+        /* fall back to sendmmsg() for this and all future batches */
+        batch->gso = 0;
+        continue;
+      }
+      i += run;
+      first = i;
+      continue;
+    }
+#endif /* UDP_SEGMENT */
+    i++;
+  }
+  if (i > first)
+    coap_tx_send_mmsg(batch, first, i - first);
+  batch->count = 0;
+}
+
+#else /* ! COAP_TX_BATCHING */
+
+int
+coap_context_set_tx_batching(coap_context_t *context, int enable) {
+  (void)context;
+  if (enable) {
+    coap_log(LOG_WARNING, "coap_context_set_tx_batching: not supported\n");
+    return 0;
+  }
+  return 1;
+}
+
+void
+coap_io_flush(coap_context_t *context) {
+  coap_io_flush_corked(context);
+}
+#endif /* ! COAP_TX_BATCHING */
+
+int
+coap_context_set_reuseport(coap_context_t *context, int enable) {
+#ifdef SO_REUSEPORT
+  context->reuseport = enable ? 1 : 0;
+  return 1;
+#else /* ! SO_REUSEPORT */
+  (void)context;
+  if (enable) {
+    coap_log(LOG_WARNING, "coap_context_set_reuseport: not supported\n");
+    return 0;
+  }
+  return 1;
+#endif /* ! SO_REUSEPORT */
+}
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF) && \
+    defined(SO_INCOMING_CPU)
+#define COAP_REUSEPORT_STEERING 1
+#else
+#define COAP_REUSEPORT_STEERING 0
+#endif
+
+int
+coap_context_set_reuseport_steering(coap_context_t *context,
+                                    unsigned int shard, unsigned int shards,
+                                    int cpu) {
+#if COAP_REUSEPORT_STEERING
+  if (shards > 256 || (shards && shard >= shards)) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_reuseport_steering: invalid shard\n");
+    return 0;
+  }
+  context->reuseport_shard = (uint16_t)shard;
+  context->reuseport_shards = (uint16_t)shards;
+  context->reuseport_cpu = cpu;
+  return 1;
+#else /* ! COAP_REUSEPORT_STEERING */
+  (void)context;
+  (void)shard;
+  (void)cpu;
+  if (shards) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_reuseport_steering: not supported\n");
+    return 0;
+  }
+  return 1;
+#endif /* ! COAP_REUSEPORT_STEERING */
+}
+
+void
+coap_socket_set_steering(coap_socket_t *sock, coap_context_t *context) {
+#if COAP_REUSEPORT_STEERING
+  /*
+   * The program returns the index of the socket in the SO_REUSEPORT group
+   * that gets the datagram, with the data at the UDP payload.  An index
+   * that is out of range leaves it to the kernel hashing.
+   */
+  struct sock_filter code[] = {
+    /* A tls12_cid record goes to the shard in its Connection ID */
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, COAP_DTLS_CID_OFFSET + 1, 0, 4),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, COAP_DTLS_CT_TLS12_CID, 0, 2),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, COAP_DTLS_CID_OFFSET),
+    BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+    /* Anything else goes to the shard of the receiving CPU */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, context->reuseport_shards),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog;
+
+  if (!context->reuseport_shards)
+    return;
+  if (context->reuseport_cpu >= 0 &&
+      setsockopt(sock->fd, SOL_SOCKET, SO_INCOMING_CPU,
+                 OPTVAL_T(&context->reuseport_cpu),
+                 sizeof(context->reuseport_cpu)) == COAP_SOCKET_ERROR)
+    coap_log(LOG_WARNING,
+             "coap_socket_set_steering: setsockopt SO_INCOMING_CPU: %s\n",
+             coap_socket_strerror());
+  prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+  prog.filter = code;
+  if (setsockopt(sock->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                 OPTVAL_T(&prog), sizeof(prog)) == COAP_SOCKET_ERROR)
+    coap_log(LOG_WARNING,
+             "coap_socket_set_steering: setsockopt "
+             "SO_ATTACH_REUSEPORT_CBPF: %s\n", coap_socket_strerror());
+#else /* ! COAP_REUSEPORT_STEERING */
+  (void)sock;
+  (void)context;
+#endif /* ! COAP_REUSEPORT_STEERING */
+}
+
+void
+coap_context_set_max_epoll_events(coap_context_t *context,
+                                  unsigned int max_events) {
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (max_events && max_events < COAP_MAX_EPOLL_EVENTS)
+    max_events = COAP_MAX_EPOLL_EVENTS;
+  context->epoll_events_max = max_events;
+  if (context->epoll_events &&
+      context->epoll_events_size > (max_events ? max_events :
+                                    COAP_MAX_EPOLL_EVENTS_LIMIT)) {
+    /* Shrink back, the array gets re-allocated by coap_io_process() */
+    coap_free_type(COAP_STRING, context->epoll_events);
+    context->epoll_events = NULL;
+    context->epoll_events_size = 0;
+  }
+#else /* ! COAP_EVENT_QUEUE_SUPPORT */
+  (void)context;
+  (void)max_events;
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
+}
+
+int
+coap_context_set_epoll_edge_triggered(coap_context_t *context, int enable) {
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  coap_endpoint_t *ep;
+
+  context->epoll_edge = enable ? 1 : 0;
+  LL_FOREACH(context->endpoint, ep) {
+    if (enable)
+      ep->sock.flags |= COAP_SOCKET_EDGE;
+    else
+      ep->sock.flags &= ~COAP_SOCKET_EDGE;
+#ifdef COAP_KQUEUE_SUPPORT
+    if (!context->io_external) {
+      /* EV_CLEAR is only taken from the change that adds the filter */
+      struct kevent change;
+
+      EV_SET(&change, ep->sock.fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+      coap_kqueue_change(context, &change, 1, __func__);
+    }
+#endif /* COAP_KQUEUE_SUPPORT */
+    coap_epoll_ctl_mod(&ep->sock, EPOLLIN, __func__);
+  }
+  return 1;
+#else /* ! COAP_EVENT_QUEUE_SUPPORT */
+  (void)context;
+  if (enable) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_epoll_edge_triggered: epoll not supported\n");
+    return 0;
+  }
+  return 1;
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
+}
+
+int
+coap_context_set_io_callbacks(coap_context_t *context,
+                              const coap_io_callbacks_t *callbacks,
+                              void *arg) {
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (!callbacks || !callbacks->add || !callbacks->modify ||
+      !callbacks->remove || !callbacks->set_timer) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_io_callbacks: call-back missing\n");
+    return 0;
+  }
+  /* The sockets already there are watched by the epoll or kqueue */
+  if (context->endpoint || context->sessions) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_io_callbacks: context already has sockets\n");
+    return 0;
+  }
+  context->io_callbacks = *callbacks;
+  context->io_callbacks_arg = arg;
+  context->io_timer_due = 0;
+  context->io_external = 1;
+  return 1;
+#else /* ! COAP_EVENT_QUEUE_SUPPORT */
+  (void)context;
+  (void)callbacks;
+  (void)arg;
+  coap_log(LOG_WARNING,
+           "coap_context_set_io_callbacks: epoll or kqueue not supported\n");
+  return 0;
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
+}
+
+int
+coap_context_set_max_rx_size(coap_context_t *context, size_t size) {
+  uint8_t *rxbuf = NULL;
+
+  if (size > 65535) {
+    coap_log(LOG_WARNING, "coap_context_set_max_rx_size: %zu too big\n",
+             size);
+    return 0;
+  }
+  /* The sockets already there may be read into the coap_packet_t */
+  if (context->endpoint || context->sessions) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_max_rx_size: context already has sockets\n");
+    return 0;
+  }
+  if (size > COAP_RXBUFFER_SIZE) {
+    rxbuf = coap_malloc_type(COAP_STRING, size);
+    if (!rxbuf)
+      return 0;
+  }
+  coap_free_type(COAP_STRING, context->rxbuf);
+  context->rxbuf = rxbuf;
+  context->rx_size = rxbuf ? size : 0;
+  return 1;
+}
+
+int
+coap_context_set_path_mtu_discovery(coap_context_t *context, int enable) {
+#ifdef COAP_PATH_MTU_SUPPORT
+  context->path_mtu_discovery = enable ? 1 : 0;
+  return 1;
+#else /* ! COAP_PATH_MTU_SUPPORT */
+  if (enable) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_path_mtu_discovery: not supported\n");
+    return 0;
+  }
+  context->path_mtu_discovery = 0;
+  return 1;
+#endif /* ! COAP_PATH_MTU_SUPPORT */
+}
+
+#define SIN6(A) ((struct sockaddr_in6 *)(A))
+
+void
+coap_packet_get_memmapped(coap_packet_t *packet, unsigned char **address, size_t *length) {
+  *address = packet->payload;
+  *length = packet->length;
+}
+
+#if !defined(WITH_CONTIKI) && !defined(RIOT_VERSION) && defined(HAVE_STRUCT_CMSGHDR)
+/**
+ * Walks the ancillary data of a received datagram in @p mhdr and updates
+ * @p packet with the local address and interface the data was received on.
+ *
+ * @param sock   The socket the datagram was read from.
+ * @param packet The packet to update.
+ * @param mhdr   The message header as filled in by recvmsg() or recvmmsg().
+ */
+static void
+coap_packet_set_pktinfo(coap_socket_t *sock, coap_packet_t *packet,
+                        struct msghdr *mhdr) {
+  struct cmsghdr *cmsg;
+  int dst_found = 0;
+
+  /* Walk through ancillary data records until the local interface
+   * is found where the data was received. */
+  for (cmsg = CMSG_FIRSTHDR(mhdr); cmsg; cmsg = CMSG_NXTHDR(mhdr, cmsg)) {
+
+    /* get the local interface for IPv6 */
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+      union {
+        uint8_t *c;
+        struct in6_pktinfo *p;
+      } u;
+      u.c = CMSG_DATA(cmsg);
+      packet->ifindex = (int)(u.p->ipi6_ifindex);
+      memcpy(&packet->addr_info.local.addr.sin6.sin6_addr,
+             &u.p->ipi6_addr, sizeof(struct in6_addr));
+      dst_found = 1;
+      break;
+    }
+
+    /* local interface for IPv4 */
+#if defined(IP_PKTINFO)
+    if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
+      union {
+        uint8_t *c;
+        struct in_pktinfo *p;
+      } u;
+      u.c = CMSG_DATA(cmsg);
+      packet->ifindex = u.p->ipi_ifindex;
+      if (packet->addr_info.local.addr.sa.sa_family == AF_INET6) {
+        memset(packet->addr_info.local.addr.sin6.sin6_addr.s6_addr, 0, 10);
+        packet->addr_info.local.addr.sin6.sin6_addr.s6_addr[10] = 0xff;
+        packet->addr_info.local.addr.sin6.sin6_addr.s6_addr[11] = 0xff;
+        memcpy(packet->addr_info.local.addr.sin6.sin6_addr.s6_addr + 12,
+               &u.p->ipi_addr, sizeof(struct in_addr));
+      } else {
+        memcpy(&packet->addr_info.local.addr.sin.sin_addr,
+               &u.p->ipi_addr, sizeof(struct in_addr));
+      }
+      dst_found = 1;
+      break;
+    }
+#elif defined(IP_RECVDSTADDR)
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+      packet->ifindex = sock->fd;
+      memcpy(&packet->addr_info.local.addr.sin.sin_addr,
+             CMSG_DATA(cmsg), sizeof(struct in_addr));
+      dst_found = 1;
+      break;
+    }
+#endif /* IP_PKTINFO */
+    if (!dst_found) {
+      /* cmsg_level / cmsg_type combination we do not understand
+         (ignore preset case for bad recvmsg() not updating cmsg) */
+      if (cmsg->cmsg_level != -1 && cmsg->cmsg_type != -1) {
+        coap_log(LOG_DEBUG,
+                 "cmsg_level = %d and cmsg_type = %d not supported - fix\n",
+                 cmsg->cmsg_level, cmsg->cmsg_type);
+      }
+    }
+  }
+  if (!dst_found) {
+    /* Not expected, but cmsg_level and cmsg_type don't match above and
+       may need a new case */
+    packet->ifindex = (int)sock->fd;
+    if (getsockname(sock->fd, &packet->addr_info.local.addr.sa,
+        &packet->addr_info.local.size) < 0) {
+      coap_log(LOG_DEBUG, "Cannot determine local port\n");
+    }
+  }
+}
+#endif /* !WITH_CONTIKI && !RIOT_VERSION && HAVE_STRUCT_CMSGHDR */
+
+#ifndef RIOT_VERSION
+ssize_t
+coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
+  ssize_t len = -1;
+
+  assert(sock);
+  assert(packet);
+
+  if ((sock->flags & COAP_SOCKET_CAN_READ) == 0) {
+    return -1;
   } else {
     /* clear has-data flag */
     sock->flags &= ~COAP_SOCKET_CAN_READ;
@@ -759,9 +1715,9 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 #if !defined(WITH_CONTIKI) && !defined(RIOT_VERSION)
   if (sock->flags & COAP_SOCKET_CONNECTED) {
 #ifdef _WIN32
-    len = recv(sock->fd, (char *)packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, (char *)packet->payload, (int)packet->size, 0);
 #else
-    len = recv(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0);
+    len = recv(sock->fd, packet->payload, packet->size, 0);
 #endif
     if (len < 0) {
 #ifdef _WIN32
@@ -773,6 +1729,15 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
         coap_log(LOG_WARNING, "coap_network_read: unreachable\n");
         return -2;
       }
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEMSGSIZE) {
+#else
+      if (errno == EMSGSIZE) {
+#endif
+        /* ICMP says that a datagram sent was too big for the path */
+        coap_log(LOG_DEBUG, "coap_network_read: path MTU exceeded\n");
+        return -3;
+      }
       coap_log(LOG_WARNING, "coap_network_read: %s\n", coap_socket_strerror());
       goto error;
     } else if (len > 0) {
@@ -793,7 +1758,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
     struct iovec iov[1];
 
     iov[0].iov_base = packet->payload;
-    iov[0].iov_len = (iov_len_t)COAP_RXBUFFER_SIZE;
+    iov[0].iov_len = (iov_len_t)packet->size;
 
     memset(&mhdr, 0, sizeof(struct msghdr));
 
@@ -829,7 +1794,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 #endif
 
 #else /* ! HAVE_STRUCT_CMSGHDR */
-    len = recvfrom(sock->fd, packet->payload, COAP_RXBUFFER_SIZE, 0,
+    len = recvfrom(sock->fd, packet->payload, packet->size, 0,
                    &packet->addr_info.remote.addr.sa,
                    &packet->addr_info.remote.size);
 #endif /* ! HAVE_STRUCT_CMSGHDR */
@@ -841,85 +1806,31 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
       if (errno == ECONNREFUSED) {
 #endif
         /* server-side ICMP destination unreachable, ignore it. The destination address is in msg_name. */
+        if (sock->flags & COAP_SOCKET_EDGE)
+          sock->flags |= COAP_SOCKET_CAN_READ;
+        return 0;
+      }
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+        /* Batched read has drained the endpoint */
         return 0;
       }
+#else /* ! _WIN32 */
+      if (COAP_SOCKET_WOULD_BLOCK(errno)) {
+        /* Edge-triggered endpoint has been drained */
+        return 0;
+      }
+#endif /* ! _WIN32 */
       coap_log(LOG_WARNING, "coap_network_read: %s\n", coap_socket_strerror());
       goto error;
     } else {
+      /* An edge-triggered endpoint is read until there is nothing left */
+      if (sock->flags & COAP_SOCKET_EDGE)
+        sock->flags |= COAP_SOCKET_CAN_READ;
 #ifdef HAVE_STRUCT_CMSGHDR
-      int dst_found = 0;
-
       packet->addr_info.remote.size = mhdr.msg_namelen;
       packet->length = (size_t)len;
-
-      /* Walk through ancillary data records until the local interface
-       * is found where the data was received. */
-      for (cmsg = CMSG_FIRSTHDR(&mhdr); cmsg; cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
-
-        /* get the local interface for IPv6 */
-        if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
-          union {
-            uint8_t *c;
-            struct in6_pktinfo *p;
-          } u;
-          u.c = CMSG_DATA(cmsg);
-          packet->ifindex = (int)(u.p->ipi6_ifindex);
-          memcpy(&packet->addr_info.local.addr.sin6.sin6_addr,
-                 &u.p->ipi6_addr, sizeof(struct in6_addr));
-          dst_found = 1;
-          break;
-        }
-
-        /* local interface for IPv4 */
-#if defined(IP_PKTINFO)
-        if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
-          union {
-            uint8_t *c;
-            struct in_pktinfo *p;
-          } u;
-          u.c = CMSG_DATA(cmsg);
-          packet->ifindex = u.p->ipi_ifindex;
-          if (packet->addr_info.local.addr.sa.sa_family == AF_INET6) {
-            memset(packet->addr_info.local.addr.sin6.sin6_addr.s6_addr, 0, 10);
-            packet->addr_info.local.addr.sin6.sin6_addr.s6_addr[10] = 0xff;
-            packet->addr_info.local.addr.sin6.sin6_addr.s6_addr[11] = 0xff;
-            memcpy(packet->addr_info.local.addr.sin6.sin6_addr.s6_addr + 12,
-                   &u.p->ipi_addr, sizeof(struct in_addr));
-          } else {
-            memcpy(&packet->addr_info.local.addr.sin.sin_addr,
-                   &u.p->ipi_addr, sizeof(struct in_addr));
-          }
-          dst_found = 1;
-          break;
-        }
-#elif defined(IP_RECVDSTADDR)
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
-          packet->ifindex = sock->fd;
-          memcpy(&packet->addr_info.local.addr.sin.sin_addr,
-                 CMSG_DATA(cmsg), sizeof(struct in_addr));
-          dst_found = 1;
-          break;
-        }
-#endif /* IP_PKTINFO */
-        if (!dst_found) {
-          /* cmsg_level / cmsg_type combination we do not understand
-             (ignore preset case for bad recvmsg() not updating cmsg) */
-          if (cmsg->cmsg_level != -1 && cmsg->cmsg_type != -1) {
-            coap_log(LOG_DEBUG,
-                     "cmsg_level = %d and cmsg_type = %d not supported - fix\n",
-                     cmsg->cmsg_level, cmsg->cmsg_type);
-          }
-        }
-      }
-      if (!dst_found) {
-        /* Not expected, but cmsg_level and cmsg_type don't match above and
-           may need a new case */
-        packet->ifindex = (int)sock->fd;
-        if (getsockname(sock->fd, &packet->addr_info.local.addr.sa,
-            &packet->addr_info.local.size) < 0) {
-          coap_log(LOG_DEBUG, "Cannot determine local port\n");
-        }
-      }
+      coap_packet_set_pktinfo(sock, packet, &mhdr);
 #else /* ! HAVE_STRUCT_CMSGHDR */
       packet->length = (size_t)len;
       packet->ifindex = 0;
@@ -944,14 +1855,14 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
 
       len = uip_datalen();
 
-      if (len > COAP_RXBUFFER_SIZE) {
+      if ((size_t)len > packet->size) {
         /* FIXME: we might want to send back a response */
         coap_log(LOG_WARNING, "discarded oversized packet\n");
         return -1;
       }
 
       ((char *)uip_appdata)[len] = 0;
-      if (LOG_DEBUG <= coap_get_log_level()) {
+      if (coap_log_enabled(LOG_DEBUG)) {
 #ifndef INET6_ADDRSTRLEN
 #define INET6_ADDRSTRLEN 40
 #endif
@@ -964,7 +1875,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
       }
 
       packet->length = len;
-      memcpy(&packet->payload, uip_appdata, len);
+      memcpy(packet->payload, uip_appdata, len);
     }
 
 #undef UIP_IP_BUF
@@ -974,7 +1885,7 @@ coap_network_read(coap_socket_t *sock, coap_packet_t *packet) {
     packet->src.size = sizeof(packet->src.addr);
     len = recvfrom (sock->fd, packet->payload, COAP_RXBUFFER_SIZE,
                     0, &packet->src.addr.sa, &packet->src.size);
-    if (LOG_DEBUG <= coap_get_log_level()) {
+    if (coap_log_enabled(LOG_DEBUG)) {
       unsigned char addr_str[INET6_ADDRSTRLEN + 8];
 
       if (coap_print_addr(&packet->src, addr_str, INET6_ADDRSTRLEN + 8)) {
@@ -995,32 +1906,610 @@ error:
 }
 #endif /* RIOT_VERSION */
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_STRUCT_CMSGHDR) && \
+    COAP_RECVMMSG_BATCH > 1
+int
+coap_network_read_batch(coap_socket_t *sock, coap_packet_t *packets,
+                        unsigned int count) {
+  struct mmsghdr mmsg[COAP_RECVMMSG_BATCH];
+  struct iovec iov[COAP_RECVMMSG_BATCH];
+  /* buffers large enough to hold all packet info types, ipv6 is the largest */
+  union {
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    size_t align; /* CMSG_ALIGN() alignment */
+  } control[COAP_RECVMMSG_BATCH];
+  struct cmsghdr *cmsg;
+  unsigned int i;
+  int n;
+
+  assert(sock);
+  assert(packets);
+  assert((sock->flags & COAP_SOCKET_CONNECTED) == 0);
+
+  if ((sock->flags & COAP_SOCKET_CAN_READ) == 0) {
+    return -1;
+  } else {
+    /* clear has-data flag */
+    sock->flags &= ~COAP_SOCKET_CAN_READ;
+  }
+
+  if (count > COAP_RECVMMSG_BATCH)
+    count = COAP_RECVMMSG_BATCH;
+
+  memset(mmsg, 0, count * sizeof(mmsg[0]));
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = packets[i].payload;
+    iov[i].iov_len = (iov_len_t)packets[i].size;
+
+    mmsg[i].msg_hdr.msg_name = &packets[i].addr_info.remote.addr;
+    mmsg[i].msg_hdr.msg_namelen = sizeof(packets[i].addr_info.remote.addr);
+    mmsg[i].msg_hdr.msg_iov = &iov[i];
+    mmsg[i].msg_hdr.msg_iovlen = 1;
+    mmsg[i].msg_hdr.msg_control = control[i].buf;
+    mmsg[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+
+    /* preset the first cmsg with bad data as in coap_network_read() */
+    cmsg = (struct cmsghdr *)control[i].buf;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(control[i].buf));
+    cmsg->cmsg_level = -1;
+    cmsg->cmsg_type = -1;
+  }
+
+  /* Only wait for the first datagram, return whatever else is queued. */
+  n = recvmmsg(sock->fd, mmsg, count, MSG_WAITFORONE, NULL);
+  if (n < 0) {
+    if (errno == ECONNREFUSED) {
+      /* server-side ICMP destination unreachable */
+      if (sock->flags & COAP_SOCKET_EDGE)
+        sock->flags |= COAP_SOCKET_CAN_READ;
+      return 0;
+    }
+    if (COAP_SOCKET_WOULD_BLOCK(errno)) {
+      /* nothing to read */
+      return 0;
+    }
+    coap_log(LOG_WARNING, "coap_network_read_batch: %s\n",
+             coap_socket_strerror());
+    return -1;
+  }
+
+  for (i = 0; i < (unsigned int)n; i++) {
+    packets[i].addr_info.remote.size = mmsg[i].msg_hdr.msg_namelen;
+    packets[i].length = (size_t)mmsg[i].msg_len;
+    coap_packet_set_pktinfo(sock, &packets[i], &mmsg[i].msg_hdr);
+  }
+  /*
+   * A short batch means that the socket was drained, else an edge-triggered
+   * endpoint has to be read again.
+   */
+  if ((unsigned int)n == count && (sock->flags & COAP_SOCKET_EDGE))
+    sock->flags |= COAP_SOCKET_CAN_READ;
+  return n;
+}
+#elif defined(COAP_NETWORK_READ_BATCH)
+int
+coap_network_read_batch(coap_socket_t *sock, coap_packet_t *packets,
+                        unsigned int count) {
+  unsigned int n;
+
+  assert(sock);
+  assert(packets);
+  assert((sock->flags & COAP_SOCKET_CONNECTED) == 0);
+
+  if ((sock->flags & COAP_SOCKET_CAN_READ) == 0)
+    return -1;
+
+  if (count > COAP_RECVMMSG_BATCH)
+    count = COAP_RECVMMSG_BATCH;
+
+  /*
+   * The socket is non-blocking, so once it has been reported readable the
+   * datagrams that are queued can be read without waiting for it again.
+   * coap_network_read() leaves an edge-triggered endpoint to be read again
+   * if it may not have been drained.
+   */
+  for (n = 0; n < count; n++) {
+    ssize_t len;
+
+    sock->flags |= COAP_SOCKET_CAN_READ;
+    len = coap_network_read(sock, &packets[n]);
+    if (len < 0)
+      return n ? (int)n : -1;
+    if (len == 0)
+      /* drained, or nothing to pass on */
+      break;
+  }
+  return (int)n;
+}
+#endif /* COAP_NETWORK_READ_BATCH */
+
+#ifdef COAP_IO_URING_SUPPORT
+/*
+ * Each provided buffer holds what a multishot recvmsg() writes for one
+ * datagram: the struct io_uring_recvmsg_out header, then space for the
+ * remote address and the ancillary data as given in the msghdr template,
+ * then the payload.  The address space is rounded up so that the cmsghdr
+ * after it is aligned, and so is each buffer.
+ */
+#define COAP_IO_URING_ADDRLEN (sizeof(((coap_address_t *)0)->addr))
+#define COAP_IO_URING_NAMELEN (CMSG_ALIGN(COAP_IO_URING_ADDRLEN))
+#define COAP_IO_URING_CONTROLLEN (CMSG_SPACE(sizeof(struct in6_pktinfo)))
+#define COAP_IO_URING_HDRLEN (sizeof(struct io_uring_recvmsg_out) + \
+                              COAP_IO_URING_NAMELEN + \
+                              COAP_IO_URING_CONTROLLEN)
+#define COAP_IO_URING_BUFLEN (CMSG_ALIGN(COAP_IO_URING_HDRLEN + \
+                                         COAP_RXBUFFER_SIZE))
+#define COAP_IO_URING_BGID 0
+
+/* The number of submission queue entries */
+#define COAP_IO_URING_ENTRIES 32
+
+struct coap_io_uring_t {
+  int fd;                         /**< from io_uring_setup() */
+  void *sq_ring;                  /**< mapped submission queue ring */
+  size_t sq_ring_size;
+  void *cq_ring;                  /**< mapped completion queue ring (may be
+                                       the same as sq_ring) */
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;      /**< mapped submission queue entries */
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int to_submit;        /**< entries not yet passed to the kernel */
+  struct io_uring_buf_ring *buf_ring; /**< ring of provided buffers */
+  size_t buf_ring_size;
+  uint8_t *bufs;                  /**< COAP_IO_URING_BUFFERS buffers */
+  struct msghdr msg;              /**< template for the multishot receives */
+  uint64_t last_id;               /**< last endpoint uring_id handed out */
+};
+
+static int
+coap_io_uring_enter(coap_io_uring_t *uring, unsigned int to_submit) {
+  return (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, 0, 0,
+                      NULL, 0);
+}
+
+static void
+coap_io_uring_submit(coap_io_uring_t *uring) {
+  while (uring->to_submit) {
+    int ret = coap_io_uring_enter(uring, uring->to_submit);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EBUSY)
+        coap_log(LOG_WARNING, "coap_io_uring_submit: %s\n",
+                 coap_socket_strerror());
+      return;
+    }
+    uring->to_submit -= (unsigned int)ret < uring->to_submit ?
+                        (unsigned int)ret : uring->to_submit;
+    if (ret == 0)
+      return;
+  }
+}
+
+static struct io_uring_sqe *
+coap_io_uring_get_sqe(coap_io_uring_t *uring) {
+  unsigned tail = *uring->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+      uring->sq_entries) {
+    /* Full, so hand what there is to the kernel first */
+    coap_io_uring_submit(uring);
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+        uring->sq_entries)
+      return NULL;
+  }
+  sqe = &uring->sqes[tail & uring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+  return sqe;
+}
+
+static void
+coap_io_uring_queue_sqe(coap_io_uring_t *uring) {
+  __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+  uring->to_submit++;
+}
+
+static void
+coap_io_uring_buf_return(coap_io_uring_t *uring, unsigned int bid) {
+  /* This thread is the only producer, so tail can be read directly */
+  uint16_t tail = uring->buf_ring->tail;
+  struct io_uring_buf *buf;
+
+  buf = &uring->buf_ring->bufs[tail & (COAP_IO_URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(uring->bufs + bid * COAP_IO_URING_BUFLEN);
+  buf->len = (uint32_t)COAP_IO_URING_BUFLEN;
+  buf->bid = (uint16_t)bid;
+  __atomic_store_n(&uring->buf_ring->tail, (uint16_t)(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+static void
+coap_io_uring_release(coap_io_uring_t *uring) {
+  if (uring->buf_ring)
+    munmap(uring->buf_ring, uring->buf_ring_size);
+  if (uring->sqes)
+    munmap(uring->sqes, uring->sqes_size);
+  if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  if (uring->sq_ring)
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  if (uring->fd != -1)
+    close(uring->fd);
+  coap_free_type(COAP_STRING, uring->bufs);
+  coap_free_type(COAP_STRING, uring);
+}
+
+static coap_io_uring_t *
+coap_io_uring_new(coap_context_t *ctx) {
+  coap_io_uring_t *uring;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  struct epoll_event event;
+  unsigned int i;
+  uint8_t *sq;
+  uint8_t *cq;
+
+  uring = coap_malloc_type(COAP_STRING, sizeof(coap_io_uring_t));
+  if (!uring)
+    return NULL;
+  memset(uring, 0, sizeof(coap_io_uring_t));
+
+  memset(&params, 0, sizeof(params));
+  /* Room for a completion for each provided buffer plus the cancels */
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = COAP_IO_URING_BUFFERS * 2;
+  uring->fd = (int)syscall(__NR_io_uring_setup, COAP_IO_URING_ENTRIES,
+                           &params);
+  if (uring->fd < 0) {
+    coap_log(LOG_INFO, "coap_io_uring_new: io_uring_setup: %s\n",
+             coap_socket_strerror());
+    uring->fd = -1;
+    goto error;
+  }
+
+  uring->sq_ring_size = params.sq_off.array +
+                        params.sq_entries * sizeof(unsigned);
+  uring->cq_ring_size = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_size > uring->sq_ring_size)
+      uring->sq_ring_size = uring->cq_ring_size;
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd,
+                        IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    uring->sq_ring = NULL;
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
+  } else {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd,
+                          IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      uring->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    uring->sqes = NULL;
+    goto fail;
+  }
+
+  sq = uring->sq_ring;
+  uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  uring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  uring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+  uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  cq = uring->cq_ring;
+  uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  uring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* The provided buffer ring has to be page aligned */
+  uring->buf_ring_size = COAP_IO_URING_BUFFERS * sizeof(struct io_uring_buf);
+  uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (uring->buf_ring == MAP_FAILED) {
+    uring->buf_ring = NULL;
+    goto fail;
+  }
+  uring->bufs = coap_malloc_type(COAP_STRING,
+                                 COAP_IO_URING_BUFFERS * COAP_IO_URING_BUFLEN);
+  if (!uring->bufs)
+    goto error;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+  reg.ring_entries = COAP_IO_URING_BUFFERS;
+  reg.bgid = COAP_IO_URING_BGID;
+  if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    coap_log(LOG_INFO, "coap_io_uring_new: IORING_REGISTER_PBUF_RING: %s\n",
+             coap_socket_strerror());
+    goto error;
+  }
+  for (i = 0; i < COAP_IO_URING_BUFFERS; i++)
+    coap_io_uring_buf_return(uring, i);
+
+  uring->msg.msg_namelen = COAP_IO_URING_NAMELEN;
+  uring->msg.msg_controllen = COAP_IO_URING_CONTROLLEN;
+
+  /* Completions are picked up when epoll reports the ring as readable */
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = uring;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, uring->fd, &event) == -1) {
+    coap_log(LOG_ERR, "%s: epoll_ctl ADD failed: %s (%d)\n",
+             "coap_io_uring_new", coap_socket_strerror(), errno);
+    goto error;
+  }
+  return uring;
+
+fail:
+  coap_log(LOG_WARNING, "coap_io_uring_new: mmap: %s\n",
+           coap_socket_strerror());
+error:
+  coap_io_uring_release(uring);
+  return NULL;
+}
+
+static int
+coap_io_uring_arm(coap_io_uring_t *uring, coap_endpoint_t *endpoint) {
+  struct io_uring_sqe *sqe = coap_io_uring_get_sqe(uring);
+
+  if (!sqe)
+    return 0;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = endpoint->sock.fd;
+  sqe->addr = (uint64_t)(uintptr_t)&uring->msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = COAP_IO_URING_BGID;
+  sqe->user_data = endpoint->uring_id;
+  coap_io_uring_queue_sqe(uring);
+  return 1;
+}
+
+/*
+ * Reverts @p endpoint to being read when epoll reports it as readable.
+ */
+static void
+coap_io_uring_fallback(coap_endpoint_t *endpoint, int error) {
+  coap_log(LOG_WARNING, "*  %s: io_uring receive failed: %s, using epoll\n",
+           coap_endpoint_str(endpoint), coap_socket_format_errno(error));
+  endpoint->uring_id = 0;
+  endpoint->sock.flags &= ~COAP_SOCKET_URING;
+  coap_epoll_ctl_mod(&endpoint->sock, EPOLLIN |
+                     ((endpoint->sock.flags & COAP_SOCKET_WANT_WRITE) ?
+                      EPOLLOUT : 0), __func__);
+}
+
+int
+coap_io_uring_add_endpoint(coap_endpoint_t *endpoint) {
+  coap_context_t *ctx = endpoint->context;
+
+  /*
+   * The completions are only picked up from the epoll of the context, and
+   * the provided buffers only take datagrams of up to COAP_RXBUFFER_SIZE
+   */
+  if (ctx->network_read != coap_network_read || ctx->io_external ||
+      ctx->rxbuf)
+    return 0;
+  if (!ctx->io_uring) {
+    ctx->io_uring = coap_io_uring_new(ctx);
+    if (!ctx->io_uring)
+      return 0;
+  }
+  endpoint->uring_id = ++ctx->io_uring->last_id;
+  if (!coap_io_uring_arm(ctx->io_uring, endpoint)) {
+    endpoint->uring_id = 0;
+    return 0;
+  }
+  coap_io_uring_submit(ctx->io_uring);
+  endpoint->sock.flags |= COAP_SOCKET_URING;
+  return 1;
+}
+
+void
+coap_io_uring_remove_endpoint(coap_endpoint_t *endpoint) {
+  coap_io_uring_t *uring = endpoint->context ? endpoint->context->io_uring :
+                                               NULL;
+  struct io_uring_sqe *sqe;
+
+  if (!uring || endpoint->uring_id == 0)
+    return;
+  sqe = coap_io_uring_get_sqe(uring);
+  if (sqe) {
+    /* Any completions still to come no longer match an endpoint */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = endpoint->uring_id;
+    sqe->user_data = 0;
+    coap_io_uring_queue_sqe(uring);
+    coap_io_uring_submit(uring);
+  }
+  endpoint->uring_id = 0;
+  endpoint->sock.flags &= ~COAP_SOCKET_URING;
+}
+
+static coap_endpoint_t *
+coap_io_uring_find_endpoint(coap_context_t *ctx, uint64_t id) {
+  coap_endpoint_t *endpoint;
+
+  if (id == 0)
+    return NULL;
+  LL_FOREACH(ctx->endpoint, endpoint) {
+    if (endpoint->uring_id == id)
+      return endpoint;
+  }
+  return NULL;
+}
+
+void
+coap_io_uring_process(coap_context_t *ctx, coap_tick_t now) {
+  coap_io_uring_t *uring = ctx->io_uring;
+#if COAP_CONSTRAINED_STACK
+  static coap_mutex_t u_static_mutex = COAP_MUTEX_INITIALIZER;
+  static coap_packet_t u_packet;
+#else /* ! COAP_CONSTRAINED_STACK */
+  coap_packet_t u_packet;
+#endif /* ! COAP_CONSTRAINED_STACK */
+  coap_packet_t *packet = &u_packet;
+  unsigned head;
+
+  if (!uring)
+    return;
+
+#if COAP_CONSTRAINED_STACK
+  coap_mutex_lock(&u_static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+  coap_packet_set_rxbuf(packet, ctx);
+
+  head = *uring->cq_head;
+  while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+    coap_endpoint_t *endpoint = coap_io_uring_find_endpoint(ctx,
+                                                            cqe->user_data);
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    int have_packet = 0;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+      unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      uint8_t *buf = uring->bufs + bid * COAP_IO_URING_BUFLEN;
+      struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+
+      if (endpoint && res >= (int)COAP_IO_URING_HDRLEN &&
+          (out->flags & MSG_TRUNC)) {
+        coap_log(LOG_WARNING, "*  %s: io_uring: datagram too large, dropped\n",
+                 coap_endpoint_str(endpoint));
+      } else if (endpoint && res >= (int)COAP_IO_URING_HDRLEN) {
+        struct msghdr mhdr;
+
+        memset(&packet->addr_info, 0, sizeof(packet->addr_info));
+        coap_address_init(&packet->addr_info.remote);
+        coap_address_copy(&packet->addr_info.local, &endpoint->bind_addr);
+        packet->ifindex = 0;
+        packet->addr_info.remote.size = out->namelen < COAP_IO_URING_ADDRLEN ?
+                                        out->namelen : COAP_IO_URING_ADDRLEN;
+        memcpy(&packet->addr_info.remote.addr, buf + sizeof(*out),
+               packet->addr_info.remote.size);
+        memset(&mhdr, 0, sizeof(mhdr));
+        mhdr.msg_control = buf + sizeof(*out) + COAP_IO_URING_NAMELEN;
+        mhdr.msg_controllen = out->controllen;
+        coap_packet_set_pktinfo(&endpoint->sock, packet, &mhdr);
+        packet->length = (size_t)res - COAP_IO_URING_HDRLEN;
+        memcpy(packet->payload, buf + COAP_IO_URING_HDRLEN, packet->length);
+        have_packet = packet->length > 0;
+      }
+      coap_io_uring_buf_return(uring, bid);
+    }
+    head++;
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (endpoint && !(flags & IORING_CQE_F_MORE)) {
+      /*
+       * The multishot receive has stopped. Start it again unless it
+       * is not supported.
+       */
+      if (res == -EINVAL || res == -EOPNOTSUPP || res == -EBADF ||
+          !coap_io_uring_arm(uring, endpoint)) {
+        coap_io_uring_fallback(endpoint, res < 0 ? -res : EBUSY);
+      }
+    }
+    if (have_packet)
+      coap_handle_endpoint_packet(ctx, endpoint, packet, now);
+  }
+  coap_io_uring_submit(uring);
+
+#if COAP_CONSTRAINED_STACK
+  coap_mutex_unlock(&u_static_mutex);
+#endif /* COAP_CONSTRAINED_STACK */
+}
+
+void
+coap_io_uring_free(coap_context_t *ctx) {
+  coap_io_uring_t *uring = ctx->io_uring;
+  struct epoll_event event;
+
+  if (!uring)
+    return;
+  /* Kernels prior to 2.6.9 expect non NULL event parameter */
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, uring->fd, &event) == -1) {
+    coap_log(LOG_ERR, "%s: epoll_ctl DEL failed: %s (%d)\n",
+             "coap_io_uring_free", coap_socket_strerror(), errno);
+  }
+  /* Closing the ring cancels anything still outstanding */
+  coap_io_uring_release(uring);
+  ctx->io_uring = NULL;
+}
+#endif /* COAP_IO_URING_SUPPORT */
+
 #if !defined(WITH_CONTIKI)
 
+#ifdef COAP_EPOLL_SUPPORT
+typedef struct epoll_event coap_io_event_t;
+#elif defined(COAP_KQUEUE_SUPPORT)
+typedef struct kevent coap_io_event_t;
+#endif /* COAP_KQUEUE_SUPPORT */
+
 unsigned int
 coap_io_prepare_epoll(coap_context_t *ctx, coap_tick_t now) {
-#ifndef COAP_EPOLL_SUPPORT
+#ifndef COAP_EVENT_QUEUE_SUPPORT
   (void)ctx;
   (void)now;
    coap_log(LOG_EMERG,
             "coap_io_prepare_epoll() requires libcoap compiled for using epoll\n");
   return 0;
-#else /* COAP_EPOLL_SUPPORT */
+#else /* COAP_EVENT_QUEUE_SUPPORT */
   coap_socket_t *sockets[1];
   unsigned int max_sockets = sizeof(sockets)/sizeof(sockets[0]);
   unsigned int num_sockets;
   unsigned int timeout;
+  coap_tick_t io_now = ctx->io_now;
 
+  ctx->io_now = now;
   /* Use the common logic */
   timeout = coap_io_prepare_io(ctx, sockets, max_sockets, &num_sockets, now);
   /* Save when the next expected I/O is to take place */
   ctx->next_timeout = timeout ? now + timeout : 0;
-  if (ctx->eptimerfd != -1) {
+  if (ctx->io_external) {
+    coap_io_external_set_timer(ctx, ctx->next_timeout > now ?
+                                    ctx->next_timeout - now : 0);
+  }
+#ifdef COAP_KQUEUE_SUPPORT
+  else {
+    coap_kqueue_set_timer(ctx, ctx->next_timeout > now ?
+                               ctx->next_timeout - now : 0,
+                          "coap_io_prepare_epoll");
+  }
+#else /* COAP_EPOLL_SUPPORT */
+  else if (ctx->eptimerfd != -1) {
     struct itimerspec new_value;
     int ret;
 
     memset(&new_value, 0, sizeof(new_value));
-    coap_ticks(&now);
     if (ctx->next_timeout != 0 && ctx->next_timeout > now) {
       coap_tick_t rem_timeout = ctx->next_timeout - now;
       /* Need to trigger an event on ctx->epfd in the future */
@@ -1041,8 +2530,22 @@ coap_io_prepare_epoll(coap_context_t *ctx, coap_tick_t now) {
                 coap_socket_strerror(), errno);
     }
   }
-  return timeout;
 #endif /* COAP_EPOLL_SUPPORT */
+  ctx->io_now = io_now;
+  return timeout;
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+}
+
+unsigned int
+coap_io_do_timers(coap_context_t *ctx) {
+  coap_tick_t now;
+
+  coap_ticks(&now);
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  /* The timer has fired or is about to be replaced, so always set it again */
+  ctx->io_timer_due = 0;
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+  return coap_io_prepare_epoll(ctx, now);
 }
 
 /*
@@ -1057,131 +2560,79 @@ coap_io_prepare_io(coap_context_t *ctx,
            coap_tick_t now)
 {
   coap_queue_t *nextpdu;
+#ifndef COAP_EVENT_QUEUE_SUPPORT
   coap_endpoint_t *ep;
   coap_session_t *s, *rtmp;
-  coap_tick_t session_timeout;
+  unsigned int pos;
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
   coap_tick_t timeout = 0;
-#ifdef COAP_EPOLL_SUPPORT
+  coap_tick_t io_now = ctx->io_now;
+  unsigned int offloaded;
+  unsigned int retransmits = 0;
+#ifdef COAP_EVENT_QUEUE_SUPPORT
   (void)sockets;
   (void)max_sockets;
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 
   *num_sockets = 0;
+  /* Everything done here is timed from now */
+  ctx->io_now = now;
+
+  /* The handler time and transmit budgets are per I/O processing iteration */
+  ctx->handler_us = 0;
+  ctx->tx_bulk_sent = 0;
+  ctx->tx_deferred = 0;
+  /* Pick up anything posted by other threads */
+  coap_process_posted(ctx);
+  offloaded = coap_dtls_offload_process(ctx);
+
+  /* Retransmissions and session timers go before the notifications */
+  nextpdu = coap_peek_next(ctx);
+
+  while (nextpdu && now >= ctx->sendqueue_basetime && nextpdu->t <= now - ctx->sendqueue_basetime) {
+    if (ctx->tx_budget_retransmit &&
+        retransmits++ == ctx->tx_budget_retransmit) {
+      ctx->tx_deferred = 1;
+      break;
+    }
+    coap_retransmit(ctx, coap_pop_next(ctx));
+    nextpdu = coap_peek_next(ctx);
+  }
+
+  /* Idle sessions, keepalives, CSM, DTLS handshake and block timeouts */
+  timeout = coap_session_timers_run(ctx, now);
 
   /* Check to see if we need to send off any Observe requests */
   coap_check_notify(ctx);
 
-  if (ctx->session_timeout > 0)
-    session_timeout = ctx->session_timeout * COAP_TICKS_PER_SECOND;
-  else
-    session_timeout = COAP_DEFAULT_SESSION_TIMEOUT * COAP_TICKS_PER_SECOND;
+  /* The sessions freed off may have had entries in the sendqueue */
+  nextpdu = coap_peek_next(ctx);
+  if (nextpdu && (timeout == 0 || nextpdu->t - ( now - ctx->sendqueue_basetime ) < timeout))
+    timeout = nextpdu->t - (now - ctx->sendqueue_basetime);
 
+#ifndef COAP_EVENT_QUEUE_SUPPORT
   LL_FOREACH(ctx->endpoint, ep) {
-#ifndef COAP_EPOLL_SUPPORT
     if (ep->sock.flags & (COAP_SOCKET_WANT_READ | COAP_SOCKET_WANT_WRITE | COAP_SOCKET_WANT_ACCEPT)) {
       if (*num_sockets < max_sockets)
         sockets[(*num_sockets)++] = &ep->sock;
     }
-#endif /* ! COAP_EPOLL_SUPPORT */
-    SESSIONS_ITER_SAFE(ep->sessions, s, rtmp) {
-      if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0 &&
-          s->delayqueue == NULL &&
-          (s->last_rx_tx + session_timeout <= now ||
-           s->state == COAP_SESSION_STATE_NONE)) {
-        coap_session_free(s);
-      } else {
-        if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0 && s->delayqueue == NULL) {
-          coap_tick_t s_timeout = (s->last_rx_tx + session_timeout) - now;
-          if (timeout == 0 || s_timeout < timeout)
-            timeout = s_timeout;
-        }
-        /* Check if any server large receives have timed out */
-        if (s->lg_srcv) {
-          coap_tick_t s_timeout;
-          s_timeout = coap_block_check_lg_srcv_timeouts(s, now);
-          if (timeout == 0 || s_timeout < timeout)
-            timeout = s_timeout;
-        }
-#ifndef COAP_EPOLL_SUPPORT
-        if (s->sock.flags & (COAP_SOCKET_WANT_READ | COAP_SOCKET_WANT_WRITE)) {
-          if (*num_sockets < max_sockets)
-            sockets[(*num_sockets)++] = &s->sock;
-        }
-#endif /* ! COAP_EPOLL_SUPPORT */
+    /* Only TCP server sessions have a socket of their own */
+    if (!COAP_PROTO_RELIABLE(ep->proto))
+      continue;
+    SESSIONS_INDEX_ITER(&ep->sessions, s, pos) {
+      if (s->sock.flags & (COAP_SOCKET_WANT_READ | COAP_SOCKET_WANT_WRITE)) {
+        if (*num_sockets < max_sockets)
+          sockets[(*num_sockets)++] = &s->sock;
       }
     }
   }
-  SESSIONS_ITER_SAFE(ctx->sessions, s, rtmp) {
-    if (!COAP_DISABLE_TCP
-     && s->type == COAP_SESSION_TYPE_CLIENT
-     && s->state == COAP_SESSION_STATE_ESTABLISHED
-     && ctx->ping_timeout > 0
-    ) {
-      coap_tick_t s_timeout;
-      if (s->last_rx_tx + ctx->ping_timeout * COAP_TICKS_PER_SECOND <= now) {
-        if ((s->last_ping > 0 && s->last_pong < s->last_ping)
-          || ((s->last_ping_mid = coap_session_send_ping(s)) == COAP_INVALID_MID))
-        {
-          /* Make sure the session object is not deleted in the callback */
-          coap_session_reference(s);
-          coap_session_disconnected(s, COAP_NACK_NOT_DELIVERABLE);
-          coap_session_release(s);
-          continue;
-        }
-        s->last_rx_tx = now;
-        s->last_ping = now;
-      }
-      s_timeout = (s->last_rx_tx + ctx->ping_timeout * COAP_TICKS_PER_SECOND) - now;
-      if (timeout == 0 || s_timeout < timeout)
-        timeout = s_timeout;
-    }
-
-    if (!COAP_DISABLE_TCP
-     && s->type == COAP_SESSION_TYPE_CLIENT
-     && COAP_PROTO_RELIABLE(s->proto)
-     && s->state == COAP_SESSION_STATE_CSM
-     && ctx->csm_timeout > 0
-    ) {
-      coap_tick_t s_timeout;
-      if (s->csm_tx == 0) {
-        s->csm_tx = now;
-      } else if (s->csm_tx + ctx->csm_timeout * COAP_TICKS_PER_SECOND <= now) {
-        /* Make sure the session object is not deleted in the callback */
-        coap_session_reference(s);
-        coap_session_disconnected(s, COAP_NACK_NOT_DELIVERABLE);
-        coap_session_release(s);
-        continue;
-      }
-      s_timeout = (s->csm_tx + ctx->csm_timeout * COAP_TICKS_PER_SECOND) - now;
-      if (timeout == 0 || s_timeout < timeout)
-        timeout = s_timeout;
-    }
-
-    /* Check if any client large receives have timed out */
-    if (s->lg_crcv) {
-      coap_tick_t s_timeout;
-      s_timeout = coap_block_check_lg_crcv_timeouts(s, now);
-      if (timeout == 0 || s_timeout < timeout)
-        timeout = s_timeout;
-    }
-
-#ifndef COAP_EPOLL_SUPPORT
+  SESSIONS_ITER(ctx->sessions, s, rtmp) {
     if (s->sock.flags & (COAP_SOCKET_WANT_READ | COAP_SOCKET_WANT_WRITE | COAP_SOCKET_WANT_CONNECT)) {
       if (*num_sockets < max_sockets)
         sockets[(*num_sockets)++] = &s->sock;
     }
-#endif /* ! COAP_EPOLL_SUPPORT */
-  }
-
-  nextpdu = coap_peek_next(ctx);
-
-  while (nextpdu && now >= ctx->sendqueue_basetime && nextpdu->t <= now - ctx->sendqueue_basetime) {
-    coap_retransmit(ctx, coap_pop_next(ctx));
-    nextpdu = coap_peek_next(ctx);
   }
-
-  if (nextpdu && (timeout == 0 || nextpdu->t - ( now - ctx->sendqueue_basetime ) < timeout))
-    timeout = nextpdu->t - (now - ctx->sendqueue_basetime);
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
 
   if (ctx->dtls_context) {
     if (coap_dtls_is_context_timeout()) {
@@ -1194,57 +2645,36 @@ coap_io_prepare_io(coap_context_t *ctx,
         if (timeout == 0 || tls_timeout - now < timeout)
           timeout = tls_timeout - now;
       }
-    } else {
-      LL_FOREACH(ctx->endpoint, ep) {
-        if (ep->proto == COAP_PROTO_DTLS) {
-          SESSIONS_ITER(ep->sessions, s, rtmp) {
-            if (s->state == COAP_SESSION_STATE_HANDSHAKE &&
-                s->proto == COAP_PROTO_DTLS && s->tls) {
-              coap_tick_t tls_timeout = coap_dtls_get_timeout(s, now);
-              while (tls_timeout > 0 && tls_timeout <= now) {
-                coap_log(LOG_DEBUG, "** %s: DTLS retransmit timeout\n",
-                         coap_session_str(s));
-                /* Make sure the session object is not deleted in any callbacks */
-                coap_session_reference(s);
-                coap_dtls_handle_timeout(s);
-                if (s->tls)
-                  tls_timeout = coap_dtls_get_timeout(s, now);
-                else {
-                  tls_timeout = 0;
-                  timeout = 1;
-                }
-                coap_session_release(s);
-              }
-              if (tls_timeout > 0 && (timeout == 0 || tls_timeout - now < timeout))
-                timeout = tls_timeout - now;
-            }
-          }
-        }
-      }
-      SESSIONS_ITER(ctx->sessions, s, rtmp) {
-        if (s->state == COAP_SESSION_STATE_HANDSHAKE &&
-            s->proto == COAP_PROTO_DTLS && s->tls) {
-          coap_tick_t tls_timeout = coap_dtls_get_timeout(s, now);
-          while (tls_timeout > 0 && tls_timeout <= now) {
-            coap_log(LOG_DEBUG, "** %s: DTLS retransmit timeout\n", coap_session_str(s));
-            /* Make sure the session object is not deleted in any callbacks */
-            coap_session_reference(s);
-            coap_dtls_handle_timeout(s);
-            if (s->tls)
-              tls_timeout = coap_dtls_get_timeout(s, now);
-            else {
-              tls_timeout = 0;
-              timeout = 1;
-            }
-            coap_session_release(s);
-          }
-          if (tls_timeout > 0 && (timeout == 0 || tls_timeout - now < timeout))
-            timeout = tls_timeout - now;
-        }
-      }
     }
   }
 
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (ctx->io_external) {
+    /* The workers call the wake call-back when a handshake has finished */
+    if (ctx->io_callbacks.wake)
+      offloaded = 0;
+  }
+#if defined(COAP_EPOLL_SUPPORT) && defined(HAVE_SYS_EVENTFD_H)
+  /* The workers wake up epoll_wait() when a handshake has finished */
+  else if (ctx->eppostfd != -1)
+    offloaded = 0;
+#elif defined(COAP_KQUEUE_SUPPORT)
+  /* The workers trigger the EVFILT_USER when a handshake has finished */
+  else
+    offloaded = 0;
+#endif /* COAP_KQUEUE_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+  if (offloaded &&
+      (timeout == 0 || timeout > COAP_TICKS_PER_SECOND / 100)) {
+    /* Poll for the handshakes that the workers have finished */
+    timeout = COAP_TICKS_PER_SECOND / 100;
+  }
+  if (ctx->tx_deferred) {
+    /* Carry on with what is over budget straight after any new input */
+    timeout = 1;
+  }
+
+  ctx->io_now = io_now;
   return (unsigned int)((timeout * 1000 + COAP_TICKS_PER_SECOND - 1) / COAP_TICKS_PER_SECOND);
 }
 
@@ -1260,26 +2690,30 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
                          fd_set *eexceptfds) {
 #if COAP_CONSTRAINED_STACK
   static coap_mutex_t static_mutex = COAP_MUTEX_INITIALIZER;
-# ifndef COAP_EPOLL_SUPPORT
+# ifndef COAP_EVENT_QUEUE_SUPPORT
   static fd_set readfds, writefds, exceptfds;
   static coap_socket_t *sockets[64];
   unsigned int num_sockets = 0;
-# endif /* ! COAP_EPOLL_SUPPORT */
+# endif /* ! COAP_EVENT_QUEUE_SUPPORT */
 #else /* ! COAP_CONSTRAINED_STACK */
-# ifndef COAP_EPOLL_SUPPORT
+# ifndef COAP_EVENT_QUEUE_SUPPORT
   fd_set readfds, writefds, exceptfds;
   coap_socket_t *sockets[64];
   unsigned int num_sockets = 0;
-# endif /* ! COAP_EPOLL_SUPPORT */
+# endif /* ! COAP_EVENT_QUEUE_SUPPORT */
 #endif /* ! COAP_CONSTRAINED_STACK */
   coap_fd_t nfds = 0;
   coap_tick_t before, now;
   unsigned int timeout;
-#ifndef COAP_EPOLL_SUPPORT
+#ifndef COAP_EVENT_QUEUE_SUPPORT
   struct timeval tv;
   int result;
   unsigned int i;
-#endif /* ! COAP_EPOLL_SUPPORT */
+#else /* COAP_EVENT_QUEUE_SUPPORT */
+  coap_io_event_t stack_events[COAP_MAX_EPOLL_EVENTS];
+  coap_io_event_t *events;
+  unsigned int nevents;
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 
 #if COAP_CONSTRAINED_STACK
   coap_mutex_lock(&static_mutex);
@@ -1287,7 +2721,7 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
 
   coap_ticks(&before);
 
-#ifndef COAP_EPOLL_SUPPORT
+#ifndef COAP_EVENT_QUEUE_SUPPORT
   timeout = coap_io_prepare_io(ctx, sockets,
                             (sizeof(sockets) / sizeof(sockets[0])),
                             &num_sockets, before);
@@ -1342,6 +2776,9 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
     tv.tv_sec = (long)(timeout / 1000);
   }
 
+  /* Send anything queued by coap_io_prepare_io() before waiting */
+  coap_io_flush(ctx);
+
   result = select((int)nfds, &readfds, &writefds, &exceptfds, timeout > 0 ? &tv : NULL);
 
   if (result < 0) {   /* error */
@@ -1385,21 +2822,35 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
     *eexceptfds = exceptfds;
   }
 
-#else /* COAP_EPOLL_SUPPORT */
+#else /* COAP_EVENT_QUEUE_SUPPORT */
   (void)ereadfds;
   (void)ewritefds;
   (void)eexceptfds;
   (void)enfds;
 
   timeout = coap_io_prepare_epoll(ctx, before);
+  now = before;
 
   if (timeout == 0 || timeout_ms < timeout)
     timeout = timeout_ms;
 
   do {
-    struct epoll_event events[COAP_MAX_EPOLL_EVENTS];
     int etimeout = timeout;
 
+    events = stack_events;
+    nevents = COAP_MAX_EPOLL_EVENTS;
+
+    if (!ctx->epoll_events) {
+      ctx->epoll_events = coap_malloc_type(COAP_STRING,
+                                           COAP_MAX_EPOLL_EVENTS *
+                                           sizeof(coap_io_event_t));
+      ctx->epoll_events_size = ctx->epoll_events ? COAP_MAX_EPOLL_EVENTS : 0;
+    }
+    if (ctx->epoll_events) {
+      events = ctx->epoll_events;
+      nevents = ctx->epoll_events_size;
+    }
+
     /* Potentially adjust based on what the caller wants */
     if (timeout_ms == COAP_IO_NO_WAIT) {
       etimeout = 0;
@@ -1413,30 +2864,79 @@ coap_io_process_with_fds(coap_context_t *ctx, uint32_t timeout_ms,
       etimeout = INT_MAX;
     }
 
-    nfds = epoll_wait(ctx->epfd, events, COAP_MAX_EPOLL_EVENTS, etimeout);
+    /* Send anything queued before waiting */
+    coap_io_flush(ctx);
+
+#ifdef COAP_EPOLL_SUPPORT
+    nfds = epoll_wait(ctx->epfd, events, (int)nevents, etimeout);
+#else /* COAP_KQUEUE_SUPPORT */
+    {
+      struct timespec ts;
+
+      ts.tv_sec = etimeout / 1000;
+      ts.tv_nsec = (etimeout % 1000) * 1000000L;
+      nfds = kevent(ctx->epfd, NULL, 0, events, (int)nevents,
+                    etimeout < 0 ? NULL : &ts);
+    }
+#endif /* COAP_KQUEUE_SUPPORT */
     if (nfds < 0) {
       if (errno != EINTR) {
+#ifdef COAP_EPOLL_SUPPORT
         coap_log (LOG_ERR, "epoll_wait: unexpected error: %s (%d)\n",
                             coap_socket_strerror(), nfds);
+#else /* COAP_KQUEUE_SUPPORT */
+        coap_log (LOG_ERR, "kevent: unexpected error: %s (%d)\n",
+                            coap_socket_strerror(), nfds);
+#endif /* COAP_KQUEUE_SUPPORT */
       }
       break;
     }
 
+    /* One clock reading for everything handled for these events */
+    coap_ticks(&now);
+    ctx->io_now = now;
+#ifdef COAP_EPOLL_SUPPORT
     coap_io_do_epoll(ctx, events, nfds);
+#else /* COAP_KQUEUE_SUPPORT */
+    coap_io_do_kqueue(ctx, events, nfds);
+#endif /* COAP_KQUEUE_SUPPORT */
+    ctx->io_now = 0;
 
     /*
      * reset to COAP_IO_NO_WAIT (which causes etimeout to become 0)
      * incase we have to do another iteration
-     * (COAP_MAX_EPOLL_EVENTS insufficient)
+     * (events array insufficient)
      */
     timeout_ms = COAP_IO_NO_WAIT;
 
-    /* Keep retrying until less than COAP_MAX_EPOLL_EVENTS are returned */
-  } while (nfds == COAP_MAX_EPOLL_EVENTS);
+    if ((unsigned int)nfds == nevents && events == ctx->epoll_events) {
+      /* The array was filled, so grow it for the next epoll_wait() */
+      unsigned int max_events = ctx->epoll_events_max ?
+                                ctx->epoll_events_max :
+                                COAP_MAX_EPOLL_EVENTS_LIMIT;
+
+      if (nevents < max_events) {
+        unsigned int new_size = nevents * 2 < max_events ?
+                                nevents * 2 : max_events;
+        coap_io_event_t *new_events =
+                  coap_realloc_type(COAP_STRING, ctx->epoll_events,
+                                    new_size * sizeof(coap_io_event_t));
+        if (new_events) {
+          ctx->epoll_events = new_events;
+          ctx->epoll_events_size = new_size;
+        }
+      }
+    }
+
+    /* Keep retrying until the events array is not filled */
+  } while ((unsigned int)nfds == nevents);
 
+  ctx->io_now = now;
   coap_expire_cache_entries(ctx);
-  coap_ticks(&now);
-#endif /* COAP_EPOLL_SUPPORT */
+  ctx->io_now = 0;
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+
+  coap_io_flush(ctx);
 
 #if COAP_CONSTRAINED_STACK
   coap_mutex_unlock(&static_mutex);
@@ -1472,7 +2972,7 @@ coap_io_prepare(coap_context_t *ctx,
 
 #ifdef _WIN32
 const char *coap_socket_format_errno(int error) {
-  static char szError[256];
+  static COAP_THREAD_LOCAL char szError[256];
   if (FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, (DWORD)error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)szError, (DWORD)sizeof(szError), NULL) == 0)
     strcpy(szError, "Unknown error");
   return szError;
@@ -1493,7 +2993,94 @@ const char *coap_socket_strerror(void) {
 ssize_t
 coap_socket_send(coap_socket_t *sock, coap_session_t *session,
   const uint8_t *data, size_t data_len) {
+#if COAP_TX_BATCHING
+  struct iovec iov[1];
+  ssize_t bytes_written;
+
+  memcpy(&iov[0].iov_base, &data, sizeof(iov[0].iov_base));
+  iov[0].iov_len = data_len;
+  bytes_written = coap_tx_batch_add(sock, session, iov, 1);
+  if (bytes_written > 0)
+    return bytes_written;
+#endif /* COAP_TX_BATCHING */
   return session->context->network_send(sock, session, data, data_len);
 }
 
+#if COAP_SOCKET_SENDV
+/*
+ * As coap_network_send(), but gathering the datagram from @p iov.
+ */
+static ssize_t
+coap_network_sendv(coap_socket_t *sock, const coap_session_t *session,
+                   const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_written;
+  size_t datalen = 0;
+  struct msghdr mhdr;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    datalen += iov[i].iov_len;
+  if (!coap_debug_send_packet())
+    return (ssize_t)datalen;
+
+  memset(&mhdr, 0, sizeof(struct msghdr));
+  memcpy(&mhdr.msg_iov, &iov, sizeof(mhdr.msg_iov));
+  mhdr.msg_iovlen = iovcnt;
+
+  if (coap_socket_is_connected(sock, session)) {
+    bytes_written = sendmsg(sock->fd, &mhdr, 0);
+  } else {
+    /* a buffer large enough to hold all packet info types, ipv6 is the largest */
+    char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    const void *addr = &session->addr_info.remote.addr;
+
+    memset(buf, 0, sizeof (buf));
+    memcpy(&mhdr.msg_name, &addr, sizeof(mhdr.msg_name));
+    mhdr.msg_namelen = session->addr_info.remote.size;
+    if (!coap_network_set_pktinfo(&mhdr, buf, &session->addr_info.local,
+                                  session->ifindex))
+      bytes_written = -1;
+    else
+      bytes_written = sendmsg(sock->fd, &mhdr, 0);
+  }
+
+  if (bytes_written < 0)
+    coap_log(LOG_CRIT, "coap_network_send: %s\n", coap_socket_strerror());
+
+  return bytes_written;
+}
+
+ssize_t
+coap_socket_sendv(coap_socket_t *sock, coap_session_t *session,
+                  const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_written;
+  uint8_t *data;
+  size_t datalen = 0;
+  int i;
+
+#if COAP_TX_BATCHING
+  bytes_written = coap_tx_batch_add(sock, session, iov, iovcnt);
+  if (bytes_written > 0)
+    return bytes_written;
+#endif /* COAP_TX_BATCHING */
+  if (session->context->network_send == coap_network_send)
+    return coap_network_sendv(sock, session, iov, iovcnt);
+
+  /* The application's send function needs a contiguous datagram */
+  for (i = 0; i < iovcnt; i++)
+    datalen += iov[i].iov_len;
+  data = coap_malloc_type(COAP_STRING, datalen);
+  if (!data)
+    return -1;
+  datalen = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(data + datalen, iov[i].iov_base, iov[i].iov_len);
+    datalen += iov[i].iov_len;
+  }
+  bytes_written = session->context->network_send(sock, session, data, datalen);
+  coap_free_type(COAP_STRING, data);
+  return bytes_written;
+}
+#endif /* COAP_SOCKET_SENDV */
+
 #undef SIN6
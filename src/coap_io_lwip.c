@@ -86,7 +86,7 @@ static void coap_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_
     goto error;
   }
 
-  coap_ticks(&now);
+  coap_io_ticks(ep->context, &now);
   session = coap_endpoint_get_session(ep, packet, now);
   if (!session)
     goto error;
@@ -152,14 +152,29 @@ void coap_free_endpoint(coap_endpoint_t *ep)
 ssize_t
 coap_socket_send_pdu(coap_socket_t *sock, coap_session_t *session,
   coap_pdu_t *pdu) {
+  struct pbuf *payload = NULL;
+
   /* FIXME: we can't check this here with the existing infrastructure, but we
   * should actually check that the pdu is not held by anyone but us. the
   * respective pbuf is already exclusively owned by the pdu. */
 
   pbuf_realloc(pdu->pbuf, pdu->used_size + coap_pdu_parse_header_size(session->proto, pdu->pbuf->payload));
+  if (pdu->xmit_data) {
+    /* Send the payload from where it is held rather than copying it */
+    payload = pbuf_alloc(PBUF_RAW, (u16_t)pdu->xmit_length, PBUF_REF);
+    if (payload == NULL)
+      return -1;
+    memcpy(&payload->payload, &pdu->xmit_data, sizeof(payload->payload));
+    pbuf_chain(pdu->pbuf, payload);
+  }
   udp_sendto(sock->pcb, pdu->pbuf, &session->addr_info.remote.addr,
     session->addr_info.remote.port);
-  return pdu->used_size;
+  if (payload) {
+    /* lwIP copies a PBUF_REF chain that it has to queue */
+    pbuf_dechain(pdu->pbuf);
+    pbuf_free(payload);
+  }
+  return pdu->used_size + pdu->xmit_length;
 }
 
 ssize_t
@@ -169,6 +184,90 @@ coap_socket_send(coap_socket_t *sock, coap_session_t *session,
   return -1;
 }
 
+int
+coap_context_set_tx_batching(coap_context_t *context, int enable) {
+  /* Not implemented, lwIP sends each pbuf directly */
+  return !enable;
+}
+
+void
+coap_io_flush(coap_context_t *context) {
+  return;
+}
+
+int
+coap_context_set_reuseport(coap_context_t *context, int enable) {
+  /* Not implemented, there is only one lwIP stack */
+  return !enable;
+}
+
+int
+coap_context_set_reuseport_steering(coap_context_t *context,
+                                    unsigned int shard, unsigned int shards,
+                                    int cpu) {
+  (void)context;
+  (void)shard;
+  (void)cpu;
+  return !shards;
+}
+
+void
+coap_context_set_max_epoll_events(coap_context_t *context,
+                                  unsigned int max_events) {
+  (void)context;
+  (void)max_events;
+}
+
+int
+coap_context_set_epoll_edge_triggered(coap_context_t *context, int enable) {
+  /* There is no epoll with lwIP */
+  return !enable;
+}
+
+int
+coap_context_set_io_callbacks(coap_context_t *context,
+                              const coap_io_callbacks_t *callbacks,
+                              void *arg) {
+  (void)context;
+  (void)callbacks;
+  (void)arg;
+  return 0;
+}
+
+int
+coap_context_set_max_rx_size(coap_context_t *context, size_t size) {
+  /* The datagrams are received into pbufs of the size lwIP is built with */
+  (void)context;
+  return size <= COAP_RXBUFFER_SIZE;
+}
+
+int
+coap_context_set_path_mtu_discovery(coap_context_t *context, int enable) {
+  /* Not implemented */
+  (void)context;
+  return !enable;
+}
+
+int
+coap_socket_set_path_mtu_discovery(coap_socket_t *sock, int family) {
+  (void)sock;
+  (void)family;
+  return 0;
+}
+
+size_t
+coap_socket_get_path_mtu(coap_socket_t *sock, int family) {
+  (void)sock;
+  (void)family;
+  return 0;
+}
+
+unsigned int
+coap_io_do_timers(coap_context_t *ctx) {
+  (void)ctx;
+  return 0;
+}
+
 int
 coap_socket_bind_udp(coap_socket_t *sock,
   const coap_address_t *listen_addr,
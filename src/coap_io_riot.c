@@ -67,18 +67,31 @@ get_udp_header(gnrc_pktsnip_t *pkt) {
   return udp ? (udp_hdr_t *)udp->data : NULL;
 }
 
+static void
+set_address(coap_address_t *addr, const ipv6_addr_t *ip,
+            network_uint16_t port) {
+  assert(sizeof(struct in6_addr) == sizeof(ipv6_addr_t));
+  addr->size = sizeof(struct sockaddr_in6);
+  addr->addr.sin6 = (struct sockaddr_in6){ .sin6_family = AF_INET6,
+                                           .sin6_port = port.u16 };
+  memcpy(&addr->addr.sin6.sin6_addr, ip, sizeof(ipv6_addr_t));
+}
+
 ssize_t
 coap_network_read(coap_socket_t *sock, struct coap_packet_t *packet) {
-  size_t len;
+  gnrc_pktsnip_t *pkt, *writable;
   ipv6_hdr_t *ipv6_hdr;
   /* The GNRC API currently only supports UDP. */
   gnrc_pktsnip_t *udp;
   udp_hdr_t *udp_hdr;
-  const gnrc_nettype_t type = GNRC_NETTYPE_UDP;
 
   assert(sock);
   assert(packet);
 
+  packet->pkt = NULL;
+  packet->payload = NULL;
+  packet->length = 0;
+
   if ((sock->flags & COAP_SOCKET_CAN_READ) == 0) {
     coap_log(LOG_DEBUG, "coap_network_read: COAP_SOCKET_CAN_READ not set\n");
     return -1;
@@ -87,55 +100,63 @@ coap_network_read(coap_socket_t *sock, struct coap_packet_t *packet) {
     sock->flags &= ~COAP_SOCKET_CAN_READ;
   }
 
+  /* The packet now belongs to @p packet until coap_packet_release(). */
+  pkt = sock->pkt;
+  sock->pkt = NULL;
+  if (!pkt)
+    return -1;
+
+  /* The payload is the first snip.  It may be written to while the request
+   * is handled, so it is only copied if some other thread holds it too. */
+  writable = gnrc_pktbuf_start_write(pkt);
+  if (!writable) {
+    coap_log(LOG_DEBUG, "coap_network_read: empty or unwritable packet\n");
+    gnrc_pktbuf_release(pkt);
+    return -1;
+  }
+  pkt = writable;
+
   /* Search for the transport header in the packet received from the
    * network interface driver. */
-  udp = gnrc_pktsnip_search_type(sock->pkt, type);
-  ipv6_hdr = gnrc_ipv6_get_header(sock->pkt);
+  udp = gnrc_pktsnip_search_type(pkt, GNRC_NETTYPE_UDP);
+  ipv6_hdr = gnrc_ipv6_get_header(pkt);
 
-  if (!ipv6_hdr || !udp || !(udp_hdr = (udp_hdr_t *)udp->data)) {
+  if (!ipv6_hdr || !udp || !(udp_hdr = (udp_hdr_t *)udp->data) ||
+      pkt->next != udp) {
     coap_log(LOG_DEBUG, "no UDP header found in packet\n");
+    gnrc_pktbuf_release(pkt);
     return -EFAULT;
   }
   udp_hdr_print(udp_hdr);
+  coap_log(LOG_DEBUG, "coap_network_read: recvfrom got %zu bytes\n",
+           pkt->size);
 
-  len = (size_t)gnrc_pkt_len_upto(sock->pkt, type) - sizeof(udp_hdr_t);
-  coap_log(LOG_DEBUG, "coap_network_read: recvfrom got %zd bytes\n", len);
-  if (len > COAP_RXBUFFER_SIZE) {
-    coap_log(LOG_WARNING, "packet exceeds buffer size, truncated\n");
-    len = COAP_RXBUFFER_SIZE;
-  }
-  packet->ifindex = sock->fd;
-
-  assert(sizeof(struct in6_addr) == sizeof(ipv6_addr_t));
-  packet->addr_info.remote.size = sizeof(struct sockaddr_in6);
-  memset(&packet->addr_info.remote.addr, 0,
-         sizeof(packet->addr_info.remote.addr));
-  packet->addr_info.remote.addr.sin6.sin6_family = AF_INET6;
-  memcpy(&packet->addr_info.remote.addr.sin6.sin6_addr,
-         &ipv6_hdr->src, sizeof(ipv6_addr_t));
-  memcpy(&packet->addr_info.remote.addr.sin6.sin6_port,
-         &udp_hdr->src_port, sizeof(udp_hdr->src_port));
-
-  packet->addr_info.local.size = sizeof(struct sockaddr_in6);
-  memset(&packet->addr_info.local.addr, 0, sizeof(packet->addr_info.local.addr));
-  packet->addr_info.local.addr.sin6.sin6_family = AF_INET6;
-  memcpy(&packet->addr_info.local.addr.sin6.sin6_addr,
-         &ipv6_hdr->dst, sizeof(ipv6_addr_t));
-  memcpy(&packet->addr_info.local
-         .addr.sin6.sin6_port, &udp_hdr->dst_port, sizeof(udp_hdr->src_port));
+  set_address(&packet->addr_info.remote, &ipv6_hdr->src, udp_hdr->src_port);
+  set_address(&packet->addr_info.local, &ipv6_hdr->dst, udp_hdr->dst_port);
 
   packet->ifindex = sock->fd;
-  packet->length = (len > 0) ? len : 0;
-  memcpy(packet->payload, (uint8_t*)udp_hdr + sizeof(udp_hdr_t), len);
-  if (LOG_DEBUG <= coap_get_log_level()) {
+  packet->pkt = pkt;
+  packet->payload = pkt->data;
+  packet->length = pkt->size;
+  if (coap_log_enabled(LOG_DEBUG)) {
     unsigned char addr_str[INET6_ADDRSTRLEN + 8];
 
     if (coap_print_addr(&packet->addr_info.remote, addr_str, INET6_ADDRSTRLEN + 8)) {
-      coap_log(LOG_DEBUG, "received %zd bytes from %s\n", len, addr_str);
+      coap_log(LOG_DEBUG, "received %zu bytes from %s\n", packet->length,
+               addr_str);
     }
   }
 
-  return len;
+  return (ssize_t)packet->length;
+}
+
+void
+coap_packet_release(coap_packet_t *packet) {
+  if (packet->pkt) {
+    gnrc_pktbuf_release(packet->pkt);
+    packet->pkt = NULL;
+    packet->payload = NULL;
+  }
 }
 
 static msg_t _msg_q[LIBCOAP_MSG_QUEUE_SIZE];
@@ -211,8 +232,10 @@ coap_io_process(coap_context_t *ctx, uint32_t timeout_ms) {
     udp_hdr_t *udp_hdr = get_udp_header((gnrc_pktsnip_t *)msg.content.ptr);
     ipv6_hdr_t *ip6_hdr =
       gnrc_ipv6_get_header((gnrc_pktsnip_t *)msg.content.ptr);
-    if (!udp_hdr || !ip6_hdr)
+    if (!udp_hdr || !ip6_hdr) {
+      gnrc_pktbuf_release(msg.content.ptr);
       break;
+    }
     coap_log(LOG_DEBUG, "coap_run_once: found UDP header\n");
 
     /* Traverse all sessions and set COAP_SOCKET_CAN_READ if the
@@ -257,6 +280,9 @@ coap_io_process(coap_context_t *ctx, uint32_t timeout_ms) {
         }
       }
     }
+    /* Nobody is going to read it */
+    if (!found_port)
+      gnrc_pktbuf_release(msg.content.ptr);
     break;
   }
   case GNRC_NETAPI_MSG_TYPE_SND:
@@ -50,6 +50,31 @@
 #include <mbedtls/oid.h>
 #include <mbedtls/debug.h>
 #include <mbedtls/sha256.h>
+#include <mbedtls/ccm.h>
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C) && \
+    defined(MBEDTLS_SSL_SRV_C) && defined(MBEDTLS_GCM_C)
+#include <mbedtls/ssl_ticket.h>
+#define COAP_MBEDTLS_TICKETS 1
+#else /* ! MBEDTLS_SSL_SESSION_TICKETS || ! MBEDTLS_SSL_TICKET_C || ... */
+#define COAP_MBEDTLS_TICKETS 0
+#endif /* ! MBEDTLS_SSL_SESSION_TICKETS || ! MBEDTLS_SSL_TICKET_C || ... */
+#if defined(MBEDTLS_SSL_CLI_C) && MBEDTLS_VERSION_NUMBER >= 0x02130000
+/* mbedtls_ssl_session_save() and mbedtls_ssl_session_load() */
+#define COAP_MBEDTLS_RESUME 1
+#else /* ! MBEDTLS_SSL_CLI_C || MBEDTLS_VERSION_NUMBER < 0x02130000 */
+#define COAP_MBEDTLS_RESUME 0
+#endif /* ! MBEDTLS_SSL_CLI_C || MBEDTLS_VERSION_NUMBER < 0x02130000 */
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+/* DTLS Connection ID (RFC 9146) */
+#define COAP_MBEDTLS_CID 1
+#else /* ! MBEDTLS_SSL_DTLS_CONNECTION_ID */
+#define COAP_MBEDTLS_CID 0
+#endif /* ! MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
+/* How long a session ticket issued by a server may be used for (secs) */
+#ifndef COAP_MBEDTLS_TICKET_LIFETIME
+#define COAP_MBEDTLS_TICKET_LIFETIME 86400
+#endif /* COAP_MBEDTLS_TICKET_LIFETIME */
 #if defined(ESPIDF_VERSION) && defined(CONFIG_MBEDTLS_DEBUG)
 #include <mbedtls/esp_debug.h>
 #endif /* ESPIDF_VERSION && CONFIG_MBEDTLS_DEBUG */
@@ -127,6 +152,13 @@ typedef struct coap_mbedtls_context_t {
   char *root_ca_file;
   char *root_ca_path;
   int psk_pki_enabled;
+#if COAP_MBEDTLS_TICKETS
+  int ticket_state;             /* 0 not set up, 1 set up, -1 failed */
+  int no_tickets;               /* do not issue session tickets */
+  mbedtls_ssl_ticket_context ticket_ctx;
+  mbedtls_entropy_context ticket_entropy;
+  mbedtls_ctr_drbg_context ticket_ctr_drbg;
+#endif /* COAP_MBEDTLS_TICKETS */
 } coap_mbedtls_context_t;
 
 typedef enum coap_enc_method_t {
@@ -226,7 +258,9 @@ static int psk_server_callback(void *p_info, mbedtls_ssl_context *ssl,
   m_env = (coap_mbedtls_env_t *)c_session->tls;
   setup_data = &c_session->context->spsk_setup_data;
 
-  if (setup_data->validate_id_call_back) {
+  /* A key found in the store is returned by get_server_psk() */
+  if (!coap_psk_store_set_session_key(c_session, name, name_len) &&
+      setup_data->validate_id_call_back) {
     coap_bin_const_t lidentity;
     lidentity.length = name_len;
     lidentity.s = (const uint8_t*)name;
@@ -285,7 +319,7 @@ get_san_or_cn_from_cert(mbedtls_x509_crt *crt)
 
 static char *
 get_error_string(int ret) {
-  static char buf[128] = {0};
+  static COAP_THREAD_LOCAL char buf[128] = {0};
   mbedtls_strerror(ret, buf, sizeof(buf)-1);
   return buf;
 }
@@ -867,6 +901,52 @@ psk_sni_callback(void *p_info, mbedtls_ssl_context *ssl,
 }
 #endif /* MBEDTLS_KEY_EXCHANGE__SOME__PSK_ENABLED */
 
+#if COAP_MBEDTLS_TICKETS
+static void
+free_ticket_context(coap_mbedtls_context_t *m_context) {
+  if (m_context->ticket_state > 0) {
+    mbedtls_ssl_ticket_free(&m_context->ticket_ctx);
+    mbedtls_ctr_drbg_free(&m_context->ticket_ctr_drbg);
+    mbedtls_entropy_free(&m_context->ticket_entropy);
+  }
+  m_context->ticket_state = -1;
+}
+
+/*
+ * Sets up the ticket keys of the context on first use.  Mbed TLS only
+ * creates random keys, so these are not shared with other contexts.
+ *
+ * return 0 failed
+ *        1 passed
+ */
+static int
+setup_ticket_context(coap_mbedtls_context_t *m_context) {
+  int ret;
+
+  if (m_context->ticket_state)
+    return m_context->ticket_state > 0;
+  mbedtls_ssl_ticket_init(&m_context->ticket_ctx);
+  mbedtls_entropy_init(&m_context->ticket_entropy);
+  mbedtls_ctr_drbg_init(&m_context->ticket_ctr_drbg);
+  m_context->ticket_state = 1;
+  if ((ret = mbedtls_ctr_drbg_seed(&m_context->ticket_ctr_drbg,
+                                   mbedtls_entropy_func,
+                                   &m_context->ticket_entropy,
+                                   NULL, 0)) != 0 ||
+      (ret = mbedtls_ssl_ticket_setup(&m_context->ticket_ctx,
+                                      mbedtls_ctr_drbg_random,
+                                      &m_context->ticket_ctr_drbg,
+                                      MBEDTLS_CIPHER_AES_256_GCM,
+                                      COAP_MBEDTLS_TICKET_LIFETIME)) != 0) {
+    coap_log(LOG_WARNING, "mbedtls_ssl_ticket_setup returned -0x%x: '%s'\n",
+             -ret, get_error_string(ret));
+    free_ticket_context(m_context);
+    return 0;
+  }
+  return 1;
+}
+#endif /* COAP_MBEDTLS_TICKETS */
+
 static int setup_server_ssl_session(coap_session_t *c_session,
                                     coap_mbedtls_env_t *m_env)
 {
@@ -919,6 +999,15 @@ static int setup_server_ssl_session(coap_session_t *c_session,
     }
   }
 
+#if COAP_MBEDTLS_TICKETS
+  if (!m_context->no_tickets && setup_ticket_context(m_context)) {
+    mbedtls_ssl_conf_session_tickets_cb(&m_env->conf,
+                                        mbedtls_ssl_ticket_write,
+                                        mbedtls_ssl_ticket_parse,
+                                        &m_context->ticket_ctx);
+  }
+#endif /* COAP_MBEDTLS_TICKETS */
+
   if ((ret = mbedtls_ssl_cookie_setup(&m_env->cookie_ctx,
                                   mbedtls_ctr_drbg_random,
                                   &m_env->ctr_drbg)) != 0) {
@@ -1064,9 +1153,9 @@ static int setup_client_ssl_session(coap_session_t *c_session,
     mbedtls_ssl_conf_psk(&m_env->conf, (const unsigned char *)psk_key,
                          psk_len, (const unsigned char *)identity,
                          identity_len);
-    if (c_session->cpsk_setup_data.client_sni) {
+    if (c_session->ext->cpsk_setup_data.client_sni) {
       mbedtls_ssl_set_hostname(&m_env->ssl,
-                               c_session->cpsk_setup_data.client_sni);
+                               c_session->ext->cpsk_setup_data.client_sni);
     }
     /* Identity Hint currently not supported in Mbed TLS so code removed */
 
@@ -1170,6 +1259,19 @@ static int do_mbedtls_handshake(coap_session_t *c_session,
     m_env->established = 1;
     coap_log(LOG_DEBUG, "*  %s: Mbed TLS established\n",
                                             coap_session_str(c_session));
+#if COAP_MBEDTLS_CID
+    if (c_session->proto == COAP_PROTO_DTLS) {
+      unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+      size_t peer_cid_len;
+      int cid_enabled;
+
+      if (mbedtls_ssl_get_peer_cid(&m_env->ssl, &cid_enabled, peer_cid,
+                                   &peer_cid_len) == 0 &&
+          cid_enabled == MBEDTLS_SSL_CID_ENABLED)
+        coap_log(LOG_DEBUG, "*  %s: DTLS Connection ID in use\n",
+                 coap_session_str(c_session));
+    }
+#endif /* COAP_MBEDTLS_CID */
     ret = 1;
     break;
   case MBEDTLS_ERR_SSL_WANT_READ:
@@ -1253,6 +1355,73 @@ mbedtls_debug_out(void *ctx COAP_UNUSED, int level,
   coap_log(log_level, "%s:%04d: %s", file, line, str);
 }
 
+#if COAP_MBEDTLS_RESUME
+/* Tries to resume the last session with this server */
+static void
+set_resume_session(coap_session_t *c_session, coap_mbedtls_env_t *m_env) {
+  const coap_tls_resume_t *resume = coap_tls_resume_find(c_session);
+  mbedtls_ssl_session session;
+
+  if (!resume)
+    return;
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_session_load(&session, resume->data, resume->length) != 0 ||
+      mbedtls_ssl_set_session(&m_env->ssl, &session) != 0)
+    coap_tls_resume_forget(c_session);
+  mbedtls_ssl_session_free(&session);
+}
+
+/* Saves the state of an established client session for resumption */
+static void
+save_resume_session(coap_session_t *c_session, coap_mbedtls_env_t *m_env) {
+  mbedtls_ssl_session session;
+  unsigned char *data;
+  size_t len = 0;
+
+  if (c_session->type != COAP_SESSION_TYPE_CLIENT || !m_env->established)
+    return;
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_get_session(&m_env->ssl, &session) == 0 &&
+      mbedtls_ssl_session_save(&session, NULL, 0, &len) ==
+                                      MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+    data = mbedtls_malloc(len);
+    if (data) {
+      if (mbedtls_ssl_session_save(&session, data, len, &len) == 0)
+        coap_tls_resume_save(c_session, data, len);
+      mbedtls_free(data);
+    }
+  }
+  mbedtls_ssl_session_free(&session);
+}
+#endif /* COAP_MBEDTLS_RESUME */
+
+#if COAP_MBEDTLS_CID
+/*
+ * A server asks the client to put the Connection ID of the session in the
+ * records it sends, a client only needs the server to support Connection IDs.
+ */
+static int
+setup_cid(coap_session_t *c_session, coap_mbedtls_env_t *m_env,
+          coap_dtls_role_t role) {
+  int ret;
+
+  if (role == COAP_DTLS_ROLE_SERVER) {
+    if (!coap_session_new_dtls_cid(c_session))
+      return 0;
+    ret = mbedtls_ssl_set_cid(&m_env->ssl, MBEDTLS_SSL_CID_ENABLED,
+                              c_session->dtls_cid, COAP_DTLS_CID_LENGTH);
+  } else {
+    ret = mbedtls_ssl_set_cid(&m_env->ssl, MBEDTLS_SSL_CID_ENABLED, NULL, 0);
+  }
+  if (ret != 0) {
+    coap_log(LOG_ERR, "mbedtls_ssl_set_cid returned -0x%x: '%s'\n",
+             -ret, get_error_string(ret));
+    return -1;
+  }
+  return 0;
+}
+#endif /* COAP_MBEDTLS_CID */
+
 static coap_mbedtls_env_t *coap_dtls_new_mbedtls_env(coap_session_t *c_session,
                                                      coap_dtls_role_t role)
 {
@@ -1299,10 +1468,30 @@ static coap_mbedtls_env_t *coap_dtls_new_mbedtls_env(coap_session_t *c_session,
 
   mbedtls_ssl_conf_min_version(&m_env->conf, MBEDTLS_SSL_MAJOR_VERSION_3,
                                MBEDTLS_SSL_MINOR_VERSION_3);
+#if COAP_MBEDTLS_CID
+  if (c_session->proto == COAP_PROTO_DTLS &&
+      (ret = mbedtls_ssl_conf_cid(&m_env->conf,
+                        role == COAP_DTLS_ROLE_SERVER ? COAP_DTLS_CID_LENGTH : 0,
+                        MBEDTLS_SSL_UNEXPECTED_CID_IGNORE)) != 0) {
+    coap_log(LOG_ERR, "mbedtls_ssl_conf_cid returned -0x%x: '%s'\n",
+             -ret, get_error_string(ret));
+    goto fail;
+  }
+#endif /* COAP_MBEDTLS_CID */
 
   if ((ret = mbedtls_ssl_setup(&m_env->ssl, &m_env->conf)) != 0) {
     goto fail;
   }
+#if COAP_MBEDTLS_CID
+  if (c_session->proto == COAP_PROTO_DTLS &&
+      setup_cid(c_session, m_env, role) != 0) {
+    goto fail;
+  }
+#endif /* COAP_MBEDTLS_CID */
+#if COAP_MBEDTLS_RESUME
+  if (role == COAP_DTLS_ROLE_CLIENT)
+    set_resume_session(c_session, m_env);
+#endif /* COAP_MBEDTLS_RESUME */
   mbedtls_ssl_set_bio(&m_env->ssl, c_session, coap_dgram_write,
                       coap_dgram_read, NULL);
   mbedtls_ssl_set_timer_cb(&m_env->ssl, &m_env->timer,
@@ -1399,6 +1588,62 @@ coap_dtls_context_set_cpsk(coap_context_t *c_context,
   return 1;
 }
 
+/*
+ * return 0 failed
+ *        1 passed
+ */
+int
+coap_dtls_context_set_ticket_key(coap_context_t *c_context,
+                                 const uint8_t *key, size_t key_len
+) {
+  coap_mbedtls_context_t *m_context =
+                         ((coap_mbedtls_context_t *)c_context->dtls_context);
+
+  (void)key_len;
+  if (!m_context)
+    return 0;
+#if COAP_MBEDTLS_TICKETS
+  if (!key) {
+    /* Sessions in progress may still use the ticket context */
+    m_context->no_tickets = 1;
+    return 1;
+  }
+#endif /* COAP_MBEDTLS_TICKETS */
+  coap_log(LOG_WARNING,
+           "Mbed TLS does not support setting the session ticket key\n");
+  return 0;
+}
+
+/*
+ * Mbed TLS loads the certificates, keys and root CAs for each session, so
+ * the configuration is just copied.  Each context keeps its own random
+ * session ticket key.
+ *
+ * return 0 failed
+ *        1 passed
+ */
+int
+coap_dtls_context_share(coap_context_t *c_context, coap_context_t *from) {
+  coap_mbedtls_context_t *m_context =
+                         ((coap_mbedtls_context_t *)c_context->dtls_context);
+  coap_mbedtls_context_t *f_context =
+                         ((coap_mbedtls_context_t *)from->dtls_context);
+
+  if (!m_context || !f_context)
+    return 0;
+  if ((f_context->root_ca_file || f_context->root_ca_path) &&
+      !coap_dtls_context_set_pki_root_cas(c_context, f_context->root_ca_file,
+                                          f_context->root_ca_path))
+    return 0;
+  m_context->setup_data = f_context->setup_data;
+  m_context->psk_pki_enabled |= f_context->psk_pki_enabled &
+                                (IS_PSK | IS_PKI);
+#if COAP_MBEDTLS_TICKETS
+  m_context->no_tickets = f_context->no_tickets;
+#endif /* COAP_MBEDTLS_TICKETS */
+  return 1;
+}
+
 int coap_dtls_context_set_pki(coap_context_t *c_context,
                               const coap_dtls_pki_t *setup_data,
                               const coap_dtls_role_t role COAP_UNUSED)
@@ -1500,6 +1745,9 @@ void coap_dtls_free_context(void *dtls_context)
   if (m_context->root_ca_file)
     mbedtls_free(m_context->root_ca_file);
 
+#if COAP_MBEDTLS_TICKETS
+  free_ticket_context(m_context);
+#endif /* COAP_MBEDTLS_TICKETS */
   mbedtls_free(m_context);
 }
 
@@ -1547,6 +1795,9 @@ void *coap_dtls_new_server_session(coap_session_t *c_session)
 void coap_dtls_free_session(coap_session_t *c_session)
 {
   if (c_session && c_session->context && c_session->tls) {
+#if COAP_MBEDTLS_RESUME
+    save_resume_session(c_session, c_session->tls);
+#endif /* COAP_MBEDTLS_RESUME */
     coap_dtls_free_mbedtls_env(c_session->tls);
     c_session->tls = NULL;
     coap_handle_event(c_session->context, COAP_EVENT_DTLS_CLOSED, c_session);
@@ -1734,6 +1985,7 @@ int coap_dtls_receive(coap_session_t *c_session,
 
     ret = mbedtls_ssl_read(&m_env->ssl, pdu, sizeof(pdu));
     if (ret > 0) {
+      coap_session_dtls_cid_verified(c_session);
       ret = coap_handle_dgram(c_session->context, c_session, pdu, (size_t)ret);
 #if COAP_CONSTRAINED_STACK
       coap_mutex_unlock(&b_static_mutex);
@@ -1874,6 +2126,12 @@ int coap_dtls_hello(coap_session_t *c_session,
 #endif /* MBEDTLS_SSL_PROTO_DTLS && MBEDTLS_SSL_SRV_C */
 }
 
+int coap_dtls_is_cookie_stateless(void)
+{
+  /* Mbed TLS makes and checks the cookies itself */
+  return 0;
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *c_session)
 {
   coap_mbedtls_env_t *m_env = (coap_mbedtls_env_t *)c_session->tls;
@@ -1917,6 +2175,11 @@ ssize_t coap_tls_read(coap_session_t *c_session COAP_UNUSED,
 {
   return 0;
 }
+
+int coap_tls_is_ktls_send(coap_session_t *c_session COAP_UNUSED)
+{
+  return 0;
+}
 #endif /* !COAP_DISABLE_TCP */
 
 void coap_dtls_startup(void)
@@ -2001,6 +2264,47 @@ coap_digest_final(coap_digest_ctx_t *digest_ctx,
   return ret == 0;
 }
 
+int
+coap_crypto_aead_encrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  mbedtls_ccm_context ctx;
+  int ret;
+
+  mbedtls_ccm_init(&ctx);
+  ret = mbedtls_ccm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, key,
+                           COAP_OSCORE_KEY_LEN * 8);
+  if (ret == 0)
+    ret = mbedtls_ccm_encrypt_and_tag(&ctx, in_len,
+                                      nonce, COAP_OSCORE_NONCE_LEN,
+                                      aad, aad_len, in, out,
+                                      out + in_len, COAP_OSCORE_TAG_LEN);
+  mbedtls_ccm_free(&ctx);
+  return ret == 0;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  mbedtls_ccm_context ctx;
+  size_t out_len = in_len - COAP_OSCORE_TAG_LEN;
+  int ret;
+
+  if (in_len < COAP_OSCORE_TAG_LEN)
+    return 0;
+  mbedtls_ccm_init(&ctx);
+  ret = mbedtls_ccm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, key,
+                           COAP_OSCORE_KEY_LEN * 8);
+  if (ret == 0)
+    ret = mbedtls_ccm_auth_decrypt(&ctx, out_len,
+                                   nonce, COAP_OSCORE_NONCE_LEN,
+                                   aad, aad_len, in, out,
+                                   in + out_len, COAP_OSCORE_TAG_LEN);
+  mbedtls_ccm_free(&ctx);
+  return ret == 0;
+}
+
 #else /* !HAVE_MBEDTLS */
 
 #ifdef __clang__
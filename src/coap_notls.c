@@ -59,6 +59,21 @@ coap_dtls_context_set_spsk(coap_context_t *ctx COAP_UNUSED,
   return 0;
 }
 
+int
+coap_dtls_context_set_ticket_key(coap_context_t *ctx COAP_UNUSED,
+                                 const uint8_t *key COAP_UNUSED,
+                                 size_t key_len COAP_UNUSED
+) {
+  return 0;
+}
+
+int
+coap_dtls_context_share(coap_context_t *ctx COAP_UNUSED,
+                        coap_context_t *from COAP_UNUSED
+) {
+  return 0;
+}
+
 int
 coap_dtls_context_check_keys_enabled(coap_context_t *ctx COAP_UNUSED)
 {
@@ -146,6 +161,11 @@ coap_dtls_hello(coap_session_t *session COAP_UNUSED,
   return 0;
 }
 
+int
+coap_dtls_is_cookie_stateless(void) {
+  return 0;
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *session COAP_UNUSED) {
   return 0;
 }
@@ -175,6 +195,10 @@ ssize_t coap_tls_read(coap_session_t *session COAP_UNUSED,
   return -1;
 }
 
+int coap_tls_is_ktls_send(coap_session_t *session COAP_UNUSED) {
+  return 0;
+}
+
 typedef struct coap_local_hash_t {
   size_t ofs;
   coap_key_t key[8];   /* 32 bytes in total */
@@ -219,6 +243,28 @@ coap_digest_final(coap_digest_ctx_t *digest_ctx,
   return 1;
 }
 
+int
+coap_crypto_aead_encrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+
 #else /* !HAVE_LIBTINYDTLS && !HAVE_OPENSSL && !HAVE_LIBGNUTLS */
 
 #ifdef __clang__
@@ -61,6 +61,7 @@
 #include <openssl/err.h>
 #include <openssl/rand.h>
 #include <openssl/hmac.h>
+#include <openssl/sha.h>
 #include <openssl/x509v3.h>
 
 #ifdef COAP_EPOLL_SUPPORT
@@ -96,11 +97,25 @@
 #define COAP_OPENSSL_PSK_CIPHERS "PSK:!NULL"
 #endif /*COAP_OPENSSL_PSK_CIPHERS */
 
+/*
+ * Kernel TLS.  OpenSSL hands the keys over with BIO controls that it keeps
+ * internal (see openssl/bio.h), which the TLS BIO passes on to a socket BIO
+ * that knows how to start kTLS on the socket.
+ */
+#if !COAP_DISABLE_TCP && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+#define COAP_OPENSSL_KTLS 1
+#define COAP_BIO_CTRL_SET_KTLS               72
+#define COAP_BIO_CTRL_SET_KTLS_SEND_CTRL_MSG 74
+#define COAP_BIO_CTRL_CLEAR_KTLS_CTRL_MSG    75
+#else /* COAP_DISABLE_TCP || ! SSL_OP_ENABLE_KTLS || OPENSSL_NO_KTLS */
+#define COAP_OPENSSL_KTLS 0
+#endif /* COAP_DISABLE_TCP || ! SSL_OP_ENABLE_KTLS || OPENSSL_NO_KTLS */
+
 /* This structure encapsulates the OpenSSL context object. */
 typedef struct coap_dtls_context_t {
   SSL_CTX *ctx;
   SSL *ssl;        /* OpenSSL object for listening to connection requests */
-  HMAC_CTX *cookie_hmac;
   BIO_METHOD *meth;
   BIO_ADDR *bio_addr;
 } coap_dtls_context_t;
@@ -110,6 +125,16 @@ typedef struct coap_tls_context_t {
   BIO_METHOD *meth;
 } coap_tls_context_t;
 
+#if !COAP_DISABLE_TCP
+/* The data of the BIO of a TLS session */
+typedef struct coap_sock_data {
+  coap_session_t *session;
+#if COAP_OPENSSL_KTLS
+  BIO *ktls;    /* Socket BIO that kTLS has been started with, if any */
+#endif /* COAP_OPENSSL_KTLS */
+} coap_sock_data;
+#endif /* !COAP_DISABLE_TCP */
+
 #define IS_PSK 0x1
 #define IS_PKI 0x2
 
@@ -148,6 +173,7 @@ static int psk_tls_server_name_call_back(SSL *ssl, int *sd, void *arg);
 #else /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
 static int psk_tls_client_hello_call_back(SSL *ssl, int *al, void *arg);
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+static int tls_cert_verify_call_back(X509_STORE_CTX *ctx, void *arg);
 
 int coap_dtls_is_supported(void) {
   if (SSLeay() < 0x10100000L) {
@@ -199,10 +225,21 @@ coap_get_tls_library_version(void) {
 
 static ENGINE* ssl_engine = NULL;
 
+/* The session id context of all the contexts, see coap_dtls_new_context() */
+static const unsigned char coap_sid_ctx[] = "libcoap";
+
+/* The session ticket key shared by all the contexts by default */
+static uint8_t default_ticket_key[COAP_DTLS_TICKET_KEY_LEN];
+
 void coap_dtls_startup(void) {
   SSL_load_error_strings();
   SSL_library_init();
   ENGINE_load_dynamic();
+  if (!RAND_bytes(default_ticket_key, (int)sizeof(default_ticket_key))) {
+    coap_log(LOG_WARNING,
+             "Insufficient entropy for session ticket key generation\n");
+    coap_prng(default_ticket_key, sizeof(default_ticket_key));
+  }
 }
 
 void coap_dtls_shutdown(void) {
@@ -370,31 +407,27 @@ static int
 coap_dtls_generate_cookie(SSL *ssl,
                          unsigned char *cookie,
                          unsigned int *cookie_len) {
-  coap_dtls_context_t *dtls =
-            (coap_dtls_context_t *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
   coap_ssl_data *data = (coap_ssl_data*)BIO_get_data(SSL_get_rbio(ssl));
-  int r = HMAC_Init_ex(dtls->cookie_hmac, NULL, 0, NULL, NULL);
-  r &= HMAC_Update(dtls->cookie_hmac,
-                   (const uint8_t*)&data->session->addr_info.local.addr,
-                   (size_t)data->session->addr_info.local.size);
-  r &= HMAC_Update(dtls->cookie_hmac,
-                   (const uint8_t*)&data->session->addr_info.remote.addr,
-                   (size_t)data->session->addr_info.remote.size);
-  r &= HMAC_Final(dtls->cookie_hmac, cookie, cookie_len);
-  return r;
+
+  if (!coap_dtls_cookie_make(data->session->context,
+                             &data->session->addr_hash, cookie))
+    return 0;
+  *cookie_len = COAP_DTLS_COOKIE_LENGTH;
+  return 1;
 }
 
 static int
 coap_dtls_verify_cookie(SSL *ssl,
                         const uint8_t *cookie,
                         unsigned int cookie_len) {
-  uint8_t hmac[32];
-  unsigned len = 32;
-  if (coap_dtls_generate_cookie(ssl, hmac, &len) &&
-      cookie_len == len && memcmp(cookie, hmac, len) == 0)
-    return 1;
-  else
-    return 0;
+  (void)ssl;
+  (void)cookie;
+  (void)cookie_len;
+  /*
+   * Only a ClientHello whose cookie has been checked by
+   * coap_dtls_cookie_check() gets as far as DTLSv1_listen()
+   */
+  return 1;
 }
 
 static unsigned int
@@ -418,15 +451,15 @@ coap_dtls_psk_client_callback(
   o_context = (coap_openssl_context_t *)c_session->context->dtls_context;
   if (o_context == NULL)
     return 0;
-  setup_data = &c_session->cpsk_setup_data;
+  setup_data = &c_session->ext->cpsk_setup_data;
 
-  if (c_session->psk_hint) {
-    coap_delete_bin_const(c_session->psk_hint);
-    c_session->psk_hint = NULL;
+  if (c_session->ext->psk_hint) {
+    coap_delete_bin_const(c_session->ext->psk_hint);
+    c_session->ext->psk_hint = NULL;
   }
   if (hint) {
     hint_len = strlen(hint);
-    c_session->psk_hint = coap_new_bin_const((const uint8_t *)hint, hint_len);
+    c_session->ext->psk_hint = coap_new_bin_const((const uint8_t *)hint, hint_len);
   }
   else
     hint = "";
@@ -449,19 +482,19 @@ coap_dtls_psk_client_callback(
     if (psk_info->key.length > max_psk_len)
       return 0;
 
-    if (c_session->psk_identity) {
-      coap_delete_bin_const(c_session->psk_identity);
+    if (c_session->ext->psk_identity) {
+      coap_delete_bin_const(c_session->ext->psk_identity);
     }
     identity_len = psk_info->identity.length;
-    c_session->psk_identity = coap_new_bin_const(psk_info->identity.s, identity_len);
+    c_session->ext->psk_identity = coap_new_bin_const(psk_info->identity.s, identity_len);
     memcpy(identity, psk_info->identity.s, identity_len);
     identity[identity_len] = '\000';
 
-    if (c_session->psk_key) {
-      coap_delete_bin_const(c_session->psk_key);
+    if (c_session->ext->psk_key) {
+      coap_delete_bin_const(c_session->ext->psk_key);
     }
     psk_len = psk_info->key.length;
-    c_session->psk_key = coap_new_bin_const(psk_info->key.s, psk_len);
+    c_session->ext->psk_key = coap_new_bin_const(psk_info->key.s, psk_len);
     memcpy(psk, psk_info->key.s, psk_len);
 
     return (unsigned int)psk_len;
@@ -502,15 +535,18 @@ coap_dtls_psk_server_callback(
     identity = "";
 
   /* Track the Identity being used */
-  if (c_session->psk_identity)
-    coap_delete_bin_const(c_session->psk_identity);
-  c_session->psk_identity = coap_new_bin_const((const uint8_t *)identity,
+  if (c_session->ext->psk_identity)
+    coap_delete_bin_const(c_session->ext->psk_identity);
+  c_session->ext->psk_identity = coap_new_bin_const((const uint8_t *)identity,
                                                identity_len);
 
   coap_log(LOG_DEBUG, "got psk_identity: '%.*s'\n",
            (int)identity_len, identity);
 
-  if (setup_data->validate_id_call_back) {
+  /* A key found in the store is returned by get_server_psk() */
+  if (!coap_psk_store_set_session_key(c_session, (const uint8_t*)identity,
+                                      identity_len) &&
+      setup_data->validate_id_call_back) {
     coap_bin_const_t lidentity;
     lidentity.length = identity_len;
     lidentity.s = (const uint8_t*)identity;
@@ -594,23 +630,59 @@ static void coap_dtls_info_callback(const SSL *ssl, int where, int ret) {
 
   if (where == SSL_CB_HANDSHAKE_START && SSL_get_state(ssl) == TLS_ST_OK)
     session->dtls_event = COAP_EVENT_DTLS_RENEGOTIATE;
+  /* Before OpenSSL 3.0 SSL_session_reused() takes a non-const SSL */
+  if ((where & SSL_CB_HANDSHAKE_DONE) && session->tls &&
+      SSL_session_reused((SSL *)session->tls) && dtls_log_level >= LOG_DEBUG)
+    coap_log(LOG_DEBUG, "*  %s: session resumed\n", coap_session_str(session));
 }
 
 #if !COAP_DISABLE_TCP
 static int coap_sock_create(BIO *a) {
+  coap_sock_data *data = malloc(sizeof(coap_sock_data));
+  if (data == NULL)
+    return 0;
   BIO_set_init(a, 1);
+  BIO_set_data(a, data);
+  memset(data, 0x00, sizeof(coap_sock_data));
   return 1;
 }
 
 static int coap_sock_destroy(BIO *a) {
-  (void)a;
+  coap_sock_data *data;
+  if (a == NULL)
+    return 0;
+  data = (coap_sock_data *)BIO_get_data(a);
+  if (data != NULL) {
+#if COAP_OPENSSL_KTLS
+    if (data->ktls)
+      BIO_free(data->ktls);
+#endif /* COAP_OPENSSL_KTLS */
+    free(data);
+  }
   return 1;
 }
 
 static int coap_sock_read(BIO *a, char *out, int outl) {
   int ret = 0;
-  coap_session_t *session = (coap_session_t *)BIO_get_data(a);
-
+  coap_sock_data *data = (coap_sock_data *)BIO_get_data(a);
+  coap_session_t *session = data->session;
+
+#if COAP_OPENSSL_KTLS
+  if (out != NULL && data->ktls && BIO_get_ktls_recv(data->ktls)) {
+    /* The socket BIO hands over the records decrypted, with their headers */
+    ret = BIO_read(data->ktls, out, outl);
+    if (ret > 0) {
+      BIO_clear_retry_flags(a);
+      return ret;
+    }
+    session->sock.flags &= ~COAP_SOCKET_CAN_READ;
+    if (BIO_should_retry(data->ktls))
+      BIO_set_retry_read(a);
+    else
+      BIO_clear_retry_flags(a);
+    return -1;
+  }
+#endif /* COAP_OPENSSL_KTLS */
   if (out != NULL) {
     ret = (int)coap_socket_read(&session->sock, (uint8_t*)out, (size_t)outl);
     if (ret == 0) {
@@ -625,8 +697,39 @@ static int coap_sock_read(BIO *a, char *out, int outl) {
 
 static int coap_sock_write(BIO *a, const char *in, int inl) {
   int ret = 0;
-  coap_session_t *session = (coap_session_t *)BIO_get_data(a);
+  coap_sock_data *data = (coap_sock_data *)BIO_get_data(a);
+  coap_session_t *session = data->session;
 
+#if COAP_OPENSSL_KTLS
+  if (data->ktls && BIO_get_ktls_send(data->ktls)) {
+    /*
+     * The socket BIO sends the alerts and handshake messages as records of
+     * their own type, and application data as it is
+     */
+    ret = BIO_write(data->ktls, in, inl);
+    if (ret > 0) {
+      BIO_clear_retry_flags(a);
+      return ret;
+    }
+    if (BIO_should_retry(data->ktls)) {
+      BIO_set_retry_write(a);
+      session->sock.flags |= COAP_SOCKET_WANT_WRITE;
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+      coap_epoll_ctl_mod(&session->sock,
+                         EPOLLOUT |
+                          ((session->sock.flags & COAP_SOCKET_WANT_READ) ?
+                           EPOLLIN : 0),
+                         __func__);
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+    } else {
+      BIO_clear_retry_flags(a);
+      coap_log(LOG_DEBUG,  "*  %s: failed to send %d bytes (%s) state %d\n",
+               coap_session_str(session), inl, coap_socket_strerror(),
+               session->state);
+    }
+    return -1;
+  }
+#endif /* COAP_OPENSSL_KTLS */
   ret = (int)coap_socket_write(&session->sock, (const uint8_t*)in, (size_t)inl);
   BIO_clear_retry_flags(a);
   if (ret == 0) {
@@ -666,12 +769,38 @@ static int coap_sock_puts(BIO *a, const char *pstr) {
 }
 
 static long coap_sock_ctrl(BIO *a, int cmd, long num, void *ptr) {
-  int r = 1;
+  long r = 1;
+#if COAP_OPENSSL_KTLS
+  coap_sock_data *data = (coap_sock_data *)BIO_get_data(a);
+#else /* ! COAP_OPENSSL_KTLS */
   (void)a;
   (void)ptr;
   (void)num;
+#endif /* ! COAP_OPENSSL_KTLS */
 
   switch (cmd) {
+#if COAP_OPENSSL_KTLS
+  case COAP_BIO_CTRL_SET_KTLS:
+    /* num is 1 for the keys to send with, 0 for those to receive with */
+    if (!data->ktls)
+      data->ktls = BIO_new_socket((int)data->session->sock.fd, BIO_NOCLOSE);
+    r = data->ktls ? BIO_ctrl(data->ktls, cmd, num, ptr) : 0;
+    coap_log(LOG_DEBUG, "*  %s: kTLS %s %s\n",
+             coap_session_str(data->session), num ? "send" : "receive",
+             r ? "started" : "not available");
+    if (data->ktls && !BIO_get_ktls_send(data->ktls) &&
+        !BIO_get_ktls_recv(data->ktls)) {
+      BIO_free(data->ktls);
+      data->ktls = NULL;
+    }
+    break;
+  case BIO_CTRL_GET_KTLS_SEND:
+  case BIO_CTRL_GET_KTLS_RECV:
+  case COAP_BIO_CTRL_SET_KTLS_SEND_CTRL_MSG:
+  case COAP_BIO_CTRL_CLEAR_KTLS_CTRL_MSG:
+    r = data->ktls ? BIO_ctrl(data->ktls, cmd, num, ptr) : 0;
+    break;
+#endif /* COAP_OPENSSL_KTLS */
   case BIO_C_SET_FD:
   case BIO_C_GET_FD:
     r = -1;
@@ -703,14 +832,49 @@ static void coap_set_user_prefs(SSL_CTX *ctx) {
 #endif
 }
 
+/*
+ * Expands key into the ticket name and keys that OpenSSL wants (the size
+ * depends on the version), so that contexts sharing key accept each
+ * other's tickets.
+ *
+ * return 0 failed
+ *        1 passed
+ */
+static int
+coap_set_ticket_key(SSL_CTX *ctx, const uint8_t *key) {
+  unsigned char keys[4 * SHA256_DIGEST_LENGTH];
+  long keys_len;
+  long offset;
+  unsigned char counter;
+
+  if (!key) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    return 1;
+  }
+  keys_len = SSL_CTX_get_tlsext_ticket_keys(ctx, NULL, 0);
+  if (keys_len <= 0 || keys_len > (long)sizeof(keys))
+    return 0;
+  for (offset = 0, counter = 1; offset < keys_len;
+       offset += SHA256_DIGEST_LENGTH, counter++) {
+    if (!HMAC(EVP_sha256(), key, COAP_DTLS_TICKET_KEY_LEN, &counter, 1,
+              &keys[offset], NULL))
+      return 0;
+  }
+  if (!SSL_CTX_set_tlsext_ticket_keys(ctx, keys, keys_len)) {
+    OPENSSL_cleanse(keys, sizeof(keys));
+    return 0;
+  }
+  OPENSSL_cleanse(keys, sizeof(keys));
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  return 1;
+}
+
 void *coap_dtls_new_context(struct coap_context_t *coap_context) {
   coap_openssl_context_t *context;
   (void)coap_context;
 
   context = (coap_openssl_context_t *)coap_malloc(sizeof(coap_openssl_context_t));
   if (context) {
-    uint8_t cookie_secret[32];
-
     memset(context, 0, sizeof(coap_openssl_context_t));
 
     /* Set up DTLS context */
@@ -721,20 +885,23 @@ void *coap_dtls_new_context(struct coap_context_t *coap_context) {
     SSL_CTX_set_app_data(context->dtls.ctx, &context->dtls);
     SSL_CTX_set_read_ahead(context->dtls.ctx, 1);
     coap_set_user_prefs(context->dtls.ctx);
-    memset(cookie_secret, 0, sizeof(cookie_secret));
-    if (!RAND_bytes(cookie_secret, (int)sizeof(cookie_secret))) {
-      if (dtls_log_level >= LOG_WARNING)
-        coap_log(LOG_WARNING,
-                 "Insufficient entropy for random cookie generation");
-      coap_prng(cookie_secret, sizeof(cookie_secret));
-    }
-    context->dtls.cookie_hmac = HMAC_CTX_new();
-    if (!HMAC_Init_ex(context->dtls.cookie_hmac, cookie_secret, (int)sizeof(cookie_secret), EVP_sha256(), NULL))
-      goto error;
     SSL_CTX_set_cookie_generate_cb(context->dtls.ctx, coap_dtls_generate_cookie);
     SSL_CTX_set_cookie_verify_cb(context->dtls.ctx, coap_dtls_verify_cookie);
     SSL_CTX_set_info_callback(context->dtls.ctx, coap_dtls_info_callback);
+    SSL_CTX_set_cert_verify_callback(context->dtls.ctx,
+                                     tls_cert_verify_call_back, NULL);
     SSL_CTX_set_options(context->dtls.ctx, SSL_OP_NO_QUERY_MTU);
+    if (!coap_set_ticket_key(context->dtls.ctx, default_ticket_key))
+      goto error;
+    /*
+     * A session whose client certificate was verified can only be resumed
+     * with a session id context, which is the same for all the contexts
+     * that share the ticket key.
+     */
+    if (!SSL_CTX_set_session_id_context(context->dtls.ctx,
+                                        coap_sid_ctx,
+                                        sizeof(coap_sid_ctx) - 1))
+      goto error;
     context->dtls.meth = BIO_meth_new(BIO_TYPE_DGRAM, "coapdgram");
     if (!context->dtls.meth)
       goto error;
@@ -756,7 +923,19 @@ void *coap_dtls_new_context(struct coap_context_t *coap_context) {
     SSL_CTX_set_app_data(context->tls.ctx, &context->tls);
     SSL_CTX_set_min_proto_version(context->tls.ctx, TLS1_VERSION);
     coap_set_user_prefs(context->tls.ctx);
+#if COAP_OPENSSL_KTLS
+    /* Have the kernel encrypt and decrypt the records where it can */
+    SSL_CTX_set_options(context->tls.ctx, SSL_OP_ENABLE_KTLS);
+#endif /* COAP_OPENSSL_KTLS */
     SSL_CTX_set_info_callback(context->tls.ctx, coap_dtls_info_callback);
+    SSL_CTX_set_cert_verify_callback(context->tls.ctx,
+                                     tls_cert_verify_call_back, NULL);
+    if (!coap_set_ticket_key(context->tls.ctx, default_ticket_key))
+      goto error;
+    if (!SSL_CTX_set_session_id_context(context->tls.ctx,
+                                        coap_sid_ctx,
+                                        sizeof(coap_sid_ctx) - 1))
+      goto error;
     context->tls.meth = BIO_meth_new(BIO_TYPE_SOCKET, "coapsock");
     if (!context->tls.meth)
       goto error;
@@ -776,13 +955,40 @@ error:
   return NULL;
 }
 
+/*
+ * Sets up the SSL that handles new incoming sessions to a server
+ *
+ * return 0 failed
+ *        1 passed
+ */
+static int
+setup_dtls_listener(coap_openssl_context_t *o_context) {
+  BIO *bio;
+
+  if (o_context->dtls.ssl)
+    return 1;
+  o_context->dtls.ssl = SSL_new(o_context->dtls.ctx);
+  if (!o_context->dtls.ssl)
+    return 0;
+  bio = BIO_new(o_context->dtls.meth);
+  if (!bio) {
+    SSL_free (o_context->dtls.ssl);
+    o_context->dtls.ssl = NULL;
+    return 0;
+  }
+  SSL_set_bio(o_context->dtls.ssl, bio, bio);
+  SSL_set_app_data(o_context->dtls.ssl, NULL);
+  SSL_set_options(o_context->dtls.ssl, SSL_OP_COOKIE_EXCHANGE);
+  SSL_set_mtu(o_context->dtls.ssl, COAP_DEFAULT_MTU);
+  return 1;
+}
+
 int
 coap_dtls_context_set_spsk(coap_context_t *c_context,
                               coap_dtls_spsk_t *setup_data
 ) {
   coap_openssl_context_t *o_context =
                            ((coap_openssl_context_t *)c_context->dtls_context);
-  BIO *bio;
 
   if (!setup_data || !o_context)
     return 0;
@@ -826,22 +1032,8 @@ coap_dtls_context_set_spsk(coap_context_t *c_context,
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
   }
 
-  if (!o_context->dtls.ssl) {
-    /* This is set up to handle new incoming sessions to a server */
-    o_context->dtls.ssl = SSL_new(o_context->dtls.ctx);
-    if (!o_context->dtls.ssl)
-      return 0;
-    bio = BIO_new(o_context->dtls.meth);
-    if (!bio) {
-      SSL_free (o_context->dtls.ssl);
-      o_context->dtls.ssl = NULL;
-      return 0;
-    }
-    SSL_set_bio(o_context->dtls.ssl, bio, bio);
-    SSL_set_app_data(o_context->dtls.ssl, NULL);
-    SSL_set_options(o_context->dtls.ssl, SSL_OP_COOKIE_EXCHANGE);
-    SSL_set_mtu(o_context->dtls.ssl, COAP_DEFAULT_MTU);
-  }
+  if (!setup_dtls_listener(o_context))
+    return 0;
   o_context->psk_pki_enabled |= IS_PSK;
   return 1;
 }
@@ -852,31 +1044,79 @@ coap_dtls_context_set_cpsk(coap_context_t *c_context,
 ) {
   coap_openssl_context_t *o_context =
                           ((coap_openssl_context_t *)c_context->dtls_context);
-  BIO *bio;
 
   if (!setup_data || !o_context)
     return 0;
 
-  if (!o_context->dtls.ssl) {
-    /* This is set up to handle new incoming sessions to a server */
-    o_context->dtls.ssl = SSL_new(o_context->dtls.ctx);
-    if (!o_context->dtls.ssl)
-      return 0;
-    bio = BIO_new(o_context->dtls.meth);
-    if (!bio) {
-      SSL_free (o_context->dtls.ssl);
-      o_context->dtls.ssl = NULL;
-      return 0;
-    }
-    SSL_set_bio(o_context->dtls.ssl, bio, bio);
-    SSL_set_app_data(o_context->dtls.ssl, NULL);
-    SSL_set_options(o_context->dtls.ssl, SSL_OP_COOKIE_EXCHANGE);
-    SSL_set_mtu(o_context->dtls.ssl, COAP_DEFAULT_MTU);
-  }
+  if (!setup_dtls_listener(o_context))
+    return 0;
   o_context->psk_pki_enabled |= IS_PSK;
   return 1;
 }
 
+int
+coap_dtls_context_share(coap_context_t *c_context, coap_context_t *from) {
+  coap_openssl_context_t *o_context =
+                          ((coap_openssl_context_t *)c_context->dtls_context);
+  coap_openssl_context_t *f_context =
+                          ((coap_openssl_context_t *)from->dtls_context);
+
+  if (!o_context || !f_context)
+    return 0;
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+  /* The SNI call-backs are handed the setup data of f_context */
+  coap_log(LOG_WARNING,
+           "coap_context_share_dtls: OpenSSL 1.1.1 or later is required\n");
+  return 0;
+#else /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+  /*
+   * The SSL_CTXs hold the loaded root CAs, PSK hint and ticket key, and
+   * are only looked at by the call-backs, which get everything else from
+   * the session's own context.
+   */
+  if (!SSL_CTX_up_ref(f_context->dtls.ctx))
+    return 0;
+  SSL_CTX_free(o_context->dtls.ctx);
+  o_context->dtls.ctx = f_context->dtls.ctx;
+#if !COAP_DISABLE_TCP
+  if (!SSL_CTX_up_ref(f_context->tls.ctx))
+    return 0;
+  SSL_CTX_free(o_context->tls.ctx);
+  o_context->tls.ctx = f_context->tls.ctx;
+#endif /* !COAP_DISABLE_TCP */
+  o_context->setup_data = f_context->setup_data;
+  o_context->psk_pki_enabled = f_context->psk_pki_enabled;
+
+  /* The listener has to be made again from the shared SSL_CTX */
+  if (o_context->dtls.ssl) {
+    SSL_free(o_context->dtls.ssl);
+    o_context->dtls.ssl = NULL;
+  }
+  if (f_context->dtls.ssl && !setup_dtls_listener(o_context))
+    return 0;
+  return 1;
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+}
+
+int
+coap_dtls_context_set_ticket_key(coap_context_t *c_context,
+                                 const uint8_t *key, size_t key_len
+) {
+  coap_openssl_context_t *o_context =
+                          ((coap_openssl_context_t *)c_context->dtls_context);
+
+  (void)key_len;
+  if (!o_context)
+    return 0;
+  if (!coap_set_ticket_key(o_context->dtls.ctx, key))
+    return 0;
+#if !COAP_DISABLE_TCP
+  if (!coap_set_ticket_key(o_context->tls.ctx, key))
+    return 0;
+#endif /* !COAP_DISABLE_TCP */
+  return 1;
+}
+
 static int
 map_key_type(int asn1_private_key_type
 ) {
@@ -1923,6 +2163,68 @@ tls_verify_call_back(int preverify_ok, X509_STORE_CTX *ctx) {
   return preverify_ok;
 }
 
+/*
+ * Called in place of X509_verify_cert() to verify the peer's certificate
+ * chain, so that a server can skip the chain of a client whose certificate
+ * it has verified recently (see coap_context_set_pki_cache()).
+ *
+ * return 1 verified
+ *        0 failed
+ */
+static int
+tls_cert_verify_call_back(X509_STORE_CTX *ctx, void *arg) {
+  SSL *ssl = X509_STORE_CTX_get_ex_data(ctx,
+                              SSL_get_ex_data_X509_STORE_CTX_idx());
+  coap_session_t *session = SSL_get_app_data(ssl);
+  X509 *x509 = X509_STORE_CTX_get0_cert(ctx);
+  const char *sni = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  uint8_t *der = NULL;
+  int length;
+  int ret;
+
+  (void)arg;
+  if (!session || session->type != COAP_SESSION_TYPE_SERVER || !x509)
+    return X509_verify_cert(ctx);
+  length = i2d_X509(x509, &der);
+  if (length <= 0)
+    return X509_verify_cert(ctx);
+
+  if (coap_pki_cache_lookup(session, der, length, sni)) {
+    coap_openssl_context_t *context =
+           ((coap_openssl_context_t *)session->context->dtls_context);
+    coap_dtls_pki_t *setup_data = &context->setup_data;
+
+    ret = 1;
+    /* Only the Client Cert - the rest of the chain has not been looked at */
+    if (setup_data->validate_cn_call_back) {
+      char *cn = get_san_or_cn_from_cert(x509);
+
+      if (!setup_data->validate_cn_call_back(cn, der, length, session,
+                                             0, 1,
+                                             setup_data->cn_call_back_arg)) {
+        X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_REJECTED);
+        ret = 0;
+      }
+      OPENSSL_free(cn);
+    }
+  }
+  else {
+    ret = X509_verify_cert(ctx);
+    /* Only cache a chain that verified with no allow_* overrides */
+    if (ret > 0 && X509_STORE_CTX_get_error(ctx) == X509_V_OK) {
+      int days;
+      int secs;
+
+      if (ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(x509)) &&
+          (days > 0 || (days == 0 && secs > 0)))
+        coap_pki_cache_add(session, der, length, sni,
+                           (unsigned long)days * 86400 + secs);
+    }
+  }
+  OPENSSL_free(der);
+  return ret;
+}
+
 #if OPENSSL_VERSION_NUMBER < 0x10101000L
 /*
  * During the SSL/TLS initial negotiations, tls_secret_call_back() is called so
@@ -1951,7 +2253,7 @@ tls_secret_call_back(SSL *ssl,
       session->context == NULL)
     return 0;
 
-  if ((session->psk_key) ||
+  if ((session->ext->psk_key) ||
       (session->context->spsk_setup_data.psk_info.key.s &&
        session->context->spsk_setup_data.psk_info.key.length)) {
     /* Is PSK being requested - if so, we need to change algorithms */
@@ -2001,9 +2303,9 @@ tls_secret_call_back(SSL *ssl,
     }
   }
   else {
-    if (session->psk_key) {
-      memcpy(secret, session->psk_key->s, session->psk_key->length);
-      *secretlen = session->psk_key->length;
+    if (session->ext->psk_key) {
+      memcpy(secret, session->ext->psk_key->s, session->ext->psk_key->length);
+      *secretlen = session->ext->psk_key->length;
     }
     else if (session->context->spsk_setup_data.psk_info.key.s &&
              session->context->spsk_setup_data.psk_info.key.length) {
@@ -2078,6 +2380,7 @@ tls_server_name_call_back(SSL *ssl,
         SSL_CTX_set_cookie_generate_cb(ctx, coap_dtls_generate_cookie);
         SSL_CTX_set_cookie_verify_cb(ctx, coap_dtls_verify_cookie);
         SSL_CTX_set_info_callback(ctx, coap_dtls_info_callback);
+        SSL_CTX_set_cert_verify_callback(ctx, tls_cert_verify_call_back, NULL);
         SSL_CTX_set_options(ctx, SSL_OP_NO_QUERY_MTU);
       }
 #if !COAP_DISABLE_TCP
@@ -2090,6 +2393,7 @@ tls_server_name_call_back(SSL *ssl,
         SSL_CTX_set_min_proto_version(ctx, TLS1_VERSION);
         coap_set_user_prefs(ctx);
         SSL_CTX_set_info_callback(ctx, coap_dtls_info_callback);
+        SSL_CTX_set_cert_verify_callback(ctx, tls_cert_verify_call_back, NULL);
         SSL_CTX_set_alpn_select_cb(ctx, server_alpn_callback, NULL);
       }
 #endif /* !COAP_DISABLE_TCP */
@@ -2266,7 +2570,7 @@ tls_client_hello_call_back(SSL *ssl,
   /*
    * See if PSK being requested
    */
-  if ((session->psk_key) ||
+  if ((session->ext->psk_key) ||
       (session->context->spsk_setup_data.psk_info.key.s &&
        session->context->spsk_setup_data.psk_info.key.length)) {
     size_t len = SSL_client_hello_get0_ciphers(ssl, &out);
@@ -2557,7 +2861,6 @@ coap_dtls_context_set_pki(coap_context_t *ctx,
 ) {
   coap_openssl_context_t *context =
                                 ((coap_openssl_context_t *)ctx->dtls_context);
-  BIO *bio;
   if (!setup_data)
     return 0;
   context->setup_data = *setup_data;
@@ -2638,22 +2941,8 @@ coap_dtls_context_set_pki(coap_context_t *ctx,
 #endif /* !COAP_DISABLE_TCP */
   }
 
-  if (!context->dtls.ssl) {
-    /* This is set up to handle new incoming sessions to a server */
-    context->dtls.ssl = SSL_new(context->dtls.ctx);
-    if (!context->dtls.ssl)
-      return 0;
-    bio = BIO_new(context->dtls.meth);
-    if (!bio) {
-      SSL_free (context->dtls.ssl);
-      context->dtls.ssl = NULL;
-      return 0;
-    }
-    SSL_set_bio(context->dtls.ssl, bio, bio);
-    SSL_set_app_data(context->dtls.ssl, NULL);
-    SSL_set_options(context->dtls.ssl, SSL_OP_COOKIE_EXCHANGE);
-    SSL_set_mtu(context->dtls.ssl, COAP_DEFAULT_MTU);
-  }
+  if (!setup_dtls_listener(context))
+    return 0;
   context->psk_pki_enabled |= IS_PKI;
   return 1;
 }
@@ -2701,8 +2990,6 @@ void coap_dtls_free_context(void *handle) {
     SSL_free(context->dtls.ssl);
   if (context->dtls.ctx)
     SSL_CTX_free(context->dtls.ctx);
-  if (context->dtls.cookie_hmac)
-    HMAC_CTX_free(context->dtls.cookie_hmac);
   if (context->dtls.meth)
     BIO_meth_free(context->dtls.meth);
   if (context->dtls.bio_addr)
@@ -2795,7 +3082,7 @@ setup_client_ssl_session(coap_session_t *session, SSL *ssl
                     ((coap_openssl_context_t *)session->context->dtls_context);
 
   if (context->psk_pki_enabled & IS_PSK) {
-    coap_dtls_cpsk_t *setup_data = &session->cpsk_setup_data;
+    coap_dtls_cpsk_t *setup_data = &session->ext->cpsk_setup_data;
 
     /* Issue SNI if requested */
     if (setup_data->client_sni &&
@@ -2863,6 +3150,62 @@ setup_client_ssl_session(coap_session_t *session, SSL *ssl
   return 1;
 }
 
+/* Tries to resume the last session with this server */
+static void
+coap_set_resume_session(coap_session_t *session, SSL *ssl) {
+  const coap_tls_resume_t *resume = coap_tls_resume_find(session);
+  const unsigned char *p;
+  SSL_SESSION *sess;
+
+  if (!resume)
+    return;
+  p = resume->data;
+  sess = d2i_SSL_SESSION(NULL, &p, (long)resume->length);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  /*
+   * A TLS1.3 ticket is offered as a PSK identity, which the server's PSK
+   * callback would take as an external PSK identity and fail.
+   */
+  if (sess && SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION &&
+      (((coap_openssl_context_t *)session->context->dtls_context)->
+        psk_pki_enabled & IS_PSK)) {
+    SSL_SESSION_free(sess);
+    coap_tls_resume_forget(session);
+    return;
+  }
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10101000L */
+  if (!sess || !SSL_set_session(ssl, sess))
+    coap_tls_resume_forget(session);
+  if (sess)
+    SSL_SESSION_free(sess);
+}
+
+/* Saves the state of an established client session for resumption */
+static void
+coap_save_resume_session(coap_session_t *session, SSL *ssl) {
+  SSL_SESSION *sess;
+  unsigned char *data = NULL;
+  int len;
+
+  if (session->type != COAP_SESSION_TYPE_CLIENT || SSL_in_init(ssl))
+    return;
+  sess = SSL_get1_session(ssl);
+  if (!sess)
+    return;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (SSL_SESSION_is_resumable(sess)) {
+#else /* OPENSSL_VERSION_NUMBER < 0x10101000L */
+  {
+#endif /* OPENSSL_VERSION_NUMBER < 0x10101000L */
+    len = i2d_SSL_SESSION(sess, &data);
+    if (len > 0) {
+      coap_tls_resume_save(session, data, (size_t)len);
+      OPENSSL_free(data);
+    }
+  }
+  SSL_SESSION_free(sess);
+}
+
 void *coap_dtls_new_client_session(coap_session_t *session) {
   BIO *bio = NULL;
   SSL *ssl = NULL;
@@ -2886,6 +3229,7 @@ void *coap_dtls_new_client_session(coap_session_t *session) {
 
   if (!setup_client_ssl_session(session, ssl))
     goto error;
+  coap_set_resume_session(session, ssl);
 
   session->dtls_timeout_count = 0;
 
@@ -2916,6 +3260,7 @@ void coap_dtls_session_update_mtu(coap_session_t *session) {
 void coap_dtls_free_session(coap_session_t *session) {
   SSL *ssl = (SSL *)session->tls;
   if (ssl) {
+    coap_save_resume_session(session, ssl);
     if (!SSL_in_init(ssl) && !(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN)) {
       int r = SSL_shutdown(ssl);
       if (r == 0) r = SSL_shutdown(ssl);
@@ -2994,6 +3339,10 @@ void coap_dtls_handle_timeout(coap_session_t *session) {
   }
 }
 
+int coap_dtls_is_cookie_stateless(void) {
+  return 1;
+}
+
 int coap_dtls_hello(coap_session_t *session,
   const uint8_t *data, size_t data_len) {
   coap_dtls_context_t *dtls = &((coap_openssl_context_t *)session->context->dtls_context)->dtls;
@@ -3166,12 +3515,13 @@ void *coap_tls_new_client_session(coap_session_t *session, int *connected) {
   bio = BIO_new(tls->meth);
   if (!bio)
     goto error;
-  BIO_set_data(bio, session);
+  ((coap_sock_data *)BIO_get_data(bio))->session = session;
   SSL_set_bio(ssl, bio, bio);
   SSL_set_app_data(ssl, session);
 
   if (!setup_client_ssl_session(session, ssl))
     return 0;
+  coap_set_resume_session(session, ssl);
 
   r = SSL_connect(ssl);
   if (r == -1) {
@@ -3182,13 +3532,13 @@ void *coap_tls_new_client_session(coap_session_t *session, int *connected) {
       session->sock.flags |= COAP_SOCKET_WANT_READ;
     if (ret == SSL_ERROR_WANT_WRITE) {
       session->sock.flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
       coap_epoll_ctl_mod(&session->sock,
                          EPOLLOUT |
                           ((session->sock.flags & COAP_SOCKET_WANT_READ) ?
                            EPOLLIN : 0),
                          __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
     }
   }
 
@@ -3218,7 +3568,7 @@ void *coap_tls_new_server_session(coap_session_t *session, int *connected) {
   bio = BIO_new(tls->meth);
   if (!bio)
     goto error;
-  BIO_set_data(bio, session);
+  ((coap_sock_data *)BIO_get_data(bio))->session = session;
   SSL_set_bio(ssl, bio, bio);
   SSL_set_app_data(ssl, session);
 
@@ -3240,13 +3590,13 @@ void *coap_tls_new_server_session(coap_session_t *session, int *connected) {
       session->sock.flags |= COAP_SOCKET_WANT_READ;
     if (err == SSL_ERROR_WANT_WRITE) {
       session->sock.flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
       coap_epoll_ctl_mod(&session->sock,
                          EPOLLOUT |
                           ((session->sock.flags & COAP_SOCKET_WANT_READ) ?
                            EPOLLIN : 0),
                          __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
     }
   }
 
@@ -3266,6 +3616,7 @@ error:
 void coap_tls_free_session(coap_session_t *session) {
   SSL *ssl = (SSL *)session->tls;
   if (ssl) {
+    coap_save_resume_session(session, ssl);
     if (!SSL_in_init(ssl) && !(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN)) {
       int r = SSL_shutdown(ssl);
       if (r == 0) r = SSL_shutdown(ssl);
@@ -3287,6 +3638,11 @@ ssize_t coap_tls_write(coap_session_t *session,
   if (ssl == NULL)
     return -1;
 
+  if (coap_tls_is_ktls_send(session)) {
+    /* The kernel makes the records of what is written to the socket */
+    return coap_socket_write(&session->sock, data, data_len);
+  }
+
   in_init = !SSL_is_init_finished(ssl);
   session->dtls_event = -1;
   r = SSL_write(ssl, data, (int)data_len);
@@ -3304,13 +3660,13 @@ ssize_t coap_tls_write(coap_session_t *session,
         session->sock.flags |= COAP_SOCKET_WANT_READ;
       if (err == SSL_ERROR_WANT_WRITE) {
         session->sock.flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
         coap_epoll_ctl_mod(&session->sock,
                            EPOLLOUT |
                             ((session->sock.flags & COAP_SOCKET_WANT_READ) ?
                              EPOLLIN : 0),
                            __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
       }
       r = 0;
     } else {
@@ -3369,13 +3725,13 @@ ssize_t coap_tls_read(coap_session_t *session,
         session->sock.flags |= COAP_SOCKET_WANT_READ;
       if (err == SSL_ERROR_WANT_WRITE) {
         session->sock.flags |= COAP_SOCKET_WANT_WRITE;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
         coap_epoll_ctl_mod(&session->sock,
                            EPOLLOUT |
                             ((session->sock.flags & COAP_SOCKET_WANT_READ) ?
                              EPOLLIN : 0),
                            __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
       }
       r = 0;
     } else {
@@ -3405,6 +3761,18 @@ ssize_t coap_tls_read(coap_session_t *session,
 
   return r;
 }
+
+int coap_tls_is_ktls_send(coap_session_t *session) {
+#if COAP_OPENSSL_KTLS
+  SSL *ssl = (SSL *)session->tls;
+
+  return ssl && SSL_is_init_finished(ssl) &&
+         BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else /* ! COAP_OPENSSL_KTLS */
+  (void)session;
+  return 0;
+#endif /* ! COAP_OPENSSL_KTLS */
+}
 #endif /* !COAP_DISABLE_TCP */
 
 coap_digest_ctx_t *
@@ -3438,6 +3806,75 @@ coap_digest_final(coap_digest_ctx_t *digest_ctx,
   return ret;
 }
 
+/*
+ * AES-CCM needs the nonce and tag lengths, and then the total length of
+ * the input, before the AAD and the input.
+ */
+static EVP_CIPHER_CTX *
+coap_crypto_ccm_init(const uint8_t *key, const uint8_t *nonce,
+                     const uint8_t *tag, int encrypt) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  /* EVP_CIPHER_CTX_ctrl() does not take a const tag */
+  uint8_t tag_copy[COAP_OSCORE_TAG_LEN];
+
+  if (!ctx)
+    return NULL;
+  if (tag)
+    memcpy(tag_copy, tag, COAP_OSCORE_TAG_LEN);
+  if (!EVP_CipherInit_ex(ctx, EVP_aes_128_ccm(), NULL, NULL, NULL, encrypt) ||
+      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN,
+                           COAP_OSCORE_NONCE_LEN, NULL) ||
+      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, COAP_OSCORE_TAG_LEN,
+                           tag ? tag_copy : NULL) ||
+      !EVP_CipherInit_ex(ctx, NULL, NULL, key, nonce, encrypt)) {
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+int
+coap_crypto_aead_encrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  EVP_CIPHER_CTX *ctx = coap_crypto_ccm_init(key, nonce, NULL, 1);
+  int len;
+  int ok;
+
+  if (!ctx)
+    return 0;
+  ok = EVP_EncryptUpdate(ctx, NULL, &len, NULL, (int)in_len) &&
+       (!aad_len || EVP_EncryptUpdate(ctx, NULL, &len, aad, (int)aad_len)) &&
+       EVP_EncryptUpdate(ctx, out, &len, in, (int)in_len) &&
+       EVP_EncryptFinal_ex(ctx, out + len, &len) &&
+       EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, COAP_OSCORE_TAG_LEN,
+                           out + in_len);
+  EVP_CIPHER_CTX_free(ctx);
+  return ok;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len,
+                         const uint8_t *in, size_t in_len, uint8_t *out) {
+  EVP_CIPHER_CTX *ctx;
+  size_t out_len = in_len - COAP_OSCORE_TAG_LEN;
+  int len;
+  int ok;
+
+  if (in_len < COAP_OSCORE_TAG_LEN)
+    return 0;
+  ctx = coap_crypto_ccm_init(key, nonce, in + out_len, 0);
+  if (!ctx)
+    return 0;
+  /* The tag is checked by the update of the input */
+  ok = EVP_DecryptUpdate(ctx, NULL, &len, NULL, (int)out_len) &&
+       (!aad_len || EVP_DecryptUpdate(ctx, NULL, &len, aad, (int)aad_len)) &&
+       EVP_DecryptUpdate(ctx, out, &len, in, (int)out_len) > 0;
+  EVP_CIPHER_CTX_free(ctx);
+  return ok;
+}
+
 #else /* !HAVE_OPENSSL */
 
 #ifdef __clang__
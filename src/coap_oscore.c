@@ -0,0 +1,1158 @@
+/* coap_oscore.c -- Object Security for Constrained RESTful Environments
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * OSCORE (RFC 8613) protects a request and its responses end to end, so
+ * that proxies on the way can forward them without being able to read or
+ * change them.  coap_send() hands every PDU to coap_oscore_send_pdu(),
+ * which swaps the requests of a session set up with
+ * coap_session_set_oscore(), and the responses to requests that came in
+ * protected, for a POST (or FETCH) or 2.04 (or 2.05) that carries the
+ * code, the Class E options and the payload encrypted, and only the Class
+ * U options that a proxy needs in the clear.  handle_request() and
+ * coap_dispatch() turn what they receive back into the plain PDU in place,
+ * so that the rest of the library never sees the difference.
+ *
+ * The security contexts are derived once, when they are added, and are
+ * kept in a hash table on the context by Recipient ID and ID Context, the
+ * kid and kid context that a request names its context by.  Each holds
+ * the replay window of the requests received with it: the highest Partial
+ * IV received and a bitmap of which of the ones below it have been seen.
+ *
+ * The responses are protected with the nonce of the request (or a Partial
+ * IV of their own, for notifications), so each session keeps a list of its
+ * exchanges, by token: the security context and Partial IV of the request
+ * and, for a client, the plain request to give to the response handler.
+ */
+
+/* AES-CCM-16-64-128, the only AEAD algorithm */
+#define COAP_OSCORE_ALG 10
+/* The longest Partial IV, and so the highest Sender Sequence Number */
+#define COAP_OSCORE_MAX_PIV_LEN 5
+#define COAP_OSCORE_MAX_SEQ ((UINT64_C(1) << 40) - 1)
+#define COAP_OSCORE_MAX_ID_CONTEXT_LEN 255
+
+/* The flag byte of the OSCORE option */
+#define COAP_OSCORE_FLAG_N 0x07
+#define COAP_OSCORE_FLAG_K 0x08
+#define COAP_OSCORE_FLAG_H 0x10
+#define COAP_OSCORE_FLAG_RESERVED 0xe0
+
+/* Room for the HKDF info, the AAD and the OSCORE option value */
+#define COAP_OSCORE_INFO_SIZE (1 + 1 + COAP_OSCORE_MAX_ID_LEN + 3 + \
+                               COAP_OSCORE_MAX_ID_CONTEXT_LEN + 1 + 4 + 1 + 1)
+#define COAP_OSCORE_EXT_AAD_SIZE (4 + 1 + COAP_OSCORE_MAX_ID_LEN + 1 + \
+                                  COAP_OSCORE_MAX_PIV_LEN + 1)
+#define COAP_OSCORE_AAD_SIZE (1 + 1 + 8 + 1 + 1 + COAP_OSCORE_EXT_AAD_SIZE)
+#define COAP_OSCORE_OPTION_SIZE (1 + COAP_OSCORE_MAX_PIV_LEN + 1 + \
+                                 COAP_OSCORE_MAX_ID_CONTEXT_LEN + \
+                                 COAP_OSCORE_MAX_ID_LEN)
+
+struct coap_oscore_ctx_t {
+  UT_hash_handle hh;           /* context->oscore, by key */
+  unsigned int ref;            /* the store, sessions and exchanges */
+  uint8_t sender_id[COAP_OSCORE_MAX_ID_LEN];
+  uint8_t sender_id_len;
+  uint8_t recipient_id[COAP_OSCORE_MAX_ID_LEN];
+  uint8_t recipient_id_len;
+  uint8_t sender_key[COAP_OSCORE_KEY_LEN];
+  uint8_t recipient_key[COAP_OSCORE_KEY_LEN];
+  uint8_t common_iv[COAP_OSCORE_NONCE_LEN];
+  uint64_t sender_seq;         /* next Sender Sequence Number */
+  uint64_t replay_high;        /* highest Partial IV received */
+  uint64_t replay_seen;        /* bit n set if replay_high - n received */
+  uint8_t replay_valid;        /* 1 once a request has been received */
+  unsigned int replay_window;
+  const uint8_t *id_context;   /* within key */
+  size_t id_context_len;
+  uint8_t *key;                /* Recipient ID length, Recipient ID and ID
+                                  Context, follows in the same block */
+  size_t key_len;
+};
+
+struct coap_oscore_assoc_t {
+  struct coap_oscore_assoc_t *next;
+  coap_oscore_ctx_t *osc;
+  uint8_t token[8];
+  uint8_t token_length;
+  uint8_t observe;             /* 1 if an observe registration */
+  uint8_t piv[COAP_OSCORE_MAX_PIV_LEN]; /* Partial IV of the request */
+  uint8_t piv_len;
+  uint8_t notify_valid;        /* client: 1 once a notification came in */
+  uint64_t notify_piv;         /* client: its highest Partial IV */
+  coap_pdu_t *request;         /* client: the plain request, else NULL */
+};
+
+/* The fields of a received OSCORE option */
+typedef struct coap_oscore_option_t {
+  const uint8_t *piv;
+  size_t piv_len;
+  const uint8_t *kid;
+  size_t kid_len;
+  int has_kid;
+  const uint8_t *kid_context;
+  size_t kid_context_len;
+} coap_oscore_option_t;
+
+int
+coap_oscore_is_supported(void) {
+#if defined(HAVE_OPENSSL) || defined(HAVE_LIBGNUTLS) || defined(HAVE_MBEDTLS)
+  return 1;
+#else /* ! HAVE_OPENSSL && ! HAVE_LIBGNUTLS && ! HAVE_MBEDTLS */
+  return 0;
+#endif /* ! HAVE_OPENSSL && ! HAVE_LIBGNUTLS && ! HAVE_MBEDTLS */
+}
+
+static uint8_t *
+coap_oscore_cbor_head(uint8_t *p, uint8_t major, size_t value) {
+  if (value < 24) {
+    *p++ = major | (uint8_t)value;
+  } else if (value < 256) {
+    *p++ = major | 24;
+    *p++ = (uint8_t)value;
+  } else {
+    *p++ = major | 25;
+    *p++ = (uint8_t)(value >> 8);
+    *p++ = (uint8_t)value;
+  }
+  return p;
+}
+
+static uint8_t *
+coap_oscore_cbor_bytes(uint8_t *p, const uint8_t *s, size_t len) {
+  p = coap_oscore_cbor_head(p, 0x40, len);
+  if (len)
+    memcpy(p, s, len);
+  return p + len;
+}
+
+/*
+ * HMAC-SHA-256 (RFC 2104) of @p data with @p key.
+ */
+static int
+coap_oscore_hmac(const uint8_t *key, size_t key_len,
+                 const uint8_t *data, size_t data_len, coap_digest_t *mac) {
+  uint8_t pad[64];
+  coap_digest_t digest;
+  coap_digest_ctx_t *dctx;
+  size_t i;
+  int ok = 0;
+
+  memset(pad, 0, sizeof(pad));
+  if (key_len > sizeof(pad)) {
+    dctx = coap_digest_setup();
+    if (!dctx)
+      return 0;
+    if (!coap_digest_update(dctx, key, key_len)) {
+      coap_digest_free(dctx);
+      return 0;
+    }
+    if (!coap_digest_final(dctx, &digest))
+      return 0;
+    memcpy(pad, digest.key, sizeof(digest.key));
+  } else if (key_len) {
+    memcpy(pad, key, key_len);
+  }
+
+  for (i = 0; i < sizeof(pad); i++)
+    pad[i] ^= 0x36;
+  dctx = coap_digest_setup();
+  if (!dctx)
+    goto finish;
+  if (!coap_digest_update(dctx, pad, sizeof(pad)) ||
+      !coap_digest_update(dctx, data, data_len)) {
+    coap_digest_free(dctx);
+    goto finish;
+  }
+  if (!coap_digest_final(dctx, &digest))
+    goto finish;
+
+  for (i = 0; i < sizeof(pad); i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+  dctx = coap_digest_setup();
+  if (!dctx)
+    goto finish;
+  if (!coap_digest_update(dctx, pad, sizeof(pad)) ||
+      !coap_digest_update(dctx, digest.key, sizeof(digest.key))) {
+    coap_digest_free(dctx);
+    goto finish;
+  }
+  ok = coap_digest_final(dctx, mac);
+
+finish:
+  memset(pad, 0, sizeof(pad));
+  return ok;
+}
+
+/*
+ * HKDF-Expand (RFC 5869) of the key or IV for @p id, which as no more
+ * than 32 bytes are needed is the first block truncated.
+ */
+static int
+coap_oscore_derive(const coap_digest_t *prk, const uint8_t *id, size_t id_len,
+                   const coap_bin_const_t *id_context, int is_key,
+                   uint8_t *out, size_t out_len) {
+  uint8_t info[COAP_OSCORE_INFO_SIZE];
+  uint8_t *p = info;
+  coap_digest_t okm;
+
+  /* info = [ id, id_context, alg_aead, type, L ] */
+  *p++ = 0x85;
+  p = coap_oscore_cbor_bytes(p, id, id_len);
+  if (id_context->length)
+    p = coap_oscore_cbor_bytes(p, id_context->s, id_context->length);
+  else
+    *p++ = 0xf6;
+  *p++ = COAP_OSCORE_ALG;
+  if (is_key) {
+    *p++ = 0x63;
+    memcpy(p, "Key", 3);
+    p += 3;
+  } else {
+    *p++ = 0x62;
+    memcpy(p, "IV", 2);
+    p += 2;
+  }
+  p = coap_oscore_cbor_head(p, 0x00, out_len);
+  /* T(1) = HMAC(PRK, info | 0x01) */
+  *p++ = 0x01;
+  if (!coap_oscore_hmac(prk->key, sizeof(prk->key), info, p - info, &okm))
+    return 0;
+  memcpy(out, okm.key, out_len);
+  memset(&okm, 0, sizeof(okm));
+  return 1;
+}
+
+static void
+coap_oscore_nonce(const coap_oscore_ctx_t *osc,
+                  const uint8_t *id, size_t id_len,
+                  const uint8_t *piv, size_t piv_len, uint8_t *nonce) {
+  size_t i;
+
+  /* Length of the ID, the ID and the Partial IV, both left-padded */
+  memset(nonce, 0, COAP_OSCORE_NONCE_LEN);
+  nonce[0] = (uint8_t)id_len;
+  memcpy(&nonce[1 + COAP_OSCORE_MAX_ID_LEN - id_len], id, id_len);
+  memcpy(&nonce[COAP_OSCORE_NONCE_LEN - piv_len], piv, piv_len);
+  for (i = 0; i < COAP_OSCORE_NONCE_LEN; i++)
+    nonce[i] ^= osc->common_iv[i];
+}
+
+/*
+ * The AAD, the Enc_structure around the external_aad, which always names
+ * the request by its kid and Partial IV.
+ */
+static size_t
+coap_oscore_aad(const uint8_t *kid, size_t kid_len,
+                const uint8_t *piv, size_t piv_len, uint8_t *aad) {
+  uint8_t ext[COAP_OSCORE_EXT_AAD_SIZE];
+  uint8_t *p = ext;
+  uint8_t *q = aad;
+
+  /* [ oscore_version, [ alg_aead ], request_kid, request_piv, options ] */
+  *p++ = 0x85;
+  *p++ = 0x01;
+  *p++ = 0x81;
+  *p++ = COAP_OSCORE_ALG;
+  p = coap_oscore_cbor_bytes(p, kid, kid_len);
+  p = coap_oscore_cbor_bytes(p, piv, piv_len);
+  *p++ = 0x40;
+
+  /* [ "Encrypt0", h'', external_aad ] */
+  *q++ = 0x83;
+  *q++ = 0x68;
+  memcpy(q, "Encrypt0", 8);
+  q += 8;
+  *q++ = 0x40;
+  q = coap_oscore_cbor_bytes(q, ext, p - ext);
+  return q - aad;
+}
+
+/*
+ * Takes the next Sender Sequence Number of @p osc as a Partial IV.
+ */
+static size_t
+coap_oscore_next_piv(coap_oscore_ctx_t *osc, uint8_t *piv) {
+  uint64_t seq;
+  size_t len = 1;
+  size_t i;
+
+  if (osc->sender_seq > COAP_OSCORE_MAX_SEQ) {
+    coap_log(LOG_WARNING, "oscore: Sender Sequence Numbers used up\n");
+    return 0;
+  }
+  seq = osc->sender_seq++;
+  while (len < COAP_OSCORE_MAX_PIV_LEN && (seq >> (8 * len)))
+    len++;
+  for (i = 0; i < len; i++)
+    piv[len - 1 - i] = (uint8_t)(seq >> (8 * i));
+  return len;
+}
+
+static int
+coap_oscore_parse_option(coap_opt_t *option, coap_oscore_option_t *out) {
+  const uint8_t *p = coap_opt_value(option);
+  size_t len = coap_opt_length(option);
+  uint8_t flags;
+
+  memset(out, 0, sizeof(*out));
+  if (len == 0)
+    return 1;
+  flags = *p++;
+  len--;
+  if ((flags & COAP_OSCORE_FLAG_RESERVED) ||
+      (flags & COAP_OSCORE_FLAG_N) > COAP_OSCORE_MAX_PIV_LEN)
+    return 0;
+  out->piv_len = flags & COAP_OSCORE_FLAG_N;
+  if (len < out->piv_len)
+    return 0;
+  out->piv = p;
+  p += out->piv_len;
+  len -= out->piv_len;
+  if (flags & COAP_OSCORE_FLAG_H) {
+    if (len < 1 || len - 1 < *p)
+      return 0;
+    out->kid_context_len = *p++;
+    out->kid_context = p;
+    p += out->kid_context_len;
+    len -= 1 + out->kid_context_len;
+  }
+  if (flags & COAP_OSCORE_FLAG_K) {
+    if (len > COAP_OSCORE_MAX_ID_LEN)
+      return 0;
+    out->has_kid = 1;
+    out->kid = p;
+    out->kid_len = len;
+  } else if (len) {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * The key of a security context in the store.
+ */
+static size_t
+coap_oscore_key(const uint8_t *rid, size_t rid_len,
+                const uint8_t *id_context, size_t id_context_len,
+                uint8_t *key) {
+  key[0] = (uint8_t)rid_len;
+  if (rid_len)
+    memcpy(&key[1], rid, rid_len);
+  if (id_context_len)
+    memcpy(&key[1 + rid_len], id_context, id_context_len);
+  return 1 + rid_len + id_context_len;
+}
+
+static coap_oscore_ctx_t *
+coap_oscore_find(coap_context_t *context,
+                 const uint8_t *rid, size_t rid_len,
+                 const uint8_t *id_context, size_t id_context_len) {
+  uint8_t key[1 + COAP_OSCORE_MAX_ID_LEN + COAP_OSCORE_MAX_ID_CONTEXT_LEN];
+  coap_oscore_ctx_t *osc;
+  size_t key_len;
+
+  if (rid_len > COAP_OSCORE_MAX_ID_LEN ||
+      id_context_len > COAP_OSCORE_MAX_ID_CONTEXT_LEN)
+    return NULL;
+  key_len = coap_oscore_key(rid, rid_len, id_context, id_context_len, key);
+  HASH_FIND(hh, context->oscore, key, key_len, osc);
+  return osc;
+}
+
+static void
+coap_oscore_release(coap_oscore_ctx_t *osc) {
+  if (osc && --osc->ref == 0) {
+    size_t len = sizeof(coap_oscore_ctx_t) + osc->key_len;
+
+    /* Do not leave the keys lying around */
+    memset(osc, 0, len);
+    coap_free_type(COAP_STRING, osc);
+  }
+}
+
+int
+coap_context_add_oscore(coap_context_t *context,
+                        const coap_oscore_conf_t *conf) {
+  coap_oscore_ctx_t *osc;
+  coap_digest_t prk;
+  size_t key_len;
+  int ok;
+
+  if (!context || !conf)
+    return 0;
+  if (!coap_oscore_is_supported()) {
+    coap_log(LOG_WARNING, "coap_context_add_oscore: OSCORE not supported\n");
+    return 0;
+  }
+  if (conf->master_secret.length < 16 ||
+      conf->sender_id.length > COAP_OSCORE_MAX_ID_LEN ||
+      conf->recipient_id.length > COAP_OSCORE_MAX_ID_LEN ||
+      conf->id_context.length > COAP_OSCORE_MAX_ID_CONTEXT_LEN ||
+      conf->replay_window > 64 || conf->sender_seq > COAP_OSCORE_MAX_SEQ) {
+    coap_log(LOG_WARNING, "coap_context_add_oscore: invalid parameters\n");
+    return 0;
+  }
+  if (coap_oscore_find(context, conf->recipient_id.s,
+                       conf->recipient_id.length, conf->id_context.s,
+                       conf->id_context.length)) {
+    coap_log(LOG_WARNING, "coap_context_add_oscore: already added\n");
+    return 0;
+  }
+
+  key_len = 1 + conf->recipient_id.length + conf->id_context.length;
+  osc = coap_malloc_type(COAP_STRING, sizeof(coap_oscore_ctx_t) + key_len);
+  if (!osc)
+    return 0;
+  memset(osc, 0, sizeof(coap_oscore_ctx_t));
+  osc->ref = 1;
+  osc->key = (uint8_t *)(osc + 1);
+  osc->key_len = coap_oscore_key(conf->recipient_id.s,
+                                 conf->recipient_id.length,
+                                 conf->id_context.s, conf->id_context.length,
+                                 osc->key);
+  osc->id_context = osc->key + 1 + conf->recipient_id.length;
+  osc->id_context_len = conf->id_context.length;
+  osc->sender_id_len = (uint8_t)conf->sender_id.length;
+  if (osc->sender_id_len)
+    memcpy(osc->sender_id, conf->sender_id.s, osc->sender_id_len);
+  osc->recipient_id_len = (uint8_t)conf->recipient_id.length;
+  if (osc->recipient_id_len)
+    memcpy(osc->recipient_id, conf->recipient_id.s, osc->recipient_id_len);
+  osc->sender_seq = conf->sender_seq;
+  osc->replay_window = conf->replay_window ?
+                       conf->replay_window : COAP_OSCORE_DEFAULT_REPLAY_WINDOW;
+
+  /* HKDF-Extract, then the keys and Common IV */
+  ok = coap_oscore_hmac(conf->master_salt.s, conf->master_salt.length,
+                        conf->master_secret.s, conf->master_secret.length,
+                        &prk) &&
+       coap_oscore_derive(&prk, osc->sender_id, osc->sender_id_len,
+                          &conf->id_context, 1, osc->sender_key,
+                          COAP_OSCORE_KEY_LEN) &&
+       coap_oscore_derive(&prk, osc->recipient_id, osc->recipient_id_len,
+                          &conf->id_context, 1, osc->recipient_key,
+                          COAP_OSCORE_KEY_LEN) &&
+       coap_oscore_derive(&prk, NULL, 0, &conf->id_context, 0,
+                          osc->common_iv, COAP_OSCORE_NONCE_LEN);
+  memset(&prk, 0, sizeof(prk));
+  if (!ok) {
+    coap_oscore_release(osc);
+    return 0;
+  }
+
+  /* The OSCORE option is critical, so must be known to be accepted */
+  coap_register_option(context, COAP_OPTION_OSCORE);
+  HASH_ADD_KEYPTR(hh, context->oscore, osc->key, osc->key_len, osc);
+  return 1;
+}
+
+int
+coap_context_remove_oscore(coap_context_t *context,
+                           const coap_bin_const_t *recipient_id,
+                           const coap_bin_const_t *id_context) {
+  coap_oscore_ctx_t *osc;
+
+  if (!context || !recipient_id)
+    return 0;
+  osc = coap_oscore_find(context, recipient_id->s, recipient_id->length,
+                         id_context ? id_context->s : NULL,
+                         id_context ? id_context->length : 0);
+  if (!osc)
+    return 0;
+  HASH_DELETE(hh, context->oscore, osc);
+  coap_oscore_release(osc);
+  return 1;
+}
+
+int
+coap_session_set_oscore(coap_session_t *session,
+                        const coap_bin_const_t *recipient_id,
+                        const coap_bin_const_t *id_context) {
+  coap_oscore_ctx_t *osc = NULL;
+
+  if (!session)
+    return 0;
+  if (recipient_id) {
+    osc = coap_oscore_find(session->context, recipient_id->s,
+                           recipient_id->length,
+                           id_context ? id_context->s : NULL,
+                           id_context ? id_context->length : 0);
+    if (!osc) {
+      coap_log(LOG_WARNING, "coap_session_set_oscore: "
+                            "security context not found\n");
+      return 0;
+    }
+    osc->ref++;
+  }
+  coap_oscore_release(session->oscore);
+  session->oscore = osc;
+  return 1;
+}
+
+/*
+ * Finds the exchange of @p session with @p token, of a client if
+ * @p client, else of a server.
+ */
+static coap_oscore_assoc_t *
+coap_oscore_assoc_find(coap_session_t *session, const uint8_t *token,
+                       size_t token_length, int client) {
+  coap_oscore_assoc_t *assoc;
+
+  LL_FOREACH(session->oscore_assoc, assoc) {
+    if ((assoc->request != NULL) == client &&
+        assoc->token_length == token_length &&
+        memcmp(assoc->token, token, token_length) == 0)
+      return assoc;
+  }
+  return NULL;
+}
+
+static void
+coap_oscore_assoc_free(coap_oscore_assoc_t *assoc) {
+  coap_oscore_release(assoc->osc);
+  coap_delete_pdu(assoc->request);
+  coap_free_type(COAP_STRING, assoc);
+}
+
+static void
+coap_oscore_assoc_remove(coap_session_t *session, coap_oscore_assoc_t *assoc) {
+  LL_DELETE(session->oscore_assoc, assoc);
+  coap_oscore_assoc_free(assoc);
+}
+
+/*
+ * Adds an exchange for @p token, replacing any earlier one with the same
+ * token.  A client makes room by dropping its oldest exchange that is not
+ * observing; a server fails instead, as a response to a request that was
+ * forgotten would otherwise go out in the clear.
+ */
+static coap_oscore_assoc_t *
+coap_oscore_assoc_new(coap_session_t *session, coap_oscore_ctx_t *osc,
+                      coap_pdu_t *pdu, const uint8_t *piv,
+                      size_t piv_len, int client) {
+  coap_oscore_assoc_t *assoc;
+  coap_oscore_assoc_t *oldest = NULL;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  size_t count = 0;
+
+  assoc = coap_oscore_assoc_find(session, pdu->token, pdu->token_length,
+                                 client);
+  if (assoc) {
+    coap_oscore_assoc_remove(session, assoc);
+  } else {
+    LL_FOREACH(session->oscore_assoc, assoc) {
+      if ((assoc->request != NULL) != client)
+        continue;
+      count++;
+      if (!oldest && !assoc->observe)
+        oldest = assoc;
+    }
+    if (count >= COAP_OSCORE_MAX_EXCHANGES) {
+      if (!client || !oldest) {
+        coap_log(LOG_WARNING, "oscore: too many exchanges\n");
+        return NULL;
+      }
+      coap_oscore_assoc_remove(session, oldest);
+    }
+  }
+
+  assoc = coap_malloc_type(COAP_STRING, sizeof(coap_oscore_assoc_t));
+  if (!assoc)
+    return NULL;
+  memset(assoc, 0, sizeof(coap_oscore_assoc_t));
+  assoc->osc = osc;
+  osc->ref++;
+  assoc->token_length = pdu->token_length;
+  if (pdu->token_length)
+    memcpy(assoc->token, pdu->token, pdu->token_length);
+  assoc->piv_len = (uint8_t)piv_len;
+  memcpy(assoc->piv, piv, piv_len);
+  option = coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter);
+  assoc->observe = option &&
+                   coap_decode_var_bytes(coap_opt_value(option),
+                                   coap_opt_length(option)) == COAP_OBSERVE_ESTABLISH;
+  LL_APPEND(session->oscore_assoc, assoc);
+  return assoc;
+}
+
+/*
+ * Whether option @p number is Class U, so is sent outside the ciphertext.
+ */
+static int
+coap_oscore_is_outer(uint16_t number) {
+  switch (number) {
+  case COAP_OPTION_URI_HOST:
+  case COAP_OPTION_URI_PORT:
+  case COAP_OPTION_OSCORE:
+  case COAP_OPTION_HOP_LIMIT:
+  case COAP_OPTION_PROXY_URI:
+  case COAP_OPTION_PROXY_SCHEME:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Adds the options in @p s, as split up by @p split, to @p pdu.
+ */
+static int
+coap_oscore_add_split(coap_pdu_t *pdu, uint16_t number,
+                      const coap_str_const_t *s,
+                      int (*split)(const uint8_t *, size_t, uint8_t *,
+                                   size_t *)) {
+  size_t buflen = s->length + 3 * (s->length + 1);
+  uint8_t *buf = coap_malloc_type(COAP_STRING, buflen);
+  uint8_t *p = buf;
+  int res;
+  int ok = 1;
+
+  if (!buf)
+    return 0;
+  res = split(s->s, s->length, buf, &buflen);
+  while (res-- > 0) {
+    if (!coap_insert_option(pdu, number, coap_opt_length(p),
+                            coap_opt_value(p))) {
+      ok = 0;
+      break;
+    }
+    p += coap_opt_size(p);
+  }
+  coap_free_type(COAP_STRING, buf);
+  return ok;
+}
+
+/*
+ * Moves a Proxy-Uri into Proxy-Scheme, Uri-Host and Uri-Port options of
+ * @p outer, that a proxy reads, and Uri-Path and Uri-Query options of
+ * @p inner, that it does not.
+ */
+static int
+coap_oscore_split_proxy_uri(coap_pdu_t *outer, coap_pdu_t *inner,
+                            coap_opt_t *option) {
+  static const char *const scheme[] = {
+    "coap", "coaps", "coap+tcp", "coaps+tcp"
+  };
+  coap_uri_t uri;
+  uint8_t portbuf[2];
+
+  if (coap_split_proxy_uri(coap_opt_value(option), coap_opt_length(option),
+                           &uri) < 0 ||
+      (size_t)uri.scheme >= sizeof(scheme) / sizeof(scheme[0])) {
+    coap_log(LOG_WARNING, "oscore: cannot protect Proxy-Uri\n");
+    return 0;
+  }
+  if (!coap_insert_option(outer, COAP_OPTION_PROXY_SCHEME,
+                          strlen(scheme[uri.scheme]),
+                          (const uint8_t *)scheme[uri.scheme]) ||
+      (uri.host.length &&
+       !coap_insert_option(outer, COAP_OPTION_URI_HOST, uri.host.length,
+                           uri.host.s)))
+    return 0;
+  if (uri.port != (coap_uri_scheme_is_secure(&uri) ?
+                     COAPS_DEFAULT_PORT : COAP_DEFAULT_PORT) &&
+      !coap_insert_option(outer, COAP_OPTION_URI_PORT,
+                          coap_encode_var_safe(portbuf, sizeof(portbuf),
+                                               uri.port),
+                          portbuf))
+    return 0;
+  return (!uri.path.length ||
+          coap_oscore_add_split(inner, COAP_OPTION_URI_PATH, &uri.path,
+                                coap_split_path)) &&
+         (!uri.query.length ||
+          coap_oscore_add_split(inner, COAP_OPTION_URI_QUERY, &uri.query,
+                                coap_split_query));
+}
+
+/*
+ * Builds the protected version of @p pdu with @p osc.  A request, or a
+ * response with @p with_piv set, gets a new Partial IV, which goes into
+ * @p piv; any other response uses the nonce of the request of @p assoc.
+ */
+static coap_pdu_t *
+coap_oscore_protect(coap_pdu_t *pdu, coap_oscore_ctx_t *osc,
+                    const coap_oscore_assoc_t *assoc, int with_piv,
+                    uint8_t *piv, size_t *piv_len) {
+  int is_request = COAP_PDU_IS_REQUEST(pdu);
+  coap_pdu_t *inner;
+  coap_pdu_t *outer = NULL;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  coap_opt_t *proxy_uri = NULL;
+  int observe;
+  uint8_t nonce[COAP_OSCORE_NONCE_LEN];
+  uint8_t aad[COAP_OSCORE_AAD_SIZE];
+  size_t aad_len;
+  uint8_t value[COAP_OSCORE_OPTION_SIZE];
+  uint8_t *v = value;
+  uint8_t code;
+  uint8_t *plain = NULL;
+  uint8_t *cipher;
+  size_t plain_len;
+  const uint8_t *data;
+  size_t data_len = 0;
+  size_t offset;
+  size_t total;
+
+  *piv_len = 0;
+  inner = coap_pdu_init(COAP_MESSAGE_CON, pdu->code, 0, 0);
+  if (!inner)
+    return NULL;
+  observe = coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter) != NULL &&
+            (is_request || COAP_RESPONSE_CLASS(pdu->code) == 2);
+  if (is_request)
+    code = observe ? COAP_REQUEST_FETCH : COAP_REQUEST_POST;
+  else
+    code = observe ? COAP_RESPONSE_CODE(205) : COAP_RESPONSE_CODE(204);
+  outer = coap_pdu_init(pdu->type, code, pdu->mid, 0);
+  if (!outer || !coap_add_token(outer, pdu->token_length, pdu->token))
+    goto fail;
+
+  /* Observe goes both inside, and outside for the proxies */
+  coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    coap_pdu_t *to = coap_oscore_is_outer(opt_iter.type) ? outer : inner;
+
+    if (opt_iter.type == COAP_OPTION_PROXY_URI) {
+      proxy_uri = option;
+      continue;
+    }
+    if ((opt_iter.type == COAP_OPTION_OBSERVE &&
+         !coap_add_option(outer, opt_iter.type, coap_opt_length(option),
+                          coap_opt_value(option))) ||
+        !coap_add_option(to, opt_iter.type, coap_opt_length(option),
+                         coap_opt_value(option)))
+      goto fail;
+  }
+  if (proxy_uri && !coap_oscore_split_proxy_uri(outer, inner, proxy_uri))
+    goto fail;
+
+  if (is_request || with_piv) {
+    *piv_len = coap_oscore_next_piv(osc, piv);
+    if (!*piv_len)
+      goto fail;
+  }
+
+  /* The OSCORE option, which a response without a Partial IV leaves empty */
+  if (*piv_len) {
+    *v++ = (uint8_t)*piv_len | (is_request ? COAP_OSCORE_FLAG_K : 0) |
+           (is_request && osc->id_context_len ? COAP_OSCORE_FLAG_H : 0);
+    memcpy(v, piv, *piv_len);
+    v += *piv_len;
+    if (is_request && osc->id_context_len) {
+      *v++ = (uint8_t)osc->id_context_len;
+      memcpy(v, osc->id_context, osc->id_context_len);
+      v += osc->id_context_len;
+    }
+    if (is_request) {
+      memcpy(v, osc->sender_id, osc->sender_id_len);
+      v += osc->sender_id_len;
+    }
+  }
+  if (!coap_insert_option(outer, COAP_OPTION_OSCORE, v - value, value))
+    goto fail;
+
+  /* The plaintext: the code, the Class E options and the payload */
+  coap_get_data_large(pdu, &data_len, &data, &offset, &total);
+  plain_len = 1 + inner->used_size + (data_len ? 1 + data_len : 0);
+  plain = coap_malloc_type(COAP_STRING, plain_len);
+  if (!plain)
+    goto fail;
+  plain[0] = pdu->code;
+  if (inner->used_size)
+    memcpy(&plain[1], inner->token, inner->used_size);
+  if (data_len) {
+    plain[1 + inner->used_size] = COAP_PAYLOAD_START;
+    memcpy(&plain[2 + inner->used_size], data, data_len);
+  }
+
+  if (is_request) {
+    aad_len = coap_oscore_aad(osc->sender_id, osc->sender_id_len,
+                              piv, *piv_len, aad);
+    coap_oscore_nonce(osc, osc->sender_id, osc->sender_id_len,
+                      piv, *piv_len, nonce);
+  } else {
+    aad_len = coap_oscore_aad(osc->recipient_id, osc->recipient_id_len,
+                              assoc->piv, assoc->piv_len, aad);
+    if (*piv_len)
+      coap_oscore_nonce(osc, osc->sender_id, osc->sender_id_len,
+                        piv, *piv_len, nonce);
+    else
+      coap_oscore_nonce(osc, osc->recipient_id, osc->recipient_id_len,
+                        assoc->piv, assoc->piv_len, nonce);
+  }
+  cipher = coap_add_data_after(outer, plain_len + COAP_OSCORE_TAG_LEN);
+  if (!cipher ||
+      !coap_crypto_aead_encrypt(osc->sender_key, nonce, aad, aad_len,
+                                plain, plain_len, cipher))
+    goto fail;
+
+  coap_free_type(COAP_STRING, plain);
+  coap_delete_pdu(inner);
+  return outer;
+
+fail:
+  coap_log(LOG_WARNING, "oscore: cannot protect %d.%02d\n",
+           COAP_RESPONSE_CLASS(pdu->code), pdu->code & 0x1f);
+  coap_free_type(COAP_STRING, plain);
+  coap_delete_pdu(inner);
+  coap_delete_pdu(outer);
+  return NULL;
+}
+
+coap_pdu_t *
+coap_oscore_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_oscore_assoc_t *assoc;
+  coap_opt_iterator_t opt_iter;
+  coap_pdu_t *protected;
+  uint8_t piv[COAP_OSCORE_MAX_PIV_LEN];
+  size_t piv_len;
+  int observe;
+
+  if (COAP_PDU_IS_EMPTY(pdu) || COAP_PDU_IS_SIGNALING(pdu) ||
+      pdu->code == COAP_RESPONSE_CODE(508))
+    return pdu;
+
+  if (COAP_PDU_IS_REQUEST(pdu)) {
+    if (!session->oscore ||
+        coap_check_option(pdu, COAP_OPTION_OSCORE, &opt_iter))
+      return pdu;
+    protected = coap_oscore_protect(pdu, session->oscore, NULL, 0,
+                                    piv, &piv_len);
+    if (!protected) {
+      coap_delete_pdu(pdu);
+      return NULL;
+    }
+    assoc = coap_oscore_assoc_new(session, session->oscore, pdu, piv,
+                                  piv_len, 1);
+    if (!assoc) {
+      coap_delete_pdu(protected);
+      coap_delete_pdu(pdu);
+      return NULL;
+    }
+    /* Kept to hand to the response handler */
+    assoc->request = pdu;
+    return protected;
+  }
+
+  assoc = coap_oscore_assoc_find(session, pdu->token, pdu->token_length, 0);
+  if (!assoc)
+    return pdu;
+  /* Notifications carry a Partial IV of their own */
+  observe = coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter) != NULL &&
+            COAP_RESPONSE_CLASS(pdu->code) == 2;
+  protected = coap_oscore_protect(pdu, assoc->osc, assoc, observe,
+                                  piv, &piv_len);
+  if (!observe)
+    coap_oscore_assoc_remove(session, assoc);
+  coap_delete_pdu(pdu);
+  return protected;
+}
+
+/*
+ * Decrypts the payload of @p pdu and puts the plaintext code, options and
+ * payload in place of the OSCORE option and ciphertext.  The outer Observe
+ * option, that the proxies may have seen, is kept rather than the inner
+ * one.  Returns 0 if successful, else the code for the failure.
+ */
+static int
+coap_oscore_decrypt(coap_pdu_t *pdu, const uint8_t *key, const uint8_t *nonce,
+                    const uint8_t *aad, size_t aad_len) {
+  coap_pdu_t *inner = NULL;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  uint8_t *plain = NULL;
+  size_t plain_len;
+  int has_observe;
+  int resp = 400;
+
+  if (!pdu->data ||
+      pdu->used_size - (pdu->data - pdu->token) < 1 + COAP_OSCORE_TAG_LEN)
+    return 400;
+  plain_len = pdu->used_size - (pdu->data - pdu->token) - COAP_OSCORE_TAG_LEN;
+  plain = coap_malloc_type(COAP_STRING, plain_len);
+  if (!plain)
+    return 500;
+  if (!coap_crypto_aead_decrypt(key, nonce, aad, aad_len, pdu->data,
+                                plain_len + COAP_OSCORE_TAG_LEN, plain)) {
+    coap_log(LOG_DEBUG, "oscore: decryption failed\n");
+    goto finish;
+  }
+
+  /* Parse the plaintext options in a PDU of their own */
+  inner = coap_pdu_init(COAP_MESSAGE_CON, plain[0], 0, 0);
+  if (!inner || !coap_pdu_resize(inner, plain_len)) {
+    resp = 500;
+    goto finish;
+  }
+  if (plain_len > 1)
+    memcpy(inner->token, &plain[1], plain_len - 1);
+  inner->used_size = plain_len - 1;
+  if (COAP_PDU_IS_EMPTY(inner) || COAP_PDU_IS_SIGNALING(inner) ||
+      COAP_PDU_IS_REQUEST(inner) != COAP_PDU_IS_REQUEST(pdu) ||
+      !coap_pdu_parse_opt(inner)) {
+    coap_log(LOG_DEBUG, "oscore: plaintext malformed\n");
+    goto finish;
+  }
+
+  /* Swap the ciphertext for the plaintext options and payload */
+  pdu->used_size = (pdu->data - 1) - pdu->token;
+  pdu->data = NULL;
+  coap_remove_option(pdu, COAP_OPTION_OSCORE);
+  pdu->code = inner->code;
+  has_observe = coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter) != NULL;
+  coap_option_iterator_init(inner, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_oscore_is_outer(opt_iter.type) ||
+        (opt_iter.type == COAP_OPTION_OBSERVE && has_observe))
+      continue;
+    if (!coap_insert_option(pdu, opt_iter.type, coap_opt_length(option),
+                            coap_opt_value(option))) {
+      resp = 500;
+      goto finish;
+    }
+  }
+  if (inner->data &&
+      !coap_add_data(pdu, inner->used_size - (inner->data - inner->token),
+                     inner->data)) {
+    resp = 500;
+    goto finish;
+  }
+  pdu->body_data = NULL;
+  pdu->body_length = 0;
+  pdu->body_offset = 0;
+  pdu->body_total = 0;
+  resp = 0;
+
+finish:
+  coap_delete_pdu(inner);
+  memset(plain, 0, plain_len);
+  coap_free_type(COAP_STRING, plain);
+  return resp;
+}
+
+static int
+coap_oscore_replay_ok(const coap_oscore_ctx_t *osc, uint64_t seq) {
+  uint64_t delta;
+
+  if (!osc->replay_valid || seq > osc->replay_high)
+    return 1;
+  delta = osc->replay_high - seq;
+  return delta < osc->replay_window &&
+         !(osc->replay_seen & (UINT64_C(1) << delta));
+}
+
+static void
+coap_oscore_replay_update(coap_oscore_ctx_t *osc, uint64_t seq) {
+  if (!osc->replay_valid) {
+    osc->replay_valid = 1;
+    osc->replay_high = seq;
+    osc->replay_seen = 1;
+  } else if (seq > osc->replay_high) {
+    uint64_t shift = seq - osc->replay_high;
+
+    osc->replay_seen = shift >= 64 ? 0 : osc->replay_seen << shift;
+    osc->replay_seen |= 1;
+    osc->replay_high = seq;
+  } else {
+    osc->replay_seen |= UINT64_C(1) << (osc->replay_high - seq);
+  }
+}
+
+int
+coap_oscore_unprotect_request(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_oscore_assoc_t *assoc;
+  coap_oscore_ctx_t *osc;
+  coap_oscore_option_t parsed;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  uint8_t nonce[COAP_OSCORE_NONCE_LEN];
+  uint8_t aad[COAP_OSCORE_AAD_SIZE];
+  size_t aad_len;
+  uint64_t seq;
+  int resp;
+
+  /* Whatever happens, an earlier exchange with the token is over */
+  assoc = coap_oscore_assoc_find(session, pdu->token, pdu->token_length, 0);
+  if (assoc)
+    coap_oscore_assoc_remove(session, assoc);
+
+  option = coap_check_option(pdu, COAP_OPTION_OSCORE, &opt_iter);
+  if (!option || !coap_oscore_parse_option(option, &parsed) ||
+      !parsed.has_kid || !parsed.piv_len) {
+    coap_log(LOG_DEBUG, "oscore: request without kid or Partial IV\n");
+    return 402;
+  }
+  osc = coap_oscore_find(session->context, parsed.kid, parsed.kid_len,
+                         parsed.kid_context, parsed.kid_context_len);
+  if (!osc) {
+    coap_log(LOG_DEBUG, "oscore: security context not found\n");
+    return 401;
+  }
+  seq = coap_decode_var_bytes8(parsed.piv, parsed.piv_len);
+  if (!coap_oscore_replay_ok(osc, seq)) {
+    coap_log(LOG_DEBUG, "oscore: replayed request\n");
+    return 401;
+  }
+
+  aad_len = coap_oscore_aad(osc->recipient_id, osc->recipient_id_len,
+                            parsed.piv, parsed.piv_len, aad);
+  coap_oscore_nonce(osc, osc->recipient_id, osc->recipient_id_len,
+                    parsed.piv, parsed.piv_len, nonce);
+  /* The option goes with the decryption, so is parsed before */
+  assoc = coap_oscore_assoc_new(session, osc, pdu, parsed.piv,
+                                parsed.piv_len, 0);
+  if (!assoc)
+    return 503;
+  resp = coap_oscore_decrypt(pdu, osc->recipient_key, nonce, aad, aad_len);
+  if (resp) {
+    coap_oscore_assoc_remove(session, assoc);
+    return resp;
+  }
+  coap_oscore_replay_update(osc, seq);
+  /* Only the plaintext says whether it is an observe registration */
+  option = coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter);
+  assoc->observe = option &&
+                   coap_decode_var_bytes(coap_opt_value(option),
+                                   coap_opt_length(option)) == COAP_OBSERVE_ESTABLISH;
+  return 0;
+}
+
+int
+coap_oscore_unprotect_response(coap_session_t *session, coap_pdu_t *pdu,
+                               coap_pdu_t **sent,
+                               coap_oscore_assoc_t **assoc) {
+  coap_oscore_assoc_t *a;
+  coap_oscore_ctx_t *osc;
+  coap_oscore_option_t parsed;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  uint8_t nonce[COAP_OSCORE_NONCE_LEN];
+  uint8_t aad[COAP_OSCORE_AAD_SIZE];
+  size_t aad_len;
+  uint64_t seq = 0;
+
+  *assoc = NULL;
+  option = coap_check_option(pdu, COAP_OPTION_OSCORE, &opt_iter);
+  a = coap_oscore_assoc_find(session, pdu->token, pdu->token_length, 1);
+  if (!a) {
+    if (option)
+      coap_log(LOG_DEBUG, "oscore: response to no protected request\n");
+    return option == NULL;
+  }
+  if (!option) {
+    /* A proxy, or the server failing to verify, answers in the clear */
+    if (COAP_RESPONSE_CLASS(pdu->code) < 4) {
+      coap_log(LOG_DEBUG, "oscore: unprotected response dropped\n");
+      return 0;
+    }
+    LL_DELETE(session->oscore_assoc, a);
+    *sent = a->request;
+    *assoc = a;
+    return 1;
+  }
+
+  osc = a->osc;
+  if (!coap_oscore_parse_option(option, &parsed)) {
+    coap_log(LOG_DEBUG, "oscore: OSCORE option malformed\n");
+    return 0;
+  }
+  aad_len = coap_oscore_aad(osc->sender_id, osc->sender_id_len,
+                            a->piv, a->piv_len, aad);
+  if (parsed.piv_len) {
+    seq = coap_decode_var_bytes8(parsed.piv, parsed.piv_len);
+    if (a->notify_valid && seq <= a->notify_piv) {
+      coap_log(LOG_DEBUG, "oscore: replayed or reordered notification\n");
+      return 0;
+    }
+    coap_oscore_nonce(osc, osc->recipient_id, osc->recipient_id_len,
+                      parsed.piv, parsed.piv_len, nonce);
+  } else {
+    coap_oscore_nonce(osc, osc->sender_id, osc->sender_id_len,
+                      a->piv, a->piv_len, nonce);
+  }
+  if (coap_oscore_decrypt(pdu, osc->recipient_key, nonce, aad, aad_len))
+    return 0;
+  if (parsed.piv_len) {
+    a->notify_valid = 1;
+    a->notify_piv = seq;
+  }
+  LL_DELETE(session->oscore_assoc, a);
+  *sent = a->request;
+  *assoc = a;
+  return 1;
+}
+
+coap_oscore_assoc_t *
+coap_oscore_assoc_take(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_oscore_assoc_t *assoc;
+  coap_opt_iterator_t opt_iter;
+
+  if (!COAP_PDU_IS_REQUEST(pdu) ||
+      !coap_check_option(pdu, COAP_OPTION_OSCORE, &opt_iter))
+    return NULL;
+  assoc = coap_oscore_assoc_find(session, pdu->token, pdu->token_length, 1);
+  if (assoc)
+    LL_DELETE(session->oscore_assoc, assoc);
+  return assoc;
+}
+
+coap_pdu_t *
+coap_oscore_assoc_request(coap_oscore_assoc_t *assoc) {
+  return assoc->request;
+}
+
+void
+coap_oscore_assoc_done(coap_session_t *session, coap_oscore_assoc_t *assoc,
+                       int keep) {
+  if (!assoc)
+    return;
+  /* The handler may have sent a new request with the same token */
+  if (keep && !coap_oscore_assoc_find(session, assoc->token,
+                                      assoc->token_length, 1))
+    LL_PREPEND(session->oscore_assoc, assoc);
+  else
+    coap_oscore_assoc_free(assoc);
+}
+
+void
+coap_oscore_response_dropped(coap_session_t *session,
+                             const coap_pdu_t *response) {
+  coap_oscore_assoc_t *assoc;
+
+  if (!response || !session->oscore_assoc || COAP_PDU_IS_EMPTY(response))
+    return;
+  assoc = coap_oscore_assoc_find(session, response->token,
+                                 response->token_length, 0);
+  if (assoc && !assoc->observe)
+    coap_oscore_assoc_remove(session, assoc);
+}
+
+void
+coap_oscore_session_free(coap_session_t *session) {
+  coap_oscore_assoc_t *assoc, *tmp;
+
+  LL_FOREACH_SAFE(session->oscore_assoc, assoc, tmp) {
+    coap_oscore_assoc_free(assoc);
+  }
+  session->oscore_assoc = NULL;
+  coap_oscore_release(session->oscore);
+  session->oscore = NULL;
+}
+
+void
+coap_oscore_free(coap_context_t *context) {
+  coap_oscore_ctx_t *osc, *tmp;
+
+  HASH_ITER(hh, context->oscore, osc, tmp) {
+    HASH_DELETE(hh, context->oscore, osc);
+    coap_oscore_release(osc);
+  }
+}
@@ -0,0 +1,96 @@
+/* coap_overload.c -- Admission control under overload
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The watermarks are checked for each request before the resource is
+ * looked up, and for each packet that would set up a new server session.
+ * All of them are cheap to look at: the retransmission queue and the
+ * asynchronous states are hashes that know their size, the time spent in
+ * the request handlers is added up over the current I/O processing
+ * iteration, and the memory in use is summed over the tracked types.
+ */
+
+void
+coap_context_set_overload(coap_context_t *context,
+                          const coap_overload_t *limits) {
+  if (limits)
+    context->overload = *limits;
+  else
+    memset(&context->overload, 0, sizeof(context->overload));
+  context->overloaded = 0;
+}
+
+int
+coap_context_is_overloaded(coap_context_t *context) {
+  return coap_overload_check(context);
+}
+
+static size_t
+coap_overload_memory(void) {
+  coap_memory_stats_t stats;
+  size_t bytes = 0;
+  int type;
+
+  for (type = 0; coap_memory_stats((coap_memory_tag_t)type, &stats); type++)
+    bytes += stats.bytes;
+  return bytes;
+}
+
+int
+coap_overload_check(coap_context_t *context) {
+  const coap_overload_t *limits = &context->overload;
+  const char *reason = NULL;
+
+  if (limits->max_sendqueue &&
+      HASH_CNT(hh, context->sendqueue_index) >= limits->max_sendqueue)
+    reason = "retransmission queue";
+#ifndef WITHOUT_ASYNC
+  else if (limits->max_async &&
+           HASH_CNT(hh, context->async_state) >= limits->max_async)
+    reason = "asynchronous requests";
+#endif /* WITHOUT_ASYNC */
+  else if (limits->handler_budget_ms &&
+           context->handler_us >= (uint64_t)limits->handler_budget_ms * 1000)
+    reason = "request handler time";
+  else if (limits->max_memory &&
+           coap_overload_memory() >= limits->max_memory)
+    reason = "memory";
+
+  if (reason && !context->overloaded)
+    coap_log(LOG_WARNING, "overloaded (%s), new work is turned away\n",
+             reason);
+  else if (!reason && context->overloaded)
+    coap_log(LOG_INFO, "no longer overloaded\n");
+  context->overloaded = reason != NULL;
+  return context->overloaded;
+}
+
+void
+coap_overload_reject(coap_session_t *session, const coap_pdu_t *pdu) {
+  coap_pdu_t *response;
+  uint8_t buf[4];
+
+  COAP_COUNT(session, overloaded, 1);
+  response = coap_pdu_init(pdu->type == COAP_MESSAGE_CON ? COAP_MESSAGE_ACK :
+                                                           COAP_MESSAGE_NON,
+                           COAP_RESPONSE_CODE(503), pdu->mid,
+                           pdu->token_length + 1 + sizeof(buf));
+  if (!response)
+    return;
+  if (!coap_add_token(response, pdu->token_length, pdu->token) ||
+      (session->context->overload.max_age &&
+       !coap_add_option(response, COAP_OPTION_MAXAGE,
+                        coap_encode_var_safe(buf, sizeof(buf),
+                                          session->context->overload.max_age),
+                        buf))) {
+    coap_delete_pdu(response);
+    return;
+  }
+  if (coap_send(session, response) == COAP_INVALID_MID)
+    coap_log(LOG_WARNING, "cannot send response for mid=0x%x\n", pdu->mid);
+}
@@ -0,0 +1,237 @@
+/* coap_pki_cache.c -- Cache of verified peer certificates
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The cache is a fixed size hash table of the SHA-256 fingerprints of the
+ * client certificates that have been verified, together with the server
+ * name the client asked for (as that can pick other CAs).  An entry lapses
+ * after the time to live, when the certificate expires, or when the CRLs
+ * are updated, which bumps the generation of the cache.
+ *
+ * An entry is looked for in the COAP_PKI_CACHE_PROBE slots from the one
+ * its fingerprint hashes to.  A new entry goes into the first of these
+ * that is free or has lapsed, or else replaces the one that lapses first,
+ * so that the cache never grows beyond its size.
+ *
+ * As the handshakes may run in the DTLS handshake worker threads, the
+ * table is only used under a spin lock, which is held for no more than
+ * the few compares of a probe.
+ */
+#define COAP_PKI_CACHE_PROBE 8
+
+typedef struct coap_pki_cache_entry_t {
+  uint8_t fingerprint[32];
+  coap_tick_t expires;         /* 0 if the slot is free */
+  unsigned int generation;     /* of the cache when it was verified */
+} coap_pki_cache_entry_t;
+
+struct coap_pki_cache_t {
+  size_t size;                 /* number of entries */
+  coap_tick_t ttl;             /* time to live of an entry */
+  unsigned int generation;     /* bumped whenever the CRLs are updated */
+  coap_pki_cache_entry_t *entry; /* follows the cache in the same block */
+};
+
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#define COAP_PKI_CACHE_LOCK(c) \
+  while (__atomic_test_and_set(&(c)->pki_cache_lock, __ATOMIC_ACQUIRE))
+#define COAP_PKI_CACHE_UNLOCK(c) \
+  __atomic_clear(&(c)->pki_cache_lock, __ATOMIC_RELEASE)
+#else /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+#define COAP_PKI_CACHE_LOCK(c)
+#define COAP_PKI_CACHE_UNLOCK(c)
+#endif /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+
+int
+coap_context_set_pki_cache(coap_context_t *context, size_t max_entries,
+                           unsigned int ttl) {
+  coap_pki_cache_t *cache = NULL;
+  coap_pki_cache_t *old;
+
+  if (max_entries && ttl) {
+    size_t len = sizeof(coap_pki_cache_t) +
+                 max_entries * sizeof(coap_pki_cache_entry_t);
+
+    if (max_entries > (SIZE_MAX - sizeof(coap_pki_cache_t)) /
+                      sizeof(coap_pki_cache_entry_t)) {
+      coap_log(LOG_WARNING, "coap_context_set_pki_cache: "
+                            "too many entries\n");
+      return 0;
+    }
+    cache = coap_malloc_type(COAP_STRING, len);
+    if (!cache)
+      return 0;
+    memset(cache, 0, len);
+    cache->entry = (coap_pki_cache_entry_t *)(cache + 1);
+    cache->size = max_entries;
+    cache->ttl = (coap_tick_t)ttl * COAP_TICKS_PER_SECOND;
+  }
+
+  COAP_PKI_CACHE_LOCK(context);
+  old = context->pki_cache;
+  context->pki_cache = cache;
+  COAP_PKI_CACHE_UNLOCK(context);
+
+  if (old)
+    coap_free_type(COAP_STRING, old);
+  return 1;
+}
+
+void
+coap_context_pki_crl_updated(coap_context_t *context) {
+  COAP_PKI_CACHE_LOCK(context);
+  if (context->pki_cache)
+    context->pki_cache->generation++;
+  COAP_PKI_CACHE_UNLOCK(context);
+}
+
+void
+coap_pki_cache_flush(coap_context_t *context) {
+  coap_context_pki_crl_updated(context);
+}
+
+static int
+coap_pki_cache_fingerprint(const uint8_t *der, size_t der_len,
+                           const char *sni, uint8_t *fingerprint) {
+  coap_digest_ctx_t *dctx;
+  coap_digest_t digest;
+
+  dctx = coap_digest_setup();
+  if (!dctx)
+    return 0;
+  /* The terminating '\0' keeps the server name apart from the DER */
+  if (!coap_digest_update(dctx, der, der_len) ||
+      !coap_digest_update(dctx, (const uint8_t *)(sni ? sni : ""),
+                          (sni ? strlen(sni) : 0) + 1)) {
+    coap_digest_free(dctx);
+    return 0;
+  }
+  if (!coap_digest_final(dctx, &digest))
+    return 0;
+  memcpy(fingerprint, digest.key, sizeof(digest.key));
+  return 1;
+}
+
+static size_t
+coap_pki_cache_slot(const coap_pki_cache_t *cache,
+                    const uint8_t *fingerprint) {
+  size_t h;
+
+  /* The fingerprint is already uniformly distributed */
+  memcpy(&h, fingerprint, sizeof(h));
+  return h % cache->size;
+}
+
+static int
+coap_pki_cache_lapsed(const coap_pki_cache_t *cache,
+                      const coap_pki_cache_entry_t *entry, coap_tick_t now) {
+  return entry->expires == 0 || entry->expires <= now ||
+         entry->generation != cache->generation;
+}
+
+int
+coap_pki_cache_lookup(coap_session_t *session,
+                      const uint8_t *der, size_t der_len, const char *sni) {
+  coap_context_t *context = session->context;
+  uint8_t fingerprint[32];
+  coap_pki_cache_t *cache;
+  coap_tick_t now;
+  int found = 0;
+
+  if (session->type != COAP_SESSION_TYPE_SERVER ||
+      !coap_pki_cache_fingerprint(der, der_len, sni, fingerprint))
+    return 0;
+  coap_ticks(&now);
+
+  COAP_PKI_CACHE_LOCK(context);
+  cache = context->pki_cache;
+  if (cache) {
+    size_t i = coap_pki_cache_slot(cache, fingerprint);
+    size_t n;
+
+    for (n = 0; n < COAP_PKI_CACHE_PROBE && n < cache->size; n++) {
+      coap_pki_cache_entry_t *entry = &cache->entry[i];
+
+      if (entry->expires &&
+          memcmp(entry->fingerprint, fingerprint, sizeof(fingerprint)) == 0) {
+        if (coap_pki_cache_lapsed(cache, entry, now))
+          entry->expires = 0;
+        else
+          found = 1;
+        break;
+      }
+      if (++i == cache->size)
+        i = 0;
+    }
+  }
+  COAP_PKI_CACHE_UNLOCK(context);
+
+  if (found)
+    coap_log(LOG_DEBUG, "   %s: certificate verified earlier\n",
+             coap_session_str(session));
+  return found;
+}
+
+void
+coap_pki_cache_add(coap_session_t *session,
+                   const uint8_t *der, size_t der_len,
+                   const char *sni, unsigned long valid_for) {
+  coap_context_t *context = session->context;
+  uint8_t fingerprint[32];
+  coap_pki_cache_t *cache;
+  coap_tick_t now;
+
+  if (session->type != COAP_SESSION_TYPE_SERVER || valid_for == 0 ||
+      !coap_pki_cache_fingerprint(der, der_len, sni, fingerprint))
+    return;
+  coap_ticks(&now);
+
+  COAP_PKI_CACHE_LOCK(context);
+  cache = context->pki_cache;
+  if (cache) {
+    size_t i = coap_pki_cache_slot(cache, fingerprint);
+    coap_pki_cache_entry_t *use = NULL;
+    coap_pki_cache_entry_t *oldest = NULL;
+    coap_tick_t expires;
+    size_t n;
+
+    for (n = 0; n < COAP_PKI_CACHE_PROBE && n < cache->size; n++) {
+      coap_pki_cache_entry_t *entry = &cache->entry[i];
+
+      if (entry->expires &&
+          memcmp(entry->fingerprint, fingerprint, sizeof(fingerprint)) == 0) {
+        use = entry;
+        break;
+      }
+      if (!use && coap_pki_cache_lapsed(cache, entry, now))
+        use = entry;
+      if (!oldest || entry->expires < oldest->expires)
+        oldest = entry;
+      if (++i == cache->size)
+        i = 0;
+    }
+    if (!use)
+      use = oldest;
+
+    expires = cache->ttl;
+    if (valid_for < cache->ttl / COAP_TICKS_PER_SECOND)
+      expires = (coap_tick_t)valid_for * COAP_TICKS_PER_SECOND;
+    memcpy(use->fingerprint, fingerprint, sizeof(fingerprint));
+    use->expires = now + expires;
+    use->generation = cache->generation;
+  }
+  COAP_PKI_CACHE_UNLOCK(context);
+}
+
+void
+coap_pki_cache_free(coap_context_t *context) {
+  if (context->pki_cache) {
+    coap_free_type(COAP_STRING, context->pki_cache);
+    context->pki_cache = NULL;
+  }
+}
@@ -14,6 +14,15 @@
 #else /* !HAVE_GETRANDOM */
 #include <stdlib.h>
 #endif /* !HAVE_GETRANDOM */
+#if defined(HAVE_UNISTD_H) && !defined(_WIN32)
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H && !_WIN32 */
+
+#if defined(WITH_CONTIKI)
+
+#elif defined(WITH_LWIP) && defined(LWIP_RAND)
+
+#else
 
 #if defined(_WIN32)
 
@@ -41,10 +50,11 @@ coap_prng_impl( unsigned char *buf, size_t len ) {
 
 #endif /* _WIN32 */
 
+/* Reads @p len bytes from the random source of the system */
 static int
-coap_prng_default(void *buf, size_t len) {
+coap_prng_system(void *buf, size_t len) {
 #ifdef HAVE_GETRANDOM
-  return getrandom(buf, len, 0);
+  return getrandom(buf, len, 0) == (ssize_t)len;
 #else /* !HAVE_GETRANDOM */
 #if defined(_WIN32)
   return coap_prng_impl(buf,len);
@@ -57,13 +67,129 @@ coap_prng_default(void *buf, size_t len) {
 #endif /* !HAVE_GETRANDOM */
 }
 
-static coap_rand_func_t rand_func = coap_prng_default;
+/*
+ * The default generator is ChaCha20 (RFC 8439), keyed from the random
+ * source of the system, so that MIDs, tokens and retransmission jitter do
+ * not need a system call or a global lock each.  The state is kept per
+ * thread.  Each refill produces COAP_PRNG_BLOCKS blocks of key stream, the
+ * first 32 bytes of which become the next key (fast key erasure), so that
+ * earlier output cannot be recovered from the state.  The key is taken
+ * from the system again after COAP_PRNG_RESEED bytes and in a forked
+ * child.
+ */
+#define COAP_PRNG_BLOCKS 4
+#define COAP_PRNG_RESEED (1024 * 1024)
 
-#if defined(WITH_CONTIKI)
+typedef struct coap_prng_state_t {
+  uint8_t key[32];
+  uint8_t buf[COAP_PRNG_BLOCKS * 64];
+  size_t avail;            /* unused bytes at the end of buf */
+  size_t left;             /* bytes to hand out until the next reseed */
+#if defined(HAVE_UNISTD_H) && !defined(_WIN32)
+  pid_t pid;               /* process the state was seeded in */
+#endif /* HAVE_UNISTD_H && !_WIN32 */
+} coap_prng_state_t;
 
-#elif defined(WITH_LWIP) && defined(LWIP_RAND)
+static COAP_THREAD_LOCAL coap_prng_state_t coap_prng_state;
 
-#else
+#define COAP_PRNG_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define COAP_PRNG_QR(a, b, c, d) do {                          \
+    a += b; d ^= a; d = COAP_PRNG_ROTL(d, 16);                 \
+    c += d; b ^= c; b = COAP_PRNG_ROTL(b, 12);                 \
+    a += b; d ^= a; d = COAP_PRNG_ROTL(d, 8);                  \
+    c += d; b ^= c; b = COAP_PRNG_ROTL(b, 7);                  \
+  } while (0)
+
+void
+coap_prng_chacha20_block(const uint8_t key[32], uint32_t counter,
+                         uint8_t out[64]) {
+  uint32_t in[16], x[16];
+  int i;
+
+  in[0] = 0x61707865; in[1] = 0x3320646e; in[2] = 0x79622d32;
+  in[3] = 0x6b206574;
+  /* The words are little endian */
+  for (i = 0; i < 8; i++)
+    in[4 + i] = (uint32_t)key[4 * i] | (uint32_t)key[4 * i + 1] << 8 |
+                (uint32_t)key[4 * i + 2] << 16 |
+                (uint32_t)key[4 * i + 3] << 24;
+  in[12] = counter;
+  in[13] = in[14] = in[15] = 0;
+  memcpy(x, in, sizeof(x));
+  for (i = 0; i < 10; i++) {
+    COAP_PRNG_QR(x[0], x[4], x[8], x[12]);
+    COAP_PRNG_QR(x[1], x[5], x[9], x[13]);
+    COAP_PRNG_QR(x[2], x[6], x[10], x[14]);
+    COAP_PRNG_QR(x[3], x[7], x[11], x[15]);
+    COAP_PRNG_QR(x[0], x[5], x[10], x[15]);
+    COAP_PRNG_QR(x[1], x[6], x[11], x[12]);
+    COAP_PRNG_QR(x[2], x[7], x[8], x[13]);
+    COAP_PRNG_QR(x[3], x[4], x[9], x[14]);
+  }
+  for (i = 0; i < 16; i++) {
+    x[i] += in[i];
+    out[4 * i] = (uint8_t)x[i];
+    out[4 * i + 1] = (uint8_t)(x[i] >> 8);
+    out[4 * i + 2] = (uint8_t)(x[i] >> 16);
+    out[4 * i + 3] = (uint8_t)(x[i] >> 24);
+  }
+}
+
+static void
+coap_prng_refill(coap_prng_state_t *st) {
+  uint32_t i;
+#if defined(HAVE_UNISTD_H) && !defined(_WIN32)
+  pid_t pid = getpid();
+
+  if (st->pid != pid) {
+    st->pid = pid;
+    st->left = 0;
+  }
+#endif /* HAVE_UNISTD_H && !_WIN32 */
+  if (st->left == 0) {
+    uint8_t seed[sizeof(st->key)];
+
+    /* Mixed into the old key, in case the system source fails */
+    memset(seed, 0, sizeof(seed));
+    coap_prng_system(seed, sizeof(seed));
+    for (i = 0; i < sizeof(seed); i++)
+      st->key[i] ^= seed[i];
+    st->left = COAP_PRNG_RESEED;
+  }
+  for (i = 0; i < COAP_PRNG_BLOCKS; i++)
+    coap_prng_chacha20_block(st->key, i, st->buf + i * 64);
+  memcpy(st->key, st->buf, sizeof(st->key));
+  memset(st->buf, 0, sizeof(st->key));
+  st->avail = sizeof(st->buf) - sizeof(st->key);
+}
+
+static int
+coap_prng_default(void *buf, size_t len) {
+  coap_prng_state_t *st = &coap_prng_state;
+  uint8_t *dst = (uint8_t *)buf;
+
+  while (len) {
+    size_t n;
+
+    if (!st->avail)
+      coap_prng_refill(st);
+    n = len < st->avail ? len : st->avail;
+    if (n > st->left)
+      n = st->left;
+    /* Hand out the unused bytes in order, wiping them */
+    memcpy(dst, st->buf + sizeof(st->buf) - st->avail, n);
+    memset(st->buf + sizeof(st->buf) - st->avail, 0, n);
+    st->avail -= n;
+    st->left -= n;
+    if (!st->left)
+      st->avail = 0;
+    dst += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static coap_rand_func_t rand_func = coap_prng_default;
 
 void
 coap_set_prng(coap_rand_func_t rng) {
@@ -79,6 +205,9 @@ coap_prng_init(unsigned int seed) {
 #else /* !HAVE_GETRANDOM */
   srand(seed);
 #endif /* !HAVE_GETRANDOM */
+  /* Key the generator of this thread afresh */
+  coap_prng_state.avail = 0;
+  coap_prng_state.left = 0;
 }
 
 int
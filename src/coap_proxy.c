@@ -0,0 +1,1301 @@
+/* coap_proxy.c -- Forward proxy with pooled origin sessions
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#ifndef COAP_WITHOUT_PROXY
+
+#include <stdio.h>
+
+#if !defined(WITH_CONTIKI) && !defined(WITH_LWIP) && !defined(RIOT_VERSION)
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif /* HAVE_NETDB_H */
+#ifdef HAVE_WS2TCPIP_H
+#include <ws2tcpip.h>
+#endif /* HAVE_WS2TCPIP_H */
+#define COAP_PROXY_RESOLVE 1
+#endif /* ! WITH_CONTIKI && ! WITH_LWIP && ! RIOT_VERSION */
+
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
+/*
+ * Each forwarded request gets an 8 byte token of its own on the origin
+ * session, which is how the responses are matched back up (through
+ * proxy->requests) to the client that is waiting for them.  The requests
+ * for an origin share the one session to it; those beyond max_requests
+ * wait in the origin's parked list until one of the outstanding requests
+ * completes.
+ *
+ * A GET or FETCH that is identical (by cache-key) to one that is already
+ * on its way to the origin is not sent again, but waits in the waiters
+ * list of the first one and gets a copy of its response.  A 2.05 response
+ * to a GET or FETCH is then kept in proxy->replies for its Max-Age, so that
+ * the requests that follow are answered straight away.
+ */
+typedef struct coap_proxy_request_t {
+  UT_hash_handle hh;             /* proxy->requests, by token */
+  UT_hash_handle kh;             /* proxy->pending, by cache_key */
+  struct coap_proxy_request_t *prev; /* Links for the origin's active or */
+  struct coap_proxy_request_t *next; /* parked list, or leader's waiters */
+  uint64_t token;                /* token used with the origin */
+  coap_proxy_origin_t *origin;
+  struct coap_proxy_request_t *leader; /* request waited on, or NULL */
+  struct coap_proxy_request_t *waiters; /* identical requests waiting */
+  coap_cache_key_t cache_key;    /* cache-key of a GET or FETCH */
+  uint8_t keyed;                 /* 1 if cache_key is set */
+  uint8_t pending;               /* 1 if in proxy->pending */
+  coap_session_t *incoming;      /* session of the client (referenced) */
+  coap_resource_t *resource;     /* proxy resource */
+  coap_binary_t *in_token;       /* token used by the client */
+  coap_string_t *query;          /* query of the client's request */
+  uint8_t in_type;               /* type of the client's request */
+  uint8_t code;                  /* method */
+  uint16_t block2_opt;           /* Block2 or Q-Block2 asked for, or 0 */
+  coap_block_t block2;           /* block asked for by the client */
+  coap_optlist_t *optlist;       /* options for the origin */
+  coap_binary_t *body;           /* request body, until it is sent */
+  coap_binary_t *body_data;      /* response body being put together */
+  coap_tick_t sent;              /* when it was passed to the origin */
+  uint8_t parked;                /* 1 if in the parked list */
+} coap_proxy_request_t;
+
+struct coap_proxy_origin_t {
+  UT_hash_handle hh;             /* proxy->origins, by key */
+  coap_proxy_t *proxy;
+  coap_session_t *session;       /* session to the origin, or NULL */
+  coap_uri_scheme_t scheme;
+  uint16_t port;
+  coap_str_const_t host;         /* points into key */
+  uint8_t closed;                /* 1 if session has been disconnected */
+  unsigned int in_flight;        /* number of requests in active */
+  unsigned int queued;           /* number of requests in parked */
+  coap_proxy_request_t *active;  /* outstanding requests, oldest first */
+  coap_proxy_request_t *parked;  /* waiting requests, oldest first */
+  size_t key_length;
+  char *key;                     /* "scheme:port:host" */
+};
+
+/*
+ * A response of an origin, shared by all the clients it is passed back to
+ * and by proxy->replies while it is fresh.
+ */
+typedef struct coap_proxy_reply_t {
+  UT_hash_handle hh;             /* proxy->replies, by cache_key */
+  coap_cache_key_t cache_key;
+  unsigned int ref;              /* holders, including the transfers */
+  coap_pdu_t *pdu;               /* code and options (no token or body) */
+  uint16_t media_type;           /* Content-Format of body */
+  int maxage;                    /* Max-Age of body, or -1 */
+  uint64_t etag;                 /* ETag of body, or 0 */
+  coap_binary_t *body;           /* response body, or NULL */
+  coap_proxy_origin_t *origin;   /* origin of a cached reply */
+  uint8_t request_code;          /* method of a cached reply */
+  coap_tick_t fresh_ticks;       /* cached reply is fresh until then */
+} coap_proxy_reply_t;
+
+struct coap_proxy_t {
+  coap_context_t *context;
+  coap_proxy_config_t config;
+  coap_uri_t next_hop;
+  uint8_t *next_hop_host;        /* copy of next_hop.host */
+  coap_proxy_origin_t *origins;
+  coap_proxy_request_t *requests;
+  coap_proxy_request_t *pending; /* GET and FETCH requests with the origin */
+  coap_proxy_reply_t *replies;   /* fresh replies, oldest first */
+  uint64_t next_token;
+};
+
+/* Observe, Block1/2, Q-Block1/2 and Size1/2 are not passed on */
+COAP_STATIC_INLINE int
+coap_proxy_hop_by_hop(uint16_t type) {
+  const coap_option_desc_t *desc = coap_option_desc(type);
+
+  return desc && (desc->flags & COAP_OPT_PROP_HOP_BY_HOP);
+}
+
+static void
+coap_proxy_release_body(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_delete_binary(app_ptr);
+}
+
+static void
+coap_proxy_reply_release(coap_proxy_reply_t *reply) {
+  if (--reply->ref > 0)
+    return;
+  coap_delete_pdu(reply->pdu);
+  coap_delete_binary(reply->body);
+  coap_free_type(COAP_STRING, reply);
+}
+
+static void
+coap_proxy_release_reply(coap_session_t *session COAP_UNUSED, void *app_ptr) {
+  coap_proxy_reply_release(app_ptr);
+}
+
+static void
+coap_proxy_uncache_reply(coap_proxy_t *proxy, coap_proxy_reply_t *reply) {
+  HASH_DELETE(hh, proxy->replies, reply);
+  coap_proxy_reply_release(reply);
+}
+
+static void
+coap_proxy_request_free(coap_proxy_request_t *req) {
+  coap_proxy_origin_t *origin = req->origin;
+
+  while (req->waiters)
+    coap_proxy_request_free(req->waiters);
+  if (req->leader) {
+    DL_DELETE(req->leader->waiters, req);
+  } else {
+    coap_proxy_t *proxy = origin->proxy;
+
+    HASH_DELETE(hh, proxy->requests, req);
+    if (req->pending)
+      HASH_DELETE(kh, proxy->pending, req);
+    if (req->parked) {
+      DL_DELETE(origin->parked, req);
+      origin->queued--;
+    } else {
+      DL_DELETE(origin->active, req);
+      origin->in_flight--;
+    }
+  }
+  coap_session_release(req->incoming);
+  coap_delete_binary(req->in_token);
+  coap_delete_string(req->query);
+  coap_delete_optlist(req->optlist);
+  coap_delete_binary(req->body);
+  coap_delete_binary(req->body_data);
+  coap_free_type(COAP_STRING, req);
+}
+
+/*
+ * Sends a response with just @p code back to the client of @p req and
+ * forgets about @p req.
+ */
+static void
+coap_proxy_request_fail(coap_proxy_request_t *req, uint8_t code) {
+  coap_session_t *incoming = req->incoming;
+  coap_pdu_t *pdu;
+  const char *phrase = coap_response_phrase(code);
+
+  while (req->waiters)
+    coap_proxy_request_fail(req->waiters, code);
+  pdu = coap_pdu_init(req->in_type == COAP_MESSAGE_CON ?
+                        COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+                      code, coap_new_message_id(incoming),
+                      coap_session_max_pdu_size(incoming));
+  if (pdu) {
+    if (coap_add_token(pdu, req->in_token->length, req->in_token->s)) {
+      if (phrase)
+        coap_add_data(pdu, strlen(phrase), (const uint8_t *)phrase);
+      if (coap_send(incoming, pdu) == COAP_INVALID_MID)
+        coap_log(LOG_DEBUG, "proxy: cannot send %d.%02d\n",
+                 COAP_RESPONSE_CLASS(code), code & 0x1f);
+    } else {
+      coap_delete_pdu(pdu);
+    }
+  }
+  coap_proxy_request_free(req);
+}
+
+static int
+coap_proxy_resolve(coap_proxy_origin_t *origin, coap_proto_t proto,
+                   coap_address_t *dst) {
+#ifdef COAP_PROXY_RESOLVE
+  struct addrinfo *res, *ainfo;
+  struct addrinfo hints;
+  int error;
+  int found = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = COAP_PROTO_RELIABLE(proto) ? SOCK_STREAM : SOCK_DGRAM;
+  hints.ai_family = AF_UNSPEC;
+
+  /* origin->host is nul terminated as it is at the end of origin->key */
+  error = getaddrinfo(origin->host.length ? (const char *)origin->host.s :
+                                            "localhost", NULL, &hints, &res);
+  if (error != 0) {
+    coap_log(LOG_WARNING, "proxy: cannot resolve '%s': %s\n",
+             origin->host.s, gai_strerror(error));
+    return 0;
+  }
+
+  for (ainfo = res; ainfo != NULL && !found; ainfo = ainfo->ai_next) {
+    switch (ainfo->ai_family) {
+    case AF_INET6:
+    case AF_INET:
+      coap_address_init(dst);
+      dst->size = (socklen_t)ainfo->ai_addrlen;
+      memcpy(&dst->addr.sa, ainfo->ai_addr, ainfo->ai_addrlen);
+      if (ainfo->ai_family == AF_INET)
+        dst->addr.sin.sin_port = htons(origin->port);
+      else
+        dst->addr.sin6.sin6_port = htons(origin->port);
+      found = 1;
+      break;
+    default:
+      ;
+    }
+  }
+  freeaddrinfo(res);
+  return found;
+#else /* ! COAP_PROXY_RESOLVE */
+  (void)proto;
+  (void)dst;
+  coap_log(LOG_WARNING, "proxy: cannot resolve '%.*s'\n",
+           (int)origin->host.length, (const char *)origin->host.s);
+  return 0;
+#endif /* ! COAP_PROXY_RESOLVE */
+}
+
+/*
+ * Makes sure that @p origin has a session that requests can be sent on,
+ * replacing one that has been disconnected.
+ */
+static int
+coap_proxy_origin_connect(coap_proxy_origin_t *origin) {
+  coap_proxy_t *proxy = origin->proxy;
+  coap_address_t dst;
+  coap_proto_t proto;
+  coap_session_t *session;
+
+  if (origin->session && !origin->closed)
+    return 1;
+
+  if (origin->session) {
+    origin->session->proxy_origin = NULL;
+    coap_session_release(origin->session);
+    origin->session = NULL;
+  }
+
+  switch (origin->scheme) {
+  case COAP_URI_SCHEME_COAP:
+    proto = COAP_PROTO_UDP;
+    break;
+  case COAP_URI_SCHEME_COAPS:
+    proto = COAP_PROTO_DTLS;
+    break;
+  case COAP_URI_SCHEME_COAP_TCP:
+    proto = COAP_PROTO_TCP;
+    break;
+  case COAP_URI_SCHEME_COAPS_TCP:
+    proto = COAP_PROTO_TLS;
+    break;
+  case COAP_URI_SCHEME_HTTP:
+  case COAP_URI_SCHEME_HTTPS:
+  default:
+    return 0;
+  }
+
+  if (!coap_proxy_resolve(origin, proto, &dst))
+    return 0;
+
+  if (proxy->config.new_session) {
+    coap_uri_t uri;
+
+    memset(&uri, 0, sizeof(uri));
+    uri.scheme = origin->scheme;
+    uri.port = origin->port;
+    uri.host = origin->host;
+    session = proxy->config.new_session(proxy->context, &uri, &dst, proto,
+                                        proxy->config.app_data);
+  } else {
+    session = coap_new_client_session(proxy->context, NULL, &dst, proto);
+  }
+  if (!session) {
+    coap_log(LOG_WARNING, "proxy: cannot set up session to '%s'\n",
+             origin->key);
+    return 0;
+  }
+  session->proxy_origin = origin;
+  origin->session = session;
+  origin->closed = 0;
+  return 1;
+}
+
+static coap_proxy_origin_t *
+coap_proxy_get_origin(coap_proxy_t *proxy, coap_uri_scheme_t scheme,
+                      const coap_str_const_t *host, uint16_t port) {
+  coap_proxy_origin_t *origin;
+  char prefix[16];
+  size_t prefix_length;
+  size_t key_length;
+
+  prefix_length = snprintf(prefix, sizeof(prefix), "%d:%u:",
+                           (int)scheme, port);
+  key_length = prefix_length + host->length;
+
+  /* Look up with the key put together on the stack if it fits */
+  if (key_length <= 64) {
+    char key[64];
+
+    memcpy(key, prefix, prefix_length);
+    memcpy(key + prefix_length, host->s, host->length);
+    HASH_FIND(hh, proxy->origins, key, key_length, origin);
+    if (origin)
+      return origin;
+  }
+
+  origin = coap_malloc_type(COAP_STRING,
+                            sizeof(coap_proxy_origin_t) + key_length + 1);
+  if (!origin)
+    return NULL;
+  memset(origin, 0, sizeof(coap_proxy_origin_t));
+  origin->proxy = proxy;
+  origin->scheme = scheme;
+  origin->port = port;
+  origin->key = (char *)(origin + 1);
+  origin->key_length = key_length;
+  memcpy(origin->key, prefix, prefix_length);
+  memcpy(origin->key + prefix_length, host->s, host->length);
+  origin->key[key_length] = '\000';
+  origin->host.s = (const uint8_t *)origin->key + prefix_length;
+  origin->host.length = host->length;
+
+  if (key_length > 64) {
+    coap_proxy_origin_t *found;
+
+    HASH_FIND(hh, proxy->origins, origin->key, key_length, found);
+    if (found) {
+      coap_free_type(COAP_STRING, origin);
+      return found;
+    }
+  }
+  HASH_ADD_KEYPTR(hh, proxy->origins, origin->key, key_length, origin);
+  return origin;
+}
+
+/*
+ * Passes @p req on to the origin.  Returns 0 if successful, else the
+ * response code that the client is to be given.
+ */
+static uint8_t
+coap_proxy_request_send(coap_proxy_request_t *req) {
+  coap_proxy_origin_t *origin = req->origin;
+  coap_session_t *session;
+  coap_pdu_t *pdu;
+  uint8_t token[8];
+  size_t i;
+
+  if (!coap_proxy_origin_connect(origin))
+    return COAP_RESPONSE_CODE(502);
+  session = origin->session;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, req->code,
+                      coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return COAP_RESPONSE_CODE(500);
+  for (i = 0; i < sizeof(token); i++)
+    token[i] = (uint8_t)(req->token >> (8 * (sizeof(token) - 1 - i)));
+  if (!coap_add_token(pdu, sizeof(token), token) ||
+      !coap_add_optlist_pdu(pdu, &req->optlist)) {
+    coap_delete_pdu(pdu);
+    return COAP_RESPONSE_CODE(500);
+  }
+  if (req->body) {
+    coap_binary_t *body = req->body;
+
+    /* body is released by the transfer, even if it fails */
+    req->body = NULL;
+    if (!coap_add_data_large_request(session, pdu, body->length, body->s,
+                                     coap_proxy_release_body, body)) {
+      coap_delete_pdu(pdu);
+      return COAP_RESPONSE_CODE(500);
+    }
+  }
+  coap_delete_optlist(req->optlist);
+  req->optlist = NULL;
+
+  if (!coap_log_enabled(LOG_DEBUG))
+    coap_show_pdu(LOG_INFO, pdu);
+
+  if (req->parked) {
+    DL_DELETE(origin->parked, req);
+    origin->queued--;
+    req->parked = 0;
+  }
+  DL_APPEND(origin->active, req);
+  origin->in_flight++;
+  coap_io_ticks(origin->proxy->context, &req->sent);
+
+  if (coap_send_large(session, pdu) == COAP_INVALID_MID) {
+    /* Leave it to the nack (or the timeout) to fail the request */
+    coap_log(LOG_DEBUG, "proxy: cannot send request to '%s'\n", origin->key);
+  }
+  return 0;
+}
+
+/*
+ * Sends the parked requests of @p origin that now fit into max_requests.
+ */
+static void
+coap_proxy_origin_dispatch(coap_proxy_origin_t *origin) {
+  coap_proxy_t *proxy = origin->proxy;
+
+  while (origin->parked && origin->in_flight < proxy->config.max_requests) {
+    coap_proxy_request_t *req = origin->parked;
+    uint8_t code = coap_proxy_request_send(req);
+
+    if (code)
+      coap_proxy_request_fail(req, code);
+  }
+}
+
+/*
+ * Fails the outstanding requests of @p origin that have waited too long
+ * for their responses.
+ */
+static void
+coap_proxy_origin_expire(coap_proxy_origin_t *origin, coap_tick_t now) {
+  while (origin->active &&
+         now - origin->active->sent >=
+                            COAP_PROXY_REQUEST_TIMEOUT * COAP_TICKS_PER_SECOND) {
+    coap_proxy_request_t *req = origin->active;
+    uint8_t token[8];
+    size_t i;
+
+    for (i = 0; i < sizeof(token); i++)
+      token[i] = (uint8_t)(req->token >> (8 * (sizeof(token) - 1 - i)));
+    if (origin->session)
+      coap_cancel_all_messages(origin->proxy->context, origin->session,
+                               token, sizeof(token));
+    coap_log(LOG_DEBUG, "proxy: request to '%s' timed out\n", origin->key);
+    coap_proxy_request_fail(req, COAP_RESPONSE_CODE(504));
+  }
+}
+
+/*
+ * Puts together the reply to pass back to the clients from the response
+ * @p rcvd of the origin and its (reassembled) @p body, which is taken over.
+ */
+static coap_proxy_reply_t *
+coap_proxy_new_reply(coap_pdu_t *rcvd, coap_binary_t *body) {
+  coap_proxy_reply_t *reply;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  reply = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_reply_t));
+  if (!reply) {
+    coap_delete_binary(body);
+    return NULL;
+  }
+  memset(reply, 0, sizeof(coap_proxy_reply_t));
+  reply->ref = 1;
+  reply->body = body;
+  reply->media_type = COAP_MEDIATYPE_TEXT_PLAIN;
+  reply->maxage = -1;
+  reply->pdu = coap_pdu_init(0, rcvd->code, 0, rcvd->used_size);
+  if (!reply->pdu) {
+    coap_proxy_reply_release(reply);
+    return NULL;
+  }
+
+  /*
+   * Copy the options across, leaving those that
+   * coap_add_data_large_response() adds in for a body
+   */
+  coap_option_iterator_init(rcvd, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_proxy_hop_by_hop(opt_iter.type))
+      continue;
+    switch (opt_iter.type) {
+    case COAP_OPTION_CONTENT_FORMAT:
+      if (!body)
+        break;
+      reply->media_type = (uint16_t)coap_decode_var_bytes(
+                                                  coap_opt_value(option),
+                                                  coap_opt_length(option));
+      continue;
+    case COAP_OPTION_MAXAGE:
+      reply->maxage = (int)coap_decode_var_bytes(coap_opt_value(option),
+                                                 coap_opt_length(option));
+      if (!body)
+        break;
+      continue;
+    case COAP_OPTION_ETAG:
+      if (!body)
+        break;
+      reply->etag = coap_decode_var_bytes8(coap_opt_value(option),
+                                           coap_opt_length(option));
+      continue;
+    default:
+      break;
+    }
+    if (!coap_add_option(reply->pdu, opt_iter.type, coap_opt_length(option),
+                         coap_opt_value(option))) {
+      coap_proxy_reply_release(reply);
+      return NULL;
+    }
+  }
+  return reply;
+}
+
+/*
+ * Fills in @p pdu, which only has the client's token, from @p reply.
+ * @p request is the client's request, or one that just carries its Block2
+ * option.  If @p maxage is not -1, it replaces the Max-Age of @p reply.
+ */
+static int
+coap_proxy_add_reply(coap_proxy_reply_t *reply, coap_resource_t *resource,
+                     coap_session_t *session, coap_pdu_t *request,
+                     coap_pdu_t *pdu, const coap_binary_t *token,
+                     const coap_string_t *query, int maxage) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  pdu->code = reply->pdu->code;
+  coap_option_iterator_init(reply->pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (!coap_add_option(pdu, opt_iter.type, coap_opt_length(option),
+                         coap_opt_value(option)))
+      return 0;
+  }
+  if (!reply->body) {
+    if (maxage >= 0) {
+      uint8_t buf[4];
+
+      return coap_update_option(pdu, COAP_OPTION_MAXAGE,
+                                coap_encode_var_safe(buf, sizeof(buf),
+                                                     maxage),
+                                buf) != 0;
+    }
+    return 1;
+  }
+  if (coap_check_option(reply->pdu, COAP_OPTION_OSCORE, &opt_iter))
+    /* The OSCORE ciphertext goes back as it came, in a single message */
+    return coap_add_data(pdu, reply->body->length, reply->body->s);
+
+  /* Dropped by coap_proxy_release_reply() */
+  reply->ref++;
+  return coap_add_data_large_response(resource, session, request, pdu,
+                                      token, query, reply->media_type,
+                                      maxage >= 0 ? maxage : reply->maxage,
+                                      reply->etag, reply->body->length,
+                                      reply->body->s,
+                                      coap_proxy_release_reply, reply);
+}
+
+/*
+ * Sends @p reply back to the client of @p req and forgets about @p req.
+ */
+static void
+coap_proxy_request_reply(coap_proxy_request_t *req,
+                         coap_proxy_reply_t *reply) {
+  coap_session_t *incoming = req->incoming;
+  coap_pdu_t *pdu;
+  coap_pdu_t *block_request = NULL;
+
+  pdu = coap_pdu_init(req->in_type == COAP_MESSAGE_CON ?
+                        COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+                      reply->pdu->code, coap_new_message_id(incoming),
+                      coap_session_max_pdu_size(incoming));
+  if (!pdu || !coap_add_token(pdu, req->in_token->length, req->in_token->s)) {
+    coap_delete_pdu(pdu);
+    coap_proxy_request_fail(req, COAP_RESPONSE_CODE(500));
+    return;
+  }
+
+  if (req->block2_opt) {
+    /* So that the block size the client asked for is used */
+    uint8_t buf[4];
+
+    block_request = coap_pdu_init(COAP_MESSAGE_CON, req->code, 0, 16);
+    if (block_request)
+      coap_add_option(block_request, req->block2_opt,
+                      coap_encode_var_safe(buf, sizeof(buf),
+                                           (req->block2.num << 4) |
+                                           (req->block2.m << 3) |
+                                           req->block2.szx),
+                      buf);
+  }
+  if (!coap_proxy_add_reply(reply, req->resource, incoming, block_request,
+                            pdu, req->in_token, req->query, -1))
+    coap_log(LOG_DEBUG, "proxy: cannot pass back the whole response\n");
+  coap_delete_pdu(block_request);
+
+  if (!coap_log_enabled(LOG_DEBUG))
+    coap_show_pdu(LOG_INFO, pdu);
+
+  if (coap_send_large(incoming, pdu) == COAP_INVALID_MID)
+    coap_log(LOG_DEBUG, "proxy: cannot send response to client\n");
+  coap_proxy_request_free(req);
+}
+
+/*
+ * Keeps @p reply to the GET or FETCH @p req in proxy->replies for its
+ * Max-Age, dropping the oldest reply when there are max_cached of them.
+ */
+static void
+coap_proxy_cache_reply(coap_proxy_t *proxy, coap_proxy_request_t *req,
+                       coap_proxy_reply_t *reply) {
+  coap_proxy_reply_t *old;
+  unsigned int max_age;
+  coap_tick_t now;
+
+  if (reply->pdu->code != COAP_RESPONSE_CODE(205))
+    return;
+  max_age = reply->maxage >= 0 ? (unsigned int)reply->maxage :
+                                 COAP_DEFAULT_MAX_AGE;
+  if (max_age == 0)
+    return;
+
+  HASH_FIND(hh, proxy->replies, &req->cache_key, sizeof(coap_cache_key_t),
+            old);
+  if (old)
+    coap_proxy_uncache_reply(proxy, old);
+  while (HASH_COUNT(proxy->replies) >= proxy->config.max_cached)
+    coap_proxy_uncache_reply(proxy, proxy->replies);
+
+  coap_io_ticks(proxy->context, &now);
+  reply->cache_key = req->cache_key;
+  reply->origin = req->origin;
+  reply->request_code = req->code;
+  reply->fresh_ticks = now + (coap_tick_t)max_age * COAP_TICKS_PER_SECOND;
+  reply->ref++;
+  HASH_ADD(hh, proxy->replies, cache_key, sizeof(coap_cache_key_t), reply);
+}
+
+/*
+ * Drops the replies cached for @p origin, as one of its resources may be
+ * about to change.
+ */
+static void
+coap_proxy_uncache_origin(coap_proxy_t *proxy, coap_proxy_origin_t *origin) {
+  coap_proxy_reply_t *reply, *rtmp;
+
+  HASH_ITER(hh, proxy->replies, reply, rtmp) {
+    if (reply->origin == origin)
+      coap_proxy_uncache_reply(proxy, reply);
+  }
+}
+
+static int
+coap_proxy_get_scheme_uri(coap_pdu_t *request, coap_opt_t *opt,
+                          coap_uri_t *uri) {
+  const char *opt_val = (const char*)coap_opt_value(opt);
+  size_t opt_len = coap_opt_length(opt);
+  coap_opt_iterator_t opt_iter;
+
+  if (opt_len == 9 && strncasecmp(opt_val, "coaps+tcp", 9) == 0) {
+    uri->scheme = COAP_URI_SCHEME_COAPS_TCP;
+    uri->port = COAPS_DEFAULT_PORT;
+  } else if (opt_len == 8 && strncasecmp(opt_val, "coap+tcp", 8) == 0) {
+    uri->scheme = COAP_URI_SCHEME_COAP_TCP;
+    uri->port = COAP_DEFAULT_PORT;
+  } else if (opt_len == 5 && strncasecmp(opt_val, "coaps", 5) == 0) {
+    uri->scheme = COAP_URI_SCHEME_COAPS;
+    uri->port = COAPS_DEFAULT_PORT;
+  } else if (opt_len == 4 && strncasecmp(opt_val, "coap", 4) == 0) {
+    uri->scheme = COAP_URI_SCHEME_COAP;
+    uri->port = COAP_DEFAULT_PORT;
+  } else {
+    coap_log(LOG_WARNING, "proxy: unsupported Proxy-Scheme '%.*s'\n",
+             (int)opt_len, opt_val);
+    return 0;
+  }
+
+  opt = coap_check_option(request, COAP_OPTION_URI_HOST, &opt_iter);
+  if (!opt) {
+    coap_log(LOG_WARNING, "proxy: Proxy-Scheme requires Uri-Host\n");
+    return 0;
+  }
+  uri->host.length = coap_opt_length(opt);
+  uri->host.s = coap_opt_value(opt);
+  opt = coap_check_option(request, COAP_OPTION_URI_PORT, &opt_iter);
+  if (opt)
+    uri->port = (uint16_t)coap_decode_var_bytes(coap_opt_value(opt),
+                                                coap_opt_length(opt));
+  return 1;
+}
+
+static int
+coap_proxy_scheme_supported(const coap_proxy_t *proxy,
+                            coap_uri_scheme_t scheme) {
+  switch (scheme) {
+  case COAP_URI_SCHEME_COAP:
+    return 1;
+  case COAP_URI_SCHEME_COAP_TCP:
+    return coap_tcp_is_supported();
+  case COAP_URI_SCHEME_COAPS:
+    /* The keys for the session need to come from the application */
+    return coap_dtls_is_supported() && proxy->config.new_session != NULL;
+  case COAP_URI_SCHEME_COAPS_TCP:
+    return coap_tls_is_supported() && proxy->config.new_session != NULL;
+  case COAP_URI_SCHEME_HTTP:
+  case COAP_URI_SCHEME_HTTPS:
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Adds the options in @p s, as split up by @p split, to @p optlist.
+ */
+static int
+coap_proxy_add_split(coap_optlist_t **optlist, uint16_t number,
+                     const coap_str_const_t *s,
+                     int (*split)(const uint8_t *, size_t, uint8_t *,
+                                  size_t *)) {
+  size_t buflen = s->length + 3 * (s->length + 1);
+  uint8_t *buf = coap_malloc_type(COAP_STRING, buflen);
+  uint8_t *p = buf;
+  int res;
+  int ok = 1;
+
+  if (!buf)
+    return 0;
+  res = split(s->s, s->length, buf, &buflen);
+  while (res-- > 0) {
+    if (!coap_insert_optlist(optlist,
+                             coap_new_optlist(number, coap_opt_length(p),
+                                              coap_opt_value(p)))) {
+      ok = 0;
+      break;
+    }
+    p += coap_opt_size(p);
+  }
+  coap_free_type(COAP_STRING, buf);
+  return ok;
+}
+
+/*
+ * Puts together in req->optlist the options to send to the origin.
+ * Returns 0 if successful, else the response code for the client.
+ */
+static uint8_t
+coap_proxy_build_options(coap_proxy_t *proxy, coap_proxy_request_t *req,
+                         coap_pdu_t *request, const coap_uri_t *uri,
+                         int proxy_uri) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  int use_next_hop = proxy->next_hop.host.length != 0;
+
+  if (proxy_uri && !use_next_hop) {
+    /* Proxy-Uri is turned into Uri-Port, Uri-Path and Uri-Query */
+    if (uri->port != (coap_uri_scheme_is_secure(uri) ?
+                        COAPS_DEFAULT_PORT : COAP_DEFAULT_PORT)) {
+      uint8_t portbuf[2];
+
+      if (!coap_insert_optlist(&req->optlist,
+                    coap_new_optlist(COAP_OPTION_URI_PORT,
+                                     coap_encode_var_safe(portbuf,
+                                                          sizeof(portbuf),
+                                                          uri->port),
+                                     portbuf)))
+        return COAP_RESPONSE_CODE(500);
+    }
+    if ((uri->path.length &&
+         !coap_proxy_add_split(&req->optlist, COAP_OPTION_URI_PATH,
+                               &uri->path, coap_split_path)) ||
+        (uri->query.length &&
+         !coap_proxy_add_split(&req->optlist, COAP_OPTION_URI_QUERY,
+                               &uri->query, coap_split_query)))
+      return COAP_RESPONSE_CODE(500);
+  }
+
+  coap_option_iterator_init(request, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    /* Hop-Limit has already been decremented by handle_request() */
+    if (coap_proxy_hop_by_hop(opt_iter.type))
+      continue;
+    switch (opt_iter.type) {
+    case COAP_OPTION_PROXY_URI:
+    case COAP_OPTION_URI_HOST:
+    case COAP_OPTION_URI_PORT:
+    case COAP_OPTION_URI_PATH:
+    case COAP_OPTION_URI_QUERY:
+      /* Already in the Proxy-Uri (or the Uri-* options put together) */
+      if (use_next_hop || !proxy_uri)
+        break;
+      continue;
+    case COAP_OPTION_PROXY_SCHEME:
+      if (use_next_hop)
+        break;
+      continue;
+    default:
+      break;
+    }
+    if (!coap_insert_optlist(&req->optlist,
+                             coap_new_optlist(opt_iter.type,
+                                              coap_opt_length(option),
+                                              coap_opt_value(option))))
+      return COAP_RESPONSE_CODE(500);
+  }
+  return 0;
+}
+
+int
+coap_proxy_setup(coap_context_t *context, const coap_proxy_config_t *config) {
+  coap_proxy_t *proxy;
+
+  if (!context || !config)
+    return 0;
+  if (config->next_hop && (config->next_hop->host.length == 0 ||
+      config->next_hop->scheme == COAP_URI_SCHEME_HTTP ||
+      config->next_hop->scheme == COAP_URI_SCHEME_HTTPS)) {
+    coap_log(LOG_WARNING, "coap_proxy_setup: next hop not usable\n");
+    return 0;
+  }
+  if (context->proxy) {
+    coap_log(LOG_WARNING, "coap_proxy_setup: already set up\n");
+    return 0;
+  }
+
+  proxy = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_t));
+  if (!proxy)
+    return 0;
+  memset(proxy, 0, sizeof(coap_proxy_t));
+  proxy->context = context;
+  proxy->config = *config;
+  if (!proxy->config.max_requests)
+    proxy->config.max_requests = COAP_PROXY_DEFAULT_MAX_REQUESTS;
+  if (!proxy->config.max_queued)
+    proxy->config.max_queued = COAP_PROXY_DEFAULT_MAX_QUEUED;
+  if (!proxy->config.max_cached)
+    proxy->config.max_cached = COAP_PROXY_DEFAULT_MAX_CACHED;
+  if (config->next_hop) {
+    proxy->next_hop_host = coap_malloc_type(COAP_STRING,
+                                            config->next_hop->host.length);
+    if (!proxy->next_hop_host) {
+      coap_free_type(COAP_STRING, proxy);
+      return 0;
+    }
+    memcpy(proxy->next_hop_host, config->next_hop->host.s,
+           config->next_hop->host.length);
+    proxy->next_hop.scheme = config->next_hop->scheme;
+    proxy->next_hop.port = config->next_hop->port;
+    proxy->next_hop.host.s = proxy->next_hop_host;
+    proxy->next_hop.host.length = config->next_hop->host.length;
+  }
+  proxy->config.next_hop = NULL;
+  coap_prng(&proxy->next_token, sizeof(proxy->next_token));
+  /* Requests protected with OSCORE are passed on as they are */
+  coap_register_option(context, COAP_OPTION_OSCORE);
+  context->proxy = proxy;
+  return 1;
+}
+
+int
+coap_proxy_forward_request(coap_resource_t *resource,
+                           coap_session_t *session,
+                           coap_pdu_t *request,
+                           coap_pdu_t *response) {
+  coap_proxy_t *proxy = session->context->proxy;
+  coap_proxy_origin_t *origin;
+  coap_proxy_request_t *req;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_uri_t uri;
+  int proxy_uri = 0;
+  size_t size;
+  const uint8_t *data;
+  size_t offset;
+  size_t total;
+  coap_tick_t now;
+  uint8_t code;
+  coap_cache_key_t cache_key;
+  int keyed = 0;
+
+  if (!proxy) {
+    coap_log(LOG_WARNING, "proxy: coap_proxy_setup() not called\n");
+    response->code = COAP_RESPONSE_CODE(505);
+    return 0;
+  }
+
+  memset(&uri, 0, sizeof(uri));
+  opt = coap_check_option(request, COAP_OPTION_PROXY_URI, &opt_iter);
+  if (opt) {
+    if (coap_split_proxy_uri(coap_opt_value(opt), coap_opt_length(opt),
+                             &uri) < 0) {
+      /* RFC7252 Section 5.7.2 */
+      coap_log(LOG_WARNING, "proxy: Proxy-Uri not decodable\n");
+      response->code = COAP_RESPONSE_CODE(505);
+      return 0;
+    }
+    proxy_uri = 1;
+  } else {
+    opt = coap_check_option(request, COAP_OPTION_PROXY_SCHEME, &opt_iter);
+    if (!opt) {
+      response->code = COAP_RESPONSE_CODE(404);
+      return 0;
+    }
+    if (!coap_proxy_get_scheme_uri(request, opt, &uri)) {
+      response->code = COAP_RESPONSE_CODE(505);
+      return 0;
+    }
+  }
+
+  if (uri.host.length == 0 || !coap_proxy_scheme_supported(proxy, uri.scheme)) {
+    coap_log(LOG_WARNING, "proxy: cannot forward to scheme %d\n", uri.scheme);
+    response->code = COAP_RESPONSE_CODE(505);
+    return 0;
+  }
+
+  if (coap_get_data_large(request, &size, &data, &offset, &total) &&
+      size != total) {
+    coap_log(LOG_WARNING, "proxy: request body incomplete\n");
+    response->code = COAP_RESPONSE_CODE(408);
+    return 0;
+  }
+
+  coap_io_ticks(session->context, &now);
+  /*
+   * A request protected with OSCORE is never the same as another, and
+   * neither is its response, so is always passed on by itself
+   */
+  if ((request->code == COAP_REQUEST_GET ||
+       request->code == COAP_REQUEST_FETCH) &&
+      !coap_check_option(request, COAP_OPTION_OSCORE, &opt_iter))
+    keyed = coap_cache_derive_key_buf(session, request,
+                                      COAP_CACHE_NOT_SESSION_BASED, &cache_key);
+  if (keyed) {
+    coap_proxy_reply_t *reply;
+    coap_proxy_request_t *leader;
+
+    HASH_FIND(hh, proxy->replies, &cache_key, sizeof(cache_key), reply);
+    if (reply && reply->fresh_ticks <= now) {
+      coap_proxy_uncache_reply(proxy, reply);
+      reply = NULL;
+    }
+    if (reply && reply->request_code == request->code) {
+      coap_binary_t token;
+      coap_string_t *query = coap_get_query(request);
+      int ok;
+
+      token.length = request->token_length;
+      token.s = request->token;
+      /* The client may only keep the response for as long as is left */
+      ok = coap_proxy_add_reply(reply, resource, session, request, response,
+                                &token, query,
+                                (int)((reply->fresh_ticks - now) /
+                                      COAP_TICKS_PER_SECOND));
+      coap_delete_string(query);
+      if (!ok && response->code == reply->pdu->code)
+        response->code = COAP_RESPONSE_CODE(500);
+      coap_log(LOG_DEBUG, "proxy: answered request from cache\n");
+      return ok;
+    }
+
+    HASH_FIND(kh, proxy->pending, &cache_key, sizeof(cache_key), leader);
+    if (leader && leader->code == request->code) {
+      /* Wait for the response to the identical request */
+      req = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_request_t));
+      if (!req) {
+        response->code = COAP_RESPONSE_CODE(500);
+        return 0;
+      }
+      memset(req, 0, sizeof(coap_proxy_request_t));
+      req->origin = leader->origin;
+      req->leader = leader;
+      req->incoming = coap_session_reference(session);
+      req->resource = resource;
+      req->in_type = request->type;
+      req->code = request->code;
+      if (coap_get_block(request, COAP_OPTION_BLOCK2, &req->block2))
+        req->block2_opt = COAP_OPTION_BLOCK2;
+      else if (coap_get_block(request, COAP_OPTION_Q_BLOCK2, &req->block2))
+        req->block2_opt = COAP_OPTION_Q_BLOCK2;
+      DL_APPEND(leader->waiters, req);
+      req->in_token = coap_new_binary(request->token_length);
+      req->query = coap_get_query(request);
+      if (!req->in_token) {
+        coap_proxy_request_free(req);
+        response->code = COAP_RESPONSE_CODE(500);
+        return 0;
+      }
+      if (request->token_length)
+        memcpy(req->in_token->s, request->token, request->token_length);
+      coap_log(LOG_DEBUG, "proxy: request joins identical one to '%s'\n",
+               leader->origin->key);
+      return 1;
+    }
+  }
+
+  if (proxy->next_hop.host.length)
+    origin = coap_proxy_get_origin(proxy, proxy->next_hop.scheme,
+                                   &proxy->next_hop.host,
+                                   proxy->next_hop.port);
+  else
+    origin = coap_proxy_get_origin(proxy, uri.scheme, &uri.host, uri.port);
+  if (!origin) {
+    response->code = COAP_RESPONSE_CODE(500);
+    return 0;
+  }
+  if (request->code != COAP_REQUEST_GET &&
+      request->code != COAP_REQUEST_FETCH)
+    /* The origin's resources may be about to change */
+    coap_proxy_uncache_origin(proxy, origin);
+
+  coap_proxy_origin_expire(origin, now);
+  coap_proxy_origin_dispatch(origin);
+  if (origin->in_flight >= proxy->config.max_requests &&
+      origin->queued >= proxy->config.max_queued) {
+    coap_log(LOG_DEBUG, "proxy: too many requests for '%s'\n", origin->key);
+    response->code = COAP_RESPONSE_CODE(503);
+    return 0;
+  }
+
+  req = coap_malloc_type(COAP_STRING, sizeof(coap_proxy_request_t));
+  if (!req) {
+    response->code = COAP_RESPONSE_CODE(500);
+    return 0;
+  }
+  memset(req, 0, sizeof(coap_proxy_request_t));
+  req->origin = origin;
+  req->incoming = coap_session_reference(session);
+  req->resource = resource;
+  req->in_type = request->type;
+  req->code = request->code;
+  if (coap_get_block(request, COAP_OPTION_BLOCK2, &req->block2))
+    req->block2_opt = COAP_OPTION_BLOCK2;
+  else if (coap_get_block(request, COAP_OPTION_Q_BLOCK2, &req->block2))
+    req->block2_opt = COAP_OPTION_Q_BLOCK2;
+  req->token = proxy->next_token++;
+  req->parked = 1;
+  HASH_ADD(hh, proxy->requests, token, sizeof(req->token), req);
+  DL_APPEND(origin->parked, req);
+  origin->queued++;
+  if (keyed) {
+    coap_proxy_request_t *pending;
+
+    req->cache_key = cache_key;
+    req->keyed = 1;
+    HASH_FIND(kh, proxy->pending, &cache_key, sizeof(cache_key), pending);
+    if (!pending) {
+      HASH_ADD(kh, proxy->pending, cache_key, sizeof(coap_cache_key_t), req);
+      req->pending = 1;
+    }
+  }
+
+  req->in_token = coap_new_binary(request->token_length);
+  req->query = coap_get_query(request);
+  if (!req->in_token || (size && !(req->body = coap_new_binary(size)))) {
+    coap_proxy_request_free(req);
+    response->code = COAP_RESPONSE_CODE(500);
+    return 0;
+  }
+  if (request->token_length)
+    memcpy(req->in_token->s, request->token, request->token_length);
+  if (size)
+    memcpy(req->body->s, data, size);
+
+  code = coap_proxy_build_options(proxy, req, request, &uri, proxy_uri);
+  if (code == 0 && origin->in_flight < proxy->config.max_requests)
+    code = coap_proxy_request_send(req);
+  if (code) {
+    coap_proxy_request_free(req);
+    response->code = code;
+    return 0;
+  }
+  return 1;
+}
+
+int
+coap_proxy_handle_response(coap_session_t *session, coap_pdu_t *rcvd) {
+  coap_proxy_origin_t *origin = session->proxy_origin;
+  coap_proxy_request_t *req = NULL;
+  coap_proxy_reply_t *reply;
+  uint64_t token;
+  size_t size = 0;
+  const uint8_t *data = NULL;
+  size_t offset;
+  size_t total;
+  coap_binary_t *body = NULL;
+
+  if (!origin)
+    return 0;
+
+  if (rcvd->token_length == sizeof(token)) {
+    token = coap_decode_var_bytes8(rcvd->token, rcvd->token_length);
+    HASH_FIND(hh, origin->proxy->requests, &token, sizeof(token), req);
+  }
+  if (!req || req->origin != origin || req->parked) {
+    coap_log(LOG_DEBUG, "proxy: unknown response from '%s'\n", origin->key);
+    return 1;
+  }
+
+  if (!coap_log_enabled(LOG_DEBUG))
+    coap_show_pdu(LOG_INFO, rcvd);
+
+  /*
+   * With COAP_BLOCK_USE_LIBCOAP, but not COAP_BLOCK_SINGLE_BODY, the
+   * blocks of the response are passed up one by one.
+   */
+  if (coap_get_data_large(rcvd, &size, &data, &offset, &total) &&
+      size != total) {
+    if (!(session->block_mode & COAP_BLOCK_USE_LIBCOAP)) {
+      coap_log(LOG_WARNING, "proxy: Block2 response needs "
+                            "COAP_BLOCK_USE_LIBCOAP\n");
+      coap_proxy_request_fail(req, COAP_RESPONSE_CODE(502));
+      coap_proxy_origin_dispatch(origin);
+      return 1;
+    }
+    req->body_data = coap_block_build_body(req->body_data, size, data,
+                                           offset, total);
+    if (!req->body_data) {
+      coap_proxy_request_fail(req, COAP_RESPONSE_CODE(500));
+      coap_proxy_origin_dispatch(origin);
+      return 1;
+    }
+    if (offset + size != total)
+      return 1;
+    body = req->body_data;
+    req->body_data = NULL;
+  } else if (size) {
+    body = coap_new_binary(size);
+    if (!body) {
+      coap_proxy_request_fail(req, COAP_RESPONSE_CODE(500));
+      coap_proxy_origin_dispatch(origin);
+      return 1;
+    }
+    memcpy(body->s, data, size);
+  }
+
+  reply = coap_proxy_new_reply(rcvd, body);
+  if (!reply) {
+    coap_proxy_request_fail(req, COAP_RESPONSE_CODE(500));
+    coap_proxy_origin_dispatch(origin);
+    return 1;
+  }
+
+  /* Identical requests from now on are answered from the cache */
+  if (req->pending) {
+    HASH_DELETE(kh, origin->proxy->pending, req);
+    req->pending = 0;
+  }
+  if (req->keyed)
+    coap_proxy_cache_reply(origin->proxy, req, reply);
+
+  while (req->waiters)
+    coap_proxy_request_reply(req->waiters, reply);
+  coap_proxy_request_reply(req, reply);
+  coap_proxy_reply_release(reply);
+  coap_proxy_origin_dispatch(origin);
+  return 1;
+}
+
+int
+coap_proxy_handle_nack(coap_session_t *session, coap_pdu_t *sent,
+                       coap_nack_reason_t reason) {
+  coap_proxy_origin_t *origin = session->proxy_origin;
+  coap_proxy_request_t *req = NULL;
+  uint64_t token;
+
+  if (!origin || sent->token_length != sizeof(token))
+    return 0;
+  token = coap_decode_var_bytes8(sent->token, sent->token_length);
+  HASH_FIND(hh, origin->proxy->requests, &token, sizeof(token), req);
+  if (!req || req->origin != origin || req->parked)
+    return 0;
+
+  if (reason == COAP_NACK_ICMP_ISSUE)
+    /* Still being retransmitted */
+    return 1;
+  coap_proxy_request_fail(req, reason == COAP_NACK_TOO_MANY_RETRIES ?
+                                 COAP_RESPONSE_CODE(504) :
+                                 COAP_RESPONSE_CODE(502));
+  /*
+   * The other reasons come from coap_session_disconnected(), which is not
+   * the place to be sending new requests
+   */
+  if (reason == COAP_NACK_TOO_MANY_RETRIES)
+    coap_proxy_origin_dispatch(origin);
+  return 1;
+}
+
+void
+coap_proxy_session_closed(coap_session_t *session) {
+  coap_proxy_origin_t *origin = session->proxy_origin;
+
+  if (!origin)
+    return;
+  origin->closed = 1;
+  while (origin->active)
+    coap_proxy_request_fail(origin->active, COAP_RESPONSE_CODE(502));
+  while (origin->parked)
+    coap_proxy_request_fail(origin->parked, COAP_RESPONSE_CODE(502));
+}
+
+void
+coap_proxy_free(coap_context_t *context) {
+  coap_proxy_t *proxy = context->proxy;
+  coap_proxy_origin_t *origin, *otmp;
+
+  if (!proxy)
+    return;
+  while (proxy->replies)
+    coap_proxy_uncache_reply(proxy, proxy->replies);
+  HASH_ITER(hh, proxy->origins, origin, otmp) {
+    while (origin->active)
+      coap_proxy_request_free(origin->active);
+    while (origin->parked)
+      coap_proxy_request_free(origin->parked);
+    if (origin->session) {
+      origin->session->proxy_origin = NULL;
+      coap_session_release(origin->session);
+    }
+    HASH_DELETE(hh, proxy->origins, origin);
+    coap_free_type(COAP_STRING, origin);
+  }
+  coap_free_type(COAP_STRING, proxy->next_hop_host);
+  coap_free_type(COAP_STRING, proxy);
+  context->proxy = NULL;
+}
+
+#else /* COAP_WITHOUT_PROXY */
+
+int
+coap_proxy_setup(coap_context_t *context, const coap_proxy_config_t *config) {
+  (void)context;
+  (void)config;
+  coap_log(LOG_WARNING, "coap_proxy_setup: not supported\n");
+  return 0;
+}
+
+int
+coap_proxy_forward_request(coap_resource_t *resource,
+                           coap_session_t *session,
+                           coap_pdu_t *request,
+                           coap_pdu_t *response) {
+  (void)resource;
+  (void)session;
+  (void)request;
+  response->code = COAP_RESPONSE_CODE(505);
+  return 0;
+}
+
+int
+coap_proxy_handle_response(coap_session_t *session, coap_pdu_t *rcvd) {
+  (void)session;
+  (void)rcvd;
+  return 0;
+}
+
+int
+coap_proxy_handle_nack(coap_session_t *session, coap_pdu_t *sent,
+                       coap_nack_reason_t reason) {
+  (void)session;
+  (void)sent;
+  (void)reason;
+  return 0;
+}
+
+void
+coap_proxy_session_closed(coap_session_t *session) {
+  (void)session;
+}
+
+void
+coap_proxy_free(coap_context_t *context) {
+  (void)context;
+}
+
+#endif /* COAP_WITHOUT_PROXY */
@@ -0,0 +1,454 @@
+/* coap_psk_store.c -- Pre-Shared Keys of the clients of a server
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#include <stdio.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* HAVE_SYS_STAT_H */
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#define COAP_PSK_STORE_MMAP 1
+#endif /* HAVE_MMAP && HAVE_SYS_MMAN_H */
+
+/*
+ * A store is an open addressing hash table of the identities, which is
+ * kept in memory just as it is laid out in a file:
+ *
+ *   coap_psk_store_header_t
+ *   coap_psk_slot_t[slots]   (slots is a power of two)
+ *   records                  (uint16_t identity length, uint16_t key
+ *                             length, identity, key)
+ *
+ * so that loading a file is no more than mapping it.  The numbers are in
+ * the byte order of the host that wrote the file.
+ *
+ * The context holds a reference on its store, and each lookup takes one
+ * for as long as it uses the store, so that the store can be replaced
+ * from another thread while lookups are going on.  The pointer swap and
+ * the taking of a reference are done under a spin lock, as they only take
+ * a few instructions.
+ */
+#define COAP_PSK_STORE_MAGIC "COAPPSK1"
+#define COAP_PSK_STORE_ORDER 0x01020304
+#define COAP_PSK_STORE_MIN_SLOTS 1024
+
+typedef struct coap_psk_store_header_t {
+  char magic[8];         /* COAP_PSK_STORE_MAGIC */
+  uint32_t order;        /* COAP_PSK_STORE_ORDER */
+  uint32_t count;        /* number of identities */
+  uint32_t slots;        /* size of the hash table */
+  uint32_t reserved;
+  uint64_t data_len;     /* size of the records */
+} coap_psk_store_header_t;
+
+typedef struct coap_psk_slot_t {
+  uint32_t hash;         /* hash of the identity */
+  uint32_t offset;       /* offset of the record + 1, or 0 if free */
+} coap_psk_slot_t;
+
+struct coap_psk_store_t {
+  unsigned int ref;      /* references held */
+  int frozen;            /* 1 if it can no longer be added to */
+  size_t count;          /* number of identities */
+  size_t slots;          /* size of slot */
+  coap_psk_slot_t *slot; /* the hash table */
+  uint8_t *data;         /* the records */
+  size_t data_len;       /* size of the records */
+  size_t data_size;      /* space allocated for data, 0 if in map */
+  void *map;             /* the file the store was loaded from, or NULL */
+  size_t map_len;
+};
+
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#define COAP_PSK_STORE_LOCK(c) \
+  while (__atomic_test_and_set(&(c)->psk_store_lock, __ATOMIC_ACQUIRE))
+#define COAP_PSK_STORE_UNLOCK(c) \
+  __atomic_clear(&(c)->psk_store_lock, __ATOMIC_RELEASE)
+#define COAP_PSK_STORE_REF_ADD(s) \
+  __atomic_add_fetch(&(s)->ref, 1, __ATOMIC_RELAXED)
+#define COAP_PSK_STORE_REF_SUB(s) \
+  __atomic_sub_fetch(&(s)->ref, 1, __ATOMIC_ACQ_REL)
+#else /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+#define COAP_PSK_STORE_LOCK(c)
+#define COAP_PSK_STORE_UNLOCK(c)
+#define COAP_PSK_STORE_REF_ADD(s) (++(s)->ref)
+#define COAP_PSK_STORE_REF_SUB(s) (--(s)->ref)
+#endif /* ! __GNUC__ || WITH_CONTIKI || WITH_LWIP */
+
+/* FNV-1a, which is part of the file format and so must not change */
+static uint32_t
+coap_psk_store_hash(const uint8_t *s, size_t len) {
+  uint32_t h = 0x811c9dc5;
+
+  while (len--) {
+    h ^= *s++;
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+coap_psk_store_t *
+coap_psk_store_new(void) {
+  coap_psk_store_t *store;
+
+  store = coap_malloc_type(COAP_STRING, sizeof(coap_psk_store_t));
+  if (!store)
+    return NULL;
+  memset(store, 0, sizeof(coap_psk_store_t));
+  store->ref = 1;
+  store->slots = COAP_PSK_STORE_MIN_SLOTS;
+  store->slot = coap_malloc_type(COAP_STRING,
+                                 store->slots * sizeof(coap_psk_slot_t));
+  if (!store->slot) {
+    coap_free_type(COAP_STRING, store);
+    return NULL;
+  }
+  memset(store->slot, 0, store->slots * sizeof(coap_psk_slot_t));
+  return store;
+}
+
+/*
+ * Returns the slot that holds @p identity, or the free slot it would go
+ * into.  There is always a free slot, as the table is kept at most 3/4
+ * full, unless a file that was loaded says otherwise.
+ */
+static coap_psk_slot_t *
+coap_psk_store_slot(const coap_psk_store_t *store, uint32_t hash,
+                    const uint8_t *identity, size_t identity_len) {
+  size_t mask = store->slots - 1;
+  size_t i = hash & mask;
+  size_t n;
+
+  for (n = 0; n < store->slots; n++, i = (i + 1) & mask) {
+    coap_psk_slot_t *slot = &store->slot[i];
+    size_t offset;
+    uint16_t len;
+
+    if (slot->offset == 0)
+      return slot;
+    if (slot->hash != hash)
+      continue;
+    offset = slot->offset - 1;
+    if (offset + 4 > store->data_len)
+      continue;
+    memcpy(&len, &store->data[offset], sizeof(len));
+    if (len == identity_len && offset + 4 + len <= store->data_len &&
+        (len == 0 || memcmp(&store->data[offset + 4], identity, len) == 0))
+      return slot;
+  }
+  return NULL;
+}
+
+static int
+coap_psk_store_grow(coap_psk_store_t *store) {
+  size_t slots = store->slots * 2;
+  coap_psk_slot_t *old = store->slot;
+  size_t i;
+
+  store->slot = coap_malloc_type(COAP_STRING, slots * sizeof(coap_psk_slot_t));
+  if (!store->slot) {
+    store->slot = old;
+    return 0;
+  }
+  memset(store->slot, 0, slots * sizeof(coap_psk_slot_t));
+  for (i = 0; i < store->slots; i++) {
+    if (old[i].offset) {
+      size_t j = old[i].hash & (slots - 1);
+
+      while (store->slot[j].offset)
+        j = (j + 1) & (slots - 1);
+      store->slot[j] = old[i];
+    }
+  }
+  coap_free_type(COAP_STRING, old);
+  store->slots = slots;
+  return 1;
+}
+
+int
+coap_psk_store_add(coap_psk_store_t *store, const coap_bin_const_t *identity,
+                   const coap_bin_const_t *key) {
+  coap_psk_slot_t *slot;
+  uint32_t hash;
+  size_t need;
+  uint16_t len;
+
+  if (!store || !identity || !key || store->frozen ||
+      identity->length > UINT16_MAX || key->length > UINT16_MAX ||
+      (identity->length && !identity->s) || (key->length && !key->s))
+    return 0;
+  need = 4 + identity->length + key->length;
+  if (store->data_len + need >= UINT32_MAX)
+    return 0;
+  if (store->data_len + need > store->data_size) {
+    size_t size = store->data_size ? store->data_size * 2 : 4096;
+    uint8_t *data;
+
+    while (size < store->data_len + need)
+      size *= 2;
+    data = coap_realloc_type(COAP_STRING, store->data, size);
+    if (!data)
+      return 0;
+    store->data = data;
+    store->data_size = size;
+  }
+  if ((store->count + 1) * 4 > store->slots * 3 &&
+      !coap_psk_store_grow(store))
+    return 0;
+
+  hash = coap_psk_store_hash(identity->s, identity->length);
+  slot = coap_psk_store_slot(store, hash, identity->s, identity->length);
+  if (!slot)
+    return 0;
+  if (slot->offset == 0)
+    store->count++;
+  /* A replaced key leaves its old record behind unused */
+  slot->hash = hash;
+  slot->offset = (uint32_t)store->data_len + 1;
+  len = (uint16_t)identity->length;
+  memcpy(&store->data[store->data_len], &len, sizeof(len));
+  len = (uint16_t)key->length;
+  memcpy(&store->data[store->data_len + 2], &len, sizeof(len));
+  if (identity->length)
+    memcpy(&store->data[store->data_len + 4], identity->s, identity->length);
+  if (key->length)
+    memcpy(&store->data[store->data_len + 4 + identity->length], key->s,
+           key->length);
+  store->data_len += need;
+  return 1;
+}
+
+size_t
+coap_psk_store_count(const coap_psk_store_t *store) {
+  return store ? store->count : 0;
+}
+
+int
+coap_psk_store_find(const coap_psk_store_t *store, const uint8_t *identity,
+                    size_t identity_len, coap_bin_const_t *key) {
+  coap_psk_slot_t *slot;
+  size_t offset;
+  uint16_t len;
+
+  slot = coap_psk_store_slot(store,
+                             coap_psk_store_hash(identity, identity_len),
+                             identity, identity_len);
+  if (!slot || slot->offset == 0)
+    return 0;
+  offset = slot->offset - 1 + 4 + identity_len;
+  memcpy(&len, &store->data[slot->offset - 1 + 2], sizeof(len));
+  if (offset + len > store->data_len)
+    return 0;
+  key->s = &store->data[offset];
+  key->length = len;
+  return 1;
+}
+
+int
+coap_psk_store_save(const coap_psk_store_t *store, const char *filename) {
+  coap_psk_store_header_t header;
+  FILE *fp;
+  int ok;
+
+  if (!store || !filename)
+    return 0;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COAP_PSK_STORE_MAGIC, sizeof(header.magic));
+  header.order = COAP_PSK_STORE_ORDER;
+  header.count = (uint32_t)store->count;
+  header.slots = (uint32_t)store->slots;
+  header.data_len = store->data_len;
+
+  fp = fopen(filename, "wb");
+  if (!fp) {
+    coap_log(LOG_WARNING, "coap_psk_store_save: %s: %s\n", filename,
+             coap_socket_strerror());
+    return 0;
+  }
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+       fwrite(store->slot, sizeof(coap_psk_slot_t), store->slots, fp) ==
+       store->slots &&
+       (store->data_len == 0 ||
+        fwrite(store->data, store->data_len, 1, fp) == 1);
+  if (fclose(fp) != 0)
+    ok = 0;
+  if (!ok)
+    coap_log(LOG_WARNING, "coap_psk_store_save: %s: write failed\n",
+             filename);
+  return ok;
+}
+
+static void
+coap_psk_store_unmap(void *map, size_t map_len) {
+#if COAP_PSK_STORE_MMAP
+  munmap(map, map_len);
+#else /* ! COAP_PSK_STORE_MMAP */
+  (void)map_len;
+  coap_free_type(COAP_STRING, map);
+#endif /* ! COAP_PSK_STORE_MMAP */
+}
+
+/* Maps (or reads in) the whole of @p filename, returning NULL on failure */
+static void *
+coap_psk_store_map(const char *filename, size_t *length) {
+  void *map;
+#if COAP_PSK_STORE_MMAP
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  *length = (size_t)st.st_size;
+  map = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+#else /* ! COAP_PSK_STORE_MMAP */
+  FILE *fp = fopen(filename, "rb");
+  long size;
+
+  if (!fp)
+    return NULL;
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) <= 0 ||
+      fseek(fp, 0, SEEK_SET) != 0) {
+    fclose(fp);
+    return NULL;
+  }
+  *length = (size_t)size;
+  map = coap_malloc_type(COAP_STRING, *length);
+  if (map && fread(map, *length, 1, fp) != 1) {
+    coap_free_type(COAP_STRING, map);
+    map = NULL;
+  }
+  fclose(fp);
+#endif /* ! COAP_PSK_STORE_MMAP */
+  return map;
+}
+
+coap_psk_store_t *
+coap_psk_store_load(const char *filename) {
+  coap_psk_store_header_t header;
+  coap_psk_store_t *store;
+  size_t map_len = 0;
+  uint8_t *map;
+
+  if (!filename)
+    return NULL;
+  map = coap_psk_store_map(filename, &map_len);
+  if (!map) {
+    coap_log(LOG_WARNING, "coap_psk_store_load: %s: %s\n", filename,
+             coap_socket_strerror());
+    return NULL;
+  }
+  if (map_len < sizeof(header))
+    goto bad;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, COAP_PSK_STORE_MAGIC, sizeof(header.magic)) ||
+      header.order != COAP_PSK_STORE_ORDER ||
+      header.slots == 0 || (header.slots & (header.slots - 1)) ||
+      header.count >= header.slots ||
+      (map_len - sizeof(header)) / sizeof(coap_psk_slot_t) < header.slots ||
+      map_len - sizeof(header) - header.slots * sizeof(coap_psk_slot_t) !=
+      header.data_len)
+    goto bad;
+
+  store = coap_malloc_type(COAP_STRING, sizeof(coap_psk_store_t));
+  if (!store) {
+    coap_psk_store_unmap(map, map_len);
+    return NULL;
+  }
+  memset(store, 0, sizeof(coap_psk_store_t));
+  store->ref = 1;
+  store->frozen = 1;
+  store->count = header.count;
+  store->slots = header.slots;
+  store->slot = (coap_psk_slot_t *)(map + sizeof(header));
+  store->data = map + sizeof(header) + header.slots * sizeof(coap_psk_slot_t);
+  store->data_len = (size_t)header.data_len;
+  store->map = map;
+  store->map_len = map_len;
+  return store;
+
+bad:
+  coap_log(LOG_WARNING, "coap_psk_store_load: %s: not a PSK store\n",
+           filename);
+  coap_psk_store_unmap(map, map_len);
+  return NULL;
+}
+
+static void
+coap_psk_store_release(coap_psk_store_t *store) {
+  if (COAP_PSK_STORE_REF_SUB(store) != 0)
+    return;
+  if (store->map) {
+    coap_psk_store_unmap(store->map, store->map_len);
+  } else {
+    coap_free_type(COAP_STRING, store->slot);
+    coap_free_type(COAP_STRING, store->data);
+  }
+  coap_free_type(COAP_STRING, store);
+}
+
+void
+coap_psk_store_free(coap_psk_store_t *store) {
+  if (store)
+    coap_psk_store_release(store);
+}
+
+int
+coap_context_set_psk_store(coap_context_t *context, coap_psk_store_t *store) {
+  coap_psk_store_t *old;
+
+  if (!context)
+    return 0;
+  if (store)
+    store->frozen = 1;
+  COAP_PSK_STORE_LOCK(context);
+  old = context->psk_store;
+  context->psk_store = store;
+  COAP_PSK_STORE_UNLOCK(context);
+  if (old)
+    coap_psk_store_release(old);
+  return 1;
+}
+
+int
+coap_psk_store_set_session_key(coap_session_t *session,
+                               const uint8_t *identity, size_t identity_len) {
+  coap_context_t *context = session->context;
+  coap_psk_store_t *store;
+  coap_bin_const_t key;
+  int found = 0;
+
+  COAP_PSK_STORE_LOCK(context);
+  store = context->psk_store;
+  if (store)
+    COAP_PSK_STORE_REF_ADD(store);
+  COAP_PSK_STORE_UNLOCK(context);
+  if (!store)
+    return 0;
+
+  if (coap_psk_store_find(store, identity, identity_len, &key))
+    found = coap_session_refresh_psk_key(session, &key);
+  coap_psk_store_release(store);
+  return found;
+}
+
+void
+coap_psk_store_release_all(coap_context_t *context) {
+  coap_context_set_psk_store(context, NULL);
+}
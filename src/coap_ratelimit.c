@@ -0,0 +1,246 @@
+/* coap_ratelimit.c -- Rate limiting of the peers
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The token buckets are kept in a fixed size table of sets of
+ * COAP_RATELIMIT_WAYS entries, picked by the seeded hash of the peer's
+ * address.  A peer that is not in its set takes the place of the one that
+ * was least recently refilled, starting with a full bucket, so the table
+ * never grows however many addresses a flood comes from.  Two peers whose
+ * addresses hash to the same value share a bucket.
+ */
+#define COAP_RATELIMIT_WAYS 4
+
+/* The tokens are kept in thousandths of a datagram */
+#define COAP_RATELIMIT_UNIT 1000
+
+/* Keeps burst * COAP_RATELIMIT_UNIT within 32 bits */
+#define COAP_RATELIMIT_MAX_BURST 4000000
+
+typedef struct coap_ratelimit_peer_t {
+  uint32_t tag;           /* hash of the address, or 0 if free */
+  uint32_t tokens;        /* tokens left, in COAP_RATELIMIT_UNIT */
+  coap_tick_t refilled;   /* when the tokens were last added to */
+  coap_tick_t answered;   /* when the last 5.03 was sent, or 0 */
+} coap_ratelimit_peer_t;
+
+struct coap_ratelimit_state_t {
+  coap_ratelimit_t limits;
+  unsigned int mask;              /* number of sets - 1 */
+  coap_ratelimit_peer_t *peers;
+};
+
+int
+coap_context_set_ratelimit(coap_context_t *context,
+                           const coap_ratelimit_t *limits) {
+  coap_ratelimit_state_t *state;
+  unsigned int sets = 1;
+  unsigned int peers;
+
+  if (limits && limits->rate == 0) {
+    coap_log(LOG_WARNING, "coap_context_set_ratelimit: rate must be set\n");
+    return 0;
+  }
+  if (context->ratelimit) {
+    coap_free_type(COAP_STRING, context->ratelimit->peers);
+    coap_free_type(COAP_STRING, context->ratelimit);
+    context->ratelimit = NULL;
+  }
+  if (!limits)
+    return 1;
+
+  peers = limits->peers ? limits->peers : COAP_RATELIMIT_DEFAULT_PEERS;
+  while (sets < 0x10000 && sets * COAP_RATELIMIT_WAYS < peers)
+    sets <<= 1;
+  state = coap_malloc_type(COAP_STRING, sizeof(coap_ratelimit_state_t));
+  if (!state)
+    return 0;
+  state->peers = coap_malloc_type(COAP_STRING,
+                          sets * COAP_RATELIMIT_WAYS * sizeof(*state->peers));
+  if (!state->peers) {
+    coap_free_type(COAP_STRING, state);
+    return 0;
+  }
+  memset(state->peers, 0, sets * COAP_RATELIMIT_WAYS * sizeof(*state->peers));
+  state->limits = *limits;
+  if (state->limits.burst == 0)
+    state->limits.burst = limits->rate;
+  if (state->limits.burst > COAP_RATELIMIT_MAX_BURST)
+    state->limits.burst = COAP_RATELIMIT_MAX_BURST;
+  state->mask = sets - 1;
+  context->ratelimit = state;
+  return 1;
+}
+
+/*
+ * Hashes the address of the peer without the port, so that a peer cannot
+ * get a fresh bucket by sending from another port.
+ */
+static uint32_t
+coap_ratelimit_hash(const coap_address_t *remote) {
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+  switch (remote->addr.sa.sa_family) {
+  case AF_INET:
+    return coap_uthash_hash(&remote->addr.sin.sin_addr,
+                            sizeof(remote->addr.sin.sin_addr));
+  case AF_INET6:
+    return coap_uthash_hash(&remote->addr.sin6.sin6_addr,
+                            sizeof(remote->addr.sin6.sin6_addr));
+#ifdef COAP_AF_UNIX_SUPPORT
+  case AF_UNIX:
+    return coap_uthash_hash(remote->addr.cun.sun_path,
+                            strlen(remote->addr.cun.sun_path));
+#endif /* COAP_AF_UNIX_SUPPORT */
+  default:
+    break;
+  }
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+  {
+    coap_address_t addr;
+
+    coap_address_copy(&addr, remote);
+    coap_address_set_port(&addr, 0);
+    return coap_uthash_hash(&addr, sizeof(addr));
+  }
+}
+
+/* Returns the bucket of the peer with hash @p h, refilled up to @p now */
+static coap_ratelimit_peer_t *
+coap_ratelimit_peer(coap_ratelimit_state_t *state, uint32_t h,
+                    coap_tick_t now) {
+  const coap_ratelimit_t *limits = &state->limits;
+  uint32_t max = limits->burst * COAP_RATELIMIT_UNIT;
+  coap_ratelimit_peer_t *set;
+  coap_ratelimit_peer_t *peer = NULL;
+  coap_tick_t full;
+  unsigned int i;
+
+  if (h == 0)
+    h = 1;
+  set = &state->peers[(h & state->mask) * COAP_RATELIMIT_WAYS];
+  for (i = 0; i < COAP_RATELIMIT_WAYS; i++) {
+    if (set[i].tag == h) {
+      peer = &set[i];
+      break;
+    }
+    if (!peer || set[i].refilled < peer->refilled)
+      peer = &set[i];
+  }
+  if (peer->tag != h) {
+    /* A free entry, or the one least recently refilled */
+    peer->tag = h;
+    peer->tokens = max;
+    peer->refilled = now;
+    peer->answered = 0;
+    return peer;
+  }
+
+  /* The time it takes to refill an empty bucket */
+  full = ((coap_tick_t)limits->burst * COAP_TICKS_PER_SECOND +
+          limits->rate - 1) / limits->rate;
+  if (now - peer->refilled >= full) {
+    peer->tokens = max;
+    peer->refilled = now;
+  } else {
+    uint64_t add = (uint64_t)(now - peer->refilled) * limits->rate *
+                   COAP_RATELIMIT_UNIT / COAP_TICKS_PER_SECOND;
+
+    /* Leave a fraction of a tick to the next time */
+    if (add) {
+      peer->tokens = add >= max - peer->tokens ? max :
+                                                 peer->tokens + (uint32_t)add;
+      peer->refilled = now;
+    }
+  }
+  return peer;
+}
+
+/*
+ * Answers the request in @p data with 5.03 straight from the header, without
+ * setting up a session or a PDU.  Anything else is left unanswered.
+ */
+static void
+coap_ratelimit_reject(coap_endpoint_t *endpoint, const coap_packet_t *packet,
+                      const uint8_t *data, size_t length) {
+  unsigned int max_age = endpoint->context->ratelimit->limits.max_age;
+  uint8_t response[4 + 8 + 2 + 4];
+  coap_session_t session;
+  size_t token_length;
+  size_t len;
+  uint8_t type;
+
+  if (length < 4 || (data[0] >> 6) != COAP_DEFAULT_VERSION)
+    return;
+  type = (data[0] >> 4) & 0x03;
+  token_length = data[0] & 0x0f;
+  if ((type != COAP_MESSAGE_CON && type != COAP_MESSAGE_NON) ||
+      token_length > 8 || length < 4 + token_length ||
+      data[1] == 0 || data[1] >= 32)
+    return;
+
+  response[0] = (uint8_t)((COAP_DEFAULT_VERSION << 6) |
+                          ((type == COAP_MESSAGE_CON ? COAP_MESSAGE_ACK :
+                                                       COAP_MESSAGE_NON) << 4) |
+                          token_length);
+  response[1] = COAP_RESPONSE_CODE(503);
+  response[2] = data[2];
+  response[3] = data[3];
+  memcpy(&response[4], &data[4], token_length);
+  len = 4 + token_length;
+  if (max_age) {
+    /* Option delta 14 (Max-Age) takes one extended byte */
+    size_t opt_len = coap_encode_var_safe(&response[len + 2], 4, max_age);
+
+    response[len] = (uint8_t)((13 << 4) | opt_len);
+    response[len + 1] = COAP_OPTION_MAXAGE - 13;
+    len += 2 + opt_len;
+  }
+
+  /* Just enough of a session to send from the endpoint */
+  memset(&session, 0, sizeof(session));
+  session.proto = endpoint->proto;
+  session.type = COAP_SESSION_TYPE_SERVER;
+  session.context = endpoint->context;
+  session.endpoint = endpoint;
+  session.ifindex = packet->ifindex;
+  coap_address_copy(&session.addr_info.remote, &packet->addr_info.remote);
+  coap_address_copy(&session.addr_info.local, &packet->addr_info.local);
+  coap_session_send(&session, response, len);
+}
+
+int
+coap_ratelimit_check(coap_endpoint_t *endpoint, const coap_packet_t *packet,
+                     const uint8_t *data, size_t length, coap_tick_t now) {
+  coap_ratelimit_state_t *state = endpoint->context->ratelimit;
+  coap_ratelimit_peer_t *peer;
+
+  peer = coap_ratelimit_peer(state,
+                             coap_ratelimit_hash(&packet->addr_info.remote),
+                             now);
+  if (peer->tokens >= COAP_RATELIMIT_UNIT) {
+    peer->tokens -= COAP_RATELIMIT_UNIT;
+    return 1;
+  }
+
+  COAP_COUNT_ENDPOINT(endpoint, ratelimited, 1);
+  coap_log(LOG_DEBUG, "*  %s: datagram from peer over the rate dropped\n",
+           coap_endpoint_str(endpoint));
+  /*
+   * A DTLS datagram cannot be answered without its session, and multicast
+   * requests are not answered with errors (RFC 7252 Section 8.1)
+   */
+  if (state->limits.policy == COAP_RATELIMIT_503 &&
+      endpoint->proto == COAP_PROTO_UDP &&
+      !coap_is_mcast(&packet->addr_info.local) &&
+      (peer->answered == 0 ||
+       now - peer->answered >= COAP_TICKS_PER_SECOND)) {
+    peer->answered = now;
+    coap_ratelimit_reject(endpoint, packet, data, length);
+  }
+  return 0;
+}
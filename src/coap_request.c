@@ -0,0 +1,314 @@
+/* coap_request.c -- Handlers of the requests sent by a session
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The handlers of the requests sent with coap_send_request() are hashed by
+ * token in the session, so that a response is matched to its request
+ * without going through the response handler of the context.  Those with
+ * a timeout are also kept in a list in the order they are due, which is
+ * searched from the tail when a request is added, so that it is in the
+ * right place straight away when the requests use the same timeout.  The
+ * timeouts are carried out by the timers of the session.  The handler of a
+ * request sent to a multicast group with coap_send_group_request() is
+ * given every response until the timeout, which ends the collection.
+ * coap_send_request_scatter() copies the encoded options and payload of a
+ * template into the request of each session, behind a token and message
+ * id of the session's own.
+ */
+struct coap_request_cb_t {
+  UT_hash_handle hh;
+  struct coap_request_cb_t *prev;  /* in request_due, if due is set */
+  struct coap_request_cb_t *next;
+  coap_tick_t due;                 /* when the request times out, or 0 */
+  coap_request_handler_t handler;
+  void *arg;
+  int group;                       /* collects the responses of a group */
+  size_t token_length;
+  uint8_t token[8];                /* key */
+};
+
+static coap_request_cb_t *
+coap_request_find(coap_session_t *session, const uint8_t *token,
+                  size_t token_length) {
+  coap_request_cb_t *cb;
+
+  if (!session->request_cbs)
+    return NULL;
+  HASH_FIND(hh, session->request_cbs, token, token_length, cb);
+  return cb;
+}
+
+/* Takes @p cb out of the list of the requests with a timeout */
+static void
+coap_request_no_timeout(coap_session_t *session, coap_request_cb_t *cb) {
+  if (cb->due) {
+    DL_DELETE(session->request_due, cb);
+    cb->due = 0;
+  }
+}
+
+static void
+coap_request_unlink(coap_session_t *session, coap_request_cb_t *cb) {
+  coap_request_no_timeout(session, cb);
+  HASH_DELETE(hh, session->request_cbs, cb);
+}
+
+static coap_mid_t
+coap_request_send(coap_session_t *session, coap_pdu_t *pdu,
+                  coap_request_handler_t handler, void *arg,
+                  unsigned int timeout_ms, int group, const char *who) {
+  coap_request_cb_t *cb;
+  coap_mid_t mid;
+  uint8_t token[8];
+  size_t token_length;
+
+  if (!session || !pdu || !COAP_PDU_IS_REQUEST(pdu) ||
+      pdu->token_length > sizeof(cb->token)) {
+    coap_log(LOG_WARNING, "%s: not a valid request\n", who);
+    goto error;
+  }
+  if (coap_request_find(session, pdu->token, pdu->token_length)) {
+    coap_log(LOG_WARNING, "%s: token already in use\n", who);
+    goto error;
+  }
+
+  cb = coap_malloc_type(COAP_STRING, sizeof(coap_request_cb_t));
+  if (!cb)
+    goto error;
+  memset(cb, 0, sizeof(coap_request_cb_t));
+  cb->handler = handler;
+  cb->arg = arg;
+  cb->group = group;
+  cb->token_length = pdu->token_length;
+  memcpy(cb->token, pdu->token, pdu->token_length);
+  HASH_ADD(hh, session->request_cbs, token, cb->token_length, cb);
+
+  if (timeout_ms) {
+    coap_request_cb_t *el;
+
+    coap_ticks(&cb->due);
+    cb->due += (coap_tick_t)timeout_ms * COAP_TICKS_PER_SECOND / 1000;
+    if (!cb->due)
+      cb->due = 1;
+    el = session->request_due ? session->request_due->prev : NULL;
+    while (el && el->due > cb->due)
+      el = el == session->request_due ? NULL : el->prev;
+    DL_APPEND_ELEM(session->request_due, el, cb);
+    coap_session_timer_arm(session, cb->due);
+  }
+
+  token_length = cb->token_length;
+  memcpy(token, cb->token, token_length);
+  mid = coap_send(session, pdu);
+  if (mid == COAP_INVALID_MID) {
+    /* The handler is not called for a request that was not sent */
+    cb = coap_request_find(session, token, token_length);
+    if (cb) {
+      coap_request_unlink(session, cb);
+      coap_free_type(COAP_STRING, cb);
+    }
+  }
+  return mid;
+
+error:
+  coap_delete_pdu(pdu);
+  return COAP_INVALID_MID;
+}
+
+coap_mid_t
+coap_send_request(coap_session_t *session, coap_pdu_t *pdu,
+                  coap_request_handler_t handler, void *arg,
+                  unsigned int timeout_ms) {
+  if (!handler)
+    return coap_send(session, pdu);
+  return coap_request_send(session, pdu, handler, arg, timeout_ms, 0,
+                           "coap_send_request");
+}
+
+coap_mid_t
+coap_send_group_request(coap_session_t *session, coap_pdu_t *pdu,
+                        coap_request_handler_t handler, void *arg,
+                        unsigned int timeout_ms) {
+  if (!session || !handler || !timeout_ms ||
+      !(session->sock.flags & COAP_SOCKET_MULTICAST) ||
+      (pdu && pdu->type != COAP_MESSAGE_NON)) {
+    coap_log(LOG_WARNING,
+             "coap_send_group_request: not a multicast NON request\n");
+    coap_delete_pdu(pdu);
+    return COAP_INVALID_MID;
+  }
+  return coap_request_send(session, pdu, handler, arg, timeout_ms, 1,
+                           "coap_send_group_request");
+}
+
+/* Copies @p tmpl for @p session, with a new token and message id */
+static coap_pdu_t *
+coap_request_copy(coap_session_t *session, const coap_pdu_t *tmpl) {
+  uint8_t token[8];
+  size_t token_length;
+  size_t length = tmpl->used_size - tmpl->token_length;
+  coap_pdu_t *pdu;
+
+  coap_session_new_token(session, &token_length, token);
+  pdu = coap_pdu_init(tmpl->type, tmpl->code, coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  if (!pdu)
+    return NULL;
+  if (!coap_add_token(pdu, token_length, token) ||
+      !coap_pdu_resize(pdu, pdu->used_size + length)) {
+    coap_delete_pdu(pdu);
+    return NULL;
+  }
+  /* The options and the payload, with its marker */
+  memcpy(pdu->token + pdu->used_size,
+         tmpl->token + tmpl->token_length, length);
+  pdu->used_size += length;
+  pdu->max_opt = tmpl->max_opt;
+  if (tmpl->data)
+    pdu->data = pdu->token + token_length + (tmpl->data - tmpl->token) -
+                tmpl->token_length;
+  return pdu;
+}
+
+size_t
+coap_send_request_scatter(coap_session_t **sessions, size_t count,
+                          const coap_pdu_t *pdu,
+                          coap_request_handler_t handler, void *arg,
+                          unsigned int timeout_ms) {
+  coap_context_t *batching = NULL;
+  size_t sent = 0;
+  size_t i;
+
+  if (!sessions || !pdu || !handler || !COAP_PDU_IS_REQUEST(pdu)) {
+    coap_log(LOG_WARNING, "coap_send_request_scatter: not a valid request\n");
+    return 0;
+  }
+
+  /*
+   * The datagrams of the sessions that send from an endpoint go out in as
+   * few system calls as possible, unless the context batches them anyway
+   * and flushes them itself.
+   */
+  for (i = 0; i < count; i++) {
+    if (sessions[i]->endpoint) {
+      if (!sessions[i]->context->tx_batch &&
+          coap_context_set_tx_batching(sessions[i]->context, 1))
+        batching = sessions[i]->context;
+      break;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    coap_session_t *session = sessions[i];
+    coap_pdu_t *copy = coap_request_copy(session, pdu);
+
+    if (!copy ||
+        coap_request_send(session, copy, handler, arg, timeout_ms, 0,
+                          "coap_send_request_scatter") == COAP_INVALID_MID) {
+      /* Every session hears about its request */
+      handler(session, NULL, COAP_REQUEST_STATUS_FAILED, arg);
+      continue;
+    }
+    sent++;
+  }
+
+  if (batching)
+    coap_context_set_tx_batching(batching, 0);
+  return sent;
+}
+
+int
+coap_cancel_request(coap_session_t *session, const coap_binary_t *token) {
+  coap_request_cb_t *cb;
+
+  cb = coap_request_find(session, token->s, token->length);
+  if (!cb)
+    return 0;
+  coap_request_unlink(session, cb);
+  coap_free_type(COAP_STRING, cb);
+  coap_cancel_all_messages(session->context, session, token->s,
+                           token->length);
+  return 1;
+}
+
+int
+coap_request_response(coap_session_t *session, coap_pdu_t *rcvd,
+                      coap_response_t *result) {
+  coap_request_cb_t *cb;
+  coap_opt_iterator_t opt_iter;
+  coap_block_t block;
+  coap_response_t ret;
+
+  cb = coap_request_find(session, rcvd->token, rcvd->token_length);
+  if (!cb)
+    return 0;
+
+  if (cb->group) {
+    /* Each member of the group answers, until the timeout */
+    ret = cb->handler(session, rcvd, COAP_REQUEST_STATUS_OK, cb->arg);
+  } else if (COAP_RESPONSE_CLASS(rcvd->code) == 2 &&
+      coap_check_option(rcvd, COAP_OPTION_OBSERVE, &opt_iter)) {
+    /* The notifications go on until the observation is cancelled */
+    coap_request_no_timeout(session, cb);
+    ret = cb->handler(session, rcvd, COAP_REQUEST_STATUS_OK, cb->arg);
+  } else if ((coap_get_block(rcvd, COAP_OPTION_BLOCK2, &block) ||
+              coap_get_block(rcvd, COAP_OPTION_Q_BLOCK2, &block)) &&
+             block.m) {
+    ret = cb->handler(session, rcvd, COAP_REQUEST_STATUS_OK, cb->arg);
+  } else {
+    coap_request_unlink(session, cb);
+    ret = cb->handler(session, rcvd, COAP_REQUEST_STATUS_OK, cb->arg);
+    coap_free_type(COAP_STRING, cb);
+  }
+  if (result)
+    *result = ret;
+  return 1;
+}
+
+int
+coap_request_nack(coap_session_t *session, const coap_pdu_t *sent) {
+  coap_request_cb_t *cb;
+
+  if (!COAP_PDU_IS_REQUEST(sent))
+    return 0;
+  cb = coap_request_find(session, sent->token, sent->token_length);
+  if (!cb)
+    return 0;
+  coap_request_unlink(session, cb);
+  cb->handler(session, NULL, COAP_REQUEST_STATUS_FAILED, cb->arg);
+  coap_free_type(COAP_STRING, cb);
+  return 1;
+}
+
+coap_tick_t
+coap_request_check_timeouts(coap_session_t *session, coap_tick_t now) {
+  coap_request_cb_t *cb;
+
+  while ((cb = session->request_due) != NULL && cb->due <= now) {
+    coap_log(LOG_DEBUG, "** %s: request timed out\n",
+             coap_session_str(session));
+    coap_request_unlink(session, cb);
+    /* No more retransmissions or blocks of the request */
+    coap_cancel_all_messages(session->context, session, cb->token,
+                             cb->token_length);
+    cb->handler(session, NULL, COAP_REQUEST_STATUS_TIMEOUT, cb->arg);
+    coap_free_type(COAP_STRING, cb);
+  }
+  return session->request_due ? session->request_due->due : 0;
+}
+
+void
+coap_request_free(coap_session_t *session) {
+  coap_request_cb_t *cb;
+
+  while ((cb = session->request_cbs) != NULL) {
+    coap_request_unlink(session, cb);
+    cb->handler(session, NULL, COAP_REQUEST_STATUS_FAILED, cb->arg);
+    coap_free_type(COAP_STRING, cb);
+  }
+}
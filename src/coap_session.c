@@ -18,6 +18,9 @@
 #include <sys/timerfd.h>
 #endif /* COAP_EPOLL_SUPPORT */
 #include <errno.h>
+#if defined(COAP_AF_UNIX_SUPPORT) && defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif /* COAP_AF_UNIX_SUPPORT && HAVE_UNISTD_H */
 
 void
 coap_session_set_max_retransmit (coap_session_t *session, unsigned int value) {
@@ -28,10 +31,21 @@ coap_session_set_max_retransmit (coap_session_t *session, unsigned int value) {
   return;
 }
 
+/* Converts @p value (in seconds) to microseconds */
+static uint32_t
+coap_fixed_point_us(coap_fixed_point_t value) {
+  return (uint32_t)value.integer_part * 1000000 +
+         (uint32_t)value.fractional_part * 1000;
+}
+
 void
 coap_session_set_ack_timeout (coap_session_t *session, coap_fixed_point_t value) {
   if (value.integer_part > 0 && value.fractional_part < 1000)
     session->ack_timeout = value;
+  if (session->cocoa &&
+      session->rtt.strong_samples + session->rtt.weak_samples == 0)
+    /* Nothing has been learnt yet, so start from the new value */
+    session->rtt.rto_us = coap_fixed_point_us(session->ack_timeout);
   coap_log(LOG_DEBUG, "***%s: session ack_timeout set to %d.%03d\n",
            coap_session_str(session), session->ack_timeout.integer_part,
            session->ack_timeout.fractional_part);
@@ -49,11 +63,38 @@ coap_session_set_ack_random_factor (coap_session_t *session,
   return;
 }
 
+void
+coap_session_set_max_payloads (coap_session_t *session, uint16_t value) {
+  if (value > 0)
+    session->max_payloads = value < COAP_MAX_PAYLOADS_LIMIT ?
+                            value : COAP_MAX_PAYLOADS_LIMIT;
+  coap_log(LOG_DEBUG, "***%s: session max_payloads set to %u\n",
+           coap_session_str(session), session->max_payloads);
+  return;
+}
+
+void
+coap_session_set_nstart (coap_session_t *session, unsigned int value) {
+  if (value > 0)
+    session->nstart = value;
+  coap_log(LOG_DEBUG, "***%s: session nstart set to %u\n",
+           coap_session_str(session), session->nstart);
+  if (session->delayqueue &&
+      session->state == COAP_SESSION_STATE_ESTABLISHED)
+    /* A larger window may let held back CON messages go */
+    coap_session_connected(session);
+}
+
 unsigned int
 coap_session_get_max_transmit (coap_session_t *session) {
   return session->max_retransmit;
 }
 
+unsigned int
+coap_session_get_nstart (coap_session_t *session) {
+  return session->nstart;
+}
+
 coap_fixed_point_t
 coap_session_get_ack_timeout (coap_session_t *session) {
   return session->ack_timeout;
@@ -64,9 +105,640 @@ coap_session_get_ack_random_factor (coap_session_t *session) {
   return session->ack_random_factor;
 }
 
+uint16_t
+coap_session_get_max_payloads (coap_session_t *session) {
+  return session->max_payloads;
+}
+
+/*
+ * CoCoA (draft-ietf-core-cocoa) keeps two estimators in the way of RFC 6298
+ * (alpha 1/8, beta 1/4): a strong one with K = 4 for the CON messages that
+ * were acknowledged at the first go, and a weak one with K = 1 for those
+ * that needed one or two retransmissions, timed from the first
+ * transmission.  A strong sample pulls the overall RTO half way to the
+ * strong RTO, a weak sample a quarter of the way to the weak RTO.
+ */
+#define COAP_COCOA_K_STRONG 4
+#define COAP_COCOA_K_WEAK 1
+
+/* The clock granularity, which K * RTTVAR is never less than */
+#define COAP_COCOA_GRANULARITY_US (1000000 / COAP_TICKS_PER_SECOND)
+
+void
+coap_session_set_cocoa(coap_session_t *session, int enable) {
+  if (enable && !session->cocoa) {
+    memset(&session->rtt, 0, sizeof(session->rtt));
+    session->rtt.rto_us = coap_fixed_point_us(session->ack_timeout);
+    session->rto_updated_us = coap_histogram_clock();
+  }
+  session->cocoa = enable ? 1 : 0;
+  coap_log(LOG_DEBUG, "***%s: session CoCoA %s\n",
+           coap_session_str(session), session->cocoa ? "on" : "off");
+}
+
+int
+coap_session_get_cocoa(coap_session_t *session) {
+  return session->cocoa;
+}
+
+int
+coap_session_get_rtt_stats(coap_session_t *session, coap_rtt_stats_t *stats) {
+  if (!session->cocoa)
+    return 0;
+  *stats = session->rtt;
+  return 1;
+}
+
+/* Updates one estimator with @p rtt, and returns its new RTO */
+static uint32_t
+coap_rtt_estimate(uint32_t *srtt, uint32_t *rttvar, uint32_t samples,
+                  uint32_t rtt, uint32_t k) {
+  uint32_t var;
+  uint32_t rto;
+
+  if (samples == 0) {
+    *srtt = rtt;
+    *rttvar = rtt / 2;
+  } else {
+    uint32_t delta = *srtt > rtt ? *srtt - rtt : rtt - *srtt;
+
+    *rttvar = *rttvar - *rttvar / 4 + delta / 4;
+    *srtt = *srtt - *srtt / 8 + rtt / 8;
+  }
+  var = k * *rttvar;
+  if (var < COAP_COCOA_GRANULARITY_US)
+    var = COAP_COCOA_GRANULARITY_US;
+  rto = *srtt + var;
+  return rto < COAP_COCOA_MAX_RTO_US ? rto : COAP_COCOA_MAX_RTO_US;
+}
+
+void
+coap_session_rtt_sample(coap_session_t *session, uint64_t sent_us,
+                        unsigned int retransmits) {
+  coap_rtt_stats_t *st = &session->rtt;
+  uint64_t now = coap_histogram_clock();
+  uint32_t rtt;
+
+  /* Beyond two retransmissions it is too unclear which one was answered */
+  if (!session->cocoa || retransmits > 2)
+    return;
+  rtt = now > sent_us + COAP_COCOA_MAX_RTO_US ? COAP_COCOA_MAX_RTO_US :
+        now > sent_us ? (uint32_t)(now - sent_us) : 0;
+  st->last_rtt_us = rtt;
+  if (retransmits == 0) {
+    st->strong_rto_us = coap_rtt_estimate(&st->strong_srtt_us,
+                                          &st->strong_rttvar_us,
+                                          st->strong_samples++, rtt,
+                                          COAP_COCOA_K_STRONG);
+    st->rto_us = st->rto_us / 2 + st->strong_rto_us / 2;
+  } else {
+    st->weak_rto_us = coap_rtt_estimate(&st->weak_srtt_us,
+                                        &st->weak_rttvar_us,
+                                        st->weak_samples++, rtt,
+                                        COAP_COCOA_K_WEAK);
+    st->rto_us = (uint32_t)(((uint64_t)st->rto_us * 3 + st->weak_rto_us) / 4);
+  }
+  session->rto_updated_us = now;
+  coap_log(LOG_DEBUG, "***%s: %s RTT %u.%03ums, RTO %u.%03ums\n",
+           coap_session_str(session), retransmits ? "weak" : "strong",
+           rtt / 1000, rtt % 1000, st->rto_us / 1000, st->rto_us % 1000);
+}
+
+uint32_t
+coap_session_rto(coap_session_t *session) {
+  coap_rtt_stats_t *st = &session->rtt;
+  uint64_t now = coap_histogram_clock();
+  uint64_t idle = now - session->rto_updated_us;
+
+  /*
+   * An estimate that has not been updated for a while is aged, as it may
+   * no longer hold: a small one is doubled after 16 RTOs, and a large one
+   * brought half way to 2 seconds after 4 RTOs.
+   */
+  if (st->rto_us < 1000000 && idle > (uint64_t)st->rto_us * 16) {
+    st->rto_us *= 2;
+    session->rto_updated_us = now;
+  } else if (st->rto_us > 3000000 && idle > (uint64_t)st->rto_us * 4) {
+    st->rto_us = 1000000 + st->rto_us / 2;
+    session->rto_updated_us = now;
+  }
+  return st->rto_us;
+}
+
+/*
+ * The sessions that have timeouts are kept in a pairing heap
+ * (context->session_timers) ordered by timer_due, the same way as the
+ * retransmission queue.  timer_prev points to the previous sibling, or to
+ * the parent for the first child.  A session is only checked once it is
+ * due, which then works out when it is next due.
+ */
+
+/* Melds the two heaps @p a and @p b and returns the new root. */
+static coap_session_t *
+coap_session_timer_meld(coap_session_t *a, coap_session_t *b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (b->timer_due < a->timer_due) {
+    coap_session_t *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  /* make b the first child of a */
+  b->timer_prev = a;
+  b->timer_sibling = a->timer_child;
+  if (a->timer_child)
+    a->timer_child->timer_prev = b;
+  a->timer_child = b;
+  return a;
+}
+
+/*
+ * Melds the list of siblings starting at @p first into a single heap using
+ * the standard two pass method and returns the new root.
+ */
+static coap_session_t *
+coap_session_timer_merge_pairs(coap_session_t *first) {
+  coap_session_t *pairs = NULL;
+  coap_session_t *root = NULL;
+
+  /* first pass: meld pairs left to right, collect them in reverse order */
+  while (first) {
+    coap_session_t *a = first;
+    coap_session_t *b = first->timer_sibling;
+
+    first = b ? b->timer_sibling : NULL;
+    a->timer_prev = a->timer_sibling = NULL;
+    if (b)
+      b->timer_prev = b->timer_sibling = NULL;
+    a = coap_session_timer_meld(a, b);
+    a->timer_sibling = pairs;
+    pairs = a;
+  }
+
+  /* second pass: meld the pairs right to left */
+  while (pairs) {
+    coap_session_t *next = pairs->timer_sibling;
+
+    pairs->timer_sibling = NULL;
+    root = coap_session_timer_meld(root, pairs);
+    pairs = next;
+  }
+  return root;
+}
+
+static void
+coap_session_timer_cancel(coap_session_t *session) {
+  coap_context_t *context = session->context;
+
+  if (!session->in_timers)
+    return;
+  if (session == context->session_timers) {
+    context->session_timers =
+                  coap_session_timer_merge_pairs(session->timer_child);
+  } else {
+    if (session->timer_prev->timer_child == session)
+      session->timer_prev->timer_child = session->timer_sibling;
+    else
+      session->timer_prev->timer_sibling = session->timer_sibling;
+    if (session->timer_sibling)
+      session->timer_sibling->timer_prev = session->timer_prev;
+    context->session_timers = coap_session_timer_meld(context->session_timers,
+                     coap_session_timer_merge_pairs(session->timer_child));
+  }
+  session->timer_child = session->timer_sibling = session->timer_prev = NULL;
+  session->in_timers = 0;
+}
+
+void
+coap_session_timer_arm(coap_session_t *session, coap_tick_t due) {
+  coap_context_t *context = session->context;
+
+  if (!context)
+    return;
+  /* Leave anything that becomes due while running the timers for the
+     next run */
+  if (context->session_timers_now && due <= context->session_timers_now)
+    due = context->session_timers_now + 1;
+  if (session->in_timers) {
+    if (session->timer_due <= due)
+      return;
+    coap_session_timer_cancel(session);
+  }
+  session->timer_due = due;
+  session->in_timers = 1;
+  context->session_timers = coap_session_timer_meld(context->session_timers,
+                                                    session);
+}
+
+static coap_tick_t
+coap_session_idle_ticks(coap_context_t *context) {
+  if (context->session_timeout > 0)
+    return context->session_timeout * COAP_TICKS_PER_SECOND;
+  return COAP_DEFAULT_SESSION_TIMEOUT * COAP_TICKS_PER_SECOND;
+}
+
+static void
+coap_session_lru_remove(coap_session_t *session) {
+  coap_endpoint_t *endpoint = session->endpoint;
+
+  if (session->in_idle_lru) {
+    DL_DELETE2(endpoint->idle_lru, session, idle_prev, idle_next);
+    endpoint->num_idle--;
+    session->in_idle_lru = 0;
+  }
+  if (session->in_hs_lru) {
+    DL_DELETE2(endpoint->hs_lru, session, hs_prev, hs_next);
+    endpoint->num_hs--;
+    session->in_hs_lru = 0;
+  }
+}
+
+void
+coap_session_lru_update(coap_session_t *session) {
+  coap_endpoint_t *endpoint = session->endpoint;
+
+  if (!endpoint)
+    return;
+  coap_session_lru_remove(session);
+  if (session->ref)
+    return;
+  if (session->type == COAP_SESSION_TYPE_SERVER) {
+    DL_APPEND2(endpoint->idle_lru, session, idle_prev, idle_next);
+    endpoint->num_idle++;
+    session->in_idle_lru = 1;
+    coap_session_timer_arm(session, session->last_rx_tx +
+                           coap_session_idle_ticks(session->context));
+  }
+  if (session->type == COAP_SESSION_TYPE_HELLO ||
+      (session->type == COAP_SESSION_TYPE_SERVER &&
+       session->state == COAP_SESSION_STATE_HANDSHAKE)) {
+    DL_APPEND2(endpoint->hs_lru, session, hs_prev, hs_next);
+    endpoint->num_hs++;
+    session->in_hs_lru = 1;
+  }
+}
+
+#define COAP_SESSION_INDEX_MIN_SLOTS 8
+
+COAP_STATIC_INLINE unsigned int
+coap_session_index_hash(const coap_addr_hash_t *key) {
+  return coap_uthash_hash(key, sizeof(*key));
+}
+
+/* Returns the slot that holds @p session, or -1 if it is not in @p index */
+static int
+coap_session_index_slot(const coap_session_index_t *index,
+                        const coap_session_t *session) {
+  unsigned int h, i;
+
+  if (!index->count)
+    return -1;
+  h = coap_session_index_hash(&session->addr_hash);
+  for (i = h & index->mask; index->ctrl[i]; i = (i + 1) & index->mask) {
+    if (index->sessions[index->pos[i]] == session)
+      return (int)i;
+  }
+  return -1;
+}
+
+/* Puts position @p pos with hash @p h into the first free slot */
+static void
+coap_session_index_insert(coap_session_index_t *index, unsigned int h,
+                          uint32_t pos) {
+  unsigned int i;
+
+  for (i = h & index->mask; index->ctrl[i]; i = (i + 1) & index->mask);
+  index->ctrl[i] = 0x80 | (h >> 25);
+  index->pos[i] = pos;
+}
+
+/* Doubles the slots of @p index, keeping the load below 3/4 */
+static int
+coap_session_index_grow(coap_session_index_t *index) {
+  size_t slots = index->mask ? ((size_t)index->mask + 1) * 2 :
+                               COAP_SESSION_INDEX_MIN_SLOTS;
+  size_t cap = slots / 4 * 3;
+  coap_session_index_t grown;
+  uint8_t *block;
+  uint32_t p;
+
+  if (slots > UINT32_MAX / 2)
+    return 0;
+  /* sessions, pos and ctrl share one block, in order of alignment */
+  block = (uint8_t *)coap_malloc(cap * sizeof(coap_session_t *) +
+                                 slots * (sizeof(uint32_t) + 1));
+  if (!block)
+    return 0;
+  grown.sessions = (coap_session_t **)block;
+  grown.pos = (uint32_t *)(block + cap * sizeof(coap_session_t *));
+  grown.ctrl = (uint8_t *)(grown.pos + slots);
+  grown.count = index->count;
+  grown.mask = (unsigned int)(slots - 1);
+  memset(grown.ctrl, 0, slots);
+  for (p = 0; p < index->count; p++) {
+    grown.sessions[p] = index->sessions[p];
+    coap_session_index_insert(&grown,
+                  coap_session_index_hash(&grown.sessions[p]->addr_hash), p);
+  }
+  coap_free(index->sessions);
+  *index = grown;
+  return 1;
+}
+
+coap_session_t *
+coap_session_index_find(const coap_session_index_t *index,
+                        const coap_addr_hash_t *key) {
+  unsigned int h, i;
+  uint8_t tag;
+
+  if (!index->count)
+    return NULL;
+  h = coap_session_index_hash(key);
+  tag = 0x80 | (h >> 25);
+  for (i = h & index->mask; index->ctrl[i]; i = (i + 1) & index->mask) {
+    if (index->ctrl[i] == tag) {
+      coap_session_t *session = index->sessions[index->pos[i]];
+
+      if (memcmp(&session->addr_hash, key, sizeof(*key)) == 0)
+        return session;
+    }
+  }
+  return NULL;
+}
+
+int
+coap_session_index_add(coap_session_index_t *index, coap_session_t *session) {
+  if ((!index->mask || index->count == (index->mask + 1) / 4 * 3) &&
+      !coap_session_index_grow(index))
+    return 0;
+  index->sessions[index->count] = session;
+  coap_session_index_insert(index,
+                            coap_session_index_hash(&session->addr_hash),
+                            index->count);
+  index->count++;
+  return 1;
+}
+
+void
+coap_session_index_remove(coap_session_index_t *index,
+                          coap_session_t *session) {
+  int slot = coap_session_index_slot(index, session);
+  unsigned int i, j, home;
+  uint32_t pos;
+  coap_session_t *last;
+
+  if (slot < 0)
+    return;
+  pos = index->pos[slot];
+
+  /* Empty the slot, moving back the slots after it that are allowed to be
+   * there (backward shift deletion), so that no tombstones are needed. */
+  i = (unsigned int)slot;
+  index->ctrl[i] = 0;
+  for (j = (i + 1) & index->mask; index->ctrl[j]; j = (j + 1) & index->mask) {
+    home = coap_session_index_hash(
+             &index->sessions[index->pos[j]]->addr_hash) & index->mask;
+    if (((j - home) & index->mask) >= ((j - i) & index->mask)) {
+      index->ctrl[i] = index->ctrl[j];
+      index->pos[i] = index->pos[j];
+      index->ctrl[j] = 0;
+      i = j;
+    }
+  }
+
+  /* Fill the hole in the dense array with the last session */
+  last = index->sessions[--index->count];
+  if (last != session) {
+    slot = coap_session_index_slot(index, last);
+    assert(slot >= 0);
+    index->pos[slot] = pos;
+    index->sessions[pos] = last;
+  }
+}
+
+void
+coap_session_index_free(coap_session_index_t *index) {
+  coap_free(index->sessions);
+  memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Carries out the timeouts of @p s that have expired and sets @p due to
+ * when the earliest of the others expires (0 if none).
+ *
+ * Returns 0 if @p s may have been freed, else 1.
+ */
+static int
+coap_session_check_timeouts(coap_session_t *s, coap_tick_t now,
+                            coap_tick_t *due) {
+  coap_context_t *ctx = s->context;
+  coap_tick_t s_due;
+
+  *due = 0;
+#define COAP_DUE_AT(t) do { if (*due == 0 || (t) < *due) *due = (t); } while (0)
+
+  if (s->pool_entry) {
+    if (!coap_session_pool_check(s, now, &s_due))
+      return 0;
+    if (s_due)
+      COAP_DUE_AT(s_due);
+  }
+  if (s->type == COAP_SESSION_TYPE_SERVER && s->ref == 0) {
+    s_due = s->last_rx_tx + coap_session_idle_ticks(ctx);
+    if (s->delayqueue == NULL &&
+        (s_due <= now || s->state == COAP_SESSION_STATE_NONE)) {
+      coap_session_free(s);
+      return 0;
+    }
+    /* Check again later if there is still something waiting to go */
+    COAP_DUE_AT(s_due > now ? s_due : now + COAP_TICKS_PER_SECOND);
+  }
+  /* Check if any server large receives have timed out */
+  if (s->lg_srcv) {
+    s_due = coap_block_check_lg_srcv_timeouts(s, now);
+    if (s_due != (coap_tick_t)-1)
+      COAP_DUE_AT(now + s_due);
+  }
+
+  if (!COAP_DISABLE_TCP
+   && s->type == COAP_SESSION_TYPE_CLIENT
+   && s->state == COAP_SESSION_STATE_ESTABLISHED
+   && ctx->ping_timeout > 0
+  ) {
+    if (s->last_rx_tx + ctx->ping_timeout * COAP_TICKS_PER_SECOND <= now) {
+      coap_session_ext_t *ext = coap_session_ext(s);
+
+      if (!ext || (ext->last_ping > 0 && ext->last_pong < ext->last_ping)
+        || ((ext->last_ping_mid = coap_session_send_ping(s)) == COAP_INVALID_MID))
+      {
+        /* Make sure the session object is not deleted in the callback */
+        coap_session_reference(s);
+        coap_session_disconnected(s, COAP_NACK_NOT_DELIVERABLE);
+        coap_session_release(s);
+        return 0;
+      }
+      s->last_rx_tx = now;
+      ext->last_ping = now;
+    }
+    COAP_DUE_AT(s->last_rx_tx + ctx->ping_timeout * COAP_TICKS_PER_SECOND);
+  }
+
+  if (!COAP_DISABLE_TCP
+   && s->type == COAP_SESSION_TYPE_CLIENT
+   && COAP_PROTO_RELIABLE(s->proto)
+   && s->state == COAP_SESSION_STATE_CSM
+   && ctx->csm_timeout > 0
+  ) {
+    if (s->ext->csm_tx == 0) {
+      s->ext->csm_tx = now;
+    } else if (s->ext->csm_tx + ctx->csm_timeout * COAP_TICKS_PER_SECOND <= now) {
+      /* Make sure the session object is not deleted in the callback */
+      coap_session_reference(s);
+      coap_session_disconnected(s, COAP_NACK_NOT_DELIVERABLE);
+      coap_session_release(s);
+      return 0;
+    }
+    COAP_DUE_AT(s->ext->csm_tx + ctx->csm_timeout * COAP_TICKS_PER_SECOND);
+  }
+
+  /* Check if any Q-Block1 large transmits need prompting */
+  if (s->lg_xmit) {
+    s_due = coap_block_check_lg_xmit_timeouts(s, now);
+    if (s_due != (coap_tick_t)-1)
+      COAP_DUE_AT(now + s_due);
+  }
+
+  /* Check if any client large receives have timed out */
+  if (s->lg_crcv) {
+    s_due = coap_block_check_lg_crcv_timeouts(s, now);
+    if (s_due != (coap_tick_t)-1)
+      COAP_DUE_AT(now + s_due);
+  }
+
+#ifndef WITHOUT_ASYNC
+  /* Send any held back ACKs and time out any asynchronous requests */
+  if (s->async_token) {
+    /* Make sure the session object is not deleted with the states */
+    coap_session_reference(s);
+    s_due = coap_async_check_timeouts(s, now);
+    if (s->ref == 1 && s->type == COAP_SESSION_TYPE_CLIENT) {
+      /* The session goes away with the reference */
+      coap_session_release(s);
+      return 0;
+    }
+    coap_session_release(s);
+    if (s_due)
+      COAP_DUE_AT(s_due);
+  }
+#endif /* WITHOUT_ASYNC */
+
+  /* Send the notifications held back or due by conditional attributes */
+  if (s->obs_cond_count) {
+    /* Make sure the session object is not deleted by the handlers */
+    coap_session_reference(s);
+    s_due = coap_observe_cond_check_timeouts(s, now);
+    if (s->ref == 1 && s->type == COAP_SESSION_TYPE_CLIENT) {
+      /* The session goes away with the reference */
+      coap_session_release(s);
+      return 0;
+    }
+    coap_session_release(s);
+    if (s_due)
+      COAP_DUE_AT(s_due);
+  }
+
+  /* Time out the requests that have not been answered */
+  if (s->request_due) {
+    /* Make sure the session object is not deleted by the handlers */
+    coap_session_reference(s);
+    s_due = coap_request_check_timeouts(s, now);
+    if (s->ref == 1 && s->type == COAP_SESSION_TYPE_CLIENT) {
+      /* The session goes away with the reference */
+      coap_session_release(s);
+      return 0;
+    }
+    coap_session_release(s);
+    if (s_due)
+      COAP_DUE_AT(s_due);
+  }
+
+  /* The worker threads look after offloaded handshakes */
+  if (ctx->dtls_context && !coap_dtls_is_context_timeout() &&
+      s->state == COAP_SESSION_STATE_HANDSHAKE &&
+      s->proto == COAP_PROTO_DTLS && s->tls && !s->dtls_job) {
+    coap_tick_t tls_timeout = coap_dtls_get_timeout(s, now);
+
+    while (tls_timeout > 0 && tls_timeout <= now) {
+      coap_log(LOG_DEBUG, "** %s: DTLS retransmit timeout\n",
+               coap_session_str(s));
+      /* Make sure the session object is not deleted in any callbacks */
+      coap_session_reference(s);
+      coap_dtls_handle_timeout(s);
+      if (s->tls)
+        tls_timeout = coap_dtls_get_timeout(s, now);
+      else
+        tls_timeout = now + 1;
+      if (s->ref == 1 && s->type == COAP_SESSION_TYPE_CLIENT) {
+        /* The session goes away with the reference */
+        coap_session_release(s);
+        return 0;
+      }
+      coap_session_release(s);
+    }
+    if (tls_timeout > 0)
+      COAP_DUE_AT(tls_timeout);
+  }
+#undef COAP_DUE_AT
+  return 1;
+}
+
+/* One of the timeouts has changed, so all the sessions must be checked */
+static void
+coap_session_timers_rearm_all(coap_context_t *context, coap_tick_t now) {
+  coap_endpoint_t *ep;
+  coap_session_t *s, *rtmp;
+  unsigned int pos;
+
+  context->timers_session_timeout = context->session_timeout;
+  context->timers_ping_timeout = context->ping_timeout;
+  context->timers_csm_timeout = context->csm_timeout;
+  LL_FOREACH(context->endpoint, ep) {
+    SESSIONS_INDEX_ITER(&ep->sessions, s, pos) {
+      coap_session_timer_arm(s, now);
+    }
+  }
+  SESSIONS_ITER(context->sessions, s, rtmp) {
+    coap_session_timer_arm(s, now);
+  }
+}
+
+coap_tick_t
+coap_session_timers_run(coap_context_t *context, coap_tick_t now) {
+  coap_session_t *s;
+  coap_tick_t due;
+
+  if (context->timers_session_timeout != context->session_timeout ||
+      context->timers_ping_timeout != context->ping_timeout ||
+      context->timers_csm_timeout != context->csm_timeout)
+    coap_session_timers_rearm_all(context, now);
+
+  context->session_timers_now = now;
+  while ((s = context->session_timers) != NULL && s->timer_due <= now) {
+    coap_session_timer_cancel(s);
+    if (coap_session_check_timeouts(s, now, &due) && due)
+      coap_session_timer_arm(s, due);
+  }
+  context->session_timers_now = 0;
+
+  return s ? s->timer_due - now : 0;
+}
+
 coap_session_t *
 coap_session_reference(coap_session_t *session) {
-  ++session->ref;
+  if (session->ref++ == 0)
+    coap_session_lru_remove(session);
   return session;
 }
 
@@ -79,6 +751,8 @@ coap_session_release(coap_session_t *session) {
       --session->ref;
     if (session->ref == 0 && session->type == COAP_SESSION_TYPE_CLIENT)
       coap_session_free(session);
+    else if (session->ref == 0)
+      coap_session_lru_update(session);
 #else /* __COVERITY__ */
     /* Coverity scan is fooled by the reference counter leading to
      * false positives for USE_AFTER_FREE. */
@@ -133,6 +807,8 @@ coap_make_session(coap_proto_t proto, coap_session_type_t type,
   session->block_mode = context->block_mode;
   if (endpoint)
     session->mtu = endpoint->default_mtu;
+  else if (remote_addr && coap_address_is_unix(remote_addr))
+    session->mtu = COAP_AF_UNIX_MTU;
   else
     session->mtu = COAP_DEFAULT_MTU;
   if (proto == COAP_PROTO_DTLS) {
@@ -145,8 +821,19 @@ coap_make_session(coap_proto_t proto, coap_session_type_t type,
   session->max_retransmit = COAP_DEFAULT_MAX_RETRANSMIT;
   session->ack_timeout = COAP_DEFAULT_ACK_TIMEOUT;
   session->ack_random_factor = COAP_DEFAULT_ACK_RANDOM_FACTOR;
+  session->max_payloads = COAP_DEFAULT_MAX_PAYLOADS;
+  session->nstart = COAP_DEFAULT_NSTART;
+  if (context->cocoa) {
+    session->cocoa = 1;
+    session->rtt.rto_us = coap_fixed_point_us(session->ack_timeout);
+    session->rto_updated_us = coap_histogram_clock();
+  }
   session->dtls_event = -1;
-  session->last_ping_mid = COAP_INVALID_MID;
+  /* Plain UDP sessions only get the extension once they need it */
+  if (proto != COAP_PROTO_UDP && !coap_session_ext(session)) {
+    coap_free_type(COAP_SESSION, session);
+    return NULL;
+  }
 
   /* initialize message id */
   coap_prng((unsigned char *)&session->tx_mid, sizeof(session->tx_mid));
@@ -154,8 +841,24 @@ coap_make_session(coap_proto_t proto, coap_session_type_t type,
   return session;
 }
 
+coap_session_ext_t *
+coap_session_ext(coap_session_t *session) {
+  if (!session->ext) {
+    session->ext = (coap_session_ext_t *)coap_malloc_type(COAP_STRING,
+                                                  sizeof(coap_session_ext_t));
+    if (!session->ext) {
+      coap_log(LOG_WARNING, "***%s: cannot allocate session state\n",
+               coap_session_str(session));
+      return NULL;
+    }
+    memset(session->ext, 0, sizeof(coap_session_ext_t));
+    session->ext->last_ping_mid = COAP_INVALID_MID;
+  }
+  return session->ext;
+}
+
 void coap_session_mfree(coap_session_t *session) {
-  coap_queue_t *q, *tmp;
+  coap_queue_t *q;
   coap_cache_entry_t *cp, *ctmp;
   coap_lg_xmit_t *lq, *ltmp;
   coap_lg_crcv_t *cq, *etmp;
@@ -166,24 +869,25 @@ void coap_session_mfree(coap_session_t *session) {
     if (cq->observe_set) {
       /* Need to close down observe */
       if (coap_cancel_observe(session, cq->app_token, COAP_MESSAGE_NON)) {
-        /* Need to delete node we set up for NON */
-        coap_queue_t *queue = session->context->sendqueue;
-
-        while (queue) {
-          if (queue->session == session) {
-            coap_delete_node(queue);
-            break;
-          }
-          queue = queue->next;
-        }
+        /* Need to delete node we set up for NON (the most recent one) */
+        if (session->sendqueue)
+          coap_delete_node(session->sendqueue->session_prev);
       }
     }
-    LL_DELETE(session->lg_crcv, cq);
+    coap_block_remove_lg_crcv(session, cq);
     coap_block_delete_lg_crcv(session, cq);
   }
 
-  if (session->partial_pdu)
-    coap_delete_pdu(session->partial_pdu);
+  if (session->ext) {
+    if (session->ext->partial_pdu)
+      coap_delete_pdu(session->ext->partial_pdu);
+    coap_free_type(COAP_STRING, session->ext->read_buf);
+    coap_free_type(COAP_STRING, session->ext->write_buf);
+    session->ext->partial_pdu = NULL;
+    session->ext->read_buf = NULL;
+    session->ext->write_buf = NULL;
+  }
+  coap_session_uncork(session);
   if (session->proto == COAP_PROTO_DTLS)
     coap_dtls_free_session(session);
 #if !COAP_DISABLE_TCP
@@ -192,32 +896,44 @@ void coap_session_mfree(coap_session_t *session) {
 #endif /* !COAP_DISABLE_TCP */
   if (session->sock.flags != COAP_SOCKET_EMPTY)
     coap_socket_close(&session->sock);
-  if (session->psk_identity)
-    coap_free(session->psk_identity);
-  if (session->psk_key)
-    coap_free(session->psk_key);
-  if (session->psk_hint)
-    coap_free(session->psk_hint);
+  if (session->ext) {
+    if (session->ext->psk_identity)
+      coap_free(session->ext->psk_identity);
+    if (session->ext->psk_key)
+      coap_free(session->ext->psk_key);
+    if (session->ext->psk_hint)
+      coap_free(session->ext->psk_hint);
+    session->ext->psk_identity = NULL;
+    session->ext->psk_key = NULL;
+    session->ext->psk_hint = NULL;
+  }
 
   HASH_ITER(hh, session->context->cache, cp, ctmp) {
     /* cp->session is NULL if not session based */
     if (cp->session == session) {
-      coap_delete_cache_entry(session->context, cp);
+      coap_cache_free_entry(session->context, cp);
     }
   }
-  LL_FOREACH_SAFE(session->delayqueue, q, tmp) {
-    if (q->pdu->type==COAP_MESSAGE_CON && session->context && session->context->nack_handler)
-      session->context->nack_handler(session->context, session, q->pdu, session->proto == COAP_PROTO_DTLS ? COAP_NACK_TLS_FAILED : COAP_NACK_NOT_DELIVERABLE, q->id);
+  while ((q = coap_session_delayqueue_pop(session)) != NULL) {
+    if (q->pdu->type==COAP_MESSAGE_CON && session->context)
+      coap_handle_nack(session->context, session, q->pdu, session->proto == COAP_PROTO_DTLS ? COAP_NACK_TLS_FAILED : COAP_NACK_NOT_DELIVERABLE, q->id);
     coap_delete_node(q);
   }
   LL_FOREACH_SAFE(session->lg_xmit, lq, ltmp) {
-    LL_DELETE(session->lg_xmit, lq);
+    coap_block_remove_lg_xmit(session, lq);
     coap_block_delete_lg_xmit(session, lq);
   }
   LL_FOREACH_SAFE(session->lg_srcv, sq, stmp) {
-    LL_DELETE(session->lg_srcv, sq);
+    coap_block_remove_lg_srcv(session, sq);
     coap_block_delete_lg_srcv(session, sq);
   }
+  coap_histogram_free(session->rtt_histogram);
+  session->rtt_histogram = NULL;
+  coap_oscore_session_free(session);
+  coap_dedup_free(session);
+  coap_request_free(session);
+  coap_free_type(COAP_STRING, session->ext);
+  session->ext = NULL;
 }
 
 void coap_session_free(coap_session_t *session) {
@@ -227,18 +943,126 @@ void coap_session_free(coap_session_t *session) {
   if (session->ref)
     return;
   coap_session_mfree(session);
+  coap_session_peer_remove(session);
   if (session->endpoint) {
-    if (session->endpoint->sessions)
-      SESSIONS_DELETE(session->endpoint->sessions, session);
+    coap_session_lru_remove(session);
+    coap_session_index_remove(&session->endpoint->sessions, session);
+    if (session->dtls_cid_set)
+      HASH_DELETE(hh_cid, session->endpoint->sessions_cid, session);
   } else if (session->context) {
     if (session->context->sessions)
       SESSIONS_DELETE(session->context->sessions, session);
   }
+  coap_session_timer_cancel(session);
   coap_log(LOG_DEBUG, "***%s: session closed\n", coap_session_str(session));
 
   coap_free_type(COAP_SESSION, session);
 }
 
+static coap_tls_resume_t **
+coap_tls_resume_lookup(const coap_session_t *session) {
+  coap_tls_resume_t **p;
+
+  for (p = &session->context->tls_resume; *p; p = &(*p)->next) {
+    coap_tls_resume_t *r = *p;
+
+    if (r->proto != session->proto ||
+        !coap_address_equals(&r->remote, &session->addr_info.remote))
+      continue;
+    if (!r->identity != !session->ext->psk_identity)
+      continue;
+    if (r->identity && (r->identity->length != session->ext->psk_identity->length ||
+                        memcmp(r->identity->s, session->ext->psk_identity->s,
+                               r->identity->length) != 0))
+      continue;
+    return p;
+  }
+  return NULL;
+}
+
+static void
+coap_tls_resume_delete(coap_tls_resume_t *r) {
+  coap_delete_bin_const(r->identity);
+  coap_free_type(COAP_STRING, r);
+}
+
+void
+coap_tls_resume_save(coap_session_t *session,
+                     const uint8_t *data, size_t length) {
+  coap_tls_resume_t *r;
+  coap_tls_resume_t **p;
+  unsigned int count = 0;
+
+  if (!session->context || session->type != COAP_SESSION_TYPE_CLIENT)
+    return;
+  coap_tls_resume_forget(session);
+
+  r = coap_malloc_type(COAP_STRING, sizeof(coap_tls_resume_t) + length);
+  if (!r)
+    return;
+  memset(r, 0, sizeof(coap_tls_resume_t));
+  r->proto = session->proto;
+  coap_address_copy(&r->remote, &session->addr_info.remote);
+  if (session->ext->psk_identity) {
+    r->identity = coap_new_bin_const(session->ext->psk_identity->s,
+                                     session->ext->psk_identity->length);
+    if (!r->identity) {
+      coap_free_type(COAP_STRING, r);
+      return;
+    }
+  }
+  r->length = length;
+  memcpy(r->data, data, length);
+  LL_PREPEND(session->context->tls_resume, r);
+
+  /* Drop the least recently saved servers */
+  for (p = &session->context->tls_resume; *p; ) {
+    if (++count > COAP_TLS_RESUME_MAX) {
+      coap_tls_resume_t *old = *p;
+
+      *p = old->next;
+      coap_tls_resume_delete(old);
+    } else {
+      p = &(*p)->next;
+    }
+  }
+}
+
+const coap_tls_resume_t *
+coap_tls_resume_find(const coap_session_t *session) {
+  coap_tls_resume_t **p;
+
+  if (!session->context || session->type != COAP_SESSION_TYPE_CLIENT)
+    return NULL;
+  p = coap_tls_resume_lookup(session);
+  return p ? *p : NULL;
+}
+
+void
+coap_tls_resume_forget(const coap_session_t *session) {
+  coap_tls_resume_t **p;
+
+  if (!session->context)
+    return;
+  p = coap_tls_resume_lookup(session);
+  if (p) {
+    coap_tls_resume_t *r = *p;
+
+    *p = r->next;
+    coap_tls_resume_delete(r);
+  }
+}
+
+void
+coap_tls_resume_free_all(coap_context_t *context) {
+  coap_tls_resume_t *r, *rtmp;
+
+  LL_FOREACH_SAFE(context->tls_resume, r, rtmp) {
+    LL_DELETE(context->tls_resume, r);
+    coap_tls_resume_delete(r);
+  }
+}
+
 size_t coap_session_max_pdu_size(const coap_session_t *session) {
   size_t max_with_header = (size_t)(session->mtu - session->tls_overhead);
 #if COAP_DISABLE_TCP
@@ -272,6 +1096,48 @@ void coap_session_set_mtu(coap_session_t *session, unsigned mtu) {
   }
 }
 
+void
+coap_session_update_path_mtu(coap_session_t *session, size_t lost) {
+  size_t path_mtu;
+  size_t mtu;
+
+  if (!session->context->path_mtu_discovery ||
+      session->type != COAP_SESSION_TYPE_CLIENT ||
+      COAP_PROTO_RELIABLE(session->proto) ||
+      !(session->sock.flags & COAP_SOCKET_CONNECTED))
+    return;
+  path_mtu = coap_socket_get_path_mtu(&session->sock,
+                                  session->addr_info.remote.addr.sa.sa_family);
+  if (path_mtu == 0)
+    return;
+  if (lost > COAP_DEFAULT_MTU && path_mtu == session->path_mtu &&
+      !session->path_mtu_lost) {
+    /* No ICMP has come back, yet the larger datagrams are being dropped */
+    coap_log(LOG_DEBUG, "***%s: %zu byte datagram lost, path MTU %zu\n",
+             coap_session_str(session), lost, path_mtu);
+    session->path_mtu_lost = 1;
+  }
+  session->path_mtu = path_mtu;
+
+  mtu = path_mtu;
+  if (session->path_mtu_lost && mtu > COAP_DEFAULT_MTU)
+    mtu = COAP_DEFAULT_MTU;
+  /* What the peer can receive, if it is set up alike */
+  if (session->proto == COAP_PROTO_DTLS || !session->context->rxbuf) {
+    if (mtu > COAP_RXBUFFER_SIZE)
+      mtu = COAP_RXBUFFER_SIZE;
+  } else if (mtu > session->context->rx_size) {
+    mtu = session->context->rx_size;
+  }
+  if (mtu == session->mtu || mtu <= session->tls_overhead)
+    return;
+  coap_log(LOG_DEBUG, "***%s: MTU %zu from path MTU\n",
+           coap_session_str(session), mtu);
+  coap_session_set_mtu(session, (unsigned)mtu);
+  if (session->tls)
+    coap_dtls_session_update_mtu(session);
+}
+
 ssize_t coap_session_send(coap_session_t *session, const uint8_t *data, size_t datalen) {
   ssize_t bytes_written;
 
@@ -283,7 +1149,8 @@ ssize_t coap_session_send(coap_session_t *session, const uint8_t *data, size_t d
 
   bytes_written = coap_socket_send(sock, session, data, datalen);
   if (bytes_written == (ssize_t)datalen) {
-    coap_ticks(&session->last_rx_tx);
+    if (!coap_dtls_offload_defer_sent(session))
+      coap_io_ticks(session->context, &session->last_rx_tx);
     coap_log(LOG_DEBUG, "*  %s: sent %zd bytes\n",
              coap_session_str(session), datalen);
   } else {
@@ -296,7 +1163,7 @@ ssize_t coap_session_send(coap_session_t *session, const uint8_t *data, size_t d
 ssize_t coap_session_write(coap_session_t *session, const uint8_t *data, size_t datalen) {
   ssize_t bytes_written = coap_socket_write(&session->sock, data, datalen);
   if (bytes_written > 0) {
-    coap_ticks(&session->last_rx_tx);
+    coap_io_ticks(session->context, &session->last_rx_tx);
     coap_log(LOG_DEBUG, "*  %s: sent %zd bytes\n",
              coap_session_str(session), datalen);
   } else if (bytes_written < 0) {
@@ -306,6 +1173,127 @@ ssize_t coap_session_write(coap_session_t *session, const uint8_t *data, size_t
   return bytes_written;
 }
 
+int coap_session_can_sendv(const coap_session_t *session) {
+#if COAP_SOCKET_SENDV
+  switch (session->proto) {
+  case COAP_PROTO_UDP:
+    /* Anything else would have to assemble the datagram again */
+    return session->context->network_send == coap_network_send;
+  case COAP_PROTO_TCP:
+    return 1;
+  default:
+    break;
+  }
+#elif defined(WITH_LWIP)
+  /* coap_socket_send_pdu() chains the payload behind the PDU's pbuf */
+  return session->proto == COAP_PROTO_UDP;
+#else /* ! COAP_SOCKET_SENDV && ! WITH_LWIP */
+  (void)session;
+#endif /* ! COAP_SOCKET_SENDV && ! WITH_LWIP */
+  return 0;
+}
+
+#if COAP_SOCKET_SENDV
+ssize_t coap_session_sendv(coap_session_t *session, const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_written;
+  size_t datalen = 0;
+  int i;
+
+  coap_socket_t *sock = &session->sock;
+  if (sock->flags == COAP_SOCKET_EMPTY) {
+    assert(session->endpoint != NULL);
+    sock = &session->endpoint->sock;
+  }
+
+  for (i = 0; i < iovcnt; i++)
+    datalen += iov[i].iov_len;
+  bytes_written = coap_socket_sendv(sock, session, iov, iovcnt);
+  if (bytes_written == (ssize_t)datalen) {
+    if (!coap_dtls_offload_defer_sent(session))
+      coap_io_ticks(session->context, &session->last_rx_tx);
+    coap_log(LOG_DEBUG, "*  %s: sent %zd bytes\n",
+             coap_session_str(session), datalen);
+  } else {
+    coap_log(LOG_DEBUG, "*  %s: failed to send %zd bytes\n",
+             coap_session_str(session), datalen);
+  }
+  return bytes_written;
+}
+
+ssize_t coap_session_writev(coap_session_t *session, const struct iovec *iov, int iovcnt) {
+  ssize_t bytes_written = coap_socket_writev(&session->sock, iov, iovcnt);
+  if (bytes_written > 0) {
+    coap_io_ticks(session->context, &session->last_rx_tx);
+    coap_log(LOG_DEBUG, "*  %s: sent %zd bytes\n",
+             coap_session_str(session), bytes_written);
+  } else if (bytes_written < 0) {
+    coap_log(LOG_DEBUG,  "*   %s: failed to send %d buffers\n",
+             coap_session_str(session), iovcnt);
+  }
+  return bytes_written;
+}
+#endif /* COAP_SOCKET_SENDV */
+
+void
+coap_session_uncork(coap_session_t *session) {
+  coap_session_t **p;
+
+  if (!session->corked_bytes)
+    return;
+  for (p = &session->context->corked; *p; p = &(*p)->cork_next) {
+    if (*p == session) {
+      *p = session->cork_next;
+      break;
+    }
+  }
+  session->cork_next = NULL;
+  session->corked_bytes = 0;
+}
+
+/*
+ * The delayqueue is a singly linked list with a tail pointer, so that
+ * entries are appended and taken off the front in constant time.  For the
+ * protocols that are not reliable its entries are also hashed by message
+ * id, using the hh handle that indexes them by (session, id) while they are
+ * in the retransmission queue, which they cannot be at the same time.
+ */
+static void
+coap_session_delayqueue_append(coap_session_t *session, coap_queue_t *node) {
+  node->next = NULL;
+  if (session->delayqueue_tail)
+    session->delayqueue_tail->next = node;
+  else
+    session->delayqueue = node;
+  session->delayqueue_tail = node;
+  if (COAP_PROTO_NOT_RELIABLE(session->proto))
+    HASH_ADD(hh, session->delayqueue_index, id, sizeof(node->id), node);
+}
+
+coap_queue_t *
+coap_session_delayqueue_pop(coap_session_t *session) {
+  coap_queue_t *node = session->delayqueue;
+
+  if (!node)
+    return NULL;
+  session->delayqueue = node->next;
+  if (!session->delayqueue)
+    session->delayqueue_tail = NULL;
+  node->next = NULL;
+  if (COAP_PROTO_NOT_RELIABLE(session->proto))
+    HASH_DELETE(hh, session->delayqueue_index, node);
+  return node;
+}
+
+void
+coap_session_delayqueue_push(coap_session_t *session, coap_queue_t *node) {
+  node->next = session->delayqueue;
+  session->delayqueue = node;
+  if (!session->delayqueue_tail)
+    session->delayqueue_tail = node;
+  if (COAP_PROTO_NOT_RELIABLE(session->proto))
+    HASH_ADD(hh, session->delayqueue_index, id, sizeof(node->id), node);
+}
+
 ssize_t
 coap_session_delay_pdu(coap_session_t *session, coap_pdu_t *pdu,
                        coap_queue_t *node)
@@ -319,9 +1307,15 @@ coap_session_delay_pdu(coap_session_t *session, coap_pdu_t *pdu,
     node->t = 0;
   } else {
     coap_queue_t *q = NULL;
-    /* Check that the same mid is not getting re-used in violation of RFC7252 */
-    LL_FOREACH(session->delayqueue, q) {
-      if (q->id == pdu->mid) {
+    /*
+     * Check that the same mid is not getting re-used in violation of RFC7252.
+     * Messages on TCP and TLS have no mid.
+     */
+    if (COAP_PROTO_NOT_RELIABLE(session->proto)) {
+      coap_mid_t mid = pdu->mid;
+
+      HASH_FIND(hh, session->delayqueue_index, &mid, sizeof(mid), q);
+      if (q) {
         coap_log(LOG_ERR, "**  %s: mid=0x%x: already in-use - dropped\n",
                  coap_session_str(session), pdu->mid);
         return COAP_INVALID_MID;
@@ -339,7 +1333,7 @@ coap_session_delay_pdu(coap_session_t *session, coap_pdu_t *pdu,
       node->timeout = coap_calc_timeout(session, r);
     }
   }
-  LL_APPEND(session->delayqueue, node);
+  coap_session_delayqueue_append(session, node);
   coap_log(LOG_DEBUG, "** %s: mid=0x%x: delayed\n",
            coap_session_str(session), node->id);
   return COAP_PDU_DELAYED;
@@ -352,7 +1346,8 @@ void coap_session_send_csm(coap_session_t *session) {
   assert(COAP_PROTO_RELIABLE(session->proto));
   coap_log(LOG_DEBUG, "***%s: sending CSM\n", coap_session_str(session));
   session->state = COAP_SESSION_STATE_CSM;
-  session->partial_write = 0;
+  coap_session_timer_arm(session, 0);
+  session->ext->partial_write = 0;
   if (session->mtu == 0)
     session->mtu = COAP_DEFAULT_MTU;  /* base value */
   pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_SIGNALING_CSM, 0, 20);
@@ -395,15 +1390,22 @@ coap_mid_t coap_session_send_ping(coap_session_t *session) {
 }
 
 void coap_session_connected(coap_session_t *session) {
+  if (coap_dtls_offload_defer(session, COAP_DTLS_JOB_CONNECTED, 0))
+    return;
   if (session->state != COAP_SESSION_STATE_ESTABLISHED) {
     coap_log(LOG_DEBUG, "***%s: session connected\n",
              coap_session_str(session));
+    COAP_PROBE_SESSION(session_connected, session, session->proto);
     if (session->state == COAP_SESSION_STATE_CSM)
       coap_handle_event(session->context, COAP_EVENT_SESSION_CONNECTED, session);
   }
 
   session->state = COAP_SESSION_STATE_ESTABLISHED;
-  session->partial_write = 0;
+  if (session->ext)
+    session->ext->partial_write = 0;
+  coap_session_lru_update(session);
+  /* May need keepalive pings */
+  coap_session_timer_arm(session, 0);
 
   if ( session->proto==COAP_PROTO_DTLS) {
     session->tls_overhead = coap_dtls_get_overhead(session);
@@ -417,13 +1419,12 @@ void coap_session_connected(coap_session_t *session) {
     ssize_t bytes_written;
     coap_queue_t *q = session->delayqueue;
     if (q->pdu->type == COAP_MESSAGE_CON && COAP_PROTO_NOT_RELIABLE(session->proto)) {
-      if (session->con_active >= COAP_DEFAULT_NSTART)
+      if (session->con_active >= session->nstart)
         break;
       session->con_active++;
     }
     /* Take entry off the queue */
-    session->delayqueue = q->next;
-    q->next = NULL;
+    coap_session_delayqueue_pop(session);
 
     coap_log(LOG_DEBUG, "** %s: mid=0x%x: transmitted after delay\n",
              coap_session_str(session), (int)q->pdu->mid);
@@ -438,11 +1439,10 @@ void coap_session_connected(coap_session_t *session) {
       if (bytes_written < 0)
         break;
     } else {
-      if (bytes_written <= 0 || (size_t)bytes_written < q->pdu->used_size + q->pdu->hdr_size) {
-        q->next = session->delayqueue;
-        session->delayqueue = q;
+      if (bytes_written <= 0 || (size_t)bytes_written < COAP_PDU_WIRE_SIZE(q->pdu)) {
+        coap_session_delayqueue_push(session, q);
         if (bytes_written > 0)
-          session->partial_write = (size_t)bytes_written;
+          session->ext->partial_write = (size_t)bytes_written;
         break;
       } else {
         coap_delete_node(q);
@@ -457,8 +1457,13 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
   coap_session_state_t state = session->state;
 #endif /* !COAP_DISABLE_TCP */
 
+  if (coap_dtls_offload_defer(session, COAP_DTLS_JOB_DISCONNECTED, reason))
+    return;
+  /* The workers must be done with the (D)TLS state before it is freed */
+  coap_dtls_offload_cancel(session);
   coap_log(LOG_DEBUG, "***%s: session disconnected (reason %d)\n",
            coap_session_str(session), reason);
+  COAP_PROBE_SESSION(session_disconnected, session, reason);
   coap_delete_observers( session->context, session );
 
   if ( session->tls) {
@@ -475,19 +1480,25 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
     session->state = COAP_SESSION_STATE_ESTABLISHED;
   else
     session->state = COAP_SESSION_STATE_NONE;
+  coap_session_lru_update(session);
+  /* Unused server sessions are now freed off */
+  coap_session_timer_arm(session, 0);
 
   session->con_active = 0;
 
-  if (session->partial_pdu) {
-    coap_delete_pdu(session->partial_pdu);
-    session->partial_pdu = NULL;
+  if (session->ext) {
+    if (session->ext->partial_pdu) {
+      coap_delete_pdu(session->ext->partial_pdu);
+      session->ext->partial_pdu = NULL;
+    }
+    session->ext->partial_read = 0;
+    session->ext->read_head = session->ext->read_tail = 0;
+    session->ext->write_pending = 0;
   }
-  session->partial_read = 0;
+  coap_session_uncork(session);
 
   while (session->delayqueue) {
-    coap_queue_t *q = session->delayqueue;
-    session->delayqueue = q->next;
-    q->next = NULL;
+    coap_queue_t *q = coap_session_delayqueue_pop(session);
     coap_log(LOG_DEBUG, "** %s: mid=0x%x: not transmitted after disconnect\n",
              coap_session_str(session), q->id);
     if (q->pdu->type==COAP_MESSAGE_CON
@@ -496,18 +1507,13 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
     {
       /* Make sure that we try a re-transmit later on ICMP error */
       if (coap_wait_ack(session->context, session, q) >= 0) {
-        if (session->context->nack_handler) {
-          session->context->nack_handler(session->context, session, q->pdu,
-                                         reason, q->id);
-        }
+        coap_handle_nack(session->context, session, q->pdu, reason, q->id);
         q = NULL;
       }
     }
-    if (q && q->pdu->type == COAP_MESSAGE_CON
-      && session->context->nack_handler)
+    if (q && q->pdu->type == COAP_MESSAGE_CON)
     {
-      session->context->nack_handler(session->context, session, q->pdu,
-                                     reason, q->id);
+      coap_handle_nack(session->context, session, q->pdu, reason, q->id);
     }
     if (q)
       coap_delete_node(q);
@@ -515,14 +1521,10 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
   if (reason != COAP_NACK_ICMP_ISSUE) {
     coap_cancel_session_messages(session->context, session, reason);
   }
-  else if (session->context->nack_handler) {
-    coap_queue_t *q = session->context->sendqueue;
-    while (q) {
-      if (q->session == session) {
-        session->context->nack_handler(session->context, session, q->pdu,
-                                       reason, q->id);
-      }
-      q = q->next;
+  else {
+    coap_queue_t *q;
+    LL_FOREACH2(session->sendqueue, q, session_next) {
+      coap_handle_nack(session->context, session, q->pdu, reason, q->id);
     }
   }
 
@@ -541,6 +1543,8 @@ void coap_session_disconnected(coap_session_t *session, coap_nack_reason_t reaso
     }
   }
 #endif /* !COAP_DISABLE_TCP */
+  if (reason != COAP_NACK_ICMP_ISSUE)
+    coap_proxy_session_closed(session);
 }
 
 static void
@@ -551,60 +1555,162 @@ coap_make_addr_hash(coap_addr_hash_t *addr_hash,
   addr_hash->lport = coap_address_get_port(&addr_info->local);
 }
 
+int
+coap_session_new_dtls_cid(coap_session_t *session) {
+  coap_endpoint_t *endpoint = session->endpoint;
+  coap_session_t *other;
+  int tries;
+
+  if (!endpoint || session->proto != COAP_PROTO_DTLS)
+    return 0;
+  if (session->dtls_cid_set)
+    return 1;
+  for (tries = 0; tries < 8; tries++) {
+    coap_prng(session->dtls_cid, sizeof(session->dtls_cid));
+    if (endpoint->context->reuseport_shards) {
+      /* The first byte steers the records to this shard */
+      unsigned int shards = endpoint->context->reuseport_shards;
+      unsigned int first = session->dtls_cid[0] / shards * shards +
+                           endpoint->context->reuseport_shard;
+
+      session->dtls_cid[0] = (uint8_t)(first > 255 ? first - shards : first);
+    }
+    HASH_FIND(hh_cid, endpoint->sessions_cid, session->dtls_cid,
+              sizeof(session->dtls_cid), other);
+    if (!other) {
+      HASH_ADD(hh_cid, endpoint->sessions_cid, dtls_cid,
+               sizeof(session->dtls_cid), session);
+      session->dtls_cid_set = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void
+coap_session_dtls_cid_verified(coap_session_t *session) {
+  coap_endpoint_t *endpoint = session->endpoint;
+
+  /* The session hash tables belong to the I/O thread */
+  if (!session->ext->cid_remote_set || !endpoint || coap_dtls_offload_in_worker())
+    return;
+  session->ext->cid_remote_set = 0;
+  if (coap_log_enabled(LOG_DEBUG)) {
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 40
+#endif
+    unsigned char addr_str[INET6_ADDRSTRLEN + 8];
+
+    if (coap_print_addr(&session->ext->cid_remote, addr_str,
+                        INET6_ADDRSTRLEN + 8)) {
+      coap_log(LOG_DEBUG, "***%s: peer moved to %s\n",
+               coap_session_str(session), addr_str);
+    }
+  }
+  coap_session_index_remove(&endpoint->sessions, session);
+  coap_address_copy(&session->addr_info.remote, &session->ext->cid_remote);
+  coap_make_addr_hash(&session->addr_hash, &session->addr_info);
+  /* Cannot fail, as the index has just made room */
+  coap_session_index_add(&endpoint->sessions, session);
+  coap_session_peer_update(session);
+}
+
+/*
+ * Looks up the server session of a DTLS record that carries a Connection ID
+ * (RFC 9146), which is located after the sequence number (see
+ * COAP_DTLS_CID_OFFSET).
+ */
+
+static coap_session_t *
+coap_endpoint_get_cid_session(coap_endpoint_t *endpoint,
+                              const coap_packet_t *packet) {
+  coap_session_t *session;
+#ifdef WITH_LWIP
+  const uint8_t *payload = (const uint8_t*)packet->pbuf->payload;
+  size_t length = packet->pbuf->len;
+#else /* ! WITH_LWIP */
+  const uint8_t *payload = (const uint8_t*)packet->payload;
+  size_t length = packet->length;
+#endif /* ! WITH_LWIP */
+
+  if (length < COAP_DTLS_CID_OFFSET + COAP_DTLS_CID_LENGTH + 2 ||
+      payload[0] != COAP_DTLS_CT_TLS12_CID)
+    return NULL;
+  HASH_FIND(hh_cid, endpoint->sessions_cid, &payload[COAP_DTLS_CID_OFFSET],
+            COAP_DTLS_CID_LENGTH, session);
+  if (session && !coap_address_equals(&session->addr_info.remote,
+                                      &packet->addr_info.remote)) {
+    /* Only follow the peer once the record has been authenticated */
+    coap_address_copy(&session->ext->cid_remote, &packet->addr_info.remote);
+    session->ext->cid_remote_set = 1;
+  }
+  return session;
+}
+
 coap_session_t *
 coap_endpoint_get_session(coap_endpoint_t *endpoint,
   const coap_packet_t *packet, coap_tick_t now) {
   coap_session_t *session;
-  coap_session_t *rtmp;
-  unsigned int num_idle = 0;
-  unsigned int num_hs = 0;
   coap_session_t *oldest = NULL;
   coap_session_t *oldest_hs = NULL;
   coap_addr_hash_t addr_hash;
 
+  session = NULL;
+  if (endpoint->sessions_cid)
+    session = coap_endpoint_get_cid_session(endpoint, packet);
   coap_make_addr_hash(&addr_hash, &packet->addr_info);
-  SESSIONS_FIND(endpoint->sessions, addr_hash, session);
+  if (!session)
+    session = coap_session_index_find(&endpoint->sessions, &addr_hash);
   if (session) {
     /* Maybe mcast or unicast IP address which is not in the hash */
     coap_address_copy(&session->addr_info.local, &packet->addr_info.local);
-    session->ifindex = packet->ifindex;
+    if (session->ifindex != packet->ifindex) {
+      session->ifindex = packet->ifindex;
+      coap_session_peer_update(session);
+    }
     session->last_rx_tx = now;
+    coap_session_lru_update(session);
     return session;
   }
 
-  SESSIONS_ITER(endpoint->sessions, session, rtmp) {
-    if (session->ref == 0 && session->delayqueue == NULL) {
-      if (session->type == COAP_SESSION_TYPE_SERVER) {
-        ++num_idle;
-        if (oldest==NULL || session->last_rx_tx < oldest->last_rx_tx)
-          oldest = session;
-
-        if (session->state == COAP_SESSION_STATE_HANDSHAKE) {
-          ++num_hs;
-          /* See if this is a partial (D)TLS session set up
-             which needs to be cleared down to prevent DOS */
-          if ((session->last_rx_tx + COAP_PARTIAL_SESSION_TIMEOUT_TICKS) < now) {
-            if (oldest_hs == NULL ||
-                session->last_rx_tx < oldest_hs->last_rx_tx)
-              oldest_hs = session;
-          }
-        }
-      }
-      else if (session->type == COAP_SESSION_TYPE_HELLO) {
-        ++num_hs;
-        /* See if this is a partial (D)TLS session set up for Client Hello
-           which needs to be cleared down to prevent DOS */
-        if ((session->last_rx_tx + COAP_PARTIAL_SESSION_TIMEOUT_TICKS) < now) {
-          if (oldest_hs == NULL ||
-              session->last_rx_tx < oldest_hs->last_rx_tx)
-            oldest_hs = session;
-        }
+  if (coap_overload_check(endpoint->context)) {
+    /* No new sessions until the load has drained */
+    COAP_COUNT_ENDPOINT(endpoint, overloaded, 1);
+    return NULL;
+  }
+
+  if (endpoint->proto == COAP_PROTO_DTLS && coap_dtls_is_cookie_stateless()) {
+    /*
+     * Do the cookie exchange without a session, so that a flood of
+     * ClientHellos from spoofed addresses costs nothing to keep.
+     */
+    if (coap_dtls_cookie_check(endpoint, packet, &addr_hash, now) != 1)
+      return NULL;
+  }
+
+  /*
+   * The least recently used sessions are at the head of the lists, skip
+   * over any that still have something to send.
+   */
+  if (endpoint->context->max_idle_sessions > 0 &&
+      endpoint->num_idle >= endpoint->context->max_idle_sessions) {
+    for (oldest = endpoint->idle_lru; oldest && oldest->delayqueue;
+         oldest = oldest->idle_next);
+  }
+  if (!oldest) {
+    /* See if this is a partial (D)TLS session set up (or Client Hello)
+       which needs to be cleared down to prevent DOS */
+    for (oldest_hs = endpoint->hs_lru; oldest_hs; oldest_hs = oldest_hs->hs_next) {
+      if ((oldest_hs->last_rx_tx + COAP_PARTIAL_SESSION_TIMEOUT_TICKS) >= now) {
+        oldest_hs = NULL;
+        break;
       }
+      if (oldest_hs->delayqueue == NULL)
+        break;
     }
   }
 
-  if (endpoint->context->max_idle_sessions > 0 &&
-      num_idle >= endpoint->context->max_idle_sessions) {
+  if (oldest) {
     coap_session_free(oldest);
   }
   else if (oldest_hs) {
@@ -613,7 +1719,7 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
     coap_session_free(oldest_hs);
   }
 
-  if (num_hs > (endpoint->context->max_handshake_sessions ?
+  if (endpoint->num_hs > (endpoint->context->max_handshake_sessions ?
               endpoint->context->max_handshake_sessions :
               COAP_DEFAULT_MAX_HANDSHAKE_SESSIONS)) {
     /* Maxed out on number of sessions in (D)TLS negotiation state */
@@ -623,7 +1729,7 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
     return NULL;
   }
 
-  if (endpoint->proto == COAP_PROTO_DTLS) {
+  if (endpoint->proto == COAP_PROTO_DTLS && !coap_dtls_is_cookie_stateless()) {
     /*
      * Need to check that this actually is a Client Hello before wasting
      * time allocating and then freeing off session.
@@ -681,7 +1787,12 @@ coap_endpoint_get_session(coap_endpoint_t *endpoint,
     else if (endpoint->proto == COAP_PROTO_DTLS) {
       session->type = COAP_SESSION_TYPE_HELLO;
     }
-    SESSIONS_ADD(endpoint->sessions, session);
+    if (!coap_session_index_add(&endpoint->sessions, session)) {
+      coap_session_free(session);
+      return NULL;
+    }
+    coap_session_peer_update(session);
+    coap_session_lru_update(session);
     coap_log(LOG_DEBUG, "***%s: new incoming session\n",
              coap_session_str(session));
   }
@@ -694,9 +1805,11 @@ coap_session_new_dtls_session(coap_session_t *session,
   if (session) {
     session->last_rx_tx = now;
     session->type = COAP_SESSION_TYPE_SERVER;
+    COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
     session->tls = coap_dtls_new_server_session(session);
     if (session->tls) {
       session->state = COAP_SESSION_STATE_HANDSHAKE;
+      coap_session_lru_update(session);
     } else {
       coap_session_free(session);
       session = NULL;
@@ -722,10 +1835,18 @@ coap_epoll_ctl_add(coap_socket_t *sock,
                             sock->endpoint ? sock->endpoint->context : NULL;
   if (context == NULL)
     return;
+  if (context->io_external) {
+    coap_io_external_watch(context, sock, events, 1);
+    return;
+  }
 
   /* Needed if running 32bit as ptr is only 32bit */
   memset(&event, 0, sizeof(event));
   event.events = events;
+  if (sock->flags & COAP_SOCKET_EDGE)
+    event.events |= EPOLLET;
+  if (sock->flags & COAP_SOCKET_URING)
+    event.events &= ~EPOLLIN;
   event.data.ptr = sock;
 
   ret = epoll_ctl(context->epfd, EPOLL_CTL_ADD, sock->fd, &event);
@@ -736,7 +1857,26 @@ coap_epoll_ctl_add(coap_socket_t *sock,
               coap_socket_strerror(), errno);
   }
 }
-#endif /* COAP_EPOLL_SUPPORT */
+#elif defined(COAP_KQUEUE_SUPPORT)
+/* EV_ADD both adds and updates the kqueue filters */
+static void
+coap_epoll_ctl_add(coap_socket_t *sock,
+                   uint32_t events,
+                   const char *func
+) {
+  coap_context_t *context;
+
+  if (sock == NULL)
+    return;
+
+  context = sock->session ? sock->session->context :
+                            sock->endpoint ? sock->endpoint->context : NULL;
+  if (context && context->io_external)
+    coap_io_external_watch(context, sock, events, 1);
+  else
+    coap_epoll_ctl_mod(sock, events, func);
+}
+#endif /* COAP_KQUEUE_SUPPORT */
 
 static coap_session_t *
 coap_session_create_client(
@@ -775,6 +1915,11 @@ coap_session_create_client(
     assert(0);
     break;
   }
+  if (proto != COAP_PROTO_UDP && coap_address_is_unix(server)) {
+    coap_log(LOG_CRIT,
+             "coap_new_client_session*: Unix domain sockets are UDP only\n");
+    return NULL;
+  }
   session = coap_make_session(proto, COAP_SESSION_TYPE_CLIENT, NULL,
     local_if, server, 0, ctx, NULL);
   if (!session)
@@ -799,18 +1944,25 @@ coap_session_create_client(
   }
 
   session->sock.session = session;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
   coap_epoll_ctl_add(&session->sock,
                      EPOLLIN |
                       ((session->sock.flags & COAP_SOCKET_WANT_CONNECT) ?
                        EPOLLOUT : 0),
                    __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 
   session->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_WANT_READ;
   if (local_if)
     session->sock.flags |= COAP_SOCKET_BOUND;
+  if (ctx->path_mtu_discovery && COAP_PROTO_NOT_RELIABLE(proto) &&
+      (session->sock.flags & COAP_SOCKET_CONNECTED) &&
+      coap_socket_set_path_mtu_discovery(&session->sock,
+                                 session->addr_info.remote.addr.sa.sa_family))
+    /* Before the DTLS library takes the MTU */
+    coap_session_update_path_mtu(session, 0);
   SESSIONS_ADD(ctx->sessions, session);
+  coap_session_peer_update(session);
   return session;
 
 error:
@@ -823,9 +1975,11 @@ coap_session_connect(coap_session_t *session) {
   if (session->proto == COAP_PROTO_UDP) {
     session->state = COAP_SESSION_STATE_ESTABLISHED;
   } else if (session->proto == COAP_PROTO_DTLS) {
+    COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
     session->tls = coap_dtls_new_client_session(session);
     if (session->tls) {
       session->state = COAP_SESSION_STATE_HANDSHAKE;
+      coap_session_timer_arm(session, 0);
     } else {
       /* Need to free session object. As a new session may not yet
        * have been referenced, we call coap_session_reference() first
@@ -842,6 +1996,7 @@ coap_session_connect(coap_session_t *session) {
         session->state = COAP_SESSION_STATE_CONNECTING;
       } else if (session->proto == COAP_PROTO_TLS) {
         int connected = 0;
+        COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
         session->tls = coap_tls_new_client_session(session, &connected);
         if (session->tls) {
           session->state = COAP_SESSION_STATE_HANDSHAKE;
@@ -862,7 +2017,7 @@ coap_session_connect(coap_session_t *session) {
     }
 #endif /* !COAP_DISABLE_TCP */
   }
-  coap_ticks(&session->last_rx_tx);
+  coap_io_ticks(session->context, &session->last_rx_tx);
   return session;
 }
 
@@ -875,6 +2030,7 @@ coap_session_accept(coap_session_t *session) {
     coap_session_send_csm(session);
   } else if (session->proto == COAP_PROTO_TLS) {
     int connected = 0;
+    COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
     session->tls = coap_tls_new_server_session(session, &connected);
     if (session->tls) {
       session->state = COAP_SESSION_STATE_HANDSHAKE;
@@ -947,16 +2103,22 @@ coap_session_t *coap_new_client_session_psk2(
 ) {
   coap_session_t *session = coap_session_create_client(ctx, local_if,
                                                        server, proto);
+  coap_session_ext_t *ext;
 
   if (!session)
     return NULL;
 
-  session->cpsk_setup_data = *setup_data;
+  ext = coap_session_ext(session);
+  if (!ext) {
+    coap_session_release(session);
+    return NULL;
+  }
+  ext->cpsk_setup_data = *setup_data;
   if (setup_data->psk_info.identity.s) {
-    session->psk_identity =
+    ext->psk_identity =
                       coap_new_bin_const(setup_data->psk_info.identity.s,
                                          setup_data->psk_info.identity.length);
-    if (!session->psk_identity) {
+    if (!ext->psk_identity) {
       coap_log(LOG_WARNING, "Cannot store session Identity (PSK)\n");
       coap_session_release(session);
       return NULL;
@@ -969,9 +2131,9 @@ coap_session_t *coap_new_client_session_psk2(
   }
 
   if (setup_data->psk_info.key.s && setup_data->psk_info.key.length > 0) {
-    session->psk_key = coap_new_bin_const(setup_data->psk_info.key.s,
+    ext->psk_key = coap_new_bin_const(setup_data->psk_info.key.s,
                                           setup_data->psk_info.key.length);
-    if (!session->psk_key) {
+    if (!ext->psk_key) {
       coap_log(LOG_WARNING, "Cannot store session pre-shared key (PSK)\n");
       coap_session_release(session);
       return NULL;
@@ -997,17 +2159,22 @@ coap_session_t *coap_new_client_session_psk2(
 int coap_session_refresh_psk_hint(coap_session_t *session,
   const coap_bin_const_t *psk_hint
 ) {
+  coap_session_ext_t *ext = coap_session_ext(session);
+  coap_bin_const_t *old_psk_hint;
+
+  if (!ext)
+    return 0;
   /* We may be refreshing the hint with the same hint */
-  coap_bin_const_t *old_psk_hint = session->psk_hint;
+  old_psk_hint = ext->psk_hint;
 
   if (psk_hint && psk_hint->s) {
-    if (session->psk_hint) {
-      if (coap_binary_equal(session->psk_hint, psk_hint))
+    if (ext->psk_hint) {
+      if (coap_binary_equal(ext->psk_hint, psk_hint))
         return 1;
     }
-    session->psk_hint = coap_new_bin_const(psk_hint->s,
+    ext->psk_hint = coap_new_bin_const(psk_hint->s,
                                            psk_hint->length);
-    if (!session->psk_hint) {
+    if (!ext->psk_hint) {
       coap_log(LOG_ERR, "No memory to store identity hint (PSK)\n");
       if (old_psk_hint)
         coap_delete_bin_const(old_psk_hint);
@@ -1015,7 +2182,7 @@ int coap_session_refresh_psk_hint(coap_session_t *session,
     }
   }
   else {
-    session->psk_hint = NULL;
+    ext->psk_hint = NULL;
   }
   if (old_psk_hint)
     coap_delete_bin_const(old_psk_hint);
@@ -1026,16 +2193,21 @@ int coap_session_refresh_psk_hint(coap_session_t *session,
 int coap_session_refresh_psk_key(coap_session_t *session,
   const coap_bin_const_t *psk_key
 ) {
+  coap_session_ext_t *ext = coap_session_ext(session);
+  coap_bin_const_t *old_psk_key;
+
+  if (!ext)
+    return 0;
   /* We may be refreshing the key with the same key */
-  coap_bin_const_t *old_psk_key = session->psk_key;
+  old_psk_key = ext->psk_key;
 
   if (psk_key && psk_key->s) {
-    if (session->psk_key) {
-      if (coap_binary_equal(session->psk_key, psk_key))
+    if (ext->psk_key) {
+      if (coap_binary_equal(ext->psk_key, psk_key))
         return 1;
     }
-    session->psk_key = coap_new_bin_const(psk_key->s, psk_key->length);
-    if (!session->psk_key) {
+    ext->psk_key = coap_new_bin_const(psk_key->s, psk_key->length);
+    if (!ext->psk_key) {
       coap_log(LOG_ERR, "No memory to store pre-shared key (PSK)\n");
       if (old_psk_key)
         coap_delete_bin_const(old_psk_key);
@@ -1043,7 +2215,7 @@ int coap_session_refresh_psk_key(coap_session_t *session,
     }
   }
   else {
-    session->psk_key = NULL;
+    ext->psk_key = NULL;
   }
   if (old_psk_key)
     coap_delete_bin_const(old_psk_key);
@@ -1051,6 +2223,21 @@ int coap_session_refresh_psk_key(coap_session_t *session,
   return 1;
 }
 
+const coap_bin_const_t *
+coap_session_get_psk_hint(const coap_session_t *session) {
+  return session && session->ext ? session->ext->psk_hint : NULL;
+}
+
+const coap_bin_const_t *
+coap_session_get_psk_key(const coap_session_t *session) {
+  return session && session->ext ? session->ext->psk_key : NULL;
+}
+
+const coap_bin_const_t *
+coap_session_get_psk_identity(const coap_session_t *session) {
+  return session && session->ext ? session->ext->psk_identity : NULL;
+}
+
 coap_session_t *coap_new_client_session_pki(
   struct coap_context_t *ctx,
   const coap_address_t *local_if,
@@ -1103,20 +2290,30 @@ coap_session_t *coap_new_server_session(
 #if !COAP_DISABLE_TCP
   if (!coap_socket_accept_tcp(&ep->sock, &session->sock,
                               &session->addr_info.local,
-                              &session->addr_info.remote))
-    goto error;
+                              &session->addr_info.remote)) {
+    /*
+     * Not yet in ep->sessions, so is freed off directly.
+     */
+    coap_session_mfree(session);
+    coap_free_type(COAP_SESSION, session);
+    return NULL;
+  }
   coap_make_addr_hash(&session->addr_hash, &session->addr_info);
   
 #endif /* !COAP_DISABLE_TCP */
   session->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_CONNECTED
                        | COAP_SOCKET_WANT_READ;
   session->sock.session = session;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
   coap_epoll_ctl_add(&session->sock,
                      EPOLLIN,
                    __func__);
-#endif /* COAP_EPOLL_SUPPORT */
-  SESSIONS_ADD(ep->sessions, session);
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+  if (!coap_session_index_add(&ep->sessions, session)) {
+    coap_session_free(session);
+    return NULL;
+  }
+  coap_session_peer_update(session);
   if (session) {
     coap_log(LOG_DEBUG, "***%s: new incoming session\n",
              coap_session_str(session));
@@ -1165,6 +2362,11 @@ coap_new_endpoint(coap_context_t *context, const coap_address_t *listen_addr, co
     goto error;
   }
 
+  if (proto != COAP_PROTO_UDP && coap_address_is_unix(listen_addr)) {
+    coap_log(LOG_CRIT, "coap_new_endpoint: Unix domain sockets are UDP only\n");
+    goto error;
+  }
+
   if (proto == COAP_PROTO_DTLS || proto == COAP_PROTO_TLS) {
     if (!coap_dtls_context_check_keys_enabled(context)) {
       coap_log(LOG_INFO,
@@ -1183,10 +2385,14 @@ coap_new_endpoint(coap_context_t *context, const coap_address_t *listen_addr, co
   memset(ep, 0, sizeof(coap_endpoint_t));
   ep->context = context;
   ep->proto = proto;
+  if (context->reuseport && !coap_address_is_unix(listen_addr))
+    ep->sock.flags |= COAP_SOCKET_REUSEPORT;
 
   if (proto==COAP_PROTO_UDP || proto==COAP_PROTO_DTLS) {
     if (!coap_socket_bind_udp(&ep->sock, listen_addr, &ep->bind_addr))
       goto error;
+    if (ep->sock.flags & COAP_SOCKET_REUSEPORT)
+      coap_socket_set_steering(&ep->sock, context);
     ep->sock.flags |= COAP_SOCKET_WANT_READ;
 #if !COAP_DISABLE_TCP
   } else if (proto==COAP_PROTO_TCP || proto==COAP_PROTO_TLS) {
@@ -1199,7 +2405,7 @@ coap_new_endpoint(coap_context_t *context, const coap_address_t *listen_addr, co
     goto error;
   }
 
-  if (LOG_DEBUG <= coap_get_log_level()) {
+  if (coap_log_enabled(LOG_DEBUG)) {
 #ifndef INET6_ADDRSTRLEN
 #define INET6_ADDRSTRLEN 40
 #endif
@@ -1216,14 +2422,23 @@ coap_new_endpoint(coap_context_t *context, const coap_address_t *listen_addr, co
 
   ep->sock.flags |= COAP_SOCKET_NOT_EMPTY | COAP_SOCKET_BOUND;
 
-  ep->default_mtu = COAP_DEFAULT_MTU;
+  ep->default_mtu = coap_address_is_unix(&ep->bind_addr) ? COAP_AF_UNIX_MTU :
+                                                          COAP_DEFAULT_MTU;
 
   ep->sock.endpoint = ep;
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (context->epoll_edge)
+    ep->sock.flags |= COAP_SOCKET_EDGE;
+#ifdef COAP_IO_URING_SUPPORT
+  /* Still registered with epoll, but only for output.  The io_uring buffers
+     are too small for the datagrams of a Unix domain socket. */
+  if (COAP_PROTO_NOT_RELIABLE(proto) && !coap_address_is_unix(&ep->bind_addr))
+    coap_io_uring_add_endpoint(ep);
+#endif /* COAP_IO_URING_SUPPORT */
   coap_epoll_ctl_add(&ep->sock,
                      EPOLLIN,
                    __func__);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 
   LL_PREPEND(context->endpoint, ep);
   return ep;
@@ -1240,14 +2455,17 @@ void coap_endpoint_set_default_mtu(coap_endpoint_t *ep, unsigned mtu) {
 void
 coap_free_endpoint(coap_endpoint_t *ep) {
   if (ep) {
-    coap_session_t *session, *rtmp;
+    coap_session_t *session;
+    unsigned int pos;
 
-    SESSIONS_ITER_SAFE(ep->sessions, session, rtmp) {
+    coap_dtls_offload_drain(ep->context);
+    SESSIONS_INDEX_ITER(&ep->sessions, session, pos) {
       assert(session->ref == 0);
       if (session->ref == 0) {
         coap_session_free(session);
       }
     }
+    coap_session_index_free(&ep->sessions);
     if (ep->sock.flags != COAP_SOCKET_EMPTY) {
       /*
        * ep->sock.endpoint is set in coap_new_endpoint().
@@ -1259,10 +2477,21 @@ coap_free_endpoint(coap_endpoint_t *ep) {
        * So, it is safe to call coap_socket_close() after all the sessions
        * have been freed above as we are only working with the endpoint sock.
        */
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
        assert(ep->sock.session == NULL);
-#endif /* COAP_EPOLL_SUPPORT */
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+      /* Make sure nothing is left queued for this socket */
+      if (ep->context)
+        coap_io_flush(ep->context);
+#ifdef COAP_IO_URING_SUPPORT
+      coap_io_uring_remove_endpoint(ep);
+#endif /* COAP_IO_URING_SUPPORT */
       coap_socket_close(&ep->sock);
+#if defined(COAP_AF_UNIX_SUPPORT) && defined(HAVE_UNISTD_H)
+      if (coap_address_is_unix(&ep->bind_addr) &&
+          ep->bind_addr.addr.cun.sun_path[0])
+        unlink(ep->bind_addr.addr.cun.sun_path);
+#endif /* COAP_AF_UNIX_SUPPORT && HAVE_UNISTD_H */
     }
 
     if (ep->context && ep->context->endpoint) {
@@ -1273,29 +2502,73 @@ coap_free_endpoint(coap_endpoint_t *ep) {
 }
 #endif /* WITH_LWIP */
 
+void
+coap_session_peer_key(coap_peer_key_t *key, const coap_address_t *remote,
+                      int ifindex) {
+  memset(key, 0, sizeof(*key));
+  coap_address_copy(&key->remote, remote);
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+  if (key->remote.addr.sa.sa_family == AF_INET6)
+    key->remote.addr.sin6.sin6_scope_id = 0;
+  else if (key->remote.addr.sa.sa_family == AF_INET)
+    memset(&key->remote.addr.sin.sin_zero, 0,
+           sizeof(key->remote.addr.sin.sin_zero));
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+  key->ifindex = ifindex;
+}
+
+void
+coap_session_peer_remove(coap_session_t *session) {
+  coap_context_t *context = session->context;
+
+  if (!session->in_peers)
+    return;
+  if (session->endpoint)
+    HASH_DELETE(hh_peer, context->peers_server, session);
+  else
+    HASH_DELETE(hh_peer, context->peers_client, session);
+  session->in_peers = 0;
+}
+
+void
+coap_session_peer_update(coap_session_t *session) {
+  coap_context_t *context = session->context;
+  coap_peer_key_t key;
+
+  coap_session_peer_key(&key, &session->addr_info.remote, session->ifindex);
+  if (session->in_peers) {
+    if (memcmp(&key, &session->peer_key, sizeof(key)) == 0)
+      return;
+    coap_session_peer_remove(session);
+  }
+  session->peer_key = key;
+  if (session->endpoint)
+    HASH_ADD(hh_peer, context->peers_server, peer_key, sizeof(key), session);
+  else
+    HASH_ADD(hh_peer, context->peers_client, peer_key, sizeof(key), session);
+  session->in_peers = 1;
+}
+
 coap_session_t *
 coap_session_get_by_peer(coap_context_t *ctx,
   const coap_address_t *remote_addr,
   int ifindex) {
-  coap_session_t *s, *rtmp;
-  coap_endpoint_t *ep;
-  SESSIONS_ITER(ctx->sessions, s, rtmp) {
-    if (s->ifindex == ifindex && coap_address_equals(&s->addr_info.remote,
-                                                     remote_addr))
-      return s;
-  }
-  LL_FOREACH(ctx->endpoint, ep) {
-    SESSIONS_ITER(ep->sessions, s, rtmp) {
-      if (s->ifindex == ifindex && coap_address_equals(&s->addr_info.remote,
-                                                       remote_addr))
-        return s;
-    }
-  }
-  return NULL;
+  coap_session_t *s;
+  coap_peer_key_t key;
+
+  /* Client sessions take precedence, as when the sessions were searched */
+  coap_session_peer_key(&key, remote_addr, ifindex);
+  HASH_FIND(hh_peer, ctx->peers_client, &key, sizeof(key), s);
+  if (!s)
+    HASH_FIND(hh_peer, ctx->peers_server, &key, sizeof(key), s);
+  /* coap_address_equals() does not match unknown address families */
+  if (s && !coap_address_equals(&s->addr_info.remote, remote_addr))
+    return NULL;
+  return s;
 }
 
 const char *coap_session_str(const coap_session_t *session) {
-  static char szSession[2 * (INET6_ADDRSTRLEN + 8) + 24];
+  static COAP_THREAD_LOCAL char szSession[2 * (INET6_ADDRSTRLEN + 8) + 24];
   char *p = szSession, *end = szSession + sizeof(szSession);
   if (coap_print_addr(&session->addr_info.local,
                       (unsigned char*)p, end - p) > 0)
@@ -1334,7 +2607,7 @@ const char *coap_session_str(const coap_session_t *session) {
 }
 
 const char *coap_endpoint_str(const coap_endpoint_t *endpoint) {
-  static char szEndpoint[128];
+  static COAP_THREAD_LOCAL char szEndpoint[128];
   char *p = szEndpoint, *end = szEndpoint + sizeof(szEndpoint);
   if (coap_print_addr(&endpoint->bind_addr, (unsigned char*)p, end - p) > 0)
     p += strlen(p);
@@ -1354,4 +2627,16 @@ const char *coap_endpoint_str(const coap_endpoint_t *endpoint) {
   return szEndpoint;
 }
 
+void
+coap_session_get_counters(const coap_session_t *session,
+                          coap_counters_t *counters) {
+  *counters = session->counters;
+}
+
+void
+coap_endpoint_get_counters(const coap_endpoint_t *endpoint,
+                           coap_counters_t *counters) {
+  *counters = endpoint->counters;
+}
+
 #endif  /* COAP_SESSION_C_ */
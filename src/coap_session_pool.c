@@ -0,0 +1,343 @@
+/* coap_session_pool.c -- Client sessions kept for reuse
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+/*
+ * The pool holds a reference on each of its sessions, which are hashed by
+ * protocol, remote and local address, and a SHA-256 digest of the security
+ * parameters (so that a session is only ever handed out again for the same
+ * credentials).  A session that is handed out is moved to the end of the
+ * hash, which as a uthash table iterates in the order of insertion keeps the
+ * least recently used session at its head.  The idle timeouts are carried
+ * out by the timers of the sessions.  Only sessions the application no
+ * longer holds are evicted, either when they have been idle for too long or
+ * to make room for a new one.
+ */
+typedef struct coap_pool_key_t {
+  coap_digest_t security;       /* all zero for NoSec */
+  coap_peer_key_t remote;
+  coap_peer_key_t local;
+  coap_proto_t proto;
+} coap_pool_key_t;
+
+struct coap_pool_entry_t {
+  UT_hash_handle hh;
+  coap_pool_key_t key;
+  coap_session_t *session;
+  coap_tick_t last_used;        /* when last handed out, or in use */
+};
+
+static void
+coap_pool_address_key(coap_peer_key_t *key, const coap_address_t *addr) {
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+  coap_address_t tmp;
+
+  /* Only take what is in use of the address of the application */
+  coap_address_init(&tmp);
+  if (addr && addr->size <= sizeof(tmp.addr)) {
+    tmp.size = addr->size;
+    memcpy(&tmp.addr, &addr->addr, addr->size);
+  }
+  coap_session_peer_key(key, &tmp, 0);
+#else /* WITH_LWIP || WITH_CONTIKI */
+  coap_address_t tmp;
+
+  coap_address_init(&tmp);
+  coap_session_peer_key(key, addr ? addr : &tmp, 0);
+#endif /* WITH_LWIP || WITH_CONTIKI */
+}
+
+/* Adds @p len and then @p data, so that no two inputs run into each other */
+static void
+coap_pool_digest_update(coap_digest_ctx_t *dctx, const void *data,
+                        size_t len) {
+  uint64_t length = data ? len : (uint64_t)-1;
+
+  coap_digest_update(dctx, (const uint8_t *)&length, sizeof(length));
+  if (data && len)
+    coap_digest_update(dctx, data, len);
+}
+
+static void
+coap_pool_digest_string(coap_digest_ctx_t *dctx, const char *s) {
+  coap_pool_digest_update(dctx, s, s ? strlen(s) : 0);
+}
+
+static int
+coap_pool_digest_psk(coap_digest_t *digest, const coap_dtls_cpsk_t *setup) {
+  coap_digest_ctx_t *dctx = coap_digest_setup();
+
+  if (!dctx)
+    return 0;
+  coap_pool_digest_update(dctx, "psk", 3);
+  coap_pool_digest_update(dctx, &setup->version, sizeof(setup->version));
+  coap_pool_digest_update(dctx, &setup->validate_ih_call_back,
+                          sizeof(setup->validate_ih_call_back));
+  coap_pool_digest_update(dctx, &setup->ih_call_back_arg,
+                          sizeof(setup->ih_call_back_arg));
+  coap_pool_digest_string(dctx, setup->client_sni);
+  coap_pool_digest_update(dctx, setup->psk_info.identity.s,
+                          setup->psk_info.identity.length);
+  coap_pool_digest_update(dctx, setup->psk_info.key.s,
+                          setup->psk_info.key.length);
+  return coap_digest_final(dctx, digest);
+}
+
+static int
+coap_pool_digest_pki(coap_digest_t *digest, const coap_dtls_pki_t *setup) {
+  coap_digest_ctx_t *dctx = coap_digest_setup();
+  const coap_dtls_key_t *key = &setup->pki_key;
+
+  if (!dctx)
+    return 0;
+  coap_pool_digest_update(dctx, "pki", 3);
+  /* The version and all the options */
+  coap_pool_digest_update(dctx, setup, offsetof(coap_dtls_pki_t, reserved));
+  coap_pool_digest_update(dctx, &setup->validate_cn_call_back,
+                          sizeof(setup->validate_cn_call_back));
+  coap_pool_digest_update(dctx, &setup->cn_call_back_arg,
+                          sizeof(setup->cn_call_back_arg));
+  coap_pool_digest_update(dctx, &setup->validate_sni_call_back,
+                          sizeof(setup->validate_sni_call_back));
+  coap_pool_digest_update(dctx, &setup->sni_call_back_arg,
+                          sizeof(setup->sni_call_back_arg));
+  coap_pool_digest_update(dctx, &setup->additional_tls_setup_call_back,
+                          sizeof(setup->additional_tls_setup_call_back));
+  coap_pool_digest_string(dctx, setup->client_sni);
+  coap_pool_digest_update(dctx, &key->key_type, sizeof(key->key_type));
+  switch (key->key_type) {
+  case COAP_PKI_KEY_PEM:
+    coap_pool_digest_string(dctx, key->key.pem.ca_file);
+    coap_pool_digest_string(dctx, key->key.pem.public_cert);
+    coap_pool_digest_string(dctx, key->key.pem.private_key);
+    break;
+  case COAP_PKI_KEY_PEM_BUF:
+    coap_pool_digest_update(dctx, key->key.pem_buf.ca_cert,
+                            key->key.pem_buf.ca_cert_len);
+    coap_pool_digest_update(dctx, key->key.pem_buf.public_cert,
+                            key->key.pem_buf.public_cert_len);
+    coap_pool_digest_update(dctx, key->key.pem_buf.private_key,
+                            key->key.pem_buf.private_key_len);
+    break;
+  case COAP_PKI_KEY_ASN1:
+    coap_pool_digest_update(dctx, key->key.asn1.ca_cert,
+                            key->key.asn1.ca_cert_len);
+    coap_pool_digest_update(dctx, key->key.asn1.public_cert,
+                            key->key.asn1.public_cert_len);
+    coap_pool_digest_update(dctx, key->key.asn1.private_key,
+                            key->key.asn1.private_key_len);
+    coap_pool_digest_update(dctx, &key->key.asn1.private_key_type,
+                            sizeof(key->key.asn1.private_key_type));
+    break;
+  case COAP_PKI_KEY_PKCS11:
+    coap_pool_digest_string(dctx, key->key.pkcs11.ca);
+    coap_pool_digest_string(dctx, key->key.pkcs11.public_cert);
+    coap_pool_digest_string(dctx, key->key.pkcs11.private_key);
+    coap_pool_digest_string(dctx, key->key.pkcs11.user_pin);
+    break;
+  default:
+    break;
+  }
+  return coap_digest_final(dctx, digest);
+}
+
+static void
+coap_pool_entry_free(coap_context_t *context, coap_pool_entry_t *entry) {
+  HASH_DELETE(hh, context->session_pool, entry);
+  entry->session->pool_entry = NULL;
+  coap_session_release(entry->session);
+  coap_free_type(COAP_STRING, entry);
+}
+
+void
+coap_context_set_session_pool(coap_context_t *context,
+                              unsigned int max_sessions,
+                              unsigned int idle_timeout) {
+  coap_pool_entry_t *entry, *tmp;
+  unsigned int count = HASH_COUNT(context->session_pool);
+
+  context->session_pool_max = max_sessions;
+  context->session_pool_idle = idle_timeout;
+  HASH_ITER(hh, context->session_pool, entry, tmp) {
+    if (count <= max_sessions)
+      break;
+    /* The application holds on to those still in use */
+    coap_pool_entry_free(context, entry);
+    count--;
+  }
+  HASH_ITER(hh, context->session_pool, entry, tmp) {
+    coap_session_timer_arm(entry->session, 0);
+  }
+}
+
+/* Returns the pooled session for @p key with a reference for the caller */
+static coap_session_t *
+coap_pool_find(coap_context_t *context, const coap_pool_key_t *key) {
+  coap_pool_entry_t *entry;
+
+  HASH_FIND(hh, context->session_pool, key, sizeof(*key), entry);
+  if (!entry)
+    return NULL;
+  if (entry->session->state == COAP_SESSION_STATE_NONE) {
+    /* Failed or disconnected, so make way for a new one */
+    coap_pool_entry_free(context, entry);
+    return NULL;
+  }
+  /* Most recently used last */
+  HASH_DELETE(hh, context->session_pool, entry);
+  HASH_ADD(hh, context->session_pool, key, sizeof(entry->key), entry);
+  coap_ticks(&entry->last_used);
+  coap_log(LOG_DEBUG, "***%s: reused from the session pool\n",
+           coap_session_str(entry->session));
+  return coap_session_reference(entry->session);
+}
+
+/* Adds @p session, which the caller holds, to the pool if there is room */
+static void
+coap_pool_add(coap_context_t *context, const coap_pool_key_t *key,
+              coap_session_t *session) {
+  coap_pool_entry_t *entry, *tmp;
+  unsigned int count = HASH_COUNT(context->session_pool);
+
+  HASH_ITER(hh, context->session_pool, entry, tmp) {
+    if (count < context->session_pool_max)
+      break;
+    /* Least recently used first, skipping those still in use */
+    if (entry->session->ref == 1) {
+      coap_pool_entry_free(context, entry);
+      count--;
+    }
+  }
+  if (count >= context->session_pool_max)
+    return;
+
+  entry = coap_malloc_type(COAP_STRING, sizeof(coap_pool_entry_t));
+  if (!entry)
+    return;
+  memset(entry, 0, sizeof(coap_pool_entry_t));
+  entry->key = *key;
+  entry->session = coap_session_reference(session);
+  coap_ticks(&entry->last_used);
+  session->pool_entry = entry;
+  HASH_ADD(hh, context->session_pool, key, sizeof(entry->key), entry);
+  if (context->session_pool_idle)
+    coap_session_timer_arm(session, entry->last_used +
+                           (coap_tick_t)context->session_pool_idle *
+                           COAP_TICKS_PER_SECOND);
+}
+
+static void
+coap_pool_key(coap_pool_key_t *key, const coap_address_t *local_if,
+              const coap_address_t *server, coap_proto_t proto) {
+  memset(key, 0, sizeof(*key));
+  coap_pool_address_key(&key->remote, server);
+  coap_pool_address_key(&key->local, local_if);
+  key->proto = proto;
+}
+
+coap_session_t *
+coap_get_client_session(coap_context_t *ctx, const coap_address_t *local_if,
+                        const coap_address_t *server, coap_proto_t proto) {
+  coap_pool_key_t key;
+  coap_session_t *session;
+
+  if (!ctx->session_pool_max || !server)
+    return coap_new_client_session(ctx, local_if, server, proto);
+  coap_pool_key(&key, local_if, server, proto);
+  session = coap_pool_find(ctx, &key);
+  if (session)
+    return session;
+  session = coap_new_client_session(ctx, local_if, server, proto);
+  if (session)
+    coap_pool_add(ctx, &key, session);
+  return session;
+}
+
+coap_session_t *
+coap_get_client_session_psk2(coap_context_t *ctx,
+                             const coap_address_t *local_if,
+                             const coap_address_t *server,
+                             coap_proto_t proto,
+                             coap_dtls_cpsk_t *setup_data) {
+  coap_pool_key_t key;
+  coap_session_t *session;
+
+  if (!ctx->session_pool_max || !server || !setup_data)
+    return coap_new_client_session_psk2(ctx, local_if, server, proto,
+                                        setup_data);
+  coap_pool_key(&key, local_if, server, proto);
+  if (!coap_pool_digest_psk(&key.security, setup_data))
+    return coap_new_client_session_psk2(ctx, local_if, server, proto,
+                                        setup_data);
+  session = coap_pool_find(ctx, &key);
+  if (session)
+    return session;
+  session = coap_new_client_session_psk2(ctx, local_if, server, proto,
+                                         setup_data);
+  if (session)
+    coap_pool_add(ctx, &key, session);
+  return session;
+}
+
+coap_session_t *
+coap_get_client_session_pki(coap_context_t *ctx,
+                            const coap_address_t *local_if,
+                            const coap_address_t *server,
+                            coap_proto_t proto,
+                            coap_dtls_pki_t *setup_data) {
+  coap_pool_key_t key;
+  coap_session_t *session;
+
+  if (!ctx->session_pool_max || !server || !setup_data)
+    return coap_new_client_session_pki(ctx, local_if, server, proto,
+                                       setup_data);
+  coap_pool_key(&key, local_if, server, proto);
+  if (!coap_pool_digest_pki(&key.security, setup_data))
+    return coap_new_client_session_pki(ctx, local_if, server, proto,
+                                       setup_data);
+  session = coap_pool_find(ctx, &key);
+  if (session)
+    return session;
+  session = coap_new_client_session_pki(ctx, local_if, server, proto,
+                                        setup_data);
+  if (session)
+    coap_pool_add(ctx, &key, session);
+  return session;
+}
+
+int
+coap_session_pool_check(coap_session_t *session, coap_tick_t now,
+                        coap_tick_t *due) {
+  coap_context_t *context = session->context;
+  coap_pool_entry_t *entry = session->pool_entry;
+  coap_tick_t idle = (coap_tick_t)context->session_pool_idle *
+                     COAP_TICKS_PER_SECOND;
+
+  *due = 0;
+  if (session->ref > 1) {
+    /* Still held by the application, which counts as being used */
+    entry->last_used = now;
+  } else if (session->state == COAP_SESSION_STATE_NONE ||
+             (idle && entry->last_used + idle <= now)) {
+    coap_log(LOG_DEBUG, "***%s: evicted from the session pool\n",
+             coap_session_str(session));
+    coap_pool_entry_free(context, entry);
+    return 0;
+  }
+  if (idle)
+    *due = entry->last_used + idle;
+  return 1;
+}
+
+void
+coap_session_pool_free(coap_context_t *context) {
+  coap_pool_entry_t *entry, *tmp;
+
+  HASH_ITER(hh, context->session_pool, entry, tmp) {
+    coap_pool_entry_free(context, entry);
+  }
+}
@@ -230,6 +230,15 @@ coap_socket_bind_tcp(coap_socket_t *sock,
              "coap_socket_bind_tcp: setsockopt SO_REUSEADDR: %s\n",
              coap_socket_strerror());
 
+#ifdef SO_REUSEPORT
+  if ((sock->flags & COAP_SOCKET_REUSEPORT) &&
+      setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, OPTVAL_T(&on),
+                 sizeof(on)) == COAP_SOCKET_ERROR)
+    coap_log(LOG_WARNING,
+             "coap_socket_bind_tcp: setsockopt SO_REUSEPORT: %s\n",
+             coap_socket_strerror());
+#endif /* SO_REUSEPORT */
+
   switch (listen_addr->addr.sa.sa_family) {
   case AF_INET:
     break;
@@ -293,10 +302,21 @@ coap_socket_accept_tcp(coap_socket_t *server,
   new_client->fd = accept(server->fd, &remote_addr->addr.sa,
                           &remote_addr->size);
   if (new_client->fd == COAP_INVALID_SOCKET) {
+#ifndef _WIN32
+    if (COAP_SOCKET_WOULD_BLOCK(errno)) {
+      /* Edge-triggered endpoint has no more pending connections */
+      coap_log(LOG_DEBUG, "coap_socket_accept_tcp: accept: %s\n",
+               coap_socket_strerror());
+      return 0;
+    }
+#endif /* ! _WIN32 */
     coap_log(LOG_WARNING, "coap_socket_accept_tcp: accept: %s\n",
              coap_socket_strerror());
     return 0;
   }
+  /* An edge-triggered endpoint accepts until there is nothing pending */
+  if (server->flags & COAP_SOCKET_EDGE)
+    server->flags |= COAP_SOCKET_CAN_ACCEPT;
 
   if (getsockname( new_client->fd, &local_addr->addr.sa, &local_addr->size) < 0)
     coap_log(LOG_WARNING, "coap_socket_accept_tcp: getsockname: %s\n",
@@ -27,7 +27,12 @@ static coap_tick_t coap_clock_offset = 0;
   /* _POSIX_TIMERS is > 0 when clock_gettime() is available */
 
   /* Use real-time clock for correct timestamps in coap_log(). */
+#if defined(COAP_CLOCK_COARSE) && defined(CLOCK_REALTIME_COARSE)
+  /* Cheaper to read, but only updated every scheduler tick */
+#define COAP_CLOCK CLOCK_REALTIME_COARSE
+#else /* ! COAP_CLOCK_COARSE || ! CLOCK_REALTIME_COARSE */
 #define COAP_CLOCK CLOCK_REALTIME
+#endif /* ! COAP_CLOCK_COARSE || ! CLOCK_REALTIME_COARSE */
 #endif
 
 #ifdef HAVE_WINSOCK2_H
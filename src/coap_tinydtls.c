@@ -214,7 +214,7 @@ get_psk_info(struct dtls_context_t *dtls_context,
         coap_session->type != COAP_SESSION_TYPE_CLIENT)
       goto error;
 
-    setup_cdata = &coap_session->cpsk_setup_data;
+    setup_cdata = &coap_session->ext->cpsk_setup_data;
 
     temp.s = id;
     temp.length = id_len;
@@ -238,11 +238,11 @@ get_psk_info(struct dtls_context_t *dtls_context,
       if (psk_info->key.length > sizeof(psk))
         return 0;
 
-      if (coap_session->psk_identity) {
-        coap_delete_bin_const(coap_session->psk_identity);
+      if (coap_session->ext->psk_identity) {
+        coap_delete_bin_const(coap_session->ext->psk_identity);
       }
       identity_length = psk_info->identity.length;
-      coap_session->psk_identity = coap_new_bin_const(psk_info->identity.s, identity_length);
+      coap_session->ext->psk_identity = coap_new_bin_const(psk_info->identity.s, identity_length);
       memcpy(result, psk_info->identity.s, identity_length);
       result[identity_length] = '\000';
 
@@ -282,14 +282,16 @@ get_psk_info(struct dtls_context_t *dtls_context,
         id = (const uint8_t *)"";
 
       /* Track the Identity being used */
-      if (coap_session->psk_identity)
-        coap_delete_bin_const(coap_session->psk_identity);
-      coap_session->psk_identity = coap_new_bin_const(id, id_len);
+      if (coap_session->ext->psk_identity)
+        coap_delete_bin_const(coap_session->ext->psk_identity);
+      coap_session->ext->psk_identity = coap_new_bin_const(id, id_len);
 
       coap_log(LOG_DEBUG, "got psk_identity: '%.*s'\n",
                (int)id_len, id);
 
-      if (setup_sdata->validate_id_call_back) {
+      /* A key found in the store is returned by get_server_psk() */
+      if (!coap_psk_store_set_session_key(coap_session, id, id_len) &&
+          setup_sdata->validate_id_call_back) {
         coap_bin_const_t lidentity;
         lidentity.length = id_len;
         lidentity.s = (const uint8_t*)id;
@@ -661,6 +663,12 @@ coap_dtls_hello(coap_session_t *session,
   return res;
 }
 
+int
+coap_dtls_is_cookie_stateless(void) {
+  /* tinydtls makes and checks the cookies itself */
+  return 0;
+}
+
 unsigned int coap_dtls_get_overhead(coap_session_t *session) {
   (void)session;
   return 13 + 8 + 8;
@@ -1154,6 +1162,24 @@ coap_dtls_context_set_spsk(coap_context_t *coap_context COAP_UNUSED,
   return 1;
 }
 
+int
+coap_dtls_context_set_ticket_key(coap_context_t *coap_context COAP_UNUSED,
+  const uint8_t *key COAP_UNUSED,
+  size_t key_len COAP_UNUSED
+) {
+  coap_log(LOG_WARNING, "TinyDTLS does not support session tickets\n");
+  return 0;
+}
+
+int
+coap_dtls_context_share(coap_context_t *coap_context COAP_UNUSED,
+  coap_context_t *from COAP_UNUSED
+) {
+  coap_log(LOG_WARNING,
+           "TinyDTLS does not support sharing the DTLS configuration\n");
+  return 0;
+}
+
 int
 coap_dtls_context_check_keys_enabled(coap_context_t *ctx COAP_UNUSED)
 {
@@ -1185,6 +1211,10 @@ ssize_t coap_tls_read(coap_session_t *session COAP_UNUSED,
 ) {
   return -1;
 }
+
+int coap_tls_is_ktls_send(coap_session_t *session COAP_UNUSED) {
+  return 0;
+}
 #endif /* !COAP_DISABLE_TCP */
 
 coap_digest_ctx_t *
@@ -1221,6 +1251,29 @@ coap_digest_final(coap_digest_ctx_t *digest_ctx,
   return 1;
 }
 
+/* The AES-CCM of TinyDTLS is not public, so there is no OSCORE */
+int
+coap_crypto_aead_encrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+
+int
+coap_crypto_aead_decrypt(const uint8_t *key COAP_UNUSED,
+                         const uint8_t *nonce COAP_UNUSED,
+                         const uint8_t *aad COAP_UNUSED,
+                         size_t aad_len COAP_UNUSED,
+                         const uint8_t *in COAP_UNUSED,
+                         size_t in_len COAP_UNUSED,
+                         uint8_t *out COAP_UNUSED) {
+  return 0;
+}
+
 #else /* !HAVE_LIBTINYDTLS */
 
 #ifdef __clang__
@@ -0,0 +1,462 @@
+/* coap_trace.c -- Binary trace of the PDUs sent and received
+*
+* This file is part of the CoAP library libcoap. Please see
+* README for terms of use.
+*/
+
+#include "coap2/coap_internal.h"
+
+#ifdef COAP_TRACE_SUPPORT
+#include <stdio.h>
+
+/*
+ * The trace is a ring buffer of records, each a coap_trace_rec_t followed
+ * by the captured bytes of the PDU, padded to a multiple of 8 bytes.
+ * head counts the bytes ever written and tail is where the oldest record
+ * that is still held starts.  The I/O thread moves tail on before it
+ * overwrites a record, and head on once a record is complete, so a reader
+ * copies [tail, head) and then keeps the records from where tail has got
+ * to by the time the copy is done.
+ */
+typedef struct coap_trace_rec_t {
+  uint32_t length;        /* of the record, a multiple of 8 */
+  uint32_t session_id;
+  uint64_t ticks;
+  uint32_t pdu_length;    /* wire size of the PDU */
+  uint16_t captured;      /* bytes of the PDU that follow */
+  uint8_t flags;
+  uint8_t proto;
+  uint16_t local_port;
+  uint16_t remote_port;
+  uint8_t local[16];
+  uint8_t remote[16];
+  uint32_t reserved;
+} coap_trace_rec_t;
+
+#define COAP_TRACE_SENT 0x01
+#define COAP_TRACE_IPV6 0x02
+
+#define COAP_TRACE_MIN_SIZE 4096
+#define COAP_TRACE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct coap_trace_t {
+  uint8_t *buf;
+  size_t size;            /* a power of two */
+  size_t max_payload;
+  size_t max_captured;    /* so that a record takes at most a quarter */
+  uint32_t next_id;       /* last session_id handed out */
+  uint64_t head;
+  uint64_t tail;
+};
+
+static void
+coap_trace_put(coap_trace_t *trace, uint64_t pos, const void *data,
+               size_t len) {
+  size_t offset = (size_t)pos & (trace->size - 1);
+  size_t first = trace->size - offset;
+
+  if (first > len)
+    first = len;
+  memcpy(trace->buf + offset, data, first);
+  memcpy(trace->buf, (const uint8_t *)data + first, len - first);
+}
+
+static void
+coap_trace_get(const coap_trace_t *trace, uint64_t pos, void *data,
+               size_t len) {
+  size_t offset = (size_t)pos & (trace->size - 1);
+  size_t first = trace->size - offset;
+
+  if (first > len)
+    first = len;
+  memcpy(data, trace->buf + offset, first);
+  memcpy((uint8_t *)data + first, trace->buf, len - first);
+}
+
+static void
+coap_trace_address(const coap_address_t *addr, uint8_t *out,
+                   uint16_t *port, uint8_t *flags) {
+  switch (addr->addr.sa.sa_family) {
+  case AF_INET:
+    memcpy(out, &addr->addr.sin.sin_addr, 4);
+    break;
+  case AF_INET6:
+    memcpy(out, &addr->addr.sin6.sin6_addr, 16);
+    *flags |= COAP_TRACE_IPV6;
+    break;
+  default:
+    break;
+  }
+  *port = coap_address_get_port(addr);
+}
+
+void
+coap_trace_pdu(coap_session_t *session, const coap_pdu_t *pdu, int sent) {
+  coap_trace_t *trace = session->context ? session->context->trace : NULL;
+  const uint8_t *head;
+  const uint8_t *payload = NULL;
+  size_t head_length;
+  size_t payload_length = 0;
+  size_t length;
+  uint64_t pos, tail;
+  coap_tick_t now;
+  coap_trace_rec_t rec;
+
+  if (!trace || !pdu->hdr_size)
+    return;
+
+  /* The header, token and options are kept whole, the payload cut short */
+  head = pdu->token - pdu->hdr_size;
+  head_length = pdu->hdr_size + pdu->used_size;
+  if (pdu->xmit_data) {
+    payload = pdu->xmit_data;
+    payload_length = pdu->xmit_length;
+  } else if (pdu->data) {
+    payload = pdu->data;
+    payload_length = pdu->token + pdu->used_size - pdu->data;
+    head_length -= payload_length;
+  }
+  if (payload_length > trace->max_payload)
+    payload_length = trace->max_payload;
+  if (head_length > trace->max_captured) {
+    head_length = trace->max_captured;
+    payload_length = 0;
+  } else if (payload_length > trace->max_captured - head_length) {
+    payload_length = trace->max_captured - head_length;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  length = COAP_TRACE_ALIGN(sizeof(rec) + head_length + payload_length);
+  rec.length = (uint32_t)length;
+  if (!session->trace_id)
+    session->trace_id = ++trace->next_id;
+  rec.session_id = session->trace_id;
+  coap_io_ticks(session->context, &now);
+  rec.ticks = now;
+  rec.pdu_length = (uint32_t)COAP_PDU_WIRE_SIZE(pdu);
+  rec.captured = (uint16_t)(head_length + payload_length);
+  rec.flags = sent ? COAP_TRACE_SENT : 0;
+  rec.proto = session->proto;
+  coap_trace_address(&session->addr_info.local, rec.local, &rec.local_port,
+                     &rec.flags);
+  coap_trace_address(&session->addr_info.remote, rec.remote,
+                     &rec.remote_port, &rec.flags);
+
+  /* Drop the oldest records to make room, before overwriting them */
+  pos = trace->head;
+  tail = trace->tail;
+  if (pos + length - tail > trace->size) {
+    while (pos + length - tail > trace->size) {
+      uint32_t old_length;
+
+      coap_trace_get(trace, tail, &old_length, sizeof(old_length));
+      tail += old_length;
+    }
+    __atomic_store_n(&trace->tail, tail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  coap_trace_put(trace, pos, &rec, sizeof(rec));
+  coap_trace_put(trace, pos + sizeof(rec), head, head_length);
+  if (payload_length)
+    coap_trace_put(trace, pos + sizeof(rec) + head_length, payload,
+                   payload_length);
+  __atomic_store_n(&trace->head, pos + length, __ATOMIC_RELEASE);
+}
+
+void
+coap_trace_free(coap_context_t *context) {
+  if (context->trace) {
+    coap_free_type(COAP_STRING, context->trace->buf);
+    coap_free_type(COAP_STRING, context->trace);
+    context->trace = NULL;
+  }
+}
+
+int
+coap_context_set_trace(coap_context_t *context, size_t size,
+                       size_t max_payload) {
+  coap_trace_t *trace;
+  size_t ring = COAP_TRACE_MIN_SIZE;
+
+  if (!context)
+    return 0;
+  coap_trace_free(context);
+  if (size == 0)
+    return 1;
+
+  while (ring < size && ring < ((size_t)1 << 30))
+    ring <<= 1;
+  trace = coap_malloc_type(COAP_STRING, sizeof(coap_trace_t));
+  if (!trace)
+    return 0;
+  memset(trace, 0, sizeof(coap_trace_t));
+  trace->buf = coap_malloc_type(COAP_STRING, ring);
+  if (!trace->buf) {
+    coap_free_type(COAP_STRING, trace);
+    return 0;
+  }
+  trace->size = ring;
+  trace->max_payload = max_payload;
+  trace->max_captured = ring / 4 - sizeof(coap_trace_rec_t);
+  if (trace->max_captured > 0xffff)
+    trace->max_captured = 0xffff;
+  context->trace = trace;
+  return 1;
+}
+
+/* pcapng block types, options and the exported PDU tags */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_EPB_INBOUND 1
+#define PCAPNG_EPB_OUTBOUND 2
+#define LINKTYPE_WIRESHARK_UPPER_PDU 252
+
+#define EXP_PDU_TAG_DISSECTOR_NAME 12
+#define EXP_PDU_TAG_IPV4_SRC 20
+#define EXP_PDU_TAG_IPV4_DST 21
+#define EXP_PDU_TAG_IPV6_SRC 22
+#define EXP_PDU_TAG_IPV6_DST 23
+#define EXP_PDU_TAG_PORT_TYPE 24
+#define EXP_PDU_TAG_SRC_PORT 25
+#define EXP_PDU_TAG_DST_PORT 26
+#define EXP_PDU_PT_TCP 2
+#define EXP_PDU_PT_UDP 3
+
+/* Large enough for the block around the longest record */
+#define COAP_TRACE_BLOCK_EXTRA 256
+
+static size_t
+coap_trace_u16(uint8_t *p, uint16_t v) {
+  memcpy(p, &v, sizeof(v));
+  return sizeof(v);
+}
+
+static size_t
+coap_trace_u32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+  return sizeof(v);
+}
+
+/* pcapng options are in the byte order of the file, padded to 4 bytes */
+static size_t
+coap_trace_option(uint8_t *p, uint16_t code, const void *value,
+                  uint16_t length) {
+  size_t padded = (length + 3) & ~(size_t)3;
+
+  coap_trace_u16(p, code);
+  coap_trace_u16(p + 2, length);
+  memcpy(p + 4, value, length);
+  memset(p + 4 + length, 0, padded - length);
+  return 4 + padded;
+}
+
+/* Exported PDU tags are big-endian, also padded to 4 bytes */
+static size_t
+coap_trace_tag(uint8_t *p, uint16_t tag, const void *value, uint16_t length) {
+  size_t padded = (length + 3) & ~(size_t)3;
+
+  p[0] = (uint8_t)(tag >> 8);
+  p[1] = (uint8_t)tag;
+  p[2] = (uint8_t)(padded >> 8);
+  p[3] = (uint8_t)padded;
+  memcpy(p + 4, value, length);
+  memset(p + 4 + length, 0, padded - length);
+  return 4 + padded;
+}
+
+static size_t
+coap_trace_tag_u32(uint8_t *p, uint16_t tag, uint32_t v) {
+  uint8_t value[4];
+
+  value[0] = (uint8_t)(v >> 24);
+  value[1] = (uint8_t)(v >> 16);
+  value[2] = (uint8_t)(v >> 8);
+  value[3] = (uint8_t)v;
+  return coap_trace_tag(p, tag, value, sizeof(value));
+}
+
+static int
+coap_trace_write_block(FILE *file, uint8_t *block, size_t length) {
+  /* The total length goes at both ends */
+  coap_trace_u32(block + 4, (uint32_t)length);
+  coap_trace_u32(block + length - 4, (uint32_t)length);
+  return fwrite(block, length, 1, file) == 1;
+}
+
+static size_t
+coap_trace_epb(uint8_t *block, const coap_trace_rec_t *rec,
+               const uint8_t *data) {
+  const uint8_t *src = (rec->flags & COAP_TRACE_SENT) ? rec->local
+                                                      : rec->remote;
+  const uint8_t *dst = (rec->flags & COAP_TRACE_SENT) ? rec->remote
+                                                      : rec->local;
+  uint16_t src_port = (rec->flags & COAP_TRACE_SENT) ? rec->local_port
+                                                     : rec->remote_port;
+  uint16_t dst_port = (rec->flags & COAP_TRACE_SENT) ? rec->remote_port
+                                                     : rec->local_port;
+  int reliable = COAP_PROTO_RELIABLE(rec->proto);
+  const char *dissector = reliable ? "coap_tcp_tls" : "coap";
+  uint64_t us = coap_ticks_to_rt_us((coap_tick_t)rec->ticks);
+  uint8_t *p = block + 28;
+  size_t tags;
+  uint32_t flags;
+  char comment[32];
+
+  /* The exported PDU tags, then the PDU */
+  p += coap_trace_tag(p, EXP_PDU_TAG_DISSECTOR_NAME, dissector,
+                      (uint16_t)strlen(dissector));
+  if (rec->flags & COAP_TRACE_IPV6) {
+    p += coap_trace_tag(p, EXP_PDU_TAG_IPV6_SRC, src, 16);
+    p += coap_trace_tag(p, EXP_PDU_TAG_IPV6_DST, dst, 16);
+  } else {
+    p += coap_trace_tag(p, EXP_PDU_TAG_IPV4_SRC, src, 4);
+    p += coap_trace_tag(p, EXP_PDU_TAG_IPV4_DST, dst, 4);
+  }
+  p += coap_trace_tag_u32(p, EXP_PDU_TAG_PORT_TYPE,
+                          reliable ? EXP_PDU_PT_TCP : EXP_PDU_PT_UDP);
+  p += coap_trace_tag_u32(p, EXP_PDU_TAG_SRC_PORT, src_port);
+  p += coap_trace_tag_u32(p, EXP_PDU_TAG_DST_PORT, dst_port);
+  p += coap_trace_tag(p, 0, NULL, 0);
+  tags = p - (block + 28);
+  memcpy(p, data, rec->captured);
+  p += rec->captured;
+  memset(p, 0, ((tags + rec->captured + 3) & ~(size_t)3) - tags -
+               rec->captured);
+  p = block + 28 + ((tags + rec->captured + 3) & ~(size_t)3);
+
+  coap_trace_u32(block, PCAPNG_EPB);
+  coap_trace_u32(block + 8, 0);
+  coap_trace_u32(block + 12, (uint32_t)(us >> 32));
+  coap_trace_u32(block + 16, (uint32_t)us);
+  coap_trace_u32(block + 20, (uint32_t)(tags + rec->captured));
+  coap_trace_u32(block + 24, (uint32_t)(tags + rec->pdu_length));
+
+  flags = (rec->flags & COAP_TRACE_SENT) ? PCAPNG_EPB_OUTBOUND
+                                         : PCAPNG_EPB_INBOUND;
+  p += coap_trace_option(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+  snprintf(comment, sizeof(comment), "session %u", rec->session_id);
+  p += coap_trace_option(p, PCAPNG_OPT_COMMENT, comment,
+                         (uint16_t)strlen(comment));
+  p += coap_trace_option(p, 0, NULL, 0);
+  return p + 4 - block;
+}
+
+int
+coap_trace_write_pcapng(coap_context_t *context, const char *filename) {
+  coap_trace_t *trace = context ? context->trace : NULL;
+  uint64_t head, tail, pos;
+  uint8_t *copy;
+  uint8_t *block;
+  size_t length;
+  FILE *file;
+  int count = 0;
+
+  if (!trace)
+    return -1;
+
+  /*
+   * Take a copy of the records, then keep those not overwritten meanwhile.
+   * The tail is loaded first so that it cannot pass the head.  If records
+   * have been added in between, the tail has moved on to at least
+   * head - size by the time the copy is checked below.
+   */
+  tail = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+  head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  if (head - tail > trace->size)
+    tail = head - trace->size;
+  copy = coap_malloc_type(COAP_STRING, (size_t)(head - tail) + 1);
+  block = coap_malloc_type(COAP_STRING,
+                           trace->max_captured + COAP_TRACE_BLOCK_EXTRA);
+  if (!copy || !block) {
+    coap_free_type(COAP_STRING, copy);
+    coap_free_type(COAP_STRING, block);
+    return -1;
+  }
+  coap_trace_get(trace, tail, copy, (size_t)(head - tail));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  pos = __atomic_load_n(&trace->tail, __ATOMIC_RELAXED);
+  if (pos < tail)
+    pos = tail;
+
+  file = fopen(filename, "wb");
+  if (!file) {
+    coap_log(LOG_WARNING, "coap_trace_write_pcapng: %s: cannot open\n",
+             filename);
+    coap_free_type(COAP_STRING, copy);
+    coap_free_type(COAP_STRING, block);
+    return -1;
+  }
+
+  /* Section Header Block */
+  coap_trace_u32(block, PCAPNG_SHB);
+  coap_trace_u32(block + 8, PCAPNG_BYTE_ORDER_MAGIC);
+  coap_trace_u16(block + 12, 1);
+  coap_trace_u16(block + 14, 0);
+  coap_trace_u32(block + 16, 0xffffffff);
+  coap_trace_u32(block + 20, 0xffffffff);
+  length = 24;
+  length += coap_trace_option(block + length, 4, "libcoap",
+                              (uint16_t)strlen("libcoap"));
+  length += coap_trace_option(block + length, 0, NULL, 0);
+  if (!coap_trace_write_block(file, block, length + 4))
+    goto fail;
+
+  /* Interface Description Block, with timestamps in us */
+  coap_trace_u32(block, PCAPNG_IDB);
+  coap_trace_u16(block + 8, LINKTYPE_WIRESHARK_UPPER_PDU);
+  coap_trace_u16(block + 10, 0);
+  coap_trace_u32(block + 12, 0);
+  if (!coap_trace_write_block(file, block, 20))
+    goto fail;
+
+  while (pos < head) {
+    coap_trace_rec_t rec;
+
+    memcpy(&rec, copy + (pos - tail), sizeof(rec));
+    if (rec.length < sizeof(rec) || rec.length > head - pos)
+      break;
+    length = coap_trace_epb(block, &rec, copy + (pos - tail) + sizeof(rec));
+    if (!coap_trace_write_block(file, block, length))
+      goto fail;
+    count++;
+    pos += rec.length;
+  }
+
+  if (fclose(file) != 0)
+    count = -1;
+  coap_free_type(COAP_STRING, copy);
+  coap_free_type(COAP_STRING, block);
+  return count;
+
+fail:
+  coap_log(LOG_WARNING, "coap_trace_write_pcapng: %s: write failed\n",
+           filename);
+  fclose(file);
+  coap_free_type(COAP_STRING, copy);
+  coap_free_type(COAP_STRING, block);
+  return -1;
+}
+
+#else /* ! COAP_TRACE_SUPPORT */
+
+int
+coap_context_set_trace(coap_context_t *context, size_t size,
+                       size_t max_payload) {
+  (void)context;
+  (void)max_payload;
+  return size == 0;
+}
+
+int
+coap_trace_write_pcapng(coap_context_t *context, const char *filename) {
+  (void)context;
+  (void)filename;
+  return -1;
+}
+
+#endif /* ! COAP_TRACE_SUPPORT */
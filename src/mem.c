@@ -9,6 +9,101 @@
 
 #include "coap2/coap_internal.h"
 
+#ifdef COAP_MEM_STATS
+/* Number of entries in coap_memory_tag_t (COAP_LG_SRCV is the last one) */
+#define COAP_MEM_TAGS ((size_t)COAP_LG_SRCV + 1)
+
+static coap_memory_stats_t coap_mem_stats[COAP_MEM_TAGS];
+
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(RIOT_VERSION)
+#define COAP_MEM_ADD(Var, Val) __atomic_add_fetch(&(Var), (Val), __ATOMIC_RELAXED)
+#define COAP_MEM_SUB(Var, Val) __atomic_sub_fetch(&(Var), (Val), __ATOMIC_RELAXED)
+#define COAP_MEM_LOAD(Var) __atomic_load_n(&(Var), __ATOMIC_RELAXED)
+#define COAP_MEM_STORE(Var, Val) __atomic_store_n(&(Var), (Val), __ATOMIC_RELAXED)
+#else /* ! __GNUC__ || WITH_CONTIKI || RIOT_VERSION */
+#define COAP_MEM_ADD(Var, Val) ((Var) += (Val))
+#define COAP_MEM_SUB(Var, Val) ((Var) -= (Val))
+#define COAP_MEM_LOAD(Var) (Var)
+#define COAP_MEM_STORE(Var, Val) ((Var) = (Val))
+#endif /* ! __GNUC__ || WITH_CONTIKI || RIOT_VERSION */
+
+static void
+coap_mem_stats_peak(size_t *peak, size_t value) {
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(RIOT_VERSION)
+  size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (value > old &&
+         !__atomic_compare_exchange_n(peak, &old, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else /* ! __GNUC__ || WITH_CONTIKI || RIOT_VERSION */
+  if (value > *peak)
+    *peak = value;
+#endif /* ! __GNUC__ || WITH_CONTIKI || RIOT_VERSION */
+}
+
+static void
+coap_mem_stats_alloc(coap_memory_tag_t type, size_t size) {
+  coap_memory_stats_t *stats = &coap_mem_stats[type];
+
+  coap_mem_stats_peak(&stats->peak_count, COAP_MEM_ADD(stats->count, 1));
+  coap_mem_stats_peak(&stats->peak_bytes, COAP_MEM_ADD(stats->bytes, size));
+}
+
+static void
+coap_mem_stats_free(coap_memory_tag_t type, size_t size) {
+  COAP_MEM_SUB(coap_mem_stats[type].count, 1);
+  COAP_MEM_SUB(coap_mem_stats[type].bytes, size);
+}
+
+static void
+coap_mem_stats_fail(coap_memory_tag_t type) {
+  COAP_MEM_ADD(coap_mem_stats[type].failed, 1);
+}
+
+int
+coap_memory_stats(coap_memory_tag_t type, coap_memory_stats_t *stats) {
+  coap_memory_stats_t *cur;
+
+  if ((size_t)type >= COAP_MEM_TAGS || !stats)
+    return 0;
+  cur = &coap_mem_stats[type];
+  stats->count = COAP_MEM_LOAD(cur->count);
+  stats->bytes = COAP_MEM_LOAD(cur->bytes);
+  stats->peak_count = COAP_MEM_LOAD(cur->peak_count);
+  stats->peak_bytes = COAP_MEM_LOAD(cur->peak_bytes);
+  stats->failed = COAP_MEM_LOAD(cur->failed);
+  return 1;
+}
+
+void
+coap_memory_stats_reset_peak(coap_memory_tag_t type) {
+  coap_memory_stats_t *cur;
+
+  if ((size_t)type >= COAP_MEM_TAGS)
+    return;
+  cur = &coap_mem_stats[type];
+  COAP_MEM_STORE(cur->peak_count, COAP_MEM_LOAD(cur->count));
+  COAP_MEM_STORE(cur->peak_bytes, COAP_MEM_LOAD(cur->bytes));
+}
+
+#else /* ! COAP_MEM_STATS */
+#define coap_mem_stats_alloc(Type, Size) ((void)0)
+#define coap_mem_stats_free(Type, Size) ((void)0)
+#define coap_mem_stats_fail(Type) ((void)0)
+
+int
+coap_memory_stats(coap_memory_tag_t type, coap_memory_stats_t *stats) {
+  (void)type;
+  (void)stats;
+  return 0;
+}
+
+void
+coap_memory_stats_reset_peak(coap_memory_tag_t type) {
+  (void)type;
+}
+#endif /* ! COAP_MEM_STATS */
+
 #if defined(RIOT_VERSION) && defined(MODULE_MEMARRAY)
 #include <memarray.h>
 
@@ -240,8 +335,10 @@ static memarray_t option_storage;
 static coap_cache_key_t cache_key_storage_data[COAP_MAX_CACHE_KEYS];
 static memarray_t cache_key_storage;
 
+#ifndef COAP_WITHOUT_CACHE
 static coap_cache_entry_t cache_entry_storage_data[COAP_MAX_CACHE_ENTRIES];
 static memarray_t cache_entry_storage;
+#endif /* COAP_WITHOUT_CACHE */
 
 #define INIT_STORAGE(Storage, Count)  \
   memarray_init(&(Storage ## _storage), (Storage ## _storage_data), sizeof(Storage ## _storage_data[0]), (Count));
@@ -266,7 +363,9 @@ coap_memory_init(void) {
   INIT_STORAGE(session, COAP_MAX_SESSIONS);
   INIT_STORAGE(option, COAP_MAX_OPTIONS);
   INIT_STORAGE(cache_key, COAP_MAX_CACHE_KEYS);
+#ifndef COAP_WITHOUT_CACHE
   INIT_STORAGE(cache_entry, COAP_MAX_CACHE_ENTRIES);
+#endif /* COAP_WITHOUT_CACHE */
 }
 
 static memarray_t *
@@ -289,7 +388,9 @@ get_container(coap_memory_tag_t type) {
   case COAP_SESSION:         return &session_storage;
   case COAP_OPTLIST:         return &option_storage;
   case COAP_CACHE_KEY:       return &cache_key_storage;
-  case COAP_CACHE_ENTRY:     return &cache_key_entry;
+#ifndef COAP_WITHOUT_CACHE
+  case COAP_CACHE_ENTRY:     return &cache_entry_storage;
+#endif /* COAP_WITHOUT_CACHE */
   case COAP_STRING:
     /* fall through */
   default:
@@ -312,43 +413,462 @@ coap_malloc_type(coap_memory_tag_t type, size_t size) {
   }
 
   ptr = memarray_alloc(container);
-  if (!ptr)
+  if (!ptr) {
+    coap_mem_stats_fail(type);
     coap_log(LOG_WARNING,
              "coap_malloc_type: Failure (no free blocks) for type %d\n",
              type);
+  }
+  else {
+    coap_mem_stats_alloc(type, container->size);
+  }
   return ptr;
 }
 
 void
 coap_free_type(coap_memory_tag_t type, void *object) {
-  if (object != NULL)
-    memarray_free(get_container(type), object);
+  if (object != NULL) {
+    memarray_t *container = get_container(type);
+
+    coap_mem_stats_free(type, container->size);
+    memarray_free(container, object);
+  }
 }
 #else /* ! RIOT_VERSION */
 
 #ifdef HAVE_MALLOC
 #include <stdlib.h>
 
+#ifdef COAP_MEM_SLAB
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_MUTEX_LOCK)
+#include <pthread.h>
+#define COAP_SLAB_THREADS 1
+#endif /* HAVE_PTHREAD_H && HAVE_PTHREAD_MUTEX_LOCK */
+
+/**
+ * The number of objects carved out of each chunk that is requested from
+ * malloc(), which is also the number of objects moved between a thread
+ * cache and the shared depot in one go.
+ */
+#ifndef COAP_SLAB_BATCH
+#define COAP_SLAB_BATCH             (32U)
+#endif /* COAP_SLAB_BATCH */
+
+/**
+ * The maximum number of free objects of one type that a thread keeps
+ * for itself before handing #COAP_SLAB_BATCH of them back to the depot.
+ */
+#ifndef COAP_SLAB_CACHE_MAX
+#define COAP_SLAB_CACHE_MAX         (4U * (COAP_SLAB_BATCH))
+#endif /* COAP_SLAB_CACHE_MAX */
+
+#define COAP_SLAB_ALIGN             (2 * sizeof(void *))
+#define COAP_SLAB_ROUNDUP(Size) \
+  (((Size) + COAP_SLAB_ALIGN - 1) & ~(COAP_SLAB_ALIGN - 1))
+
+typedef struct coap_slab_obj_t {
+  struct coap_slab_obj_t *next;
+} coap_slab_obj_t;
+
+/* The shared part of a slab, only accessed with coap_slab_lock held. */
+typedef struct coap_slab_t {
+  const size_t size;        /**< object size, rounded up for alignment */
+  coap_slab_obj_t *depot;   /**< free objects returned by the threads */
+  size_t depot_count;       /**< number of objects in depot */
+  void *chunks;             /**< chunks obtained from malloc() */
+  size_t chunk_count;       /**< number of chunks */
+  size_t refills;           /**< number of thread cache refills */
+  size_t flushes;           /**< number of thread cache flushes */
+} coap_slab_t;
+
+/* The per-thread part of a slab. */
+typedef struct coap_slab_cache_t {
+  coap_slab_obj_t *head;    /**< free objects owned by this thread */
+  size_t count;             /**< number of objects in head */
+} coap_slab_cache_t;
+
+/*
+ * COAP_PDU_BUF objects vary in size, so they come from the slabs of a few
+ * size classes.  Each is preceded by a header with the size that it can
+ * hold, which tells the slab it goes back to, or that it is too large for
+ * any of them and has come from malloc().
+ */
+#define COAP_SLAB_BUF_HDR           COAP_SLAB_ALIGN
+#define COAP_SLAB_BUF_CLASS(Size) \
+  { COAP_SLAB_ROUNDUP(COAP_SLAB_BUF_HDR + COAP_PDU_MAX_TCP_HEADER_SIZE + \
+                      (Size)), NULL, 0, NULL, 0, 0, 0 }
+
+/* Index of the smallest COAP_PDU_BUF size class in coap_slabs[] */
+#define COAP_SLAB_BUF_FIRST 7
+
+static coap_slab_t coap_slabs[] = {
+  { COAP_SLAB_ROUNDUP(COAP_PDU_ALLOC_SIZE), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_queue_t)), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_session_t)), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_lg_xmit_t)), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_lg_crcv_t)), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_lg_srcv_t)), NULL, 0, NULL, 0, 0, 0 },
+  { COAP_SLAB_ROUNDUP(sizeof(coap_cache_key_t)), NULL, 0, NULL, 0, 0, 0 },
+  /* COAP_PDU_BUF, following the sizes coap_pdu_check_resize() grows by */
+  COAP_SLAB_BUF_CLASS(256),
+  COAP_SLAB_BUF_CLASS(512),
+  COAP_SLAB_BUF_CLASS(1024),
+  COAP_SLAB_BUF_CLASS(2048),
+};
+
+#define COAP_SLAB_COUNT (sizeof(coap_slabs) / sizeof(coap_slabs[0]))
+
+static COAP_THREAD_LOCAL coap_slab_cache_t coap_slab_cache[COAP_SLAB_COUNT];
+
+#ifdef COAP_SLAB_THREADS
+static pthread_mutex_t coap_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t coap_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t coap_slab_key;
+static COAP_THREAD_LOCAL int coap_slab_registered;
+#define coap_slab_lock() pthread_mutex_lock(&coap_slab_lock)
+#define coap_slab_unlock() pthread_mutex_unlock(&coap_slab_lock)
+#else /* ! COAP_SLAB_THREADS */
+#define coap_slab_lock()
+#define coap_slab_unlock()
+#endif /* ! COAP_SLAB_THREADS */
+
+/* Returns the index into coap_slabs[] for @p type or -1 if not slab backed */
+static int
+coap_slab_index(coap_memory_tag_t type) {
+  switch (type) {
+  case COAP_PDU:       return 0;
+  case COAP_NODE:      return 1;
+  case COAP_SESSION:   return 2;
+  case COAP_LG_XMIT:   return 3;
+  case COAP_LG_CRCV:   return 4;
+  case COAP_LG_SRCV:   return 5;
+  case COAP_CACHE_KEY: return 6;
+  default:             return -1;
+  }
+}
+
+/*
+ * Moves up to @p count objects from the head of @p cache onto the depot.
+ * Must be called with coap_slab_lock held.
+ */
+static void
+coap_slab_flush_locked(coap_slab_t *slab, coap_slab_cache_t *cache,
+                       size_t count) {
+  while (count-- && cache->head) {
+    coap_slab_obj_t *obj = cache->head;
+
+    cache->head = obj->next;
+    cache->count--;
+    obj->next = slab->depot;
+    slab->depot = obj;
+    slab->depot_count++;
+  }
+  slab->flushes++;
+}
+
+#ifdef COAP_SLAB_THREADS
+/* Hands all the objects cached by an exiting thread back to the depot */
+static void
+coap_slab_thread_exit(void *arg) {
+  coap_slab_cache_t *cache = (coap_slab_cache_t *)arg;
+  size_t i;
+
+  coap_slab_lock();
+  for (i = 0; i < COAP_SLAB_COUNT; i++) {
+    if (cache[i].head)
+      coap_slab_flush_locked(&coap_slabs[i], &cache[i], cache[i].count);
+  }
+  coap_slab_unlock();
+}
+
+static void
+coap_slab_key_create(void) {
+  pthread_key_create(&coap_slab_key, coap_slab_thread_exit);
+}
+#endif /* COAP_SLAB_THREADS */
+
+/*
+ * Refills an empty thread cache with a batch of objects, taken from the
+ * depot if possible, otherwise carved out of a new chunk.
+ */
+static int
+coap_slab_refill(coap_slab_t *slab, coap_slab_cache_t *cache) {
+  size_t i;
+
+#ifdef COAP_SLAB_THREADS
+  if (!coap_slab_registered) {
+    /* Get told when this thread exits so that its cache is not lost */
+    pthread_once(&coap_slab_once, coap_slab_key_create);
+    pthread_setspecific(coap_slab_key, coap_slab_cache);
+    coap_slab_registered = 1;
+  }
+#endif /* COAP_SLAB_THREADS */
+
+  coap_slab_lock();
+  slab->refills++;
+  if (slab->depot) {
+    for (i = 0; i < COAP_SLAB_BATCH && slab->depot; i++) {
+      coap_slab_obj_t *obj = slab->depot;
+
+      slab->depot = obj->next;
+      slab->depot_count--;
+      obj->next = cache->head;
+      cache->head = obj;
+      cache->count++;
+    }
+  }
+  else {
+    /* The first slot of a chunk links it into the list of chunks */
+    uint8_t *chunk = malloc(slab->size * (COAP_SLAB_BATCH + 1));
+
+    if (!chunk) {
+      coap_slab_unlock();
+      return 0;
+    }
+    *(void **)chunk = slab->chunks;
+    slab->chunks = chunk;
+    slab->chunk_count++;
+    for (i = COAP_SLAB_BATCH; i > 0; i--) {
+      coap_slab_obj_t *obj = (coap_slab_obj_t *)(chunk + i * slab->size);
+
+      obj->next = cache->head;
+      cache->head = obj;
+      cache->count++;
+    }
+  }
+  coap_slab_unlock();
+  return 1;
+}
+
+/* Takes a free object from the thread cache of coap_slabs[@p idx] */
+static void *
+coap_slab_get(size_t idx) {
+  coap_slab_cache_t *cache = &coap_slab_cache[idx];
+  coap_slab_obj_t *obj;
+
+  if (!cache->head && !coap_slab_refill(&coap_slabs[idx], cache))
+    return NULL;
+  obj = cache->head;
+  cache->head = obj->next;
+  cache->count--;
+  return obj;
+}
+
+/* Returns @p p to the thread cache of coap_slabs[@p idx] */
+static void
+coap_slab_put(size_t idx, void *p) {
+  coap_slab_cache_t *cache = &coap_slab_cache[idx];
+  coap_slab_obj_t *obj = (coap_slab_obj_t *)p;
+
+  obj->next = cache->head;
+  cache->head = obj;
+  if (++cache->count > COAP_SLAB_CACHE_MAX) {
+    coap_slab_lock();
+    coap_slab_flush_locked(&coap_slabs[idx], cache, COAP_SLAB_BATCH);
+    coap_slab_unlock();
+  }
+}
+
+/* The size that a COAP_PDU_BUF object of size class @p idx can hold */
+#define COAP_SLAB_BUF_SIZE(idx) (coap_slabs[idx].size - COAP_SLAB_BUF_HDR)
+
+static void *
+coap_slab_buf_alloc(size_t size) {
+  uint8_t *hdr;
+  size_t idx;
+
+  for (idx = COAP_SLAB_BUF_FIRST; idx < COAP_SLAB_COUNT; idx++) {
+    if (size <= COAP_SLAB_BUF_SIZE(idx))
+      break;
+  }
+  if (idx < COAP_SLAB_COUNT) {
+    hdr = coap_slab_get(idx);
+    size = COAP_SLAB_BUF_SIZE(idx);
+  }
+  else {
+    hdr = malloc(COAP_SLAB_BUF_HDR + size);
+  }
+  if (!hdr) {
+    coap_mem_stats_fail(COAP_PDU_BUF);
+    return NULL;
+  }
+  *(size_t *)hdr = size;
+  coap_mem_stats_alloc(COAP_PDU_BUF, size);
+  return hdr + COAP_SLAB_BUF_HDR;
+}
+
+static void
+coap_slab_buf_free(void *p) {
+  uint8_t *hdr;
+  size_t size;
+  size_t idx;
+
+  if (!p)
+    return;
+  hdr = (uint8_t *)p - COAP_SLAB_BUF_HDR;
+  size = *(size_t *)hdr;
+  coap_mem_stats_free(COAP_PDU_BUF, size);
+  for (idx = COAP_SLAB_BUF_FIRST; idx < COAP_SLAB_COUNT; idx++) {
+    if (size == COAP_SLAB_BUF_SIZE(idx)) {
+      coap_slab_put(idx, hdr);
+      return;
+    }
+  }
+  free(hdr);
+}
+
+static void *
+coap_slab_buf_realloc(void *p, size_t size) {
+  size_t old_size;
+  uint8_t *new_p;
+
+  if (!p)
+    return coap_slab_buf_alloc(size);
+  old_size = *(size_t *)((uint8_t *)p - COAP_SLAB_BUF_HDR);
+  if (size <= old_size)
+    return p;
+  /* Move up to a larger size class */
+  new_p = coap_slab_buf_alloc(size);
+  if (!new_p)
+    return NULL;
+  memcpy(new_p, p, old_size);
+  coap_slab_buf_free(p);
+  return new_p;
+}
+
+int
+coap_memory_slab_stats(coap_memory_tag_t type,
+                       coap_memory_slab_stats_t *stats) {
+  int idx = coap_slab_index(type);
+  coap_slab_t *slab;
+
+  if (idx < 0 || !stats)
+    return 0;
+  slab = &coap_slabs[idx];
+  coap_slab_lock();
+  stats->object_size = slab->size;
+  stats->chunks = slab->chunk_count;
+  stats->objects = slab->chunk_count * COAP_SLAB_BATCH;
+  stats->depot = slab->depot_count;
+  stats->refills = slab->refills;
+  stats->flushes = slab->flushes;
+  coap_slab_unlock();
+  stats->cached = coap_slab_cache[idx].count;
+  return 1;
+}
+
+#endif /* COAP_MEM_SLAB */
+
 void
 coap_memory_init(void) {
 }
 
+#ifdef COAP_MEM_STATS
+/*
+ * Without a slab the size of each object is not known when it is freed,
+ * so it is kept in a header in front of the object.
+ */
+#define COAP_MEM_HDR_SIZE (2 * sizeof(void *))
+#endif /* COAP_MEM_STATS */
+
 void *
 coap_malloc_type(coap_memory_tag_t type, size_t size) {
+  void *ptr;
+#ifdef COAP_MEM_SLAB
+  int idx = coap_slab_index(type);
+
+  if (idx >= 0) {
+    if (size > coap_slabs[idx].size) {
+      coap_mem_stats_fail(type);
+      coap_log(LOG_WARNING,
+               "coap_malloc_type: %zu bytes too big for type %d\n",
+               size, type);
+      return NULL;
+    }
+    ptr = coap_slab_get(idx);
+    if (!ptr) {
+      coap_mem_stats_fail(type);
+      return NULL;
+    }
+    coap_mem_stats_alloc(type, coap_slabs[idx].size);
+    return ptr;
+  }
+  if (type == COAP_PDU_BUF)
+    return coap_slab_buf_alloc(size);
+#endif /* COAP_MEM_SLAB */
+#ifdef COAP_MEM_STATS
+  ptr = malloc(COAP_MEM_HDR_SIZE + size);
+  if (!ptr) {
+    coap_mem_stats_fail(type);
+    return NULL;
+  }
+  *(size_t *)ptr = size;
+  coap_mem_stats_alloc(type, size);
+  return (uint8_t *)ptr + COAP_MEM_HDR_SIZE;
+#else /* ! COAP_MEM_STATS */
   (void)type;
-  return malloc(size);
+  ptr = malloc(size);
+  return ptr;
+#endif /* ! COAP_MEM_STATS */
 }
 
 void *
 coap_realloc_type(coap_memory_tag_t type, void* p, size_t size) {
+#ifdef COAP_MEM_SLAB
+  if (type == COAP_PDU_BUF)
+    return coap_slab_buf_realloc(p, size);
+#endif /* COAP_MEM_SLAB */
+#ifdef COAP_MEM_STATS
+  uint8_t *hdr;
+  size_t old_size;
+
+  if (!p)
+    return coap_malloc_type(type, size);
+  hdr = (uint8_t *)p - COAP_MEM_HDR_SIZE;
+  old_size = *(size_t *)hdr;
+  hdr = realloc(hdr, COAP_MEM_HDR_SIZE + size);
+  if (!hdr) {
+    coap_mem_stats_fail(type);
+    return NULL;
+  }
+  *(size_t *)hdr = size;
+  coap_mem_stats_free(type, old_size);
+  coap_mem_stats_alloc(type, size);
+  return hdr + COAP_MEM_HDR_SIZE;
+#else /* ! COAP_MEM_STATS */
   (void)type;
   return realloc(p, size);
+#endif /* ! COAP_MEM_STATS */
 }
 
 void
 coap_free_type(coap_memory_tag_t type, void *p) {
+#ifdef COAP_MEM_SLAB
+  int idx = coap_slab_index(type);
+
+  if (idx >= 0) {
+    if (!p)
+      return;
+    coap_mem_stats_free(type, coap_slabs[idx].size);
+    coap_slab_put(idx, p);
+    return;
+  }
+  if (type == COAP_PDU_BUF) {
+    coap_slab_buf_free(p);
+    return;
+  }
+#endif /* COAP_MEM_SLAB */
+#ifdef COAP_MEM_STATS
+  if (p) {
+    uint8_t *hdr = (uint8_t *)p - COAP_MEM_HDR_SIZE;
+
+    coap_mem_stats_free(type, *(size_t *)hdr);
+    free(hdr);
+  }
+#else /* ! COAP_MEM_STATS */
   (void)type;
   free(p);
+#endif /* ! COAP_MEM_STATS */
 }
 
 #else /* ! HAVE_MALLOC */
@@ -395,7 +915,9 @@ MEMB(pdu_buf_storage, coap_packetbuf_t, COAP_PDU_MAXCNT);
 MEMB(resource_storage, coap_resource_t, COAP_MAX_RESOURCES);
 MEMB(attribute_storage, coap_attr_t, COAP_MAX_ATTRIBUTES);
 MEMB(cache_key_storage, coap_cache_key_t, COAP_MAX_CACHE_KEYS);
+#ifndef COAP_WITHOUT_CACHE
 MEMB(cache_entry_storage, coap_cache_entry_t, COAP_MAX_CACHE_ENTRIES);
+#endif /* COAP_WITHOUT_CACHE */
 MEMB(lg_xmit_storage, coap_lg_xmit_t, COAP_MAX_LG_XMIT);
 MEMB(lg_crcv_storage, coap_lg_crcv_t, COAP_MAX_LG_CRCV);
 MEMB(lg_srcv_storage, coap_lg_srcv_t, COAP_MAX_LG_SRCV);
@@ -411,7 +933,9 @@ get_container(coap_memory_tag_t type) {
   case COAP_RESOURCE: return &resource_storage;
   case COAP_RESOURCEATTR: return &attribute_storage;
   case COAP_CACHE_KEY:    return &cache_key_storage;
+#ifndef COAP_WITHOUT_CACHE
   case COAP_CACHE_ENTRY:  return &cache_entry_storage;
+#endif /* COAP_WITHOUT_CACHE */
   case COAP_LG_XMIT: return &lg_xmit_storage;
   case COAP_LG_CRCV: return &lg_crcv_storage;
   case COAP_LG_SRCV: return &lg_srcv_storage;
@@ -431,7 +955,9 @@ coap_memory_init(void) {
   memb_init(&resource_storage);
   memb_init(&attribute_storage);
   memb_init(&cache_key_storage);
+#ifndef COAP_WITHOUT_CACHE
   memb_init(&cache_entry_storage);
+#endif /* COAP_WITHOUT_CACHE */
   memb_init(&lg_xmit_storage);
   memb_init(&lg_crcv_storage);
   memb_init(&lg_srcv_storage);
@@ -453,19 +979,117 @@ coap_malloc_type(coap_memory_tag_t type, size_t size) {
   }
 
   ptr = memb_alloc(container);
-  if (!ptr)
+  if (!ptr) {
+    coap_mem_stats_fail(type);
     coap_log(LOG_WARNING,
              "coap_malloc_type: Failure (no free blocks) for type %d\n",
              type);
+  }
+  else {
+    coap_mem_stats_alloc(type, container->size);
+  }
   return ptr;
 }
 
 void
 coap_free_type(coap_memory_tag_t type, void *object) {
-  memb_free(get_container(type), object);
+  struct memb *container = get_container(type);
+
+  if (object != NULL)
+    coap_mem_stats_free(type, container->size);
+  memb_free(container, object);
 }
 #endif /* WITH_CONTIKI */
 
 #endif /* ! HAVE_MALLOC */
 
 #endif /* ! RIOT_VERSION */
+
+#if !defined(COAP_MEM_SLAB) || !defined(HAVE_MALLOC) || \
+    (defined(RIOT_VERSION) && defined(MODULE_MEMARRAY))
+int
+coap_memory_slab_stats(coap_memory_tag_t type,
+                       coap_memory_slab_stats_t *stats) {
+  (void)type;
+  (void)stats;
+  return 0;
+}
+#endif /* ! COAP_MEM_SLAB || ! HAVE_MALLOC || RIOT_VERSION */
+
+/*
+ * Header of a block that an arena has taken from the heap, followed by
+ * the allocations.
+ */
+struct coap_arena_block_t {
+  coap_arena_block_t *next;
+  size_t size;                /* bytes following the header */
+};
+
+#define COAP_ARENA_ALIGN       (2 * sizeof(void *))
+#define COAP_ARENA_ROUNDUP(Size) \
+  (((Size) + COAP_ARENA_ALIGN - 1) & ~(COAP_ARENA_ALIGN - 1))
+#define COAP_ARENA_BLOCK_HDR   COAP_ARENA_ROUNDUP(sizeof(coap_arena_block_t))
+
+void
+coap_arena_init(coap_arena_t *arena, uint8_t *buf, size_t size) {
+  uintptr_t start = COAP_ARENA_ROUNDUP((uintptr_t)buf);
+
+  arena->blocks = NULL;
+  arena->block_size = COAP_ARENA_BLOCK_SIZE;
+  if (start > (uintptr_t)buf + size) {
+    arena->next = arena->end = buf;
+    return;
+  }
+  arena->next = (uint8_t *)start;
+  arena->end = buf + size;
+}
+
+void *
+coap_arena_alloc(coap_arena_t *arena, size_t size) {
+  coap_arena_block_t *block;
+  void *ptr;
+
+  size = COAP_ARENA_ROUNDUP(size);
+  if (size > (size_t)(arena->end - arena->next)) {
+    /* Start a new block, leaving the rest of the current one unused */
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+    block = coap_malloc_type(COAP_STRING, COAP_ARENA_BLOCK_HDR + block_size);
+    if (!block)
+      return NULL;
+    block->size = block_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->next = (uint8_t *)block + COAP_ARENA_BLOCK_HDR;
+    arena->end = arena->next + block_size;
+  }
+  ptr = arena->next;
+  arena->next += size;
+  return ptr;
+}
+
+void
+coap_arena_release(coap_arena_t *arena) {
+  while (arena->blocks) {
+    coap_arena_block_t *block = arena->blocks;
+
+    arena->blocks = block->next;
+    coap_free_type(COAP_STRING, block);
+  }
+  arena->next = arena->end = NULL;
+}
+
+coap_string_t *
+coap_arena_new_string(coap_arena_t *arena, size_t size) {
+  coap_string_t *s;
+
+  if (!arena)
+    return coap_new_string(size);
+  s = coap_arena_alloc(arena, sizeof(coap_string_t) + size + 1);
+  if (!s)
+    return NULL;
+  s->s = (uint8_t *)s + sizeof(coap_string_t);
+  s->s[size] = '\000';
+  s->length = size;
+  return s;
+}
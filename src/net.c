@@ -42,7 +42,13 @@
 #ifdef COAP_EPOLL_SUPPORT
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif /* HAVE_SYS_EVENTFD_H */
 #endif /* COAP_EPOLL_SUPPORT */
+#ifdef COAP_KQUEUE_SUPPORT
+#include <sys/event.h>
+#endif /* COAP_KQUEUE_SUPPORT */
 #ifdef HAVE_WS2TCPIP_H
 #include <ws2tcpip.h>
 #endif
@@ -151,35 +157,134 @@ coap_free_node(coap_queue_t *node) {
 }
 #endif /* WITH_CONTIKI */
 
+/*
+ * The retransmission queue (context->sendqueue) is a pairing heap ordered
+ * by t.  Every entry has a pointer to its first child and to its next
+ * sibling.  heap_prev points to the previous sibling, or to the parent for
+ * the first child, so that any entry can be unlinked from the heap without
+ * searching for it.
+ */
+
+/* Melds the two heaps @p a and @p b and returns the new root. */
+static coap_queue_t *
+coap_queue_meld(coap_queue_t *a, coap_queue_t *b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (b->t < a->t) {
+    coap_queue_t *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  /* make b the first child of a */
+  b->heap_prev = a;
+  b->heap_sibling = a->heap_child;
+  if (a->heap_child)
+    a->heap_child->heap_prev = b;
+  a->heap_child = b;
+  return a;
+}
+
+/*
+ * Melds the list of siblings starting at @p first into a single heap using
+ * the standard two pass method and returns the new root.
+ */
+static coap_queue_t *
+coap_queue_merge_pairs(coap_queue_t *first) {
+  coap_queue_t *pairs = NULL;
+  coap_queue_t *root = NULL;
+
+  /* first pass: meld pairs left to right, collect them in reverse order */
+  while (first) {
+    coap_queue_t *a = first;
+    coap_queue_t *b = first->heap_sibling;
+
+    first = b ? b->heap_sibling : NULL;
+    a->heap_prev = a->heap_sibling = NULL;
+    if (b)
+      b->heap_prev = b->heap_sibling = NULL;
+    a = coap_queue_meld(a, b);
+    a->heap_sibling = pairs;
+    pairs = a;
+  }
+
+  /* second pass: meld the pairs right to left */
+  while (pairs) {
+    coap_queue_t *next = pairs->heap_sibling;
+
+    pairs->heap_sibling = NULL;
+    root = coap_queue_meld(root, pairs);
+    pairs = next;
+  }
+  return root;
+}
+
+COAP_STATIC_INLINE int
+coap_queue_in_heap(coap_queue_t *queue, coap_queue_t *node) {
+  return node == queue || node->heap_prev != NULL;
+}
+
+/*
+ * Removes @p node from the heap @p queue, from its session's list
+ * of queued entries and from the (session, id) index.
+ */
+static void
+coap_queue_unlink(coap_queue_t **queue, coap_queue_t *node) {
+  if (node == *queue) {
+    *queue = coap_queue_merge_pairs(node->heap_child);
+  } else {
+    if (node->heap_prev->heap_child == node)
+      node->heap_prev->heap_child = node->heap_sibling;
+    else
+      node->heap_prev->heap_sibling = node->heap_sibling;
+    if (node->heap_sibling)
+      node->heap_sibling->heap_prev = node->heap_prev;
+    *queue = coap_queue_meld(*queue, coap_queue_merge_pairs(node->heap_child));
+  }
+  node->heap_child = node->heap_sibling = node->heap_prev = NULL;
+
+  if (node->session && node->session_prev) {
+    DL_DELETE2(node->session->sendqueue, node, session_prev, session_next);
+    node->session_prev = node->session_next = NULL;
+    HASH_DELETE(hh, node->session->context->sendqueue_index, node);
+  }
+}
+
 unsigned int
 coap_adjust_basetime(coap_context_t *ctx, coap_tick_t now) {
   unsigned int result = 0;
   coap_tick_diff_t delta = now - ctx->sendqueue_basetime;
+  coap_queue_t *q = ctx->sendqueue;
 
-  if (ctx->sendqueue) {
-    /* delta < 0 means that the new time stamp is before the old. */
+  /*
+   * All the elements are relative to the basetime, so they all need to be
+   * adjusted. This keeps the heap order intact. Elements that have timed
+   * out get their relative time set to zero and the result counter is
+   * increased.
+   */
+  while (q) {
     if (delta <= 0) {
-      ctx->sendqueue->t -= delta;
+      q->t -= delta;
+    } else if (q->t < (coap_tick_t)delta) {
+      q->t = 0;
+      result++;
     } else {
-      /* This case is more complex: The time must be advanced forward,
-       * thus possibly leading to timed out elements at the queue's
-       * start. For every element that has timed out, its relative
-       * time is set to zero and the result counter is increased. */
-
-      coap_queue_t *q = ctx->sendqueue;
-      coap_tick_t t = 0;
-      while (q && (t + q->t < (coap_tick_t)delta)) {
-        t += q->t;
-        q->t = 0;
-        result++;
-        q = q->next;
-      }
+      q->t -= delta;
+    }
 
-      /* finally adjust the first element that has not expired */
-      if (q) {
-        q->t = (coap_tick_t)delta - t;
-      }
+    /* walk the heap depth first without recursion */
+    if (q->heap_child) {
+      q = q->heap_child;
+      continue;
     }
+    while (q != ctx->sendqueue && !q->heap_sibling) {
+      /* go back to the first sibling, its heap_prev is the parent */
+      while (q->heap_prev->heap_child != q)
+        q = q->heap_prev;
+      q = q->heap_prev;
+    }
+    q = q == ctx->sendqueue ? NULL : q->heap_sibling;
   }
 
   /* adjust basetime */
@@ -190,38 +295,17 @@ coap_adjust_basetime(coap_context_t *ctx, coap_tick_t now) {
 
 int
 coap_insert_node(coap_queue_t **queue, coap_queue_t *node) {
-  coap_queue_t *p, *q;
   if (!queue || !node)
     return 0;
 
-  /* set queue head if empty */
-  if (!*queue) {
-    *queue = node;
-    return 1;
-  }
+  node->heap_child = node->heap_sibling = node->heap_prev = NULL;
+  *queue = coap_queue_meld(*queue, node);
 
-  /* replace queue head if PDU's time is less than head's time */
-  q = *queue;
-  if (node->t < q->t) {
-    node->next = q;
-    *queue = node;
-    q->t -= node->t;                /* make q->t relative to node->t */
-    return 1;
+  if (node->session) {
+    DL_APPEND2(node->session->sendqueue, node, session_prev, session_next);
+    HASH_ADD(hh, node->session->context->sendqueue_index, session,
+             COAP_QUEUE_KEY_LEN, node);
   }
-
-  /* search for right place to insert */
-  do {
-    node->t -= q->t;                /* make node-> relative to q->t */
-    p = q;
-    q = q->next;
-  } while (q && q->t <= node->t);
-
-  /* insert new item */
-  if (q) {
-    q->t -= node->t;                /* make q->t relative to node->t */
-  }
-  node->next = q;
-  p->next = node;
   return 1;
 }
 
@@ -235,8 +319,9 @@ coap_delete_node(coap_queue_t *node) {
     /*
      * Need to remove out of context->sendqueue as added in by coap_wait_ack()
      */
-    if (node->session->context->sendqueue) {
-      LL_DELETE(node->session->context->sendqueue, node);
+    if (node->session->context->sendqueue &&
+        coap_queue_in_heap(node->session->context->sendqueue, node)) {
+      coap_queue_unlink(&node->session->context->sendqueue, node);
     }
     coap_session_release(node->session);
   }
@@ -284,10 +369,7 @@ coap_pop_next(coap_context_t *context) {
     return NULL;
 
   next = context->sendqueue;
-  context->sendqueue = context->sendqueue->next;
-  if (context->sendqueue) {
-    context->sendqueue->t += next->t;
-  }
+  coap_queue_unlink(&context->sendqueue, next);
   next->next = NULL;
   return next;
 }
@@ -303,16 +385,16 @@ coap_get_session_client_psk(
   (void)hint;
   (void)hint_len;
 
-  if (session->psk_identity && session->psk_key) {
-    if (session->psk_identity->length <= max_identity_len &&
-        session->psk_key->length <= max_psk_len) {
-      memcpy(identity, session->psk_identity->s, session->psk_identity->length);
-      memcpy(psk, session->psk_key->s, session->psk_key->length);
-      *identity_len = session->psk_identity->length;
-      return session->psk_key->length;
+  if (session->ext->psk_identity && session->ext->psk_key) {
+    if (session->ext->psk_identity->length <= max_identity_len &&
+        session->ext->psk_key->length <= max_psk_len) {
+      memcpy(identity, session->ext->psk_identity->s, session->ext->psk_identity->length);
+      memcpy(psk, session->ext->psk_key->s, session->ext->psk_key->length);
+      *identity_len = session->ext->psk_identity->length;
+      return session->ext->psk_key->length;
     }
   }
-  psk_info = &session->cpsk_setup_data.psk_info;
+  psk_info = &session->ext->cpsk_setup_data.psk_info;
   if (psk_info->identity.s && psk_info->identity.length > 0 &&
       psk_info->key.s && psk_info->key.length > 0) {
     if (psk_info->identity.length <= max_identity_len &&
@@ -341,10 +423,10 @@ coap_get_context_server_psk(
   if (!session)
     return 0;
 
-  if (session->psk_key &&
-      session->psk_key->length <= max_psk_len) {
-    memcpy(psk, session->psk_key->s, session->psk_key->length);
-    return session->psk_key->length;
+  if (session->ext->psk_key &&
+      session->ext->psk_key->length <= max_psk_len) {
+    memcpy(psk, session->ext->psk_key->s, session->ext->psk_key->length);
+    return session->ext->psk_key->length;
   }
   psk_info = &session->context->spsk_setup_data.psk_info;
   if (psk_info->key.s && psk_info->key.length > 0 &&
@@ -366,11 +448,11 @@ coap_get_context_server_hint(
   if (!session)
     return 0;
 
-  if (session->psk_hint &&
-      session->psk_hint->s && session->psk_hint->length > 0 &&
-      session->psk_hint->length <= max_hint_len) {
-    memcpy(hint, session->psk_hint->s, session->psk_hint->length);
-    return session->psk_hint->length;
+  if (session->ext->psk_hint &&
+      session->ext->psk_hint->s && session->ext->psk_hint->length > 0 &&
+      session->ext->psk_hint->length <= max_hint_len) {
+    memcpy(hint, session->ext->psk_hint->s, session->ext->psk_hint->length);
+    return session->ext->psk_hint->length;
   }
   psk_info = &session->context->spsk_setup_data.psk_info;
   if (psk_info->hint.s &&
@@ -427,6 +509,7 @@ int coap_context_set_pki(coap_context_t *ctx,
     return 0;
   }
   if (coap_dtls_is_supported()) {
+    coap_pki_cache_flush(ctx);
     return coap_dtls_context_set_pki(ctx, setup_data, COAP_DTLS_ROLE_SERVER);
   }
   return 0;
@@ -437,22 +520,79 @@ int coap_context_set_pki_root_cas(coap_context_t *ctx,
   const char *ca_dir
 ) {
   if (coap_dtls_is_supported()) {
+    coap_pki_cache_flush(ctx);
     return coap_dtls_context_set_pki_root_cas(ctx, ca_file, ca_dir);
   }
   return 0;
 }
 
+int coap_context_set_session_ticket_key(coap_context_t *ctx,
+  const uint8_t *key,
+  size_t key_len
+) {
+  if (key && key_len != COAP_DTLS_TICKET_KEY_LEN) {
+    coap_log(LOG_ERR, "coap_context_set_session_ticket_key: "
+                      "key must be %d bytes\n", COAP_DTLS_TICKET_KEY_LEN);
+    return 0;
+  }
+  if (coap_dtls_is_supported() || coap_tls_is_supported()) {
+    return coap_dtls_context_set_ticket_key(ctx, key, key_len);
+  }
+  return 0;
+}
+
+int coap_context_share_dtls(coap_context_t *ctx, coap_context_t *from) {
+  if (!from || from == ctx)
+    return 0;
+  if (coap_dtls_is_supported() || coap_tls_is_supported()) {
+    ctx->spsk_setup_data = from->spsk_setup_data;
+    coap_pki_cache_flush(ctx);
+    return coap_dtls_context_share(ctx, from);
+  }
+  return 0;
+}
+
 void coap_context_set_keepalive(coap_context_t *context, unsigned int seconds) {
   context->ping_timeout = seconds;
 }
 
+void coap_context_set_cocoa(coap_context_t *context, int enable) {
+  context->cocoa = enable ? 1 : 0;
+}
+
+void
+coap_context_set_mcast_leisure(coap_context_t *context,
+                               unsigned int milliseconds) {
+  context->mcast_leisure_ms = milliseconds;
+}
+
 int coap_context_get_coap_fd(coap_context_t *context) {
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
   return context->epfd;
-#else /* ! COAP_EPOLL_SUPPORT */
+#else /* ! COAP_EVENT_QUEUE_SUPPORT */
   (void)context;
   return -1;
-#endif /* ! COAP_EPOLL_SUPPORT */
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
+}
+
+void
+coap_context_get_counters(const coap_context_t *context,
+                          coap_counters_t *counters) {
+  *counters = context->counters;
+}
+
+void
+coap_context_set_tcp_cork(coap_context_t *context, size_t limit) {
+  context->tcp_cork = limit;
+  if (!limit)
+    coap_io_flush_corked(context);
+}
+
+void
+coap_context_set_tx_budget(coap_context_t *context, unsigned int retransmits,
+                           unsigned int bulk) {
+  context->tx_budget_retransmit = retransmits;
+  context->tx_budget_bulk = bulk;
 }
 
 coap_context_t *
@@ -485,8 +625,13 @@ coap_new_context(
 #endif /* WITH_CONTIKI */
 
   memset(c, 0, sizeof(coap_context_t));
+  c->tx_class = COAP_TX_NORMAL;
+  coap_option_props_init(c);
+  c->mcast_leisure_ms = COAP_DEFAULT_LEISURE_MS;
+  c->max_body_size = COAP_DEFAULT_MAX_BODY_SIZE;
 
 #ifdef COAP_EPOLL_SUPPORT
+  c->eppostfd = -1;
   c->epfd = epoll_create1(0);
   if (c->epfd == -1) {
     coap_log(LOG_ERR, "coap_new_context: Unable to epoll_create: %s (%d)\n",
@@ -521,9 +666,63 @@ coap_new_context(
         goto onerror;
       }
     }
+#ifdef HAVE_SYS_EVENTFD_H
+    c->eppostfd = eventfd(0, EFD_NONBLOCK);
+    if (c->eppostfd == -1) {
+      coap_log(LOG_ERR, "coap_new_context: Unable to eventfd: %s (%d)\n",
+               coap_socket_strerror(),
+               errno);
+      goto onerror;
+    }
+    else {
+      int ret;
+      struct epoll_event event;
+
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      /* Special cased in coap_io_do_epoll() */
+      event.data.ptr = &c->eppostfd;
+
+      ret = epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->eppostfd, &event);
+      if (ret == -1) {
+         coap_log(LOG_ERR,
+                  "%s: epoll_ctl ADD failed: %s (%d)\n",
+                  "coap_new_context",
+                  coap_socket_strerror(), errno);
+        goto onerror;
+      }
+    }
+#endif /* HAVE_SYS_EVENTFD_H */
   }
 #endif /* COAP_EPOLL_SUPPORT */
 
+#ifdef COAP_KQUEUE_SUPPORT
+  c->epfd = kqueue();
+  if (c->epfd == -1) {
+    coap_log(LOG_ERR, "coap_new_context: Unable to kqueue: %s (%d)\n",
+             coap_socket_strerror(),
+             errno);
+    goto onerror;
+  }
+  else {
+    struct kevent event;
+
+    /*
+     * Triggered by coap_context_wake_io(), and special cased in
+     * coap_io_do_kqueue().  The timer is only added when it is armed.
+     */
+    EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+    if (kevent(c->epfd, &event, 1, NULL, 0, NULL) == -1) {
+      coap_log(LOG_ERR,
+               "%s: kevent EVFILT_USER failed: %s (%d)\n",
+               "coap_new_context",
+               coap_socket_strerror(), errno);
+      close(c->epfd);
+      goto onerror;
+    }
+  }
+#endif /* COAP_KQUEUE_SUPPORT */
+
   if (coap_dtls_is_supported()) {
     c->dtls_context = coap_dtls_new_context(c);
     if (!c->dtls_context) {
@@ -533,6 +732,10 @@ coap_new_context(
     }
   }
 
+  /* Tracing is best effort, so go on without it if out of memory */
+  coap_context_set_trace(c, COAP_TRACE_DEFAULT_SIZE,
+                         COAP_TRACE_DEFAULT_MAX_PAYLOAD);
+
   /* set default CSM timeout */
   c->csm_timeout = 30;
 
@@ -581,6 +784,223 @@ coap_get_app_data(const coap_context_t *ctx) {
   return ctx->app;
 }
 
+/*
+ * Events posted by other threads are pushed onto context->posted, which is
+ * a lock-free stack. The I/O thread takes the whole stack in one atomic
+ * exchange, so there is no ABA problem, and then processes it in the
+ * order the events were posted.
+ */
+#if defined(__GNUC__) && !defined(WITH_CONTIKI) && !defined(WITH_LWIP)
+#define COAP_POST_SUPPORT 1
+#endif /* __GNUC__ && !WITH_CONTIKI && !WITH_LWIP */
+
+typedef struct coap_post_t {
+  struct coap_post_t *next;
+  coap_resource_t *resource;     /**< resource to notify, or NULL */
+  coap_string_t *query;          /**< query for the notification */
+  coap_session_t *session;       /**< session to send pdu over */
+  coap_pdu_t *pdu;               /**< pdu to send */
+  coap_defer_job_t *job;         /**< deferred request that is done */
+} coap_post_t;
+
+void
+coap_context_wake_io(coap_context_t *context) {
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (context->io_external) {
+    if (context->io_callbacks.wake)
+      context->io_callbacks.wake(context, context->io_callbacks_arg);
+    return;
+  }
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+#if defined(COAP_EPOLL_SUPPORT) && defined(HAVE_SYS_EVENTFD_H)
+  if (context->eppostfd != -1) {
+    uint64_t count = 1;
+
+    if (write(context->eppostfd, &count, sizeof(count)) == -1) {
+      /* counter overflow is not possible, so ignore */;
+    }
+  }
+#elif defined(COAP_KQUEUE_SUPPORT)
+  struct kevent event;
+
+  EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+  if (kevent(context->epfd, &event, 1, NULL, 0, NULL) == -1) {
+    /* the context is being freed, so ignore */;
+  }
+#else /* ! COAP_EPOLL_SUPPORT || ! HAVE_SYS_EVENTFD_H */
+  (void)context;
+#endif /* ! COAP_EPOLL_SUPPORT || ! HAVE_SYS_EVENTFD_H */
+}
+
+#ifdef COAP_POST_SUPPORT
+static int
+coap_post_push(coap_context_t *context, coap_post_t *post) {
+  coap_post_t *head = __atomic_load_n(&context->posted, __ATOMIC_RELAXED);
+
+  do {
+    post->next = head;
+  } while (!__atomic_compare_exchange_n(&context->posted, &head, post, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  coap_context_wake_io(context);
+  return 1;
+}
+
+/* Takes all the posted events, oldest first. */
+static coap_post_t *
+coap_post_take_all(coap_context_t *context) {
+  coap_post_t *list;
+  coap_post_t *fifo = NULL;
+
+  if (!__atomic_load_n(&context->posted, __ATOMIC_RELAXED))
+    return NULL;
+  list = __atomic_exchange_n(&context->posted, NULL, __ATOMIC_ACQUIRE);
+  while (list) {
+    coap_post_t *next = list->next;
+
+    list->next = fifo;
+    fifo = list;
+    list = next;
+  }
+  return fifo;
+}
+#endif /* COAP_POST_SUPPORT */
+
+int
+coap_context_post_notify(coap_context_t *context, coap_resource_t *resource,
+                         const coap_string_t *query) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_t *post;
+
+  if (!context || !resource)
+    return 0;
+  post = coap_malloc_type(COAP_STRING, sizeof(coap_post_t));
+  if (!post)
+    return 0;
+  memset(post, 0, sizeof(coap_post_t));
+  post->resource = resource;
+  if (query) {
+    post->query = coap_new_string(query->length);
+    if (!post->query) {
+      coap_free_type(COAP_STRING, post);
+      return 0;
+    }
+    memcpy(post->query->s, query->s, query->length);
+  }
+  return coap_post_push(context, post);
+#else /* ! COAP_POST_SUPPORT */
+  (void)context;
+  (void)resource;
+  (void)query;
+  coap_log(LOG_WARNING, "coap_context_post_notify: not supported\n");
+  return 0;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
+int
+coap_context_post_send(coap_context_t *context, coap_session_t *session,
+                       coap_pdu_t *pdu) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_t *post;
+
+  if (!context || !session || !pdu)
+    goto error;
+  post = coap_malloc_type(COAP_STRING, sizeof(coap_post_t));
+  if (!post)
+    goto error;
+  memset(post, 0, sizeof(coap_post_t));
+  post->session = session;
+  post->pdu = pdu;
+  return coap_post_push(context, post);
+
+error:
+  /* pdu ownership is passed on even on failure, as for coap_send() */
+  coap_delete_pdu(pdu);
+  return 0;
+#else /* ! COAP_POST_SUPPORT */
+  (void)context;
+  (void)session;
+  coap_log(LOG_WARNING, "coap_context_post_send: not supported\n");
+  coap_delete_pdu(pdu);
+  return 0;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
+struct coap_post_t *
+coap_post_defer_new(coap_defer_job_t *job) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_t *post;
+
+  post = coap_malloc_type(COAP_STRING, sizeof(coap_post_t));
+  if (!post)
+    return NULL;
+  memset(post, 0, sizeof(coap_post_t));
+  post->job = job;
+  return post;
+#else /* ! COAP_POST_SUPPORT */
+  (void)job;
+  return NULL;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
+void
+coap_post_defer(coap_context_t *context, coap_post_t *post) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_push(context, post);
+#else /* ! COAP_POST_SUPPORT */
+  (void)context;
+  (void)post;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
+void
+coap_process_posted(coap_context_t *context) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_t *post = coap_post_take_all(context);
+
+  while (post) {
+    coap_post_t *next = post->next;
+
+    if (post->resource) {
+      coap_resource_notify_observers(post->resource, post->query);
+      coap_delete_string(post->query);
+    } else if (post->job) {
+      coap_defer_done(post->job);
+    } else {
+      coap_send(post->session, post->pdu);
+      coap_session_release(post->session);
+    }
+    coap_free_type(COAP_STRING, post);
+    post = next;
+  }
+#else /* ! COAP_POST_SUPPORT */
+  (void)context;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
+/* Drops any posted events that have not been processed yet. */
+static void
+coap_discard_posted(coap_context_t *context) {
+#ifdef COAP_POST_SUPPORT
+  coap_post_t *post = coap_post_take_all(context);
+
+  while (post) {
+    coap_post_t *next = post->next;
+
+    coap_delete_string(post->query);
+    coap_delete_pdu(post->pdu);
+    if (post->job)
+      coap_defer_job_free(post->job);
+    if (post->session)
+      coap_session_release(post->session);
+    coap_free_type(COAP_STRING, post);
+    post = next;
+  }
+#else /* ! COAP_POST_SUPPORT */
+  (void)context;
+#endif /* ! COAP_POST_SUPPORT */
+}
+
 void
 coap_free_context(coap_context_t *context) {
   coap_endpoint_t *ep, *tmp;
@@ -590,10 +1010,20 @@ coap_free_context(coap_context_t *context) {
   if (!context)
     return;
 
+  /* The requests still with the workers are passed back as posted */
+  coap_defer_free(context);
+  coap_discard_posted(context);
+  coap_dtls_offload_free(context);
+  coap_proxy_free(context);
+  coap_trace_free(context);
+  coap_histogram_free(context->notify_histogram);
+
   /* Removing a resource may cause a CON observe to be sent */
   coap_delete_all_resources(context);
+  coap_catalog_free(context);
 
-  coap_delete_all(context->sendqueue);
+  while (context->sendqueue)
+    coap_delete_node(coap_pop_next(context));
 
 #ifdef WITH_LWIP
   context->sendqueue = NULL;
@@ -604,20 +1034,37 @@ coap_free_context(coap_context_t *context) {
   coap_delete_all_async(context);
 #endif /* WITHOUT_ASYNC */
   HASH_ITER(hh, context->cache, cp, ctmp) {
-    coap_delete_cache_entry(context, cp);
+    coap_cache_free_entry(context, cp);
   }
   if (context->cache_ignore_count) {
     coap_free(context->cache_ignore_options);
   }
 
+  /* Write out what the TCP and TLS sessions still hold back */
+  coap_context_set_tcp_cork(context, 0);
   LL_FOREACH_SAFE(context->endpoint, ep, tmp) {
     coap_free_endpoint(ep);
   }
+  coap_context_set_tx_batching(context, 0);
 
+  coap_session_pool_free(context);
   SESSIONS_ITER_SAFE(context->sessions, sp, rtmp) {
     coap_session_release(sp);
   }
-
+  /* Only now that the sessions have saved their large transfers */
+  coap_free_type(COAP_STRING, context->block_resume_dir);
+  coap_free_type(COAP_STRING, context->rxbuf);
+#ifdef COAP_AF_UNIX_SUPPORT
+  coap_free_type(COAP_STRING, context->unix_rxbuf);
+#endif /* COAP_AF_UNIX_SUPPORT */
+
+  coap_context_set_observe_registry(context, NULL);
+  coap_tls_resume_free_all(context);
+  coap_dtls_cookie_free(context);
+  coap_context_set_ratelimit(context, NULL);
+  coap_psk_store_release_all(context);
+  coap_pki_cache_free(context);
+  coap_oscore_free(context);
   if (context->dtls_context)
     coap_dtls_free_context(context->dtls_context);
 #ifdef COAP_EPOLL_SUPPORT
@@ -636,11 +1083,37 @@ coap_free_context(coap_context_t *context) {
     close(context->eptimerfd);
     context->eptimerfd = -1;
   }
+  if (context->eppostfd != -1) {
+    int ret;
+    struct epoll_event event;
+
+    ret = epoll_ctl(context->epfd, EPOLL_CTL_DEL, context->eppostfd, &event);
+    if (ret == -1) {
+       coap_log(LOG_ERR,
+                "%s: epoll_ctl DEL failed: %s (%d)\n",
+                "coap_free_context",
+                coap_socket_strerror(), errno);
+    }
+    close(context->eppostfd);
+    context->eppostfd = -1;
+  }
+#ifdef COAP_IO_URING_SUPPORT
+  coap_io_uring_free(context);
+#endif /* COAP_IO_URING_SUPPORT */
   if (context->epfd != -1) {
     close(context->epfd);
     context->epfd = -1;
   }
+  coap_free_type(COAP_STRING, context->epoll_events);
 #endif /* COAP_EPOLL_SUPPORT */
+#ifdef COAP_KQUEUE_SUPPORT
+  /* Closing the kqueue removes the timer and the socket filters too */
+  if (context->epfd != -1) {
+    close(context->epfd);
+    context->epfd = -1;
+  }
+  coap_free_type(COAP_STRING, context->epoll_events);
+#endif /* COAP_KQUEUE_SUPPORT */
 
 #ifndef WITH_CONTIKI
   coap_free_type(COAP_CONTEXT, context);
@@ -661,41 +1134,14 @@ coap_option_check_critical(coap_context_t *ctx,
   coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL);
 
   while (coap_option_next(&opt_iter)) {
-
-    /* The following condition makes use of the fact that
-     * coap_option_getb() returns -1 if type exceeds the bit-vector
-     * filter. As the vector is supposed to be large enough to hold
-     * the largest known option, we know that everything beyond is
-     * bad.
-     */
-    if (opt_iter.type & 0x01) {
-      /* first check the built-in critical options */
-      switch (opt_iter.type) {
-      case COAP_OPTION_IF_MATCH:
-      case COAP_OPTION_URI_HOST:
-      case COAP_OPTION_IF_NONE_MATCH:
-      case COAP_OPTION_URI_PORT:
-      case COAP_OPTION_URI_PATH:
-      case COAP_OPTION_URI_QUERY:
-      case COAP_OPTION_ACCEPT:
-      case COAP_OPTION_PROXY_URI:
-      case COAP_OPTION_PROXY_SCHEME:
-      case COAP_OPTION_BLOCK2:
-      case COAP_OPTION_BLOCK1:
-        break;
-      default:
-        if (coap_option_filter_get(&ctx->known_options, opt_iter.type) <= 0) {
-          coap_log(LOG_DEBUG, "unknown critical option %d\n", opt_iter.type);
-          ok = 0;
-
-          /* When opt_iter.type is beyond our known option range,
-           * coap_option_filter_set() will return -1 and we are safe to leave
-           * this loop. */
-          if (coap_option_filter_set(&unknown, opt_iter.type) == -1) {
-            break;
-          }
-        }
-      }
+    /* The built-in critical options, the registered ones and Q-Block1/2
+     * if Q-Block has been enabled are known */
+    if ((coap_option_props(ctx, opt_iter.type) &
+         (COAP_OPT_PROP_CRITICAL | COAP_OPT_PROP_KNOWN)) ==
+        COAP_OPT_PROP_CRITICAL) {
+      coap_log(LOG_DEBUG, "unknown critical option %d\n", opt_iter.type);
+      ok = 0;
+      coap_option_filter_set(&unknown, opt_iter.type);
     }
   }
 
@@ -716,38 +1162,177 @@ coap_send_ack(coap_session_t *session, coap_pdu_t *request) {
   return result;
 }
 
-ssize_t
-coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
+/*
+ * Counts @p pdu as sent on @p session.
+ */
+static void
+coap_count_tx(coap_session_t *session, const coap_pdu_t *pdu) {
+  COAP_COUNT(session, tx_pdus, 1);
+  COAP_COUNT(session, tx_bytes, COAP_PDU_WIRE_SIZE(pdu));
+  if (pdu->type == COAP_MESSAGE_RST)
+    COAP_COUNT(session, tx_rsts, 1);
+}
+
+/*
+ * Sends @p pdu on @p session, skipping the first @p offset bytes that have
+ * already been written to a stream.
+ */
+static ssize_t
+coap_session_send_pdu_from(coap_session_t *session, coap_pdu_t *pdu,
+                           size_t offset) {
+  const uint8_t *data = pdu->token - pdu->hdr_size + offset;
+  size_t length = COAP_PDU_WIRE_SIZE(pdu) - offset;
+  uint8_t *flat = NULL;
   ssize_t bytes_written = -1;
-  assert(pdu->hdr_size > 0);
+
+  if (pdu->xmit_data) {
+    size_t buffered = pdu->hdr_size + pdu->used_size;
+#if COAP_SOCKET_SENDV
+    if (session->proto == COAP_PROTO_UDP || session->proto == COAP_PROTO_TCP ||
+        (session->proto == COAP_PROTO_TLS && coap_tls_is_ktls_send(session))) {
+      /* Send the payload directly from where the application has it */
+      struct iovec iov[2];
+      const uint8_t *payload = pdu->xmit_data;
+      size_t payload_length = pdu->xmit_length;
+      int iovcnt = 0;
+
+      if (offset < buffered) {
+        memcpy(&iov[0].iov_base, &data, sizeof(iov[0].iov_base));
+        iov[0].iov_len = buffered - offset;
+        iovcnt++;
+      } else {
+        payload += offset - buffered;
+        payload_length -= offset - buffered;
+      }
+      memcpy(&iov[iovcnt].iov_base, &payload, sizeof(iov[iovcnt].iov_base));
+      iov[iovcnt].iov_len = payload_length;
+      iovcnt++;
+      if (session->proto == COAP_PROTO_UDP)
+        return coap_session_sendv(session, iov, iovcnt);
+#if !COAP_DISABLE_TCP
+      return coap_session_writev(session, iov, iovcnt);
+#else /* COAP_DISABLE_TCP */
+      return -1;
+#endif /* COAP_DISABLE_TCP */
+    }
+#endif /* COAP_SOCKET_SENDV */
+    /* The (D)TLS backends need the whole PDU in a single buffer */
+    flat = coap_malloc_type(COAP_STRING, length);
+    if (!flat)
+      return -1;
+    if (offset < buffered) {
+      memcpy(flat, data, buffered - offset);
+      memcpy(flat + buffered - offset, pdu->xmit_data, pdu->xmit_length);
+    } else {
+      memcpy(flat, pdu->xmit_data + offset - buffered, length);
+    }
+    data = flat;
+  }
+
   switch(session->proto) {
     case COAP_PROTO_UDP:
-      bytes_written = coap_session_send(session, pdu->token - pdu->hdr_size,
-                                        pdu->used_size + pdu->hdr_size);
+      bytes_written = coap_session_send(session, data, length);
       break;
     case COAP_PROTO_DTLS:
-      bytes_written = coap_dtls_send(session, pdu->token - pdu->hdr_size,
-                                     pdu->used_size + pdu->hdr_size);
+      if (coap_dtls_offload_send(session, data, length))
+        bytes_written = (ssize_t)length;
+      else
+        bytes_written = coap_dtls_send(session, data, length);
       break;
     case COAP_PROTO_TCP:
 #if !COAP_DISABLE_TCP
-      bytes_written = coap_session_write(session, pdu->token - pdu->hdr_size,
-                                         pdu->used_size + pdu->hdr_size);
+      bytes_written = coap_session_write(session, data, length);
 #endif /* !COAP_DISABLE_TCP */
       break;
     case COAP_PROTO_TLS:
 #if !COAP_DISABLE_TCP
-      bytes_written = coap_tls_write(session, pdu->token - pdu->hdr_size,
-                                     pdu->used_size + pdu->hdr_size);
+      bytes_written = coap_tls_write(session, data, length);
 #endif /* !COAP_DISABLE_TCP */
       break;
     default:
       break;
   }
+  coap_free_type(COAP_STRING, flat);
+  return bytes_written;
+}
+
+/*
+ * Returns the coap_tx_class_t that @p pdu is queued for coap_io_flush()
+ * with, given the @p tx_class of what is being sent.
+ */
+static uint8_t
+coap_tx_class(coap_pdu_t *pdu, uint8_t tx_class) {
+  coap_block_t block;
+
+  if (pdu->code == 0 || pdu->type == COAP_MESSAGE_RST ||
+      COAP_PDU_IS_SIGNALING(pdu))
+    return COAP_TX_CONTROL;
+  if (tx_class == COAP_TX_NORMAL && COAP_PDU_IS_RESPONSE(pdu) &&
+      (coap_get_block(pdu, COAP_OPTION_BLOCK2, &block) ||
+       coap_get_block(pdu, COAP_OPTION_Q_BLOCK2, &block)) &&
+      block.num > 0)
+    return COAP_TX_BULK;
+  return tx_class;
+}
+
+ssize_t
+coap_session_send_pdu(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_context_t *context = session->context;
+  uint8_t tx_class = context->tx_class;
+  ssize_t bytes_written;
+  assert(pdu->hdr_size > 0);
+  context->tx_class = coap_tx_class(pdu, tx_class);
+  bytes_written = coap_session_send_pdu_from(session, pdu, 0);
+  if (bytes_written > 0) {
+    coap_trace_pdu(session, pdu, 1);
+    coap_count_tx(session, pdu);
+    if (context->tx_class == COAP_TX_BULK)
+      context->tx_bulk_sent++;
+  }
+  context->tx_class = tx_class;
   coap_show_pdu(LOG_DEBUG, pdu);
   return bytes_written;
 }
 
+static void coap_write_session(coap_context_t *ctx, coap_session_t *session,
+                               coap_tick_t now);
+
+#if !COAP_DISABLE_TCP
+/*
+ * Holds @p pdu back on the TCP or TLS @p session until coap_io_flush(),
+ * writing out what is held back already first if @p pdu would take it
+ * over the cork limit.
+ *
+ * Returns COAP_PDU_DELAYED if @p pdu is held back, else 0 if it is to be
+ * written straight away as it is over the cork limit by itself.
+ */
+static ssize_t
+coap_session_cork_pdu(coap_session_t *session, coap_pdu_t *pdu,
+                      coap_queue_t *node) {
+  coap_context_t *context = session->context;
+  size_t size = COAP_PDU_WIRE_SIZE(pdu);
+
+  if (session->corked_bytes + size > context->tcp_cork) {
+    if (session->delayqueue) {
+      coap_tick_t now;
+
+      coap_io_ticks(context, &now);
+      coap_write_session(context, session, now);
+    }
+    if (!session->delayqueue && size >= context->tcp_cork)
+      return 0;
+  }
+  if (coap_session_delay_pdu(session, pdu, node) != COAP_PDU_DELAYED)
+    return 0;
+  if (!session->corked_bytes) {
+    session->cork_next = context->corked;
+    context->corked = session;
+  }
+  session->corked_bytes += size;
+  return COAP_PDU_DELAYED;
+}
+#endif /* !COAP_DISABLE_TCP */
+
 static ssize_t
 coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
   ssize_t bytes_written;
@@ -765,18 +1350,20 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
       COAP_PROTO_NOT_RELIABLE(session->proto))
     session->con_active++;
 
-  if (LOG_DEBUG <= coap_get_log_level()) {
+  if (coap_log_enabled(LOG_DEBUG)) {
     coap_show_pdu(LOG_DEBUG, pdu);
   }
-  coap_ticks(&session->last_rx_tx);
+  coap_io_ticks(session->context, &session->last_rx_tx);
 
 #else
 
   if (session->state == COAP_SESSION_STATE_NONE) {
     if (session->proto == COAP_PROTO_DTLS && !session->tls) {
+      COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
       session->tls = coap_dtls_new_client_session(session);
       if (session->tls) {
         session->state = COAP_SESSION_STATE_HANDSHAKE;
+        coap_session_timer_arm(session, 0);
         return coap_session_delay_pdu(session, pdu, node);
       }
       coap_handle_event(session->context, COAP_EVENT_DTLS_ERROR, session);
@@ -792,10 +1379,11 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
         coap_handle_event(session->context, COAP_EVENT_TCP_FAILED, session);
         return -1;
       }
-      session->last_ping = 0;
-      session->last_pong = 0;
-      session->csm_tx = 0;
-      coap_ticks( &session->last_rx_tx );
+      coap_session_peer_update(session);
+      session->ext->last_ping = 0;
+      session->ext->last_pong = 0;
+      session->ext->csm_tx = 0;
+      coap_io_ticks(session->context, &session->last_rx_tx);
       if ((session->sock.flags & COAP_SOCKET_WANT_CONNECT) != 0) {
         session->state = COAP_SESSION_STATE_CONNECTING;
         return coap_session_delay_pdu(session, pdu, node);
@@ -804,6 +1392,7 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
       if (session->proto == COAP_PROTO_TLS) {
         int connected = 0;
         session->state = COAP_SESSION_STATE_HANDSHAKE;
+        COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
         session->tls = coap_tls_new_client_session(session, &connected);
         if (session->tls) {
           if (connected) {
@@ -833,7 +1422,7 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
   }
 
   if (session->state != COAP_SESSION_STATE_ESTABLISHED ||
-      (pdu->type == COAP_MESSAGE_CON && session->con_active >= COAP_DEFAULT_NSTART)) {
+      (pdu->type == COAP_MESSAGE_CON && session->con_active >= session->nstart)) {
     return coap_session_delay_pdu(session, pdu, node);
   }
 
@@ -841,6 +1430,12 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
     (session->sock.flags & COAP_SOCKET_WANT_WRITE))
     return coap_session_delay_pdu(session, pdu, node);
 
+#if !COAP_DISABLE_TCP
+  if (session->context->tcp_cork && COAP_PROTO_RELIABLE(session->proto) &&
+      coap_session_cork_pdu(session, pdu, node) == COAP_PDU_DELAYED)
+    return COAP_PDU_DELAYED;
+#endif /* !COAP_DISABLE_TCP */
+
   bytes_written = coap_session_send_pdu(session, pdu);
   if (bytes_written >= 0 && pdu->type == COAP_MESSAGE_CON &&
       COAP_PROTO_NOT_RELIABLE(session->proto))
@@ -851,6 +1446,22 @@ coap_send_pdu(coap_session_t *session, coap_pdu_t *pdu, coap_queue_t *node) {
   return bytes_written;
 }
 
+/*
+ * Sends @p response again on @p session as it was sent the first time, as
+ * the request it answers has come in again.
+ */
+static void
+coap_resend_response(coap_session_t *session, const coap_pdu_t *response) {
+  coap_pdu_t *pdu = coap_pdu_copy(response, response->mid, response->max_size,
+                                  response->token_length, response->token);
+
+  if (!pdu)
+    return;
+  if (!coap_pdu_encode_header(pdu, session->proto) ||
+      coap_send_pdu(session, pdu, NULL) != COAP_PDU_DELAYED)
+    coap_delete_pdu(pdu);
+}
+
 coap_mid_t
 coap_send_error(coap_session_t *session,
   coap_pdu_t *request,
@@ -909,6 +1520,15 @@ coap_calc_timeout(coap_session_t *session, unsigned char r) {
    * make the result a rounded Qx.FRAC_BITS */
   result = SHR_FP((ACK_RANDOM_FACTOR - FP1) * r, MAX_BITS);
 
+  if (session->cocoa) {
+    /* The CoCoA RTO takes the place of ACK_TIMEOUT */
+    uint64_t rto = SHR_FP((uint64_t)coap_session_rto(session) *
+                          (result + FP1), FRAC_BITS);
+
+    rto = rto * COAP_TICKS_PER_SECOND / 1000000;
+    return rto ? (unsigned int)rto : 1;
+  }
+
   /* Add 1 to the inner term and multiply with ACK_TIMEOUT, then
    * make the result a rounded Qx.FRAC_BITS */
   result = SHR_FP(((result + FP1) * ACK_TIMEOUT), FRAC_BITS);
@@ -921,11 +1541,40 @@ coap_calc_timeout(coap_session_t *session, unsigned char r) {
 #undef SHR_FP
 }
 
+/*
+ * Returns the CoCoA variable backoff factor, in halves, for a CON message
+ * with the initial @p timeout (in ticks).
+ */
+static unsigned char
+coap_cocoa_vbf(unsigned int timeout) {
+  if (timeout < COAP_TICKS_PER_SECOND)
+    return 6;
+  if (timeout > 3 * COAP_TICKS_PER_SECOND)
+    return 3;
+  return 4;
+}
+
+/* Returns the time until @p node is next due to be retransmitted */
+static coap_tick_t
+coap_retransmit_delay(const coap_queue_t *node) {
+  if (node->vbf)
+    return node->timeout;
+  return (coap_tick_t)node->timeout << node->retransmit_cnt;
+}
+
 coap_mid_t
 coap_wait_ack(coap_context_t *context, coap_session_t *session,
               coap_queue_t *node) {
   coap_tick_t now;
+  coap_tick_t delay;
 
+  if (node->retransmit_cnt == 0) {
+    /* First transmission */
+    node->vbf = session->cocoa ? coap_cocoa_vbf(node->timeout) : 0;
+    if (context->histograms || session->cocoa)
+      node->sent_us = coap_histogram_clock();
+  }
+  delay = coap_retransmit_delay(node);
   node->session = coap_session_reference(session);
 
   /* Set timer for pdu retransmission. If this is the first element in
@@ -936,14 +1585,13 @@ coap_wait_ack(coap_context_t *context, coap_session_t *session,
   * normalized to the base time and then inserted into the queue with
   * an adjusted relative time.
   */
-  coap_ticks(&now);
+  coap_io_ticks(context, &now);
   if (context->sendqueue == NULL) {
-    node->t = node->timeout << node->retransmit_cnt;
+    node->t = delay;
     context->sendqueue_basetime = now;
   } else {
     /* make node->t relative to context->sendqueue_basetime */
-    node->t = (now - context->sendqueue_basetime) +
-              (node->timeout << node->retransmit_cnt);
+    node->t = (now - context->sendqueue_basetime) + delay;
   }
 
   coap_insert_node(&context->sendqueue, node);
@@ -969,19 +1617,31 @@ coap_wait_ack(coap_context_t *context, coap_session_t *session,
 
   coap_log(LOG_DEBUG, "** %s: mid=0x%x: added to retransmit queue (%ums)\n",
     coap_session_str(node->session), node->id,
-    (unsigned)(node->t * 1000 / COAP_TICKS_PER_SECOND));
+    (unsigned)(delay * 1000 / COAP_TICKS_PER_SECOND));
 
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (context->io_external) {
+    coap_io_ticks(context, &now);
+    if (context->next_timeout == 0 ||
+        context->next_timeout > now + (delay * 1000 / COAP_TICKS_PER_SECOND)) {
+      context->next_timeout = now + (delay * 1000 / COAP_TICKS_PER_SECOND);
+      coap_io_external_set_timer(context,
+                                 delay * 1000 / COAP_TICKS_PER_SECOND);
+    }
+    return node->id;
+  }
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 #ifdef COAP_EPOLL_SUPPORT
   if (context->eptimerfd != -1) {
-    coap_ticks(&now);
+    coap_io_ticks(context, &now);
     if (context->next_timeout == 0 ||
-        context->next_timeout > now + (node->t * 1000 / COAP_TICKS_PER_SECOND)) {
+        context->next_timeout > now + (delay * 1000 / COAP_TICKS_PER_SECOND)) {
       struct itimerspec new_value;
       int ret;
 
-      context->next_timeout = now + (node->t * 1000 / COAP_TICKS_PER_SECOND);
+      context->next_timeout = now + (delay * 1000 / COAP_TICKS_PER_SECOND);
       memset(&new_value, 0, sizeof(new_value));
-      coap_tick_t rem_timeout = (node->t * 1000 / COAP_TICKS_PER_SECOND);
+      coap_tick_t rem_timeout = (delay * 1000 / COAP_TICKS_PER_SECOND);
       /* Need to trigger an event on context->epfd in the future */
       new_value.it_value.tv_sec = rem_timeout / 1000;
       new_value.it_value.tv_nsec = (rem_timeout % 1000) * 1000000;
@@ -994,7 +1654,15 @@ coap_wait_ack(coap_context_t *context, coap_session_t *session,
       }
     }
   }
-#endif /* COAP_EPOLL_SUPPORT */
+#elif defined(COAP_KQUEUE_SUPPORT)
+  coap_io_ticks(context, &now);
+  if (context->next_timeout == 0 ||
+      context->next_timeout > now + (delay * 1000 / COAP_TICKS_PER_SECOND)) {
+    context->next_timeout = now + (delay * 1000 / COAP_TICKS_PER_SECOND);
+    coap_kqueue_set_timer(context, delay * 1000 / COAP_TICKS_PER_SECOND,
+                          "coap_wait_ack");
+  }
+#endif /* COAP_KQUEUE_SUPPORT */
 
   return node->id;
 }
@@ -1012,7 +1680,9 @@ coap_send_large(coap_session_t *session, coap_pdu_t *pdu) {
   coap_opt_iterator_t opt_iter;
   int observe_action = -1;
   int have_block1 = 0;
+  int have_q_block2 = 0;
   coap_opt_t *opt;
+  uint64_t resume_key = 0;
 
   assert(pdu);
 
@@ -1033,16 +1703,45 @@ coap_send_large(coap_session_t *session, coap_pdu_t *pdu) {
                                                      coap_opt_length(opt));
     }
 
-    if (coap_get_block(pdu, COAP_OPTION_BLOCK1, &block) && block.m == 1)
+    if ((coap_get_block(pdu, COAP_OPTION_BLOCK1, &block) ||
+         coap_get_block(pdu, COAP_OPTION_Q_BLOCK1, &block)) && block.m == 1)
       have_block1 = 1;
+
+    if (COAP_SESSION_Q_BLOCK(session) &&
+        (pdu->code == COAP_REQUEST_GET || pdu->code == COAP_REQUEST_FETCH) &&
+        !coap_check_option(pdu, COAP_OPTION_BLOCK2, &opt_iter)) {
+      /* Ask for the first set of any large body as a burst */
+      if (!coap_check_option(pdu, COAP_OPTION_Q_BLOCK2, &opt_iter)) {
+        uint8_t buf[4];
+
+        coap_add_option(pdu, COAP_OPTION_Q_BLOCK2,
+                        coap_encode_var_safe(buf, sizeof(buf),
+                                             (0 << 4) | (1 << 3) | 6),
+                        buf);
+      }
+      have_q_block2 = 1;
+    }
+
+    if (session->context->block_resume_dir && observe_action == -1 &&
+        !have_q_block2 &&
+        (pdu->code == COAP_REQUEST_GET || pdu->code == COAP_REQUEST_FETCH) &&
+        (session->block_mode & COAP_BLOCK_SINGLE_BODY) &&
+        !(session->block_mode & COAP_BLOCK_STREAM_BODY) &&
+        !coap_check_option(pdu, COAP_OPTION_BLOCK2, &opt_iter)) {
+      /* Carry on with a body that was saved part of the way through */
+      resume_key = coap_block_resume_crcv_key(session, pdu);
+      if (!coap_block_resume_exists(session->context, resume_key))
+        resume_key = 0;
+    }
   }
 
   /*
    * If type is CON and protocol is not reliable, there is no need to set up
    * lg_crcv here as it can be built up based on sent PDU if there is a
-   * Block2 in the response.  However, still need it for observe and block1.
+   * Block2 in the response.  However, still need it for observe, block1 and
+   * a body that is being resumed.
    */
-  if (observe_action != -1 || have_block1 ||
+  if (observe_action != -1 || have_block1 || have_q_block2 || resume_key ||
       ((pdu->type == COAP_MESSAGE_NON || COAP_PROTO_RELIABLE(session->proto)) &&
        COAP_PDU_IS_REQUEST(pdu) && pdu->code != COAP_REQUEST_DELETE)) {
     /* See if this token is already in use for large body responses */
@@ -1054,18 +1753,17 @@ coap_send_large(coap_session_t *session, coap_pdu_t *pdu) {
           /* Need to update token to server's version */
           coap_update_token(pdu, lg_crcv->base_token_length,
                             lg_crcv->base_token);
-          memcpy(lg_crcv->token, lg_crcv->base_token,
-                 lg_crcv->base_token_length);
-          lg_crcv->token_length = lg_crcv->base_token_length;
+          coap_block_set_lg_crcv_token(session, lg_crcv, lg_crcv->base_token,
+                                       lg_crcv->base_token_length);
           lg_crcv->initial = 1;
           lg_crcv->observe_set = 0;
           /* de-reference lg_crcv as potentially linking in later */
-          LL_DELETE(session->lg_crcv, lg_crcv);
+          coap_block_remove_lg_crcv(session, lg_crcv);
           goto send_it;
         }
 
         /* Need to terminate and clean up previous response setup */
-        LL_DELETE(session->lg_crcv, lg_crcv);
+        coap_block_remove_lg_crcv(session, lg_crcv);
         coap_block_delete_lg_crcv(session, lg_crcv);
         break;
       }
@@ -1074,29 +1772,15 @@ coap_send_large(coap_session_t *session, coap_pdu_t *pdu) {
     lg_crcv = coap_block_new_lg_crcv(session, pdu);
     if (lg_crcv == NULL)
       return COAP_INVALID_MID;
-    if (have_block1 && session->lg_xmit) {
-      coap_lg_xmit_t *lg_xmit;
-
-      LL_FOREACH(session->lg_xmit, lg_xmit) {
-        if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
-            lg_xmit->b.b1.app_token &&
-            token_match(pdu->token, pdu->token_length,
-                        lg_xmit->b.b1.app_token->s,
-                        lg_xmit->b.b1.app_token->length)) {
-          /* Need to update the token as set up in the session->lg_xmit */
-          coap_update_token(pdu, session->lg_xmit->b.b1.token_length,
-                            session->lg_xmit->b.b1.token);
-          break;
-        }
-      }
-    }
+    if (resume_key)
+      coap_block_resume_lg_crcv(session, lg_crcv, pdu, resume_key);
   }
 
 send_it:
   mid = coap_send(session, pdu);
   if (lg_crcv) {
     if (mid != COAP_INVALID_MID) {
-      LL_PREPEND(session->lg_crcv, lg_crcv);
+      coap_block_add_lg_crcv(session, lg_crcv);
     }
     else {
       coap_block_delete_lg_crcv(session, lg_crcv);
@@ -1105,12 +1789,76 @@ send_it:
   return mid;
 }
 
-coap_mid_t
-coap_send(coap_session_t *session, coap_pdu_t *pdu) {
+/*
+ * Gives the first request @p pdu of a body set up with
+ * coap_add_data_large_request() the token of its lg_xmit, which the
+ * responses are matched with.
+ *
+ * Returns the lg_xmit, or NULL if @p pdu is not such a request.
+ */
+static coap_lg_xmit_t *
+coap_send_lg_xmit_token(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_lg_xmit_t *lg_xmit;
+  coap_block_t block;
+
+  if (!session->lg_xmit || !COAP_PDU_IS_REQUEST(pdu) ||
+      !(coap_get_block(pdu, COAP_OPTION_BLOCK1, &block) ||
+        coap_get_block(pdu, COAP_OPTION_Q_BLOCK1, &block)) ||
+      block.m == 0)
+    return NULL;
+
+  LL_FOREACH(session->lg_xmit, lg_xmit) {
+    if (COAP_PDU_IS_REQUEST(&lg_xmit->pdu) &&
+        lg_xmit->b.b1.app_token &&
+        token_match(pdu->token, pdu->token_length,
+                    lg_xmit->b.b1.app_token->s,
+                    lg_xmit->b.b1.app_token->length)) {
+      coap_update_token(pdu, lg_xmit->b.b1.token_length,
+                        lg_xmit->b.b1.token);
+      return lg_xmit;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Queues the response @p pdu to a multicast request to be sent once, after
+ * a random delay of up to the leisure of the context.
+ */
+static coap_mid_t
+coap_send_mcast_response(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_queue_t *node;
+  uint32_t r;
+  coap_tick_t leisure = (coap_tick_t)session->context->mcast_leisure_ms *
+                        COAP_TICKS_PER_SECOND / 1000;
+
+  node = coap_new_node();
+  if (!node) {
+    coap_delete_pdu(pdu);
+    return COAP_INVALID_MID;
+  }
+  coap_prng(&r, sizeof(r));
+  node->id = pdu->mid;
+  node->pdu = pdu;
+  node->is_mcast = 1;
+  node->timeout = (unsigned int)(((uint64_t)leisure * r) >> 32);
+  return coap_wait_ack(session->context, session, node);
+}
+
+static coap_mid_t
+coap_send_internal(coap_session_t *session, coap_pdu_t *pdu) {
   uint8_t r;
   ssize_t bytes_written;
   coap_opt_iterator_t opt_iter;
 
+  COAP_PROBE_PDU(send, session, pdu);
+#ifndef WITHOUT_ASYNC
+  if (session->async_token && COAP_PDU_IS_RESPONSE(pdu) &&
+      pdu->type != COAP_MESSAGE_ACK)
+    /* The response to a request handled asynchronously */
+    coap_async_piggyback(session, pdu);
+#endif /* WITHOUT_ASYNC */
+
   if (pdu->code == COAP_RESPONSE_CODE(508)) {
     /*
      * Need to prepend our IP identifier to the data as per
@@ -1214,14 +1962,25 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
     }
   }
 
+  if (session->oscore || session->oscore_assoc) {
+    /* Requests and responses protected end to end go out in their place */
+    pdu = coap_oscore_send_pdu(session, pdu);
+    if (!pdu)
+      return COAP_INVALID_MID;
+  }
+
   if (!coap_pdu_encode_header(pdu, session->proto)) {
     goto error;
   }
+  if (session->dedup && (pdu->type == COAP_MESSAGE_ACK ||
+                         pdu->type == COAP_MESSAGE_RST))
+    /* Kept for any duplicate of the request that this answers */
+    coap_dedup_store(session, pdu);
 
 #if !COAP_DISABLE_TCP
   if (COAP_PROTO_RELIABLE(session->proto) &&
       session->state == COAP_SESSION_STATE_ESTABLISHED &&
-      !session->csm_block_supported) {
+      !session->ext->csm_block_supported) {
     /*
      * Need to check that this instance is not sending any block options as the
      * remote end via CSM has not informed us that there is support
@@ -1239,6 +1998,12 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
   }
 #endif /* !COAP_DISABLE_TCP */
 
+  if (session->context->mcast_leisure_ms && pdu->type == COAP_MESSAGE_NON &&
+      COAP_PDU_IS_RESPONSE(pdu) && COAP_PROTO_NOT_RELIABLE(session->proto) &&
+      coap_is_mcast(&session->addr_info.local))
+    /* Held back for a random part of the leisure (RFC 7252 8.2) */
+    return coap_send_mcast_response(session, pdu);
+
   bytes_written = coap_send_pdu( session, pdu, NULL );
 
   if (bytes_written == COAP_PDU_DELAYED) {
@@ -1253,9 +2018,9 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
 
 #if !COAP_DISABLE_TCP
   if (COAP_PROTO_RELIABLE(session->proto) &&
-      (size_t)bytes_written < pdu->used_size + pdu->hdr_size) {
+      (size_t)bytes_written < COAP_PDU_WIRE_SIZE(pdu)) {
     if (coap_session_delay_pdu(session, pdu, NULL) == COAP_PDU_DELAYED) {
-      session->partial_write = (size_t)bytes_written;
+      session->ext->partial_write = (size_t)bytes_written;
       /* do not free pdu as it is stored with session for later use */
       return pdu->mid;
     } else {
@@ -1288,24 +2053,70 @@ coap_send(coap_session_t *session, coap_pdu_t *pdu) {
   return COAP_INVALID_MID;
 }
 
+coap_mid_t
+coap_send(coap_session_t *session, coap_pdu_t *pdu) {
+  coap_lg_xmit_t *lg_xmit;
+  uint8_t type = pdu->type;
+  coap_mid_t mid;
+
+  /* The responses to a large body are matched on the token of its lg_xmit */
+  lg_xmit = coap_send_lg_xmit_token(session, pdu);
+  mid = coap_send_internal(session, pdu);
+  if (lg_xmit && lg_xmit->option == COAP_OPTION_Q_BLOCK1 &&
+      mid != COAP_INVALID_MID && type == COAP_MESSAGE_NON) {
+    /*
+     * The rest of the first Q-Block1 set follows straight away.  For CON,
+     * it waits for the server to show that Q-Block1 is understood.
+     */
+    coap_block_send_q_block1_set(session, lg_xmit, 1);
+  }
+  return mid;
+}
+
 coap_mid_t
 coap_retransmit(coap_context_t *context, coap_queue_t *node) {
   if (!context || !node)
     return COAP_INVALID_MID;
 
+  if (node->is_mcast) {
+    /* The leisure of a response to a multicast request is over */
+    coap_mid_t mid = node->id;
+    ssize_t bytes_written = coap_send_pdu(node->session, node->pdu, NULL);
+
+    if (bytes_written == COAP_PDU_DELAYED)
+      /* The PDU was moved to the send queue of the session */
+      node->pdu = NULL;
+    else if (bytes_written < 0)
+      mid = COAP_INVALID_MID;
+    coap_delete_node(node);
+    return mid;
+  }
+
   /* re-initialize timeout when maximum number of retransmissions are not reached yet */
   if (node->retransmit_cnt < node->session->max_retransmit) {
     ssize_t bytes_written;
     coap_tick_t now;
 
     node->retransmit_cnt++;
-    coap_ticks(&now);
+    COAP_COUNT(node->session, retransmits, 1);
+    COAP_PROBE_PDU(retransmit, node->session, node->pdu);
+    /* The path may not take a datagram of this size any more */
+    coap_session_update_path_mtu(node->session,
+                                 COAP_PDU_WIRE_SIZE(node->pdu));
+    if (node->vbf) {
+      coap_tick_t timeout = (coap_tick_t)node->timeout * node->vbf / 2;
+      coap_tick_t max = (coap_tick_t)((uint64_t)COAP_COCOA_MAX_RTO_US *
+                                      COAP_TICKS_PER_SECOND / 1000000);
+
+      node->timeout = (unsigned int)(timeout < max ? timeout : max);
+    }
+    coap_io_ticks(context, &now);
     if (context->sendqueue == NULL) {
-      node->t = node->timeout << node->retransmit_cnt;
+      node->t = coap_retransmit_delay(node);
       context->sendqueue_basetime = now;
     } else {
       /* make node->t relative to context->sendqueue_basetime */
-      node->t = (now - context->sendqueue_basetime) + (node->timeout << node->retransmit_cnt);
+      node->t = (now - context->sendqueue_basetime) + coap_retransmit_delay(node);
     }
     coap_insert_node(&context->sendqueue, node);
 #ifdef WITH_LWIP
@@ -1318,7 +2129,9 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
 
     if (node->session->con_active)
       node->session->con_active--;
+    context->tx_class = COAP_TX_RETRANSMIT;
     bytes_written = coap_send_pdu(node->session, node->pdu, node);
+    context->tx_class = COAP_TX_NORMAL;
 
     if (bytes_written == COAP_PDU_DELAYED) {
       /* PDU was not retransmitted immediately because a new handshake is
@@ -1365,8 +2178,9 @@ coap_retransmit(coap_context_t *context, coap_queue_t *node) {
  }
 
   /* And finally delete the node */
-  if (node->pdu->type == COAP_MESSAGE_CON && context->nack_handler)
-    context->nack_handler(context, node->session, node->pdu, COAP_NACK_TOO_MANY_RETRIES, node->id);
+  if (node->pdu->type == COAP_MESSAGE_CON)
+    coap_handle_nack(context, node->session, node->pdu,
+                     COAP_NACK_TOO_MANY_RETRIES, node->id);
   coap_delete_node(node);
   return COAP_INVALID_MID;
 }
@@ -1388,10 +2202,17 @@ coap_handle_dgram_for_proto(coap_context_t *ctx, coap_session_t *session, coap_p
   coap_packet_get_memmapped(packet, &data, &data_len);
 
   if (session->proto == COAP_PROTO_DTLS) {
-    if (session->type == COAP_SESSION_TYPE_HELLO)
+    if (coap_dtls_offload_packet(session, data, data_len))
+      result = 0;
+    else if (session->type == COAP_SESSION_TYPE_HELLO)
       result = coap_dtls_hello(session, data, data_len);
     else if (session->tls)
       result = coap_dtls_receive(session, data, data_len);
+    /* Drop any peer address change that did not get authenticated */
+    session->ext->cid_remote_set = 0;
+    /* The handshake retransmit timeout may have changed */
+    if (session->state == COAP_SESSION_STATE_HANDSHAKE)
+      coap_session_timer_arm(session, 0);
   } else if (session->proto == COAP_PROTO_UDP) {
     result = coap_handle_dgram(ctx, session, data, data_len);
   }
@@ -1416,6 +2237,7 @@ coap_connect_session(coap_context_t *ctx,
     } else if (session->proto == COAP_PROTO_TLS) {
       int connected = 0;
       session->state = COAP_SESSION_STATE_HANDSHAKE;
+      COAP_PROBE_SESSION(dtls_handshake_start, session, session->proto);
       session->tls = coap_tls_new_client_session(session, &connected);
       if (session->tls) {
         if (connected) {
@@ -1435,53 +2257,446 @@ coap_connect_session(coap_context_t *ctx,
 #endif /* !COAP_DISABLE_TCP */
 }
 
+#if !COAP_DISABLE_TCP
+/*
+ * Copies @p length bytes of the wire form of @p pdu, starting @p offset
+ * bytes in, to @p dst.
+ */
+static void
+coap_pdu_copy_wire(const coap_pdu_t *pdu, size_t offset, uint8_t *dst,
+                   size_t length) {
+  size_t buffered = pdu->hdr_size + pdu->used_size;
+
+  if (offset < buffered) {
+    size_t n = min(length, buffered - offset);
+
+    memcpy(dst, pdu->token - pdu->hdr_size + offset, n);
+    dst += n;
+    length -= n;
+    offset = 0;
+  } else {
+    offset -= buffered;
+  }
+  if (length)
+    memcpy(dst, pdu->xmit_data + offset, length);
+}
+
+/*
+ * Writes the PDUs queued on the TCP or TLS @p session, from
+ * session->ext->partial_write bytes into the first, with a single writev() or
+ * in a single TLS record.  The kernel encrypts what is written with
+ * writev() to a TLS session that has kTLS.
+ *
+ * Returns the number of bytes written, 0 if the connection would block, or
+ * a value less than zero on error.
+ */
+static ssize_t
+coap_session_write_queued(coap_session_t *session) {
+  size_t offset = session->ext->partial_write;
+  coap_queue_t *q;
+
+#if COAP_SOCKET_SENDV
+  if (session->proto == COAP_PROTO_TCP ||
+      (session->proto == COAP_PROTO_TLS && !session->ext->write_pending &&
+       coap_tls_is_ktls_send(session))) {
+    struct iovec iov[COAP_TCP_WRITE_IOV_MAX];
+    int iovcnt = 0;
+
+    for (q = session->delayqueue;
+         q && iovcnt + 2 <= COAP_TCP_WRITE_IOV_MAX; q = q->next) {
+      const uint8_t *data = q->pdu->token - q->pdu->hdr_size;
+      size_t buffered = q->pdu->hdr_size + q->pdu->used_size;
+
+      if (offset < buffered) {
+        data += offset;
+        memcpy(&iov[iovcnt].iov_base, &data, sizeof(iov[iovcnt].iov_base));
+        iov[iovcnt++].iov_len = buffered - offset;
+        offset = 0;
+      } else {
+        offset -= buffered;
+      }
+      if (q->pdu->xmit_data) {
+        /* Send the payload directly from where the application has it */
+        data = q->pdu->xmit_data + offset;
+        memcpy(&iov[iovcnt].iov_base, &data, sizeof(iov[iovcnt].iov_base));
+        iov[iovcnt++].iov_len = q->pdu->xmit_length - offset;
+        offset = 0;
+      }
+    }
+    return coap_session_writev(session, iov, iovcnt);
+  }
+#endif /* COAP_SOCKET_SENDV */
+
+  if (session->proto == COAP_PROTO_TLS) {
+    size_t length = session->ext->write_pending;
+    ssize_t bytes_written;
+
+    /* The TLS library is given the same record again until it is taken */
+    if (!length) {
+      if (!session->ext->write_buf) {
+        session->ext->write_buf = coap_malloc_type(COAP_STRING,
+                                              COAP_TLS_WRITE_BUF_SIZE);
+        if (!session->ext->write_buf)
+          return -1;
+      }
+      for (q = session->delayqueue;
+           q && length < COAP_TLS_WRITE_BUF_SIZE; q = q->next) {
+        size_t n = min(COAP_PDU_WIRE_SIZE(q->pdu) - offset,
+                       COAP_TLS_WRITE_BUF_SIZE - length);
+
+        coap_pdu_copy_wire(q->pdu, offset, session->ext->write_buf + length, n);
+        length += n;
+        offset = 0;
+      }
+    }
+    bytes_written = coap_tls_write(session, session->ext->write_buf, length);
+    session->ext->write_pending = bytes_written == 0 ? length : 0;
+    return bytes_written;
+  }
+
+  return coap_session_send_pdu_from(session, session->delayqueue->pdu,
+                                    session->ext->partial_write);
+}
+
+void
+coap_io_flush_corked(coap_context_t *context) {
+  coap_tick_t now;
+
+  if (!context->corked)
+    return;
+  coap_io_ticks(context, &now);
+  while (context->corked) {
+    coap_session_t *session = coap_session_reference(context->corked);
+
+    /* Takes the session off the list */
+    coap_write_session(context, session, now);
+    coap_session_release(session);
+  }
+}
+#else /* COAP_DISABLE_TCP */
+
+void
+coap_io_flush_corked(coap_context_t *context) {
+  (void)context;
+}
+#endif /* COAP_DISABLE_TCP */
+
 static void
 coap_write_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now) {
+  coap_session_ext_t *ext = coap_session_ext(session);
+
   (void)ctx;
   assert(session->sock.flags & COAP_SOCKET_CONNECTED);
+  if (!ext)
+    return;
 
+#if !COAP_DISABLE_TCP
+  coap_session_uncork(session);
+#endif /* !COAP_DISABLE_TCP */
   while (session->delayqueue) {
     ssize_t bytes_written;
+    size_t left;
     coap_queue_t *q = session->delayqueue;
     coap_log(LOG_DEBUG, "** %s: mid=0x%x: transmitted after delay\n",
              coap_session_str(session), (int)q->pdu->mid);
-    assert(session->partial_write < q->pdu->used_size + q->pdu->hdr_size);
-    switch (session->proto) {
-      case COAP_PROTO_TCP:
+    assert(ext->partial_write < COAP_PDU_WIRE_SIZE(q->pdu));
 #if !COAP_DISABLE_TCP
-        bytes_written = coap_session_write(
-          session,
-          q->pdu->token - q->pdu->hdr_size - session->partial_write,
-          q->pdu->used_size + q->pdu->hdr_size - session->partial_write
-        );
+    /* Coalesce the queued PDUs into as few writes as possible */
+    if (COAP_PROTO_RELIABLE(session->proto) &&
+        session->state == COAP_SESSION_STATE_ESTABLISHED &&
+        (q->next || ext->write_pending))
+      bytes_written = coap_session_write_queued(session);
+    else
 #endif /* !COAP_DISABLE_TCP */
+      bytes_written = coap_session_send_pdu_from(session, q->pdu,
+                                                 ext->partial_write);
+    if (bytes_written <= 0)
+      break;
+    session->last_rx_tx = now;
+
+    /* Take the PDUs that have been written in full off the queue */
+    left = (size_t)bytes_written;
+    while ((q = session->delayqueue) != NULL && left > 0) {
+      size_t remaining = COAP_PDU_WIRE_SIZE(q->pdu) - ext->partial_write;
+
+      if (ext->partial_write == 0) {
+        coap_trace_pdu(session, q->pdu, 1);
+        coap_count_tx(session, q->pdu);
+      }
+      if (left < remaining) {
+        ext->partial_write += left;
         break;
-      case COAP_PROTO_TLS:
+      }
+      left -= remaining;
+      coap_session_delayqueue_pop(session);
+      ext->partial_write = 0;
+      coap_delete_node(q);
+    }
+    if (ext->partial_write > 0)
+      break;
+  }
+}
+
 #if !COAP_DISABLE_TCP
-        bytes_written = coap_tls_write(
-          session,
-          q->pdu->token - q->pdu->hdr_size - session->partial_write,
-          q->pdu->used_size + q->pdu->hdr_size - session->partial_write
-        );
-#endif /* !COAP_DISABLE_TCP */
-        break;
-      default:
-        bytes_written = -1;
+/*
+ * Adds the received bytes at @p p to the frame that is being assembled in
+ * session->ext->partial_pdu, which is started if there is none, and hands the
+ * frame on once it is complete.  Used for the frames that wrap around the
+ * end of session->ext->read_buf.
+ *
+ * Returns the number of bytes used, which is less than @p length only once
+ * the frame is complete, or -1 if the frame is bad.
+ */
+static ssize_t
+coap_read_frame_copy(coap_context_t *ctx, coap_session_t *session,
+                     const uint8_t *p, size_t length) {
+  size_t bytes_read = length;
+
+  while (bytes_read > 0) {
+    if (session->ext->partial_pdu) {
+      size_t len = session->ext->partial_pdu->used_size
+                 + session->ext->partial_pdu->hdr_size
+                 - session->ext->partial_read;
+      size_t n = min(len, bytes_read);
+      memcpy(session->ext->partial_pdu->token - session->ext->partial_pdu->hdr_size
+             + session->ext->partial_read, p, n);
+      p += n;
+      bytes_read -= n;
+      if (n == len) {
+        if (coap_pdu_parse_header(session->ext->partial_pdu, session->proto)
+          && coap_pdu_parse_opt(session->ext->partial_pdu)) {
+          coap_dispatch(ctx, session, session->ext->partial_pdu);
+        }
+        coap_delete_pdu(session->ext->partial_pdu);
+        session->ext->partial_pdu = NULL;
+        session->ext->partial_read = 0;
         break;
+      } else {
+        session->ext->partial_read += n;
+      }
+    } else if (session->ext->partial_read > 0) {
+      size_t hdr_size = coap_pdu_parse_header_size(session->proto,
+        session->ext->read_header);
+      size_t len = hdr_size - session->ext->partial_read;
+      size_t n = min(len, bytes_read);
+      memcpy(session->ext->read_header + session->ext->partial_read, p, n);
+      p += n;
+      bytes_read -= n;
+      if (n == len) {
+        size_t size = coap_pdu_parse_size(session->proto, session->ext->read_header,
+          hdr_size);
+        if (size > COAP_DEFAULT_MAX_PDU_RX_SIZE) {
+          coap_log(LOG_WARNING,
+                   "** %s: incoming PDU length too large (%zu > %lu)\n",
+                   coap_session_str(session),
+                   size, COAP_DEFAULT_MAX_PDU_RX_SIZE);
+          return -1;
+        }
+        /* Need max space incase PDU is updated with updated token etc. */
+        session->ext->partial_pdu = coap_pdu_init(0, 0, 0,
+                                       coap_session_max_pdu_size(session));
+        if (session->ext->partial_pdu == NULL)
+          return -1;
+        if (session->ext->partial_pdu->alloc_size < size && !coap_pdu_resize(session->ext->partial_pdu, size))
+          return -1;
+        session->ext->partial_pdu->hdr_size = (uint8_t)hdr_size;
+        session->ext->partial_pdu->used_size = size;
+        memcpy(session->ext->partial_pdu->token - hdr_size, session->ext->read_header, hdr_size);
+        session->ext->partial_read = hdr_size;
+        if (size == 0) {
+          if (coap_pdu_parse_header(session->ext->partial_pdu, session->proto)) {
+            coap_dispatch(ctx, session, session->ext->partial_pdu);
+          }
+          coap_delete_pdu(session->ext->partial_pdu);
+          session->ext->partial_pdu = NULL;
+          session->ext->partial_read = 0;
+          break;
+        }
+      } else {
+        session->ext->partial_read += n;
+      }
+    } else {
+      session->ext->read_header[0] = *p++;
+      bytes_read -= 1;
+      if (!coap_pdu_parse_header_size(session->proto,
+                                      session->ext->read_header))
+        return -1;
+      session->ext->partial_read = 1;
     }
-    if (bytes_written > 0)
-      session->last_rx_tx = now;
-    if (bytes_written <= 0 || (size_t)bytes_written < q->pdu->used_size + q->pdu->hdr_size - session->partial_write) {
-      if (bytes_written > 0)
-        session->partial_write += (size_t)bytes_written;
+  }
+  return (ssize_t)(length - bytes_read);
+}
+
+/*
+ * Hands on each complete frame at @p data, parsed in place.
+ *
+ * Returns the number of bytes of the complete frames, leaving any frame
+ * that is cut short, or -1 if a frame is bad.
+ */
+static ssize_t
+coap_read_frames(coap_context_t *ctx, coap_session_t *session,
+                 uint8_t *data, size_t length) {
+  size_t offset = 0;
+
+  while (offset < length) {
+    size_t hdr_size = coap_pdu_parse_header_size(session->proto,
+                                                 data + offset);
+    size_t size;
+    coap_pdu_t *pdu;
+
+    if (!hdr_size)
+      return -1;
+    if (hdr_size > length - offset)
       break;
+    size = coap_pdu_parse_size(session->proto, data + offset, hdr_size);
+    if (size > COAP_DEFAULT_MAX_PDU_RX_SIZE) {
+      coap_log(LOG_WARNING,
+               "** %s: incoming PDU length too large (%zu > %lu)\n",
+               coap_session_str(session),
+               size, COAP_DEFAULT_MAX_PDU_RX_SIZE);
+      return -1;
     }
-    session->delayqueue = q->next;
-    session->partial_write = 0;
-    coap_delete_node(q);
+    if (size > length - offset - hdr_size)
+      break;
+    pdu = coap_pdu_borrow(session->proto, data + offset, hdr_size + size,
+                          coap_session_max_pdu_size(session));
+    if (!pdu)
+      return -1;
+    offset += hdr_size + size;
+    if (coap_pdu_parse_header(pdu, session->proto) &&
+        (size == 0 || coap_pdu_parse_opt(pdu)))
+      coap_dispatch(ctx, session, pdu);
+    coap_delete_pdu(pdu);
+    if (session->state == COAP_SESSION_STATE_NONE)
+      break;
   }
+  return (ssize_t)offset;
 }
 
+/*
+ * Reads what there is from the TCP or TLS connection of @p session into
+ * its receive ring buffer.  Frames that lie wholly in the buffer are
+ * parsed in place, several per read, and only a frame that wraps around
+ * the end of the buffer is copied into a PDU of its own.
+ *
+ * Returns 0 on success or -1 if the session needs to be disconnected.
+ */
+static int
+coap_read_stream(coap_context_t *ctx, coap_session_t *session,
+                 coap_tick_t now) {
+  ssize_t bytes_read = 0;
+  ssize_t used;
+  int retry;
+
+  if (!session->ext->read_buf) {
+    session->ext->read_buf = coap_malloc_type(COAP_STRING, COAP_TCP_READ_BUF_SIZE);
+    if (!session->ext->read_buf)
+      return -1;
+    session->ext->read_head = session->ext->read_tail = 0;
+  }
+  do {
+    uint8_t *buf = session->ext->read_buf + session->ext->read_tail;
+    size_t buf_len = COAP_TCP_READ_BUF_SIZE - session->ext->read_tail;
+
+    if (session->proto == COAP_PROTO_TCP)
+      bytes_read = coap_socket_read(&session->sock, buf, buf_len);
+    else if (session->proto == COAP_PROTO_TLS)
+      bytes_read = coap_tls_read(session, buf, buf_len);
+    if (bytes_read < 0)
+      return -1;
+    if (bytes_read == 0)
+      break;
+    coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
+             coap_session_str(session), bytes_read);
+    session->last_rx_tx = now;
+    /*
+     * The TLS libraries hand over a record at a time, so that a burst of
+     * PDUs is only handled (and answered) together if reading goes on
+     */
+    retry = bytes_read == (ssize_t)buf_len ||
+            session->proto == COAP_PROTO_TLS;
+    session->ext->read_tail += bytes_read;
+
+    if (session->ext->partial_read > 0) {
+      /* Finish off the frame that wrapped */
+      used = coap_read_frame_copy(ctx, session,
+                                  session->ext->read_buf + session->ext->read_head,
+                                  session->ext->read_tail - session->ext->read_head);
+      if (used < 0)
+        return -1;
+      if (session->state == COAP_SESSION_STATE_NONE)
+        break;
+      session->ext->read_head += used;
+    }
+    if (session->ext->partial_read == 0) {
+      used = coap_read_frames(ctx, session,
+                              session->ext->read_buf + session->ext->read_head,
+                              session->ext->read_tail - session->ext->read_head);
+      if (used < 0)
+        return -1;
+      if (session->state == COAP_SESSION_STATE_NONE)
+        break;
+      session->ext->read_head += used;
+    }
+
+    if (session->ext->read_head == session->ext->read_tail) {
+      session->ext->read_head = session->ext->read_tail = 0;
+    } else if (session->ext->read_tail == COAP_TCP_READ_BUF_SIZE) {
+      /* The last frame wraps, so it is assembled in a PDU of its own */
+      if (coap_read_frame_copy(ctx, session,
+                               session->ext->read_buf + session->ext->read_head,
+                               session->ext->read_tail - session->ext->read_head) < 0)
+        return -1;
+      if (session->state == COAP_SESSION_STATE_NONE)
+        break;
+      session->ext->read_head = session->ext->read_tail = 0;
+    }
+  } while (retry);
+  return 0;
+}
+#endif /* !COAP_DISABLE_TCP */
+
+#ifdef COAP_AF_UNIX_SUPPORT
+/*
+ * Reads a datagram from the Unix domain socket @p sock into the receive
+ * buffer of @p ctx, as the payload of a coap_packet_t is too small for the
+ * COAP_AF_UNIX_MTU that these sockets use.  The addresses go into
+ * @p packet.  Returns the length of the datagram, 0 if there is none, -2
+ * if the peer has gone, or -1 on error.
+ */
+static ssize_t
+coap_read_unix(coap_context_t *ctx, coap_socket_t *sock,
+               coap_packet_t *packet) {
+  ssize_t len;
+
+  if ((sock->flags & COAP_SOCKET_CAN_READ) == 0)
+    return -1;
+  sock->flags &= ~COAP_SOCKET_CAN_READ;
+  if (!ctx->unix_rxbuf) {
+    ctx->unix_rxbuf = coap_malloc_type(COAP_STRING, COAP_AF_UNIX_MTU);
+    if (!ctx->unix_rxbuf)
+      return -1;
+  }
+  packet->addr_info.remote.size = (socklen_t)sizeof(packet->addr_info.remote.addr);
+  len = recvfrom(sock->fd, ctx->unix_rxbuf, COAP_AF_UNIX_MTU, 0,
+                 &packet->addr_info.remote.addr.sa,
+                 &packet->addr_info.remote.size);
+  if (len < 0) {
+    if (COAP_SOCKET_WOULD_BLOCK(errno))
+      return 0;
+    if (errno == ECONNREFUSED)
+      return -2;
+    coap_log(LOG_WARNING, "coap_read_unix: %s\n", coap_socket_strerror());
+    return -1;
+  }
+  /* An edge-triggered socket is read until there is nothing left */
+  if (sock->flags & COAP_SOCKET_EDGE)
+    sock->flags |= COAP_SOCKET_CAN_READ;
+  packet->length = (size_t)len;
+  return len;
+}
+#endif /* COAP_AF_UNIX_SUPPORT */
+
 static void
 coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now) {
 #if COAP_CONSTRAINED_STACK
@@ -1498,126 +2713,75 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
 
   assert(session->sock.flags & (COAP_SOCKET_CONNECTED | COAP_SOCKET_MULTICAST));
 
+#ifdef COAP_AF_UNIX_SUPPORT
+  if (coap_address_is_unix(&session->addr_info.remote) &&
+      ctx->network_read == coap_network_read) {
+    ssize_t bytes_read = coap_read_unix(ctx, &session->sock, packet);
+
+    if (bytes_read == -2) {
+      coap_session_disconnected(session, COAP_NACK_ICMP_ISSUE);
+    } else if (bytes_read < 0) {
+      coap_log(LOG_WARNING, "*  %s: read error\n", coap_session_str(session));
+    } else if (bytes_read > 0) {
+      session->last_rx_tx = now;
+      coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
+               coap_session_str(session), bytes_read);
+      coap_handle_dgram(ctx, session, ctx->unix_rxbuf, (size_t)bytes_read);
+    }
+  } else
+#endif /* COAP_AF_UNIX_SUPPORT */
   if (COAP_PROTO_NOT_RELIABLE(session->proto)) {
     ssize_t bytes_read;
-    memcpy(&packet->addr_info, &session->addr_info, sizeof(packet->addr_info));
+#if !defined(WITH_CONTIKI) && !defined(RIOT_VERSION)
+    /* coap_network_read() leaves the addresses of a connected socket alone */
+    int keep_addr = (session->sock.flags & COAP_SOCKET_CONNECTED) &&
+                    ctx->network_read == coap_network_read;
+#else /* WITH_CONTIKI || RIOT_VERSION */
+    int keep_addr = 0;
+#endif /* WITH_CONTIKI || RIOT_VERSION */
+
+    if (!keep_addr)
+      memcpy(&packet->addr_info, &session->addr_info,
+             sizeof(packet->addr_info));
+#ifndef RIOT_VERSION
+    coap_packet_set_rxbuf(packet, ctx);
+#endif /* ! RIOT_VERSION */
     bytes_read = ctx->network_read(&session->sock, packet);
 
     if (bytes_read < 0) {
       if (bytes_read == -2)
         /* Reset the session back to startup defaults */
         coap_session_disconnected(session, COAP_NACK_ICMP_ISSUE);
+      else if (bytes_read == -3)
+        coap_session_update_path_mtu(session, 0);
       else
         coap_log(LOG_WARNING, "*  %s: read error\n",
                  coap_session_str(session));
     } else if (bytes_read > 0) {
+      /* The responses to a multicast request come from the members */
+      int group = session->type == COAP_SESSION_TYPE_CLIENT &&
+                  (session->sock.flags & COAP_SOCKET_MULTICAST);
+      coap_address_t group_addr;
+
       session->last_rx_tx = now;
-      memcpy(&session->addr_info, &packet->addr_info,
-             sizeof(session->addr_info));
+      if (group)
+        coap_address_copy(&group_addr, &session->addr_info.remote);
+      if (!keep_addr)
+        memcpy(&session->addr_info, &packet->addr_info,
+               sizeof(session->addr_info));
       coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
                coap_session_str(session), bytes_read);
       coap_handle_dgram_for_proto(ctx, session, packet);
+      if (group)
+        /* so that the next request goes to the group again */
+        coap_address_copy(&session->addr_info.remote, &group_addr);
     }
+#ifdef RIOT_VERSION
+    coap_packet_release(packet);
+#endif /* RIOT_VERSION */
 #if !COAP_DISABLE_TCP
   } else {
-    ssize_t bytes_read = 0;
-    const uint8_t *p;
-    int retry;
-    /* adjust for LWIP */
-    uint8_t *buf = packet->payload;
-    size_t buf_len = sizeof(packet->payload);
-
-    do {
-      if (session->proto == COAP_PROTO_TCP)
-        bytes_read = coap_socket_read(&session->sock, buf, buf_len);
-      else if (session->proto == COAP_PROTO_TLS)
-        bytes_read = coap_tls_read(session, buf, buf_len);
-      if (bytes_read > 0) {
-        coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
-                 coap_session_str(session), bytes_read);
-        session->last_rx_tx = now;
-      }
-      p = buf;
-      retry = bytes_read == (ssize_t)buf_len;
-      while (bytes_read > 0) {
-        if (session->partial_pdu) {
-          size_t len = session->partial_pdu->used_size
-                     + session->partial_pdu->hdr_size
-                     - session->partial_read;
-          size_t n = min(len, (size_t)bytes_read);
-          memcpy(session->partial_pdu->token - session->partial_pdu->hdr_size
-                 + session->partial_read, p, n);
-          p += n;
-          bytes_read -= n;
-          if (n == len) {
-            if (coap_pdu_parse_header(session->partial_pdu, session->proto)
-              && coap_pdu_parse_opt(session->partial_pdu)) {
-              coap_dispatch(ctx, session, session->partial_pdu);
-            }
-            coap_delete_pdu(session->partial_pdu);
-            session->partial_pdu = NULL;
-            session->partial_read = 0;
-          } else {
-            session->partial_read += n;
-          }
-        } else if (session->partial_read > 0) {
-          size_t hdr_size = coap_pdu_parse_header_size(session->proto,
-            session->read_header);
-          size_t len = hdr_size - session->partial_read;
-          size_t n = min(len, (size_t)bytes_read);
-          memcpy(session->read_header + session->partial_read, p, n);
-          p += n;
-          bytes_read -= n;
-          if (n == len) {
-            size_t size = coap_pdu_parse_size(session->proto, session->read_header,
-              hdr_size);
-            if (size > COAP_DEFAULT_MAX_PDU_RX_SIZE) {
-              coap_log(LOG_WARNING,
-                       "** %s: incoming PDU length too large (%zu > %lu)\n",
-                       coap_session_str(session),
-                       size, COAP_DEFAULT_MAX_PDU_RX_SIZE);
-              bytes_read = -1;
-              break;
-            }
-            /* Need max space incase PDU is updated with updated token etc. */
-            session->partial_pdu = coap_pdu_init(0, 0, 0,
-                                           coap_session_max_pdu_size(session));
-            if (session->partial_pdu == NULL) {
-              bytes_read = -1;
-              break;
-            }
-            if (session->partial_pdu->alloc_size < size && !coap_pdu_resize(session->partial_pdu, size)) {
-              bytes_read = -1;
-              break;
-            }
-            session->partial_pdu->hdr_size = (uint8_t)hdr_size;
-            session->partial_pdu->used_size = size;
-            memcpy(session->partial_pdu->token - hdr_size, session->read_header, hdr_size);
-            session->partial_read = hdr_size;
-            if (size == 0) {
-              if (coap_pdu_parse_header(session->partial_pdu, session->proto)) {
-                coap_dispatch(ctx, session, session->partial_pdu);
-              }
-              coap_delete_pdu(session->partial_pdu);
-              session->partial_pdu = NULL;
-              session->partial_read = 0;
-            }
-          } else {
-            session->partial_read += bytes_read;
-          }
-        } else {
-          session->read_header[0] = *p++;
-          bytes_read -= 1;
-          if (!coap_pdu_parse_header_size(session->proto,
-                                          session->read_header)) {
-            bytes_read = -1;
-            break;
-          }
-          session->partial_read = 1;
-        }
-      }
-    } while (bytes_read == 0 && retry);
-    if (bytes_read < 0)
+    if (coap_read_stream(ctx, session, now) < 0)
       coap_session_disconnected(session, COAP_NACK_NOT_DELIVERABLE);
 #endif /* !COAP_DISABLE_TCP */
   }
@@ -1626,6 +2790,106 @@ coap_read_session(coap_context_t *ctx, coap_session_t *session, coap_tick_t now)
 #endif /* COAP_CONSTRAINED_STACK */
 }
 
+int
+coap_handle_endpoint_packet(coap_context_t *ctx, coap_endpoint_t *endpoint,
+                            coap_packet_t *packet, coap_tick_t now) {
+  int result = -1;
+  coap_session_t *session;
+
+  if (ctx->ratelimit) {
+    uint8_t *data;
+    size_t length;
+
+    coap_packet_get_memmapped(packet, &data, &length);
+    if (!coap_ratelimit_check(endpoint, packet, data, length, now))
+      return -1;
+  }
+  session = coap_endpoint_get_session(endpoint, packet, now);
+  if (session) {
+    coap_log(LOG_DEBUG, "*  %s: received %zu bytes\n",
+             coap_session_str(session), packet->length);
+    result = coap_handle_dgram_for_proto(ctx, session, packet);
+    if (endpoint->proto == COAP_PROTO_DTLS && session->type == COAP_SESSION_TYPE_HELLO && result == 1)
+      coap_session_new_dtls_session(session, now);
+  } else {
+    COAP_COUNT_ENDPOINT(endpoint, dropped, 1);
+  }
+  return result;
+}
+
+#if defined(COAP_NETWORK_READ_BATCH) && !COAP_CONSTRAINED_STACK
+/**
+ * Reads up to #COAP_RECVMMSG_BATCH datagrams from @p endpoint in one go and
+ * dispatches each of them in turn.
+ */
+static int
+coap_read_endpoint_batch(coap_context_t *ctx, coap_endpoint_t *endpoint,
+                         coap_tick_t now) {
+  coap_packet_t packets[COAP_RECVMMSG_BATCH];
+  int result = -1;                /* the value to be returned */
+  int count;
+  int i;
+
+  for (i = 0; i < COAP_RECVMMSG_BATCH; i++) {
+    /* Need to do this as there may be holes in addr_info */
+    memset(&packets[i].addr_info, 0, sizeof(packets[i].addr_info));
+    coap_address_init(&packets[i].addr_info.remote);
+    coap_address_copy(&packets[i].addr_info.local, &endpoint->bind_addr);
+    packets[i].payload = packets[i].buf;
+    packets[i].size = sizeof(packets[i].buf);
+  }
+  count = coap_network_read_batch(&endpoint->sock, packets,
+                                  COAP_RECVMMSG_BATCH);
+
+  if (count < 0) {
+    coap_log(LOG_WARNING, "*  %s: read failed\n", coap_endpoint_str(endpoint));
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (packets[i].length == 0)
+      continue;
+    result = coap_handle_endpoint_packet(ctx, endpoint, &packets[i], now);
+  }
+  return result;
+}
+#endif /* COAP_NETWORK_READ_BATCH && !COAP_CONSTRAINED_STACK */
+
+#ifdef COAP_AF_UNIX_SUPPORT
+/* Reads a datagram of up to COAP_AF_UNIX_MTU bytes from @p endpoint */
+static int
+coap_read_endpoint_unix(coap_context_t *ctx, coap_endpoint_t *endpoint,
+                        coap_tick_t now) {
+  coap_packet_t packet;
+  coap_session_t *session;
+  ssize_t bytes_read;
+
+  memset(&packet.addr_info, 0, sizeof(packet.addr_info));
+  coap_address_copy(&packet.addr_info.local, &endpoint->bind_addr);
+  packet.ifindex = 0;
+  bytes_read = coap_read_unix(ctx, &endpoint->sock, &packet);
+  packet.payload = ctx->unix_rxbuf;
+  packet.size = COAP_AF_UNIX_MTU;
+  if (bytes_read < 0) {
+    coap_log(LOG_WARNING, "*  %s: read failed\n", coap_endpoint_str(endpoint));
+    return -1;
+  }
+  if (bytes_read == 0)
+    return -1;
+  if (ctx->ratelimit &&
+      !coap_ratelimit_check(endpoint, &packet, ctx->unix_rxbuf,
+                            (size_t)bytes_read, now))
+    return -1;
+  session = coap_endpoint_get_session(endpoint, &packet, now);
+  if (!session) {
+    COAP_COUNT_ENDPOINT(endpoint, dropped, 1);
+    return -1;
+  }
+  coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
+           coap_session_str(session), bytes_read);
+  return coap_handle_dgram(ctx, session, ctx->unix_rxbuf, (size_t)bytes_read);
+}
+#endif /* COAP_AF_UNIX_SUPPORT */
+
 static int
 coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t now) {
   ssize_t bytes_read = -1;
@@ -1641,6 +2905,21 @@ coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t n
   assert(COAP_PROTO_NOT_RELIABLE(endpoint->proto));
   assert(endpoint->sock.flags & COAP_SOCKET_BOUND);
 
+#ifdef COAP_AF_UNIX_SUPPORT
+  if (coap_address_is_unix(&endpoint->bind_addr) &&
+      ctx->network_read == coap_network_read)
+    return coap_read_endpoint_unix(ctx, endpoint, now);
+#endif /* COAP_AF_UNIX_SUPPORT */
+
+#if defined(COAP_NETWORK_READ_BATCH) && !COAP_CONSTRAINED_STACK
+  /*
+   * Batched reads are only possible with the default network_read handler,
+   * and into the coap_packet_t
+   */
+  if (ctx->network_read == coap_network_read && !ctx->rxbuf)
+    return coap_read_endpoint_batch(ctx, endpoint, now);
+#endif /* COAP_NETWORK_READ_BATCH && !COAP_CONSTRAINED_STACK */
+
 #if COAP_CONSTRAINED_STACK
   coap_mutex_lock(&e_static_mutex);
 #endif /* COAP_CONSTRAINED_STACK */
@@ -1649,20 +2928,19 @@ coap_read_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t n
   memset(&packet->addr_info, 0, sizeof(packet->addr_info));
   coap_address_init(&packet->addr_info.remote);
   coap_address_copy(&packet->addr_info.local, &endpoint->bind_addr);
+#ifndef RIOT_VERSION
+  coap_packet_set_rxbuf(packet, ctx);
+#endif /* ! RIOT_VERSION */
   bytes_read = ctx->network_read(&endpoint->sock, packet);
 
   if (bytes_read < 0) {
     coap_log(LOG_WARNING, "*  %s: read failed\n", coap_endpoint_str(endpoint));
   } else if (bytes_read > 0) {
-    coap_session_t *session = coap_endpoint_get_session(endpoint, packet, now);
-    if (session) {
-      coap_log(LOG_DEBUG, "*  %s: received %zd bytes\n",
-               coap_session_str(session), bytes_read);
-      result = coap_handle_dgram_for_proto(ctx, session, packet);
-      if (endpoint->proto == COAP_PROTO_DTLS && session->type == COAP_SESSION_TYPE_HELLO && result == 1)
-        coap_session_new_dtls_session(session, now);
-    }
+    result = coap_handle_endpoint_packet(ctx, endpoint, packet, now);
   }
+#ifdef RIOT_VERSION
+  coap_packet_release(packet);
+#endif /* RIOT_VERSION */
 #if COAP_CONSTRAINED_STACK
   coap_mutex_unlock(&e_static_mutex);
 #endif /* COAP_CONSTRAINED_STACK */
@@ -1680,23 +2958,38 @@ coap_write_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint, coap_tick_t
 static int
 coap_accept_endpoint(coap_context_t *ctx, coap_endpoint_t *endpoint,
   coap_tick_t now) {
-  coap_session_t *session = coap_new_server_session(ctx, endpoint);
-  if (session)
+  int accepted = 0;
+
+  /*
+   * An edge-triggered endpoint gets CAN_ACCEPT set again after each
+   * successful accept() until there are no more pending connections.
+   */
+  do {
+    coap_session_t *session = coap_new_server_session(ctx, endpoint);
+    if (!session)
+      break;
     session->last_rx_tx = now;
-  return session != NULL;
+    accepted = 1;
+  } while (endpoint->sock.flags & COAP_SOCKET_CAN_ACCEPT);
+  endpoint->sock.flags &= ~COAP_SOCKET_CAN_ACCEPT;
+  return accepted;
 }
 
 void
 coap_io_do_io(coap_context_t *ctx, coap_tick_t now) {
-#ifdef COAP_EPOLL_SUPPORT
+#ifdef COAP_EVENT_QUEUE_SUPPORT
   (void)ctx;
   (void)now;
    coap_log(LOG_EMERG,
-            "coap_io_do_io() requires libcoap not compiled for using epoll\n");
-#else /* ! COAP_EPOLL_SUPPORT */
+            "coap_io_do_io() requires libcoap not compiled for using epoll or kqueue\n");
+#else /* ! COAP_EVENT_QUEUE_SUPPORT */
   coap_endpoint_t *ep, *tmp;
   coap_session_t *s, *rtmp;
+  unsigned int pos;
+  coap_tick_t io_now = ctx->io_now;
 
+  /* Everything done here is timed from now */
+  ctx->io_now = now;
   LL_FOREACH_SAFE(ctx->endpoint, ep, tmp) {
     if ((ep->sock.flags & COAP_SOCKET_CAN_READ) != 0)
       coap_read_endpoint(ctx, ep, now);
@@ -1704,7 +2997,7 @@ coap_io_do_io(coap_context_t *ctx, coap_tick_t now) {
       coap_write_endpoint(ctx, ep, now);
     if ((ep->sock.flags & COAP_SOCKET_CAN_ACCEPT) != 0)
       coap_accept_endpoint(ctx, ep, now);
-    SESSIONS_ITER_SAFE(ep->sessions, s, rtmp) {
+    SESSIONS_INDEX_ITER(&ep->sessions, s, pos) {
       if ((s->sock.flags & COAP_SOCKET_CAN_READ) != 0) {
         /* Make sure the session object is not deleted in one of the callbacks  */
         coap_session_reference(s);
@@ -1740,8 +3033,84 @@ coap_io_do_io(coap_context_t *ctx, coap_tick_t now) {
       coap_session_release( s );
     }
   }
-#endif /* ! COAP_EPOLL_SUPPORT */
+  ctx->io_now = io_now;
+#endif /* ! COAP_EVENT_QUEUE_SUPPORT */
+}
+
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+/*
+ * Handles the @p events (EPOLLIN, EPOLLOUT, ...) that epoll or kqueue
+ * reported for @p sock.
+ */
+static void
+coap_io_do_socket_events(coap_socket_t *sock, uint32_t events,
+                         coap_tick_t now) {
+  if (sock->endpoint) {
+    coap_endpoint_t *endpoint = sock->endpoint;
+
+    if ((sock->flags & COAP_SOCKET_WANT_READ) &&
+        (events & EPOLLIN)) {
+      sock->flags |= COAP_SOCKET_CAN_READ;
+      /* An edge-triggered endpoint gets CAN_READ set again until drained */
+      do {
+        coap_read_endpoint(endpoint->context, endpoint, now);
+      } while ((sock->flags & (COAP_SOCKET_EDGE|COAP_SOCKET_CAN_READ)) ==
+               (COAP_SOCKET_EDGE|COAP_SOCKET_CAN_READ));
+    }
+
+    if ((sock->flags & COAP_SOCKET_WANT_WRITE) &&
+        (events & EPOLLOUT)) {
+      /*
+       * Need to update this to EPOLLIN as EPOLLOUT will normally always
+       * be true causing epoll_wait to return early
+       */
+      coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
+      sock->flags |= COAP_SOCKET_CAN_WRITE;
+      coap_write_endpoint(endpoint->context, endpoint, now);
+    }
+
+    if ((sock->flags & COAP_SOCKET_WANT_ACCEPT) &&
+        (events & EPOLLIN)) {
+      sock->flags |= COAP_SOCKET_CAN_ACCEPT;
+      coap_accept_endpoint(endpoint->context, endpoint, now);
+    }
+  }
+  else if (sock->session) {
+    coap_session_t *session = sock->session;
+
+    /* Make sure the session object is not deleted
+       in one of the callbacks  */
+    coap_session_reference(session);
+    if ((sock->flags & COAP_SOCKET_WANT_CONNECT) &&
+        (events & (EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
+      sock->flags |= COAP_SOCKET_CAN_CONNECT;
+      coap_connect_session(session->context, session, now);
+      if (!(sock->flags & COAP_SOCKET_WANT_WRITE)) {
+        coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
+      }
+    }
+
+    if ((sock->flags & COAP_SOCKET_WANT_READ) &&
+        (events & (EPOLLIN|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
+      sock->flags |= COAP_SOCKET_CAN_READ;
+      coap_read_session(session->context, session, now);
+    }
+
+    if ((sock->flags & COAP_SOCKET_WANT_WRITE) &&
+        (events & (EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
+      /*
+       * Need to update this to EPOLLIN as EPOLLOUT will normally always
+       * be true causing epoll_wait to return early
+       */
+      coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
+      sock->flags |= COAP_SOCKET_CAN_WRITE;
+      coap_write_session(session->context, session, now);
+    }
+    /* Now dereference session so it can go away if needed */
+    coap_session_release(session);
+  }
 }
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 
 /*
  * While this code in part replicates coap_io_do_io(), doing the functions
@@ -1757,75 +3126,36 @@ coap_io_do_epoll(coap_context_t *ctx, struct epoll_event *events, size_t nevents
             "coap_io_do_epoll() requires libcoap compiled for using epoll\n");
 #else /* COAP_EPOLL_SUPPORT */
   coap_tick_t now;
+  coap_tick_t io_now = ctx->io_now;
   size_t j;
 
-  coap_ticks(&now);
+  /* Everything done here is timed from now */
+  coap_io_ticks(ctx, &now);
+  ctx->io_now = now;
   for(j = 0; j < nevents; j++) {
     coap_socket_t *sock = (coap_socket_t*)events[j].data.ptr;
 
-    /* Ignore 'timer trigger' ptr  which is NULL */
-    if (sock) {
-      if (sock->endpoint) {
-        coap_endpoint_t *endpoint = sock->endpoint;
-        if ((sock->flags & COAP_SOCKET_WANT_READ) &&
-            (events[j].events & EPOLLIN)) {
-          sock->flags |= COAP_SOCKET_CAN_READ;
-          coap_read_endpoint(endpoint->context, endpoint, now);
-        }
-
-        if ((sock->flags & COAP_SOCKET_WANT_WRITE) &&
-            (events[j].events & EPOLLOUT)) {
-          /*
-           * Need to update this to EPOLLIN as EPOLLOUT will normally always
-           * be true causing epoll_wait to return early
-           */
-          coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
-          sock->flags |= COAP_SOCKET_CAN_WRITE;
-          coap_write_endpoint(endpoint->context, endpoint, now);
-        }
-
-        if ((sock->flags & COAP_SOCKET_WANT_ACCEPT) &&
-            (events[j].events & EPOLLIN)) {
-          sock->flags |= COAP_SOCKET_CAN_ACCEPT;
-          coap_accept_endpoint(endpoint->context, endpoint, now);
-        }
-
-      }
-      else if (sock->session) {
-        coap_session_t *session = sock->session;
-
-        /* Make sure the session object is not deleted
-           in one of the callbacks  */
-        coap_session_reference(session);
-        if ((sock->flags & COAP_SOCKET_WANT_CONNECT) &&
-            (events[j].events & (EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
-          sock->flags |= COAP_SOCKET_CAN_CONNECT;
-          coap_connect_session(session->context, session, now);
-          if (!(sock->flags & COAP_SOCKET_WANT_WRITE)) {
-            coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
-          }
-        }
-
-        if ((sock->flags & COAP_SOCKET_WANT_READ) &&
-            (events[j].events & (EPOLLIN|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
-          sock->flags |= COAP_SOCKET_CAN_READ;
-          coap_read_session(session->context, session, now);
-        }
+    if (events[j].data.ptr == &ctx->eppostfd) {
+      /*
+       * Another thread has posted an event. Clear the eventfd, the events
+       * get processed by coap_io_prepare_epoll() below.
+       */
+      uint64_t count;
 
-        if ((sock->flags & COAP_SOCKET_WANT_WRITE) &&
-            (events[j].events & (EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLRDHUP))) {
-          /*
-           * Need to update this to EPOLLIN as EPOLLOUT will normally always
-           * be true causing epoll_wait to return early
-           */
-          coap_epoll_ctl_mod(sock, EPOLLIN, __func__);
-          sock->flags |= COAP_SOCKET_CAN_WRITE;
-          coap_write_session(session->context, session, now);
-        }
-        /* Now dereference session so it can go away if needed */
-        coap_session_release(session);
+      if (read(ctx->eppostfd, &count, sizeof(count)) == -1) {
+        /* do nothing */;
       }
     }
+#ifdef COAP_IO_URING_SUPPORT
+    else if (ctx->io_uring && events[j].data.ptr == ctx->io_uring) {
+      /* Datagrams have been read from endpoints by io_uring */
+      coap_io_uring_process(ctx, now);
+    }
+#endif /* COAP_IO_URING_SUPPORT */
+    /* Ignore 'timer trigger' ptr  which is NULL */
+    else if (sock) {
+      coap_io_do_socket_events(sock, events[j].events, now);
+    }
     else if (ctx->eptimerfd != -1) {
       /*
        * 'timer trigger' must have fired. eptimerfd needs to be read to clear
@@ -1839,13 +3169,90 @@ coap_io_do_epoll(coap_context_t *ctx, struct epoll_event *events, size_t nevents
         /* do nothing */;
       }
     }
-    /* And update eptimerfd as to when to next trigger */
-    coap_ticks(&now);
-    coap_io_prepare_epoll(ctx, now);
   }
+  /* And update eptimerfd as to when to next trigger */
+  coap_io_prepare_epoll(ctx, now);
+  ctx->io_now = io_now;
 #endif /* COAP_EPOLL_SUPPORT */
 }
 
+
+void
+coap_io_do_kqueue(coap_context_t *ctx, struct kevent *events, size_t nevents) {
+#ifndef COAP_KQUEUE_SUPPORT
+  (void)ctx;
+  (void)events;
+  (void)nevents;
+   coap_log(LOG_EMERG,
+            "coap_io_do_kqueue() requires libcoap compiled for using kqueue\n");
+#else /* COAP_KQUEUE_SUPPORT */
+  coap_tick_t now;
+  coap_tick_t io_now = ctx->io_now;
+  size_t j;
+
+  /* Everything done here is timed from now */
+  coap_io_ticks(ctx, &now);
+  ctx->io_now = now;
+  for(j = 0; j < nevents; j++) {
+    coap_socket_t *sock = (coap_socket_t*)events[j].udata;
+
+    if (events[j].filter == EVFILT_TIMER) {
+      /* The one-shot timer is gone, coap_io_prepare_epoll() adds it again */
+      ctx->kq_timer_due = 0;
+    }
+    else if (events[j].filter == EVFILT_USER) {
+      /*
+       * Another thread has posted an event. EV_CLEAR has reset the trigger,
+       * the events get processed by coap_io_prepare_epoll() below.
+       */
+    }
+    else if (sock && !(events[j].flags & EV_ERROR)) {
+      uint32_t sock_events = events[j].filter == EVFILT_READ ? EPOLLIN :
+                             events[j].filter == EVFILT_WRITE ? EPOLLOUT : 0;
+
+      /* A failed connect() is reported as EOF on the write filter */
+      if (events[j].flags & EV_EOF)
+        sock_events |= EPOLLHUP;
+      coap_io_do_socket_events(sock, sock_events, now);
+    }
+  }
+  /* And update the timer as to when to next trigger */
+  coap_io_prepare_epoll(ctx, now);
+  ctx->io_now = io_now;
+#endif /* COAP_KQUEUE_SUPPORT */
+}
+
+void
+coap_io_do_socket(coap_context_t *context, coap_socket_t *sock,
+                  unsigned int events) {
+#ifndef COAP_EVENT_QUEUE_SUPPORT
+  (void)context;
+  (void)sock;
+  (void)events;
+   coap_log(LOG_EMERG,
+            "coap_io_do_socket() requires libcoap compiled for using epoll or kqueue\n");
+#else /* COAP_EVENT_QUEUE_SUPPORT */
+  coap_tick_t now;
+  coap_tick_t io_now = context->io_now;
+  uint32_t sock_events = 0;
+
+  if (events & COAP_IO_EVENT_READ)
+    sock_events |= EPOLLIN;
+  if (events & COAP_IO_EVENT_WRITE)
+    sock_events |= EPOLLOUT;
+  if (events & COAP_IO_EVENT_ERROR)
+    sock_events |= EPOLLERR | EPOLLHUP;
+
+  /* Everything done here is timed from now */
+  coap_io_ticks(context, &now);
+  context->io_now = now;
+  coap_io_do_socket_events(sock, sock_events, now);
+  /* And update the timer as to when to next trigger */
+  coap_io_prepare_epoll(context, now);
+  context->io_now = io_now;
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
+}
+
 int
 coap_handle_dgram(coap_context_t *ctx, coap_session_t *session,
   uint8_t *msg, size_t msg_len) {
@@ -1853,11 +3260,31 @@ coap_handle_dgram(coap_context_t *ctx, coap_session_t *session,
   coap_pdu_t *pdu = NULL;
 
   assert(COAP_PROTO_NOT_RELIABLE(session->proto));
+  /* A worker thread that has decrypted the PDU leaves it to the I/O thread */
+  if (coap_dtls_offload_defer_pdu(session, msg, msg_len))
+    return 0;
   if (msg_len < 4) {
     /* Minimum size of CoAP header - ignore runt */
+    COAP_COUNT(session, dropped, 1);
     return -1;
   }
 
+#ifndef WITH_CONTIKI
+  /*
+   * Parse the PDU in place. msg outlives the PDU, and a copy is only made
+   * if the PDU is updated to something bigger (e.g. a longer token).
+   */
+  pdu = coap_pdu_borrow(session->proto, msg, msg_len,
+                        coap_session_max_pdu_size(session));
+  if (!pdu)
+    goto error;
+
+  if (!coap_pdu_parse_header(pdu, session->proto) ||
+      !coap_pdu_parse_opt(pdu)) {
+    coap_log(LOG_WARNING, "discard malformed PDU\n");
+    goto error;
+  }
+#else /* WITH_CONTIKI */
   /* Need max space incase PDU is updated with updated token etc. */
   pdu = coap_pdu_init(0, 0, 0, coap_session_max_pdu_size(session));
   if (!pdu)
@@ -1867,12 +3294,14 @@ coap_handle_dgram(coap_context_t *ctx, coap_session_t *session,
     coap_log(LOG_WARNING, "discard malformed PDU\n");
     goto error;
   }
+#endif /* WITH_CONTIKI */
 
   coap_dispatch(ctx, session, pdu);
   coap_delete_pdu(pdu);
   return 0;
 
 error:
+  COAP_COUNT(session, dropped, 1);
   /*
    * https://tools.ietf.org/html/rfc7252#section-4.2 MUST send RST
    * https://tools.ietf.org/html/rfc7252#section-4.3 MAY send RST
@@ -1885,37 +3314,20 @@ error:
 
 int
 coap_remove_from_queue(coap_queue_t **queue, coap_session_t *session, coap_mid_t id, coap_queue_t **node) {
-  coap_queue_t *p, *q;
+  coap_queue_t *q;
+  coap_queue_t key;
 
-  if (!queue || !*queue)
+  if (!queue || !*queue || !session)
     return 0;
 
-  /* replace queue head if PDU's time is less than head's time */
-
-  if (session == (*queue)->session && id == (*queue)->id) { /* found message id */
-    *node = *queue;
-    *queue = (*queue)->next;
-    if (*queue) {          /* adjust relative time of new queue head */
-      (*queue)->t += (*node)->t;
-    }
-    (*node)->next = NULL;
-    coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
-             coap_session_str(session), id);
-    return 1;
-  }
-
-  /* search message id queue to remove (only first occurence will be removed) */
-  q = *queue;
-  do {
-    p = q;
-    q = q->next;
-  } while (q && (session != q->session || id != q->id));
+  memset(&key, 0, sizeof(key));
+  key.session = session;
+  key.id = id;
+  HASH_FIND(hh, session->context->sendqueue_index, &key.session,
+            COAP_QUEUE_KEY_LEN, q);
 
-  if (q) {                        /* found message id */
-    p->next = q->next;
-    if (p->next) {                /* must update relative time of p->next */
-      p->next->t += q->t;
-    }
+  if (q && coap_queue_in_heap(*queue, q)) { /* found message id */
+    coap_queue_unlink(queue, q);
     q->next = NULL;
     *node = q;
     coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
@@ -1930,38 +3342,46 @@ coap_remove_from_queue(coap_queue_t **queue, coap_session_t *session, coap_mid_t
 void
 coap_cancel_session_messages(coap_context_t *context, coap_session_t *session,
   coap_nack_reason_t reason) {
-  coap_queue_t *p, *q;
-
-  while (context->sendqueue && context->sendqueue->session == session) {
-    q = context->sendqueue;
-    context->sendqueue = q->next;
+  coap_queue_t *q, *list;
+
+  /* detach the entries first as the nack handler may queue new ones */
+  list = session->sendqueue;
+  session->sendqueue = NULL;
+  while (list) {
+    q = list;
+    list = q->session_next;
+    q->session_prev = q->session_next = NULL;
+    HASH_DELETE(hh, context->sendqueue_index, q);
+    coap_queue_unlink(&context->sendqueue, q);
     coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
              coap_session_str(session), q->id);
-    if (q->pdu->type == COAP_MESSAGE_CON && context->nack_handler)
-      context->nack_handler(context, session, q->pdu, reason, q->id);
+    if (q->pdu->type == COAP_MESSAGE_CON)
+      coap_handle_nack(context, session, q->pdu, reason, q->id);
     coap_delete_node(q);
   }
+}
 
-  if (!context->sendqueue)
-    return;
-
-  p = context->sendqueue;
-  q = p->next;
-
-  while (q) {
-    if (q->session == session) {
-      p->next = q->next;
-      coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
-               coap_session_str(session), q->id);
-      if (q->pdu->type == COAP_MESSAGE_CON && context->nack_handler)
-        context->nack_handler(context, session, q->pdu, reason, q->id);
-      coap_delete_node(q);
-      q = p->next;
-    } else {
-      p = q;
-      q = q->next;
-    }
+void
+coap_handle_nack(coap_context_t *context, coap_session_t *session,
+                 coap_pdu_t *pdu, coap_nack_reason_t reason,
+                 coap_mid_t mid) {
+  coap_oscore_assoc_t *assoc = NULL;
+
+  /* The handlers are given the request as it was before protection */
+  if (session->oscore_assoc) {
+    assoc = coap_oscore_assoc_take(session, pdu);
+    if (assoc)
+      pdu = coap_oscore_assoc_request(assoc);
   }
+  if (session->proxy_origin &&
+      coap_proxy_handle_nack(session, pdu, reason)) {
+    /* Handled by the forward proxy */
+  } else if (coap_request_nack(session, pdu)) {
+    /* Handled by the handler of the request */
+  } else if (context->nack_handler) {
+    context->nack_handler(context, session, pdu, reason, mid);
+  }
+  coap_oscore_assoc_done(session, assoc, reason == COAP_NACK_ICMP_ISSUE);
 }
 
 void
@@ -1969,40 +3389,25 @@ coap_cancel_all_messages(coap_context_t *context, coap_session_t *session,
   const uint8_t *token, size_t token_length) {
   /* cancel all messages in sendqueue that belong to session
    * and use the specified token */
-  coap_queue_t *p, *q;
-
-  while (context->sendqueue && context->sendqueue->session == session &&
-    token_match(token, token_length,
-      context->sendqueue->pdu->token,
-      context->sendqueue->pdu->token_length)) {
-    q = context->sendqueue;
-    context->sendqueue = q->next;
-    coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
-             coap_session_str(session), q->id);
-    coap_delete_node(q);
-  }
-
-  if (!context->sendqueue)
-    return;
-
-  p = context->sendqueue;
-  q = p->next;
+  coap_queue_t *q, *tmp;
+  int con_removed = 0;
 
-  /* when q is not NULL, it does not match (dst, token), so we can skip it */
-  while (q) {
-    if (q->session == session &&
-      token_match(token, token_length,
-        q->pdu->token, q->pdu->token_length)) {
-      p->next = q->next;
+  (void)context;
+  LL_FOREACH_SAFE2(session->sendqueue, q, tmp, session_next) {
+    if (token_match(token, token_length,
+                    q->pdu->token, q->pdu->token_length)) {
       coap_log(LOG_DEBUG, "** %s: mid=0x%x: removed\n",
                coap_session_str(session), q->id);
+      if (q->pdu->type == COAP_MESSAGE_CON && session->con_active) {
+        session->con_active--;
+        con_removed = 1;
+      }
       coap_delete_node(q);
-      q = p->next;
-    } else {
-      p = q;
-      q = q->next;
     }
   }
+  if (con_removed && session->state == COAP_SESSION_STATE_ESTABLISHED)
+    /* Flush out any entries on session->delayqueue */
+    coap_session_connected(session);
 }
 
 coap_pdu_t *
@@ -2388,6 +3793,8 @@ no_response(coap_pdu_t *request, coap_pdu_t *response,
           /* Remove token/data from piggybacked acknowledgment PDU */
           response->token_length = 0;
           response->used_size = 0;
+          response->xmit_data = NULL;
+          response->xmit_length = 0;
           return RESPONSE_SEND;
         }
         else {
@@ -2447,7 +3854,19 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
   int is_proxy_scheme = 0;
   int skip_hop_limit_check = 0;
   int resp;
+  /* The short-lived allocations of the request, released at the end */
+  coap_arena_t arena;
+  coap_arena_t *outer_arena = context->request_arena;
+  uint8_t arena_buf[COAP_REQUEST_ARENA_SIZE];
+
+  /* Turned away early on, at the least cost, under overload */
+  if (coap_overload_check(context)) {
+    coap_overload_reject(session, pdu);
+    return;
+  }
 
+  coap_arena_init(&arena, arena_buf, sizeof(arena_buf));
+  context->request_arena = &arena;
   coap_option_filter_clear(&opt_filter);
   opt = coap_check_option(pdu, COAP_OPTION_PROXY_SCHEME, &opt_iter);
   if (opt)
@@ -2458,6 +3877,13 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     is_proxy_uri = 1;
 
   if (is_proxy_scheme || is_proxy_uri) {
+#ifdef COAP_WITHOUT_PROXY
+    /* Need to return a 5.05 RFC7252 Section 5.7.2 */
+    coap_log(LOG_DEBUG, "Proxy-%s support not built in\n",
+             is_proxy_scheme ? "Scheme" : "Uri");
+    resp = 505;
+    goto fail_response;
+#else /* ! COAP_WITHOUT_PROXY */
     coap_uri_t uri;
 
     if (!context->proxy_uri_resource) {
@@ -2467,8 +3893,7 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       resp = 505;
       goto fail_response;
     }
-    if (((size_t)pdu->code - 1 <
-                (sizeof(resource->handler) / sizeof(resource->handler[0]))) &&
+    if (((size_t)pdu->code - 1 < COAP_RESOURCE_METHODS) &&
         !(context->proxy_uri_resource->handler[pdu->code - 1])) {
       /* Need to return a 5.05 RFC7252 Section 5.7.2 */
       coap_log(LOG_DEBUG, "Proxy-%s code %d.%02d handler not supported\n",
@@ -2512,6 +3937,19 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       }
     }
     resource = NULL;
+#endif /* ! COAP_WITHOUT_PROXY */
+  }
+
+  if (!is_proxy_uri && !is_proxy_scheme &&
+      coap_check_option(pdu, COAP_OPTION_OSCORE, &opt_iter)) {
+    /* Protected end to end for this server rather than a proxy */
+    resp = coap_oscore_unprotect_request(session, pdu);
+    if (resp)
+      goto fail_response;
+    if (coap_option_check_critical(context, pdu, opt_filter) == 0) {
+      resp = 402;
+      goto fail_response;
+    }
   }
 
   if (!skip_hop_limit_check) {
@@ -2540,14 +3978,12 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     }
   }
 
-  coap_string_t *uri_path = coap_get_uri_path(pdu);
-  if (!uri_path)
-    return;
+  /* Only built when needed, the resources are matched on the options */
+  coap_string_t *uri_path = NULL;
 
   if (!is_proxy_uri && !is_proxy_scheme) {
     /* try to find the resource from the request URI */
-    coap_str_const_t uri_path_c = { uri_path->length, uri_path->s };
-    resource = coap_get_resource_from_uri_path(context, &uri_path_c);
+    resource = coap_get_resource_from_request(context, pdu);
   }
 
   if ((resource == NULL) || (resource->is_unknown == 1) ||
@@ -2571,7 +4007,7 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
      *
      * else return 4.04 */
 
-    if (coap_string_equal(uri_path, &coap_default_uri_wellknown)) {
+    if (coap_uri_path_equal(pdu, &coap_default_uri_wellknown)) {
       /* request for .well-known/core */
       if (pdu->code == COAP_REQUEST_GET) { /* GET */
         coap_log(LOG_INFO, "create default response for %s\n",
@@ -2585,8 +4021,7 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
     } else if (is_proxy_uri || is_proxy_scheme) {
       resource = context->proxy_uri_resource;
     } else if ((context->unknown_resource != NULL) &&
-               ((size_t)pdu->code - 1 <
-                (sizeof(resource->handler) / sizeof(coap_method_handler_t))) &&
+               ((size_t)pdu->code - 1 < COAP_RESOURCE_METHODS) &&
                (context->unknown_resource->handler[pdu->code - 1])) {
       /*
        * The unknown_resource can be used to handle undefined resources
@@ -2608,18 +4043,28 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       /*
        * Request for DELETE on non-existant resource (RFC7252: 5.8.4.  DELETE)
        */
-      coap_log(LOG_DEBUG, "request for unknown resource '%*.*s',"
-                          " return 2.02\n",
-                          (int)uri_path->length,
-                          (int)uri_path->length,
-                          uri_path->s);
+      if (coap_log_enabled(LOG_DEBUG)) {
+        uri_path = coap_get_uri_path_arena(pdu, &arena);
+        if (uri_path)
+          coap_log(LOG_DEBUG, "request for unknown resource '%*.*s',"
+                              " return 2.02\n",
+                              (int)uri_path->length,
+                              (int)uri_path->length,
+                              uri_path->s);
+      }
       response =
         coap_new_error_response(pdu, COAP_RESPONSE_CODE(202),
           &opt_filter);
     } else { /* request for any another resource, return 4.04 */
 
-      coap_log(LOG_DEBUG, "request for unknown resource '%*.*s', return 4.04\n",
-               (int)uri_path->length, (int)uri_path->length, uri_path->s);
+      if (coap_log_enabled(LOG_DEBUG)) {
+        uri_path = coap_get_uri_path_arena(pdu, &arena);
+        if (uri_path)
+          coap_log(LOG_DEBUG,
+                   "request for unknown resource '%*.*s', return 4.04\n",
+                   (int)uri_path->length, (int)uri_path->length,
+                   uri_path->s);
+      }
       response =
         coap_new_error_response(pdu, COAP_RESPONSE_CODE(404),
           &opt_filter);
@@ -2631,13 +4076,12 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
         if (coap_send(session, response) == COAP_INVALID_MID)
           coap_log(LOG_WARNING, "cannot send response for mid=0x%x\n", mid);
       } else {
+        coap_oscore_response_dropped(session, response);
         coap_delete_pdu(response);
       }
 
       response = NULL;
-
-      coap_delete_string(uri_path);
-      return;
+      goto finish;
     } else {
       if (response) {
         /* Need to delete unused response - it will get re-created further on */
@@ -2647,8 +4091,7 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
   }
 
   /* the resource was found, check if there is a registered handler */
-  if ((size_t)pdu->code - 1 <
-    sizeof(resource->handler) / sizeof(coap_method_handler_t))
+  if ((size_t)pdu->code - 1 < COAP_RESOURCE_METHODS)
     h = resource->handler[pdu->code - 1];
 
   if (h) {
@@ -2666,8 +4109,7 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       coap_binary_t token = { pdu->token_length, pdu->token };
       coap_opt_t *observe = NULL;
       int observe_action = COAP_OBSERVE_CANCEL;
-      coap_string_t *query = coap_get_query(pdu);
-      int owns_query = 1;
+      coap_string_t *query = coap_get_query_arena(pdu, &arena);
       coap_block_t block;
       int added_block = 0;
 
@@ -2683,20 +4125,29 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
           if (observe_action == COAP_OBSERVE_ESTABLISH) {
             coap_subscription_t *subscription;
             int has_block2 = 0;
+            coap_string_t *obs_query = NULL;
 
             if (coap_get_block(pdu, COAP_OPTION_BLOCK2, &block)) {
               has_block2 = 1;
             }
-            subscription = coap_add_observer(resource, session, &token,
-                                             query, has_block2,
-                                             block, pdu->code);
+            /* The subscription outlives the request, so gets a copy */
+            if (query) {
+              obs_query = coap_new_string(query->length);
+              if (obs_query)
+                memcpy(obs_query->s, query->s, query->length);
+            }
+            if (query && !obs_query)
+              subscription = NULL;
+            else
+              subscription = coap_add_observer(resource, session, &token,
+                                               obs_query, has_block2,
+                                               block, pdu->code);
             if (subscription) {
-              /* Ownership of query is taken by subscription if not
-               * NULL. In this case, we must not delete query here
-               * hence owns_query is cleared. */
-              owns_query = 0;
               coap_touch_observer(context, session, &token);
             }
+            else {
+              coap_delete_string(obs_query);
+            }
           }
           else if (observe_action == COAP_OBSERVE_CANCEL) {
             coap_delete_observer(resource, session, &token);
@@ -2707,7 +4158,30 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
         }
       }
 
+      if (coap_resource_check_etag(resource, pdu, response) ||
+          coap_resource_fill_representation(resource, pdu, response))
+        goto skip_handler;
+
+      if (pdu->code == COAP_REQUEST_GET || pdu->code == COAP_REQUEST_FETCH) {
+        if (coap_cache_fill_response(session, resource, pdu, response))
+          goto skip_handler;
+      } else {
+        /* The resource may be about to change */
+        coap_cache_invalidate_resource(resource);
+        resource->etag = 0;
+        /* and so may any BLOCK2 body still being sent of it */
+        resource->generation++;
+      }
+
       if (session->block_mode & COAP_BLOCK_USE_LIBCOAP) {
+        /* Bodies for the unknown, proxy and route resources are tracked on
+           path */
+        if ((resource == context->unknown_resource ||
+             resource == context->proxy_uri_resource ||
+             resource->is_route) &&
+            (coap_check_option(pdu, COAP_OPTION_BLOCK1, &opt_iter) ||
+             coap_check_option(pdu, COAP_OPTION_Q_BLOCK1, &opt_iter)))
+          uri_path = coap_get_uri_path_arena(pdu, &arena);
         if (coap_handle_request_put_block(context, session, pdu, response,
                                           resource, uri_path, observe, &token,
                                           query, h, &added_block)) {
@@ -2723,10 +4197,22 @@ handle_request(coap_context_t *context, coap_session_t *session, coap_pdu_t *pdu
       /*
        * Call the request handler with everything set up
        */
-      h(context, resource, session, pdu, &token, query, response);
+      if (context->histograms || context->overload.handler_budget_ms) {
+        uint64_t start = coap_histogram_clock();
+
+        h(context, resource, session, pdu, &token, query, response);
+        if (context->histograms)
+          coap_histogram_record_since(&resource->handler_histogram, start);
+        if (context->overload.handler_budget_ms)
+          context->handler_us += coap_histogram_clock() - start;
+      } else {
+        h(context, resource, session, pdu, &token, query, response);
+      }
 
       /* Check if lg_xmit generated and update PDU code if so */
-      coap_check_code_lg_xmit(session, response, resource, query);
+      coap_check_code_lg_xmit(session, response, resource, pdu, query);
+      coap_resource_add_etag(resource, response);
+      coap_cache_store_response(session, resource, pdu, response);
 
 skip_handler:
       respond = no_response(pdu, response, session);
@@ -2750,21 +4236,30 @@ skip_handler:
           response->used_size = 0;
         }
 
+#ifndef WITHOUT_ASYNC
+        if (response->type == COAP_MESSAGE_ACK && response->code == 0 &&
+            coap_async_ack_held(session, pdu)) {
+          /* Sent later, unless the response is piggybacked on it */
+          coap_delete_pdu(response);
+        } else
+#endif /* WITHOUT_ASYNC */
         if (coap_send(session, response) == COAP_INVALID_MID) {
           coap_log(LOG_DEBUG, "cannot send response for mid=0x%x\n", mid);
         }
       } else {
+        coap_oscore_response_dropped(session, response);
         coap_delete_pdu(response);
       }
-      if (query && owns_query)
-        coap_delete_string(query);
+      if (session->lg_xmit && (session->block_mode & COAP_BLOCK_TRY_Q_BLOCK))
+        /* The rest of any Q-Block2 sets follow the response */
+        coap_block_send_q_block2_sets(session);
     } else {
       coap_log(LOG_WARNING, "cannot generate response\r\n");
       coap_delete_pdu(response);
     }
     response = NULL;
   } else {
-    if (coap_string_equal(uri_path, &coap_default_uri_wellknown)) {
+    if (coap_uri_path_equal(pdu, &coap_default_uri_wellknown)) {
       /* request for .well-known/core */
       coap_log(LOG_DEBUG, "create default response for %s\n",
                COAP_DEFAULT_URI_WELLKNOWN);
@@ -2779,29 +4274,37 @@ skip_handler:
       if (coap_send(session, response) == COAP_INVALID_MID)
         coap_log(LOG_DEBUG, "cannot send response for mid=0x%x\n", mid);
     } else {
+      coap_oscore_response_dropped(session, response);
       coap_delete_pdu(response);
     }
     response = NULL;
   }
 
   assert(response == NULL);
-  coap_delete_string(uri_path);
-  return;
+  goto finish;
 
 fail_response:
   response =
      coap_new_error_response(pdu, COAP_RESPONSE_CODE(resp),
        &opt_filter);
-  if (response) {
+  if (response && no_response(pdu, response, session) != RESPONSE_DROP) {
     coap_mid_t mid = pdu->mid;
     if (coap_send(session, response) == COAP_INVALID_MID)
       coap_log(LOG_WARNING, "cannot send response for mid=0x%x\n", mid);
+  } else {
+    coap_oscore_response_dropped(session, response);
+    coap_delete_pdu(response);
   }
+
+finish:
+  context->request_arena = outer_arena;
+  coap_arena_release(&arena);
 }
 
 static void
 handle_response(coap_context_t *context, coap_session_t *session,
   coap_pdu_t *sent, coap_pdu_t *rcvd) {
+  coap_response_t result = COAP_RESPONSE_OK;
 
   /* In a lossy context, the ACK of a separate response may have
    * been lost, so we need to stop retransmitting requests with the
@@ -2826,17 +4329,22 @@ handle_response(coap_context_t *context, coap_session_t *session,
     }
   }
 
-  /* Call application-specific response handler when available. */
-  if (context->response_handler) {
-    if (context->response_handler(context, session, sent, rcvd,
-                                  rcvd->mid) == COAP_RESPONSE_FAIL)
-      coap_send_rst(session, rcvd);
-    else
-      coap_send_ack(session, rcvd);
-  }
-  else {
+  /* Responses for requests passed on by the forward proxy */
+  if (session->proxy_origin && coap_proxy_handle_response(session, rcvd)) {
     coap_send_ack(session, rcvd);
+    return;
   }
+
+  /* Call the handler of the request, else the application-specific
+   * response handler when available. */
+  if (!coap_request_response(session, rcvd, &result) &&
+      context->response_handler)
+    result = context->response_handler(context, session, sent, rcvd,
+                                       rcvd->mid);
+  if (result == COAP_RESPONSE_FAIL)
+    coap_send_rst(session, rcvd);
+  else
+    coap_send_ack(session, rcvd);
 }
 
 #if !COAP_DISABLE_TCP
@@ -2855,7 +4363,7 @@ handle_signaling(coap_context_t *context, coap_session_t *session,
         coap_session_set_mtu(session, coap_decode_var_bytes(coap_opt_value(option),
           coap_opt_length(option)));
       } else if (opt_iter.type == COAP_SIGNALING_OPTION_BLOCK_WISE_TRANSFER) {
-        session->csm_block_supported = 1;
+        session->ext->csm_block_supported = 1;
       }
     }
     if (session->state == COAP_SESSION_STATE_CSM)
@@ -2870,7 +4378,7 @@ handle_signaling(coap_context_t *context, coap_session_t *session,
       coap_send(session, pong);
     }
   } else if (pdu->code == COAP_SIGNALING_PONG) {
-    session->last_pong = session->last_rx_tx;
+    session->ext->last_pong = session->last_rx_tx;
     if (context->pong_handler) {
       context->pong_handler(context, session, pdu, pdu->mid);
     }
@@ -2887,9 +4395,14 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
   coap_queue_t *sent = NULL;
   coap_pdu_t *response;
   coap_opt_filter_t opt_filter;
+  coap_opt_iterator_t opt_iter;
   int is_ping_rst;
 
-  if (LOG_DEBUG <= coap_get_log_level()) {
+  coap_trace_pdu(session, pdu, 0);
+  COAP_PROBE_PDU(receive, session, pdu);
+  COAP_COUNT(session, rx_pdus, 1);
+  COAP_COUNT(session, rx_bytes, COAP_PDU_WIRE_SIZE(pdu));
+  if (coap_log_enabled(LOG_DEBUG)) {
     /* FIXME: get debug to work again **
     unsigned char addr[INET6_ADDRSTRLEN+8], localaddr[INET6_ADDRSTRLEN+8];
     if (coap_print_addr(remote, addr, INET6_ADDRSTRLEN+8) &&
@@ -2908,6 +4421,17 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       /* find message id in sendqueue to stop retransmission */
       coap_remove_from_queue(&context->sendqueue, session, pdu->mid, &sent);
 
+      if (!sent && COAP_PROTO_NOT_RELIABLE(session->proto))
+        /* Already acknowledged */
+        COAP_COUNT(session, duplicates, 1);
+      if (sent && sent->sent_us) {
+        if (context->histograms && sent->retransmit_cnt == 0)
+          /* The round trip is only known if there was a single transmission */
+          coap_histogram_record_since(&session->rtt_histogram, sent->sent_us);
+        if (session->cocoa)
+          coap_session_rtt_sample(session, sent->sent_us,
+                                  sent->retransmit_cnt);
+      }
       if (sent && session->con_active) {
         session->con_active--;
         if (session->state == COAP_SESSION_STATE_ESTABLISHED)
@@ -2927,6 +4451,28 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       }
 
       if (pdu->code == 0 && sent) {
+        coap_lg_crcv_t *lg_crcv;
+
+        /*
+         * coap_send_large() does not set up an lg_crcv for a CON request
+         * as it can be built from the sent PDU if a piggy-backed response
+         * has a Block2.  A separate response is not matched to a sent PDU,
+         * so set up the lg_crcv now to follow any Block2 in it.
+         */
+        if ((session->block_mode & COAP_BLOCK_USE_LIBCOAP) &&
+            COAP_PDU_IS_REQUEST(sent->pdu) &&
+            sent->pdu->code != COAP_REQUEST_DELETE &&
+            COAP_PROTO_NOT_RELIABLE(session->proto) &&
+            !coap_check_option(sent->pdu, COAP_OPTION_BLOCK1, &opt_iter) &&
+            !coap_check_option(sent->pdu, COAP_OPTION_Q_BLOCK1, &opt_iter)) {
+          HASH_FIND(hh, session->lg_crcv_token, sent->pdu->token,
+                    sent->pdu->token_length, lg_crcv);
+          if (!lg_crcv) {
+            lg_crcv = coap_block_new_lg_crcv(session, sent->pdu);
+            if (lg_crcv)
+              coap_block_add_lg_crcv(session, lg_crcv);
+          }
+        }
         /* an empty ACK needs no further handling */
         goto cleanup;
       }
@@ -2938,51 +4484,51 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
        * not only the message id but also the subscriptions we might
        * have. */
 
+      COAP_COUNT(session, rx_rsts, 1);
       is_ping_rst = 0;
-      if (pdu->mid == session->last_ping_mid &&
-          context->ping_timeout && session->last_ping > 0)
+      if (session->ext && pdu->mid == session->ext->last_ping_mid &&
+          context->ping_timeout && session->ext->last_ping > 0)
         is_ping_rst = 1;
 
       if (!is_ping_rst)
         coap_log(LOG_ALERT, "got RST for mid=0x%x\n", pdu->mid);
 
-      if (session->con_active) {
+      /* find message id in sendqueue to stop retransmission */
+      coap_remove_from_queue(&context->sendqueue, session, pdu->mid, &sent);
+
+      /* Only a CON that is waiting frees up a place in the NSTART window */
+      if (sent && sent->pdu->type == COAP_MESSAGE_CON && session->con_active) {
         session->con_active--;
         if (session->state == COAP_SESSION_STATE_ESTABLISHED)
           /* Flush out any entries on session->delayqueue */
           coap_session_connected(session);
       }
 
-      /* find message id in sendqueue to stop retransmission */
-      coap_remove_from_queue(&context->sendqueue, session, pdu->mid, &sent);
-
       if (sent) {
         coap_cancel(context, sent);
 
         if (!is_ping_rst) {
-          if(sent->pdu->type==COAP_MESSAGE_CON && context->nack_handler)
-            context->nack_handler(context, sent->session, sent->pdu,
-                                  COAP_NACK_RST, sent->id);
+          if(sent->pdu->type==COAP_MESSAGE_CON)
+            coap_handle_nack(context, sent->session, sent->pdu,
+                             COAP_NACK_RST, sent->id);
         }
         else {
           if (context->pong_handler) {
             context->pong_handler(context, session, pdu, pdu->mid);
           }
-          session->last_pong = session->last_rx_tx;
-          session->last_ping_mid = COAP_INVALID_MID;
+          session->ext->last_pong = session->last_rx_tx;
+          session->ext->last_ping_mid = COAP_INVALID_MID;
         }
       }
       else {
         /* Need to check is there is a subscription active and delete it */
-        RESOURCES_ITER(context->resources, r) {
-          coap_subscription_t *obs, *tmp;
-          LL_FOREACH_SAFE(r->subscribers, obs, tmp) {
-            if (obs->mid == pdu->mid && obs->session == session) {
-              coap_binary_t token = { 0, NULL };
-              COAP_SET_STR(&token, obs->token_length, obs->token);
-              coap_delete_observer(r, session, &token);
-              goto cleanup;
-            }
+        coap_subscription_t *obs;
+        DL_FOREACH2(session->subscriptions, obs, session_next) {
+          if (obs->mid == pdu->mid) {
+            coap_binary_t token = { 0, NULL };
+            COAP_SET_STR(&token, obs->token_length, obs->token);
+            coap_delete_observer(obs->resource, session, &token);
+            goto cleanup;
           }
         }
       }
@@ -2998,7 +4544,26 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       }
       break;
 
-    case COAP_MESSAGE_CON:        /* check for unknown critical options */
+    case COAP_MESSAGE_CON:
+#ifndef WITHOUT_ASYNC
+      if (COAP_PDU_IS_REQUEST(pdu) && coap_async_check_duplicate(session, pdu)) {
+        /* Still being handled, so the client only needs the ACK again */
+        COAP_COUNT(session, duplicates, 1);
+        goto cleanup;
+      }
+#endif /* WITHOUT_ASYNC */
+      if (COAP_PDU_IS_REQUEST(pdu) && context->dedup_max) {
+        const coap_pdu_t *response_sent;
+
+        if (coap_dedup_check(session, pdu, &response_sent)) {
+          /* Our ACK was lost, so answer again without handling it again */
+          COAP_COUNT(session, duplicates, 1);
+          if (response_sent)
+            coap_resend_response(session, response_sent);
+          goto cleanup;
+        }
+      }
+      /* check for unknown critical options */
       if (coap_option_check_critical(context, pdu, opt_filter) == 0) {
 
         if (COAP_PDU_IS_REQUEST(pdu)) {
@@ -3008,6 +4573,8 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
           if (!response) {
             coap_log(LOG_WARNING,
                      "coap_dispatch: cannot create error response\n");
+          } else if (no_response(pdu, response, session) == RESPONSE_DROP) {
+            coap_delete_pdu(response);
           } else {
             if (coap_send(session, response) == COAP_INVALID_MID)
               coap_log(LOG_WARNING, "coap_dispatch: error sending response\n");
@@ -3029,11 +4596,29 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
     handle_signaling(context, session, pdu);
   else
 #endif /* !COAP_DISABLE_TCP */
-  if (COAP_PDU_IS_REQUEST(pdu))
+  if (COAP_PDU_IS_REQUEST(pdu)) {
+    COAP_PROBE_PDU(request_start, session, pdu);
     handle_request(context, session, pdu);
-  else if (COAP_PDU_IS_RESPONSE(pdu))
-    handle_response(context, session, sent ? sent->pdu : NULL, pdu);
-  else {
+    COAP_PROBE_PDU(request_done, session, pdu);
+  }
+  else if (COAP_PDU_IS_RESPONSE(pdu)) {
+    coap_pdu_t *sent_pdu = sent ? sent->pdu : NULL;
+    coap_oscore_assoc_t *assoc = NULL;
+    int keep = 0;
+
+    if (session->oscore || session->oscore_assoc) {
+      /* The handler is given the plain request and response */
+      if (!coap_oscore_unprotect_response(session, pdu, &sent_pdu, &assoc)) {
+        if (pdu->type == COAP_MESSAGE_CON)
+          coap_send_rst(session, pdu);
+        goto cleanup;
+      }
+      keep = COAP_RESPONSE_CLASS(pdu->code) == 2 &&
+             coap_check_option(pdu, COAP_OPTION_OBSERVE, &opt_iter) != NULL;
+    }
+    handle_response(context, session, sent_pdu, pdu);
+    coap_oscore_assoc_done(session, assoc, keep);
+  } else {
     if (COAP_PDU_IS_EMPTY(pdu)) {
       if (context->ping_handler) {
         context->ping_handler(context, session,
@@ -3048,7 +4633,7 @@ coap_dispatch(coap_context_t *context, coap_session_t *session,
       if (COAP_PDU_IS_EMPTY(pdu)) {
         if (session->proto != COAP_PROTO_TCP && session->proto != COAP_PROTO_TLS) {
           coap_tick_t now;
-          coap_ticks(&now);
+          coap_io_ticks(context, &now);
           if (session->last_tx_rst + COAP_TICKS_PER_SECOND/4 < now) {
             coap_send_message_type(session, pdu, COAP_MESSAGE_RST);
             session->last_tx_rst = now;
@@ -3067,7 +4652,19 @@ cleanup:
 
 int
 coap_handle_event(coap_context_t *context, coap_event_t event, coap_session_t *session) {
+  if (session && coap_dtls_offload_defer(session, COAP_DTLS_JOB_EVENT, event))
+    return 0;
   coap_log(LOG_DEBUG, "***EVENT: 0x%04x\n", event);
+  if (session && (event == COAP_EVENT_DTLS_CONNECTED ||
+                  event == COAP_EVENT_DTLS_ERROR))
+    COAP_PROBE_SESSION(dtls_handshake_done, session,
+                       event == COAP_EVENT_DTLS_CONNECTED);
+  if (event == COAP_EVENT_DTLS_ERROR) {
+    if (session)
+      COAP_COUNT(session, dtls_failures, 1);
+    else
+      context->counters.dtls_failures++;
+  }
 
   if (context->handle_event) {
     return context->handle_event(context, event, session);
@@ -3080,12 +4677,13 @@ int
 coap_can_exit(coap_context_t *context) {
   coap_endpoint_t *ep;
   coap_session_t *s, *rtmp;
+  unsigned int pos;
   if (!context)
     return 1;
   if (context->sendqueue)
     return 0;
   LL_FOREACH(context->endpoint, ep) {
-    SESSIONS_ITER(ep->sessions, s, rtmp) {
+    SESSIONS_INDEX_ITER(&ep->sessions, s, pos) {
       if (s->delayqueue)
         return 0;
       if (s->lg_xmit)
@@ -3119,6 +4717,7 @@ void coap_startup(void) {
   us = coap_ticks_to_rt_us(now);
   /* Be accurate to the nearest (approx) us */
   coap_prng_init((unsigned int)us);
+  coap_uthash_init();
   coap_memory_init();
   coap_dtls_startup();
 }
@@ -3128,6 +4727,7 @@ void coap_cleanup(void) {
   WSACleanup();
 #endif
   coap_dtls_shutdown();
+  coap_set_log_async(0);
 }
 
 #if ! defined WITH_CONTIKI && ! defined WITH_LWIP && ! defined RIOT_VERSION
@@ -3399,19 +4999,11 @@ static void coap_retransmittimer_execute(void *arg) {
   elapsed = now - ctx->sendqueue_basetime; /* that's positive for sure, and unless we haven't been called for a complete wrapping cycle, did not wrap */
 
   nextinqueue = coap_peek_next(ctx);
-  while (nextinqueue != NULL) {
-    if (nextinqueue->t > elapsed) {
-      nextinqueue->t -= elapsed;
-      break;
-    } else {
-      elapsed -= nextinqueue->t;
-      coap_retransmit(ctx, coap_pop_next(ctx));
-      nextinqueue = coap_peek_next(ctx);
-    }
+  while (nextinqueue != NULL && nextinqueue->t <= elapsed) {
+    coap_retransmit(ctx, coap_pop_next(ctx));
+    nextinqueue = coap_peek_next(ctx);
   }
 
-  ctx->sendqueue_basetime = now;
-
   coap_retransmittimer_restart(ctx);
 }
 
@@ -123,6 +123,13 @@ coap_option_iterator_init(const coap_pdu_t *pdu, coap_opt_iterator_t *oi,
 
   oi->length = pdu->used_size - pdu->token_length;
 
+  if (pdu->opt_indexed) {
+    /* Step through the options recorded by coap_pdu_parse() instead */
+    oi->index = pdu->opt_index;
+    oi->index_count = pdu->opt_count;
+    oi->options = oi->next_option;
+  }
+
   if (filter) {
     memcpy(&oi->filter, filter, sizeof(coap_opt_filter_t));
     oi->filtered = 1;
@@ -154,6 +161,28 @@ coap_option_next(coap_opt_iterator_t *oi) {
   if (opt_finished(oi))
     return NULL;
 
+  if (oi->index) {
+    while (oi->next_index < oi->index_count) {
+      const coap_pdu_opt_index_t *entry = &oi->index[oi->next_index++];
+
+      if (oi->filtered &&
+          (b = coap_option_filter_get(&oi->filter, entry->number)) <= 0) {
+        if (b < 0) {                 /* filter too small, cannot proceed */
+          oi->bad = 1;
+          return NULL;
+        }
+        continue;
+      }
+      current_opt = oi->options + entry->offset;
+      oi->length -= current_opt + entry->size - oi->next_option;
+      oi->next_option = current_opt + entry->size;
+      oi->type = entry->number;
+      return current_opt;
+    }
+    oi->bad = 1;
+    return NULL;
+  }
+
   while (1) {
     /* oi->option always points to the next option to deliver; as
      * opt_finished() filters out any bad conditions, we can assume that
@@ -200,7 +229,20 @@ coap_check_option(coap_pdu_t *pdu, uint16_t type,
   coap_option_filter_clear(&f);
   coap_option_filter_set(&f, type);
 
-  coap_option_iterator_init(pdu, oi, &f);
+  if (!coap_option_iterator_init(pdu, oi, &f))
+    return NULL;
+
+  if (oi->index) {
+    /* The index is in option number order, so go straight to the entry */
+    while (oi->next_index < oi->index_count &&
+           oi->index[oi->next_index].number < type)
+      oi->next_index++;
+    if (oi->next_index == oi->index_count ||
+        oi->index[oi->next_index].number != type) {
+      oi->bad = 1;
+      return NULL;
+    }
+  }
 
   return coap_option_next(oi);
 }
@@ -401,7 +443,7 @@ COAP_STATIC_INLINE int
 is_long_option(uint16_t type) { return type > 255; }
 
 /** Operation specifiers for coap_filter_op(). */
-enum filter_op_t { FILTER_SET, FILTER_CLEAR, FILTER_GET };
+enum filter_op_t { FILTER_SET, FILTER_CLEAR };
 
 /**
  * Applies @p op on @p filter with respect to @p type. The following
@@ -412,15 +454,12 @@ enum filter_op_t { FILTER_SET, FILTER_CLEAR, FILTER_GET };
  *
  * FILTER_CLEAR: Remove @p type from filter if it exists.
  *
- * FILTER_GET: Search for @p type in @p filter. Returns @c 1 if found,
- * or @c 0 if not found.
- *
  * @param filter The filter object.
- * @param type   The option type to set, get or clear in @p filter.
+ * @param type   The option type to set or clear in @p filter.
  * @param op     The operation to apply to @p filter and @p type.
  *
- * @return 1 on success, and 0 when FILTER_GET yields no
- * hit or no free slot is available to store @p type with FILTER_SET.
+ * @return 1 on success, and 0 when no free slot is available to store
+ * @p type with FILTER_SET.
  */
 static int
 coap_option_filter_op(coap_opt_filter_t *filter,
@@ -459,8 +498,8 @@ coap_option_filter_op(coap_opt_filter_t *filter,
     }
   }
 
-  /* type was not found, so there is nothing to do if op is CLEAR or GET */
-  if ((op == FILTER_CLEAR) || (op == FILTER_GET)) {
+  /* type was not found, so there is nothing to do if op is CLEAR */
+  if (op == FILTER_CLEAR) {
     return 0;
   }
 
@@ -493,10 +532,25 @@ coap_option_filter_unset(coap_opt_filter_t *filter, uint16_t type) {
 }
 
 int
-coap_option_filter_get(coap_opt_filter_t *filter, uint16_t type) {
-  /* Ugly cast to make the const go away (FILTER_GET wont change filter
-   * but as _set and _unset do, the function does not take a const). */
-  return coap_option_filter_op(filter, type, FILTER_GET);
+coap_option_filter_get(const coap_opt_filter_t *filter, uint16_t type) {
+  size_t lindex;
+  uint16_t nr;
+
+  if (is_long_option(type)) {
+    for (nr = 1, lindex = 0; lindex < COAP_OPT_FILTER_LONG;
+         nr <<= 1, lindex++) {
+      if (((filter->mask & nr) > 0) && (filter->long_opts[lindex] == type))
+        return 1;
+    }
+  } else {
+    for (nr = 1 << COAP_OPT_FILTER_LONG, lindex = 0;
+         lindex < COAP_OPT_FILTER_SHORT; nr <<= 1, lindex++) {
+      if (((filter->mask & nr) > 0) &&
+          (filter->short_opts[lindex] == (type & 0xff)))
+        return 1;
+    }
+  }
+  return 0;
 }
 
 coap_optlist_t *
@@ -540,16 +594,36 @@ order_opts(void *a, void *b) {
   return (int)(o1->number - o2->number);
 }
 
+static int coap_opt_stage_apply(coap_pdu_t *pdu,
+                                const coap_opt_stage_entry_t **opts,
+                                size_t count);
+
 int
 coap_add_optlist_pdu(coap_pdu_t *pdu, coap_optlist_t** options) {
   coap_optlist_t *opt;
+  coap_opt_stage_entry_t entries[COAP_OPT_STAGE_SIZE];
+  const coap_opt_stage_entry_t *opts[COAP_OPT_STAGE_SIZE + 1];
+  size_t count = 0;
 
   if (options && *options) {
     /* sort options for delta encoding */
     LL_SORT((*options), order_opts);
 
+    /*
+     * The options are merged into the PDU a stage full at a time, each in a
+     * single pass.  Being sorted, they still end up in the order given.
+     */
     LL_FOREACH((*options), opt) {
-      coap_add_option(pdu, opt->number, opt->length, opt->data);
+      entries[count].number = opt->number;
+      entries[count].mode = COAP_OPT_STAGE_ADD;
+      entries[count].length = opt->length;
+      entries[count].data = opt->data;
+      opts[count] = &entries[count];
+      if (++count == COAP_OPT_STAGE_SIZE || !opt->next) {
+        if (!coap_opt_stage_apply(pdu, opts, count))
+          return 0;
+        count = 0;
+      }
     }
     return 1;
   }
@@ -589,3 +663,349 @@ coap_delete_optlist(coap_optlist_t *queue) {
   }
 }
 
+
+void
+coap_opt_stage_init(coap_opt_stage_t *stage) {
+  stage->count = 0;
+}
+
+static int
+coap_opt_stage_set(coap_opt_stage_t *stage, uint8_t mode, uint16_t number,
+                   size_t length, const uint8_t *data) {
+  coap_opt_stage_entry_t *entry;
+
+  if (mode != COAP_OPT_STAGE_ADD) {
+    /* Drop what has been staged for this option number so far */
+    size_t i, j = 0;
+
+    for (i = 0; i < stage->count; i++) {
+      if (stage->opt[i].number != number)
+        stage->opt[j++] = stage->opt[i];
+    }
+    stage->count = j;
+  }
+  if (stage->count == COAP_OPT_STAGE_SIZE) {
+    coap_log(LOG_WARNING, "coap_opt_stage: too many options staged\n");
+    return 0;
+  }
+  entry = &stage->opt[stage->count++];
+  entry->number = number;
+  entry->mode = mode;
+  entry->length = length;
+  if (length <= sizeof(entry->value)) {
+    /* Callers tend to reuse the buffer they encode option values into */
+    if (length)
+      memcpy(entry->value, data, length);
+    entry->data = NULL;
+  }
+  else {
+    entry->data = data;
+  }
+  return 1;
+}
+
+int
+coap_opt_stage_add(coap_opt_stage_t *stage, uint16_t number,
+                   size_t length, const uint8_t *data) {
+  return coap_opt_stage_set(stage, COAP_OPT_STAGE_ADD, number, length, data);
+}
+
+int
+coap_opt_stage_update(coap_opt_stage_t *stage, uint16_t number,
+                      size_t length, const uint8_t *data) {
+  return coap_opt_stage_set(stage, COAP_OPT_STAGE_UPDATE, number, length,
+                            data);
+}
+
+int
+coap_opt_stage_remove(coap_opt_stage_t *stage, uint16_t number) {
+  return coap_opt_stage_set(stage, COAP_OPT_STAGE_REMOVE, number, 0, NULL);
+}
+
+/*
+ * Adds the size of option @p number to @p size, encoding it into @p out as
+ * well if set.
+ *
+ * Returns 1 if successful, else 0.
+ */
+static int
+coap_opt_stage_emit(uint8_t *out, size_t out_size, size_t *size,
+                    uint16_t *prev, uint16_t number, size_t length,
+                    const uint8_t *data) {
+  size_t optsize;
+
+  if (out)
+    optsize = coap_opt_encode(out + *size, out_size - *size, number - *prev,
+                              data, length);
+  else
+    optsize = coap_opt_encode_size(number - *prev, length);
+  if (!optsize)
+    return 0;
+  *size += optsize;
+  *prev = number;
+  return 1;
+}
+
+/*
+ * Merges the options of @p pdu with the @p count options of @p opts, which
+ * are in option number order, encoding them into @p out if set.
+ *
+ * Returns the size of the merged options (0 if there are none), or
+ * (size_t)-1 on failure.
+ */
+static size_t
+coap_opt_stage_merge(const coap_pdu_t *pdu,
+                     const coap_opt_stage_entry_t **opts, size_t count,
+                     uint8_t *out, size_t out_size, uint16_t *max_opt) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+  const coap_opt_stage_entry_t *entry;
+  size_t size = 0;
+  size_t i = 0;
+  size_t j;
+  uint16_t prev = 0;
+
+  coap_option_iterator_init(pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    int replaced = 0;
+
+    for (; i < count && opts[i]->number < opt_iter.type; i++) {
+      entry = opts[i];
+      if (entry->mode != COAP_OPT_STAGE_REMOVE &&
+          !coap_opt_stage_emit(out, out_size, &size, &prev, entry->number,
+                               entry->length,
+                               entry->data ? entry->data : entry->value))
+        return (size_t)-1;
+    }
+    /* Added options follow the ones with the same number in the PDU */
+    for (j = i; j < count && opts[j]->number == opt_iter.type; j++) {
+      if (opts[j]->mode != COAP_OPT_STAGE_ADD)
+        replaced = 1;
+    }
+    if (!replaced &&
+        !coap_opt_stage_emit(out, out_size, &size, &prev, opt_iter.type,
+                             coap_opt_length(option),
+                             coap_opt_value(option)))
+      return (size_t)-1;
+  }
+  for (; i < count; i++) {
+    entry = opts[i];
+    if (entry->mode != COAP_OPT_STAGE_REMOVE &&
+        !coap_opt_stage_emit(out, out_size, &size, &prev, entry->number,
+                             entry->length,
+                             entry->data ? entry->data : entry->value))
+      return (size_t)-1;
+  }
+  *max_opt = prev;
+  return size;
+}
+
+/*
+ * Replaces the options of @p pdu with them merged with the @p count options
+ * of @p opts, which are in option number order.  @p opts must have room for
+ * one more entry, for the Hop-Limit option that may need adding.
+ *
+ * Returns 1 if successful, else 0 with @p pdu unchanged.
+ */
+static int
+coap_opt_stage_apply(coap_pdu_t *pdu, const coap_opt_stage_entry_t **opts,
+                     size_t count) {
+  coap_opt_stage_entry_t hop_limit;
+  uint8_t sbuf[64];
+  uint8_t *buf = sbuf;
+  uint8_t *opt_start;
+  uint16_t max_opt = 0;
+  size_t new_size;
+  size_t old_size;
+  size_t tail;
+  size_t i;
+  int proxy = 0;
+  int has_hop_limit = 0;
+
+  for (i = 0; i < count; i++) {
+    if (opts[i]->mode == COAP_OPT_STAGE_REMOVE)
+      continue;
+    if (opts[i]->number == COAP_OPTION_PROXY_URI ||
+        opts[i]->number == COAP_OPTION_PROXY_SCHEME)
+      proxy = 1;
+    else if (opts[i]->number == COAP_OPTION_HOP_LIMIT)
+      has_hop_limit = 1;
+  }
+  if (proxy && !has_hop_limit && COAP_PDU_IS_REQUEST(pdu)) {
+    coap_opt_iterator_t opt_iter;
+
+    /* As for coap_add_option(), a Hop-Limit option is needed (RFC 8768) */
+    if (coap_check_option(pdu, COAP_OPTION_HOP_LIMIT, &opt_iter) == NULL) {
+      hop_limit.number = COAP_OPTION_HOP_LIMIT;
+      hop_limit.mode = COAP_OPT_STAGE_ADD;
+      hop_limit.length = 1;
+      hop_limit.data = NULL;
+      hop_limit.value[0] = COAP_DEFAULT_HOP_LIMIT;
+      for (i = count++; i > 0 && opts[i - 1]->number > COAP_OPTION_HOP_LIMIT;
+           i--)
+        opts[i] = opts[i - 1];
+      opts[i] = &hop_limit;
+    }
+  }
+
+  new_size = coap_opt_stage_merge(pdu, opts, count, NULL, 0, &max_opt);
+  if (new_size == (size_t)-1)
+    goto fail;
+  if (new_size > sizeof(sbuf)) {
+    buf = coap_malloc_type(COAP_STRING, new_size);
+    if (!buf)
+      goto fail;
+  }
+  /* The options are encoded aside as they are read from the PDU */
+  if (coap_opt_stage_merge(pdu, opts, count, buf, new_size,
+                           &max_opt) != new_size)
+    goto fail;
+
+  /* Payload marker and any payload in the PDU's buffer */
+  tail = pdu->data ? pdu->used_size - (pdu->data - 1 - pdu->token) : 0;
+  old_size = pdu->used_size - pdu->token_length - tail;
+  if (new_size > old_size &&
+      !coap_pdu_check_resize(pdu, pdu->used_size + new_size - old_size))
+    goto fail;
+
+  opt_start = pdu->token + pdu->token_length;
+  if (tail && new_size != old_size)
+    memmove(opt_start + new_size, opt_start + old_size, tail);
+  memcpy(opt_start, buf, new_size);
+  pdu->used_size = pdu->used_size - old_size + new_size;
+  if (pdu->data)
+    pdu->data = opt_start + new_size + 1;
+  pdu->max_opt = max_opt;
+  pdu->opt_indexed = 0;
+  if (buf != sbuf)
+    coap_free_type(COAP_STRING, buf);
+  return 1;
+
+fail:
+  coap_log(LOG_WARNING, "cannot add staged options\n");
+  if (buf && buf != sbuf)
+    coap_free_type(COAP_STRING, buf);
+  return 0;
+}
+
+int
+coap_add_opt_stage_pdu(coap_pdu_t *pdu, const coap_opt_stage_t *stage) {
+  const coap_opt_stage_entry_t *opts[COAP_OPT_STAGE_SIZE + 1];
+  size_t count;
+
+  assert(pdu);
+  assert(stage);
+
+  /* Stable insertion sort, so repeated options keep the order staged */
+  for (count = 0; count < stage->count; count++) {
+    size_t j = count;
+
+    while (j > 0 && opts[j - 1]->number > stage->opt[count].number) {
+      opts[j] = opts[j - 1];
+      j--;
+    }
+    opts[j] = &stage->opt[count];
+  }
+
+  return coap_opt_stage_apply(pdu, opts, count);
+}
+
+#define COAP_OPT_DESC(n,f,min,max) { n, min, max, f }
+
+static const coap_option_desc_t coap_option_descs[COAP_OPTION_PROPS_SIZE] = {
+  [COAP_OPTION_IF_MATCH] = COAP_OPT_DESC("If-Match",
+         COAP_OPT_PROP_REPEATABLE | COAP_OPT_PROP_KNOWN, 0, 8),
+  [COAP_OPTION_URI_HOST] = COAP_OPT_DESC("Uri-Host",
+         COAP_OPT_PROP_KNOWN, 1, 255),
+  [COAP_OPTION_ETAG] = COAP_OPT_DESC("ETag",
+         COAP_OPT_PROP_REPEATABLE, 1, 8),
+  [COAP_OPTION_IF_NONE_MATCH] = COAP_OPT_DESC("If-None-Match",
+         COAP_OPT_PROP_KNOWN, 0, 0),
+  /* https://tools.ietf.org/html/rfc7641#section-2 Observe is not a part of
+   * the cache-key. */
+  [COAP_OPTION_OBSERVE] = COAP_OPT_DESC("Observe",
+         COAP_OPT_PROP_NOCACHEKEY | COAP_OPT_PROP_HOP_BY_HOP, 0, 3),
+  [COAP_OPTION_URI_PORT] = COAP_OPT_DESC("Uri-Port",
+         COAP_OPT_PROP_KNOWN, 0, 2),
+  [COAP_OPTION_LOCATION_PATH] = COAP_OPT_DESC("Location-Path",
+         COAP_OPT_PROP_REPEATABLE, 0, 255),
+  /* Only known once OSCORE has registered it */
+  [COAP_OPTION_OSCORE] = COAP_OPT_DESC("OSCORE", 0, 0, 255),
+  [COAP_OPTION_URI_PATH] = COAP_OPT_DESC("Uri-Path",
+         COAP_OPT_PROP_REPEATABLE | COAP_OPT_PROP_KNOWN, 0, 255),
+  [COAP_OPTION_CONTENT_FORMAT] = COAP_OPT_DESC("Content-Format", 0, 0, 2),
+  [COAP_OPTION_MAXAGE] = COAP_OPT_DESC("Max-Age", 0, 0, 4),
+  [COAP_OPTION_URI_QUERY] = COAP_OPT_DESC("Uri-Query",
+         COAP_OPT_PROP_REPEATABLE | COAP_OPT_PROP_KNOWN, 1, 255),
+  [COAP_OPTION_HOP_LIMIT] = COAP_OPT_DESC("Hop-Limit", 0, 1, 1),
+  [COAP_OPTION_ACCEPT] = COAP_OPT_DESC("Accept",
+         COAP_OPT_PROP_KNOWN, 0, 2),
+  /* Only known if Q-Block has been enabled */
+  [COAP_OPTION_Q_BLOCK1] = COAP_OPT_DESC("Q-Block1",
+         COAP_OPT_PROP_REPEATABLE | COAP_OPT_PROP_HOP_BY_HOP, 0, 3),
+  [COAP_OPTION_LOCATION_QUERY] = COAP_OPT_DESC("Location-Query",
+         COAP_OPT_PROP_REPEATABLE, 0, 255),
+  [COAP_OPTION_BLOCK2] = COAP_OPT_DESC("Block2",
+         COAP_OPT_PROP_KNOWN | COAP_OPT_PROP_HOP_BY_HOP, 0, 3),
+  [COAP_OPTION_BLOCK1] = COAP_OPT_DESC("Block1",
+         COAP_OPT_PROP_KNOWN | COAP_OPT_PROP_HOP_BY_HOP, 0, 3),
+  [COAP_OPTION_SIZE2] = COAP_OPT_DESC("Size2",
+         COAP_OPT_PROP_HOP_BY_HOP, 0, 4),
+  [COAP_OPTION_Q_BLOCK2] = COAP_OPT_DESC("Q-Block2",
+         COAP_OPT_PROP_REPEATABLE | COAP_OPT_PROP_HOP_BY_HOP, 0, 3),
+  [COAP_OPTION_PROXY_URI] = COAP_OPT_DESC("Proxy-Uri",
+         COAP_OPT_PROP_KNOWN, 1, 1034),
+  [COAP_OPTION_PROXY_SCHEME] = COAP_OPT_DESC("Proxy-Scheme",
+         COAP_OPT_PROP_KNOWN, 1, 255),
+  [COAP_OPTION_SIZE1] = COAP_OPT_DESC("Size1",
+         COAP_OPT_PROP_HOP_BY_HOP, 0, 4),
+  [COAP_OPTION_NORESPONSE] = COAP_OPT_DESC("No-Response", 0, 0, 1),
+};
+
+const coap_option_desc_t *
+coap_option_desc(uint16_t type) {
+  if (type < COAP_OPTION_PROPS_SIZE && coap_option_descs[type].name)
+    return &coap_option_descs[type];
+  return NULL;
+}
+
+/* The properties that RFC 7252 5.4.6 encodes in the option number, with
+ * those the context has been told about. */
+uint8_t
+coap_option_props_uncached(const coap_context_t *context, uint16_t type) {
+  uint8_t props = 0;
+  size_t i;
+
+  if (type & 0x01)
+    props |= COAP_OPT_PROP_CRITICAL;
+  if (type & 0x02)
+    props |= COAP_OPT_PROP_UNSAFE;
+  if ((type & 0x1e) == 0x1c)
+    props |= COAP_OPT_PROP_NOCACHEKEY;
+
+  if (coap_option_filter_get(&context->known_options, type) > 0)
+    props |= COAP_OPT_PROP_KNOWN;
+
+  /* Check for option user has defined as not part of cache-key */
+  for (i = 0; i < context->cache_ignore_count; i++) {
+    if (context->cache_ignore_options[i] == type) {
+      props |= COAP_OPT_PROP_NOCACHEKEY;
+      break;
+    }
+  }
+  return props;
+}
+
+void
+coap_option_props_init(coap_context_t *context) {
+  uint16_t type;
+
+  for (type = 0; type < COAP_OPTION_PROPS_SIZE; type++) {
+    context->option_props[type] = coap_option_props_uncached(context, type) |
+                                  coap_option_descs[type].flags;
+  }
+  if (context->block_mode & COAP_BLOCK_TRY_Q_BLOCK) {
+    context->option_props[COAP_OPTION_Q_BLOCK1] |= COAP_OPT_PROP_KNOWN;
+    context->option_props[COAP_OPTION_Q_BLOCK2] |= COAP_OPT_PROP_KNOWN;
+  }
+}
@@ -35,8 +35,13 @@ void
 coap_pdu_clear(coap_pdu_t *pdu, size_t size) {
   assert(pdu);
   assert(pdu->token);
-  assert(pdu->max_hdr_size >= COAP_PDU_MAX_UDP_HEADER_SIZE);
-  if (pdu->alloc_size > size)
+  /*
+   * A borrowed TCP frame may have a shorter header, but never needs a
+   * longer one as it has to be copied before it can grow
+   */
+  assert(pdu->max_hdr_size >= COAP_PDU_MAX_UDP_HEADER_SIZE || pdu->borrowed);
+  /* A size of 0 leaves the PDU free to grow */
+  if (size && pdu->alloc_size > size)
     pdu->alloc_size = size;
   pdu->type = 0;
   pdu->code = 0;
@@ -44,6 +49,7 @@ coap_pdu_clear(coap_pdu_t *pdu, size_t size) {
   pdu->token_length = 0;
   pdu->mid = 0;
   pdu->max_opt = 0;
+  pdu->opt_indexed = 0;
   pdu->max_size = size;
   pdu->used_size = 0;
   pdu->data = NULL;
@@ -51,7 +57,13 @@ coap_pdu_clear(coap_pdu_t *pdu, size_t size) {
   pdu->body_length = 0;
   pdu->body_offset = 0;
   pdu->body_total = 0;
+  if (pdu->xmit_body)
+    coap_block_release_xmit_body(pdu->xmit_body);
+  pdu->xmit_data = NULL;
+  pdu->xmit_length = 0;
+  pdu->xmit_body = NULL;
   pdu->lg_xmit = NULL;
+  pdu->ref = 0;
 }
 
 #ifdef WITH_LWIP
@@ -75,6 +87,8 @@ coap_pdu_from_pbuf( struct pbuf *pbuf )
   pdu->pbuf = pbuf;
   pdu->token = (uint8_t *)pbuf->payload + pdu->max_hdr_size;
   pdu->alloc_size = pbuf->tot_len - pdu->max_hdr_size;
+  pdu->borrowed = 0;
+  pdu->xmit_body = NULL;
   coap_pdu_clear(pdu, pdu->alloc_size);
 
   return pdu;
@@ -85,7 +99,7 @@ coap_pdu_t *
 coap_pdu_init(uint8_t type, uint8_t code, uint16_t mid, size_t size) {
   coap_pdu_t *pdu;
 
-  pdu = coap_malloc_type(COAP_PDU, sizeof(coap_pdu_t));
+  pdu = coap_malloc_type(COAP_PDU, COAP_PDU_ALLOC_SIZE);
   if (!pdu) return NULL;
 
 #if defined(WITH_CONTIKI) || defined(WITH_LWIP)
@@ -98,13 +112,30 @@ coap_pdu_init(uint8_t type, uint8_t code, uint16_t mid, size_t size) {
 #endif
 
 #ifdef WITH_LWIP
-  pdu->pbuf = pbuf_alloc(PBUF_TRANSPORT, size + pdu->max_hdr_size, PBUF_RAM);
+  /*
+   * Start with a small pbuf, as a payload added by reference is chained
+   * behind it when sent.  coap_pdu_resize() moves to a larger one if need be.
+   */
+  pdu->alloc_size = size ? min(size, 256) : 256;
+  pdu->pbuf = pbuf_alloc(PBUF_TRANSPORT,
+                         (u16_t)(pdu->alloc_size + pdu->max_hdr_size),
+                         PBUF_RAM);
   if (pdu->pbuf == NULL) {
     coap_free_type(COAP_PDU, pdu);
     return NULL;
   }
   pdu->token = (uint8_t *)pdu->pbuf->payload + pdu->max_hdr_size;
-#else /* WITH_LWIP */
+  pdu->borrowed = 0;
+#elif COAP_PDU_INLINE_SIZE
+  /*
+   * Start with the buffer that follows the PDU.  Like a borrowed one, it is
+   * swapped for a buffer of its own by coap_pdu_resize() if need be.
+   */
+  pdu->alloc_size = size ? min(size, COAP_PDU_INLINE_SIZE) :
+                          COAP_PDU_INLINE_SIZE;
+  pdu->token = (uint8_t *)(pdu + 1) + pdu->max_hdr_size;
+  pdu->borrowed = 1;
+#else /* ! WITH_LWIP && ! COAP_PDU_INLINE_SIZE */
   uint8_t *buf;
   pdu->alloc_size = min(size, 256);
   buf = coap_malloc_type(COAP_PDU_BUF, pdu->alloc_size + pdu->max_hdr_size);
@@ -113,7 +144,9 @@ coap_pdu_init(uint8_t type, uint8_t code, uint16_t mid, size_t size) {
     return NULL;
   }
   pdu->token = buf + pdu->max_hdr_size;
-#endif /* WITH_LWIP */
+  pdu->borrowed = 0;
+#endif /* ! WITH_LWIP && ! COAP_PDU_INLINE_SIZE */
+  pdu->xmit_body = NULL;
   coap_pdu_clear(pdu, size);
   pdu->mid = mid;
   pdu->type = type;
@@ -132,10 +165,16 @@ coap_new_pdu(const struct coap_session_t *session) {
 void
 coap_delete_pdu(coap_pdu_t *pdu) {
   if (pdu != NULL) {
+    if (pdu->ref) {
+      pdu->ref--;
+      return;
+    }
+    if (pdu->xmit_body)
+      coap_block_release_xmit_body(pdu->xmit_body);
 #ifdef WITH_LWIP
     pbuf_free(pdu->pbuf);
 #else
-    if (pdu->token != NULL)
+    if (pdu->token != NULL && !pdu->borrowed)
       coap_free_type(COAP_PDU_BUF, pdu->token - pdu->max_hdr_size);
 #endif
     coap_free_type(COAP_PDU, pdu);
@@ -194,17 +233,87 @@ fail:
   return NULL;
 }
 
+coap_pdu_t *
+coap_pdu_reference(coap_pdu_t *pdu) {
+  pdu->ref++;
+  return pdu;
+}
+
+coap_pdu_t *
+coap_pdu_copy(const coap_pdu_t *src, coap_mid_t mid, size_t max_size,
+              size_t token_length, const uint8_t *token) {
+  coap_pdu_t *pdu = coap_pdu_init(src->type, src->code, mid, max_size);
+  size_t length = src->used_size - src->token_length;
+
+  if (!pdu)
+    return NULL;
+  if (!coap_add_token(pdu, token_length, token) ||
+      !coap_pdu_resize(pdu, pdu->used_size + length + src->xmit_length)) {
+    coap_delete_pdu(pdu);
+    return NULL;
+  }
+  memcpy(pdu->token + pdu->token_length, src->token + src->token_length,
+         length);
+  pdu->used_size += length;
+  if (src->xmit_length) {
+    memcpy(pdu->token + pdu->used_size, src->xmit_data, src->xmit_length);
+    pdu->used_size += src->xmit_length;
+  }
+  pdu->max_opt = src->max_opt;
+  if (src->data)
+    pdu->data = pdu->token + pdu->token_length +
+                (src->data - src->token - src->token_length);
+  return pdu;
+}
+
+int
+coap_pdu_copy_body(coap_pdu_t *dst, const coap_pdu_t *src) {
+  size_t length = src->used_size - src->token_length;
+
+  assert(!src->xmit_length);
+  if (dst->max_size && dst->used_size + length > dst->max_size)
+    return 0;
+  if (!coap_pdu_resize(dst, dst->used_size + length))
+    return 0;
+  memcpy(dst->token + dst->token_length, src->token + src->token_length,
+         length);
+  dst->used_size += length;
+  dst->max_opt = src->max_opt;
+  dst->data = src->data ? dst->token + dst->token_length +
+                          (src->data - src->token - src->token_length) : NULL;
+  return 1;
+}
+
 int
 coap_pdu_resize(coap_pdu_t *pdu, size_t new_size) {
+  assert(pdu->ref == 0);
   if (new_size > pdu->alloc_size) {
 #if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
     uint8_t *new_hdr;
     size_t offset;
+#elif defined(WITH_LWIP)
+    struct pbuf *new_pbuf;
+    size_t offset;
 #endif
     if (pdu->max_size && new_size > pdu->max_size) {
       coap_log(LOG_WARNING, "coap_pdu_resize: pdu too big\n");
       return 0;
     }
+#ifdef WITH_LWIP
+    offset = pdu->data ? (size_t)(pdu->data - pdu->token) : 0;
+    new_pbuf = pbuf_alloc(PBUF_TRANSPORT,
+                          (u16_t)(new_size + pdu->max_hdr_size), PBUF_RAM);
+    if (new_pbuf == NULL) {
+      coap_log(LOG_WARNING, "coap_pdu_resize: pbuf_alloc failed\n");
+      return 0;
+    }
+    memcpy(new_pbuf->payload, pdu->pbuf->payload,
+           pdu->max_hdr_size + pdu->used_size);
+    pbuf_free(pdu->pbuf);
+    pdu->pbuf = new_pbuf;
+    pdu->token = (uint8_t *)new_pbuf->payload + pdu->max_hdr_size;
+    pdu->data = offset ? pdu->token + offset : NULL;
+#endif /* WITH_LWIP */
 #if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
     if (pdu->data != NULL) {
       assert(pdu->data > pdu->token);
@@ -212,7 +321,26 @@ coap_pdu_resize(coap_pdu_t *pdu, size_t new_size) {
     } else {
       offset = 0;
     }
-    new_hdr = (uint8_t*)realloc(pdu->token - pdu->max_hdr_size, new_size + pdu->max_hdr_size);
+    if (pdu->borrowed) {
+      /*
+       * Take a private copy of the receive buffer (or of the buffer that
+       * was allocated along with the PDU) on first growth
+       */
+      new_hdr = (uint8_t*)coap_malloc_type(COAP_PDU_BUF,
+                                   new_size + COAP_PDU_MAX_TCP_HEADER_SIZE);
+      if (new_hdr != NULL) {
+        memcpy(new_hdr + COAP_PDU_MAX_TCP_HEADER_SIZE - pdu->max_hdr_size,
+               pdu->token - pdu->max_hdr_size,
+               pdu->max_hdr_size + pdu->used_size);
+        pdu->max_hdr_size = COAP_PDU_MAX_TCP_HEADER_SIZE;
+        pdu->borrowed = 0;
+      }
+    }
+    else {
+      new_hdr = (uint8_t*)coap_realloc_type(COAP_PDU_BUF,
+                                           pdu->token - pdu->max_hdr_size,
+                                           new_size + pdu->max_hdr_size);
+    }
     if (new_hdr == NULL) {
       coap_log(LOG_WARNING, "coap_pdu_resize: realloc failed\n");
       return 0;
@@ -262,6 +390,7 @@ coap_add_token(coap_pdu_t *pdu, size_t len, const uint8_t *data) {
   if (len)
     memcpy(pdu->token, data, len);
   pdu->max_opt = 0;
+  pdu->opt_indexed = 0;
   pdu->used_size = len;
   pdu->data = NULL;
 
@@ -320,6 +449,7 @@ coap_remove_option(coap_pdu_t *pdu, uint16_t type) {
   }
   if (!option)
     return 0;
+  pdu->opt_indexed = 0;
 
   if (!coap_opt_parse(option, pdu->used_size - (option - pdu->token),
                       &decode_this))
@@ -425,11 +555,13 @@ coap_insert_option(coap_pdu_t *pdu, uint16_t type, size_t len,
     prev_type = opt_iter.type;
   }
   assert(option != NULL);
+  pdu->opt_indexed = 0;
   /* size of option inc header to insert */
   shift = coap_opt_encode_size(type - prev_type, len);
 
   /* size of next option (header may shrink in size as delta changes */
-  if (!coap_opt_parse(option, opt_iter.length + 5, &decode))
+  if (!coap_opt_parse(option, pdu->used_size - (option - pdu->token),
+                      &decode))
     return 0;
   opt_delta = opt_iter.type - type;
 
@@ -515,6 +647,7 @@ coap_update_option(coap_pdu_t *pdu, uint16_t type, size_t len,
     /* Possible a re-size took place with a realloc() */
     option = coap_check_option(pdu, type, &opt_iter);
   }
+  pdu->opt_indexed = 0;
 
   if (new_length != old_length)
     memmove(&option[new_length], &option[old_length],
@@ -538,22 +671,15 @@ coap_add_option(coap_pdu_t *pdu, uint16_t type, size_t len,
   coap_opt_t *opt;
 
   assert(pdu);
+  assert(pdu->ref == 0);
 
   if (type == pdu->max_opt) {
     /* Validate that the option is repeatable */
-    switch (type) {
-    /* Ignore list of genuine repeatable */
-    case COAP_OPTION_IF_MATCH:
-    case COAP_OPTION_ETAG:
-    case COAP_OPTION_LOCATION_PATH:
-    case COAP_OPTION_URI_PATH:
-    case COAP_OPTION_URI_QUERY:
-    case COAP_OPTION_LOCATION_QUERY:
-      break;
-    default:
+    const coap_option_desc_t *desc = coap_option_desc(type);
+
+    if (!desc || !(desc->flags & COAP_OPT_PROP_REPEATABLE)) {
       coap_log(LOG_INFO, "Option %d is not defined as repeatable\n", type);
       /* Accepting it after warning as there may be user defineable options */
-      break;
     }
   }
 
@@ -582,6 +708,7 @@ coap_add_option(coap_pdu_t *pdu, uint16_t type, size_t len,
   if (!coap_pdu_check_resize(pdu,
       pdu->used_size + optsize))
     return 0;
+  pdu->opt_indexed = 0;
 
   if (pdu->data) {
     /* include option delimiter */
@@ -625,6 +752,7 @@ coap_add_data(coap_pdu_t *pdu, size_t len, const uint8_t *data) {
 uint8_t *
 coap_add_data_after(coap_pdu_t *pdu, size_t len) {
   assert(pdu);
+  assert(pdu->ref == 0);
   assert(pdu->data == NULL);
 
   pdu->data = NULL;
@@ -668,6 +796,13 @@ coap_get_data_large(const coap_pdu_t *pdu, size_t *len, const uint8_t **data,
     *len = pdu->body_length;
     return 1;
   }
+  if (pdu->xmit_data) {
+    *data = pdu->xmit_data;
+    *len = pdu->xmit_length;
+    if (*total == 0)
+      *total = *len;
+    return 1;
+  }
   *data = pdu->data;
   if(pdu->data == NULL) {
      *len = 0;
@@ -902,35 +1037,9 @@ bad:
 
 static int
 coap_pdu_parse_opt_base(coap_pdu_t *pdu, uint16_t len) {
-  int res = 1;
-
-  switch (pdu->max_opt) {
-  case COAP_OPTION_IF_MATCH:      if (len > 8) res = 0;               break;
-  case COAP_OPTION_URI_HOST:      if (len < 1 || len > 255) res = 0;  break;
-  case COAP_OPTION_ETAG:          if (len < 1 || len > 8) res = 0;    break;
-  case COAP_OPTION_IF_NONE_MATCH: if (len != 0) res = 0;              break;
-  case COAP_OPTION_OBSERVE:       if (len > 3) res = 0;               break;
-  case COAP_OPTION_URI_PORT:      if (len > 2) res = 0;               break;
-  case COAP_OPTION_LOCATION_PATH: if (len > 255) res = 0;             break;
-  case COAP_OPTION_OSCORE:        if (len > 255) res = 0;             break;
-  case COAP_OPTION_URI_PATH:      if (len > 255) res = 0;             break;
-  case COAP_OPTION_CONTENT_FORMAT:if (len > 2) res = 0;               break;
-  case COAP_OPTION_MAXAGE:        if (len > 4) res = 0;               break;
-  case COAP_OPTION_URI_QUERY:     if (len < 1 || len > 255) res = 0;  break;
-  case COAP_OPTION_HOP_LIMIT:     if (len != 1) res = 0;              break;
-  case COAP_OPTION_ACCEPT:        if (len > 2) res = 0;               break;
-  case COAP_OPTION_LOCATION_QUERY:if (len > 255) res = 0;             break;
-  case COAP_OPTION_BLOCK2:        if (len > 3) res = 0;               break;
-  case COAP_OPTION_BLOCK1:        if (len > 3) res = 0;               break;
-  case COAP_OPTION_SIZE2:         if (len > 4) res = 0;               break;
-  case COAP_OPTION_PROXY_URI:     if (len < 1 || len > 1034) res = 0; break;
-  case COAP_OPTION_PROXY_SCHEME:  if (len < 1 || len > 255) res = 0;  break;
-  case COAP_OPTION_SIZE1:         if (len > 4) res = 0;               break;
-  case COAP_OPTION_NORESPONSE:    if (len > 1) res = 0;               break;
-  default:
-    ;
-  }
-  return res;
+  const coap_option_desc_t *desc = coap_option_desc(pdu->max_opt);
+
+  return !desc || (len >= desc->min_len && len <= desc->max_len);
 }
 
 static int
@@ -984,6 +1093,8 @@ coap_pdu_parse_opt(coap_pdu_t *pdu) {
   }
 
   pdu->max_opt = 0;
+  pdu->opt_indexed = 0;
+  pdu->opt_count = 0;
   if (pdu->code == 0) {
     /* empty packet */
     pdu->used_size = 0;
@@ -992,6 +1103,7 @@ coap_pdu_parse_opt(coap_pdu_t *pdu) {
     /* skip header + token */
     coap_opt_t *opt = pdu->token + pdu->token_length;
     size_t length = pdu->used_size - pdu->token_length;
+    int indexed = 1;
 
     while (length > 0 && *opt != COAP_PAYLOAD_START) {
       coap_opt_t *opt_last = opt;
@@ -1016,7 +1128,18 @@ coap_pdu_parse_opt(coap_pdu_t *pdu) {
                  len);
         good = 0;
       }
+      if (pdu->opt_count < COAP_PDU_OPT_INDEX_SIZE &&
+          opt - pdu->token - pdu->token_length <= UINT16_MAX) {
+        coap_pdu_opt_index_t *entry = &pdu->opt_index[pdu->opt_count++];
+
+        entry->number = pdu->max_opt;
+        entry->offset = (uint16_t)(opt_last - pdu->token - pdu->token_length);
+        entry->size = (uint16_t)optsize;
+      } else {
+        indexed = 0;
+      }
     }
+    pdu->opt_indexed = good && indexed;
 
     if (!good) {
       /*
@@ -1024,7 +1147,7 @@ coap_pdu_parse_opt(coap_pdu_t *pdu) {
        * error options which are prefixed by *
        * Two rows - hex and ascii (if printable)
        */
-      static char outbuf[COAP_DEBUG_BUF_SIZE];
+      static COAP_THREAD_LOCAL char outbuf[COAP_DEBUG_BUF_SIZE];
       char *obp;
       size_t tlen;
       size_t outbuflen;
@@ -1116,6 +1239,40 @@ coap_pdu_parse(coap_proto_t proto,
   return coap_pdu_parse_header(pdu, proto) && coap_pdu_parse_opt(pdu);
 }
 
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+coap_pdu_t *
+coap_pdu_borrow(coap_proto_t proto, uint8_t *data, size_t length,
+                size_t max_size) {
+  coap_pdu_t *pdu;
+  size_t hdr_size;
+
+  if (length == 0)
+    return NULL;
+  hdr_size = coap_pdu_parse_header_size(proto, data);
+  if (!hdr_size || hdr_size > length)
+    return NULL;
+  if (max_size && length - hdr_size > max_size) {
+    coap_log(LOG_WARNING, "coap_pdu_borrow: pdu too big\n");
+    return NULL;
+  }
+
+  pdu = coap_malloc_type(COAP_PDU, sizeof(coap_pdu_t));
+  if (!pdu)
+    return NULL;
+  pdu->max_hdr_size = (uint8_t)hdr_size;
+  pdu->token = data + hdr_size;
+  pdu->alloc_size = length - hdr_size;
+  pdu->borrowed = 1;
+  pdu->xmit_body = NULL;
+  coap_pdu_clear(pdu, max_size);
+  /* coap_pdu_clear() limits alloc_size to any smaller max_size */
+  pdu->alloc_size = length - hdr_size;
+  pdu->hdr_size = (uint8_t)hdr_size;
+  pdu->used_size = length - hdr_size;
+  return pdu;
+}
+#endif /* ! WITH_LWIP && ! WITH_CONTIKI */
+
 size_t
 coap_pdu_encode_header(coap_pdu_t *pdu, coap_proto_t proto) {
   if (proto == COAP_PROTO_UDP || proto == COAP_PROTO_DTLS) {
@@ -1139,7 +1296,7 @@ coap_pdu_encode_header(coap_pdu_t *pdu, coap_proto_t proto) {
       coap_log(LOG_WARNING, "coap_pdu_encode_header: corrupted PDU\n");
       return 0;
     }
-    len = pdu->used_size - pdu->token_length;
+    len = pdu->used_size - pdu->token_length + pdu->xmit_length;
     if (len <= COAP_MAX_MESSAGE_SIZE_TCP0) {
       assert(pdu->max_hdr_size >= 2);
       if (pdu->max_hdr_size < 2) {
@@ -9,6 +9,7 @@
 #include "coap2/coap_internal.h"
 
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 
 #ifdef COAP_EPOLL_SUPPORT
@@ -58,6 +59,14 @@ coap_free_subscription(coap_subscription_t *subscription) {
 #define COAP_FREE_TYPE(Type, Object) coap_free(Object)
 #endif
 
+#if COAP_SUBSCRIPTION_SLABS
+#define COAP_SUBSCRIPTION_FREE(Resource, Object) \
+  coap_subscription_free((Resource), (Object))
+#else /* ! COAP_SUBSCRIPTION_SLABS */
+#define COAP_SUBSCRIPTION_FREE(Resource, Object) \
+  COAP_FREE_TYPE(subscription, (Object))
+#endif /* ! COAP_SUBSCRIPTION_SLABS */
+
 #define COAP_PRINT_STATUS_MAX (~COAP_PRINT_STATUS_MASK)
 
 #ifndef min
@@ -138,6 +147,385 @@ match(const coap_str_const_t *text, const coap_str_const_t *pattern, int match_p
     memcmp(text->s, pattern->s, pattern->length) == 0;
 }
 
+/*
+ * The /.well-known/core of a context is kept rendered in context->wellknown
+ * (NULL until first asked for), with each link led by a ','.  Adding a
+ * resource appends its link, and deleting it or changing what is printed
+ * for it only replaces its own link, so the catalog is never printed again
+ * as a whole for every block that is asked for.
+ */
+
+/*
+ * Replaces the @p old_length bytes at @p at of the rendered catalog with the
+ * link of @p resource, or removes them if @p resource is NULL.
+ */
+static void
+coap_wellknown_splice(coap_context_t *context, size_t at, size_t old_length,
+                      coap_resource_t *resource) {
+  unsigned char dummy[1];
+  size_t length = 0;
+  size_t offset = 0;
+
+  if (resource) {
+    coap_print_link(resource, dummy, &length, &offset);
+    length++;
+  }
+  if (context->wellknown_length - old_length + length >
+      context->wellknown_size) {
+    size_t size = context->wellknown_size;
+    uint8_t *buf;
+
+    while (size < context->wellknown_length - old_length + length)
+      size *= 2;
+    buf = coap_malloc_type(COAP_STRING, size);
+    if (!buf) {
+      /* Printed out again when next asked for */
+      coap_free_type(COAP_STRING, context->wellknown);
+      context->wellknown = NULL;
+      return;
+    }
+    memcpy(buf, context->wellknown, context->wellknown_length);
+    coap_free_type(COAP_STRING, context->wellknown);
+    context->wellknown = buf;
+    context->wellknown_size = size;
+  }
+  memmove(context->wellknown + at + length,
+          context->wellknown + at + old_length,
+          context->wellknown_length - at - old_length);
+  context->wellknown_length = context->wellknown_length - old_length + length;
+  if (resource) {
+    context->wellknown[at] = ',';
+    length--;
+    coap_print_link(resource, context->wellknown + at + 1, &length, &offset);
+    resource->wellknown_length = length + 1;
+  }
+}
+
+/* Returns where the link of @p resource starts in the rendered catalog */
+static size_t
+coap_wellknown_offset(coap_context_t *context, coap_resource_t *resource) {
+  size_t at = 0;
+
+  RESOURCES_ITER(context->resources, r) {
+    if (r == resource)
+      break;
+    at += r->wellknown_length;
+  }
+  return at;
+}
+
+/* Prints out the catalog of @p context if it is not kept yet */
+static int
+coap_wellknown_build(coap_context_t *context) {
+  if (context->wellknown)
+    return 1;
+  context->wellknown_size = 256;
+  context->wellknown_length = 0;
+  context->wellknown = coap_malloc_type(COAP_STRING, context->wellknown_size);
+  if (!context->wellknown)
+    return 0;
+  RESOURCES_ITER(context->resources, r) {
+    coap_wellknown_splice(context, context->wellknown_length, 0, r);
+    if (!context->wellknown)
+      return 0;
+  }
+  return 1;
+}
+
+/* Updates the link of @p resource after what is printed for it changed */
+static void
+coap_wellknown_update(coap_resource_t *resource) {
+  coap_context_t *context = resource->context;
+
+  if (context && context->wellknown && !resource->is_unknown &&
+      !resource->is_proxy_uri)
+    coap_wellknown_splice(context, coap_wellknown_offset(context, resource),
+                          resource->wellknown_length, resource);
+}
+
+#ifndef WITHOUT_QUERY_FILTER
+/* Attributes whose values are lists of space separated tokens */
+static const coap_str_const_t _rt_attributes[] = {
+  {2, (const uint8_t *)"rt"},
+  {2, (const uint8_t *)"if"},
+  {3, (const uint8_t *)"rel"},
+  {0, NULL}};
+
+static const coap_str_const_t coap_attr_href = {4, (const uint8_t *)"href"};
+
+/*
+ * The attribute index of a context (NULL until the first filtered discovery
+ * request) maps each attribute name to the sorted values it has over all the
+ * resources, so that a query filter only visits the resources it matches.
+ */
+
+static int
+coap_attr_is_list(const coap_str_const_t *name) {
+  const coap_str_const_t *rt_attributes;
+
+  for (rt_attributes = _rt_attributes; rt_attributes->s; rt_attributes++) {
+    if (name->length == rt_attributes->length &&
+        memcmp(name->s, rt_attributes->s, rt_attributes->length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Orders on value (a shorter value first on a tie) and then on seq */
+static int
+coap_attr_compare(const uint8_t *s, size_t length, unsigned int seq,
+                  const coap_attr_entry_t *entry) {
+  int c = memcmp(s, entry->s, min(length, entry->length));
+
+  if (c)
+    return c;
+  if (length != entry->length)
+    return length < entry->length ? -1 : 1;
+  return seq < entry->resource->seq ? -1 : seq > entry->resource->seq;
+}
+
+/* Returns the first entry of @p index that is not before the given value */
+static size_t
+coap_attr_lower_bound(const coap_attr_index_t *index, const uint8_t *s,
+                      size_t length, unsigned int seq) {
+  size_t lo = 0;
+  size_t hi = index->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (coap_attr_compare(s, length, seq, &index->entries[mid]) > 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void
+coap_attr_index_free(coap_context_t *context) {
+  coap_attr_index_t *index, *tmp;
+
+  HASH_ITER(hh, context->attr_index, index, tmp) {
+    HASH_DELETE(hh, context->attr_index, index);
+    coap_delete_str_const(index->name);
+    coap_free_type(COAP_STRING, index->entries);
+    coap_free_type(COAP_STRING, index);
+  }
+  context->attr_index = NULL;
+}
+
+/*
+ * Adds (or removes) one value of attribute @p name of @p resource.  Returns
+ * 0 if there is no memory.
+ */
+static int
+coap_attr_index_value(coap_context_t *context, const coap_str_const_t *name,
+                      const uint8_t *s, size_t length,
+                      coap_resource_t *resource, int add) {
+  coap_attr_index_t *index;
+  size_t i;
+
+  HASH_FIND(hh, context->attr_index, name->s, name->length, index);
+  if (!add) {
+    if (index) {
+      i = coap_attr_lower_bound(index, s, length, resource->seq);
+      if (i < index->count && index->entries[i].resource == resource) {
+        index->count--;
+        memmove(&index->entries[i], &index->entries[i + 1],
+                (index->count - i) * sizeof(coap_attr_entry_t));
+      }
+    }
+    return 1;
+  }
+  if (!index) {
+    index = coap_malloc_type(COAP_STRING, sizeof(coap_attr_index_t));
+    if (!index)
+      return 0;
+    memset(index, 0, sizeof(coap_attr_index_t));
+    index->name = coap_new_str_const(name->s, name->length);
+    if (!index->name) {
+      coap_free_type(COAP_STRING, index);
+      return 0;
+    }
+    HASH_ADD_KEYPTR(hh, context->attr_index, index->name->s,
+                    index->name->length, index);
+  }
+  if (index->count == index->size) {
+    size_t size = index->size ? index->size * 2 : 8;
+    coap_attr_entry_t *entries = coap_realloc_type(COAP_STRING,
+                                          index->entries,
+                                          size * sizeof(coap_attr_entry_t));
+
+    if (!entries)
+      return 0;
+    index->entries = entries;
+    index->size = size;
+  }
+  i = coap_attr_lower_bound(index, s, length, resource->seq);
+  memmove(&index->entries[i + 1], &index->entries[i],
+          (index->count - i) * sizeof(coap_attr_entry_t));
+  index->entries[i].s = s;
+  index->entries[i].length = length;
+  index->entries[i].resource = resource;
+  index->count++;
+  return 1;
+}
+
+/* Adds (or removes) the values of @p attr, split up if it is a list */
+static int
+coap_attr_index_attr(coap_context_t *context, coap_resource_t *resource,
+                     coap_attr_t *attr, int add) {
+  coap_str_const_t value;
+
+  /* Queries on href are about the uri_path, values of none never match */
+  if (!attr->value || !attr->value->s ||
+      coap_string_equal(attr->name, &coap_attr_href))
+    return 1;
+  value = *attr->value;
+  if (value.length >= 2 && value.s[0] == '"') {
+    value.length -= 2;
+    value.s += 1;
+  }
+  if (!coap_attr_is_list(attr->name))
+    return coap_attr_index_value(context, attr->name, value.s, value.length,
+                                 resource, add);
+  while (value.length) {
+    const uint8_t *space = memchr(value.s, ' ', value.length);
+    size_t token_length = space ? (size_t)(space - value.s) : value.length;
+
+    if (!coap_attr_index_value(context, attr->name, value.s, token_length,
+                               resource, add))
+      return 0;
+    if (!space)
+      break;
+    value.s += token_length + 1;
+    value.length -= token_length + 1;
+  }
+  return 1;
+}
+
+/* Adds (or removes) all the values of @p resource */
+static void
+coap_attr_index_resource(coap_context_t *context, coap_resource_t *resource,
+                         int add) {
+  coap_attr_t *attr;
+
+  if (!coap_attr_index_value(context, &coap_attr_href, resource->uri_path->s,
+                             resource->uri_path->length, resource, add))
+    goto fail;
+  LL_FOREACH(resource->link_attr, attr) {
+    if (!coap_attr_index_attr(context, resource, attr, add))
+      goto fail;
+  }
+  return;
+
+fail:
+  /* Built again when next needed */
+  coap_attr_index_free(context);
+}
+
+static int
+coap_attr_index_build(coap_context_t *context) {
+  if (context->attr_index)
+    return 1;
+  RESOURCES_ITER(context->resources, r) {
+    coap_attr_index_resource(context, r, 1);
+    if (!context->attr_index)
+      return 0;
+  }
+  return context->attr_index != NULL;
+}
+
+static int
+coap_resource_seq_cmp(const void *a, const void *b) {
+  const coap_resource_t *ra = *(coap_resource_t * const *)a;
+  const coap_resource_t *rb = *(coap_resource_t * const *)b;
+
+  return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/*
+ * Prints the links of the resources whose attribute @p name matches
+ * @p pattern, as coap_print_wellknown() does.  Returns 0 if the attribute
+ * index cannot be used.
+ */
+static int
+coap_print_wellknown_indexed(coap_context_t *context,
+                             const coap_str_const_t *name,
+                             const coap_str_const_t *pattern, int prefix,
+                             unsigned char *buf, size_t *buflen,
+                             size_t offset, coap_print_status_t *result) {
+  coap_attr_index_t *index;
+  coap_resource_t **matches = NULL;
+  unsigned char *p = buf;
+  const uint8_t *bufend = buf + *buflen;
+  size_t first, last, count = 0, i;
+  size_t left, written = 0, output_length;
+  const size_t old_offset = offset;
+
+  if (!coap_attr_index_build(context))
+    return 0;
+  HASH_FIND(hh, context->attr_index, name->s, name->length, index);
+  if (index) {
+    first = coap_attr_lower_bound(index, pattern->s, pattern->length, 0);
+    for (last = first; last < index->count; last++) {
+      const coap_attr_entry_t *entry = &index->entries[last];
+
+      if (entry->length < pattern->length ||
+          (!prefix && entry->length != pattern->length) ||
+          memcmp(entry->s, pattern->s, pattern->length) != 0)
+        break;
+    }
+    if (last > first) {
+      matches = coap_malloc_type(COAP_STRING,
+                                 (last - first) * sizeof(coap_resource_t *));
+      if (!matches)
+        return 0;
+      for (i = first; i < last; i++)
+        matches[i - first] = index->entries[i].resource;
+      /* Back into catalog order, a resource may match on several tokens */
+      qsort(matches, last - first, sizeof(coap_resource_t *),
+            coap_resource_seq_cmp);
+      for (i = 0; i < last - first; i++) {
+        if (count == 0 || matches[count - 1] != matches[i])
+          matches[count++] = matches[i];
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (i)
+      PRINT_COND_WITH_OFFSET(p, bufend, offset, ',', written);
+
+    left = bufend - p; /* calculate available space */
+    *result = coap_print_link(matches[i], p, &left, &offset);
+
+    if (*result & COAP_PRINT_STATUS_ERROR)
+      break;
+
+    p += COAP_PRINT_OUTPUT_LENGTH(*result);
+    written += left;
+  }
+  coap_free_type(COAP_STRING, matches);
+
+  *buflen = written;
+  output_length = p - buf;
+
+  if (output_length > COAP_PRINT_STATUS_MAX) {
+    *result = COAP_PRINT_STATUS_ERROR;
+    return 1;
+  }
+
+  *result = (coap_print_status_t)output_length;
+
+  if (*result + old_offset - offset < *buflen) {
+    *result |= COAP_PRINT_STATUS_TRUNC;
+  }
+  return 1;
+}
+#endif /* WITHOUT_QUERY_FILTER */
+
 /**
  * Prints the names of all known resources to @p buf. This function
  * sets @p buflen to the number of bytes actually written and returns
@@ -182,13 +570,28 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
 #define MATCH_URI       0x01
 #define MATCH_PREFIX    0x02
 #define MATCH_SUBSTRING 0x04
-  static const coap_str_const_t _rt_attributes[] = {
-    {2, (const uint8_t *)"rt"},
-    {2, (const uint8_t *)"if"},
-    {3, (const uint8_t *)"rel"},
-    {0, NULL}};
 #endif /* WITHOUT_QUERY_FILTER */
 
+#ifndef WITHOUT_QUERY_FILTER
+  if (!query_filter)
+#endif /* WITHOUT_QUERY_FILTER */
+  {
+    /* The whole catalog is served from the rendered copy */
+    if (coap_wellknown_build(context)) {
+      size_t length = context->wellknown_length ?
+                      context->wellknown_length - 1 : 0;
+      size_t count = offset < length ? min(*buflen, length - offset) : 0;
+
+      if (count)
+        memcpy(buf, context->wellknown + 1 + offset, count);
+      *buflen = length;
+      result = (coap_print_status_t)count;
+      if (offset + count < length)
+        result |= COAP_PRINT_STATUS_TRUNC;
+      return result;
+    }
+  }
+
 #ifndef WITHOUT_QUERY_FILTER
   /* split query filter, if any */
   if (query_filter) {
@@ -229,6 +632,15 @@ coap_print_wellknown(coap_context_t *context, unsigned char *buf, size_t *buflen
         query_pattern.length--;
         flags |= MATCH_PREFIX;
       }
+
+      /* Only the matching resources are visited, through the index */
+      if (coap_print_wellknown_indexed(context,
+                                 (flags & MATCH_URI) ? &coap_attr_href :
+                                                       &resource_param,
+                                 &query_pattern,
+                                 (flags & MATCH_PREFIX) != 0,
+                                 buf, buflen, offset, &result))
+        return result;
     }
   }
 #endif /* WITHOUT_QUERY_FILTER */
@@ -304,6 +716,7 @@ coap_resource_init(coap_str_const_t *uri_path, int flags) {
   r = (coap_resource_t *)coap_malloc_type(COAP_RESOURCE, sizeof(coap_resource_t));
   if (r) {
     memset(r, 0, sizeof(coap_resource_t));
+    r->handler = r->own_handler;
 
     if (!(flags & COAP_RESOURCE_FLAGS_RELEASE_URI)) {
       /* Need to take a copy if caller is not providing a release request */
@@ -338,6 +751,7 @@ coap_resource_unknown_init(coap_method_handler_t put_handler) {
   r = (coap_resource_t *)coap_malloc_type(COAP_RESOURCE, sizeof(coap_resource_t));
   if (r) {
     memset(r, 0, sizeof(coap_resource_t));
+    r->handler = r->own_handler;
     r->is_unknown = 1;
     /* Something unlikely to be used, but it shows up in the logs */
     r->uri_path = coap_new_str_const(coap_unknown_resource_uri, sizeof(coap_unknown_resource_uri)-1);
@@ -366,11 +780,12 @@ coap_resource_proxy_uri_init(coap_method_handler_t handler,
   if (r) {
     size_t i;
     memset(r, 0, sizeof(coap_resource_t));
+    r->handler = r->own_handler;
     r->is_proxy_uri = 1;
     /* Something unlikely to be used, but it shows up in the logs */
     r->uri_path = coap_new_str_const(coap_proxy_resource_uri, sizeof(coap_proxy_resource_uri)-1);
     /* Preset all the handlers */
-    for (i = 0; i < (sizeof(r->handler) / sizeof(r->handler[0])); i++) {
+    for (i = 0; i < COAP_RESOURCE_METHODS; i++) {
       r->handler[i] = handler;
     }
     if (host_name_count) {
@@ -401,6 +816,35 @@ coap_resource_proxy_uri_init(coap_method_handler_t handler,
   return r;
 }
 
+/*
+ * Creates an attribute of a compact resource, with the name and value
+ * interned in the catalog of its context.
+ */
+static coap_attr_t *
+coap_new_attr_compact(coap_resource_t *resource, coap_str_const_t *name,
+                      coap_str_const_t *val, int flags) {
+  coap_catalog_t *catalog = resource->context->catalog;
+  coap_attr_t *attr;
+
+  attr = (coap_attr_t *)coap_catalog_alloc(catalog, sizeof(coap_attr_t));
+  if (attr) {
+    attr->next = NULL;
+    attr->name = coap_catalog_intern(catalog, name->s, name->length);
+    attr->value = val ? coap_catalog_intern(catalog, val->s, val->length) :
+                        NULL;
+    attr->flags = flags & ~(COAP_ATTR_FLAGS_RELEASE_NAME |
+                            COAP_ATTR_FLAGS_RELEASE_VALUE);
+    if (!attr->name || (val && !attr->value))
+      attr = NULL;
+  }
+  /* The strings of the caller are not kept */
+  if (flags & COAP_ATTR_FLAGS_RELEASE_NAME)
+    coap_delete_str_const(name);
+  if (val && (flags & COAP_ATTR_FLAGS_RELEASE_VALUE))
+    coap_delete_str_const(val);
+  return attr;
+}
+
 coap_attr_t *
 coap_add_attr(coap_resource_t *resource,
               coap_str_const_t *name,
@@ -411,9 +855,13 @@ coap_add_attr(coap_resource_t *resource,
   if (!resource || !name)
     return NULL;
 
-  attr = (coap_attr_t *)coap_malloc_type(COAP_RESOURCEATTR, sizeof(coap_attr_t));
+  if (resource->compact)
+    attr = coap_new_attr_compact(resource, name, val, flags);
+  else
+    attr = (coap_attr_t *)coap_malloc_type(COAP_RESOURCEATTR,
+                                           sizeof(coap_attr_t));
 
-  if (attr) {
+  if (attr && !resource->compact) {
     if (!(flags & COAP_ATTR_FLAGS_RELEASE_NAME)) {
       /* Need to take a copy if caller is not providing a release request */
       name = coap_new_str_const(name->s, name->length);
@@ -428,9 +876,18 @@ coap_add_attr(coap_resource_t *resource,
     attr->value = val;
 
     attr->flags = flags;
+  }
 
+  if (attr) {
     /* add attribute to resource list */
     LL_PREPEND(resource->link_attr, attr);
+    coap_wellknown_update(resource);
+#ifndef WITHOUT_QUERY_FILTER
+    if (resource->context && resource->context->attr_index &&
+        !resource->is_unknown && !resource->is_proxy_uri &&
+        !coap_attr_index_attr(resource->context, resource, attr, 1))
+      coap_attr_index_free(resource->context);
+#endif /* WITHOUT_QUERY_FILTER */
   } else {
     coap_log(LOG_DEBUG, "coap_add_attr: no memory left\n");
   }
@@ -486,6 +943,13 @@ typedef enum coap_deleting_resource_t {
 
 static void coap_notify_observers(coap_context_t *context, coap_resource_t *r,
                                   coap_deleting_resource_t deleting);
+static void coap_resource_unqueue_dirty(coap_context_t *context,
+                                        coap_resource_t *r);
+static void coap_observer_clear_dirty(coap_resource_t *r,
+                                      coap_subscription_t *obs);
+static void coap_observer_set_cond(coap_resource_t *resource,
+                                   coap_subscription_t *s,
+                                   const coap_string_t *query);
 
 static void
 coap_free_resource(coap_resource_t *resource) {
@@ -494,25 +958,43 @@ coap_free_resource(coap_resource_t *resource) {
 
   assert(resource);
 
+  /* The resource going away on this node is not a change for the others */
+  resource->context->observe_remote++;
   coap_resource_notify_observers(resource, NULL);
+  resource->context->observe_remote--;
   coap_notify_observers(resource->context, resource, COAP_DELETING_RESOURCE);
+  coap_resource_unqueue_dirty(resource->context, resource);
 
   if (resource->context->release_userdata && resource->user_data)
     resource->context->release_userdata(resource->user_data);
 
-  /* delete registered attributes */
-  LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
+  /* delete registered attributes, those of a compact resource are kept
+   * by the catalog */
+  if (!resource->compact)
+    LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
 
-  /* Either the application provided or libcoap copied - need to delete it */
-  coap_delete_str_const(resource->uri_path);
+  /* Transfers still in progress keep their body */
+  coap_block_delete_large_bodies(resource);
+  coap_delete_file_resource(resource);
+  coap_cache_invalidate_resource(resource);
 
   /* free all elements from resource->subscribers */
+  resource->dirty_subscribers = NULL;
+  HASH_CLEAR(hh, resource->subscriber_index);
   LL_FOREACH_SAFE( resource->subscribers, obs, otmp ) {
+    coap_observe_registry_removed(resource, obs);
+    DL_DELETE2(obs->session->subscriptions, obs, session_prev, session_next);
+    coap_observer_set_cond(resource, obs, NULL);
     coap_session_release( obs->session );
     if (obs->query)
       coap_delete_string(obs->query);
-    COAP_FREE_TYPE( subscription, obs );
+    COAP_SUBSCRIPTION_FREE(resource, obs);
   }
+
+  /* Either the application provided or libcoap copied - need to delete it */
+  if (!resource->compact)
+    coap_delete_str_const(resource->uri_path);
+
   if (resource->proxy_name_count && resource->proxy_name_list) {
     size_t i;
 
@@ -521,6 +1003,7 @@ coap_free_resource(coap_resource_t *resource) {
     }
     coap_free(resource->proxy_name_list);
   }
+  coap_histogram_free(resource->handler_histogram);
 
 #ifdef WITH_LWIP
   memp_free(MEMP_COAP_RESOURCE, resource);
@@ -530,6 +1013,232 @@ coap_free_resource(coap_resource_t *resource) {
 #endif /* WITH_CONTIKI */
 }
 
+/*
+ * Gets the segment of the route @p path that starts at @p offset, moving
+ * @p offset past it.  Returns 0 when there are no more segments.
+ */
+static int
+coap_route_segment(const coap_str_const_t *path, size_t *offset,
+                   coap_str_const_t *segment) {
+  size_t i = *offset;
+
+  if (path->length == 0 || i > path->length)
+    return 0;
+  segment->s = path->s + i;
+  while (i < path->length && path->s[i] != '/')
+    i++;
+  segment->length = i - *offset;
+  *offset = i + 1;
+  return 1;
+}
+
+COAP_STATIC_INLINE int
+coap_route_is_param(const coap_str_const_t *segment) {
+  return segment->length > 2 && segment->s[0] == '{' &&
+         segment->s[segment->length - 1] == '}';
+}
+
+/* A * is only a wildcard as the last segment */
+COAP_STATIC_INLINE int
+coap_route_is_wildcard(const coap_str_const_t *path, size_t offset,
+                       const coap_str_const_t *segment) {
+  return offset > path->length && segment->length == 1 &&
+         segment->s[0] == '*';
+}
+
+#define route_hex(c) ((c) & 0x40 ? ((c) & 0x0F) + 9 : ((c) & 0x0F))
+
+/* Percent-decodes a literal segment, so it can be matched on option values */
+static coap_string_t *
+coap_route_decode(const coap_str_const_t *segment) {
+  coap_string_t *decoded = coap_new_string(segment->length);
+  size_t i;
+
+  if (!decoded)
+    return NULL;
+  decoded->length = 0;
+  for (i = 0; i < segment->length; i++) {
+    if (segment->s[i] == '%' && i + 2 < segment->length &&
+        isxdigit(segment->s[i + 1]) && isxdigit(segment->s[i + 2])) {
+      decoded->s[decoded->length++] =
+        (uint8_t)((route_hex(segment->s[i + 1]) << 4) +
+                  route_hex(segment->s[i + 2]));
+      i += 2;
+    }
+    else {
+      decoded->s[decoded->length++] = segment->s[i];
+    }
+  }
+  return decoded;
+}
+
+static coap_route_node_t *
+coap_route_node_new(void) {
+  coap_route_node_t *node = coap_malloc_type(COAP_STRING,
+                                             sizeof(coap_route_node_t));
+
+  if (node)
+    memset(node, 0, sizeof(coap_route_node_t));
+  return node;
+}
+
+static void
+coap_route_node_free(coap_route_node_t *node) {
+  coap_route_node_t *child, *tmp;
+
+  if (!node)
+    return;
+  HASH_ITER(hh, node->children, child, tmp) {
+    HASH_DELETE(hh, node->children, child);
+    coap_route_node_free(child);
+  }
+  coap_route_node_free(node->param);
+  coap_delete_string(node->segment);
+  coap_free_type(COAP_STRING, node);
+}
+
+/*
+ * Returns where the resource for the route @p path is kept, creating the
+ * nodes on the way if @p create is set.  Returns NULL if the route has no
+ * nodes (or they cannot be created).
+ */
+static coap_resource_t **
+coap_route_slot(coap_context_t *context, const coap_str_const_t *path,
+                int create) {
+  coap_route_node_t *node;
+  coap_route_node_t *child;
+  coap_str_const_t segment;
+  size_t offset = 0;
+
+  if (!context->routes) {
+    if (!create || (context->routes = coap_route_node_new()) == NULL)
+      return NULL;
+  }
+  node = context->routes;
+  while (coap_route_segment(path, &offset, &segment)) {
+    if (coap_route_is_wildcard(path, offset, &segment))
+      return &node->wildcard;
+    if (coap_route_is_param(&segment)) {
+      if (!node->param) {
+        if (!create || (node->param = coap_route_node_new()) == NULL)
+          return NULL;
+      }
+      node = node->param;
+    }
+    else {
+      coap_string_t *decoded = coap_route_decode(&segment);
+
+      if (!decoded)
+        return NULL;
+      HASH_FIND(hh, node->children, decoded->s, decoded->length, child);
+      if (child) {
+        coap_delete_string(decoded);
+      }
+      else {
+        if (!create || (child = coap_route_node_new()) == NULL) {
+          coap_delete_string(decoded);
+          return NULL;
+        }
+        child->segment = decoded;
+        HASH_ADD_KEYPTR(hh, node->children, child->segment->s,
+                        child->segment->length, child);
+      }
+      node = child;
+    }
+  }
+  return &node->resource;
+}
+
+/*
+ * Removes @p resource from below @p node, following its route from
+ * @p offset.  Returns 1 if @p node is left empty and can go.
+ */
+static int
+coap_route_remove(coap_route_node_t *node, coap_resource_t *resource,
+                  size_t offset) {
+  const coap_str_const_t *path = resource->uri_path;
+  coap_str_const_t segment;
+
+  if (!coap_route_segment(path, &offset, &segment)) {
+    if (node->resource == resource)
+      node->resource = NULL;
+  }
+  else if (coap_route_is_wildcard(path, offset, &segment)) {
+    if (node->wildcard == resource)
+      node->wildcard = NULL;
+  }
+  else if (coap_route_is_param(&segment)) {
+    if (node->param && coap_route_remove(node->param, resource, offset)) {
+      coap_route_node_free(node->param);
+      node->param = NULL;
+    }
+  }
+  else {
+    coap_string_t *decoded = coap_route_decode(&segment);
+    coap_route_node_t *child = NULL;
+
+    if (decoded) {
+      HASH_FIND(hh, node->children, decoded->s, decoded->length, child);
+      coap_delete_string(decoded);
+    }
+    if (child && coap_route_remove(child, resource, offset)) {
+      HASH_DELETE(hh, node->children, child);
+      coap_route_node_free(child);
+    }
+  }
+  return !node->resource && !node->wildcard && !node->param &&
+         !node->children;
+}
+
+/*
+ * Matches the Uri-Path options that follow @p opt_iter below @p node.
+ * Literal segments are tried before {name} segments, and those before a
+ * wildcard.
+ */
+static coap_resource_t *
+coap_route_match(coap_route_node_t *node, const coap_opt_iterator_t *opt_iter) {
+  coap_opt_iterator_t next = *opt_iter;
+  coap_opt_t *q = coap_option_next(&next);
+  coap_route_node_t *child;
+  coap_resource_t *r;
+
+  if (!q)
+    return node->resource ? node->resource : node->wildcard;
+  HASH_FIND(hh, node->children, coap_opt_value(q), coap_opt_length(q), child);
+  if (child && (r = coap_route_match(child, &next)) != NULL)
+    return r;
+  if (node->param && (r = coap_route_match(node->param, &next)) != NULL)
+    return r;
+  return node->wildcard;
+}
+
+static void
+coap_route_add(coap_context_t *context, coap_resource_t *resource) {
+  coap_resource_t **slot = coap_route_slot(context, resource->uri_path, 0);
+
+  if (slot && *slot) {
+    coap_log(LOG_WARNING,
+             "coap_add_resource: Route '%*.*s' replaces '%*.*s', "
+             "old resource deleted\n",
+             (int)resource->uri_path->length, (int)resource->uri_path->length,
+             resource->uri_path->s,
+             (int)(*slot)->uri_path->length, (int)(*slot)->uri_path->length,
+             (*slot)->uri_path->s);
+    coap_delete_resource(context, *slot);
+  }
+  slot = coap_route_slot(context, resource->uri_path, 1);
+  if (slot) {
+    *slot = resource;
+    resource->is_route = 1;
+  }
+  else {
+    coap_log(LOG_WARNING,
+             "coap_add_resource: Route '%*.*s' only matches itself\n",
+             (int)resource->uri_path->length, (int)resource->uri_path->length,
+             resource->uri_path->s);
+  }
+}
+
 void
 coap_add_resource(coap_context_t *context, coap_resource_t *resource) {
   if (resource->is_unknown) {
@@ -553,12 +1262,82 @@ coap_add_resource(coap_context_t *context, coap_resource_t *resource) {
               resource->uri_path->s);
       coap_delete_resource(context, r);
     }
+    resource->seq = context->resource_seq++;
     RESOURCES_ADD(context->resources, resource);
+    if (resource->flags & COAP_RESOURCE_FLAGS_ROUTE)
+      coap_route_add(context, resource);
+    if (context->wellknown)
+      coap_wellknown_splice(context, context->wellknown_length, 0, resource);
+#ifndef WITHOUT_QUERY_FILTER
+    if (context->attr_index)
+      coap_attr_index_resource(context, resource, 1);
+#endif /* WITHOUT_QUERY_FILTER */
   }
   assert(resource->context == NULL);
   resource->context = context;
 }
 
+size_t
+coap_add_resources_compact(coap_context_t *context,
+                           const coap_resource_def_t *defs, size_t count) {
+  coap_catalog_t *catalog;
+  size_t n, a;
+
+  if (!context || !defs)
+    return 0;
+  catalog = coap_catalog_get(context);
+  if (!catalog) {
+    coap_log(LOG_DEBUG, "coap_add_resources_compact: no memory left\n");
+    return 0;
+  }
+
+  /* Printed out and indexed again when next asked for, rather than
+   * updated for every resource */
+  coap_free_type(COAP_STRING, context->wellknown);
+  context->wellknown = NULL;
+#ifndef WITHOUT_QUERY_FILTER
+  coap_attr_index_free(context);
+#endif /* WITHOUT_QUERY_FILTER */
+
+  for (n = 0; n < count; n++) {
+    const coap_resource_def_t *def = &defs[n];
+    coap_resource_t *r;
+
+    /* Without own_handler, as the handler set is shared */
+    r = (coap_resource_t *)coap_malloc_type(COAP_RESOURCE,
+                                  offsetof(coap_resource_t, own_handler));
+    if (!r)
+      break;
+    memset(r, 0, offsetof(coap_resource_t, own_handler));
+    r->compact = 1;
+    r->flags = def->flags & ~COAP_RESOURCE_FLAGS_RELEASE_URI;
+    r->user_data = def->user_data;
+    r->uri_path = coap_catalog_copy(catalog, def->uri_path.s,
+                                    def->uri_path.length);
+    r->handler = coap_catalog_handlers(catalog, def->handlers);
+    if (!r->uri_path || !r->handler) {
+      coap_free_type(COAP_RESOURCE, r);
+      break;
+    }
+    coap_add_resource(context, r);
+    for (a = 0; a < def->attr_count; a++) {
+      /* Copied, as coap_add_attr() interns the strings without changing them */
+      coap_str_const_t name = def->attrs[2 * a];
+      coap_str_const_t value = def->attrs[2 * a + 1];
+
+      if (!coap_add_attr(r, &name, value.s ? &value : NULL, 0))
+        break;
+    }
+    if (a < def->attr_count) {
+      n++;
+      break;
+    }
+  }
+  if (n < count)
+    coap_log(LOG_DEBUG, "coap_add_resources_compact: no memory left\n");
+  return n;
+}
+
 int
 coap_delete_resource(coap_context_t *context, coap_resource_t *resource) {
   if (!context || !resource)
@@ -576,7 +1355,18 @@ coap_delete_resource(coap_context_t *context, coap_resource_t *resource) {
   }
 
   /* remove resource from list */
+#ifndef WITHOUT_QUERY_FILTER
+  if (context->attr_index)
+    coap_attr_index_resource(context, resource, 0);
+#endif /* WITHOUT_QUERY_FILTER */
+  if (context->wellknown)
+    coap_wellknown_splice(context, coap_wellknown_offset(context, resource),
+                          resource->wellknown_length, NULL);
   RESOURCES_DELETE(context->resources, resource);
+  if (resource->is_route && coap_route_remove(context->routes, resource, 0)) {
+    coap_route_node_free(context->routes);
+    context->routes = NULL;
+  }
 
   /* and free its allocated memory */
   coap_free_resource(resource);
@@ -598,6 +1388,13 @@ coap_delete_all_resources(coap_context_t *context) {
   }
 
   context->resources = NULL;
+  coap_route_node_free(context->routes);
+  context->routes = NULL;
+  coap_free_type(COAP_STRING, context->wellknown);
+  context->wellknown = NULL;
+#ifndef WITHOUT_QUERY_FILTER
+  coap_attr_index_free(context);
+#endif /* WITHOUT_QUERY_FILTER */
 
   if (context->unknown_resource) {
     coap_free_resource(context->unknown_resource);
@@ -618,6 +1415,41 @@ coap_get_resource_from_uri_path(coap_context_t *context, coap_str_const_t *uri_p
   return result;
 }
 
+coap_resource_t *
+coap_get_resource_from_request(coap_context_t *context,
+                               const coap_pdu_t *request) {
+  UT_hash_handle *hh;
+  unsigned hashv;
+  unsigned bkt;
+  size_t length;
+
+  if (!context->resources)
+    return NULL;
+
+  length = coap_uri_path_hash(request, &hashv);
+  HASH_TO_BKT(hashv, context->resources->hh.tbl->num_buckets, bkt);
+  for (hh = context->resources->hh.tbl->buckets[bkt].hh_head; hh;
+       hh = hh->hh_next) {
+    if (hh->hashv == hashv && hh->keylen == length) {
+      coap_resource_t *r = ELMT_FROM_HH(context->resources->hh.tbl, hh);
+
+      /* A route only matches through the route index */
+      if (!r->is_route && coap_uri_path_equal(request, r->uri_path))
+        return r;
+    }
+  }
+  if (context->routes) {
+    coap_opt_iterator_t opt_iter;
+    coap_opt_filter_t f;
+
+    coap_option_filter_clear(&f);
+    coap_option_filter_set(&f, COAP_OPTION_URI_PATH);
+    coap_option_iterator_init(request, &opt_iter, &f);
+    return coap_route_match(context->routes, &opt_iter);
+  }
+  return NULL;
+}
+
 coap_print_status_t
 coap_print_link(const coap_resource_t *resource,
                 unsigned char *buf, size_t *len, size_t *offset) {
@@ -676,26 +1508,219 @@ coap_register_handler(coap_resource_t *resource,
                       coap_request_t method,
                       coap_method_handler_t handler) {
   assert(resource);
-  assert(method > 0 && (size_t)(method-1) < sizeof(resource->handler)/sizeof(coap_method_handler_t));
-  resource->handler[method-1] = handler;
+  assert(method > 0 && (size_t)(method-1) < COAP_RESOURCE_METHODS);
+  if (resource->handler != resource->own_handler) {
+    /* The handler set is shared with other compact resources */
+    coap_method_handler_t handlers[COAP_RESOURCE_METHODS];
+    coap_method_handler_t *set;
+
+    memcpy(handlers, resource->handler, sizeof(handlers));
+    handlers[method-1] = handler;
+    set = coap_catalog_handlers(resource->context->catalog, handlers);
+    if (set)
+      resource->handler = set;
+    else
+      coap_log(LOG_WARNING, "coap_register_handler: no memory left\n");
+    return;
+  }
+  resource->handler[method-1] = handler;
 }
 
 coap_subscription_t *
 coap_find_observer(coap_resource_t *resource, coap_session_t *session,
                      const coap_binary_t *token) {
   coap_subscription_t *s;
+  coap_subscription_t key;
 
   assert(resource);
   assert(session);
 
-  LL_FOREACH(resource->subscribers, s) {
-    if (s->session == session
-        && (!token || (token->length == s->token_length
-                       && memcmp(token->s, s->token, token->length) == 0)))
-      return s;
+  if (!token) {
+    LL_FOREACH(resource->subscribers, s) {
+      if (s->session == session)
+        return s;
+    }
+    return NULL;
   }
+  if (token->length > sizeof(key.token))
+    return NULL;
 
-  return NULL;
+  /* Unused token bytes are zero in the index as well */
+  memset(&key, 0, sizeof(key));
+  key.session = session;
+  key.token_length = token->length;
+  if (token->length)
+    memcpy(key.token, token->s, token->length);
+  HASH_FIND(hh, resource->subscriber_index, &key.session,
+            COAP_SUBSCRIPTION_KEY_LEN, s);
+  return s;
+}
+
+/*
+ * Takes @p s off the resource's list, index and list of dirty observers,
+ * and off the session's list of subscriptions.
+ */
+static void
+coap_observer_unlink(coap_resource_t *resource, coap_subscription_t *s) {
+  coap_observe_registry_removed(resource, s);
+  LL_DELETE(resource->subscribers, s);
+  HASH_DELETE(hh, resource->subscriber_index, s);
+  coap_observer_clear_dirty(resource, s);
+  DL_DELETE2(s->session->subscriptions, s, session_prev, session_next);
+  coap_observer_set_cond(resource, s, NULL);
+}
+
+/*
+ * Parses the conditional attributes out of the observe @p query, which is
+ * a list of name=value pairs separated by &.  Returns NULL if there are
+ * none (or no memory for them), when the observer is notified of every
+ * change.
+ */
+static coap_observe_cond_t *
+coap_observe_cond_parse(const coap_string_t *query) {
+  coap_observe_cond_t cond;
+  coap_observe_cond_t *c;
+  const uint8_t *p, *end;
+  int found = 0;
+
+  if (!query)
+    return NULL;
+  memset(&cond, 0, sizeof(cond));
+  p = query->s;
+  end = p + query->length;
+  while (p < end) {
+    const uint8_t *amp = memchr(p, '&', end - p);
+    const uint8_t *next = amp ? amp : end;
+    const uint8_t *eq = memchr(p, '=', next - p);
+    char buf[32];
+    char *rest;
+    double v;
+
+    if (eq && eq + 1 < next && (size_t)(next - eq - 1) < sizeof(buf)) {
+      size_t name_len = eq - p;
+
+      memcpy(buf, eq + 1, next - eq - 1);
+      buf[next - eq - 1] = '\0';
+      v = strtod(buf, &rest);
+      /* v == v is false for NaN */
+      if (*rest == '\0' && v == v) {
+#define COAP_COND_NAME(n) \
+  (name_len == sizeof(n) - 1 && memcmp(p, n, sizeof(n) - 1) == 0)
+        if (COAP_COND_NAME("pmin") && v >= 0) {
+          cond.pmin = (coap_tick_t)(v * COAP_TICKS_PER_SECOND);
+          found = 1;
+        } else if (COAP_COND_NAME("pmax") && v > 0) {
+          cond.pmax = (coap_tick_t)(v * COAP_TICKS_PER_SECOND);
+          found = 1;
+        } else if (COAP_COND_NAME("gt")) {
+          cond.gt = v;
+          cond.has_gt = found = 1;
+        } else if (COAP_COND_NAME("lt")) {
+          cond.lt = v;
+          cond.has_lt = found = 1;
+        } else if (COAP_COND_NAME("st") && v > 0) {
+          cond.st = v;
+          cond.has_st = found = 1;
+        }
+#undef COAP_COND_NAME
+      }
+    }
+    p = next + 1;
+  }
+  if (!found)
+    return NULL;
+  /* A pmax that is not greater than pmin is ignored */
+  if (cond.pmax && cond.pmax <= cond.pmin)
+    cond.pmax = 0;
+
+  c = coap_malloc_type(COAP_STRING, sizeof(coap_observe_cond_t));
+  if (c)
+    *c = cond;
+  return c;
+}
+
+/* Records that @p obs is being notified of the current state at @p now */
+static void
+coap_observe_cond_sent(coap_resource_t *r, coap_subscription_t *obs,
+                       coap_tick_t now) {
+  coap_observe_cond_t *c = obs->cond;
+
+  c->last_sent = now;
+  c->last_value = r->value;
+  c->has_value = r->has_value;
+  c->pending = 0;
+}
+
+/*
+ * Replaces the conditional attributes of @p s by those in @p query, or
+ * drops them if @p query is NULL.  A (re-)registration is answered with
+ * the current state, so it counts as a notification.
+ */
+static void
+coap_observer_set_cond(coap_resource_t *resource, coap_subscription_t *s,
+                       const coap_string_t *query) {
+  if (s->cond) {
+    coap_free_type(COAP_STRING, s->cond);
+    s->cond = NULL;
+    s->session->obs_cond_count--;
+  }
+  s->cond = coap_observe_cond_parse(query);
+  if (s->cond) {
+    coap_tick_t now;
+
+    s->session->obs_cond_count++;
+    coap_ticks(&now);
+    coap_observe_cond_sent(resource, s, now);
+    if (s->cond->pmax)
+      coap_session_timer_arm(s->session, now + s->cond->pmax);
+  }
+}
+
+/*
+ * Checks whether the value of @p r has moved far enough from the one last
+ * notified for the step and threshold conditions of @p c.
+ */
+static int
+coap_observe_cond_changed(const coap_resource_t *r,
+                          const coap_observe_cond_t *c) {
+  double v = r->value;
+  double last = c->last_value;
+
+  if (!r->has_value || !c->has_value ||
+      !(c->has_st || c->has_gt || c->has_lt))
+    return 1;
+  if (c->has_st && (v - last >= c->st || last - v >= c->st))
+    return 1;
+  if (c->has_gt && (v > c->gt) != (last > c->gt))
+    return 1;
+  if (c->has_lt && (v < c->lt) != (last < c->lt))
+    return 1;
+  return 0;
+}
+
+/*
+ * Checks the conditional attributes of @p obs on a change of @p r, and
+ * returns 1 if it is to be notified now.  A change that comes too soon
+ * after the last notification is held back until pmin has passed.
+ */
+static int
+coap_observe_cond_due(coap_resource_t *r, coap_subscription_t *obs,
+                      coap_tick_t now) {
+  coap_observe_cond_t *c = obs->cond;
+
+  if (!c)
+    return 1;
+  if (!c->pending && !coap_observe_cond_changed(r, c))
+    return 0;
+  if (c->pmin && now < c->last_sent + c->pmin) {
+    c->pending = 1;
+    coap_session_timer_arm(obs->session, c->last_sent + c->pmin);
+    return 0;
+  }
+  coap_observe_cond_sent(r, obs, now);
+  if (c->pmax)
+    coap_session_timer_arm(obs->session, now + c->pmax);
+  return 1;
 }
 
 static coap_subscription_t *
@@ -751,11 +1776,16 @@ coap_add_observer(coap_resource_t *resource,
       coap_delete_string(s->query);
     s->query = query;
     s->code = code;
+    coap_observer_set_cond(resource, s, query);
     return s;
   }
 
   /* Create a new subscription */
+#if COAP_SUBSCRIPTION_SLABS
+  s = coap_subscription_alloc(resource);
+#else /* ! COAP_SUBSCRIPTION_SLABS */
   s = COAP_MALLOC_TYPE(subscription);
+#endif /* ! COAP_SUBSCRIPTION_SLABS */
 
   if (!s) {
     /* query is not deleted so it can be used in the calling function
@@ -764,7 +1794,9 @@ coap_add_observer(coap_resource_t *resource,
     return NULL;
   }
 
+#if !COAP_SUBSCRIPTION_SLABS
   coap_subscription_init(s);
+#endif /* ! COAP_SUBSCRIPTION_SLABS */
   s->session = coap_session_reference( session );
 
   if (token && token->length) {
@@ -781,6 +1813,12 @@ coap_add_observer(coap_resource_t *resource,
 
   /* add subscriber to resource */
   LL_PREPEND(resource->subscribers, s);
+  HASH_ADD(hh, resource->subscriber_index, session,
+           COAP_SUBSCRIPTION_KEY_LEN, s);
+  s->resource = resource;
+  DL_APPEND2(session->subscriptions, s, session_prev, session_next);
+  coap_observer_set_cond(resource, s, query);
+  coap_observe_registry_added(resource, s);
 
   coap_log(LOG_DEBUG, "create new subscription\n");
 
@@ -792,11 +1830,11 @@ coap_touch_observer(coap_context_t *context, coap_session_t *session,
                     const coap_binary_t *token) {
   coap_subscription_t *s;
 
-  RESOURCES_ITER(context->resources, r) {
-    s = coap_find_observer(r, session, token);
-    if (s) {
+  (void)context;
+  DL_FOREACH2(session->subscriptions, s, session_next) {
+    if (!token || (token->length == s->token_length &&
+                   memcmp(token->s, s->token, token->length) == 0))
       s->fail_cnt = 0;
-    }
   }
 }
 
@@ -807,7 +1845,7 @@ coap_delete_observer(coap_resource_t *resource, coap_session_t *session,
 
   s = coap_find_observer(resource, session, token);
 
-  if ( s && coap_get_log_level() >= LOG_DEBUG ) {
+  if ( s && coap_log_enabled(LOG_DEBUG) ) {
     char outbuf[2 * 8 + 1] = "";
     unsigned int i;
     for ( i = 0; i < s->token_length; i++ )
@@ -816,11 +1854,11 @@ coap_delete_observer(coap_resource_t *resource, coap_session_t *session,
   }
 
   if (resource->subscribers && s) {
-    LL_DELETE(resource->subscribers, s);
+    coap_observer_unlink(resource, s);
     coap_session_release( session );
     if (s->query)
       coap_delete_string(s->query);
-    COAP_FREE_TYPE(subscription,s);
+    COAP_SUBSCRIPTION_FREE(resource, s);
   }
 
   return s != NULL;
@@ -828,125 +1866,365 @@ coap_delete_observer(coap_resource_t *resource, coap_session_t *session,
 
 void
 coap_delete_observers(coap_context_t *context, coap_session_t *session) {
-  RESOURCES_ITER(context->resources, resource) {
-    coap_subscription_t *s, *tmp;
-    LL_FOREACH_SAFE(resource->subscribers, s, tmp) {
-      if (s->session == session) {
-        LL_DELETE(resource->subscribers, s);
-        coap_session_release(session);
-        if (s->query)
-          coap_delete_string(s->query);
-        COAP_FREE_TYPE(subscription, s);
-      }
-    }
+  coap_subscription_t *s;
+
+  (void)context;
+  while ((s = session->subscriptions) != NULL) {
+    coap_resource_t *resource = s->resource;
+
+    coap_observer_unlink(resource, s);
+    coap_session_release(session);
+    if (s->query)
+      coap_delete_string(s->query);
+    COAP_SUBSCRIPTION_FREE(resource, s);
   }
 }
 
+/*
+ * Queues @p r on the context's list of dirty resources so that it gets
+ * looked at by the next coap_check_notify().
+ */
 static void
-coap_notify_observers(coap_context_t *context, coap_resource_t *r,
-                      coap_deleting_resource_t deleting) {
+coap_resource_queue_dirty(coap_context_t *context, coap_resource_t *r) {
+  context->observe_pending = 1;
+  if (!r->dirty_queued) {
+    r->dirty_queued = 1;
+    DL_APPEND2(context->dirty_resources, r, dirty_prev, dirty_next);
+  }
+}
+
+static void
+coap_resource_unqueue_dirty(coap_context_t *context, coap_resource_t *r) {
+  if (r->dirty_queued) {
+    r->dirty_queued = 0;
+    DL_DELETE2(context->dirty_resources, r, dirty_prev, dirty_next);
+  }
+}
+
+/*
+ * Marks @p obs as still to be notified. The resource is partially dirty
+ * until all the dirty observers have been notified.
+ */
+static void
+coap_observer_set_dirty(coap_resource_t *r, coap_subscription_t *obs) {
+  if (!obs->dirty) {
+    obs->dirty = 1;
+    DL_APPEND2(r->dirty_subscribers, obs, dirty_prev, dirty_next);
+  }
+  r->partiallydirty = 1;
+}
+
+static void
+coap_observer_clear_dirty(coap_resource_t *r, coap_subscription_t *obs) {
+  if (obs->dirty) {
+    obs->dirty = 0;
+    DL_DELETE2(r->dirty_subscribers, obs, dirty_prev, dirty_next);
+  }
+}
+
+/*
+ * State kept across one notification round of a resource flagged with
+ * COAP_RESOURCE_FLAGS_NOTIFY_FANOUT. The first observer without a query
+ * has its response built by the handler, which then becomes the template
+ * for the other observers whose responses would be encoded identically.
+ */
+typedef struct coap_notify_fanout_t {
+  coap_pdu_t *pdu;          /**< template response, or NULL if none yet */
+  coap_lg_xmit_t *lg_xmit;  /**< private BLOCK2 state copy, or NULL */
+  coap_session_t *session;  /**< session the template was built for */
+  size_t max_size;          /**< maximum PDU size of the template session */
+  uint8_t block_mode;       /**< block mode of the template session */
+  uint8_t has_block2;       /**< template observer's has_block2 */
+  uint8_t szx;              /**< template observer's block size */
+} coap_notify_fanout_t;
+
+static int
+coap_notify_fanout_match(const coap_notify_fanout_t *fanout,
+                         coap_subscription_t *obs) {
+  return fanout->pdu && obs->query == NULL &&
+         fanout->block_mode == obs->session->block_mode &&
+         fanout->max_size == coap_session_max_pdu_size(obs->session) &&
+         fanout->has_block2 == obs->has_block2 &&
+         (!obs->has_block2 || fanout->szx == obs->block.szx);
+}
+
+/*
+ * Keeps the handler generated @p response (and a copy of any BLOCK2
+ * state the handler set up) for the other observers of @p r.
+ */
+static void
+coap_notify_fanout_capture(coap_notify_fanout_t *fanout, coap_resource_t *r,
+                           coap_subscription_t *obs, coap_pdu_t *response) {
+  coap_block_t block;
+
+  if (COAP_RESPONSE_CLASS(response->code) != 2)
+    return;
+
+  if (coap_get_block(response, COAP_OPTION_BLOCK2, &block) && block.m) {
+    coap_lg_xmit_t *lg_xmit;
+
+    lg_xmit = coap_block_find_lg_xmit_response(obs->session, r, NULL, NULL);
+    if (!lg_xmit)
+      return;
+    fanout->lg_xmit = coap_block_copy_lg_xmit(obs->session, lg_xmit);
+    if (!fanout->lg_xmit)
+      return;
+  }
+
+  /* The response is not changed once it has been built, so is shared */
+  fanout->pdu = coap_pdu_reference(response);
+  fanout->session = coap_session_reference(obs->session);
+  fanout->max_size = coap_session_max_pdu_size(obs->session);
+  fanout->block_mode = obs->session->block_mode;
+  fanout->has_block2 = obs->has_block2;
+  fanout->szx = obs->block.szx;
+}
+
+static void
+coap_notify_fanout_release(coap_notify_fanout_t *fanout) {
+  if (fanout->pdu) {
+    coap_block_delete_lg_xmit(fanout->session, fanout->lg_xmit);
+    coap_delete_pdu(fanout->pdu);
+    coap_session_release(fanout->session);
+  }
+}
+
+/*
+ * Sends the notification for @p r to the single observer @p obs. If the
+ * notification cannot be sent now, @p obs is marked dirty again.
+ * If @p fanout is not NULL, the response may be copied from (or become)
+ * the template for this round instead of calling the handler.
+ */
+static void
+coap_notify_observer(coap_context_t *context, coap_resource_t *r,
+                     coap_subscription_t *obs,
+                     coap_deleting_resource_t deleting,
+                     coap_notify_fanout_t *fanout) {
   coap_method_handler_t h;
-  coap_subscription_t *obs;
   coap_binary_t token;
   coap_pdu_t *response;
+  coap_mid_t mid = COAP_INVALID_MID;
+  coap_arena_t arena;
+  coap_arena_t *outer_arena;
+  uint8_t arena_buf[COAP_REQUEST_ARENA_SIZE];
+  int cancel = 0;
+  uint8_t tx_class;
+
+  if (context->tx_budget_bulk &&
+      context->tx_bulk_sent >= context->tx_budget_bulk) {
+    /* The rest is sent in the next I/O processing iteration */
+    coap_observer_set_dirty(r, obs);
+    coap_resource_queue_dirty(context, r);
+    context->tx_deferred = 1;
+    return;
+  }
+  if (obs->session->con_active >= obs->session->nstart &&
+      ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) ||
+       (obs->non_cnt >= COAP_OBS_MAX_NON))) {
+    coap_observer_set_dirty(r, obs);
+    coap_resource_queue_dirty(context, r);
+    return;
+  }
 
-  if (r->observable && (r->dirty || r->partiallydirty)) {
-    r->partiallydirty = 0;
-
-    LL_FOREACH(r->subscribers, obs) {
-      if (r->dirty == 0 && obs->dirty == 0) {
-        /*
-         * running this resource due to partiallydirty, but this observation's
-         * notification was already enqueued
-         */
-        context->observe_pending = 1;
-        continue;
+  if (fanout && coap_notify_fanout_match(fanout, obs)) {
+    /* Only the token, message id and type differ from the template */
+    response = coap_pdu_copy(fanout->pdu,
+                             coap_new_message_id(obs->session),
+                             coap_session_max_pdu_size(obs->session),
+                             obs->token_length, obs->token);
+    if (response && fanout->lg_xmit) {
+      coap_lg_xmit_t *lg_xmit = coap_block_copy_lg_xmit(fanout->session,
+                                                        fanout->lg_xmit);
+      if (lg_xmit) {
+        coap_block_add_lg_xmit(obs->session, lg_xmit);
       }
-      if (obs->session->con_active >= COAP_DEFAULT_NSTART &&
-          ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) ||
-           (obs->non_cnt >= COAP_OBS_MAX_NON))) {
-        r->partiallydirty = 1;
-        obs->dirty = 1;
-        context->observe_pending = 1;
-        continue;
+      else {
+        coap_delete_pdu(response);
+        response = NULL;
       }
+    }
+    if (!response) {
+      coap_observer_set_dirty(r, obs);
+      coap_resource_queue_dirty(context, r);
+      coap_log(LOG_DEBUG,
+               "coap_check_notify: pdu copy failed, resource stays "
+               "partially dirty\n");
+      return;
+    }
+    obs->mid = response->mid;
+    if ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) == 0 &&
+        ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS) ||
+         obs->non_cnt < COAP_OBS_MAX_NON)) {
+      response->type = COAP_MESSAGE_NON;
+    } else {
+      response->type = COAP_MESSAGE_CON;
+    }
+    goto send;
+  }
 
-      coap_mid_t mid = COAP_INVALID_MID;
-      obs->dirty = 0;
-      /* initialize response */
-      response = coap_pdu_init(COAP_MESSAGE_CON, 0, 0, coap_session_max_pdu_size(obs->session));
-      if (!response) {
-        obs->dirty = 1;
-        r->partiallydirty = 1;
-        context->observe_pending = 1;
-        coap_log(LOG_DEBUG,
-                 "coap_check_notify: pdu init failed, resource stays "
-                 "partially dirty\n");
-        continue;
-      }
+  /* initialize response */
+  response = coap_pdu_init(COAP_MESSAGE_CON, 0, 0, coap_session_max_pdu_size(obs->session));
+  if (!response) {
+    coap_observer_set_dirty(r, obs);
+    coap_resource_queue_dirty(context, r);
+    coap_log(LOG_DEBUG,
+             "coap_check_notify: pdu init failed, resource stays "
+             "partially dirty\n");
+    return;
+  }
 
-      if (!coap_add_token(response, obs->token_length, obs->token)) {
-        obs->dirty = 1;
-        r->partiallydirty = 1;
-        context->observe_pending = 1;
-        coap_log(LOG_DEBUG,
-                 "coap_check_notify: cannot add token, resource stays "
-                 "partially dirty\n");
-        coap_delete_pdu(response);
-        continue;
-      }
+  if (!coap_add_token(response, obs->token_length, obs->token)) {
+    coap_observer_set_dirty(r, obs);
+    coap_resource_queue_dirty(context, r);
+    coap_log(LOG_DEBUG,
+             "coap_check_notify: cannot add token, resource stays "
+             "partially dirty\n");
+    coap_delete_pdu(response);
+    return;
+  }
 
-      token.length = obs->token_length;
-      token.s = obs->token;
+  token.length = obs->token_length;
+  token.s = obs->token;
 
-      obs->mid = response->mid = coap_new_message_id(obs->session);
-      if ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) == 0 &&
-          ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS) ||
-           obs->non_cnt < COAP_OBS_MAX_NON)) {
-        response->type = COAP_MESSAGE_NON;
-      } else {
-        response->type = COAP_MESSAGE_CON;
-      }
-      switch (deleting) {
-      case COAP_NOT_DELETING_RESOURCE:
-        /* fill with observer-specific data */
-
-        h = r->handler[obs->code - 1];
-        assert(h);      /* we do not allow subscriptions if no
-                         * GET/FETCH handler is defined */
-        h(context, r, obs->session, NULL, &token, obs->query, response);
-        /* Check if lg_xmit generated and update PDU code if so */
-        coap_check_code_lg_xmit(obs->session, response, r, obs->query);
-        if (COAP_RESPONSE_CLASS(response->code) > 2) {
-          coap_delete_observer(r, obs->session, &token);
-        }
-        break;
-      case COAP_DELETING_RESOURCE:
-      default:
-        response->type = COAP_MESSAGE_NON;
-        response->code = COAP_RESPONSE_CODE(404);
-        break;
-      }
+  obs->mid = response->mid = coap_new_message_id(obs->session);
+  if ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_CON) == 0 &&
+      ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS) ||
+       obs->non_cnt < COAP_OBS_MAX_NON)) {
+    response->type = COAP_MESSAGE_NON;
+  } else {
+    response->type = COAP_MESSAGE_CON;
+  }
+  switch (deleting) {
+  case COAP_NOT_DELETING_RESOURCE:
+    /* fill with observer-specific data */
+
+    h = r->handler[obs->code - 1];
+    assert(h);      /* we do not allow subscriptions if no
+                     * GET/FETCH handler is defined */
+    coap_arena_init(&arena, arena_buf, sizeof(arena_buf));
+    outer_arena = context->request_arena;
+    context->request_arena = &arena;
+    h(context, r, obs->session, NULL, &token, obs->query, response);
+    /* Check if lg_xmit generated and update PDU code if so */
+    coap_check_code_lg_xmit(obs->session, response, r, NULL, obs->query);
+    coap_resource_add_etag(r, response);
+    if (fanout && !fanout->pdu && obs->query == NULL)
+      coap_notify_fanout_capture(fanout, r, obs, response);
+    context->request_arena = outer_arena;
+    coap_arena_release(&arena);
+    /* The observer is deleted once the response is on its way */
+    cancel = COAP_RESPONSE_CLASS(response->code) > 2;
+    break;
+  case COAP_DELETING_RESOURCE:
+  default:
+    response->type = COAP_MESSAGE_NON;
+    response->code = COAP_RESPONSE_CODE(404);
+    break;
+  }
 
-      if (response->type == COAP_MESSAGE_CON ||
-          (r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS)) {
-        obs->non_cnt = 0;
-      } else {
-        obs->non_cnt++;
-      }
+send:
+  COAP_PROBE_PDU(notify, obs->session, response);
+  if (response->type == COAP_MESSAGE_CON ||
+      (r->flags & COAP_RESOURCE_FLAGS_NOTIFY_NON_ALWAYS)) {
+    obs->non_cnt = 0;
+  } else {
+    obs->non_cnt++;
+  }
 
-      mid = coap_send( obs->session, response );
+  tx_class = context->tx_class;
+  context->tx_class = COAP_TX_BULK;
+  mid = coap_send( obs->session, response );
+  context->tx_class = tx_class;
+
+  if (cancel) {
+    coap_delete_observer(r, obs->session, &token);
+  } else if (COAP_INVALID_MID == mid) {
+    coap_log(LOG_DEBUG,
+             "coap_check_notify: sending failed, resource stays "
+             "partially dirty\n");
+    coap_observer_set_dirty(r, obs);
+    coap_resource_queue_dirty(context, r);
+  }
+}
 
-      if (COAP_INVALID_MID == mid) {
-        coap_log(LOG_DEBUG,
-                 "coap_check_notify: sending failed, resource stays "
-                 "partially dirty\n");
-        obs->dirty = 1;
-        r->partiallydirty = 1;
-        context->observe_pending = 1;
-      }
+static void
+coap_notify_observers(coap_context_t *context, coap_resource_t *r,
+                      coap_deleting_resource_t deleting) {
+  coap_subscription_t *obs;
+#if !COAP_SUBSCRIPTION_SLABS
+  coap_subscription_t *otmp;
+#endif /* ! COAP_SUBSCRIPTION_SLABS */
+  coap_notify_fanout_t fanout;
+  coap_notify_fanout_t *fanout_p = NULL;
+
+  if (r->observable && (r->dirty || r->partiallydirty)) {
+    uint64_t start = context->histograms ? coap_histogram_clock() : 0;
 
+    r->partiallydirty = 0;
+
+    if ((r->flags & COAP_RESOURCE_FLAGS_NOTIFY_FANOUT) &&
+        deleting == COAP_NOT_DELETING_RESOURCE) {
+      memset(&fanout, 0, sizeof(fanout));
+      fanout_p = &fanout;
+    }
+
+    if (r->dirty) {
+      coap_tick_t now;
+
+      /*
+       * Every observer gets notified, including the dirty ones, unless
+       * held back by its conditional attributes
+       */
+      coap_ticks(&now);
+      while (r->dirty_subscribers)
+        coap_observer_clear_dirty(r, r->dirty_subscribers);
+#if COAP_SUBSCRIPTION_SLABS
+      {
+        coap_subscription_slab_t *slab;
+        unsigned int notifying = r->notifying;
+        unsigned int i;
+
+        /* Slabs emptied on the way are kept until the scan is over */
+        r->notifying = 1;
+        DL_FOREACH(r->subscription_slabs, slab) {
+          for (i = 0; i < slab->size; i++) {
+            obs = &slab->slot[i];
+            if (obs->session &&
+                (deleting != COAP_NOT_DELETING_RESOURCE ||
+                 coap_observe_cond_due(r, obs, now)))
+              coap_notify_observer(context, r, obs, deleting, fanout_p);
+          }
+        }
+        r->notifying = notifying;
+        if (!notifying)
+          coap_subscription_slabs_trim(r);
+      }
+#else /* ! COAP_SUBSCRIPTION_SLABS */
+      LL_FOREACH_SAFE(r->subscribers, obs, otmp) {
+        if (deleting != COAP_NOT_DELETING_RESOURCE ||
+            coap_observe_cond_due(r, obs, now))
+          coap_notify_observer(context, r, obs, deleting, fanout_p);
+      }
+#endif /* ! COAP_SUBSCRIPTION_SLABS */
+    } else {
+      unsigned int count;
+
+      /*
+       * Only the observers that were not notified of the last change are
+       * looked at. Observers that fail again are appended, so stop after
+       * the ones that were dirty on entry.
+       */
+      DL_COUNT2(r->dirty_subscribers, obs, count, dirty_next);
+      while (count-- && (obs = r->dirty_subscribers) != NULL) {
+        coap_observer_clear_dirty(r, obs);
+        coap_notify_observer(context, r, obs, deleting, fanout_p);
+      }
     }
+
+    if (fanout_p)
+      coap_notify_fanout_release(fanout_p);
+    if (start)
+      coap_histogram_record_since(&context->notify_histogram, start);
   }
   r->dirty = 0;
 }
@@ -956,10 +2234,32 @@ coap_resource_set_dirty(coap_resource_t *r, const coap_string_t *query) {
   return coap_resource_notify_observers(r, query);
 }
 
+static int
+coap_resource_notify(coap_resource_t *r, const coap_string_t *query,
+                     const double *value);
+
+int
+coap_resource_notify_observers_value(coap_resource_t *r, double value) {
+  r->value = value;
+  r->has_value = 1;
+  return coap_resource_notify(r, NULL, &value);
+}
+
 int
 coap_resource_notify_observers(coap_resource_t *r, const coap_string_t *query) {
+  return coap_resource_notify(r, query, NULL);
+}
+
+static int
+coap_resource_notify(coap_resource_t *r, const coap_string_t *query,
+                     const double *value) {
+  /* Any cached responses and the ETag are out of date, observed or not */
+  coap_cache_invalidate_resource(r);
+  r->etag = 0;
   if (!r->observable)
     return 0;
+  /* The observers on the other nodes of a cluster are notified by them */
+  coap_observe_registry_publish(r, query, value);
   if (query) {
     coap_subscription_t *obs;
     int found = 0;
@@ -968,10 +2268,8 @@ coap_resource_notify_observers(coap_resource_t *r, const coap_string_t *query) {
        && obs->query->length==query->length
        && memcmp(obs->query->s, query->s, query->length)==0 ) {
         found = 1;
-        if (!r->dirty && !obs->dirty) {
-          obs->dirty = 1;
-          r->partiallydirty = 1;
-        }
+        if (!r->dirty)
+          coap_observer_set_dirty(r, obs);
       }
     }
     if (!found)
@@ -986,7 +2284,18 @@ coap_resource_notify_observers(coap_resource_t *r, const coap_string_t *query) {
   r->observe = (r->observe + 1) & 0xFFFFFF;
 
   assert(r->context);
-  r->context->observe_pending = 1;
+  coap_resource_queue_dirty(r->context, r);
+#ifdef COAP_EVENT_QUEUE_SUPPORT
+  if (r->context->io_external) {
+    coap_tick_t now;
+
+    /* Have coap_io_do_timers() called at once to send the notifications */
+    coap_io_ticks(r->context, &now);
+    if (!r->context->io_timer_due || r->context->io_timer_due > now + 1)
+      coap_io_external_set_timer(r->context, 1);
+    return 1;
+  }
+#endif /* COAP_EVENT_QUEUE_SUPPORT */
 #ifdef COAP_EPOLL_SUPPORT
   if (r->context->eptimerfd != -1) {
     /* Need to immediately trigger any epoll_wait() */
@@ -1003,7 +2312,10 @@ coap_resource_notify_observers(coap_resource_t *r, const coap_string_t *query) {
                 coap_socket_strerror(), errno);
     }
   }
-#endif /* COAP_EPOLL_SUPPORT */
+#elif defined(COAP_KQUEUE_SUPPORT)
+  /* Need to immediately trigger any kevent() */
+  coap_context_wake_io(r->context);
+#endif /* COAP_KQUEUE_SUPPORT */
   return 1;
 }
 
@@ -1033,6 +2345,7 @@ coap_resource_release_userdata_handler(coap_context_t *context,
 void
 coap_resource_set_get_observable(coap_resource_t *resource, int mode) {
   resource->observable = mode ? 1 : 0;
+  coap_wellknown_update(resource);
 }
 
 coap_str_const_t*
@@ -1042,66 +2355,134 @@ coap_resource_get_uri_path(coap_resource_t *resource) {
   return NULL;
 }
 
+int
+coap_resource_get_route_param(const coap_resource_t *resource,
+                              const coap_pdu_t *request,
+                              const char *name,
+                              coap_str_const_t *value) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t f;
+  coap_opt_t *q;
+  coap_str_const_t segment;
+  size_t offset = 0;
+  size_t name_length;
+
+  if (!resource || !resource->is_route || !request || !name || !value)
+    return 0;
+  name_length = strlen(name);
+  coap_option_filter_clear(&f);
+  coap_option_filter_set(&f, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(request, &opt_iter, &f);
+  while (coap_route_segment(resource->uri_path, &offset, &segment)) {
+    q = coap_option_next(&opt_iter);
+    if (!q)
+      break;
+    if (coap_route_is_param(&segment) && segment.length == name_length + 2 &&
+        memcmp(segment.s + 1, name, name_length) == 0) {
+      value->s = coap_opt_value(q);
+      value->length = coap_opt_length(q);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void *
+coap_request_alloc(coap_context_t *context, size_t size) {
+  if (!context || !context->request_arena)
+    return NULL;
+  return coap_arena_alloc(context->request_arena, size);
+}
+
 void
 coap_check_notify(coap_context_t *context) {
 
-  if (context->observe_pending) {
+  if (context->dirty_resources) {
+    coap_resource_t *r;
+    unsigned int count;
+
     context->observe_pending = 0;
-    RESOURCES_ITER(context->resources, r) {
+    /* Resources that stay partially dirty are queued again at the end */
+    DL_COUNT2(context->dirty_resources, r, count, dirty_next);
+    while (count-- && (r = context->dirty_resources) != NULL) {
+      coap_resource_unqueue_dirty(context, r);
       coap_notify_observers(context, r, COAP_NOT_DELETING_RESOURCE);
     }
   }
 }
 
+coap_tick_t
+coap_observe_cond_check_timeouts(coap_session_t *session, coap_tick_t now) {
+  coap_subscription_t *obs, *otmp;
+  coap_tick_t next = 0;
+
+  DL_FOREACH_SAFE2(session->subscriptions, obs, otmp, session_next) {
+    coap_observe_cond_t *c = obs->cond;
+    coap_resource_t *r = obs->resource;
+    coap_tick_t due = 0;
+
+    if (!c)
+      continue;
+    if (c->pending)
+      due = c->last_sent + c->pmin;
+    if (c->pmax && (!due || c->last_sent + c->pmax < due))
+      due = c->last_sent + c->pmax;
+    if (!due)
+      continue;
+    if (due <= now) {
+      coap_observe_cond_sent(r, obs, now);
+      due = c->pmax ? now + c->pmax : 0;
+      if (r->observable) {
+        /* A refresh is a new notification as far as the client is
+         * concerned */
+        r->observe = (r->observe + 1) & 0xFFFFFF;
+        coap_notify_observer(session->context, r, obs,
+                             COAP_NOT_DELETING_RESOURCE, NULL);
+      }
+      /* obs may have gone if the handler failed */
+    }
+    if (due && (!next || due < next))
+      next = due;
+  }
+  return next;
+}
+
 /**
- * Checks the failure counter for (peer, token) and removes peer from
- * the list of observers for the given resource when COAP_OBS_MAX_FAIL
- * is reached.
+ * Counts a failed notify of @p obs and removes it from the observers of
+ * its resource when COAP_OBS_MAX_FAIL is reached.
  *
  * @param context  The CoAP context to use
- * @param resource The resource to check for (peer, token)
- * @param session  The observer's session
- * @param token    The token that has been used for subscription.
+ * @param obs      The observer the notify failed for.
  */
 static void
 coap_remove_failed_observers(coap_context_t *context,
-                             coap_resource_t *resource,
-                             coap_session_t *session,
-                             const coap_binary_t *token) {
-  coap_subscription_t *obs, *otmp;
-
-  LL_FOREACH_SAFE(resource->subscribers, obs, otmp) {
-    if ( obs->session == session &&
-        token->length == obs->token_length &&
-        memcmp(token->s, obs->token, token->length) == 0) {
+                             coap_subscription_t *obs) {
+  /* count failed notifies and remove when
+   * COAP_MAX_FAILED_NOTIFY is reached */
+  if (obs->fail_cnt < COAP_OBS_MAX_FAIL)
+    obs->fail_cnt++;
+  else {
+    coap_resource_t *resource = obs->resource;
 
-      /* count failed notifies and remove when
-       * COAP_MAX_FAILED_NOTIFY is reached */
-      if (obs->fail_cnt < COAP_OBS_MAX_FAIL)
-        obs->fail_cnt++;
-      else {
-        LL_DELETE(resource->subscribers, obs);
-        obs->fail_cnt = 0;
+    coap_observer_unlink(resource, obs);
+    obs->fail_cnt = 0;
 
-        if (LOG_DEBUG <= coap_get_log_level()) {
+    if (coap_log_enabled(LOG_DEBUG)) {
 #ifndef INET6_ADDRSTRLEN
 #define INET6_ADDRSTRLEN 40
 #endif
-          unsigned char addr[INET6_ADDRSTRLEN+8];
+      unsigned char addr[INET6_ADDRSTRLEN+8];
 
-          if (coap_print_addr(&obs->session->addr_info.remote,
-                              addr, INET6_ADDRSTRLEN+8))
-            coap_log(LOG_DEBUG, "** removed observer %s\n", addr);
-        }
-        coap_cancel_all_messages(context, obs->session,
-                                 obs->token, obs->token_length);
-        coap_session_release( obs->session );
-        if (obs->query)
-          coap_delete_string(obs->query);
-        COAP_FREE_TYPE(subscription, obs);
-      }
-      break;                        /* break loop if observer was found */
+      if (coap_print_addr(&obs->session->addr_info.remote,
+                          addr, INET6_ADDRSTRLEN+8))
+        coap_log(LOG_DEBUG, "** removed observer %s\n", addr);
     }
+    coap_cancel_all_messages(context, obs->session,
+                             obs->token, obs->token_length);
+    coap_session_release( obs->session );
+    if (obs->query)
+      coap_delete_string(obs->query);
+    COAP_SUBSCRIPTION_FREE(resource, obs);
   }
 }
 
@@ -1109,8 +2490,250 @@ void
 coap_handle_failed_notify(coap_context_t *context,
                           coap_session_t *session,
                           const coap_binary_t *token) {
+  coap_subscription_t *obs, *otmp;
 
-  RESOURCES_ITER(context->resources, r) {
-        coap_remove_failed_observers(context, r, session, token);
+  DL_FOREACH_SAFE2(session->subscriptions, obs, otmp, session_next) {
+    if (token->length == obs->token_length &&
+        memcmp(token->s, obs->token, token->length) == 0)
+      coap_remove_failed_observers(context, obs);
   }
 }
+
+uint64_t
+coap_resource_etag(coap_resource_t *resource) {
+  if (resource->etag == 0) {
+    if (++resource->context->etag == 0)
+      ++resource->context->etag;
+    resource->etag = resource->context->etag;
+  }
+  return resource->etag;
+}
+
+/* Returns 1 if one of the @p type options of @p request holds @p etag */
+static int
+coap_resource_etag_listed(coap_pdu_t *request, uint16_t type, uint64_t etag,
+                          int *empty) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t filter;
+  coap_opt_t *option;
+
+  coap_option_filter_clear(&filter);
+  coap_option_filter_set(&filter, type);
+  coap_option_iterator_init(request, &opt_iter, &filter);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (coap_opt_length(option) == 0) {
+      /* An empty If-Match matches any current representation */
+      if (empty)
+        *empty = 1;
+    }
+    else if (coap_opt_length(option) <= 8 &&
+        coap_decode_var_bytes8(coap_opt_value(option),
+                               coap_opt_length(option)) == etag)
+      return 1;
+  }
+  return 0;
+}
+
+int
+coap_resource_check_etag(coap_resource_t *resource, coap_pdu_t *request,
+                         coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  uint64_t etag;
+  uint8_t buf[8];
+  int any = 0;
+
+  if (!(resource->flags & COAP_RESOURCE_FLAGS_AUTO_ETAG))
+    return 0;
+  etag = coap_resource_etag(resource);
+
+  /* RFC7252 Section 5.10.8 conditional requests */
+  if (coap_check_option(request, COAP_OPTION_IF_MATCH, &opt_iter) &&
+      !coap_resource_etag_listed(request, COAP_OPTION_IF_MATCH, etag, &any) &&
+      !any) {
+    response->code = COAP_RESPONSE_CODE(412);
+    return 1;
+  }
+  if (coap_check_option(request, COAP_OPTION_IF_NONE_MATCH, &opt_iter)) {
+    /* The resource exists, so has a current representation */
+    response->code = COAP_RESPONSE_CODE(412);
+    return 1;
+  }
+
+  /* RFC7252 Section 5.10.6.2 validation */
+  if ((request->code == COAP_REQUEST_GET ||
+       request->code == COAP_REQUEST_FETCH) &&
+      !coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter) &&
+      !coap_check_option(request, COAP_OPTION_BLOCK2, &opt_iter) &&
+      !coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter) &&
+      coap_resource_etag_listed(request, COAP_OPTION_ETAG, etag, NULL)) {
+    response->code = COAP_RESPONSE_CODE(203);
+    coap_add_option(response, COAP_OPTION_ETAG,
+                    coap_encode_var_safe8(buf, sizeof(buf), etag), buf);
+    coap_log(LOG_DEBUG, "ETag of resource '%*.*s' still valid\n",
+             (int)resource->uri_path->length, (int)resource->uri_path->length,
+             resource->uri_path->s);
+    return 1;
+  }
+  return 0;
+}
+
+void
+coap_resource_add_etag(coap_resource_t *resource, coap_pdu_t *response) {
+  coap_opt_iterator_t opt_iter;
+  uint8_t buf[8];
+
+  if (!(resource->flags & COAP_RESOURCE_FLAGS_AUTO_ETAG) ||
+      response->code != COAP_RESPONSE_CODE(205) ||
+      coap_check_option(response, COAP_OPTION_ETAG, &opt_iter))
+    return;
+  coap_insert_option(response, COAP_OPTION_ETAG,
+                     coap_encode_var_safe8(buf, sizeof(buf),
+                                           coap_resource_etag(resource)),
+                     buf);
+}
+
+static void
+coap_resource_release_representation(coap_session_t *session, void *app_ptr) {
+  coap_representation_t *rep = (coap_representation_t *)app_ptr;
+
+  (void)session;
+  coap_delete_pdu(rep->pdu);
+  coap_free_type(COAP_STRING, rep);
+}
+
+/*
+ * The handler of the requests that coap_resource_fill_representation()
+ * leaves to it: those with Observe or Block2, and responses that do not fit
+ * into a single PDU.
+ */
+static void
+coap_resource_get_representation(coap_context_t *context,
+                                 coap_resource_t *resource,
+                                 coap_session_t *session, coap_pdu_t *request,
+                                 coap_binary_t *token, coap_string_t *query,
+                                 coap_pdu_t *response) {
+  coap_representation_t *rep = resource->rep;
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *option;
+
+  (void)context;
+  if (!rep) {
+    response->code = COAP_RESPONSE_CODE(404);
+    return;
+  }
+  /* The options that coap_add_large_body_response() does not add */
+  coap_option_iterator_init(rep->pdu, &opt_iter, COAP_OPT_ALL);
+  while ((option = coap_option_next(&opt_iter))) {
+    if (opt_iter.type == COAP_OPTION_ETAG ||
+        opt_iter.type == COAP_OPTION_CONTENT_FORMAT ||
+        opt_iter.type == COAP_OPTION_MAXAGE)
+      continue;
+    coap_add_option(response, opt_iter.type, coap_opt_length(option),
+                    coap_opt_value(option));
+  }
+  response->code = COAP_RESPONSE_CODE(205);
+  if (!coap_add_large_body_response(resource, session, request, response,
+                                    token, query, rep->media_type,
+                                    rep->maxage, rep->body))
+    response->code = COAP_RESPONSE_CODE(500);
+}
+
+int
+coap_resource_set_representation(coap_resource_t *resource,
+                                 uint16_t media_type, int maxage,
+                                 uint64_t etag, coap_optlist_t **options,
+                                 size_t length, const uint8_t *data) {
+  coap_representation_t *rep;
+  coap_large_body_t *old_body = resource->rep ? resource->rep->body : NULL;
+  uint64_t old_etag = resource->rep ? resource->rep->etag : 0;
+  uint8_t buf[8];
+
+  assert(resource);
+  if (etag == 0) {
+    /* Derived from the contents, so unchanged contents keep their ETag */
+    size_t i;
+
+    etag = 0xcbf29ce484222325ULL ^ media_type;
+    for (i = 0; i < length; i++) {
+      etag ^= data[i];
+      etag *= 0x100000001b3ULL;
+    }
+    if (etag == 0)
+      etag = 1;
+  }
+
+  rep = coap_malloc_type(COAP_STRING, sizeof(coap_representation_t));
+  if (!rep)
+    return 0;
+  memset(rep, 0, sizeof(coap_representation_t));
+  rep->etag = etag;
+  rep->media_type = media_type;
+  rep->maxage = maxage;
+  rep->pdu = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE(205), 0, 0);
+  if (!rep->pdu ||
+      (options && *options && !coap_add_optlist_pdu(rep->pdu, options)) ||
+      !coap_insert_option(rep->pdu, COAP_OPTION_ETAG,
+                          coap_encode_var_safe8(buf, sizeof(buf), etag),
+                          buf) ||
+      !coap_insert_option(rep->pdu, COAP_OPTION_CONTENT_FORMAT,
+                          coap_encode_var_safe(buf, sizeof(buf), media_type),
+                          buf) ||
+      (maxage >= 0 &&
+       !coap_insert_option(rep->pdu, COAP_OPTION_MAXAGE,
+                           coap_encode_var_safe(buf, sizeof(buf),
+                                                (unsigned int)maxage),
+                           buf)) ||
+      (length && !coap_add_data(rep->pdu, length, data))) {
+    coap_delete_pdu(rep->pdu);
+    coap_free_type(COAP_STRING, rep);
+    return 0;
+  }
+
+  /*
+   * Block2 transfers are served from the payload of the pre-built response,
+   * which lives for as long as the body is registered or being sent.  A
+   * body with the same ETag is replaced by coap_resource_add_large_body().
+   */
+  rep->body = coap_resource_add_large_body(resource, etag, length,
+                                           rep->pdu->data,
+                                           coap_resource_release_representation,
+                                           rep);
+  if (!rep->body)
+    return 0;
+  if (old_body && old_etag != etag)
+    coap_resource_remove_large_body(resource, old_body);
+  resource->rep = rep;
+  coap_register_handler(resource, COAP_REQUEST_GET,
+                        coap_resource_get_representation);
+  coap_resource_notify_observers(resource, NULL);
+  return 1;
+}
+
+int
+coap_resource_fill_representation(coap_resource_t *resource,
+                                  coap_pdu_t *request,
+                                  coap_pdu_t *response) {
+  coap_representation_t *rep = resource->rep;
+  coap_opt_iterator_t opt_iter;
+  uint8_t buf[8];
+
+  if (!rep || request->code != COAP_REQUEST_GET ||
+      coap_check_option(request, COAP_OPTION_OBSERVE, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_BLOCK2, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_Q_BLOCK2, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_IF_MATCH, &opt_iter) ||
+      coap_check_option(request, COAP_OPTION_IF_NONE_MATCH, &opt_iter))
+    return 0;
+
+  if (coap_resource_etag_listed(request, COAP_OPTION_ETAG, rep->etag, NULL)) {
+    response->code = COAP_RESPONSE_CODE(203);
+    coap_add_option(response, COAP_OPTION_ETAG,
+                    coap_encode_var_safe8(buf, sizeof(buf), rep->etag), buf);
+    return 1;
+  }
+  /* Too large for the session, so Block2 from the handler */
+  if (!coap_pdu_copy_body(response, rep->pdu))
+    return 0;
+  response->code = rep->pdu->code;
+  return 1;
+}
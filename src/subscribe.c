@@ -9,8 +9,652 @@
 
 #include "coap2/coap_internal.h"
 
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+#include <stdio.h>
+#endif /* !WITH_LWIP && !WITH_CONTIKI */
+
 void
 coap_subscription_init(coap_subscription_t *s) {
   assert(s);
   memset(s, 0, sizeof(coap_subscription_t));
 }
+
+#if COAP_SUBSCRIPTION_SLABS
+/*
+ * The slabs of a resource are kept in a list in the order they were
+ * added, which is the order of a full notification, and the ones with free
+ * slots also in a second list that new subscriptions are taken from, so
+ * that freed slots are reused before a slab is added.
+ */
+coap_subscription_t *
+coap_subscription_alloc(coap_resource_t *resource) {
+  coap_subscription_slab_t *slab = resource->subscription_partial;
+  coap_subscription_t *s;
+
+  if (!slab) {
+    unsigned int size = resource->subscription_slabs ?
+                        resource->subscription_slabs->prev->size * 2 : 4;
+    unsigned int i;
+
+    if (size > COAP_SUBSCRIPTION_SLAB_MAX)
+      size = COAP_SUBSCRIPTION_SLAB_MAX;
+    slab = coap_malloc_type(COAP_STRING,
+                            offsetof(coap_subscription_slab_t, slot) +
+                            size * sizeof(coap_subscription_t));
+    if (!slab)
+      return NULL;
+    memset(slab, 0, offsetof(coap_subscription_slab_t, slot) +
+                    size * sizeof(coap_subscription_t));
+    slab->size = size;
+    for (i = size; i-- > 0; ) {
+      slab->slot[i].next = slab->free;
+      slab->free = &slab->slot[i];
+    }
+    DL_APPEND(resource->subscription_slabs, slab);
+    DL_APPEND2(resource->subscription_partial, slab, partial_prev,
+               partial_next);
+  }
+
+  s = slab->free;
+  slab->free = s->next;
+  if (++slab->used == slab->size)
+    DL_DELETE2(resource->subscription_partial, slab, partial_prev,
+               partial_next);
+  memset(s, 0, sizeof(coap_subscription_t));
+  s->slab = slab;
+  return s;
+}
+
+static void
+coap_subscription_slab_free(coap_resource_t *resource,
+                            coap_subscription_slab_t *slab) {
+  DL_DELETE(resource->subscription_slabs, slab);
+  DL_DELETE2(resource->subscription_partial, slab, partial_prev,
+             partial_next);
+  coap_free_type(COAP_STRING, slab);
+}
+
+void
+coap_subscription_free(coap_resource_t *resource, coap_subscription_t *s) {
+  coap_subscription_slab_t *slab = s->slab;
+
+  if (slab->used-- == slab->size)
+    DL_APPEND2(resource->subscription_partial, slab, partial_prev,
+               partial_next);
+  memset(s, 0, sizeof(coap_subscription_t));
+  s->next = slab->free;
+  slab->free = s;
+  if (!slab->used && !resource->notifying)
+    coap_subscription_slab_free(resource, slab);
+}
+
+void
+coap_subscription_slabs_trim(coap_resource_t *resource) {
+  coap_subscription_slab_t *slab, *tmp;
+
+  DL_FOREACH_SAFE(resource->subscription_slabs, slab, tmp) {
+    if (!slab->used)
+      coap_subscription_slab_free(resource, slab);
+  }
+}
+#endif /* COAP_SUBSCRIPTION_SLABS */
+
+/*
+ * The change events that the nodes of a cluster pass to each other are
+ *
+ * typedef struct __attribute__((__packed__)) {
+ *   uint8_t version;                COAP_OBSERVE_EVENT_VERSION
+ *   uint8_t flags;                  COAP_OBSERVE_EVENT_QUERY and/or _VALUE
+ *   uint16_t uri_path_length;       network byte order
+ *   uint8_t uri_path[];
+ *   uint16_t query_length;          if COAP_OBSERVE_EVENT_QUERY
+ *   uint8_t query[];
+ *   uint8_t value[8];               if COAP_OBSERVE_EVENT_VALUE, an IEEE 754
+ *                                   double in network byte order
+ * } coap_observe_event_t;
+ */
+#define COAP_OBSERVE_EVENT_VERSION 1
+#define COAP_OBSERVE_EVENT_QUERY   0x01
+#define COAP_OBSERVE_EVENT_VALUE   0x02
+
+int
+coap_context_set_observe_registry(coap_context_t *context,
+                                  const coap_observe_registry_t *registry) {
+  coap_free_type(COAP_STRING, context->observe_registry);
+  context->observe_registry = NULL;
+  if (!registry)
+    return 1;
+  context->observe_registry = coap_malloc_type(COAP_STRING,
+                                               sizeof(coap_observe_registry_t));
+  if (!context->observe_registry) {
+    coap_log(LOG_WARNING,
+             "coap_context_set_observe_registry: malloc failed\n");
+    return 0;
+  }
+  *context->observe_registry = *registry;
+  return 1;
+}
+
+void
+coap_observe_registry_added(coap_resource_t *resource,
+                            coap_subscription_t *s) {
+  coap_observe_registry_t *registry = resource->context ?
+                                      resource->context->observe_registry :
+                                      NULL;
+
+  if (registry && registry->add) {
+    coap_bin_const_t token = { s->token_length, s->token };
+
+    registry->add(registry->arg, resource, s->session, &token);
+  }
+}
+
+void
+coap_observe_registry_removed(coap_resource_t *resource,
+                              coap_subscription_t *s) {
+  coap_observe_registry_t *registry = resource->context ?
+                                      resource->context->observe_registry :
+                                      NULL;
+
+  if (registry && registry->remove) {
+    coap_bin_const_t token = { s->token_length, s->token };
+
+    registry->remove(registry->arg, resource, s->session, &token);
+  }
+}
+
+void
+coap_observe_registry_publish(coap_resource_t *resource,
+                              const coap_string_t *query,
+                              const double *value) {
+  coap_context_t *context = resource->context;
+  size_t path_length = resource->uri_path ? resource->uri_path->length : 0;
+  size_t length;
+  uint8_t *event;
+  uint8_t *p;
+
+  if (!context || !context->observe_registry ||
+      !context->observe_registry->publish || context->observe_remote ||
+      path_length > 0xffff || (query && query->length > 0xffff))
+    return;
+
+  length = 4 + path_length + (query ? 2 + query->length : 0) +
+           (value ? 8 : 0);
+  event = coap_malloc_type(COAP_STRING, length);
+  if (!event) {
+    coap_log(LOG_WARNING, "coap_observe_registry_publish: malloc failed\n");
+    return;
+  }
+  p = event;
+  *p++ = COAP_OBSERVE_EVENT_VERSION;
+  *p++ = (query ? COAP_OBSERVE_EVENT_QUERY : 0) |
+         (value ? COAP_OBSERVE_EVENT_VALUE : 0);
+  *p++ = (uint8_t)(path_length >> 8);
+  *p++ = (uint8_t)path_length;
+  if (path_length) {
+    memcpy(p, resource->uri_path->s, path_length);
+    p += path_length;
+  }
+  if (query) {
+    *p++ = (uint8_t)(query->length >> 8);
+    *p++ = (uint8_t)query->length;
+    memcpy(p, query->s, query->length);
+    p += query->length;
+  }
+  if (value) {
+    uint64_t bits;
+    int i;
+
+    memcpy(&bits, value, sizeof(bits));
+    for (i = 7; i >= 0; i--)
+      *p++ = (uint8_t)(bits >> (i * 8));
+  }
+  context->observe_registry->publish(context->observe_registry->arg, event,
+                                     length);
+  coap_free_type(COAP_STRING, event);
+}
+
+int
+coap_observe_registry_event(coap_context_t *context,
+                            const uint8_t *event, size_t length) {
+  const uint8_t *end = event + length;
+  coap_str_const_t uri_path;
+  coap_string_t query = { 0, NULL };
+  coap_resource_t *r;
+  uint8_t flags;
+  double value = 0;
+  int ret;
+
+  if (length < 4 || event[0] != COAP_OBSERVE_EVENT_VERSION)
+    goto invalid;
+  flags = event[1];
+  uri_path.length = (size_t)event[2] << 8 | event[3];
+  uri_path.s = event + 4;
+  event += 4;
+  if ((size_t)(end - event) < uri_path.length)
+    goto invalid;
+  event += uri_path.length;
+  if (flags & COAP_OBSERVE_EVENT_QUERY) {
+    if (end - event < 2)
+      goto invalid;
+    query.length = (size_t)event[0] << 8 | event[1];
+    event += 2;
+    if ((size_t)(end - event) < query.length)
+      goto invalid;
+    /* coap_resource_notify_observers() does not modify the query */
+    memcpy(&query.s, &event, sizeof(query.s));
+    event += query.length;
+  }
+  if (flags & COAP_OBSERVE_EVENT_VALUE) {
+    uint64_t bits = 0;
+    int i;
+
+    if (end - event < 8)
+      goto invalid;
+    for (i = 0; i < 8; i++)
+      bits = bits << 8 | *event++;
+    memcpy(&value, &bits, sizeof(value));
+  }
+  if (event != end)
+    goto invalid;
+
+  r = coap_get_resource_from_uri_path(context, &uri_path);
+  if (!r)
+    return 0;
+
+  context->observe_remote = 1;
+  if (flags & COAP_OBSERVE_EVENT_VALUE)
+    ret = coap_resource_notify_observers_value(r, value);
+  else
+    ret = coap_resource_notify_observers(r, (flags & COAP_OBSERVE_EVENT_QUERY) ?
+                                            &query : NULL);
+  context->observe_remote = 0;
+  return ret;
+
+invalid:
+  coap_log(LOG_DEBUG, "coap_observe_registry_event: invalid event\n");
+  return 0;
+}
+
+#if !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+/*
+ * The snapshot written by coap_observe_snapshot() is
+ *
+ *   uint8_t magic[4];               "cobs"
+ *   uint8_t version;                COAP_OBSERVE_SNAPSHOT_VERSION
+ *   uint64_t etag;                  next ETag of the context
+ *
+ * followed by records, each starting with its type, all numbers in network
+ * byte order:
+ *
+ *   'R' uint16_t uri_path_length, uri_path[], uint32_t observe,
+ *       uint64_t etag               a resource with observers
+ *   'S' address local, address remote, uint32_t ifindex, uint16_t tx_mid,
+ *       uint64_t tx_token, uint8_t token_length, token[], uint8_t code,
+ *       uint8_t has_block2, uint32_t block_num, uint8_t block_szx,
+ *       uint16_t query_length, query[]
+ *                                   an observer of the last resource, with
+ *                                   query_length 0xffff if it has no query
+ *   'E'                             the end
+ *
+ * where an address is a uint8_t family (4 or 6), the IP address, a
+ * uint16_t port and for IPv6 a uint32_t scope id.
+ */
+#define COAP_OBSERVE_SNAPSHOT_VERSION 1
+#define COAP_OBSERVE_SNAPSHOT_NO_QUERY 0xffff
+
+static void
+snapshot_put(FILE *fp, uint64_t value, int bytes) {
+  while (bytes-- > 0)
+    fputc((int)(value >> (bytes * 8)) & 0xff, fp);
+}
+
+static int
+snapshot_get(FILE *fp, uint64_t *value, int bytes) {
+  int c;
+
+  *value = 0;
+  while (bytes-- > 0) {
+    if ((c = fgetc(fp)) == EOF)
+      return 0;
+    *value = *value << 8 | (unsigned int)c;
+  }
+  return 1;
+}
+
+static int
+snapshot_put_address(FILE *fp, const coap_address_t *addr) {
+  switch (addr->addr.sa.sa_family) {
+  case AF_INET:
+    snapshot_put(fp, 4, 1);
+    fwrite(&addr->addr.sin.sin_addr, 4, 1, fp);
+    break;
+  case AF_INET6:
+    snapshot_put(fp, 6, 1);
+    fwrite(&addr->addr.sin6.sin6_addr, 16, 1, fp);
+    break;
+  default:
+    return 0;
+  }
+  snapshot_put(fp, coap_address_get_port(addr), 2);
+  if (addr->addr.sa.sa_family == AF_INET6)
+    snapshot_put(fp, addr->addr.sin6.sin6_scope_id, 4);
+  return 1;
+}
+
+static int
+snapshot_get_address(FILE *fp, coap_address_t *addr) {
+  uint64_t family, port, scope_id;
+
+  coap_address_init(addr);
+  if (!snapshot_get(fp, &family, 1))
+    return 0;
+  if (family == 4) {
+    addr->size = sizeof(struct sockaddr_in);
+    addr->addr.sin.sin_family = AF_INET;
+    if (fread(&addr->addr.sin.sin_addr, 4, 1, fp) != 1)
+      return 0;
+  }
+  else if (family == 6) {
+    addr->size = sizeof(struct sockaddr_in6);
+    addr->addr.sin6.sin6_family = AF_INET6;
+    if (fread(&addr->addr.sin6.sin6_addr, 16, 1, fp) != 1)
+      return 0;
+  }
+  else {
+    return 0;
+  }
+  if (!snapshot_get(fp, &port, 2))
+    return 0;
+  coap_address_set_port(addr, (uint16_t)port);
+  if (family == 6) {
+    if (!snapshot_get(fp, &scope_id, 4))
+      return 0;
+    addr->addr.sin6.sin6_scope_id = (uint32_t)scope_id;
+  }
+  return 1;
+}
+
+/*
+ * Only the observers of plain UDP sessions can be taken over, as there is
+ * no way to carry the keys of a (D)TLS session or a TCP connection across.
+ */
+static int
+snapshot_observer_usable(const coap_subscription_t *s) {
+  const coap_session_t *session = s->session;
+
+  return session->proto == COAP_PROTO_UDP &&
+         session->type == COAP_SESSION_TYPE_SERVER && session->endpoint &&
+         !session->oscore &&
+         (session->addr_info.remote.addr.sa.sa_family == AF_INET ||
+          session->addr_info.remote.addr.sa.sa_family == AF_INET6);
+}
+
+/*
+ * Drops the observers that have been saved, without telling them, so that
+ * they carry on with the process they are handed over to.
+ */
+static void
+snapshot_detach(coap_context_t *context) {
+  coap_subscription_t *s, *stmp;
+
+  RESOURCES_ITER(context->resources, r) {
+    LL_FOREACH_SAFE(r->subscribers, s, stmp) {
+      coap_binary_t token;
+
+      if (!snapshot_observer_usable(s))
+        continue;
+      token.length = s->token_length;
+      token.s = s->token;
+      coap_delete_observer(r, s->session, &token);
+    }
+  }
+}
+
+int
+coap_observe_snapshot(coap_context_t *context, const char *filename,
+                      int detach) {
+  coap_subscription_t *s;
+  char *tmpname;
+  size_t length = strlen(filename);
+  FILE *fp;
+  int count = 0;
+  int ok;
+
+  /* Written next to it and renamed, so a crash leaves the old one intact */
+  tmpname = coap_malloc(length + sizeof(".tmp"));
+  if (!tmpname)
+    return -1;
+  memcpy(tmpname, filename, length);
+  memcpy(tmpname + length, ".tmp", sizeof(".tmp"));
+  fp = fopen(tmpname, "wb");
+  if (!fp) {
+    coap_log(LOG_WARNING, "coap_observe_snapshot: cannot create %s\n",
+             tmpname);
+    coap_free(tmpname);
+    return -1;
+  }
+
+  fwrite("cobs", 4, 1, fp);
+  snapshot_put(fp, COAP_OBSERVE_SNAPSHOT_VERSION, 1);
+  snapshot_put(fp, context->etag, 8);
+  RESOURCES_ITER(context->resources, r) {
+    int first = 1;
+
+    LL_FOREACH(r->subscribers, s) {
+      coap_session_t *session = s->session;
+
+      if (!snapshot_observer_usable(s))
+        continue;
+      if (first) {
+        fputc('R', fp);
+        snapshot_put(fp, r->uri_path->length, 2);
+        fwrite(r->uri_path->s, r->uri_path->length, 1, fp);
+        snapshot_put(fp, r->observe, 4);
+        snapshot_put(fp, r->etag, 8);
+        first = 0;
+      }
+      fputc('S', fp);
+      if (!snapshot_put_address(fp, &session->addr_info.local) ||
+          !snapshot_put_address(fp, &session->addr_info.remote))
+        goto fail;
+      snapshot_put(fp, (uint32_t)session->ifindex, 4);
+      snapshot_put(fp, session->tx_mid, 2);
+      snapshot_put(fp, session->tx_token, 8);
+      snapshot_put(fp, s->token_length, 1);
+      fwrite(s->token, s->token_length, 1, fp);
+      snapshot_put(fp, s->code, 1);
+      snapshot_put(fp, s->has_block2, 1);
+      snapshot_put(fp, s->block.num, 4);
+      snapshot_put(fp, s->block.szx, 1);
+      if (s->query && s->query->length < COAP_OBSERVE_SNAPSHOT_NO_QUERY) {
+        snapshot_put(fp, s->query->length, 2);
+        fwrite(s->query->s, s->query->length, 1, fp);
+      }
+      else {
+        snapshot_put(fp, COAP_OBSERVE_SNAPSHOT_NO_QUERY, 2);
+      }
+      count++;
+    }
+  }
+  fputc('E', fp);
+  ok = !ferror(fp);
+  if (fclose(fp) != 0 || !ok || rename(tmpname, filename) != 0)
+    goto fail_closed;
+  coap_free(tmpname);
+  coap_log(LOG_DEBUG, "coap_observe_snapshot: %d observers saved\n", count);
+  if (detach)
+    snapshot_detach(context);
+  return count;
+
+fail:
+  fclose(fp);
+fail_closed:
+  coap_log(LOG_WARNING, "coap_observe_snapshot: cannot write %s\n", tmpname);
+  remove(tmpname);
+  coap_free(tmpname);
+  return -1;
+}
+
+/* Finds (or makes) the session of the UDP endpoint for @p addr_info */
+static coap_session_t *
+snapshot_get_session(coap_context_t *context, coap_packet_t *packet,
+                     coap_tick_t now) {
+  coap_endpoint_t *ep;
+  uint16_t port = coap_address_get_port(&packet->addr_info.local);
+
+  LL_FOREACH(context->endpoint, ep) {
+    if (ep->proto == COAP_PROTO_UDP &&
+        coap_address_get_port(&ep->bind_addr) == port)
+      return coap_endpoint_get_session(ep, packet, now);
+  }
+  return NULL;
+}
+
+int
+coap_observe_restore(coap_context_t *context, const char *filename) {
+  coap_resource_t *r = NULL;
+  coap_packet_t *packet;
+  coap_tick_t now;
+  uint64_t v, tx_mid, tx_token;
+  uint8_t header[5];
+  int count = 0;
+  int type;
+  FILE *fp;
+
+  fp = fopen(filename, "rb");
+  if (!fp) {
+    coap_log(LOG_DEBUG, "coap_observe_restore: cannot open %s\n", filename);
+    return -1;
+  }
+  packet = coap_malloc(sizeof(coap_packet_t));
+  if (!packet) {
+    fclose(fp);
+    return -1;
+  }
+  memset(packet, 0, sizeof(coap_packet_t));
+  coap_ticks(&now);
+
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header, "cobs", 4) != 0 ||
+      header[4] != COAP_OBSERVE_SNAPSHOT_VERSION || !snapshot_get(fp, &v, 8))
+    goto invalid;
+  if (v > context->etag)
+    context->etag = v;
+
+  while ((type = fgetc(fp)) == 'R' || type == 'S') {
+    if (type == 'R') {
+      coap_str_const_t uri_path;
+      uint8_t *path;
+      uint64_t observe, etag;
+
+      if (!snapshot_get(fp, &v, 2))
+        goto invalid;
+      path = coap_malloc(v + 1);
+      if (!path)
+        goto invalid;
+      uri_path.s = path;
+      uri_path.length = (size_t)v;
+      if ((v && fread(path, (size_t)v, 1, fp) != 1) ||
+          !snapshot_get(fp, &observe, 4) || !snapshot_get(fp, &etag, 8)) {
+        coap_free(path);
+        goto invalid;
+      }
+      r = coap_get_resource_from_uri_path(context, &uri_path);
+      if (r) {
+        /* The observers must see the sequence go on from where it was */
+        r->observe = (unsigned int)observe;
+        if (!r->etag)
+          r->etag = etag;
+      }
+      else {
+        coap_log(LOG_DEBUG, "coap_observe_restore: resource '%*.*s' "
+                 "no longer exists\n", (int)uri_path.length,
+                 (int)uri_path.length, uri_path.s);
+      }
+      coap_free(path);
+    }
+    else {
+      coap_session_t *session;
+      coap_binary_t token;
+      uint8_t token_buf[8];
+      coap_string_t *query = NULL;
+      coap_block_t block;
+      uint64_t ifindex, token_length, code, has_block2, num, szx;
+
+      memset(&block, 0, sizeof(block));
+      if (!snapshot_get_address(fp, &packet->addr_info.local) ||
+          !snapshot_get_address(fp, &packet->addr_info.remote) ||
+          !snapshot_get(fp, &ifindex, 4) || !snapshot_get(fp, &tx_mid, 2) ||
+          !snapshot_get(fp, &tx_token, 8) ||
+          !snapshot_get(fp, &token_length, 1) ||
+          token_length > sizeof(token_buf) ||
+          (token_length &&
+           fread(token_buf, (size_t)token_length, 1, fp) != 1) ||
+          !snapshot_get(fp, &code, 1) || !snapshot_get(fp, &has_block2, 1) ||
+          !snapshot_get(fp, &num, 4) || !snapshot_get(fp, &szx, 1) ||
+          !snapshot_get(fp, &v, 2))
+        goto invalid;
+      if (v != COAP_OBSERVE_SNAPSHOT_NO_QUERY) {
+        query = coap_new_string((size_t)v);
+        if (!query ||
+            (v && fread(query->s, (size_t)v, 1, fp) != 1)) {
+          coap_delete_string(query);
+          goto invalid;
+        }
+      }
+      packet->ifindex = (int)(uint32_t)ifindex;
+      session = r ? snapshot_get_session(context, packet, now) : NULL;
+      if (!session) {
+        coap_delete_string(query);
+        continue;
+      }
+      /* Carry on where the old process left off */
+      session->tx_mid = (uint16_t)tx_mid;
+      if (tx_token > session->tx_token)
+        session->tx_token = tx_token;
+      token.length = (size_t)token_length;
+      token.s = token_buf;
+      block.num = (unsigned int)num;
+      block.szx = (unsigned int)szx & 0x7;
+      if (coap_add_observer(r, session, &token, query, has_block2 != 0, block,
+                            (uint8_t)code))
+        count++;
+      else
+        coap_delete_string(query);
+    }
+  }
+  if (type != 'E')
+    goto invalid;
+  fclose(fp);
+  coap_free(packet);
+  coap_log(LOG_DEBUG, "coap_observe_restore: %d observers restored\n", count);
+  return count;
+
+invalid:
+  coap_log(LOG_WARNING, "coap_observe_restore: %s is not a valid snapshot\n",
+           filename);
+  fclose(fp);
+  coap_free(packet);
+  return -1;
+}
+
+#else /* WITH_LWIP || WITH_CONTIKI */
+
+int
+coap_observe_snapshot(coap_context_t *context, const char *filename,
+                      int detach) {
+  (void)context;
+  (void)filename;
+  (void)detach;
+  return -1;
+}
+
+int
+coap_observe_restore(coap_context_t *context, const char *filename) {
+  (void)context;
+  (void)filename;
+  return -1;
+}
+
+#endif /* WITH_LWIP || WITH_CONTIKI */
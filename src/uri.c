@@ -17,23 +17,74 @@
 #include <string.h>
 #include <ctype.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__GNUC__)
+#include <arm_neon.h>
+#endif
+
 /**
- * A length-safe version of strchr(). This function returns a pointer
- * to the first occurrence of @p c  in @p s, or @c NULL if not found.
+ * Returns the offset of the first occurrence of any of @p a, @p b, @p c
+ * or @p d in the @p len bytes at @p s, or @p len if there is none. Callers
+ * looking for fewer characters repeat one of them. Blocks of 16 bytes are
+ * compared at once where SSE2 or NEON is available.
  *
- * @param s   The string to search for @p c.
+ * @param s   The string to search.
  * @param len The length of @p s.
- * @param c   The character to search.
  *
- * @return A pointer to the first occurence of @p c, or @c NULL
- * if not found.
+ * @return The offset of the first match, or @p len if not found.
  */
-COAP_STATIC_INLINE const uint8_t *
-strnchr(const uint8_t *s, size_t len, unsigned char c) {
-  while (len && *s++ != c)
-    --len;
+static size_t
+uri_scan(const uint8_t *s, size_t len,
+         uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  size_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  if (len >= 16) {
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    const __m128i vc = _mm_set1_epi8((char)c);
+    const __m128i vd = _mm_set1_epi8((char)d);
+
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                            _mm_cmpeq_epi8(v, vb)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, vc),
+                                            _mm_cmpeq_epi8(v, vd)));
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+
+      if (mask)
+        return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__GNUC__)
+  if (len >= 16) {
+    const uint8x16_t va = vdupq_n_u8(a);
+    const uint8x16_t vb = vdupq_n_u8(b);
+    const uint8x16_t vc = vdupq_n_u8(c);
+    const uint8x16_t vd = vdupq_n_u8(d);
+
+    for (; i + 16 <= len; i += 16) {
+      uint8x16_t v = vld1q_u8(s + i);
+      uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)),
+                              vorrq_u8(vceqq_u8(v, vc), vceqq_u8(v, vd)));
+      /* narrow to 4 bits per byte as NEON has no movemask */
+      uint64_t mask =
+        vget_lane_u64(vreinterpret_u64_u8(
+                        vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+
+      if (mask)
+        return i + (__builtin_ctzll(mask) >> 2);
+    }
+  }
+#endif /* __ARM_NEON && __GNUC__ */
 
-  return len ? s : NULL;
+  for (; i < len; i++) {
+    if (s[i] == a || s[i] == b || s[i] == c || s[i] == d)
+      return i;
+  }
+  return len;
 }
 
 #define ISEQUAL_CI(a,b) \
@@ -50,6 +101,7 @@ coap_split_uri_sub(const uint8_t *str_var,
                    coap_uri_t *uri,
                    coap_uri_check_t check_proxy) {
   const uint8_t *p, *q;
+  size_t n;
   int res = 0;
   int is_http_proxy_scheme = 0;
   size_t keep_len = len;
@@ -144,9 +196,9 @@ coap_split_uri_sub(const uint8_t *str_var,
   if (len && *p == '[') {        /* IPv6 address reference */
     ++p;
 
-    while (len && *q != ']') {
-      ++q; --len;
-    }
+    n = uri_scan(q, len, ']', ']', ']', ']');
+    q += n;
+    len -= n;
 
     if (!len || *q != ']' || p == q) {
       res = -3;
@@ -156,10 +208,9 @@ coap_split_uri_sub(const uint8_t *str_var,
     COAP_SET_STR(&uri->host, q - p, p);
     ++q; --len;
   } else {                        /* IPv4 address or FQDN */
-    while (len && *q != ':' && *q != '/' && *q != '?') {
-      ++q;
-      --len;
-    }
+    n = uri_scan(q, len, ':', '/', '?', '?');
+    q += n;
+    len -= n;
 
     if (p == q) {
       res = -3;
@@ -204,10 +255,9 @@ coap_split_uri_sub(const uint8_t *str_var,
     p = ++q;
     --len;
 
-    while (len && *q != '?') {
-      ++q;
-      --len;
-    }
+    n = uri_scan(q, len, '?', '?', '?', '?');
+    q += n;
+    len -= n;
 
     if (p < q) {
       COAP_SET_STR(&uri->path, q - p, p);
@@ -251,52 +301,47 @@ coap_split_proxy_uri(const uint8_t *str_var, size_t len, coap_uri_t *uri) {
 
 /**
  * Decodes percent-encoded characters while copying the string @p seg
- * of size @p length to @p buf. The caller of this function must
- * ensure that the percent-encodings are correct (i.e. the character
- * '%' is always followed by two hex digits. and that @p buf provides
- * sufficient space to hold the result. This function is supposed to
- * be called by make_decoded_option() only.
+ * of size @p length to @p buf, checking the percent-encodings on the way
+ * (i.e. that the character '%' is always followed by two hex digits).
+ * The runs between two '%' are found with uri_scan() and copied in one go.
+ * This function is supposed to be called by make_decoded_option() only.
  *
- * @param seg     The segment to decode and copy.
- * @param length  Length of @p seg.
- * @param buf     The result buffer.
- */
-static void
-decode_segment(const uint8_t *seg, size_t length, unsigned char *buf) {
-
-  while (length--) {
-
-    if (*seg == '%') {
-      *buf = (hexchar_to_dec(seg[1]) << 4) + hexchar_to_dec(seg[2]);
-
-      seg += 2; length -= 2;
-    } else {
-      *buf = *seg;
-    }
-
-    ++buf; ++seg;
-  }
-}
-
-/**
- * Runs through the given path (or query) segment and checks if
- * percent-encodings are correct. This function returns @c 0 on success
- * and @c -1 on error.
+ * @param seg          The segment to decode and copy.
+ * @param length       Length of @p seg.
+ * @param buf          The result buffer.
+ * @param buflen       The maximum size of @p buf.
+ * @param segment_size The size of the decoded segment.
+ *
+ * @return @c 0 on success, @c -1 if a percent-encoding is invalid or
+ *         @c -2 if @p buf is too small.
  */
 static int
-check_segment(const uint8_t *s, size_t length, size_t *segment_size) {
+decode_segment(const uint8_t *seg, size_t length,
+               unsigned char *buf, size_t buflen, size_t *segment_size) {
   size_t n = 0;
 
   while (length) {
-    if (*s == '%') {
-      if (length < 2 || !(isxdigit(s[1]) && isxdigit(s[2])))
-              return -1;
+    size_t run = uri_scan(seg, length, '%', '%', '%', '%');
 
-      s += 2;
-      length -= 2;
-    }
+    if (run > buflen - n)
+      return -2;
+    memcpy(buf + n, seg, run);
+    n += run;
+    seg += run;
+    length -= run;
+
+    if (!length)
+      break;
+
+    /* seg points to '%' */
+    if (length < 3 || !(isxdigit(seg[1]) && isxdigit(seg[2])))
+      return -1;
+    if (n == buflen)
+      return -2;
 
-    ++s; ++n; --length;
+    buf[n++] = (hexchar_to_dec(seg[1]) << 4) + hexchar_to_dec(seg[2]);
+    seg += 3;
+    length -= 3;
   }
 
   *segment_size = n;
@@ -327,36 +372,46 @@ check_segment(const uint8_t *s, size_t length, size_t *segment_size) {
 static int
 make_decoded_option(const uint8_t *s, size_t length,
                     unsigned char *buf, size_t buflen, size_t* optionsize) {
-  int res;
+  unsigned char hdr[5];
+  size_t offset;
   size_t segmentlen;
   size_t written;
+  int res;
 
   if (!buflen) {
     coap_log(LOG_DEBUG, "make_decoded_option(): buflen is 0!\n");
     return -1;
   }
 
-  res = check_segment(s, length, &segmentlen);
+  /* The segment is decoded straight into buf, behind the option header
+   * needed for the encoded length. That is only too big if the
+   * percent-encodings take the length below 13 or 269, in which case the
+   * value is moved down. If the buffer is too tight for that header, the
+   * value goes behind the smallest header and is moved up instead. */
+  offset = coap_opt_encode_size(0, length) - length;
+  if (buflen < offset + length)
+    offset = 1;
+
+  res = decode_segment(s, length, buf + offset, buflen - offset, &segmentlen);
+  if (res == -2)
+    coap_log(LOG_DEBUG, "buffer too small for option\n");
   if (res < 0)
     return -1;
 
-  /* write option header using delta 0 and length res */
-  written = coap_opt_setheader(buf, buflen, 0, segmentlen);
-
-  assert(written <= buflen);
+  /* write option header using delta 0 and length segmentlen */
+  written = coap_opt_setheader(hdr, sizeof(hdr), 0, segmentlen);
 
   if (!written)                        /* encoding error */
     return -1;
 
-  buf += written;                /* advance past option type/length */
-  buflen -= written;
-
-  if (buflen < segmentlen) {
+  if (buflen < written + segmentlen) {
     coap_log(LOG_DEBUG, "buffer too small for option\n");
     return -1;
   }
 
-  decode_segment(s, length, buf);
+  if (written != offset)
+    memmove(buf + written, buf + offset, segmentlen);
+  memcpy(buf, hdr, written);
 
   *optionsize = written + segmentlen;
 
@@ -394,25 +449,22 @@ coap_split_path_impl(const uint8_t *s, size_t length,
                      segment_handler_t h, void *data) {
 
   const uint8_t *p, *q;
+  size_t n;
 
-  p = q = s;
-  while (length > 0 && !strnchr((const uint8_t *)"?#", 2, *q)) {
-    if (*q == '/') {                /* start new segment */
-
-      if (!dots(p, q - p)) {
-        h(p, q - p, data);
-      }
+  p = s;
+  for (;;) {
+    n = uri_scan(p, length, '/', '?', '#', '#');
+    q = p + n;
 
-      p = q + 1;
+    if (!dots(p, n)) {
+      h(p, n, data);
     }
 
-    q++;
-    length--;
-  }
+    if (n == length || *q != '/')   /* last segment written */
+      break;
 
-  /* write last segment */
-  if (!dots(p, q - p)) {
-    h(p, q - p, data);
+    p = q + 1;                      /* start new segment */
+    length -= n + 1;
   }
 
   return q - s;
@@ -455,20 +507,22 @@ coap_split_query(const uint8_t *s, size_t length,
                 unsigned char *buf, size_t *buflen) {
   struct cnt_str tmp = { { *buflen, buf }, 0 };
   const uint8_t *p;
+  size_t n;
 
   p = s;
-  while (length > 0 && *s != '#') {
-    if (*s == '&') {                /* start new query element */
-      write_option(p, s - p, &tmp);
-      p = s + 1;
-    }
+  for (;;) {
+    n = uri_scan(p, length, '&', '#', '#', '#');
 
-    s++;
-    length--;
+    if (n == length || p[n] != '&')
+      break;
+
+    write_option(p, n, &tmp);       /* start new query element */
+    p += n + 1;
+    length -= n + 1;
   }
 
   /* write last query element */
-  write_option(p, s - p, &tmp);
+  write_option(p, n, &tmp);
 
   *buflen = *buflen - tmp.buf.length;
   return tmp.n;
@@ -552,6 +606,11 @@ is_unescaped_in_query(const uint8_t c) {
 }
 
 coap_string_t *coap_get_query(const coap_pdu_t *request) {
+  return coap_get_query_arena(request, NULL);
+}
+
+coap_string_t *
+coap_get_query_arena(const coap_pdu_t *request, coap_arena_t *arena) {
   coap_opt_iterator_t opt_iter;
   coap_opt_filter_t f;
   coap_opt_t *q;
@@ -576,7 +635,7 @@ coap_string_t *coap_get_query(const coap_pdu_t *request) {
   if (length > 0)
     length -= 1;
   if (length > 0) {
-    query = coap_new_string(length);
+    query = coap_arena_new_string(arena, length);
     if (query) {
       query->length = length;
       unsigned char *s = query->s;
@@ -602,6 +661,11 @@ coap_string_t *coap_get_query(const coap_pdu_t *request) {
 }
 
 coap_string_t *coap_get_uri_path(const coap_pdu_t *request) {
+  return coap_get_uri_path_arena(request, NULL);
+}
+
+coap_string_t *
+coap_get_uri_path_arena(const coap_pdu_t *request, coap_arena_t *arena) {
   coap_opt_iterator_t opt_iter;
   coap_opt_filter_t f;
   coap_opt_t *q;
@@ -629,7 +693,7 @@ coap_string_t *coap_get_uri_path(const coap_pdu_t *request) {
     length -= 1;
 
   /* if 0, either no URI_PATH Option, or the first one was empty */
-  uri_path = coap_new_string(length);
+  uri_path = coap_arena_new_string(arena, length);
   if (uri_path) {
     uri_path->length = length;
     unsigned char *s = uri_path->s;
@@ -655,3 +719,75 @@ coap_string_t *coap_get_uri_path(const coap_pdu_t *request) {
   return uri_path;
 }
 
+size_t
+coap_uri_path_hash(const coap_pdu_t *request, unsigned *hashv) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t f;
+  coap_opt_t *q;
+  size_t length = 0;
+  unsigned h = COAP_RESOURCE_HASH_INIT;
+  int n = 0;
+  static const uint8_t hex[] = "0123456789ABCDEF";
+
+  coap_option_filter_clear(&f);
+  coap_option_filter_set(&f, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(request, &opt_iter, &f);
+  while ((q = coap_option_next(&opt_iter))) {
+    uint16_t seg_len = coap_opt_length(q), i;
+    const uint8_t *seg = coap_opt_value(q);
+    if (n++) {
+      h = COAP_RESOURCE_HASH_ADD(h, '/');
+      length++;
+    }
+    for (i = 0; i < seg_len; i++) {
+      if (is_unescaped_in_path(seg[i])) {
+        h = COAP_RESOURCE_HASH_ADD(h, seg[i]);
+        length += 1;
+      } else {
+        h = COAP_RESOURCE_HASH_ADD(h, '%');
+        h = COAP_RESOURCE_HASH_ADD(h, hex[seg[i]>>4]);
+        h = COAP_RESOURCE_HASH_ADD(h, hex[seg[i]&0x0F]);
+        length += 3;
+      }
+    }
+  }
+  *hashv = h;
+  return length;
+}
+
+int
+coap_uri_path_equal(const coap_pdu_t *request,
+                    const coap_str_const_t *uri_path) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_filter_t f;
+  coap_opt_t *q;
+  const uint8_t *p = uri_path->s;
+  const uint8_t *end = uri_path->s + uri_path->length;
+  int n = 0;
+  static const uint8_t hex[] = "0123456789ABCDEF";
+
+  coap_option_filter_clear(&f);
+  coap_option_filter_set(&f, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init(request, &opt_iter, &f);
+  while ((q = coap_option_next(&opt_iter))) {
+    uint16_t seg_len = coap_opt_length(q), i;
+    const uint8_t *seg = coap_opt_value(q);
+    if (n++) {
+      if (p == end || *p++ != '/')
+        return 0;
+    }
+    for (i = 0; i < seg_len; i++) {
+      if (is_unescaped_in_path(seg[i])) {
+        if (p == end || *p++ != seg[i])
+          return 0;
+      } else {
+        if (end - p < 3 || p[0] != '%' || p[1] != hex[seg[i]>>4] ||
+            p[2] != hex[seg[i]&0x0F])
+          return 0;
+        p += 3;
+      }
+    }
+  }
+  return p == end;
+}
+
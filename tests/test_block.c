@@ -0,0 +1,576 @@
+/* libcoap unit tests
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_block.h"
+#include "coap2/coap_internal.h"
+
+#include <coap2/coap.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/* Blocks received either side of the 32 block word boundaries */
+static void
+t_block1(void) {
+  coap_rblock_t rb;
+  uint32_t i;
+
+  memset(&rb, 0, sizeof(rb));
+  for (i = 0; i < 31; i++)
+    CU_ASSERT(coap_rblock_add(&rb, i));
+  CU_ASSERT(rb.first_missing == 31);
+  CU_ASSERT(rb.end == 31);
+
+  CU_ASSERT(coap_rblock_add(&rb, 32));
+  CU_ASSERT(rb.first_missing == 31);
+  CU_ASSERT(rb.end == 33);
+  CU_ASSERT(rb.words == 2);
+  CU_ASSERT(coap_rblock_check(&rb, 30));
+  CU_ASSERT(!coap_rblock_check(&rb, 31));
+  CU_ASSERT(coap_rblock_check(&rb, 32));
+  CU_ASSERT(!coap_rblock_check(&rb, 33));
+
+  /* Filling the gap moves on to the first block not yet in */
+  CU_ASSERT(coap_rblock_add(&rb, 31));
+  CU_ASSERT(rb.first_missing == 33);
+
+  for (i = 33; i < 64; i++)
+    CU_ASSERT(coap_rblock_add(&rb, i));
+  CU_ASSERT(rb.first_missing == 64);
+  CU_ASSERT(!coap_rblock_check(&rb, 64));
+
+  CU_ASSERT(coap_rblock_add(&rb, 64));
+  CU_ASSERT(rb.first_missing == 65);
+  CU_ASSERT(rb.end == 65);
+
+  /* Received again */
+  CU_ASSERT(coap_rblock_add(&rb, 0));
+  CU_ASSERT(rb.first_missing == 65);
+
+  coap_rblock_free(&rb);
+}
+
+/* The missing blocks are found across whole words of received blocks */
+static void
+t_block2(void) {
+  static const uint32_t received[] = { 0, 31, 32, 63, 64, 95, 96, 97 };
+  coap_rblock_t rb;
+  uint32_t out[200];
+  uint32_t count;
+  uint32_t i;
+  size_t j;
+
+  memset(&rb, 0, sizeof(rb));
+  for (j = 0; j < sizeof(received) / sizeof(received[0]); j++)
+    CU_ASSERT(coap_rblock_add(&rb, received[j]));
+  CU_ASSERT(rb.first_missing == 1);
+
+  count = coap_block_find_missing(&rb, 130, out, 200);
+  CU_ASSERT(count == 130 - sizeof(received) / sizeof(received[0]));
+  for (i = 0; i < count; i++) {
+    CU_ASSERT(!coap_rblock_check(&rb, out[i]));
+    if (i > 0)
+      CU_ASSERT(out[i] > out[i - 1]);
+  }
+  CU_ASSERT(out[0] == 1);
+  CU_ASSERT(out[29] == 30);
+  CU_ASSERT(out[30] == 33);
+  CU_ASSERT(out[count - 1] == 129);
+
+  /* Limited by the size of out */
+  CU_ASSERT(coap_block_find_missing(&rb, 130, out, 3) == 3);
+  CU_ASSERT(out[0] == 1 && out[1] == 2 && out[2] == 3);
+
+  /* Limited by the number of blocks */
+  CU_ASSERT(coap_block_find_missing(&rb, 33, out, 200) == 30);
+  CU_ASSERT(out[29] == 30);
+
+  /* Whole words received */
+  for (i = 1; i < 96; i++)
+    CU_ASSERT(coap_rblock_add(&rb, i));
+  CU_ASSERT(rb.first_missing == 98);
+  CU_ASSERT(coap_block_find_missing(&rb, 98, out, 200) == 0);
+  CU_ASSERT(coap_block_find_missing(&rb, 100, out, 200) == 2);
+  CU_ASSERT(out[0] == 98 && out[1] == 99);
+
+  coap_rblock_free(&rb);
+}
+
+/* The last block that a block number can address */
+static void
+t_block3(void) {
+  coap_rblock_t rb;
+  uint32_t out[4];
+  uint32_t i;
+  int ok = 1;
+
+  memset(&rb, 0, sizeof(rb));
+  CU_ASSERT(!coap_rblock_size(&rb, COAP_RBLOCK_MAX_BLOCKS + 1));
+  CU_ASSERT(!coap_rblock_add(&rb, COAP_RBLOCK_MAX_BLOCKS));
+  CU_ASSERT(rb.end == 0);
+
+  CU_ASSERT_FATAL(coap_rblock_add(&rb, COAP_RBLOCK_MAX_BLOCKS - 1));
+  CU_ASSERT(rb.words == COAP_RBLOCK_MAX_BLOCKS / 32);
+  CU_ASSERT(rb.end == COAP_RBLOCK_MAX_BLOCKS);
+  CU_ASSERT(rb.first_missing == 0);
+  CU_ASSERT(coap_rblock_check(&rb, COAP_RBLOCK_MAX_BLOCKS - 1));
+  CU_ASSERT(!coap_rblock_check(&rb, COAP_RBLOCK_MAX_BLOCKS - 2));
+  CU_ASSERT(!coap_rblock_check(&rb, COAP_RBLOCK_MAX_BLOCKS));
+
+  CU_ASSERT(coap_block_find_missing(&rb, COAP_RBLOCK_MAX_BLOCKS,
+                                    out, 4) == 4);
+  CU_ASSERT(out[0] == 0 && out[3] == 3);
+
+  for (i = 0; i < COAP_RBLOCK_MAX_BLOCKS - 2; i++)
+    ok &= coap_rblock_add(&rb, i);
+  CU_ASSERT(ok);
+  CU_ASSERT(rb.first_missing == COAP_RBLOCK_MAX_BLOCKS - 2);
+  CU_ASSERT(coap_block_find_missing(&rb, COAP_RBLOCK_MAX_BLOCKS,
+                                    out, 4) == 1);
+  CU_ASSERT(out[0] == COAP_RBLOCK_MAX_BLOCKS - 2);
+
+  /* All in, so the search stops at the end of the bitmap */
+  CU_ASSERT(coap_rblock_add(&rb, COAP_RBLOCK_MAX_BLOCKS - 2));
+  CU_ASSERT(rb.first_missing == COAP_RBLOCK_MAX_BLOCKS);
+  CU_ASSERT(coap_block_find_missing(&rb, COAP_RBLOCK_MAX_BLOCKS,
+                                    out, 4) == 0);
+  CU_ASSERT(rb.words == COAP_RBLOCK_MAX_BLOCKS / 32);
+
+  coap_rblock_free(&rb);
+}
+
+/* Growing, resetting and freeing the bitmap */
+static void
+t_block4(void) {
+  coap_rblock_t rb;
+
+  memset(&rb, 0, sizeof(rb));
+  CU_ASSERT(coap_rblock_size(&rb, 1));
+  CU_ASSERT(rb.words == 1);
+  CU_ASSERT(coap_rblock_size(&rb, 32));
+  CU_ASSERT(rb.words == 1);
+  CU_ASSERT(coap_rblock_size(&rb, 33));
+  CU_ASSERT(rb.words == 2);
+  /* Doubled rather than grown by a word */
+  CU_ASSERT(coap_rblock_size(&rb, 65));
+  CU_ASSERT(rb.words == 4);
+
+  CU_ASSERT(coap_rblock_add(&rb, 0));
+  CU_ASSERT(coap_rblock_add(&rb, 100));
+  coap_rblock_reset(&rb);
+  CU_ASSERT(rb.words == 4);
+  CU_ASSERT(rb.first_missing == 0);
+  CU_ASSERT(rb.end == 0);
+  CU_ASSERT(!coap_rblock_check(&rb, 0));
+  CU_ASSERT(!coap_rblock_check(&rb, 100));
+  CU_ASSERT(rb.bitmap[0] == 0 && rb.bitmap[3] == 0);
+
+  coap_rblock_free(&rb);
+  CU_ASSERT(rb.bitmap == NULL);
+  CU_ASSERT(rb.words == 0);
+}
+
+#define UPLOAD_SIZE 20000
+
+static uint8_t upload_body[UPLOAD_SIZE];
+static size_t upload_received;    /* body length the server was given */
+static int upload_matched;        /* 1 if the body came through intact */
+static uint8_t upload_code;       /* response code the client was given */
+static int upload_token_ok;       /* 1 if the response had the app's token */
+static const uint8_t upload_token[] = { 0x42 };
+
+static void
+upload_put(coap_context_t *ctx COAP_UNUSED,
+           coap_resource_t *resource COAP_UNUSED,
+           coap_session_t *session COAP_UNUSED, coap_pdu_t *request,
+           coap_binary_t *token COAP_UNUSED,
+           coap_string_t *query COAP_UNUSED, coap_pdu_t *response) {
+  const uint8_t *data;
+  size_t length;
+  size_t offset;
+  size_t total;
+
+  if (coap_get_data_large(request, &length, &data, &offset, &total)) {
+    upload_received = length;
+    upload_matched = offset == 0 && length == UPLOAD_SIZE &&
+                     memcmp(data, upload_body, length) == 0;
+  }
+  response->code = COAP_RESPONSE_CODE(204);
+}
+
+static coap_response_t
+upload_response(coap_context_t *ctx COAP_UNUSED,
+                coap_session_t *session COAP_UNUSED,
+                coap_pdu_t *sent COAP_UNUSED, coap_pdu_t *received,
+                const coap_mid_t id COAP_UNUSED) {
+  if (COAP_RESPONSE_CLASS(received->code) == 2 &&
+      received->code != COAP_RESPONSE_CODE(231)) {
+    upload_code = received->code;
+    upload_token_ok = received->token_length == sizeof(upload_token) &&
+                      memcmp(received->token, upload_token,
+                             sizeof(upload_token)) == 0;
+  }
+  return COAP_RESPONSE_OK;
+}
+
+/*
+ * Uploads a body with coap_add_data_large_request() and coap_send() or
+ * coap_send_large() between two contexts on the loopback interface.
+ */
+static void
+upload_large(uint8_t block_mode, uint8_t type,
+             coap_mid_t (*send)(coap_session_t *, coap_pdu_t *)) {
+  coap_context_t *server_ctx;
+  coap_context_t *client_ctx;
+  coap_endpoint_t *endpoint;
+  coap_resource_t *resource;
+  coap_session_t *session;
+  coap_address_t addr;
+  coap_pdu_t *pdu;
+  size_t i;
+  int n;
+
+  for (i = 0; i < sizeof(upload_body); i++)
+    upload_body[i] = (uint8_t)(i * 7);
+  upload_received = 0;
+  upload_matched = 0;
+  upload_code = 0;
+  upload_token_ok = 0;
+
+  server_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(server_ctx != NULL && client_ctx != NULL);
+  coap_context_set_block_mode(server_ctx, block_mode | COAP_BLOCK_SINGLE_BODY);
+  coap_context_set_block_mode(client_ctx, block_mode);
+  coap_register_response_handler(client_ctx, upload_response);
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  endpoint = coap_new_endpoint(server_ctx, &addr, COAP_PROTO_UDP);
+  CU_ASSERT_FATAL(endpoint != NULL);
+  resource = coap_resource_init(coap_make_str_const("upload"), 0);
+  CU_ASSERT_FATAL(resource != NULL);
+  coap_register_handler(resource, COAP_REQUEST_PUT, upload_put);
+  coap_add_resource(server_ctx, resource);
+
+  session = coap_new_client_session(client_ctx, NULL, &endpoint->bind_addr,
+                                    COAP_PROTO_UDP);
+  CU_ASSERT_FATAL(session != NULL);
+  pdu = coap_pdu_init(type, COAP_REQUEST_PUT, coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  CU_ASSERT_FATAL(pdu != NULL);
+  coap_add_token(pdu, sizeof(upload_token), upload_token);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 6, (const uint8_t *)"upload");
+  CU_ASSERT(coap_add_data_large_request(session, pdu, sizeof(upload_body),
+                                        upload_body, NULL, NULL));
+  CU_ASSERT(send(session, pdu) != COAP_INVALID_MID);
+
+  for (n = 0; n < 1000 && upload_code == 0; n++) {
+    coap_io_process(server_ctx, COAP_IO_NO_WAIT);
+    coap_io_process(client_ctx, 5);
+  }
+  CU_ASSERT(upload_code == COAP_RESPONSE_CODE(204));
+  CU_ASSERT(upload_token_ok);
+  CU_ASSERT(upload_received == UPLOAD_SIZE);
+  CU_ASSERT(upload_matched);
+
+  coap_free_context(client_ctx);
+  coap_free_context(server_ctx);
+}
+
+/* Block1 upload sent with coap_send() */
+static void
+t_block5(void) {
+  upload_large(COAP_BLOCK_USE_LIBCOAP, COAP_MESSAGE_CON, coap_send);
+}
+
+/* Q-Block1 upload sent with coap_send() */
+static void
+t_block6(void) {
+  upload_large(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_TRY_Q_BLOCK,
+               COAP_MESSAGE_NON, coap_send);
+}
+
+/* Block1 and Q-Block1 uploads sent with coap_send_large() */
+static void
+t_block7(void) {
+  upload_large(COAP_BLOCK_USE_LIBCOAP, COAP_MESSAGE_CON, coap_send_large);
+  upload_large(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_TRY_Q_BLOCK,
+               COAP_MESSAGE_NON, coap_send_large);
+  upload_large(COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_TRY_Q_BLOCK,
+               COAP_MESSAGE_CON, coap_send_large);
+}
+
+#define DOWNLOAD_SIZE 3000
+
+static uint8_t download_body[DOWNLOAD_SIZE];
+static size_t download_received;
+static int download_matched;
+
+static void
+download_get(coap_context_t *ctx COAP_UNUSED,
+             coap_resource_t *resource,
+             coap_session_t *session, coap_pdu_t *request,
+             coap_binary_t *token,
+             coap_string_t *query, coap_pdu_t *response) {
+  response->code = COAP_RESPONSE_CODE(205);
+  coap_add_data_large_response(resource, session, request, response, token,
+                               query, COAP_MEDIATYPE_TEXT_PLAIN, -1, 0,
+                               sizeof(download_body), download_body,
+                               NULL, NULL);
+}
+
+static void
+download_proxy(coap_context_t *ctx COAP_UNUSED,
+               coap_resource_t *resource,
+               coap_session_t *session, coap_pdu_t *request,
+               coap_binary_t *token COAP_UNUSED,
+               coap_string_t *query COAP_UNUSED, coap_pdu_t *response) {
+  coap_proxy_forward_request(resource, session, request, response);
+}
+
+static coap_response_t
+download_response(coap_context_t *ctx COAP_UNUSED,
+                  coap_session_t *session COAP_UNUSED,
+                  coap_pdu_t *sent COAP_UNUSED, coap_pdu_t *received,
+                  const coap_mid_t id COAP_UNUSED) {
+  const uint8_t *data;
+  size_t length;
+  size_t offset;
+  size_t total;
+
+  if (received->code == COAP_RESPONSE_CODE(205) &&
+      coap_get_data_large(received, &length, &data, &offset, &total)) {
+    download_received = length;
+    download_matched = offset == 0 && length == DOWNLOAD_SIZE &&
+                       memcmp(data, download_body, length) == 0;
+  }
+  return COAP_RESPONSE_OK;
+}
+
+/*
+ * Gets a body that spans several blocks from an origin through a forward
+ * proxy, which answers with a separate response, asking for blocks of
+ * 2^(szx + 4) bytes, or leaving the size to the proxy if szx is -1.
+ */
+static void
+download_proxied(int szx) {
+  static const char *proxy_names[] = { "proxy.test" };
+  coap_context_t *origin_ctx;
+  coap_context_t *proxy_ctx;
+  coap_context_t *client_ctx;
+  coap_endpoint_t *origin_ep;
+  coap_endpoint_t *proxy_ep;
+  coap_resource_t *resource;
+  coap_session_t *session;
+  coap_proxy_config_t config;
+  coap_address_t addr;
+  coap_pdu_t *pdu;
+  char uri[64];
+  size_t i;
+  int n;
+
+  for (i = 0; i < sizeof(download_body); i++)
+    download_body[i] = (uint8_t)(i * 11);
+  download_received = 0;
+  download_matched = 0;
+
+  origin_ctx = coap_new_context(NULL);
+  proxy_ctx = coap_new_context(NULL);
+  client_ctx = coap_new_context(NULL);
+  CU_ASSERT_FATAL(origin_ctx != NULL && proxy_ctx != NULL &&
+                  client_ctx != NULL);
+  coap_context_set_block_mode(origin_ctx, COAP_BLOCK_USE_LIBCOAP);
+  coap_context_set_block_mode(proxy_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  coap_context_set_block_mode(client_ctx,
+                              COAP_BLOCK_USE_LIBCOAP | COAP_BLOCK_SINGLE_BODY);
+  coap_register_response_handler(client_ctx, download_response);
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  origin_ep = coap_new_endpoint(origin_ctx, &addr, COAP_PROTO_UDP);
+  proxy_ep = coap_new_endpoint(proxy_ctx, &addr, COAP_PROTO_UDP);
+  CU_ASSERT_FATAL(origin_ep != NULL && proxy_ep != NULL);
+
+  resource = coap_resource_init(coap_make_str_const("download"), 0);
+  CU_ASSERT_FATAL(resource != NULL);
+  coap_register_handler(resource, COAP_REQUEST_GET, download_get);
+  coap_add_resource(origin_ctx, resource);
+
+  memset(&config, 0, sizeof(config));
+  CU_ASSERT_FATAL(coap_proxy_setup(proxy_ctx, &config));
+  resource = coap_resource_proxy_uri_init(download_proxy, 1, proxy_names);
+  CU_ASSERT_FATAL(resource != NULL);
+  coap_add_resource(proxy_ctx, resource);
+
+  session = coap_new_client_session(client_ctx, NULL, &proxy_ep->bind_addr,
+                                    COAP_PROTO_UDP);
+  CU_ASSERT_FATAL(session != NULL);
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+                      coap_new_message_id(session),
+                      coap_session_max_pdu_size(session));
+  CU_ASSERT_FATAL(pdu != NULL);
+  if (szx >= 0) {
+    uint8_t buf[4];
+
+    coap_add_option(pdu, COAP_OPTION_BLOCK2,
+                    coap_encode_var_safe(buf, sizeof(buf), szx), buf);
+  }
+  n = snprintf(uri, sizeof(uri), "coap://127.0.0.1:%u/download",
+               coap_address_get_port(&origin_ep->bind_addr));
+  coap_add_option(pdu, COAP_OPTION_PROXY_URI, n, (const uint8_t *)uri);
+  CU_ASSERT(coap_send_large(session, pdu) != COAP_INVALID_MID);
+
+  for (n = 0; n < 1000 && download_received == 0; n++) {
+    coap_io_process(origin_ctx, COAP_IO_NO_WAIT);
+    coap_io_process(proxy_ctx, COAP_IO_NO_WAIT);
+    coap_io_process(client_ctx, 5);
+  }
+  CU_ASSERT(download_received == DOWNLOAD_SIZE);
+  CU_ASSERT(download_matched);
+
+  coap_free_context(client_ctx);
+  coap_free_context(proxy_ctx);
+  coap_free_context(origin_ctx);
+}
+
+/* Block2 download through a forward proxy */
+static void
+t_block8(void) {
+  download_proxied(-1);
+  download_proxied(2);
+}
+
+/* The bitmap is not grown past the blocks that a body may have */
+static void
+t_block10(void) {
+  coap_rblock_t rb;
+
+  memset(&rb, 0, sizeof(rb));
+  rb.max_blocks = 70;
+  CU_ASSERT(coap_rblock_add(&rb, 32));
+  CU_ASSERT(rb.words == 2);
+  CU_ASSERT(coap_rblock_add(&rb, 69));
+  CU_ASSERT(rb.words == 3);
+  CU_ASSERT(!coap_rblock_add(&rb, 70));
+  CU_ASSERT(!coap_rblock_size(&rb, 71));
+  CU_ASSERT(rb.words == 3);
+  CU_ASSERT(rb.end == 70);
+  coap_rblock_free(&rb);
+}
+
+#if defined(HAVE_UNISTD_H) && !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+#include <dirent.h>
+#include <unistd.h>
+
+static unsigned int
+resume_files(const char *path) {
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  unsigned int count = 0;
+
+  if (!dir)
+    return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.')
+      count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+/* Saved transfers are bounded in number and in body size */
+static void
+t_block9(void) {
+  char dir[] = "/tmp/coap_resumeXXXXXX";
+  coap_context_t *ctx = coap_new_context(NULL);
+  coap_block_resume_t state;
+  coap_block_resume_t loaded;
+  uint32_t bitmap[1] = { 0x3 };
+  uint64_t key;
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL(ctx);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+  CU_ASSERT(coap_context_set_block_resume(ctx, dir) == 1);
+
+  memset(&state, 0, sizeof(state));
+  state.total_len = 1000;
+  state.bitmap = bitmap;
+  state.words = 1;
+  state.first_missing = 2;
+  state.end = 2;
+  state.szx = 2;
+  state.body_data = coap_new_binary(128);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(state.body_data);
+  memset(state.body_data->s, 'x', state.body_data->length);
+
+  for (key = 1; key <= COAP_BLOCK_RESUME_MAX_FILES + 3; key++) {
+    state.key = key;
+    CU_ASSERT(coap_block_resume_save(ctx, &state) == 1);
+  }
+  CU_ASSERT(resume_files(dir) == COAP_BLOCK_RESUME_MAX_FILES);
+  CU_ASSERT(coap_block_resume_exists(ctx, key - 1) == 1);
+
+  CU_ASSERT(coap_block_resume_load(ctx, key - 1, &loaded) == 1);
+  CU_ASSERT(loaded.total_len == 1000);
+  CU_ASSERT(loaded.first_missing == 2);
+  coap_free_type(COAP_STRING, loaded.bitmap);
+  coap_delete_binary(loaded.body_data);
+
+  /* A body larger than allowed is not read back, and is removed */
+  coap_context_set_max_body_size(ctx, 999);
+  CU_ASSERT(coap_block_resume_load(ctx, key - 1, &loaded) == 0);
+  CU_ASSERT_PTR_NULL(loaded.body_data);
+  CU_ASSERT(coap_block_resume_exists(ctx, key - 1) == 0);
+
+  for (key = 1; key <= COAP_BLOCK_RESUME_MAX_FILES + 3; key++)
+    coap_block_resume_forget(ctx, key);
+  CU_ASSERT(resume_files(dir) == 0);
+  rmdir(dir);
+  coap_delete_binary(state.body_data);
+  coap_free_context(ctx);
+}
+#endif /* HAVE_UNISTD_H && ! WITH_LWIP && ! WITH_CONTIKI */
+
+CU_pSuite
+t_init_block_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("block", NULL, NULL);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add block test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define BLOCK_TEST(s,t)                                               \
+  if (!CU_ADD_TEST(s,t)) {                                            \
+    fprintf(stderr, "W: cannot add block test (%s)\n",                \
+            CU_get_error_msg());                                      \
+  }
+
+  BLOCK_TEST(suite, t_block1);
+  BLOCK_TEST(suite, t_block2);
+  BLOCK_TEST(suite, t_block3);
+  BLOCK_TEST(suite, t_block4);
+  BLOCK_TEST(suite, t_block5);
+  BLOCK_TEST(suite, t_block6);
+  BLOCK_TEST(suite, t_block7);
+  BLOCK_TEST(suite, t_block8);
+#if defined(HAVE_UNISTD_H) && !defined(WITH_LWIP) && !defined(WITH_CONTIKI)
+  BLOCK_TEST(suite, t_block9);
+#endif /* HAVE_UNISTD_H && ! WITH_LWIP && ! WITH_CONTIKI */
+  BLOCK_TEST(suite, t_block10);
+
+  return suite;
+}
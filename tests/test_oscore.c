@@ -0,0 +1,364 @@
+/* libcoap unit tests
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_oscore.h"
+#include "coap2/coap_internal.h"
+
+#include <coap2/coap.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_PDU_SIZE 128
+
+static coap_context_t *ctx;       /* Holds the security contexts */
+static coap_session_t *client;    /* The client side of the exchanges */
+static coap_session_t *server;    /* The server side of the exchanges */
+
+/* RFC 8613 C.1.1: the Common Context of the test vectors */
+static const uint8_t master_secret[] = {
+  0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+  0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10
+};
+static const uint8_t master_salt[] = {
+  0x9e, 0x7c, 0xa9, 0x22, 0x23, 0x78, 0x63, 0x40
+};
+/* The Sender ID of the client is empty, that of the server is 0x01 */
+static const uint8_t server_id[] = { 0x01 };
+
+static const uint8_t token[] = { 0x00, 0x00, 0x39, 0x74 };
+
+/* RFC 8613 C.4: the request of the client, with Sender Sequence Number 20 */
+static const uint8_t c4_plain[] = {
+  0x44, 0x01, 0x5d, 0x1f, 0x00, 0x00, 0x39, 0x74,
+  0x39, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f,
+  0x73, 0x74, 0x83, 0x74, 0x76, 0x31
+};
+static const uint8_t c4_protected[] = {
+  0x44, 0x02, 0x5d, 0x1f, 0x00, 0x00, 0x39, 0x74,
+  0x39, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x68, 0x6f,
+  0x73, 0x74, 0x62, 0x09, 0x14, 0xff, 0x61, 0x2f,
+  0x10, 0x92, 0xf1, 0x77, 0x6f, 0x1c, 0x16, 0x68,
+  0xb3, 0x82, 0x5e
+};
+/* Offset of the flags byte of the OSCORE option in c4_protected */
+#define C4_OSCORE_FLAGS 19
+
+/* RFC 8613 C.7: the response of the server to it, without a Partial IV */
+static const uint8_t c7_plain[] = {
+  0x64, 0x45, 0x5d, 0x1f, 0x00, 0x00, 0x39, 0x74,
+  0xff, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x20, 0x57,
+  0x6f, 0x72, 0x6c, 0x64, 0x21
+};
+static const uint8_t c7_protected[] = {
+  0x64, 0x44, 0x5d, 0x1f, 0x00, 0x00, 0x39, 0x74,
+  0x90, 0xff, 0xdb, 0xaa, 0xd1, 0xe9, 0xa7, 0xe7,
+  0xb2, 0xa8, 0x13, 0xd3, 0xc3, 0x15, 0x24, 0x37,
+  0x83, 0x03, 0xcd, 0xaf, 0xae, 0x11, 0x91, 0x06
+};
+
+static int
+add_oscore(const uint8_t *sender_id, size_t sender_id_len,
+           const uint8_t *recipient_id, size_t recipient_id_len,
+           uint64_t sender_seq) {
+  coap_oscore_conf_t conf;
+
+  memset(&conf, 0, sizeof(conf));
+  conf.master_secret.s = master_secret;
+  conf.master_secret.length = sizeof(master_secret);
+  conf.master_salt.s = master_salt;
+  conf.master_salt.length = sizeof(master_salt);
+  conf.sender_id.s = sender_id;
+  conf.sender_id.length = sender_id_len;
+  conf.recipient_id.s = recipient_id;
+  conf.recipient_id.length = recipient_id_len;
+  conf.sender_seq = sender_seq;
+  return coap_context_add_oscore(ctx, &conf);
+}
+
+/* Checks that @p pdu goes on the wire as the @p length bytes of @p wire */
+static void
+check_wire(coap_pdu_t *pdu, const uint8_t *wire, size_t length) {
+  size_t hdr_size = coap_pdu_encode_header(pdu, COAP_PROTO_UDP);
+
+  CU_ASSERT(hdr_size + pdu->used_size == length);
+  if (hdr_size + pdu->used_size == length)
+    CU_ASSERT(memcmp(pdu->token - hdr_size, wire, length) == 0);
+}
+
+static coap_pdu_t *
+parse_wire(const uint8_t *wire, size_t length) {
+  coap_pdu_t *pdu = coap_pdu_init(0, 0, 0, TEST_PDU_SIZE);
+
+  if (pdu && !coap_pdu_parse(COAP_PROTO_UDP, wire, length, pdu)) {
+    coap_delete_pdu(pdu);
+    pdu = NULL;
+  }
+  return pdu;
+}
+
+/* Hands the protected request in @p wire to the server */
+static int
+unprotect_wire(const uint8_t *wire, size_t length) {
+  coap_pdu_t *pdu = parse_wire(wire, length);
+  int resp;
+
+  if (!pdu)
+    return -1;
+  resp = coap_oscore_unprotect_request(server, pdu);
+  coap_delete_pdu(pdu);
+  return resp;
+}
+
+/*
+ * Has the client protect a GET with token @p tok, and puts it in @p wire
+ * as it goes out.
+ */
+static size_t
+protect_request(uint8_t tok, uint8_t *wire, size_t size) {
+  coap_pdu_t *pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+                                  tok, TEST_PDU_SIZE);
+  size_t hdr_size;
+  size_t length = 0;
+
+  if (!pdu || !coap_add_token(pdu, 1, &tok) ||
+      !coap_add_option(pdu, COAP_OPTION_URI_PATH, 3,
+                       (const uint8_t *)"tv1")) {
+    coap_delete_pdu(pdu);
+    return 0;
+  }
+  pdu = coap_oscore_send_pdu(client, pdu);
+  if (!pdu)
+    return 0;
+  hdr_size = coap_pdu_encode_header(pdu, COAP_PROTO_UDP);
+  if (hdr_size && hdr_size + pdu->used_size <= size) {
+    length = hdr_size + pdu->used_size;
+    memcpy(wire, pdu->token - hdr_size, length);
+  }
+  coap_delete_pdu(pdu);
+  return length;
+}
+
+/* The client protects the request of C.4 */
+static void
+t_oscore1(void) {
+  coap_pdu_t *pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+                                  0x5d1f, TEST_PDU_SIZE);
+
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_add_token(pdu, sizeof(token), token));
+  CU_ASSERT(coap_add_option(pdu, COAP_OPTION_URI_HOST, 9,
+                            (const uint8_t *)"localhost"));
+  CU_ASSERT(coap_add_option(pdu, COAP_OPTION_URI_PATH, 3,
+                            (const uint8_t *)"tv1"));
+  check_wire(pdu, c4_plain, sizeof(c4_plain));
+
+  /* The plain request is kept by the exchange */
+  pdu = coap_oscore_send_pdu(client, pdu);
+  CU_ASSERT_FATAL(pdu != NULL);
+  check_wire(pdu, c4_protected, sizeof(c4_protected));
+  coap_delete_pdu(pdu);
+}
+
+/* The server verifies the request of C.4 */
+static void
+t_oscore2(void) {
+  coap_pdu_t *pdu = parse_wire(c4_protected, sizeof(c4_protected));
+
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_oscore_unprotect_request(server, pdu) == 0);
+  check_wire(pdu, c4_plain, sizeof(c4_plain));
+  coap_delete_pdu(pdu);
+}
+
+/* The server protects its response, which is C.7 */
+static void
+t_oscore3(void) {
+  coap_pdu_t *pdu = coap_pdu_init(COAP_MESSAGE_ACK, COAP_RESPONSE_CODE(205),
+                                  0x5d1f, TEST_PDU_SIZE);
+
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_add_token(pdu, sizeof(token), token));
+  CU_ASSERT(coap_add_data(pdu, 12, (const uint8_t *)"Hello World!"));
+  check_wire(pdu, c7_plain, sizeof(c7_plain));
+
+  pdu = coap_oscore_send_pdu(server, pdu);
+  CU_ASSERT_FATAL(pdu != NULL);
+  check_wire(pdu, c7_protected, sizeof(c7_protected));
+  coap_delete_pdu(pdu);
+}
+
+/* The client verifies the response of C.7 */
+static void
+t_oscore4(void) {
+  coap_pdu_t *pdu = parse_wire(c7_protected, sizeof(c7_protected));
+  coap_pdu_t *sent = NULL;
+  coap_oscore_assoc_t *assoc = NULL;
+
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_oscore_unprotect_response(client, pdu, &sent, &assoc) == 1);
+  CU_ASSERT_FATAL(assoc != NULL);
+  check_wire(pdu, c7_plain, sizeof(c7_plain));
+  /* The response handler is given the request as it was before protection */
+  CU_ASSERT_FATAL(sent != NULL);
+  check_wire(sent, c4_plain, sizeof(c4_plain));
+  coap_oscore_assoc_done(client, assoc, 0);
+  coap_delete_pdu(pdu);
+
+  /* The exchange is over, so the response is not taken again */
+  pdu = parse_wire(c7_protected, sizeof(c7_protected));
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_oscore_unprotect_response(client, pdu, &sent, &assoc) == 0);
+  CU_ASSERT(assoc == NULL);
+  coap_delete_pdu(pdu);
+}
+
+/* The request of C.4 is rejected when it is replayed */
+static void
+t_oscore5(void) {
+  coap_pdu_t *pdu = parse_wire(c4_protected, sizeof(c4_protected));
+
+  CU_ASSERT_FATAL(pdu != NULL);
+  CU_ASSERT(coap_oscore_unprotect_request(server, pdu) == 401);
+  /* and left as it was */
+  check_wire(pdu, c4_protected, sizeof(c4_protected));
+  coap_delete_pdu(pdu);
+}
+
+/* Requests that are older than the replay window are rejected */
+static void
+t_oscore6(void) {
+  static const uint8_t client_id[] = { 0x02 };
+  static const uint8_t other_id[] = { 0x03 };
+  coap_bin_const_t rid = { sizeof(other_id), other_id };
+  uint8_t old_req[TEST_PDU_SIZE];
+  uint8_t late_req[TEST_PDU_SIZE];
+  uint8_t new_req[TEST_PDU_SIZE];
+  size_t old_len, late_len, new_len;
+
+  CU_ASSERT_FATAL(add_oscore(client_id, sizeof(client_id),
+                             other_id, sizeof(other_id), 10));
+  CU_ASSERT_FATAL(add_oscore(other_id, sizeof(other_id),
+                             client_id, sizeof(client_id), 0));
+  CU_ASSERT_FATAL(coap_session_set_oscore(client, &rid, NULL));
+
+  /* Sequence number 10 */
+  old_len = protect_request(0x10, old_req, sizeof(old_req));
+  CU_ASSERT_FATAL(old_len > 0);
+
+  /* The client starts over at 80 */
+  CU_ASSERT(coap_context_remove_oscore(ctx, &rid, NULL));
+  CU_ASSERT_FATAL(add_oscore(client_id, sizeof(client_id),
+                             other_id, sizeof(other_id), 80));
+  CU_ASSERT_FATAL(coap_session_set_oscore(client, &rid, NULL));
+  late_len = protect_request(0x11, late_req, sizeof(late_req));
+  new_len = protect_request(0x12, new_req, sizeof(new_req));
+  CU_ASSERT_FATAL(late_len > 0 && new_len > 0);
+
+  CU_ASSERT(unprotect_wire(new_req, new_len) == 0);
+  /* Reordered, but within the window */
+  CU_ASSERT(unprotect_wire(late_req, late_len) == 0);
+  /* 71 behind the highest, with a window of 32 */
+  CU_ASSERT(unprotect_wire(old_req, old_len) == 401);
+  CU_ASSERT(unprotect_wire(late_req, late_len) == 401);
+  CU_ASSERT(unprotect_wire(new_req, new_len) == 401);
+}
+
+/* A malformed OSCORE option is answered with 4.02 Bad Option */
+static void
+t_oscore7(void) {
+  static const uint8_t bad_flags[] = {
+    0x89,  /* reserved bit */
+    0x0e,  /* a Partial IV length of 6 */
+    0x0a,  /* a Partial IV of 2 bytes, of which there is 1 */
+    0x19,  /* a kid context flag with no room for its length */
+    0x01   /* no kid */
+  };
+  uint8_t wire[sizeof(c4_protected)];
+  size_t i;
+
+  for (i = 0; i < sizeof(bad_flags); i++) {
+    memcpy(wire, c4_protected, sizeof(wire));
+    wire[C4_OSCORE_FLAGS] = bad_flags[i];
+    CU_ASSERT(unprotect_wire(wire, sizeof(wire)) == 402);
+  }
+  /* An empty OSCORE option has neither a kid nor a Partial IV */
+  memcpy(wire, c4_protected, C4_OSCORE_FLAGS - 1);
+  wire[C4_OSCORE_FLAGS - 1] = 0x90;
+  memcpy(&wire[C4_OSCORE_FLAGS], &c4_protected[C4_OSCORE_FLAGS + 2],
+         sizeof(c4_protected) - C4_OSCORE_FLAGS - 2);
+  CU_ASSERT(unprotect_wire(wire, sizeof(wire) - 2) == 402);
+}
+
+static int
+t_oscore_tests_create(void) {
+  coap_address_t addr;
+  coap_bin_const_t rid = { sizeof(server_id), server_id };
+
+  ctx = coap_new_context(NULL);
+  if (!ctx)
+    return 1;
+  /* The client (Sender ID empty) and the server (Sender ID 0x01) share ctx */
+  if (!add_oscore(NULL, 0, server_id, sizeof(server_id), 20) ||
+      !add_oscore(server_id, sizeof(server_id), NULL, 0, 0))
+    return 1;
+
+  coap_address_init(&addr);
+  addr.size = sizeof(struct sockaddr_in6);
+  addr.addr.sin6.sin6_family = AF_INET6;
+  addr.addr.sin6.sin6_addr = in6addr_loopback;
+  addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT);
+  client = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+  addr.addr.sin6.sin6_port = htons(COAP_DEFAULT_PORT + 1);
+  server = coap_new_client_session(ctx, NULL, &addr, COAP_PROTO_UDP);
+
+  return !client || !server || !coap_session_set_oscore(client, &rid, NULL);
+}
+
+static int
+t_oscore_tests_remove(void) {
+  coap_free_context(ctx);
+  return 0;
+}
+
+CU_pSuite
+t_init_oscore_tests(void) {
+  CU_pSuite suite;
+
+  if (!coap_oscore_is_supported()) {
+    fprintf(stderr, "W: OSCORE not supported, no oscore tests\n");
+    return NULL;
+  }
+
+  suite = CU_add_suite("oscore",
+                       t_oscore_tests_create, t_oscore_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add oscore test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define OSCORE_TEST(s,t)                                              \
+  if (!CU_ADD_TEST(s,t)) {                                            \
+    fprintf(stderr, "W: cannot add oscore test (%s)\n",               \
+            CU_get_error_msg());                                      \
+  }
+
+  OSCORE_TEST(suite, t_oscore1);
+  OSCORE_TEST(suite, t_oscore2);
+  OSCORE_TEST(suite, t_oscore3);
+  OSCORE_TEST(suite, t_oscore4);
+  OSCORE_TEST(suite, t_oscore5);
+  OSCORE_TEST(suite, t_oscore6);
+  OSCORE_TEST(suite, t_oscore7);
+
+  return suite;
+}
@@ -0,0 +1,9 @@
+/* libcoap unit tests
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include <CUnit/CUnit.h>
+
+CU_pSuite t_init_oscore_tests(void);
@@ -325,6 +325,39 @@ t_parse_pdu17(void) {
   CU_ASSERT(result == 0);
 }
 
+static void
+t_parse_pdu18(void) {
+  /* PDU parsed in place, which is copied out when the token grows */
+  uint8_t teststr[] = {  0x53, 0x45, 0x12, 0x34, 't', 'o', 'k',
+                         0x61, 'x', 0xff, 'p', 'a', 'y'
+  };
+  uint8_t orig[sizeof(teststr)];
+  coap_pdu_t *testpdu;
+
+  memcpy(orig, teststr, sizeof(teststr));
+  testpdu = coap_pdu_borrow(COAP_PROTO_UDP, teststr, sizeof(teststr), 128);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(testpdu);
+  CU_ASSERT(coap_pdu_parse_header(testpdu, COAP_PROTO_UDP) > 0);
+  CU_ASSERT(coap_pdu_parse_opt(testpdu) > 0);
+
+  CU_ASSERT(testpdu->token == teststr + 4);
+  CU_ASSERT(testpdu->token_length == 3);
+  CU_ASSERT(testpdu->code == 0x45);
+  CU_ASSERT(testpdu->mid == 0x1234);
+  CU_ASSERT(testpdu->data == teststr + 10);
+
+  CU_ASSERT(coap_update_token(testpdu, 8, (const uint8_t *)"longtokn") > 0);
+  CU_ASSERT(testpdu->borrowed == 0);
+  CU_ASSERT(memcmp(teststr, orig, sizeof(teststr)) == 0);
+  CU_ASSERT(testpdu->token_length == 8);
+  CU_ASSERT(memcmp(testpdu->token, "longtokn", 8) == 0);
+  CU_ASSERT(testpdu->used_size == sizeof(teststr) - 4 + 5);
+  CU_ASSERT_PTR_NOT_NULL(testpdu->data);
+  CU_ASSERT(memcmp(testpdu->data, "pay", 3) == 0);
+
+  coap_delete_pdu(testpdu);
+}
+
 /************************************************************************
  ** PDU encoder
  ************************************************************************/
@@ -1199,6 +1232,207 @@ t_encode_pdu21(void) {
   CU_ASSERT(memcmp(pdu->token, data3, pdu->used_size) == 0);
 }
 
+static void
+t_encode_pdu22(void) {
+  uint8_t  token[] = { 't' };
+  uint8_t  data[] = { 'd', 'a', 't', 'a' };
+  uint8_t  hdr[] = { 0x51, 0x45 };
+  size_t len;
+  uint8_t *pdata;
+
+  coap_pdu_clear(pdu, pdu->max_size);        /* clear PDU */
+  pdu->code = COAP_RESPONSE_CODE(205);
+  coap_add_token(pdu, sizeof(token), token);
+
+  /* Payload sent from outside of the PDU buffer after the marker */
+  pdu->token[pdu->used_size++] = COAP_PAYLOAD_START;
+  pdu->data = pdu->token + pdu->used_size;
+  pdu->xmit_data = data;
+  pdu->xmit_length = sizeof(data);
+
+  CU_ASSERT(coap_pdu_encode_header(pdu, COAP_PROTO_TCP) == 2);
+  CU_ASSERT(memcmp(pdu->token - pdu->hdr_size, hdr, sizeof(hdr)) == 0);
+  CU_ASSERT(COAP_PDU_WIRE_SIZE(pdu) == 8);
+
+  CU_ASSERT(coap_get_data(pdu, &len, &pdata) == 1);
+  CU_ASSERT(len == sizeof(data));
+  CU_ASSERT(pdata == data);
+
+  pdu->xmit_data = NULL;
+  pdu->xmit_length = 0;
+}
+
+/*
+ * Checks that @p pdu has been encoded to the same bytes as @p ref, which
+ * has been built up with coap_add_option().
+ */
+static void
+check_opt_stage(const coap_pdu_t *ref) {
+  CU_ASSERT_FATAL(pdu->used_size == ref->used_size);
+  CU_ASSERT(memcmp(pdu->token, ref->token, ref->used_size) == 0);
+  CU_ASSERT(pdu->max_opt == ref->max_opt);
+  if (ref->data) {
+    CU_ASSERT(pdu->data - pdu->token == ref->data - ref->token);
+  } else {
+    CU_ASSERT(pdu->data == NULL);
+  }
+}
+
+/* Options staged out of order, and after the payload has been added */
+static void
+t_encode_pdu23(void) {
+  static const uint16_t opt_num[] = { 300, 11, 7, 2000, 60, 1 };
+  uint8_t  token[] = { 't' };
+  uint8_t  opt_val[20];
+  size_t   opt_len[] = { 1, 12, 2, 0, 20, 9 };
+  uint8_t  data[] = { 'd', 'a', 't', 'a' };
+  coap_pdu_t *ref;
+  coap_opt_stage_t stage;
+  size_t n;
+  size_t i;
+
+  ref = coap_pdu_init(0, 0, 0, COAP_DEFAULT_MTU);
+  CU_ASSERT_FATAL(ref != NULL);
+  for (n = 0; n < sizeof(opt_val); n++)
+    opt_val[n] = (uint8_t)('a' + n);
+
+  coap_add_token(ref, sizeof(token), token);
+  /* In option number order */
+  for (i = 0; i < 2000; i++) {
+    for (n = 0; n < sizeof(opt_num) / sizeof(opt_num[0]); n++) {
+      if (opt_num[n] == i + 1)
+        CU_ASSERT(coap_add_option(ref, opt_num[n], opt_len[n], opt_val) > 0);
+    }
+  }
+  coap_add_data(ref, sizeof(data), data);
+
+  coap_pdu_clear(pdu, pdu->max_size);        /* clear PDU */
+  coap_add_token(pdu, sizeof(token), token);
+  coap_add_data(pdu, sizeof(data), data);
+  coap_opt_stage_init(&stage);
+  for (n = 0; n < sizeof(opt_num) / sizeof(opt_num[0]); n++)
+    CU_ASSERT(coap_opt_stage_add(&stage, opt_num[n], opt_len[n], opt_val));
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  coap_delete_pdu(ref);
+}
+
+/* Repeated options, merged with the options that are in the PDU */
+static void
+t_encode_pdu24(void) {
+  uint8_t  token[] = { 't' };
+  uint8_t  data[] = { 'd', 'a', 't', 'a' };
+  coap_pdu_t *ref;
+  coap_opt_stage_t stage;
+
+  ref = coap_pdu_init(0, 0, 0, COAP_DEFAULT_MTU);
+  CU_ASSERT_FATAL(ref != NULL);
+  coap_add_token(ref, sizeof(token), token);
+  coap_add_option(ref, COAP_OPTION_URI_PATH, 1, (const uint8_t *)"x");
+  coap_add_option(ref, COAP_OPTION_URI_PATH, 1, (const uint8_t *)"a");
+  coap_add_option(ref, COAP_OPTION_URI_PATH, 1, (const uint8_t *)"b");
+  coap_add_option(ref, COAP_OPTION_URI_QUERY, 1, (const uint8_t *)"q");
+  coap_add_data(ref, sizeof(data), data);
+
+  /* Staged after the ones in the PDU, in the order staged */
+  coap_pdu_clear(pdu, pdu->max_size);        /* clear PDU */
+  coap_add_token(pdu, sizeof(token), token);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 1, (const uint8_t *)"x");
+  coap_add_option(pdu, COAP_OPTION_URI_QUERY, 1, (const uint8_t *)"q");
+  coap_add_data(pdu, sizeof(data), data);
+  coap_opt_stage_init(&stage);
+  CU_ASSERT(coap_opt_stage_add(&stage, COAP_OPTION_URI_PATH, 1,
+                               (const uint8_t *)"a"));
+  CU_ASSERT(coap_opt_stage_add(&stage, COAP_OPTION_URI_PATH, 1,
+                               (const uint8_t *)"b"));
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  /* Update replaces all the repeated options, staged or in the PDU */
+  coap_pdu_clear(ref, ref->max_size);
+  coap_add_token(ref, sizeof(token), token);
+  coap_add_option(ref, COAP_OPTION_URI_PATH, 1, (const uint8_t *)"u");
+  coap_add_option(ref, COAP_OPTION_URI_QUERY, 1, (const uint8_t *)"q");
+  coap_add_data(ref, sizeof(data), data);
+
+  coap_opt_stage_init(&stage);
+  CU_ASSERT(coap_opt_stage_add(&stage, COAP_OPTION_URI_PATH, 1,
+                               (const uint8_t *)"c"));
+  CU_ASSERT(coap_opt_stage_update(&stage, COAP_OPTION_URI_PATH, 1,
+                                  (const uint8_t *)"u"));
+  CU_ASSERT(stage.count == 1);
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  /* Remove takes them all out */
+  coap_pdu_clear(ref, ref->max_size);
+  coap_add_token(ref, sizeof(token), token);
+  coap_add_option(ref, COAP_OPTION_URI_QUERY, 1, (const uint8_t *)"q");
+  coap_add_data(ref, sizeof(data), data);
+
+  coap_opt_stage_init(&stage);
+  CU_ASSERT(coap_opt_stage_remove(&stage, COAP_OPTION_URI_PATH));
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  /* A request with Proxy-Uri gets a Hop-Limit as with coap_add_option() */
+  coap_pdu_clear(ref, ref->max_size);
+  ref->code = COAP_REQUEST_GET;
+  coap_add_token(ref, sizeof(token), token);
+  coap_add_option(ref, COAP_OPTION_PROXY_URI, 4, (const uint8_t *)"coap");
+  coap_add_data(ref, sizeof(data), data);
+
+  coap_pdu_clear(pdu, pdu->max_size);
+  pdu->code = COAP_REQUEST_GET;
+  coap_add_token(pdu, sizeof(token), token);
+  coap_add_data(pdu, sizeof(data), data);
+  coap_opt_stage_init(&stage);
+  CU_ASSERT(coap_opt_stage_add(&stage, COAP_OPTION_PROXY_URI, 4,
+                               (const uint8_t *)"coap"));
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  coap_delete_pdu(ref);
+}
+
+/* Option deltas and lengths that need extended bytes */
+static void
+t_encode_pdu25(void) {
+  static const uint16_t opt_num[] = { 12, 13, 268, 269, 538, 65000 };
+  static const size_t opt_len[] = { 12, 13, 268, 269, 0, 1 };
+  uint8_t  token[] = { 't', 'o' };
+  uint8_t  opt_val[269];
+  coap_pdu_t *ref;
+  coap_opt_stage_t stage;
+  size_t n;
+
+  memset(opt_val, 'v', sizeof(opt_val));
+  ref = coap_pdu_init(0, 0, 0, COAP_DEFAULT_MTU);
+  CU_ASSERT_FATAL(ref != NULL);
+  coap_add_token(ref, sizeof(token), token);
+  for (n = 0; n < sizeof(opt_num) / sizeof(opt_num[0]); n++)
+    CU_ASSERT(coap_add_option(ref, opt_num[n], opt_len[n], opt_val) > 0);
+
+  coap_pdu_clear(pdu, pdu->max_size);        /* clear PDU */
+  coap_add_token(pdu, sizeof(token), token);
+  coap_opt_stage_init(&stage);
+  /* Backwards, so each one has to be sorted in */
+  for (n = sizeof(opt_num) / sizeof(opt_num[0]); n > 0; n--)
+    CU_ASSERT(coap_opt_stage_add(&stage, opt_num[n - 1], opt_len[n - 1],
+                                 opt_val));
+  CU_ASSERT(coap_add_opt_stage_pdu(pdu, &stage));
+  check_opt_stage(ref);
+
+  /* No more than COAP_OPT_STAGE_SIZE options can be staged */
+  CU_ASSERT(coap_opt_stage_add(&stage, 1, 0, NULL));
+  CU_ASSERT(coap_opt_stage_add(&stage, 1, 0, NULL));
+  CU_ASSERT(stage.count == COAP_OPT_STAGE_SIZE);
+  CU_ASSERT(!coap_opt_stage_add(&stage, 1, 0, NULL));
+
+  coap_delete_pdu(ref);
+}
+
 static int
 t_pdu_tests_create(void) {
   pdu = coap_pdu_init(0, 0, 0, COAP_DEFAULT_MTU);
@@ -1247,6 +1481,7 @@ t_init_pdu_tests(void) {
   PDU_TEST(suite[0], t_parse_pdu15);
   PDU_TEST(suite[0], t_parse_pdu16);
   PDU_TEST(suite[0], t_parse_pdu17);
+  PDU_TEST(suite[0], t_parse_pdu18);
 
   suite[1] = CU_add_suite("pdu encoder", t_pdu_tests_create, t_pdu_tests_remove);
   if (suite[1]) {
@@ -1276,6 +1511,10 @@ t_init_pdu_tests(void) {
     PDU_ENCODER_TEST(suite[1], t_encode_pdu19);
     PDU_ENCODER_TEST(suite[1], t_encode_pdu20);
     PDU_ENCODER_TEST(suite[1], t_encode_pdu21);
+    PDU_ENCODER_TEST(suite[1], t_encode_pdu22);
+    PDU_ENCODER_TEST(suite[1], t_encode_pdu23);
+    PDU_ENCODER_TEST(suite[1], t_encode_pdu24);
+    PDU_ENCODER_TEST(suite[1], t_encode_pdu25);
 
   } else                         /* signal error */
     fprintf(stderr, "W: cannot add pdu parser test suite (%s)\n",
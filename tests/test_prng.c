@@ -0,0 +1,131 @@
+/* libcoap unit tests
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_prng.h"
+#include "coap2/coap_internal.h"
+
+#include <coap2/coap.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/* RFC 8439 A.1: the key stream of the ChaCha20 block function */
+static const uint8_t zero_key_block0[64] = {
+  0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+  0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+  0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+  0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+  0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+  0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+  0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+  0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+};
+static const uint8_t zero_key_block1[64] = {
+  0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a,
+  0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+  0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69,
+  0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed,
+  0x29, 0xb7, 0x21, 0x76, 0x9c, 0xe6, 0x4e, 0x43,
+  0xd5, 0x71, 0x33, 0xb0, 0x74, 0xd8, 0x39, 0xd5,
+  0x31, 0xed, 0x1f, 0x28, 0x51, 0x0a, 0xfb, 0x45,
+  0xac, 0xe1, 0x0a, 0x1f, 0x4b, 0x79, 0x4d, 0x6f
+};
+static const uint8_t one_key_block1[64] = {
+  0x3a, 0xeb, 0x52, 0x24, 0xec, 0xf8, 0x49, 0x92,
+  0x9b, 0x9d, 0x82, 0x8d, 0xb1, 0xce, 0xd4, 0xdd,
+  0x83, 0x20, 0x25, 0xe8, 0x01, 0x8b, 0x81, 0x60,
+  0xb8, 0x22, 0x84, 0xf3, 0xc9, 0x49, 0xaa, 0x5a,
+  0x8e, 0xca, 0x00, 0xbb, 0xb4, 0xa7, 0x3b, 0xda,
+  0xd1, 0x92, 0xb5, 0xc4, 0x2f, 0x73, 0xf2, 0xfd,
+  0x4e, 0x27, 0x36, 0x44, 0xc8, 0xb3, 0x61, 0x25,
+  0xa6, 0x4a, 0xdd, 0xeb, 0x00, 0x6c, 0x13, 0xa0
+};
+static const uint8_t ff_key_block2[64] = {
+  0x72, 0xd5, 0x4d, 0xfb, 0xf1, 0x2e, 0xc4, 0x4b,
+  0x36, 0x26, 0x92, 0xdf, 0x94, 0x13, 0x7f, 0x32,
+  0x8f, 0xea, 0x8d, 0xa7, 0x39, 0x90, 0x26, 0x5e,
+  0xc1, 0xbb, 0xbe, 0xa1, 0xae, 0x9a, 0xf0, 0xca,
+  0x13, 0xb2, 0x5a, 0xa2, 0x6c, 0xb4, 0xa6, 0x48,
+  0xcb, 0x9b, 0x9d, 0x1b, 0xe6, 0x5b, 0x2c, 0x09,
+  0x24, 0xa6, 0x6c, 0x54, 0xd5, 0x45, 0xec, 0x1b,
+  0x73, 0x74, 0xf4, 0x87, 0x2e, 0x99, 0xf0, 0x96
+};
+
+/* Test Vectors #1 and #2: the all zero key, blocks 0 and 1 */
+static void
+t_prng1(void) {
+  uint8_t key[32];
+  uint8_t out[64];
+
+  memset(key, 0, sizeof(key));
+  coap_prng_chacha20_block(key, 0, out);
+  CU_ASSERT(memcmp(out, zero_key_block0, sizeof(out)) == 0);
+  coap_prng_chacha20_block(key, 1, out);
+  CU_ASSERT(memcmp(out, zero_key_block1, sizeof(out)) == 0);
+}
+
+/* Test Vector #3: the last key byte is 1 */
+static void
+t_prng2(void) {
+  uint8_t key[32];
+  uint8_t out[64];
+
+  memset(key, 0, sizeof(key));
+  key[31] = 0x01;
+  coap_prng_chacha20_block(key, 1, out);
+  CU_ASSERT(memcmp(out, one_key_block1, sizeof(out)) == 0);
+}
+
+/* Test Vector #4: the second key byte is 0xff */
+static void
+t_prng3(void) {
+  uint8_t key[32];
+  uint8_t out[64];
+
+  memset(key, 0, sizeof(key));
+  key[1] = 0xff;
+  coap_prng_chacha20_block(key, 2, out);
+  CU_ASSERT(memcmp(out, ff_key_block2, sizeof(out)) == 0);
+}
+
+/* The output of coap_prng() is not repeated across refills */
+static void
+t_prng4(void) {
+  uint8_t a[300];
+  uint8_t b[300];
+
+  CU_ASSERT(coap_prng(a, sizeof(a)));
+  CU_ASSERT(coap_prng(b, sizeof(b)));
+  CU_ASSERT(memcmp(a, b, sizeof(a)) != 0);
+  CU_ASSERT(memcmp(a, a + 64, 64) != 0);
+}
+
+CU_pSuite
+t_init_prng_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("prng", NULL, NULL);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add prng test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define PRNG_TEST(s,t)                                                \
+  if (!CU_ADD_TEST(s,t)) {                                            \
+    fprintf(stderr, "W: cannot add prng test (%s)\n",                 \
+            CU_get_error_msg());                                      \
+  }
+
+  PRNG_TEST(suite, t_prng1);
+  PRNG_TEST(suite, t_prng2);
+  PRNG_TEST(suite, t_prng3);
+  PRNG_TEST(suite, t_prng4);
+
+  return suite;
+}
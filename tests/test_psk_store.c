@@ -0,0 +1,337 @@
+/* libcoap unit tests
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#include "coap_config.h"
+#include "test_psk_store.h"
+#include "coap2/coap_internal.h"
+
+#include <coap2/coap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PSK_STORE_FILE "test_psk_store.tmp"
+
+/* The file layout of src/coap_psk_store.c */
+#define PSK_STORE_ORDER_OFFSET 8
+#define PSK_STORE_COUNT_OFFSET 12
+#define PSK_STORE_SLOTS_OFFSET 16
+#define PSK_STORE_HEADER_SIZE 32
+#define PSK_STORE_SLOT_SIZE 8
+
+static uint8_t *store_file;       /* a saved store of a single identity */
+static size_t store_file_len;
+static size_t store_data_offset;  /* where its records start */
+
+static int
+write_store_file(const uint8_t *data, size_t length) {
+  FILE *fp = fopen(PSK_STORE_FILE, "wb");
+  int ok;
+
+  if (!fp)
+    return 0;
+  ok = length == 0 || fwrite(data, length, 1, fp) == 1;
+  if (fclose(fp) != 0)
+    ok = 0;
+  return ok;
+}
+
+/* Loads the store file after writing @p data to it */
+static coap_psk_store_t *
+load_store_file(const uint8_t *data, size_t length) {
+  if (!write_store_file(data, length))
+    return NULL;
+  return coap_psk_store_load(PSK_STORE_FILE);
+}
+
+static int
+has_key(const coap_psk_store_t *store, const char *identity,
+        const char *key) {
+  coap_bin_const_t found;
+
+  if (!coap_psk_store_find(store, (const uint8_t *)identity,
+                           strlen(identity), &found))
+    return 0;
+  return found.length == strlen(key) &&
+         memcmp(found.s, key, found.length) == 0;
+}
+
+static void
+add_key(coap_psk_store_t *store, const char *identity, const char *key) {
+  coap_bin_const_t id = { strlen(identity), (const uint8_t *)identity };
+  coap_bin_const_t k = { strlen(key), (const uint8_t *)key };
+
+  CU_ASSERT(coap_psk_store_add(store, &id, &k));
+}
+
+/* Saved and loaded back */
+static void
+t_psk_store1(void) {
+  coap_psk_store_t *store;
+  char identity[16];
+  int i;
+
+  store = coap_psk_store_new();
+  CU_ASSERT_FATAL(store != NULL);
+  for (i = 0; i < 1000; i++) {
+    snprintf(identity, sizeof(identity), "client%d", i);
+    add_key(store, identity, identity + 6);
+  }
+  add_key(store, "", "empty");
+  add_key(store, "client7", "replaced");
+  CU_ASSERT(coap_psk_store_count(store) == 1001);
+  CU_ASSERT(coap_psk_store_save(store, PSK_STORE_FILE));
+  coap_psk_store_free(store);
+
+  store = coap_psk_store_load(PSK_STORE_FILE);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(coap_psk_store_count(store) == 1001);
+  CU_ASSERT(has_key(store, "client0", "0"));
+  CU_ASSERT(has_key(store, "client999", "999"));
+  CU_ASSERT(has_key(store, "client7", "replaced"));
+  CU_ASSERT(has_key(store, "", "empty"));
+  CU_ASSERT(!has_key(store, "client1000", "1000"));
+  CU_ASSERT(!has_key(store, "client", ""));
+  /* A loaded store cannot be added to */
+  {
+    coap_bin_const_t id = { 1, (const uint8_t *)"x" };
+
+    CU_ASSERT(!coap_psk_store_add(store, &id, &id));
+  }
+  coap_psk_store_free(store);
+}
+
+/* Identities and keys that are too long for a record */
+static void
+t_psk_store2(void) {
+  coap_psk_store_t *store;
+  coap_bin_const_t id;
+  coap_bin_const_t key = { 3, (const uint8_t *)"key" };
+  coap_bin_const_t found;
+  uint8_t *big;
+
+  big = malloc(UINT16_MAX + 1);
+  CU_ASSERT_FATAL(big != NULL);
+  memset(big, 'i', UINT16_MAX + 1);
+  store = coap_psk_store_new();
+  CU_ASSERT_FATAL(store != NULL);
+
+  id.s = big;
+  id.length = UINT16_MAX + 1;
+  CU_ASSERT(!coap_psk_store_add(store, &id, &key));
+  CU_ASSERT(!coap_psk_store_add(store, &key, &id));
+  CU_ASSERT(coap_psk_store_count(store) == 0);
+
+  id.length = UINT16_MAX;
+  CU_ASSERT(coap_psk_store_add(store, &id, &key));
+  CU_ASSERT(coap_psk_store_add(store, &key, &id));
+  CU_ASSERT(coap_psk_store_count(store) == 2);
+  CU_ASSERT(coap_psk_store_find(store, key.s, key.length, &found));
+  CU_ASSERT(found.length == UINT16_MAX);
+  CU_ASSERT(coap_psk_store_find(store, big, UINT16_MAX, &found));
+  CU_ASSERT(found.length == key.length);
+
+  /* No data for a length */
+  id.s = NULL;
+  id.length = 1;
+  CU_ASSERT(!coap_psk_store_add(store, &id, &key));
+  CU_ASSERT(coap_psk_store_count(store) == 2);
+
+  coap_psk_store_free(store);
+  free(big);
+}
+
+/* Truncated files */
+static void
+t_psk_store3(void) {
+  size_t lengths[] = { 0, 1, PSK_STORE_HEADER_SIZE - 1,
+                       PSK_STORE_HEADER_SIZE, PSK_STORE_HEADER_SIZE + 1,
+                       0, 0, 0 };
+  coap_psk_store_t *store;
+  size_t i;
+
+  lengths[5] = store_data_offset - 1;
+  lengths[6] = store_data_offset;
+  lengths[7] = store_file_len - 1;
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    store = load_store_file(store_file, lengths[i]);
+    CU_ASSERT(store == NULL);
+    coap_psk_store_free(store);
+  }
+
+  store = load_store_file(store_file, store_file_len);
+  CU_ASSERT(store != NULL);
+  CU_ASSERT(has_key(store, "id", "key"));
+  coap_psk_store_free(store);
+}
+
+/* Headers that do not describe the file */
+static void
+t_psk_store4(void) {
+  coap_psk_store_t *store;
+  uint8_t *data;
+  uint32_t value;
+
+  data = malloc(store_file_len + 1);
+  CU_ASSERT_FATAL(data != NULL);
+
+  /* Not the magic */
+  memcpy(data, store_file, store_file_len);
+  data[0] ^= 0xff;
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+
+  /* Other byte order */
+  memcpy(data, store_file, store_file_len);
+  value = 0x04030201;
+  memcpy(&data[PSK_STORE_ORDER_OFFSET], &value, sizeof(value));
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+
+  /* As many identities as slots */
+  memcpy(data, store_file, store_file_len);
+  memcpy(&value, &data[PSK_STORE_SLOTS_OFFSET], sizeof(value));
+  memcpy(&data[PSK_STORE_COUNT_OFFSET], &value, sizeof(value));
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+
+  /* Slots that are not a power of two, or none */
+  memcpy(data, store_file, store_file_len);
+  value -= 1;
+  memcpy(&data[PSK_STORE_SLOTS_OFFSET], &value, sizeof(value));
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+  value = 0;
+  memcpy(&data[PSK_STORE_SLOTS_OFFSET], &value, sizeof(value));
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+
+  /* More slots than in the file */
+  value = 1U << 30;
+  memcpy(&data[PSK_STORE_SLOTS_OFFSET], &value, sizeof(value));
+  CU_ASSERT(load_store_file(data, store_file_len) == NULL);
+
+  /* Trailing data */
+  memcpy(data, store_file, store_file_len);
+  data[store_file_len] = 0;
+  CU_ASSERT(load_store_file(data, store_file_len + 1) == NULL);
+
+  /* Not there */
+  remove(PSK_STORE_FILE);
+  CU_ASSERT(coap_psk_store_load(PSK_STORE_FILE) == NULL);
+
+  store = load_store_file(store_file, store_file_len);
+  CU_ASSERT(store != NULL);
+  coap_psk_store_free(store);
+  free(data);
+}
+
+/* Records whose lengths run past the end of the file */
+static void
+t_psk_store5(void) {
+  coap_psk_store_t *store;
+  uint8_t *data;
+  uint16_t len;
+
+  data = malloc(store_file_len);
+  CU_ASSERT_FATAL(data != NULL);
+
+  /* Identity length */
+  memcpy(data, store_file, store_file_len);
+  len = 1000;
+  memcpy(&data[store_data_offset], &len, sizeof(len));
+  store = load_store_file(data, store_file_len);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(!has_key(store, "id", "key"));
+  coap_psk_store_free(store);
+
+  /* Key length */
+  memcpy(data, store_file, store_file_len);
+  memcpy(&data[store_data_offset + 2], &len, sizeof(len));
+  store = load_store_file(data, store_file_len);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(!has_key(store, "id", "key"));
+  coap_psk_store_free(store);
+
+  /* Key that ends at the end of the file */
+  memcpy(data, store_file, store_file_len);
+  len = 3;
+  memcpy(&data[store_data_offset + 2], &len, sizeof(len));
+  store = load_store_file(data, store_file_len);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(has_key(store, "id", "key"));
+  coap_psk_store_free(store);
+
+  free(data);
+}
+
+static int
+t_psk_store_tests_create(void) {
+  coap_psk_store_t *store;
+  FILE *fp;
+  long size;
+  uint32_t slots;
+  int ok;
+
+  store = coap_psk_store_new();
+  if (!store)
+    return 1;
+  add_key(store, "id", "key");
+  ok = coap_psk_store_save(store, PSK_STORE_FILE);
+  coap_psk_store_free(store);
+  if (!ok)
+    return 1;
+
+  fp = fopen(PSK_STORE_FILE, "rb");
+  if (!fp)
+    return 1;
+  ok = fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 &&
+       fseek(fp, 0, SEEK_SET) == 0;
+  if (ok) {
+    store_file_len = (size_t)size;
+    store_file = malloc(store_file_len);
+    ok = store_file && fread(store_file, store_file_len, 1, fp) == 1;
+  }
+  fclose(fp);
+  if (!ok || store_file_len < PSK_STORE_HEADER_SIZE)
+    return 1;
+  memcpy(&slots, &store_file[PSK_STORE_SLOTS_OFFSET], sizeof(slots));
+  store_data_offset = PSK_STORE_HEADER_SIZE + slots * PSK_STORE_SLOT_SIZE;
+  /* The single record of "id" and "key" */
+  return store_data_offset + 4 + 2 + 3 != store_file_len;
+}
+
+static int
+t_psk_store_tests_remove(void) {
+  free(store_file);
+  store_file = NULL;
+  remove(PSK_STORE_FILE);
+  return 0;
+}
+
+CU_pSuite
+t_init_psk_store_tests(void) {
+  CU_pSuite suite;
+
+  suite = CU_add_suite("psk store", t_psk_store_tests_create,
+                       t_psk_store_tests_remove);
+  if (!suite) {                        /* signal error */
+    fprintf(stderr, "W: cannot add psk store test suite (%s)\n",
+            CU_get_error_msg());
+
+    return NULL;
+  }
+
+#define PSK_STORE_TEST(s,t)                                           \
+  if (!CU_ADD_TEST(s,t)) {                                            \
+    fprintf(stderr, "W: cannot add psk store test (%s)\n",            \
+            CU_get_error_msg());                                      \
+  }
+
+  PSK_STORE_TEST(suite, t_psk_store1);
+  PSK_STORE_TEST(suite, t_psk_store2);
+  PSK_STORE_TEST(suite, t_psk_store3);
+  PSK_STORE_TEST(suite, t_psk_store4);
+  PSK_STORE_TEST(suite, t_psk_store5);
+
+  return suite;
+}
@@ -27,17 +27,6 @@ static coap_tick_t timestamp[] = {
 /* nodes for testing. node[0] is left empty */
 coap_queue_t *node[5];
 
-static coap_tick_t
-add_timestamps(coap_queue_t *queue, size_t num) {
-  coap_tick_t t = 0;
-  while (queue && num--) {
-    t += queue->t;
-    queue = queue->next;
-  }
-
-  return t;
-}
-
 static void
 t_sendqueue1(void) {
   int result = coap_insert_node(&ctx->sendqueue, node[1]);
@@ -46,6 +35,7 @@ t_sendqueue1(void) {
   CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue);
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[1]);
   CU_ASSERT(node[1]->t == timestamp[1]);
+  CU_ASSERT_PTR_EQUAL(session->sendqueue, node[1]);
 }
 
 static void
@@ -56,10 +46,10 @@ t_sendqueue2(void) {
 
   CU_ASSERT(result > 0);
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[1]);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next, node[2]);
 
-  CU_ASSERT(ctx->sendqueue->t == timestamp[1]);
-  CU_ASSERT(node[2]->t == timestamp[2] - timestamp[1]);
+  /* time stamps are all relative to the basetime */
+  CU_ASSERT(node[1]->t == timestamp[1]);
+  CU_ASSERT(node[2]->t == timestamp[2]);
 }
 
 /* insert new node as first element in queue */
@@ -72,15 +62,10 @@ t_sendqueue3(void) {
 
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[3]);
   CU_ASSERT(node[3]->t == timestamp[3]);
-
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next);
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next->next);
-
-  CU_ASSERT(ctx->sendqueue->next->t == timestamp[1] - timestamp[3]);
-  CU_ASSERT(ctx->sendqueue->next->next->t == timestamp[2] - timestamp[1]);
+  CU_ASSERT(node[1]->t == timestamp[1]);
+  CU_ASSERT(node[2]->t == timestamp[2]);
 }
 
-/* insert new node as fourth element in queue */
 static void
 t_sendqueue4(void) {
   int result;
@@ -90,21 +75,14 @@ t_sendqueue4(void) {
   CU_ASSERT(result > 0);
 
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[3]);
-
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next, node[1]);
-
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next->next);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next->next, node[4]);
-
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next->next->next);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next->next->next, node[2]);
-
-  CU_ASSERT(ctx->sendqueue->next->t == timestamp[1] - timestamp[3]);
-  CU_ASSERT(add_timestamps(ctx->sendqueue, 1) == timestamp[3]);
-  CU_ASSERT(add_timestamps(ctx->sendqueue, 2) == timestamp[1]);
-  CU_ASSERT(add_timestamps(ctx->sendqueue, 3) == timestamp[4]);
-  CU_ASSERT(add_timestamps(ctx->sendqueue, 4) == timestamp[2]);
+  CU_ASSERT(node[4]->t == timestamp[4]);
+
+  /* the session keeps its entries in insertion order */
+  CU_ASSERT_PTR_EQUAL(session->sendqueue, node[1]);
+  CU_ASSERT_PTR_EQUAL(node[1]->session_next, node[2]);
+  CU_ASSERT_PTR_EQUAL(node[2]->session_next, node[3]);
+  CU_ASSERT_PTR_EQUAL(node[3]->session_next, node[4]);
+  CU_ASSERT_PTR_NULL(node[4]->session_next);
 }
 
 static void
@@ -115,13 +93,12 @@ t_sendqueue5(void) {
 
   /* space for saving the current node timestamps */
   static coap_tick_t times[sizeof(timestamp)/sizeof(coap_tick_t)];
-  coap_queue_t *p;
-  int i;
+  size_t n;
 
-  /* save timestamps of nodes in the sendqueue in their actual order */
+  /* save timestamps of nodes in the sendqueue */
   memset(times, 0, sizeof(times));
-  for (p = ctx->sendqueue, i = 0; p; p = p->next, i++) {
-    times[i] = p->t;
+  for (n = 1; n < sizeof(node)/sizeof(coap_queue_t *); n++) {
+    times[n] = node[n]->t;
   }
 
   coap_ticks(&now);
@@ -134,6 +111,9 @@ t_sendqueue5(void) {
   CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue);
   CU_ASSERT(ctx->sendqueue_basetime == now);
   CU_ASSERT(ctx->sendqueue->t == timestamp[3] + delta1);
+  for (n = 1; n < sizeof(node)/sizeof(coap_queue_t *); n++) {
+    CU_ASSERT(node[n]->t == timestamp[n] + delta1);
+  }
 
   now += delta2;
   result = coap_adjust_basetime(ctx, now);
@@ -142,15 +122,14 @@ t_sendqueue5(void) {
   CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue);
   CU_ASSERT(ctx->sendqueue->t == 0);
 
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next);
-  CU_ASSERT(ctx->sendqueue->next->t == 0);
-
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next->next);
-  CU_ASSERT(ctx->sendqueue->next->next->t == delta2 - delta1 - timestamp[1]);
+  CU_ASSERT(node[3]->t == 0);
+  CU_ASSERT(node[1]->t == 0);
+  CU_ASSERT(node[4]->t == timestamp[4] + delta1 - delta2);
+  CU_ASSERT(node[2]->t == timestamp[2] + delta1 - delta2);
 
   /* restore timestamps of nodes in the sendqueue */
-  for (p = ctx->sendqueue, i = 0; p; p = p->next, i++) {
-    p->t = times[i];
+  for (n = 1; n < sizeof(node)/sizeof(coap_queue_t *); n++) {
+    node[n]->t = times[n];
   }
 }
 
@@ -161,17 +140,6 @@ t_sendqueue6(void) {
   const coap_tick_diff_t delta = 20;
   coap_queue_t *tmpqueue = ctx->sendqueue;
 
-  /* space for saving the current node timestamps */
-  static coap_tick_t times[sizeof(timestamp)/sizeof(coap_tick_t)];
-  coap_queue_t *p;
-  int i;
-
-  /* save timestamps of nodes in the sendqueue in their actual order */
-  memset(times, 0, sizeof(times));
-  for (p = ctx->sendqueue, i = 0; p; p = p->next, i++) {
-    times[i] = p->t;
-  }
-
   coap_ticks(&now);
   ctx->sendqueue = NULL;
   ctx->sendqueue_basetime = now;
@@ -193,9 +161,6 @@ t_sendqueue7(void) {
   CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue);
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[3]);
 
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next, node[1]);
-
   result = coap_remove_from_queue(&ctx->sendqueue, session, 3, &tmp_node);
 
   CU_ASSERT(result == 1);
@@ -206,6 +171,7 @@ t_sendqueue7(void) {
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[1]);
 
   CU_ASSERT(ctx->sendqueue->t == timestamp[1]);
+  CU_ASSERT_PTR_EQUAL(node[2]->session_next, node[4]);
 }
 
 static void
@@ -223,11 +189,13 @@ t_sendqueue8(void) {
   CU_ASSERT_PTR_EQUAL(ctx->sendqueue, node[1]);
   CU_ASSERT(ctx->sendqueue->t == timestamp[1]);
 
-  CU_ASSERT_PTR_NOT_NULL(ctx->sendqueue->next);
-  CU_ASSERT_PTR_EQUAL(ctx->sendqueue->next, node[2]);
-  CU_ASSERT(ctx->sendqueue->next->t == timestamp[2] - timestamp[1]);
+  CU_ASSERT_PTR_EQUAL(session->sendqueue, node[1]);
+  CU_ASSERT_PTR_EQUAL(node[1]->session_next, node[2]);
+  CU_ASSERT_PTR_NULL(node[2]->session_next);
 
-  CU_ASSERT_PTR_NULL(ctx->sendqueue->next->next);
+  /* unknown ids are not found */
+  result = coap_remove_from_queue(&ctx->sendqueue, session, 4, &tmp_node);
+  CU_ASSERT(result == 0);
 }
 
 static void
@@ -250,7 +218,7 @@ t_sendqueue9(void) {
   CU_ASSERT(tmp_node->t == timestamp[1]);
   CU_ASSERT(ctx->sendqueue->t == timestamp[2]);
 
-  CU_ASSERT_PTR_NULL(ctx->sendqueue->next);
+  CU_ASSERT_PTR_EQUAL(session->sendqueue, node[2]);
 }
 
 static void
@@ -263,10 +231,46 @@ t_sendqueue10(void) {
   CU_ASSERT_PTR_EQUAL(tmp_node, node[2]);
 
   CU_ASSERT_PTR_NULL(ctx->sendqueue);
+  CU_ASSERT_PTR_NULL(session->sendqueue);
 
   CU_ASSERT(tmp_node->t == timestamp[2]);
 }
 
+/* insert many nodes, remove some from the middle and check that the
+ * remaining ones are popped in order */
+static void
+t_sendqueue11(void) {
+  coap_queue_t *tmp_node;
+  coap_tick_t last = 0;
+  int n, count = 0;
+
+  for (n = 0; n < 64; n++) {
+    tmp_node = coap_new_node();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(tmp_node);
+    tmp_node->id = 100 + n;
+    tmp_node->t = (n * 7919) % 101;
+    tmp_node->session = coap_session_reference(session);
+    coap_insert_node(&ctx->sendqueue, tmp_node);
+  }
+
+  for (n = 0; n < 64; n += 3) {
+    CU_ASSERT(coap_remove_from_queue(&ctx->sendqueue, session,
+                                     100 + n, &tmp_node) == 1);
+    coap_delete_node(tmp_node);
+  }
+
+  while ((tmp_node = coap_pop_next(ctx)) != NULL) {
+    CU_ASSERT(tmp_node->t >= last);
+    CU_ASSERT((tmp_node->id - 100) % 3 != 0);
+    last = tmp_node->t;
+    count++;
+    coap_delete_node(tmp_node);
+  }
+
+  CU_ASSERT(count == 64 - 22);
+  CU_ASSERT_PTR_NULL(session->sendqueue);
+}
+
 /* This function creates a set of nodes for testing. These nodes
  * will exist for all tests and are modified by coap_insert_node()
  * and coap_remove_from_queue().
@@ -359,6 +363,7 @@ t_init_sendqueue_tests(void) {
   SENDQUEUE_TEST(suite, t_sendqueue8);
   SENDQUEUE_TEST(suite, t_sendqueue9);
   SENDQUEUE_TEST(suite, t_sendqueue10);
+  SENDQUEUE_TEST(suite, t_sendqueue11);
 
   return suite;
 }
@@ -8,10 +8,13 @@
 
 #include "coap_config.h"
 #include "test_session.h"
+#include "coap2/coap_internal.h"
 
 #include <coap2/coap.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* The error threshold for timeout calculations. The precision of
  * coap_calc_timeout() is assumed to be sufficient if the resulting
@@ -164,6 +167,176 @@ t_session6(void) {
   coap_session_release(session);
 }
 
+/* The number of sessions for the session index tests */
+#define INDEX_SESSIONS 100
+
+/* Gives @p s the address hash of a peer at 127.0.0.1:@p port */
+static void
+index_key(coap_session_t *s, uint16_t port) {
+  memset(&s->addr_hash, 0, sizeof(s->addr_hash));
+  s->addr_hash.remote.size = sizeof(struct sockaddr_in);
+  s->addr_hash.remote.addr.sin.sin_family = AF_INET;
+  s->addr_hash.remote.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  s->addr_hash.remote.addr.sin.sin_port = htons(port);
+  s->addr_hash.lport = COAP_DEFAULT_PORT;
+}
+
+/* The slot that @p s is looked for first in an index of @p mask */
+static unsigned int
+index_home(const coap_session_t *s, unsigned int mask) {
+  return coap_uthash_hash(&s->addr_hash, sizeof(s->addr_hash)) & mask;
+}
+
+/*
+ * Gives the @p count sessions of @p s keys that have their home slot at
+ * @p home in an index of @p mask, starting the search at @p port.
+ */
+static uint16_t
+index_keys_at(coap_session_t *s, int count, unsigned int home,
+              unsigned int mask, uint16_t port) {
+  int n;
+
+  for (n = 0; n < count; port++) {
+    index_key(&s[n], port);
+    if (index_home(&s[n], mask) == home)
+      n++;
+  }
+  return port;
+}
+
+/* Checks that the slots and the dense array of @p index agree */
+static void
+index_check(const coap_session_index_t *index) {
+  unsigned int used = 0;
+  unsigned int i;
+
+  for (i = 0; index->mask && i <= index->mask; i++) {
+    if (index->ctrl[i]) {
+      used++;
+      CU_ASSERT(index->pos[i] < index->count);
+    }
+  }
+  CU_ASSERT(used == index->count);
+  for (i = 0; i < index->count; i++) {
+    CU_ASSERT(coap_session_index_find(index, &index->sessions[i]->addr_hash) ==
+              index->sessions[i]);
+  }
+}
+
+/* A probe sequence that runs off the end of the slots wraps around */
+static void
+t_session_index1(void) {
+  coap_session_index_t index;
+  coap_session_t *s = calloc(3, sizeof(coap_session_t));
+  const unsigned int mask = 7;
+  int n;
+
+  CU_ASSERT_FATAL(s != NULL);
+  memset(&index, 0, sizeof(index));
+  index_keys_at(s, 3, mask, mask, 1);
+  for (n = 0; n < 3; n++)
+    CU_ASSERT(coap_session_index_add(&index, &s[n]));
+  CU_ASSERT_FATAL(index.mask == mask);
+  CU_ASSERT(index.ctrl[7] && index.ctrl[0] && index.ctrl[1]);
+  index_check(&index);
+
+  /* The wrapped sessions move back over the end */
+  coap_session_index_remove(&index, &s[0]);
+  CU_ASSERT(index.ctrl[7] && index.ctrl[0] && !index.ctrl[1]);
+  CU_ASSERT(coap_session_index_find(&index, &s[0].addr_hash) == NULL);
+  index_check(&index);
+  coap_session_index_remove(&index, &s[1]);
+  coap_session_index_remove(&index, &s[2]);
+  CU_ASSERT(index.count == 0);
+  CU_ASSERT(!index.ctrl[7] && !index.ctrl[0] && !index.ctrl[1]);
+
+  coap_session_index_free(&index);
+  free(s);
+}
+
+/* Removing from the middle of a run keeps the displaced sessions findable */
+static void
+t_session_index2(void) {
+  coap_session_index_t index;
+  coap_session_t *s = calloc(5, sizeof(coap_session_t));
+  const unsigned int mask = 7;
+  uint16_t port;
+  int n;
+
+  CU_ASSERT_FATAL(s != NULL);
+  memset(&index, 0, sizeof(index));
+  /* Three at slot 2, then one each at slots 3 and 4 that are pushed on */
+  port = index_keys_at(s, 3, 2, mask, 1);
+  port = index_keys_at(&s[3], 1, 3, mask, port);
+  index_keys_at(&s[4], 1, 4, mask, port);
+  for (n = 0; n < 5; n++)
+    CU_ASSERT(coap_session_index_add(&index, &s[n]));
+  CU_ASSERT_FATAL(index.mask == mask);
+  for (n = 2; n < 7; n++)
+    CU_ASSERT(index.ctrl[n] != 0);
+  index_check(&index);
+
+  /* s[1] sits in slot 3, the middle of the run */
+  coap_session_index_remove(&index, &s[1]);
+  CU_ASSERT(coap_session_index_find(&index, &s[1].addr_hash) == NULL);
+  CU_ASSERT(index.count == 4);
+  CU_ASSERT(!index.ctrl[6]);
+  index_check(&index);
+  /* and the session at the start of the dense array */
+  coap_session_index_remove(&index, &s[0]);
+  CU_ASSERT(coap_session_index_find(&index, &s[0].addr_hash) == NULL);
+  index_check(&index);
+  for (n = 2; n < 5; n++)
+    CU_ASSERT(coap_session_index_find(&index, &s[n].addr_hash) == &s[n]);
+
+  coap_session_index_free(&index);
+  free(s);
+}
+
+/* Sessions are found, and removed ones are not, as the index grows */
+static void
+t_session_index3(void) {
+  coap_session_index_t index;
+  coap_session_t *s = calloc(INDEX_SESSIONS, sizeof(coap_session_t));
+  coap_session_t *el;
+  unsigned int pos;
+  int seen = 0;
+  int n;
+
+  CU_ASSERT_FATAL(s != NULL);
+  memset(&index, 0, sizeof(index));
+  for (n = 0; n < INDEX_SESSIONS; n++) {
+    index_key(&s[n], (uint16_t)(1000 + n));
+    CU_ASSERT(coap_session_index_add(&index, &s[n]));
+  }
+  CU_ASSERT(index.count == INDEX_SESSIONS);
+  CU_ASSERT(index.count <= (index.mask + 1) / 4 * 3);
+  index_check(&index);
+
+  for (n = 0; n < INDEX_SESSIONS; n += 2)
+    coap_session_index_remove(&index, &s[n]);
+  /* Removing one that is not there changes nothing */
+  coap_session_index_remove(&index, &s[0]);
+  CU_ASSERT(index.count == INDEX_SESSIONS / 2);
+  for (n = 0; n < INDEX_SESSIONS; n++) {
+    CU_ASSERT(coap_session_index_find(&index, &s[n].addr_hash) ==
+              (n % 2 ? &s[n] : NULL));
+  }
+  index_check(&index);
+
+  /* The iteration may remove the current session */
+  SESSIONS_INDEX_ITER(&index, el, pos) {
+    seen++;
+    coap_session_index_remove(&index, el);
+  }
+  CU_ASSERT(seen == INDEX_SESSIONS / 2);
+  CU_ASSERT(index.count == 0);
+  CU_ASSERT(coap_session_index_find(&index, &s[1].addr_hash) == NULL);
+
+  coap_session_index_free(&index);
+  free(s);
+}
+
 /* This function creates a set of nodes for testing. These nodes
  * will exist for all tests and are modified by coap_insert_node()
  * and coap_remove_from_queue().
@@ -219,6 +392,9 @@ t_init_session_tests(void) {
   SESSION_TEST(suite, t_session4);
   SESSION_TEST(suite, t_session5);
   SESSION_TEST(suite, t_session6);
+  SESSION_TEST(suite, t_session_index1);
+  SESSION_TEST(suite, t_session_index2);
+  SESSION_TEST(suite, t_session_index3);
 
   return suite;
 }
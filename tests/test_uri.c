@@ -12,6 +12,8 @@
 #include <coap2/coap.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void
 t_parse_uri1(void) {
@@ -574,6 +576,129 @@ t_parse_uri24(void) {
   CU_ASSERT(buflen == 16);
 }
 
+/*
+ * Splits the path @p path with coap_split_path() from a buffer of exactly
+ * its length, so that reading past its end is caught by the sanitizers.
+ */
+static int
+split_path(const char *path, unsigned char *buf, size_t *buflen) {
+  size_t length = strlen(path);
+  uint8_t *s = (uint8_t *)malloc(length);
+  int result;
+
+  if (!s)
+    return -1;
+  memcpy(s, path, length);
+  result = coap_split_path(s, length, buf, buflen);
+  free(s);
+  return result;
+}
+
+/* A '%' without two characters behind it at the end of the path */
+static void
+t_parse_uri25(void) {
+  const char *teststr[] = { "a/b%", "a/b%4", "a/%", "a/%4" };
+  unsigned char buf[40];
+  size_t buflen;
+  size_t i;
+
+  for (i = 0; i < sizeof(teststr) / sizeof(teststr[0]); i++) {
+    buflen = sizeof(buf);
+    /* Only the segment "a" is taken */
+    CU_ASSERT(split_path(teststr[i], buf, &buflen) == 1);
+    CU_ASSERT(buflen == 2);
+    CU_ASSERT(buf[0] == 0x01 && buf[1] == 'a');
+  }
+}
+
+/* A '%' that is not followed by two hex digits */
+static void
+t_parse_uri26(void) {
+  const char *teststr[] = { "a/%zz/c", "a/%4g/c", "a/%g4/c", "a/x%-1/c" };
+  char query[] = "a=%2x&b=1";
+  unsigned char buf[40];
+  size_t buflen;
+  size_t i;
+
+  for (i = 0; i < sizeof(teststr) / sizeof(teststr[0]); i++) {
+    buflen = sizeof(buf);
+    CU_ASSERT(split_path(teststr[i], buf, &buflen) == 2);
+    CU_ASSERT(buflen == 4);
+    CU_ASSERT_NSTRING_EQUAL(buf, "\x01" "a" "\x01" "c", 4);
+  }
+
+  buflen = sizeof(buf);
+  CU_ASSERT(coap_split_query((unsigned char *)query, strlen(query),
+                             buf, &buflen) == 1);
+  CU_ASSERT(buflen == 4);
+  CU_ASSERT_NSTRING_EQUAL(buf, "\x03" "b=1", 4);
+}
+
+/*
+ * Segments of lengths around the 16 byte blocks that the delimiters are
+ * looked for in, plain and with a percent-encoding that ends at the end of
+ * the segment.
+ */
+static void
+t_parse_uri27(void) {
+  static const size_t lengths[] = { 15, 16, 17, 31, 32, 33 };
+  char path[40];
+  unsigned char buf[80];
+  size_t buflen;
+  size_t i;
+  int encoded;
+
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    for (encoded = 0; encoded < 2; encoded++) {
+      size_t len = lengths[i];
+      size_t decoded = encoded ? len - 2 : len;
+      coap_opt_t *opt = buf;
+
+      memset(path, 'x', len);
+      if (encoded)
+        memcpy(path + len - 3, "%41", 3);
+      memcpy(path + len, "/y", 3);
+
+      buflen = sizeof(buf);
+      CU_ASSERT(split_path(path, buf, &buflen) == 2);
+      CU_ASSERT(coap_opt_length(opt) == decoded);
+      CU_ASSERT(memcmp(coap_opt_value(opt), path, decoded - encoded) == 0);
+      if (encoded)
+        CU_ASSERT(coap_opt_value(opt)[decoded - 1] == 'A');
+      opt += coap_opt_size(opt);
+      CU_ASSERT(coap_opt_length(opt) == 1 && *coap_opt_value(opt) == 'y');
+      CU_ASSERT(buflen == coap_opt_size(buf) + 2);
+
+      /* A trailing '%' is not read past */
+      path[len - 1] = '%';
+      path[len] = '\0';
+      buflen = sizeof(buf);
+      CU_ASSERT(split_path(path, buf, &buflen) == 0);
+    }
+  }
+}
+
+/* Host names of lengths around the 16 byte blocks */
+static void
+t_parse_uri28(void) {
+  static const size_t lengths[] = { 15, 16, 17, 31, 32, 33 };
+  char teststr[60];
+  coap_uri_t uri;
+  size_t i;
+
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    size_t len = lengths[i];
+
+    memcpy(teststr, "coap://", 7);
+    memset(teststr + 7, 'h', len);
+    memcpy(teststr + 7 + len, "/p?q", 5);
+    CU_ASSERT_FATAL(coap_split_uri((unsigned char *)teststr, strlen(teststr),
+                                   &uri) == 0);
+    CU_ASSERT(uri.host.length == len);
+    CU_ASSERT(uri.path.length == 1 && uri.path.s[0] == 'p');
+    CU_ASSERT(uri.query.length == 1 && uri.query.s[0] == 'q');
+  }
+}
 
 CU_pSuite
 t_init_uri_tests(void) {
@@ -617,6 +742,10 @@ t_init_uri_tests(void) {
   URI_TEST(suite, t_parse_uri22);
   URI_TEST(suite, t_parse_uri23);
   URI_TEST(suite, t_parse_uri24);
+  URI_TEST(suite, t_parse_uri25);
+  URI_TEST(suite, t_parse_uri26);
+  URI_TEST(suite, t_parse_uri27);
+  URI_TEST(suite, t_parse_uri28);
 
   return suite;
 }
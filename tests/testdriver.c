@@ -12,6 +12,10 @@
 #include "test_sendqueue.h"
 #include "test_wellknown.h"
 #include "test_tls.h"
+#include "test_oscore.h"
+#include "test_prng.h"
+#include "test_block.h"
+#include "test_psk_store.h"
 #include "coap2/libcoap.h"
 
 int
@@ -34,6 +38,10 @@ main(int argc COAP_UNUSED, char **argv COAP_UNUSED) {
   t_init_sendqueue_tests();
   t_init_wellknown_tests();
   t_init_tls_tests();
+  t_init_oscore_tests();
+  t_init_prng_tests();
+  t_init_block_tests();
+  t_init_psk_store_tests();
 
   CU_basic_set_mode(run_mode);
   result = CU_basic_run_tests();